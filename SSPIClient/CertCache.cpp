@@ -0,0 +1,264 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// CertCache.cpp: chain and policy verdicts per certificate thumbprint, so repeated validations
+// of the same server certificate are reported and dumped once.
+//
+
+#include "stdafx.h"
+#include "CertCache.h"
+#include "DetourFunctions.h"
+#include "TestOptions.h"
+
+#define CERT_CACHE_STORES	3
+
+static CERT_CACHE_ENTRY g_rgCertCache[CERT_CACHE_MAX_ENTRIES];
+static DWORD g_cCertCache = 0;
+static DWORD g_dwCertCacheDropped = 0;		// Certificates seen after the table filled up
+static DWORD g_dwStoreGeneration = 0;
+static ULONGLONG g_ui64WindowSeconds = CERT_CACHE_DEFAULT_WINDOW;
+static CRITICAL_SECTION g_csCertCache;
+static BOOL g_fCertCacheInit = FALSE;
+
+static const char* g_rgpszStores[CERT_CACHE_STORES] = { "ROOT", "CA", "MY" };
+static HCERTSTORE g_rghStores[CERT_CACHE_STORES];
+static HANDLE g_rghStoreEvents[CERT_CACHE_STORES];
+
+// Asks crypt32 to signal an event when one of the stores the chain engine reads changes.
+// Stores that cannot be watched are left out, their changes go unnoticed until the window ends.
+static void WatchStores()
+{
+	int i;
+
+	for ( i=0; i<CERT_CACHE_STORES; i++ )
+	{
+		g_rghStores[i] = CertOpenSystemStoreA( NULL, g_rgpszStores[i] );
+		if ( NULL == g_rghStores[i] ) continue;
+
+		g_rghStoreEvents[i] = CreateEvent( NULL, FALSE, FALSE, NULL );
+		if ( NULL == g_rghStoreEvents[i] ||
+			 !CertControlStore( g_rghStores[i], 0, CERT_STORE_CTRL_NOTIFY_CHANGE, &g_rghStoreEvents[i] ) )
+		{
+			o_printf( "Cannot watch the %s certificate store for changes. Error = %lu", g_rgpszStores[i], GetLastError() );
+			if ( NULL != g_rghStoreEvents[i] ) CloseHandle( g_rghStoreEvents[i] );
+			g_rghStoreEvents[i] = NULL;
+		}
+	}
+}
+
+// Moves to a new store generation, which invalidates every cached verdict, if a store changed.
+static void CheckStores()
+{
+	int i;
+
+	for ( i=0; i<CERT_CACHE_STORES; i++ )
+	{
+		if ( NULL == g_rghStoreEvents[i] ) continue;
+		if ( WAIT_OBJECT_0 != WaitForSingleObject( g_rghStoreEvents[i], 0 ) ) continue;
+
+		g_dwStoreGeneration++;
+		o_printf( "The %s certificate store changed, cached certificate verdicts are discarded.", g_rgpszStores[i] );
+		CertControlStore( g_rghStores[i], 0, CERT_STORE_CTRL_RESYNC, &g_rghStoreEvents[i] );
+	}
+}
+
+void CertCacheReset()
+{
+	if ( !g_fCertCacheInit )
+	{
+		InitializeCriticalSection( &g_csCertCache );
+		WatchStores();
+		g_fCertCacheInit = TRUE;
+	}
+
+	EnterCriticalSection( &g_csCertCache );
+	ZeroMemory( g_rgCertCache, sizeof(g_rgCertCache) );
+	g_cCertCache = 0;
+	g_dwCertCacheDropped = 0;
+	g_ui64WindowSeconds = (ULONGLONG) GetTestOptionLong( "certcachewindow", CERT_CACHE_DEFAULT_WINDOW );
+	LeaveCriticalSection( &g_csCertCache );
+}
+
+static ULONGLONG FileTimeToUInt64( const FILETIME* pft )
+{
+	return ( (ULONGLONG) pft->dwHighDateTime << 32 ) | pft->dwLowDateTime;
+}
+
+// Finds or adds the entry for pCert and drops its verdict if the window moved on, a store
+// changed or the certificate expired since it was cached.  Called with the lock held.
+static CERT_CACHE_ENTRY* LookupEntry( PCCERT_CONTEXT pCert, LPFILETIME pTime )
+{
+	BYTE rgbThumbprint[CERT_THUMBPRINT_SIZE];
+	DWORD cbThumbprint = sizeof(rgbThumbprint);
+	CERT_CACHE_ENTRY* pEntry = NULL;
+	FILETIME ftNow;
+	ULONGLONG ui64Time, ui64Window;
+	DWORD i;
+
+	if ( NULL == pCert || NULL == pCert->pCertInfo ) return NULL;
+	if ( !CertGetCertificateContextProperty( pCert, CERT_SHA1_HASH_PROP_ID, rgbThumbprint, &cbThumbprint ) ) return NULL;
+
+	CheckStores();
+
+	GetSystemTimeAsFileTime( &ftNow );
+	ui64Time = FileTimeToUInt64( ( NULL != pTime ) ? pTime : &ftNow );
+	ui64Window = ( g_ui64WindowSeconds > 0 ) ? ui64Time / ( g_ui64WindowSeconds * 10000000 ) : ui64Time;
+
+	for ( i=0; i<g_cCertCache; i++ )
+	{
+		if ( 0 == memcmp( g_rgCertCache[i].rgbThumbprint, rgbThumbprint, CERT_THUMBPRINT_SIZE ) )
+		{
+			pEntry = &g_rgCertCache[i];
+			break;
+		}
+	}
+
+	if ( NULL == pEntry )
+	{
+		if ( g_cCertCache >= CERT_CACHE_MAX_ENTRIES )
+		{
+			g_dwCertCacheDropped++;
+			return NULL;
+		}
+		pEntry = &g_rgCertCache[g_cCertCache++];
+		memcpy( pEntry->rgbThumbprint, rgbThumbprint, CERT_THUMBPRINT_SIZE );
+		pEntry->ftNotAfter = pCert->pCertInfo->NotAfter;
+		if ( !CertGetNameStringA( pCert, CERT_NAME_SIMPLE_DISPLAY_TYPE, 0, NULL, pEntry->szSubject, sizeof(pEntry->szSubject) ) )
+		{
+			lstrcpyn( pEntry->szSubject, "<unknown>", sizeof(pEntry->szSubject) );
+		}
+		pEntry->ui64Window   = ui64Window;
+		pEntry->dwGeneration = g_dwStoreGeneration;
+		return pEntry;
+	}
+
+	if ( pEntry->ui64Window != ui64Window ||
+		 pEntry->dwGeneration != g_dwStoreGeneration ||
+		 ui64Time >= FileTimeToUInt64( &pEntry->ftNotAfter ) )
+	{
+		if ( pEntry->fChainVerdict || pEntry->fPolicyVerdict ) pEntry->cInvalidations++;
+		pEntry->ui64Window     = ui64Window;
+		pEntry->dwGeneration   = g_dwStoreGeneration;
+		pEntry->fChainVerdict  = FALSE;
+		pEntry->fPolicyVerdict = FALSE;
+		pEntry->fDumped        = FALSE;
+	}
+
+	return pEntry;
+}
+
+// Records a CertGetCertificateChain result.  *pfRepeat is set when the same certificate was
+// already built with the same result in this window.
+CERT_CACHE_ENTRY* CertCacheChainResult( PCCERT_CONTEXT pCert, LPFILETIME pTime, BOOL fResult, DWORD dwTrustErrorStatus, double dMs, BOOL* pfRepeat )
+{
+	CERT_CACHE_ENTRY* pEntry;
+
+	*pfRepeat = FALSE;
+	if ( !g_fCertCacheInit ) return NULL;
+
+	EnterCriticalSection( &g_csCertCache );
+	pEntry = LookupEntry( pCert, pTime );
+	if ( NULL != pEntry )
+	{
+		if ( pEntry->fChainVerdict && pEntry->fChainResult == fResult && pEntry->dwTrustErrorStatus == dwTrustErrorStatus )
+		{
+			*pfRepeat = TRUE;
+			pEntry->cRepeatBuilds++;
+		}
+		else if ( pEntry->fChainVerdict )
+		{
+			// Same certificate, different answer: whatever was dumped no longer applies.
+			pEntry->fDumped = FALSE;
+		}
+		pEntry->fChainVerdict      = TRUE;
+		pEntry->fChainResult       = fResult;
+		pEntry->dwTrustErrorStatus = dwTrustErrorStatus;
+		pEntry->cChainBuilds++;
+		pEntry->dChainMsTotal += dMs;
+		if ( dMs > pEntry->dChainMsMax ) pEntry->dChainMsMax = dMs;
+	}
+	LeaveCriticalSection( &g_csCertCache );
+
+	return pEntry;
+}
+
+// Records a policy result and returns TRUE if the caller should dump the chain: the first time
+// this certificate fails with this error in the window, or always with certcachewindow=0.
+BOOL CertCachePolicyResult( PCCERT_CONTEXT pCert, DWORD dwPolicyError )
+{
+	CERT_CACHE_ENTRY* pEntry;
+	BOOL fDump = TRUE;
+
+	if ( !g_fCertCacheInit || 0 == g_ui64WindowSeconds ) return TRUE;
+
+	EnterCriticalSection( &g_csCertCache );
+	pEntry = LookupEntry( pCert, NULL );
+	if ( NULL != pEntry )
+	{
+		if ( pEntry->fPolicyVerdict && pEntry->dwPolicyError == dwPolicyError && pEntry->fDumped )
+		{
+			fDump = FALSE;
+			pEntry->cDumpsSkipped++;
+		}
+		pEntry->fPolicyVerdict = TRUE;
+		pEntry->dwPolicyError  = dwPolicyError;
+		pEntry->cPolicyChecks++;
+		if ( fDump && 0 != dwPolicyError ) pEntry->fDumped = TRUE;
+	}
+	LeaveCriticalSection( &g_csCertCache );
+
+	return fDump;
+}
+
+// One line per unique certificate validated since CertCacheReset.
+void DumpCertCache()
+{
+	SYSTEMTIME st;
+	char szThumbprint[CERT_THUMBPRINT_SIZE * 2 + 1];
+	DWORD i, j;
+
+	if ( !g_fCertCacheInit || 0 == g_cCertCache ) return;
+
+	EnterCriticalSection( &g_csCertCache );
+
+	o_printf( "" );
+	o_printf( "Server certificates validated: %lu unique, verdicts cached for %I64u seconds.", g_cCertCache, g_ui64WindowSeconds );
+	for ( i=0; i<g_cCertCache; i++ )
+	{
+		const CERT_CACHE_ENTRY* pEntry = &g_rgCertCache[i];
+
+		for ( j=0; j<CERT_THUMBPRINT_SIZE; j++ )
+		{
+			sprintf_s( szThumbprint + j*2, sizeof(szThumbprint) - j*2, "%02x", pEntry->rgbThumbprint[j] );
+		}
+		ZeroMemory( &st, sizeof(st) );
+		FileTimeToSystemTime( &pEntry->ftNotAfter, &st );
+
+		o_printf( "  %2lu. [%s] thumbprint %s, expires %04u-%02u-%02u",
+				  i+1, pEntry->szSubject, szThumbprint, st.wYear, st.wMonth, st.wDay );
+		if ( pEntry->cChainBuilds > 0 )
+		{
+			o_printf( "      chain built %lu times (%lu with an unchanged result), %.3f ms average, %.3f ms max, %s, trust status 0x%08x",
+					  pEntry->cChainBuilds, pEntry->cRepeatBuilds,
+					  pEntry->dChainMsTotal / pEntry->cChainBuilds, pEntry->dChainMsMax,
+					  ( pEntry->fChainResult ) ? "built" : "failed", pEntry->dwTrustErrorStatus );
+		}
+		if ( pEntry->cPolicyChecks > 0 )
+		{
+			o_printf( "      SSL policy checked %lu times, dwError 0x%08x (%s), %lu chain dumps skipped",
+					  pEntry->cPolicyChecks, pEntry->dwPolicyError, GetCertChainPolicyStatusCode( pEntry->dwPolicyError ), pEntry->cDumpsSkipped );
+		}
+		if ( pEntry->cInvalidations > 0 )
+		{
+			o_printf( "      verdict discarded %lu times (new window, store change or expiry)", pEntry->cInvalidations );
+		}
+	}
+	if ( g_dwCertCacheDropped > 0 )
+	{
+		o_printf( "  %lu more validations were not cached, the table holds %d certificates.", g_dwCertCacheDropped, CERT_CACHE_MAX_ENTRIES );
+	}
+
+	LeaveCriticalSection( &g_csCertCache );
+}
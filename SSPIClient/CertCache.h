@@ -0,0 +1,37 @@
+#pragma once
+
+// Chain and policy verdicts per server certificate, keyed by SHA-1 thumbprint.  A verdict holds
+// for one validation time window (certcachewindow option) and is dropped early when the ROOT,
+// CA or MY store changes or the certificate expires.  Repeated logins then report each
+// certificate once and dump its chain once instead of on every failed policy check.
+
+#define CERT_CACHE_MAX_ENTRIES		64
+#define CERT_THUMBPRINT_SIZE		20
+#define CERT_CACHE_DEFAULT_WINDOW	300		// Seconds
+
+typedef struct _CERT_CACHE_ENTRY
+{
+	BYTE      rgbThumbprint[CERT_THUMBPRINT_SIZE];
+	char      szSubject[256];
+	FILETIME  ftNotAfter;
+	ULONGLONG ui64Window;			// Validation time window the verdict belongs to
+	DWORD     dwGeneration;			// Store generation the verdict belongs to
+	BOOL      fChainVerdict;
+	BOOL      fChainResult;			// CertGetCertificateChain return value
+	DWORD     dwTrustErrorStatus;
+	BOOL      fPolicyVerdict;
+	DWORD     dwPolicyError;
+	BOOL      fDumped;				// DisplayCertChain already ran for this verdict
+	DWORD     cChainBuilds;
+	DWORD     cRepeatBuilds;		// Builds that found the same verdict already cached
+	DWORD     cPolicyChecks;
+	DWORD     cDumpsSkipped;
+	DWORD     cInvalidations;
+	double    dChainMsTotal;
+	double    dChainMsMax;
+} CERT_CACHE_ENTRY;
+
+void CertCacheReset();
+CERT_CACHE_ENTRY* CertCacheChainResult( PCCERT_CONTEXT pCert, LPFILETIME pTime, BOOL fResult, DWORD dwTrustErrorStatus, double dMs, BOOL* pfRepeat );
+BOOL CertCachePolicyResult( PCCERT_CONTEXT pCert, DWORD dwPolicyError );
+void DumpCertCache();
@@ -0,0 +1,325 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// ClockSkew.cpp: clock skew against the KDC and SQL Server from tickets, tokens and the server
+// clock, sampled once per login or repeatedly to show how it drifts.
+//
+
+#include "stdafx.h"
+#include <math.h>
+#include "ClockSkew.h"
+#include "KerbTickets.h"
+#include "TestOptions.h"
+#include "DetourFunctions.h"
+
+// FILETIME of 1970-01-01, Kerberos and NTLM times are seconds since then.
+#define SKEW_UNIX_EPOCH_FILETIME	116444736000000000LL
+
+typedef struct _SKEW_SOURCE
+{
+	DWORD       cSamples;
+	DWORD       cDropped;
+	SKEW_SAMPLE rgSamples[SKEW_MAX_SAMPLES];
+} SKEW_SOURCE;
+
+static SKEW_SOURCE g_rgSkewSources[SKEW_SOURCE_COUNT];
+static uint64_t g_ui64SkewStart = 0;
+
+static const char* GetSkewSourceName( int iSource )
+{
+	switch ( iSource )
+	{
+		case SKEW_SOURCE_TICKET:	return "LSA TimeSkew (KDC)";
+		case SKEW_SOURCE_KDC:		return "ticket start (KDC)";
+		case SKEW_SOURCE_KRB_ERROR:	return "KRB-ERROR (server)";
+		case SKEW_SOURCE_NTLM:		return "NTLM CHALLENGE (server)";
+		case SKEW_SOURCE_SQL:		return "SQL Server clock";
+	}
+	return "unknown";
+}
+
+static __int64 GetNowFileTime()
+{
+	FILETIME ftNow;
+
+	GetSystemTimeAsFileTime( &ftNow );
+	return ( (__int64) ftNow.dwHighDateTime << 32 ) | ftNow.dwLowDateTime;
+}
+
+void ClockSkewReset()
+{
+	ZeroMemory( g_rgSkewSources, sizeof(g_rgSkewSources) );
+	g_ui64SkewStart = PerfCounter();
+}
+
+void ClockSkewAdd( int iSource, double dSkewMs, double dUncertaintyMs )
+{
+	SKEW_SOURCE* pSource = NULL;
+	SKEW_SAMPLE* pSample = NULL;
+
+	if ( iSource < 0 || iSource >= SKEW_SOURCE_COUNT ) return;
+	pSource = &g_rgSkewSources[iSource];
+	if ( pSource->cSamples >= SKEW_MAX_SAMPLES )
+	{
+		pSource->cDropped++;
+		return;
+	}
+	pSample = &pSource->rgSamples[pSource->cSamples++];
+	pSample->dSeconds       = PerfElapsedMs( g_ui64SkewStart ) / 1000.0;
+	pSample->dSkewMs        = dSkewMs;
+	pSample->dUncertaintyMs = dUncertaintyMs;
+}
+
+// Called by NegoStats for the tokens the server sends.  The token was sent moments ago, so the
+// server time in it against the local clock now is the skew, with the one-way network delay
+// and, for NTLM, the one second resolution as the error.
+void ClockSkewFromToken( const NEGO_TOKEN* pToken )
+{
+	__int64 i64Now = GetNowFileTime();
+	__int64 i64Remote;
+
+	if ( NEGO_IS_KERBEROS( pToken->iInnerMech ) && KERB_MSG_ERROR == pToken->Kerb.iMsgType && 0 != pToken->Kerb.i64ServerTime )
+	{
+		i64Remote = pToken->Kerb.i64ServerTime * 10000000LL + SKEW_UNIX_EPOCH_FILETIME + pToken->Kerb.dwServerUsec * 10LL;
+		ClockSkewAdd( SKEW_SOURCE_KRB_ERROR, ( i64Remote - i64Now ) / 10000.0, 0 );
+	}
+	else if ( NEGO_MECH_NTLM == pToken->iInnerMech && NTLM_CHALLENGE == pToken->Ntlm.dwType && pToken->Ntlm.fTimestamp )
+	{
+		i64Remote = pToken->Ntlm.i64Timestamp * 10000000LL + SKEW_UNIX_EPOCH_FILETIME;
+		ClockSkewAdd( SKEW_SOURCE_NTLM, ( i64Remote - i64Now ) / 10000.0 + 500.0, 500.0 );
+	}
+}
+
+// An uncached ticket starts when the KDC issued it, in whole seconds of the KDC clock.  LSA also
+// reports the skew it has measured against the KDC in the ticket's TimeSkew.
+static void AddKdcSample( __int64 i64TimeSkew, __int64 i64StartTime, __int64 i64Before, __int64 i64After, double dRequestMs )
+{
+	ClockSkewAdd( SKEW_SOURCE_TICKET, i64TimeSkew / 10000.0, 0 );
+	ClockSkewAdd( SKEW_SOURCE_KDC, ( i64StartTime - ( i64Before + i64After ) / 2 ) / 10000.0 + 500.0, dRequestMs / 2 + 500.0 );
+}
+
+// The uncached ticket VerifySPN requested for the target SPN, so the first sample costs no
+// request of its own.
+void ClockSkewFromTicket( const KERB_EXTERNAL_TICKET* pTicket, const FILETIME* pftRequested, const FILETIME* pftReceived )
+{
+	__int64 i64Before = ( (__int64) pftRequested->dwHighDateTime << 32 ) | pftRequested->dwLowDateTime;
+	__int64 i64After  = ( (__int64) pftReceived->dwHighDateTime << 32 ) | pftReceived->dwLowDateTime;
+
+	AddKdcSample( pTicket->TimeSkew.QuadPart, pTicket->StartTime.QuadPart, i64Before, i64After, ( i64After - i64Before ) / 10000.0 );
+}
+
+BOOL ClockSkewSampleKdc( const char* pszSPN )
+{
+	KERB_TICKET_RESULT Result;
+	__int64 i64Before, i64After;
+
+	if ( NULL == pszSPN || '\0' == pszSPN[0] ) return FALSE;
+
+	i64Before = GetNowFileTime();
+	if ( !KerbRequestTicket( pszSPN, KERB_RETRIEVE_TICKET_DONT_USE_CACHE, &Result ) ) return FALSE;
+	i64After = GetNowFileTime();
+
+	AddKdcSample( Result.TimeSkew.QuadPart, Result.StartTime.QuadPart, i64Before, i64After, KerbTicketMs( &Result ) );
+	return TRUE;
+}
+
+// "2026-10-19T12:34:56.1234567+00:00" or "2026-10-19T12:34:56.123" as a UTC FILETIME.
+static BOOL ParseSqlUtcTime( const char* pszTime, __int64* pi64Time )
+{
+	SYSTEMTIME st;
+	FILETIME ft;
+	const char* pszFraction;
+	int iYear, iMonth, iDay, iHour, iMinute, iSecond;
+	__int64 i64Fraction = 0, i64Scale = 10000000;
+
+	if ( 6 != sscanf_s( pszTime, "%4d-%2d-%2dT%2d:%2d:%2d", &iYear, &iMonth, &iDay, &iHour, &iMinute, &iSecond ) ) return FALSE;
+
+	ZeroMemory( &st, sizeof(st) );
+	st.wYear   = (WORD) iYear;
+	st.wMonth  = (WORD) iMonth;
+	st.wDay    = (WORD) iDay;
+	st.wHour   = (WORD) iHour;
+	st.wMinute = (WORD) iMinute;
+	st.wSecond = (WORD) iSecond;
+	if ( !SystemTimeToFileTime( &st, &ft ) ) return FALSE;
+
+	pszFraction = strchr( pszTime, '.' );
+	if ( NULL != pszFraction )
+	{
+		for ( pszFraction++; *pszFraction >= '0' && *pszFraction <= '9' && i64Scale > 1; pszFraction++ )
+		{
+			i64Scale /= 10;
+			i64Fraction += ( *pszFraction - '0' ) * i64Scale;
+		}
+	}
+
+	*pi64Time = ( ( (__int64) ft.dwHighDateTime << 32 ) | ft.dwLowDateTime ) + i64Fraction;
+	return TRUE;
+}
+
+static BOOL QuerySqlUtcTime( HDBC hdbc, const char* pszQuery, char* pszTime, SQLLEN cbTime, __int64* pi64Before, __int64* pi64After )
+{
+	HSTMT hstmt = NULL;
+	SQLLEN cbInd = 0;
+	BOOL fSuccess = FALSE;
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_STMT, hdbc, &hstmt ) ) ) return FALSE;
+
+	*pi64Before = GetNowFileTime();
+	if ( SQL_SUCCEEDED( SQLExecDirect( hstmt, (SQLCHAR*) pszQuery, SQL_NTS ) ) &&
+		 SQL_SUCCEEDED( SQLFetch( hstmt ) ) &&
+		 SQL_SUCCEEDED( SQLGetData( hstmt, 1, SQL_C_CHAR, pszTime, cbTime, &cbInd ) ) &&
+		 cbInd > 0 )
+	{
+		*pi64After = GetNowFileTime();
+		fSuccess = TRUE;
+	}
+
+	SQLFreeHandle( SQL_HANDLE_STMT, hstmt );
+	return fSuccess;
+}
+
+// The server clock against the midpoint of the query, so the error is half the round trip.
+BOOL ClockSkewSampleSql( HDBC hdbc )
+{
+	char szTime[64];
+	__int64 i64Before = 0, i64After = 0, i64Server;
+
+	if ( NULL == hdbc ) return FALSE;
+
+	// SYSDATETIMEOFFSET has 100 ns precision, SQL Server 2005 and earlier only have GETUTCDATE.
+	if ( !QuerySqlUtcTime( hdbc, "SELECT CONVERT(varchar(40), SWITCHOFFSET(SYSDATETIMEOFFSET(), '+00:00'), 126)", szTime, sizeof(szTime), &i64Before, &i64After ) &&
+		 !QuerySqlUtcTime( hdbc, "SELECT CONVERT(varchar(30), GETUTCDATE(), 126)", szTime, sizeof(szTime), &i64Before, &i64After ) )
+	{
+		return FALSE;
+	}
+	if ( !ParseSqlUtcTime( szTime, &i64Server ) ) return FALSE;
+
+	ClockSkewAdd( SKEW_SOURCE_SQL, ( i64Server - ( i64Before + i64After ) / 2 ) / 10000.0, ( i64After - i64Before ) / 20000.0 );
+	return TRUE;
+}
+
+// One KDC and one SQL Server sample after the login and the SPN checks, or skewsamples of them
+// skewintervalms apart for a monitoring run.  The first KDC sample is the one VerifySPN's ticket
+// gave, if any, the later ones request an uncached ticket for pszSPN.
+void RunClockSkewMonitor( HDBC hdbc, const char* pszSPN )
+{
+	long lSamples, lIntervalMs, lSample;
+	SKEW_SOURCE* pKdc = &g_rgSkewSources[SKEW_SOURCE_KDC];
+	SKEW_SOURCE* pSql = &g_rgSkewSources[SKEW_SOURCE_SQL];
+	BOOL fKdc, fSql;
+
+	lSamples = GetTestOptionLong( "skewsamples", 1 );
+	if ( lSamples < 1 ) return;
+	if ( lSamples > SKEW_MAX_SAMPLES ) lSamples = SKEW_MAX_SAMPLES;
+	lIntervalMs = GetTestOptionLong( "skewintervalms", 1000 );
+	if ( lIntervalMs < 0 ) lIntervalMs = 0;
+
+	if ( lSamples > 1 )
+	{
+		o_printf( "" );
+		o_printf( "Sampling clock skew %ld times, %ld ms apart.", lSamples, lIntervalMs );
+	}
+
+	for ( lSample=0; lSample<lSamples; lSample++ )
+	{
+		if ( lSample > 0 ) Sleep( lIntervalMs );
+
+		fKdc = ( 0 == lSample ) ? ( pKdc->cSamples > 0 ) : ClockSkewSampleKdc( pszSPN );
+		fSql = ClockSkewSampleSql( hdbc );
+		if ( lSamples > 1 )
+		{
+			o_printf( "  skew sample %ld: KDC %s%.0f ms, SQL Server %s%.1f ms", lSample + 1,
+					  ( fKdc ) ? "" : "n/a ", ( fKdc ) ? pKdc->rgSamples[pKdc->cSamples-1].dSkewMs : 0.0,
+					  ( fSql ) ? "" : "n/a ", ( fSql ) ? pSql->rgSamples[pSql->cSamples-1].dSkewMs : 0.0 );
+		}
+	}
+}
+
+// Least squares slope of skew over time, in ms per minute.
+static double GetSkewTrend( const SKEW_SOURCE* pSource )
+{
+	double dSumX = 0, dSumY = 0, dSumXX = 0, dSumXY = 0, dDenominator;
+	DWORD i;
+
+	if ( pSource->cSamples < 3 ) return 0;
+	for ( i=0; i<pSource->cSamples; i++ )
+	{
+		dSumX  += pSource->rgSamples[i].dSeconds;
+		dSumY  += pSource->rgSamples[i].dSkewMs;
+		dSumXX += pSource->rgSamples[i].dSeconds * pSource->rgSamples[i].dSeconds;
+		dSumXY += pSource->rgSamples[i].dSeconds * pSource->rgSamples[i].dSkewMs;
+	}
+	dDenominator = pSource->cSamples * dSumXX - dSumX * dSumX;
+	if ( dDenominator <= 0 ) return 0;
+	return 60.0 * ( pSource->cSamples * dSumXY - dSumX * dSumY ) / dDenominator;
+}
+
+void DumpClockSkew()
+{
+	SKEW_SOURCE* pSource = NULL;
+	SKEW_SAMPLE* pLast = NULL;
+	double dMin, dMax, dSum, dTrend, dWorst = 0, dMinutes;
+	BOOL fAny = FALSE;
+	DWORD i;
+	int iSource;
+
+	for ( iSource=0; iSource<SKEW_SOURCE_COUNT; iSource++ )
+	{
+		pSource = &g_rgSkewSources[iSource];
+		if ( 0 == pSource->cSamples ) continue;
+
+		if ( !fAny )
+		{
+			o_printf( "" );
+			o_printf( "Clock skew (remote clock minus this client, positive when the remote clock is ahead):" );
+			fAny = TRUE;
+		}
+
+		dMin = dMax = dSum = pSource->rgSamples[0].dSkewMs;
+		for ( i=1; i<pSource->cSamples; i++ )
+		{
+			dMin = min( dMin, pSource->rgSamples[i].dSkewMs );
+			dMax = max( dMax, pSource->rgSamples[i].dSkewMs );
+			dSum += pSource->rgSamples[i].dSkewMs;
+		}
+		pLast = &pSource->rgSamples[pSource->cSamples-1];
+		dWorst = max( dWorst, max( fabs( dMin ), fabs( dMax ) ) );
+
+		if ( pLast->dUncertaintyMs > 0 )
+		{
+			o_printf( "  %-24s %+.1f ms +/- %.1f ms", GetSkewSourceName( iSource ), pLast->dSkewMs, pLast->dUncertaintyMs );
+		}
+		else
+		{
+			o_printf( "  %-24s %+.1f ms", GetSkewSourceName( iSource ), pLast->dSkewMs );
+		}
+		if ( pSource->cSamples < 2 ) continue;
+
+		dTrend = GetSkewTrend( pSource );
+		o_printf( "    %lu samples over %.0f s: min %+.1f ms, avg %+.1f ms, max %+.1f ms, drift %+.3f ms/min",
+				  pSource->cSamples, pLast->dSeconds - pSource->rgSamples[0].dSeconds, dMin, dSum / pSource->cSamples, dMax, dTrend );
+
+		// Drifting away from zero: when does it reach the Kerberos limit.
+		if ( ( dTrend > 0 && pLast->dSkewMs > 0 ) || ( dTrend < 0 && pLast->dSkewMs < 0 ) )
+		{
+			dMinutes = ( SKEW_KERBEROS_MAX_MS - fabs( pLast->dSkewMs ) ) / fabs( dTrend );
+			if ( dMinutes > 0 && dMinutes < 7 * 24 * 60 )
+			{
+				o_printf( "    At this drift the skew reaches 5 minutes in about %.0f minutes.", dMinutes );
+			}
+		}
+	}
+
+	if ( !fAny ) return;
+	if ( dWorst >= SKEW_KERBEROS_MAX_MS )
+	{
+		o_printf( "  *** ERROR: The clocks are more than 5 minutes apart, Kerberos fails with SEC_E_TIME_SKEW / KRB_AP_ERR_SKEW." );
+	}
+	else if ( dWorst >= SKEW_KERBEROS_MAX_MS / 2 )
+	{
+		o_printf( "  WARNING! The clocks are %.0f s apart, more than half the 5 minute Kerberos limit.  Check w32time on both sides.", dWorst / 1000.0 );
+	}
+}
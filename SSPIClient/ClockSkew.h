@@ -0,0 +1,36 @@
+#pragma once
+
+#include "PerfStats.h"
+#include "NegoDecoder.h"
+
+// Clock skew between this client and the machines that authenticate it, from every place a
+// remote clock shows up: the TimeSkew LSA keeps for the KDC, the start time of a ticket the KDC
+// just issued, the server time in a KRB-ERROR or an NTLM CHALLENGE, and SYSDATETIMEOFFSET on the
+// server after a login.  Skew is remote clock minus local clock, positive when the remote clock
+// is ahead.  Kerberos rejects anything beyond 5 minutes by default.
+
+#define SKEW_SOURCE_TICKET		0		// KERB_EXTERNAL_TICKET.TimeSkew
+#define SKEW_SOURCE_KDC			1		// StartTime of an uncached service ticket
+#define SKEW_SOURCE_KRB_ERROR	2		// KRB-ERROR stime from the server
+#define SKEW_SOURCE_NTLM		3		// MsvAvTimestamp of an NTLM CHALLENGE
+#define SKEW_SOURCE_SQL			4		// SYSDATETIMEOFFSET, or GETUTCDATE before SQL Server 2008
+#define SKEW_SOURCE_COUNT		5
+
+#define SKEW_MAX_SAMPLES		1000	// Per source
+#define SKEW_KERBEROS_MAX_MS	( 5 * 60 * 1000.0 )
+
+typedef struct _SKEW_SAMPLE
+{
+	double dSeconds;					// Since ClockSkewReset
+	double dSkewMs;
+	double dUncertaintyMs;				// +/- around dSkewMs, 0 if unknown
+} SKEW_SAMPLE;
+
+void ClockSkewReset();
+void ClockSkewAdd( int iSource, double dSkewMs, double dUncertaintyMs );
+void ClockSkewFromToken( const NEGO_TOKEN* pToken );
+void ClockSkewFromTicket( const KERB_EXTERNAL_TICKET* pTicket, const FILETIME* pftRequested, const FILETIME* pftReceived );
+BOOL ClockSkewSampleKdc( const char* pszSPN );
+BOOL ClockSkewSampleSql( HDBC hdbc );
+void RunClockSkewMonitor( HDBC hdbc, const char* pszSPN );
+void DumpClockSkew();
@@ -0,0 +1,254 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// DerCodec.cpp: DER reader shared by X509Parser.cpp and KerbDecoder.cpp, plus the small writer
+// their standalone tools use to build synthetic certificates and tokens.
+//
+// Built without the precompiled header.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "DerCodec.h"
+
+void DerInit( DER_READER* pReader, const uint8_t* pb, size_t cb )
+{
+	pReader->pb    = pb;
+	pReader->pbEnd = pb + cb;
+}
+
+void DerInitSlice( DER_READER* pReader, const DER_SLICE* pSlice )
+{
+	DerInit( pReader, pSlice->pb, pSlice->cb );
+}
+
+int DerAtEnd( const DER_READER* pReader )
+{
+	return pReader->pb >= pReader->pbEnd;
+}
+
+uint8_t DerPeek( const DER_READER* pReader )
+{
+	return ( DerAtEnd( pReader ) ) ? 0 : pReader->pb[0];
+}
+
+// Reads one TLV and moves past it.  pWhole, if given, also covers the tag and length.
+int DerNext( DER_READER* pReader, uint8_t* pbTag, DER_SLICE* pValue, DER_SLICE* pWhole )
+{
+	const uint8_t* pb = pReader->pb;
+	size_t cbLeft = (size_t) ( pReader->pbEnd - pb );
+	uint32_t cb, cbHeader, cLenBytes, i;
+
+	if ( cbLeft < 2 ) return DER_ERR_TRUNCATED;
+	if ( 0x1f == ( pb[0] & 0x1f ) ) return DER_ERR_TAG;
+
+	if ( pb[1] < 0x80 )
+	{
+		cb = pb[1];
+		cbHeader = 2;
+	}
+	else
+	{
+		cLenBytes = pb[1] & 0x7f;
+		if ( 0 == cLenBytes || cLenBytes > 4 ) return DER_ERR_LENGTH;
+		if ( cbLeft < 2 + cLenBytes ) return DER_ERR_TRUNCATED;
+		if ( 0 == pb[2] ) return DER_ERR_LENGTH;
+		for ( cb=0, i=0; i<cLenBytes; i++ ) cb = ( cb << 8 ) | pb[2+i];
+		if ( cb < 0x80 ) return DER_ERR_LENGTH;
+		cbHeader = 2 + cLenBytes;
+	}
+	if ( cb > cbLeft - cbHeader ) return DER_ERR_TRUNCATED;
+
+	*pbTag = pb[0];
+	pValue->pb = pb + cbHeader;
+	pValue->cb = cb;
+	if ( NULL != pWhole )
+	{
+		pWhole->pb = pb;
+		pWhole->cb = cbHeader + cb;
+	}
+	pReader->pb = pb + cbHeader + cb;
+	return DER_OK;
+}
+
+int DerExpect( DER_READER* pReader, uint8_t bTag, DER_SLICE* pValue )
+{
+	uint8_t bActual;
+	int iError = DerNext( pReader, &bActual, pValue, NULL );
+
+	if ( DER_OK != iError ) return iError;
+	return ( bActual == bTag ) ? DER_OK : DER_ERR_TAG;
+}
+
+// [n] EXPLICIT wrapper holding exactly one value with tag bTag, as Kerberos uses everywhere.
+int DerExpectExplicit( DER_READER* pReader, uint8_t bContextTag, uint8_t bTag, DER_SLICE* pValue )
+{
+	DER_READER Inner;
+	DER_SLICE Outer;
+	int iError;
+
+	DER_CHECK( DerExpect( pReader, bContextTag, &Outer ) );
+	DerInitSlice( &Inner, &Outer );
+	DER_CHECK( DerExpect( &Inner, bTag, pValue ) );
+	return ( DerAtEnd( &Inner ) ) ? DER_OK : DER_ERR_TRAILING;
+}
+
+// Two's complement INTEGER contents of up to eight bytes.  A leading zero byte is allowed so
+// unsigned 32 bit values such as Kerberos key version numbers fit.
+int DerReadInt( const DER_SLICE* pValue, int64_t* pi64Value )
+{
+	uint64_t ui64 = 0;
+	uint32_t i;
+
+	if ( 0 == pValue->cb || pValue->cb > 8 ) return DER_ERR_LENGTH;
+	if ( pValue->pb[0] & 0x80 ) ui64 = ~(uint64_t) 0;
+	for ( i=0; i<pValue->cb; i++ ) ui64 = ( ui64 << 8 ) | pValue->pb[i];
+	*pi64Value = (int64_t) ui64;
+	return DER_OK;
+}
+
+static int64_t DaysFromCivil( int64_t y, unsigned m, unsigned d )
+{
+	y -= ( m <= 2 );
+	int64_t era = ( y >= 0 ? y : y - 399 ) / 400;
+	unsigned yoe = (unsigned) ( y - era * 400 );
+	unsigned doy = ( 153 * ( m + ( m > 2 ? -3 : 9 ) ) + 2 ) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static int ParseDigits( const uint8_t* pb, int cDigits, int* piValue )
+{
+	int i;
+
+	*piValue = 0;
+	for ( i=0; i<cDigits; i++ )
+	{
+		if ( pb[i] < '0' || pb[i] > '9' ) return 0;
+		*piValue = *piValue * 10 + ( pb[i] - '0' );
+	}
+	return 1;
+}
+
+// UTCTime YYMMDDHHMMSSZ (years 50-99 are 19xx) or GeneralizedTime YYYYMMDDHHMMSSZ, the only
+// forms RFC 5280 and RFC 4120 allow.  Returns seconds since 1970-01-01 UTC.
+int DerParseTime( uint8_t bTag, const DER_SLICE* pValue, int64_t* pi64Time )
+{
+	const uint8_t* pb = pValue->pb;
+	int iYear, iMonth, iDay, iHour, iMinute, iSecond, cYearDigits;
+
+	if ( DER_UTC_TIME == bTag && 13 == pValue->cb ) cYearDigits = 2;
+	else if ( DER_GENERALIZED_TIME == bTag && 15 == pValue->cb ) cYearDigits = 4;
+	else return DER_ERR_TIME;
+
+	if ( 'Z' != pb[pValue->cb-1] ||
+		 !ParseDigits( pb, cYearDigits, &iYear ) ||
+		 !ParseDigits( pb + cYearDigits, 2, &iMonth ) ||
+		 !ParseDigits( pb + cYearDigits + 2, 2, &iDay ) ||
+		 !ParseDigits( pb + cYearDigits + 4, 2, &iHour ) ||
+		 !ParseDigits( pb + cYearDigits + 6, 2, &iMinute ) ||
+		 !ParseDigits( pb + cYearDigits + 8, 2, &iSecond ) )
+	{
+		return DER_ERR_TIME;
+	}
+	if ( 2 == cYearDigits ) iYear += ( iYear >= 50 ) ? 1900 : 2000;
+	if ( iMonth < 1 || iMonth > 12 || iDay < 1 || iDay > 31 || iHour > 23 || iMinute > 59 || iSecond > 59 ) return DER_ERR_TIME;
+
+	*pi64Time = DaysFromCivil( iYear, (unsigned) iMonth, (unsigned) iDay ) * 86400 + iHour * 3600 + iMinute * 60 + iSecond;
+	return DER_OK;
+}
+
+const char* DerErrorName( int iError )
+{
+	switch ( iError )
+	{
+		case DER_OK:			return "ok";
+		case DER_ERR_TRUNCATED:	return "truncated";
+		case DER_ERR_LENGTH:	return "bad length";
+		case DER_ERR_TAG:		return "unexpected tag";
+		case DER_ERR_TIME:		return "bad time";
+		case DER_ERR_TRAILING:	return "trailing data";
+	}
+	return "unknown";
+}
+
+// Printable rendering of a single byte string, other characters shown as '?'.
+char* DerStringFormat( const DER_SLICE* pSlice, char* pszBuffer, size_t cchBuffer )
+{
+	uint32_t i;
+	size_t cch = 0;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	for ( i=0; i<pSlice->cb && cch + 1 < cchBuffer; i++ )
+	{
+		pszBuffer[cch++] = ( pSlice->pb[i] >= 0x20 && pSlice->pb[i] <= 0x7e ) ? (char) pSlice->pb[i] : '?';
+	}
+	pszBuffer[cch] = 0;
+	return pszBuffer;
+}
+
+char* DerTimeFormat( int64_t i64Time, char* pszBuffer, size_t cchBuffer )
+{
+	int64_t z = ( i64Time >= 0 ? i64Time : i64Time - 86399 ) / 86400 + 719468;
+	int64_t iSeconds = i64Time - ( z - 719468 ) * 86400;
+	int64_t era = ( z >= 0 ? z : z - 146096 ) / 146097;
+	unsigned doe = (unsigned) ( z - era * 146097 );
+	unsigned yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+	unsigned doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+	unsigned mp = ( 5 * doy + 2 ) / 153;
+	unsigned d = doy - ( 153 * mp + 2 ) / 5 + 1;
+	unsigned m = mp < 10 ? mp + 3 : mp - 9;
+	int64_t y = (int64_t) yoe + era * 400 + ( m <= 2 );
+
+	snprintf( pszBuffer, cchBuffer, "%04lld-%02u-%02u %02d:%02d:%02d", (long long) y, m, d,
+			  (int) ( iSeconds / 3600 ), (int) ( iSeconds / 60 % 60 ), (int) ( iSeconds % 60 ) );
+	return pszBuffer;
+}
+
+// Writes tag, length and value at pb.  The value may already sit at pb, it is moved into place.
+size_t DerPutTlv( uint8_t* pb, uint8_t bTag, const uint8_t* pbValue, size_t cbValue )
+{
+	size_t cbHeader = ( cbValue < 0x80 ) ? 2 : ( cbValue < 0x100 ) ? 3 : 4;
+
+	memmove( pb + cbHeader, pbValue, cbValue );
+	pb[0] = bTag;
+	if ( 2 == cbHeader )
+	{
+		pb[1] = (uint8_t) cbValue;
+	}
+	else if ( 3 == cbHeader )
+	{
+		pb[1] = 0x81;
+		pb[2] = (uint8_t) cbValue;
+	}
+	else
+	{
+		pb[1] = 0x82;
+		pb[2] = (uint8_t) ( cbValue >> 8 );
+		pb[3] = (uint8_t) cbValue;
+	}
+	return cbHeader + cbValue;
+}
+
+size_t DerPutString( uint8_t* pb, uint8_t bTag, const char* psz )
+{
+	return DerPutTlv( pb, bTag, (const uint8_t*) psz, strlen( psz ) );
+}
+
+// Shortest two's complement encoding.
+size_t DerPutInt( uint8_t* pb, int64_t i64Value )
+{
+	uint8_t rgb[8];
+	int i, iFirst = 0;
+
+	for ( i=0; i<8; i++ ) rgb[i] = (uint8_t) ( (uint64_t) i64Value >> ( 56 - i*8 ) );
+	while ( iFirst < 7 &&
+			( ( 0x00 == rgb[iFirst] && 0 == ( rgb[iFirst+1] & 0x80 ) ) ||
+			  ( 0xff == rgb[iFirst] && 0 != ( rgb[iFirst+1] & 0x80 ) ) ) )
+	{
+		iFirst++;
+	}
+	return DerPutTlv( pb, DER_INTEGER, rgb + iFirst, (size_t) ( 8 - iFirst ) );
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Minimal DER reader shared by the certificate and Kerberos decoders.  Values are returned as
+// slices into the caller's buffer, nothing is copied or allocated.  Only single byte tags and
+// definite lengths of up to four bytes in their shortest form are accepted, which covers
+// X.509 and Kerberos, so truncated or hostile input fails cleanly instead of being guessed at.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DER_OK					0
+#define DER_ERR_TRUNCATED		1		// A length runs past the end of its container
+#define DER_ERR_LENGTH			2		// Indefinite, non-minimal or oversized length
+#define DER_ERR_TAG				3		// Unexpected tag
+#define DER_ERR_TIME			4		// Malformed UTCTime/GeneralizedTime
+#define DER_ERR_TRAILING		5		// Bytes after the end of a structure
+#define DER_ERR_LAST			DER_ERR_TRAILING
+
+// Universal tags used by the decoders.
+#define DER_BOOLEAN				0x01
+#define DER_INTEGER				0x02
+#define DER_BIT_STRING			0x03
+#define DER_OCTET_STRING		0x04
+#define DER_OID					0x06
+#define DER_ENUMERATED			0x0a
+#define DER_UTC_TIME			0x17
+#define DER_GENERALIZED_TIME	0x18
+#define DER_GENERAL_STRING		0x1b
+#define DER_SEQUENCE			0x30
+#define DER_SET					0x31
+
+#define DER_CONTEXT(n)			( 0xa0 | (n) )		// [n] constructed
+#define DER_APPLICATION(n)		( 0x60 | (n) )		// [APPLICATION n] constructed
+
+typedef struct _DER_SLICE
+{
+	const uint8_t* pb;
+	uint32_t       cb;
+} DER_SLICE;
+
+typedef struct _DER_READER
+{
+	const uint8_t* pb;
+	const uint8_t* pbEnd;
+} DER_READER;
+
+#define DER_CHECK(x)	do { iError = (x); if ( DER_OK != iError ) return iError; } while ( 0 )
+#define DER_OID_IS(slice, rgb)	( (slice).cb == sizeof(rgb) && 0 == memcmp( (slice).pb, rgb, sizeof(rgb) ) )
+
+void    DerInit( DER_READER* pReader, const uint8_t* pb, size_t cb );
+void    DerInitSlice( DER_READER* pReader, const DER_SLICE* pSlice );
+int     DerAtEnd( const DER_READER* pReader );
+uint8_t DerPeek( const DER_READER* pReader );
+int     DerNext( DER_READER* pReader, uint8_t* pbTag, DER_SLICE* pValue, DER_SLICE* pWhole );
+int     DerExpect( DER_READER* pReader, uint8_t bTag, DER_SLICE* pValue );
+int     DerExpectExplicit( DER_READER* pReader, uint8_t bContextTag, uint8_t bTag, DER_SLICE* pValue );
+int     DerReadInt( const DER_SLICE* pValue, int64_t* pi64Value );
+int     DerParseTime( uint8_t bTag, const DER_SLICE* pValue, int64_t* pi64Time );
+
+const char* DerErrorName( int iError );
+char* DerStringFormat( const DER_SLICE* pSlice, char* pszBuffer, size_t cchBuffer );
+char* DerTimeFormat( int64_t i64Time, char* pszBuffer, size_t cchBuffer );
+
+// Writer for the synthetic input of the standalone benchmarks and fuzzers.
+size_t  DerPutTlv( uint8_t* pb, uint8_t bTag, const uint8_t* pbValue, size_t cbValue );
+size_t  DerPutString( uint8_t* pb, uint8_t bTag, const char* psz );
+size_t  DerPutInt( uint8_t* pb, int64_t i64Value );
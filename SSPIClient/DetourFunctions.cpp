@@ -13,8 +13,18 @@
 #include <schannel.h>
 #include "dbnetlib.h"
 #include "sspierrors.h"
+#include "NetlibStats.h"
+#include "TlsStats.h"
+#include "NegoStats.h"
+#include "TokenStats.h"
+#include "RevocationProfile.h"
+#include "CertCache.h"
+#include "X509Parser.h"
+#include "NegoDecoder.h"
+#include "TestOptions.h"
 
 BOOL g_fSupressOutput = FALSE;
+BOOL g_fLogPaused = FALSE;
 int g_iStackDepth = 0;
 BOOL g_fFunctionsDetoured = FALSE;
 HANDLE g_hLogFile = NULL;
@@ -29,6 +39,7 @@ BOOL g_fCertSubjectCheckDone = FALSE;
 HMODULE g_hModSecurity = NULL;
 HMODULE g_hModDBNetlib = NULL;
 HMODULE g_hModCrypt32  = NULL;
+HMODULE g_hModCryptNet = NULL;
 
 struct _DETOUR_FUNCTIONS
 {
@@ -38,13 +49,15 @@ struct _DETOUR_FUNCTIONS
 	COMPLETE_AUTH_TOKEN_FN           pfnCompleteAuthToken;
 	ACCEPT_SECURITY_CONTEXT_FN       pfnAcceptSecurityContext;
 	QUERY_SECURITY_PACKAGE_INFO_FN_A pfnQuerySecurityPackageInfoA;
+	FREE_CONTEXT_BUFFER_FN			 pfnFreeContextBuffer;		// Loaded but not detoured
 
 	/*
-	FREE_CONTEXT_BUFFER_FN			 pfnFreeContextBuffer;
     DELETE_SECURITY_CONTEXT_FN		 pfnDeleteSecurityContext;
 	*/
 
 	QUERY_CONTEXT_ATTRIBUTES_FN_A	 pfnQueryContextAttributesA;
+	ENCRYPT_MESSAGE_FN				 pfnEncryptMessage;
+	DECRYPT_MESSAGE_FN				 pfnDecryptMessage;
 
 	// Crypt32.dll functions
 	CertNameToStrW_FN pfnCertNameToStrW;
@@ -52,8 +65,16 @@ struct _DETOUR_FUNCTIONS
 	CertVerifyCertificateChainPolicy_FN pfnCertVerifyCertificateChainPolicy;
 	CertFindChainInStore_FN pfnCertFindChainInStore;
 
+	// Cryptnet.dll functions
+	CryptRetrieveObjectByUrlW_FN pfnCryptRetrieveObjectByUrlW;
+
 	// dbnetlib.dll functions
+	ConnectionOpen_FN ConnectionOpen;
 	ConnectionOpenW_FN ConnectionOpenW;
+	ConnectionClose_FN ConnectionClose;
+	ConnectionOption_FN ConnectionOption;
+	ConnectionRead_FN ConnectionRead;
+	ConnectionWrite_FN ConnectionWrite;
 	ConnectionGetSvrUser_FN ConnectionGetSvrUser;
 	GenClientContext_FN GenClientContext;
 	InitSSPIPackage_FN InitSSPIPackage;
@@ -111,6 +132,9 @@ void o_printf( char* lpszFormat, ... )
 	if ( NULL == g_hLogFile ) return;
 	if ( NULL == g_pLogFileLock ) return;
 
+	// Measured test loops pause the log so file writes do not end up in the timings.
+	if ( g_fLogPaused ) return;
+
 	// Format input string.
 	va_start( args, lpszFormat );
 	_vsnprintf_s( szMessage, sizeof(szMessage), sizeof(szMessage), lpszFormat, args );
@@ -494,6 +518,38 @@ void DumpHex( void* pData, unsigned long length )
 	}
 }
 
+// Mechanism of the last SPNEGO, NTLM or Kerberos token DumpAuthToken decoded, so the ISC hook
+// can tell from its output token whether Negotiate went with Kerberos.
+static int g_iLastTokenMech = NEGO_MECH_NONE;
+
+// Summarises a Negotiate, NTLM or Kerberos token instead of hex dumping it, and says why
+// Negotiate fell back to NTLM when it did.  Everything lives on the stack, nothing is
+// allocated.  Returns TRUE if the hex dump can be skipped, the tokenhex option keeps it.
+static BOOL DumpAuthToken( void* pvBuffer, unsigned long cbBuffer )
+{
+	NEGO_TOKEN Token;
+	char szSummary[2048];
+	const char* pszReason;
+	int iError;
+
+	if ( NULL == pvBuffer || 0 == cbBuffer ) return FALSE;
+	iError = NegoDecode( (const uint8_t*) pvBuffer, cbBuffer, &Token );
+	if ( NEGO_ERR_UNKNOWN == iError ) return FALSE;
+	if ( DER_OK != iError )
+	{
+		o_printf( "Authentication token cannot be decoded: %s", NegoDecodeErrorName( iError ) );
+		return FALSE;
+	}
+	if ( NEGO_TOKEN_KERBEROS == Token.iType ) o_printf( "Kerberos %s", KerbMessageFormat( &Token.Kerb, szSummary, sizeof(szSummary) ) );
+	else o_printf( "%s", NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ) );
+
+	pszReason = NegoFallbackReason( &Token );
+	if ( NULL != pszReason ) o_printf( "NTLM fallback: %s", pszReason );
+
+	g_iLastTokenMech = NegoTokenMech( &Token );
+	return !GetTestOptionBool( "tokenhex", FALSE );
+}
+
 void DumpSecBufferInputDesc( PSecBufferDesc pInput )
 {
 	unsigned long i;
@@ -507,6 +563,7 @@ void DumpSecBufferInputDesc( PSecBufferDesc pInput )
 		o_printf( "pBuffers[%02lu].cbBuffer   = %lu",    i, pInput->pBuffers[i].cbBuffer );
 		o_printf( "pBuffers[%02lu].BufferType = %lu %s", i, pInput->pBuffers[i].BufferType, GetSecBufferTypeString( pInput->pBuffers[i].BufferType) );
 		o_printf( "pBuffers[%02lu].pvBuffer   = 0x%08x", i, pInput->pBuffers[i].pvBuffer );
+		if ( SECBUFFER_TOKEN == ( pInput->pBuffers[i].BufferType & ~SECBUFFER_ATTRMASK ) && DumpAuthToken( pInput->pBuffers[i].pvBuffer, pInput->pBuffers[i].cbBuffer ) ) continue;
 		DumpHex( pInput->pBuffers[i].pvBuffer, pInput->pBuffers[i].cbBuffer );
 	}
 }
@@ -528,6 +585,7 @@ void DumpSecBufferOutputDesc( SECURITY_STATUS rv, PSecBufferDesc pOutput )
 		// Only dump output buffers if call was successful.
 		if ( rv >= 0 )
 		{
+			if ( SECBUFFER_TOKEN == ( pOutput->pBuffers[i].BufferType & ~SECBUFFER_ATTRMASK ) && DumpAuthToken( pOutput->pBuffers[i].pvBuffer, pOutput->pBuffers[i].cbBuffer ) ) continue;
 			DumpHex( pOutput->pBuffers[i].pvBuffer, pOutput->pBuffers[i].cbBuffer );
 		}
 	}
@@ -892,6 +950,65 @@ void DisplayCertChain(
 }
 
 
+// Parses every certificate in a system store and checks it against pszHost the way the SSL
+// policy does, SANs first, then the CN.  Shows which certificate SQL Server could load for a
+// name, and why a certificate that looks right would fail with CERT_E_CN_NO_MATCH.
+void ScanCertStoreNames( const char* pszStore, const char* pszHost )
+{
+	HCERTSTORE hStore;
+	PCCERT_CONTEXT pCert = NULL;
+	X509_CERT Cert;
+	X509_MATCH Match;
+	char szCN[X509_MAX_NAME], szSan[X509_MAX_NAME], szEku[256], szNotAfter[32];
+	DWORD cCerts = 0, cMatches = 0, cErrors = 0;
+	uint64_t ui64Start, ui64Parse = 0;
+	int iError;
+
+	hStore = CertOpenSystemStoreA( NULL, pszStore );
+	if ( NULL == hStore )
+	{
+		o_printf( "Cannot open the %s certificate store. Error = %lu", pszStore, GetLastError() );
+		return;
+	}
+
+	o_printf( "" );
+	o_printf( "Certificates in the %s store for server name [%s]:", pszStore, pszHost );
+	while ( NULL != ( pCert = CertEnumCertificatesInStore( hStore, pCert ) ) )
+	{
+		cCerts++;
+		ui64Start = PerfCounter();
+		iError = X509Parse( pCert->pbCertEncoded, pCert->cbCertEncoded, &Cert );
+		if ( X509_OK == iError ) X509MatchHostname( &Cert, pszHost, &Match );
+		ui64Parse += PerfCounter() - ui64Start;
+
+		if ( X509_OK != iError )
+		{
+			cErrors++;
+			o_printf( "  %3lu. cannot be parsed: %s", cCerts, X509ErrorName( iError ) );
+			continue;
+		}
+
+		X509SliceFormat( &Cert.SubjectCN, Cert.bSubjectCNTag, szCN, sizeof(szCN) );
+		if ( X509_MATCH_NONE == Match.iResult || X509_MATCH_BAD_HOST == Match.iResult )
+		{
+			o_printf( "  %3lu. [%s] %s%s", cCerts, szCN, X509MatchName( Match.iResult ),
+					  ( Match.fCNIgnored ) ? ", the CN matches but is ignored because the certificate has DNS SANs" : "" );
+			continue;
+		}
+
+		cMatches++;
+		if ( Match.iSan >= 0 ) X509SanFormat( &Cert.rgSans[Match.iSan], szSan, sizeof(szSan) );
+		else lstrcpyn( szSan, szCN, sizeof(szSan) );
+		o_printf( "  %3lu. [%s] matches %s %s, EKU %s, expires %s%s", cCerts, szCN, X509MatchName( Match.iResult ), szSan,
+				  X509EkuFormat( &Cert, szEku, sizeof(szEku) ), DerTimeFormat( Cert.i64NotAfter, szNotAfter, sizeof(szNotAfter) ),
+				  ( X509IsServerAuth( &Cert ) ) ? "" : ", not valid for server authentication" );
+	}
+	o_printf( "%lu certificates, %lu match, %lu could not be parsed, %.3f ms parsing and matching", cCerts, cMatches, cErrors, PerfCounterToMs( ui64Parse ) );
+
+	CertCloseStore( hStore, 0 );
+}
+
+
 // Trampolines
 
 #pragma warning(disable:4100) 
@@ -956,6 +1073,7 @@ SECURITY_STATUS SEC_ENTRY Mine_AcquireCredentialsHandleA(
 			O_HEX( phCredential );
 			o_printf( "ptsExpiry=0x%08x -> %s", ptsExpiry, DumpTimeStamp( ptsExpiry, szTSBuffer, sizeof(szTSBuffer) ) );
 			o_printf( "EXIT  AcquireCredentialsHandleA returned SEC_E_OK." );
+			TokenStatsCredentials( pszPackage, pszPrincipal );
 		}
     } 
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
@@ -964,6 +1082,62 @@ SECURITY_STATUS SEC_ENTRY Mine_AcquireCredentialsHandleA(
 
 }
 
+// Records which package a completed client context ended up using (Kerberos or NTLM under
+// Negotiate) in g_STATUS.szNegotiatedPackage, and Kerberos in fUsedKerberos.  Schannel
+// contexts are left out.
+void SaveNegotiatedPackage( PCtxtHandle phContext )
+{
+	SecPkgContext_NegotiationInfoA NegotiationInfo;
+	SecPkgContext_PackageInfoA PackageInfo;
+	PSecPkgInfoA pPackage = NULL;
+
+	if ( NULL == phContext ) return;
+	if ( NULL == g_DFN.pfnQueryContextAttributesA ) return;
+	if ( NULL == g_DFN.pfnFreeContextBuffer ) return;
+
+	ZeroMemory( &NegotiationInfo, sizeof(NegotiationInfo) );
+	ZeroMemory( &PackageInfo, sizeof(PackageInfo) );
+
+	// Negotiate reports the package it picked, other packages only report themselves.
+	if ( SEC_E_OK == g_DFN.pfnQueryContextAttributesA( phContext, SECPKG_ATTR_NEGOTIATION_INFO, &NegotiationInfo ) )
+	{
+		pPackage = NegotiationInfo.PackageInfo;
+	}
+	else if ( SEC_E_OK == g_DFN.pfnQueryContextAttributesA( phContext, SECPKG_ATTR_PACKAGE_INFO, &PackageInfo ) )
+	{
+		pPackage = PackageInfo.PackageInfo;
+	}
+
+	if ( NULL == pPackage ) return;
+
+	if ( NULL != pPackage->Name && 
+		 NULL == strstr( pPackage->Name, "Schannel" ) &&
+		 NULL == strstr( pPackage->Name, "Unified Security" ) )
+	{
+		lstrcpyn( g_STATUS.szNegotiatedPackage, pPackage->Name, sizeof(g_STATUS.szNegotiatedPackage) );
+		NegoExchangePackage( pPackage->Name );
+		if ( 0 == lstrcmpi( pPackage->Name, "Kerberos" ) ) g_STATUS.fUsedKerberos = TRUE;
+	}
+
+	g_DFN.pfnFreeContextBuffer( pPackage );
+}
+
+// cbMaxToken of a package, straight from secur32 so nothing is logged.  0 if it is unknown.
+DWORD GetPackageMaxToken( const char* pszPackage )
+{
+	PSecPkgInfoA pPackageInfo = NULL;
+	DWORD cbMaxToken = 0;
+
+	if ( NULL == g_DFN.pfnQuerySecurityPackageInfoA || NULL == g_DFN.pfnFreeContextBuffer ) return 0;
+
+	if ( SEC_E_OK == g_DFN.pfnQuerySecurityPackageInfoA( (SEC_CHAR*) pszPackage, &pPackageInfo ) && NULL != pPackageInfo )
+	{
+		cbMaxToken = pPackageInfo->cbMaxToken;
+		g_DFN.pfnFreeContextBuffer( pPackageInfo );
+	}
+	return cbMaxToken;
+}
+
 SECURITY_STATUS SEC_ENTRY Mine_InitializeSecurityContextA(
     PCredHandle phCredential,               // Cred to base context
     PCtxtHandle phContext,                  // Existing context (OPT)
@@ -981,6 +1155,10 @@ SECURITY_STATUS SEC_ENTRY Mine_InitializeSecurityContextA(
 {
 	SECURITY_STATUS rv;
 	char szTSBuffer[128];
+	uint64_t ui64Start = 0, ui64End = 0;
+	BOOL fSchannel = ( 0 != ( fContextReq & ISC_REQ_STREAM ) );	// Negotiate, Kerberos and NTLM never ask for a stream
+	SecPkgContext_ConnectionInfo ConnectionInfo;
+	SecPkgContext_SessionInfo SessionInfo;
 
     __try 
 	{
@@ -1007,7 +1185,9 @@ SECURITY_STATUS SEC_ENTRY Mine_InitializeSecurityContextA(
 
     __try 
 	{
-
+		ui64Start = PerfCounter();
+		if ( fSchannel ) TlsHandshakeLegStart( phContext, pszTargetName, pInput, ui64Start );
+		else NegoExchangeLegStart( phContext, pszTargetName, pInput, ui64Start );
 		rv = g_DFN.pfnInitializeSecurityContextA( phCredential,
 												  phContext,
 												  pszTargetName,
@@ -1020,14 +1200,45 @@ SECURITY_STATUS SEC_ENTRY Mine_InitializeSecurityContextA(
 												  pOutput,
 												  pfContextAttr,
 												  ptsExpiry );
+		ui64End = PerfCounter();
     } 
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
+    __try 
+	{
+		if ( fSchannel )
+		{
+			TlsHandshakeLegEnd( phNewContext, pOutput, rv, ui64End );
+			if ( SEC_E_OK == rv && NULL != g_DFN.pfnQueryContextAttributesA )
+			{
+				PCtxtHandle phDone = ( NULL != phNewContext ) ? phNewContext : phContext;
+				if ( SEC_E_OK == g_DFN.pfnQueryContextAttributesA( phDone, SECPKG_ATTR_CONNECTION_INFO, &ConnectionInfo ) )
+				{
+					TlsHandshakeConnectionInfo( &ConnectionInfo );
+				}
+				if ( SEC_E_OK == g_DFN.pfnQueryContextAttributesA( phDone, SECPKG_ATTR_SESSION_INFO, &SessionInfo ) )
+				{
+					TlsHandshakeSessionInfo( &SessionInfo );
+				}
+			}
+		}
+		else
+		{
+			NegoExchangeLegEnd( phNewContext, pOutput, rv, ui64End );
+		}
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
     __try 
 	{
 		O_HEX( phNewContext );
 		O_HEX( pOutput );
+		g_iLastTokenMech = NEGO_MECH_NONE;
 		DumpSecBufferOutputDesc( rv, pOutput );
+		if ( !fSchannel && NEGO_IS_KERBEROS( g_iLastTokenMech ) )
+		{
+			g_STATUS.fUsedKerberos = TRUE;
+		}
 		if ( NULL == pfContextAttr )
 		{
 			O_HEX( pfContextAttr );	
@@ -1039,12 +1250,14 @@ SECURITY_STATUS SEC_ENTRY Mine_InitializeSecurityContextA(
 		o_printf( "ptsExpiry                 = 0x%08x -> %s", ptsExpiry, DumpTimeStamp( ptsExpiry, szTSBuffer, sizeof(szTSBuffer) ) );
 		if ( SEC_E_OK == rv )
 		{
+			SaveNegotiatedPackage( ( NULL != phNewContext ) ? phNewContext : phContext );
 			o_printf( "EXIT  InitializeSecurityContextA returned SEC_E_OK" );
 		}
 		else
 		{
 			o_printf( "EXIT  InitializeSecurityContextA returned 0x%08x %s", rv, GetSecurityErrorString(rv) );
 		}
+		o_printf( "InitializeSecurityContextA took %.3f ms%s", PerfCounterToMs( ui64End - ui64Start ), ( fSchannel ) ? " (Schannel handshake leg)" : "" );
     } 
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -1330,6 +1543,207 @@ SECURITY_STATUS SEC_ENTRY Mine_QueryContextAttributesA(
     return rv;
 }
 
+RETCODE Mine_ConnectionOpen( CONNECTIONOBJECT* ConnectionObject, CHAR* szConnectionString, NETERR* neterrno )
+{
+	RETCODE rv;
+	uint64_t ui64Start, ui64End;
+
+	__try 
+	{
+		o_printf( "" );
+		o_printf( "ENTER ConnectionOpen" );
+		O_HEX( ConnectionObject );
+		O_STRINGA( szConnectionString );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.ConnectionOpen( ConnectionObject, szConnectionString, neterrno );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		NetlibStatsOpen( ConnectionObject, szConnectionString, ui64Start, ui64End );
+		if ( NULL != neterrno ) O_DEC( *neterrno );
+		o_printf( "ConnectionOpen returned %d in %.3f ms", rv, PerfCounterToMs( ui64End - ui64Start ) );
+		o_printf( "EXIT  ConnectionOpen" );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+RETCODE Mine_ConnectionOpenW( CONNECTIONOBJECT* ConnectionObject, WCHAR* wszServerName, NETERR* neterrno )
+{
+	RETCODE rv;
+	uint64_t ui64Start, ui64End;
+	char szServerName[128];
+
+	__try 
+	{
+		o_printf( "" );
+		o_printf( "ENTER ConnectionOpenW" );
+		O_HEX( ConnectionObject );
+		O_STRINGU( wszServerName );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.ConnectionOpenW( ConnectionObject, wszServerName, neterrno );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		szServerName[0] = '\0';
+		if ( NULL != wszServerName )
+		{
+			WideCharToMultiByte( CP_ACP, 0, wszServerName, -1, szServerName, sizeof(szServerName), NULL, NULL );
+			szServerName[sizeof(szServerName)-1] = '\0';
+		}
+		NetlibStatsOpen( ConnectionObject, szServerName, ui64Start, ui64End );
+		if ( NULL != neterrno ) O_DEC( *neterrno );
+		o_printf( "ConnectionOpenW returned %d in %.3f ms", rv, PerfCounterToMs( ui64End - ui64Start ) );
+		o_printf( "EXIT  ConnectionOpenW" );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+RETCODE Mine_ConnectionClose( CONNECTIONOBJECT* ConnectionObject, NETERR* neterrno )
+{
+	RETCODE rv;
+
+	__try 
+	{
+		o_printf( "" );
+		o_printf( "ENTER ConnectionClose" );
+		O_HEX( ConnectionObject );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try 
+	{
+		rv = g_DFN.ConnectionClose( ConnectionObject, neterrno );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		NetlibStatsClose( ConnectionObject );
+		o_printf( "ConnectionClose returned %d", rv );
+		o_printf( "EXIT  ConnectionClose" );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+BOOL Mine_ConnectionOption( CONNECTIONOBJECT* ConnectionObject, OPTSTRUCT* pOptions )
+{
+	BOOL rv;
+
+	__try 
+	{
+		o_printf( "" );
+		o_printf( "ENTER ConnectionOption" );
+		O_HEX( ConnectionObject );
+		if ( NULL != pOptions )
+		{
+			O_DEC( pOptions->iRequest );
+			O_BOOL( pOptions->fEncrypt );
+			O_DEC( pOptions->dwPacketSize );
+		}
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try 
+	{
+		rv = g_DFN.ConnectionOption( ConnectionObject, pOptions );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		NetlibStatsOption( ConnectionObject, pOptions );
+		o_printf( "ConnectionOption returned %s", (rv) ? "TRUE" : "FALSE" );
+		o_printf( "EXIT  ConnectionOption" );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+// ConnectionRead and ConnectionWrite are called for every packet, so they do not log
+// ENTER/EXIT.  They only record size and latency, see NetlibStats.cpp for the report.
+IOINT Mine_ConnectionRead( CONNECTIONOBJECT* ConnectionObject, BYTE* buffer, IOINT readcount, IOINT readmax, TIMEINT timeout, NETERR* neterrno )
+{
+	IOINT rv = 0;
+	uint64_t ui64Start, ui64End;
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.ConnectionRead( ConnectionObject, buffer, readcount, readmax, timeout, neterrno );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		NetlibStatsIO( ConnectionObject,
+					   NETLIB_IO_READ,
+					   buffer,
+					   readmax,
+					   rv,
+					   timeout,
+					   ( NULL != neterrno && 0 != *neterrno ),
+					   ui64Start,
+					   ui64End );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+IOINT Mine_ConnectionWrite( CONNECTIONOBJECT* ConnectionObject, BYTE* buffer, IOINT writecount, NETERR* neterrno )
+{
+	IOINT rv = 0;
+	uint64_t ui64Start, ui64End;
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.ConnectionWrite( ConnectionObject, buffer, writecount, neterrno );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		NetlibStatsIO( ConnectionObject,
+					   NETLIB_IO_WRITE,
+					   buffer,
+					   writecount,
+					   rv,
+					   0,
+					   ( NULL != neterrno && 0 != *neterrno ),
+					   ui64Start,
+					   ui64End );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
 BOOL Mine_ConnectionGetSvrUser( CONNECTIONOBJECT* ConnectionObject, char* szUserName )
 {
 	BOOL rv;
@@ -1532,6 +1946,24 @@ BOOL Mine_TermSession( DWORD dwKey )
 
 }
 
+// Revocation profile of the CertGetCertificateChain call in progress, CryptRetrieveObjectByUrlW
+// adds its retrievals to it.  See RevocationProfile.cpp for the analysis.
+static REV_CHAIN_PROFILE g_RevProfile;
+static BOOL g_fRevProfileActive = FALSE;
+
+// Same layout as CERT_CHAIN_PARA with CERT_CHAIN_PARA_HAS_EXTRA_FIELDS, which we do not define.
+typedef struct _CHAIN_PARA_EXTRA
+{
+	CERT_CHAIN_PARA  Base;
+	CERT_USAGE_MATCH RequestedIssuancePolicy;
+	DWORD            dwUrlRetrievalTimeout;
+} CHAIN_PARA_EXTRA;
+
+static void RevLogLine( const char* pszLine, void* pvContext )
+{
+	o_printf( "%s", pszLine );
+}
+
 BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 								   PCCERT_CONTEXT pCertContext,
 								   LPFILETIME pTime,
@@ -1542,6 +1974,7 @@ BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 								   PCCERT_CHAIN_CONTEXT* ppChainContext )
 {
 	BOOL rv;
+	uint64_t ui64Start = 0, ui64End = 0;
 	g_iStackDepth++;
     __try 
 	{
@@ -1549,13 +1982,20 @@ BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 		{
 			o_printf( "" );
 			o_printf( "ENTER CertGetCertificateChain" );
+			O_HEX( dwFlags );
 			g_pCertContext = pCertContext;
+			RevProfileStart( &g_RevProfile,
+							 dwFlags,
+							 ( NULL != pChainPara && pChainPara->cbSize >= offsetof(CHAIN_PARA_EXTRA, dwUrlRetrievalTimeout) + sizeof(DWORD) ) ? ((CHAIN_PARA_EXTRA*) pChainPara)->dwUrlRetrievalTimeout : 0,
+							 PerfCounterToUs( PerfCounter() ) );
+			g_fRevProfileActive = TRUE;
 		}
     } 
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
     __try 
 	{
+		ui64Start = PerfCounter();
 		rv = g_DFN.pfnCertGetCertificateChain( hChainEngine, 
 											   pCertContext,
 											   pTime,
@@ -1564,6 +2004,7 @@ BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 											   dwFlags,
 											   pvReserved,
 											   ppChainContext );
+		ui64End = PerfCounter();
     }
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -1571,8 +2012,23 @@ BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 	{
 		if (1 == g_iStackDepth)
 		{
-			o_printf( "CertGetCertificateChain returned %s", (rv) ? "TRUE" : "FALSE" );
+			TlsHandshakeChainBuild( dwFlags, rv, ui64Start, ui64End );
+			o_printf( "CertGetCertificateChain returned %s in %.3f ms", (rv) ? "TRUE" : "FALSE", PerfCounterToMs( ui64End - ui64Start ) );
 			if ( !rv ) o_printf( "GetLastError returned %lu\n", GetLastError() );
+
+			REV_ANALYSIS Analysis;
+			g_fRevProfileActive = FALSE;
+			RevProfileFinish( &g_RevProfile,
+							  ( rv && NULL != ppChainContext && NULL != *ppChainContext ) ? (*ppChainContext)->TrustStatus.dwErrorStatus : 0,
+							  PerfCounterToUs( PerfCounter() ) );
+			RevProfileAnalyze( &g_RevProfile, (uint32_t) GetTestOptionLong( "revocationslowms", REV_DEFAULT_SLOW_MS ), &Analysis );
+			RevProfileReport( &g_RevProfile, &Analysis, RevLogLine, NULL );
+
+			BOOL fRepeat;
+			CERT_CACHE_ENTRY* pEntry = CertCacheChainResult( pCertContext, pTime, rv,
+															 ( rv && NULL != ppChainContext && NULL != *ppChainContext ) ? (*ppChainContext)->TrustStatus.dwErrorStatus : 0,
+															 PerfCounterToMs( ui64End - ui64Start ), &fRepeat );
+			if ( fRepeat ) o_printf( "Same chain result as the previous %lu builds of [%s] in this window.", pEntry->cRepeatBuilds, pEntry->szSubject );
 			o_printf( "EXIT  CertGetCertificateChain" );
 		}
     }
@@ -1621,39 +2077,52 @@ BOOL __stdcall Mine_CertGetCertificateChain( HCERTCHAINENGINE hChainEngine,
 			o_printf( "  CertName           = %S", psz );
 			if ( !rv ) o_printf( "GetLastError returned %lu\n", GetLastError() );
 
-			WCHAR wszServerName[256];
-			size_t cchServerName = sizeof(wszServerName)/sizeof(WCHAR);
-			WCHAR wszSubjectName[256];
-			size_t cchSubjectName = sizeof(wszSubjectName)/sizeof(WCHAR);
-			DWORD cszServerName;
-			cszServerName = MultiByteToWideChar( CP_ACP, 
-										0, 
-										g_STATUS.g_szSavedFQDN, 
-										-1, 
-										NULL, 
-										0 );
-			cszServerName = MultiByteToWideChar( CP_ACP, 
-										0, 
-										g_STATUS.g_szSavedFQDN, 
-										-1, 
-										wszServerName, 
-										cszServerName );
-			if (0 ==  cszServerName)
+			// When pName is the subject of the certificate the chain was built for, parse that
+			// certificate so the SANs are checked too, the CN alone does not decide the result.
+			X509_CERT Cert;
+			X509_MATCH Match;
+			X509_SLICE CN;
+			uint8_t bCNTag = 0;
+			char szCN[X509_MAX_NAME], szSan[X509_MAX_NAME];
+			BOOL fLeaf = ( NULL != pName && NULL != g_pCertContext &&
+						   g_pCertContext->pCertInfo->Subject.cbData == pName->cbData &&
+						   0 == memcmp( g_pCertContext->pCertInfo->Subject.pbData, pName->pbData, pName->cbData ) );
+			DWORD i;
+
+			if ( fLeaf && X509_OK == X509Parse( g_pCertContext->pbCertEncoded, g_pCertContext->cbCertEncoded, &Cert ) )
 			{
-				o_printf("Server Name: [%s] cannot be converted to Unicode, VerifyServerCertificate will return SEC_E_WRONG_PRINCIPAL", g_STATUS.g_szSavedFQDN);
+				for ( i=0; i<Cert.cKeptSans; i++ ) o_printf( "  SubjectAltName     = %s", X509SanFormat( &Cert.rgSans[i], szSan, sizeof(szSan) ) );
+				X509SliceFormat( &Cert.SubjectCN, Cert.bSubjectCNTag, szCN, sizeof(szCN) );
+				X509MatchHostname( &Cert, g_STATUS.g_szSavedFQDN, &Match );
+				if ( X509_MATCH_NONE == Match.iResult || X509_MATCH_BAD_HOST == Match.iResult )
+				{
+					o_printf("Server name [%s] (%s) matches neither the %lu SANs nor the CN [%s], VerifyServerCertificate will return CERT_E_CN_NO_MATCH",
+							 g_STATUS.g_szSavedFQDN, X509MatchName(Match.iResult), Cert.cSans, szCN);
+					if ( Match.fCNIgnored ) o_printf("The CN matches, but a certificate with DNS SANs is only matched against its SANs");
+				}
+				else
+				{
+					if ( Match.iSan >= 0 ) X509SanFormat( &Cert.rgSans[Match.iSan], szSan, sizeof(szSan) );
+					else lstrcpyn( szSan, szCN, sizeof(szSan) );
+					o_printf("Server name [%s] matches %s [%s], VerifyServerCertificate will continue", g_STATUS.g_szSavedFQDN, X509MatchName(Match.iResult), szSan);
+				}
+				if ( !X509IsServerAuth( &Cert ) ) o_printf("The certificate is not valid for server authentication, its EKUs are %s", X509EkuFormat( &Cert, szSan, sizeof(szSan) ));
 			}
-
-			wcscpy_s(wszSubjectName, cchSubjectName, psz);
-			_wcsupr_s( wszSubjectName, cchSubjectName );
-			_wcsupr_s( wszServerName, cchServerName );
-
-			if( NULL == wcsstr(wszSubjectName, wszServerName) )
+			else if ( NULL != pName && X509_OK == X509ParseName( pName->pbData, pName->cbData, &CN, &bCNTag ) )
 			{
-				o_printf("Could not locate server name [%S] in subject [%S], VerifyServerCertificate will return CERT_E_CN_NO_MATCH", wszServerName, wszSubjectName);
+				X509SliceFormat( &CN, bCNTag, szCN, sizeof(szCN) );
+				if ( X509_MATCH_CN == X509MatchCN( &CN, bCNTag, g_STATUS.g_szSavedFQDN ) )
+				{
+					o_printf("Server name [%s] matches the CN [%s], VerifyServerCertificate will continue unless the certificate has SANs that do not include it", g_STATUS.g_szSavedFQDN, szCN);
+				}
+				else
+				{
+					o_printf("Server name [%s] does not match the CN [%s], VerifyServerCertificate will return CERT_E_CN_NO_MATCH unless a SAN matches", g_STATUS.g_szSavedFQDN, szCN);
+				}
 			}
 			else
 			{
-				o_printf("Successfully located server name [%S] in subject [%S], VerifyServerCertificate will continue", wszServerName, wszSubjectName);
+				o_printf("The name passed to CertNameToStrW cannot be parsed, the server name [%s] was not checked", g_STATUS.g_szSavedFQDN);
 			}
 
 			o_printf( "EXIT  CertNameToStrW" );
@@ -1672,6 +2141,7 @@ BOOL __stdcall Mine_CertVerifyCertificateChainPolicy( LPCSTR pszPolicyOID,
 											          PCERT_CHAIN_POLICY_STATUS pPolicyStatus )
 {
 	BOOL rv;
+	uint64_t ui64Start = 0, ui64End = 0;
 	g_iStackDepth++;
     __try 
 	{
@@ -1685,10 +2155,12 @@ BOOL __stdcall Mine_CertVerifyCertificateChainPolicy( LPCSTR pszPolicyOID,
 
     __try 
 	{
+		ui64Start = PerfCounter();
 		rv = g_DFN.pfnCertVerifyCertificateChainPolicy( pszPolicyOID,
 														pChainContext,
 														pPolicyPara,
 														pPolicyStatus );
+		ui64End = PerfCounter();
     }
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -1696,6 +2168,7 @@ BOOL __stdcall Mine_CertVerifyCertificateChainPolicy( LPCSTR pszPolicyOID,
 	{
 		if (1 == g_iStackDepth)
 		{
+			TlsHandshakePolicyCheck( ( NULL != pPolicyStatus ) ? pPolicyStatus->dwError : 0, ui64Start, ui64End );
 			if ( CERT_CHAIN_POLICY_SSL == pszPolicyOID)
 			{
 				o_printf("  pszPolicyOID = CERT_CHAIN_POLICY_SSL");
@@ -1709,15 +2182,28 @@ BOOL __stdcall Mine_CertVerifyCertificateChainPolicy( LPCSTR pszPolicyOID,
 				o_printf("  pPolicyPara->pvExtraPolicyPara->dwAuthType = %s", GetAuthType(ppolHttps->dwAuthType));
 				o_printf("  pPolicyPara->pvExtraPolicyPara->fdwChecks = 0x%08x", ppolHttps->fdwChecks);
 			}
-			o_printf( "CertVerifyCertificateChainPolicy returned %s", (rv) ? "TRUE" : "FALSE" );
+			o_printf( "CertVerifyCertificateChainPolicy returned %s in %.3f ms", (rv) ? "TRUE" : "FALSE", PerfCounterToMs( ui64End - ui64Start ) );
 			if ( pPolicyStatus ) 
 			{
 				o_printf( "pPolicyStatus->dwError=0x%08x (%s)", pPolicyStatus->dwError, GetCertChainPolicyStatusCode(pPolicyStatus->dwError) );
-				if (CERT_CHAIN_POLICY_SSL == pszPolicyOID && pPolicyStatus->dwError != 0)
+				if (CERT_CHAIN_POLICY_SSL == pszPolicyOID)
 				{
-					o_printf("ENTER DisplayCertChain");
-					DisplayCertChain(g_pCertContext, TRUE);
-					o_printf("EXIT DisplayCertChain");
+					PCCERT_CONTEXT pLeaf = ( NULL != pChainContext && pChainContext->cChain > 0 && pChainContext->rgpChain[0]->cElement > 0 )
+										   ? pChainContext->rgpChain[0]->rgpElement[0]->pCertContext : g_pCertContext;
+					BOOL fDump = CertCachePolicyResult( pLeaf, pPolicyStatus->dwError );
+					if (pPolicyStatus->dwError != 0)
+					{
+						if (fDump)
+						{
+							o_printf("ENTER DisplayCertChain");
+							DisplayCertChain(g_pCertContext, TRUE);
+							o_printf("EXIT DisplayCertChain");
+						}
+						else
+						{
+							o_printf("Certificate chain already displayed for this certificate and error, see the certificate summary.");
+						}
+					}
 				}
 			}
 			//DisplayCertChain(g_pCertContext, TRUE);
@@ -1741,6 +2227,7 @@ PCCERT_CHAIN_CONTEXT __stdcall Mine_CertFindChainInStore( HCERTSTORE hCertStore,
 												          PCCERT_CHAIN_CONTEXT pPrevChainContext )
 {
 	PCCERT_CHAIN_CONTEXT rv;
+	uint64_t ui64Start = 0, ui64End = 0;
 	g_iStackDepth++;
     __try 
 	{
@@ -1754,12 +2241,14 @@ PCCERT_CHAIN_CONTEXT __stdcall Mine_CertFindChainInStore( HCERTSTORE hCertStore,
 
     __try 
 	{
+		ui64Start = PerfCounter();
 		rv = g_DFN.pfnCertFindChainInStore( hCertStore,
 											dwCertEncodingType,
 											dwFindFlags,
 											dwFindType,
 											pvFindPara,
 											pPrevChainContext );
+		ui64End = PerfCounter();
     }
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -1767,7 +2256,7 @@ PCCERT_CHAIN_CONTEXT __stdcall Mine_CertFindChainInStore( HCERTSTORE hCertStore,
 	{
 		if (1 == g_iStackDepth)
 		{
-			o_printf( "CertFindChainInStore returned 0x%08x", rv );
+			o_printf( "CertFindChainInStore returned 0x%08x in %.3f ms", rv, PerfCounterToMs( ui64End - ui64Start ) );
 			if ( !rv ) o_printf( "GetLastError returned %lu\n", GetLastError() );
 			o_printf( "EXIT  CertFindChainInStore" );
 		}
@@ -1779,6 +2268,111 @@ PCCERT_CHAIN_CONTEXT __stdcall Mine_CertFindChainInStore( HCERTSTORE hCertStore,
 
 }
 
+// Every CRL, OCSP and AIA download the chain engine does goes through here.  Retrievals made
+// during a CertGetCertificateChain call are added to its revocation profile.
+BOOL __stdcall Mine_CryptRetrieveObjectByUrlW( LPCWSTR pszUrl,
+											   LPCSTR pszObjectOid,
+											   DWORD dwRetrievalFlags,
+											   DWORD dwTimeout,
+											   LPVOID* ppvObject,
+											   HCRYPTASYNC hAsyncRetrieve,
+											   PCRYPT_CREDENTIALS pCredentials,
+											   LPVOID pvVerify,
+											   LPVOID pAuxInfo )
+{
+	BOOL rv = FALSE;
+	DWORD dwError = 0;
+	uint64_t ui64Start = 0, ui64End = 0;
+	char szUrl[REV_URL_SIZE];
+	BOOL fCacheOnly = ( 0 != ( dwRetrievalFlags & CRYPT_CACHE_ONLY_RETRIEVAL ) );
+
+    __try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.pfnCryptRetrieveObjectByUrlW( pszUrl,
+												 pszObjectOid,
+												 dwRetrievalFlags,
+												 dwTimeout,
+												 ppvObject,
+												 hAsyncRetrieve,
+												 pCredentials,
+												 pvVerify,
+												 pAuxInfo );
+		ui64End = PerfCounter();
+		if ( !rv ) dwError = GetLastError();
+    }
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+    __try 
+	{
+		szUrl[0] = '\0';
+		if ( NULL != pszUrl ) WideCharToMultiByte( CP_ACP, 0, pszUrl, -1, szUrl, sizeof(szUrl), NULL, NULL );
+		szUrl[sizeof(szUrl)-1] = '\0';
+
+		if ( g_fRevProfileActive )
+		{
+			RevProfileAddRetrieval( &g_RevProfile, szUrl, PerfCounterToUs( ui64End - ui64Start ), dwTimeout, rv, dwError, fCacheOnly );
+		}
+		o_printf( "CryptRetrieveObjectByUrlW%s [%s] timeout %lu ms %s in %.3f ms",
+				  ( fCacheOnly ) ? " (cache only)" : "",
+				  szUrl,
+				  dwTimeout,
+				  ( rv ) ? "succeeded" : "failed",
+				  PerfCounterToMs( ui64End - ui64Start ) );
+		if ( !rv ) o_printf( "GetLastError returned 0x%08x", dwError );
+    }
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	if ( !rv ) SetLastError( dwError );
+	return rv;
+}
+
+// EncryptMessage and DecryptMessage are called for every TLS record, so like the dbnetlib
+// read/write detours they do not log.  They only feed TlsStats.cpp.
+SECURITY_STATUS SEC_ENTRY Mine_EncryptMessage( PCtxtHandle phContext, unsigned long fQOP, PSecBufferDesc pMessage, unsigned long MessageSeqNo )
+{
+	SECURITY_STATUS rv = SEC_E_INTERNAL_ERROR;
+	uint64_t ui64Start, ui64End;
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.pfnEncryptMessage( phContext, fQOP, pMessage, MessageSeqNo );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		TlsStatsEncrypt( pMessage, rv, ui64Start, ui64End );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
+SECURITY_STATUS SEC_ENTRY Mine_DecryptMessage( PCtxtHandle phContext, PSecBufferDesc pMessage, unsigned long MessageSeqNo, unsigned long* pfQOP )
+{
+	SECURITY_STATUS rv = SEC_E_INTERNAL_ERROR;
+	uint64_t ui64Start, ui64End;
+
+	__try 
+	{
+		ui64Start = PerfCounter();
+		rv = g_DFN.pfnDecryptMessage( phContext, pMessage, MessageSeqNo, pfQOP );
+		ui64End = PerfCounter();
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	__try
+	{
+		TlsStatsDecrypt( pMessage, rv, ui64Start, ui64End );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER) {};
+
+	return rv;
+}
+
 #define ERR_LOAD_FUNCTION( pfunc, funcdef, mod, funcname )			\
 	{	pfunc = (funcdef) GetProcAddress( mod, funcname );			\
 		if ( NULL == pfunc )										\
@@ -1809,6 +2403,10 @@ HRESULT LoadDLLAndFunctions()
 	g_hModCrypt32 = NULL;
 	g_hModCrypt32 = LoadLibrary( "crypt32.dll" );
 
+	// Attempt to load cryptnet.dll, optional like crypt32.dll.
+	g_hModCryptNet = NULL;
+	g_hModCryptNet = LoadLibrary( "cryptnet.dll" );
+
 	if ( NULL == g_hModSecurity ) 
 	{
 		return E_SSPI_SECUR32_MODULE_LOAD_FAILURE;
@@ -1847,11 +2445,12 @@ HRESULT LoadDLLAndFunctions()
 						   g_hModSecurity, 
 						   "QuerySecurityPackageInfoA" );
 
-		/*
 		ERR_LOAD_FUNCTION( g_DFN.pfnFreeContextBuffer,	
 						   FREE_CONTEXT_BUFFER_FN,
 						   g_hModSecurity, 
 						   "FreeContextBuffer" );
+
+		/*
 		ERR_LOAD_FUNCTION( g_DFN.pfnDeleteSecurityContext,	
 						   DELETE_SECURITY_CONTEXT_FN,
 						   g_hModSecurity, 
@@ -1863,7 +2462,47 @@ HRESULT LoadDLLAndFunctions()
 						   g_hModSecurity, 
 						   "QueryContextAttributesA" );
 
+		ERR_LOAD_FUNCTION( g_DFN.pfnEncryptMessage,
+						   ENCRYPT_MESSAGE_FN,
+						   g_hModSecurity, 
+						   "EncryptMessage" );
+
+		ERR_LOAD_FUNCTION( g_DFN.pfnDecryptMessage,
+						   DECRYPT_MESSAGE_FN,
+						   g_hModSecurity, 
+						   "DecryptMessage" );
+
 		// Load dbnetlib functions.
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionOpen,
+						   ConnectionOpen_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionOpen" );
+
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionOpenW,
+						   ConnectionOpenW_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionOpenW" );
+
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionClose,
+						   ConnectionClose_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionClose" );
+
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionOption,
+						   ConnectionOption_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionOption" );
+
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionRead,
+						   ConnectionRead_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionRead" );
+
+		ERR_LOAD_FUNCTION( g_DFN.ConnectionWrite,
+						   ConnectionWrite_FN,
+						   g_hModDBNetlib, 
+						   "ConnectionWrite" );
+
 		ERR_LOAD_FUNCTION( g_DFN.ConnectionGetSvrUser,
 						   ConnectionGetSvrUser_FN,
 						   g_hModDBNetlib, 
@@ -1917,6 +2556,15 @@ HRESULT LoadDLLAndFunctions()
 							   "CertFindChainInStore" );
 		}
 
+		// Load Cryptnet functions.
+		if ( NULL != g_hModCryptNet )
+		{
+			ERR_LOAD_FUNCTION( g_DFN.pfnCryptRetrieveObjectByUrlW,
+							   CryptRetrieveObjectByUrlW_FN,
+							   g_hModCryptNet, 
+							   "CryptRetrieveObjectByUrlW" );
+		}
+
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -1979,6 +2627,30 @@ HRESULT StartDetouring( void )
 					 Mine_QueryContextAttributesA );	
 		
 		// Detour dbnetlib functions. 
+		DETOUR_FUNC( g_DFN.ConnectionOpen,
+					 ConnectionOpen_FN,
+					 Mine_ConnectionOpen );	
+
+		DETOUR_FUNC( g_DFN.ConnectionOpenW,
+					 ConnectionOpenW_FN,
+					 Mine_ConnectionOpenW );	
+
+		DETOUR_FUNC( g_DFN.ConnectionClose,
+					 ConnectionClose_FN,
+					 Mine_ConnectionClose );	
+
+		DETOUR_FUNC( g_DFN.ConnectionOption,
+					 ConnectionOption_FN,
+					 Mine_ConnectionOption );	
+
+		DETOUR_FUNC( g_DFN.ConnectionRead,
+					 ConnectionRead_FN,
+					 Mine_ConnectionRead );	
+
+		DETOUR_FUNC( g_DFN.ConnectionWrite,
+					 ConnectionWrite_FN,
+					 Mine_ConnectionWrite );	
+
 		DETOUR_FUNC( g_DFN.ConnectionGetSvrUser,
 					 ConnectionGetSvrUser_FN,
 					 Mine_ConnectionGetSvrUser );	
@@ -2019,6 +2691,22 @@ HRESULT StartDetouring( void )
 						 CertFindChainInStore_FN,
 						 Mine_CertFindChainInStore );	
 		}
+
+		// Detour cryptnet functions
+		if ( NULL != g_hModCryptNet )
+		{
+			DETOUR_FUNC( g_DFN.pfnCryptRetrieveObjectByUrlW,
+						 CryptRetrieveObjectByUrlW_FN,
+						 Mine_CryptRetrieveObjectByUrlW );
+		}
+
+		// Detour Schannel record functions
+		DETOUR_FUNC( g_DFN.pfnEncryptMessage,
+					 ENCRYPT_MESSAGE_FN,
+					 Mine_EncryptMessage );
+		DETOUR_FUNC( g_DFN.pfnDecryptMessage,
+					 DECRYPT_MESSAGE_FN,
+					 Mine_DecryptMessage );
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -2068,6 +2756,24 @@ HRESULT StopDetouring( void )
 							Mine_QueryContextAttributesA );
 
 		// Remove dbnetlib detours.
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionOpen,
+							Mine_ConnectionOpen );
+
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionOpenW,
+							Mine_ConnectionOpenW );
+
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionClose,
+							Mine_ConnectionClose );
+
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionOption,
+							Mine_ConnectionOption );
+
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionRead,
+							Mine_ConnectionRead );
+
+		DETOUR_REMOVE_FUNC( g_DFN.ConnectionWrite,
+							Mine_ConnectionWrite );
+
 		DETOUR_REMOVE_FUNC( g_DFN.ConnectionGetSvrUser,
 							Mine_ConnectionGetSvrUser );
 
@@ -2101,6 +2807,19 @@ HRESULT StopDetouring( void )
 			*/
 		}
 
+		// Remove cryptnet.dll functions
+		if ( NULL != g_hModCryptNet )
+		{
+			DETOUR_REMOVE_FUNC( g_DFN.pfnCryptRetrieveObjectByUrlW,
+								Mine_CryptRetrieveObjectByUrlW );
+		}
+
+		// Remove Schannel record functions
+		DETOUR_REMOVE_FUNC( g_DFN.pfnEncryptMessage,
+							Mine_EncryptMessage );
+		DETOUR_REMOVE_FUNC( g_DFN.pfnDecryptMessage,
+							Mine_DecryptMessage );
+
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER) {};
 
@@ -37,6 +37,20 @@ typedef PCCERT_CHAIN_CONTEXT (WINAPI * CertFindChainInStore_FN)(
     PCCERT_CHAIN_CONTEXT pPrevChainContext
     );
 
+// cryptnet.dll, the chain engine's CRL/OCSP/AIA downloader.  pAuxInfo is a
+// PCRYPT_RETRIEVE_AUX_INFO, kept as a pointer so the typedef does not depend on the SDK version.
+typedef BOOL (WINAPI * CryptRetrieveObjectByUrlW_FN)(
+    LPCWSTR pszUrl,
+    LPCSTR pszObjectOid,
+    DWORD dwRetrievalFlags,
+    DWORD dwTimeout,
+    LPVOID* ppvObject,
+    HCRYPTASYNC hAsyncRetrieve,
+    PCRYPT_CREDENTIALS pCredentials,
+    LPVOID pvVerify,
+    LPVOID pAuxInfo
+    );
+
 HRESULT StartDetouring(void);
 HRESULT StopDetouring(void);
 
@@ -45,6 +59,10 @@ HRESULT CloseLogFile();
 void o_printf( char* lpszFormat, ... );
 BSTR AnsiToBSTR( char* s );
 void DumpHex( void* pData, unsigned long length );
+char* GetSecurityErrorString( DWORD dwError );
+char* GetCertChainPolicyStatusCode( DWORD dwError );
+void ScanCertStoreNames( const char* pszStore, const char* pszHost );
+DWORD GetPackageMaxToken( const char* pszPackage );
 
 #define TOKEN_SOURCE_LEN ((8+1) * 2)
 #define MAX_USERNAME  ((256+1) * 2)
@@ -75,3 +93,4 @@ typedef struct _THREAD_USER
 extern BOOL		g_fFunctionsDetoured;
 extern HANDLE	g_hLogFile;
 extern BOOL		g_fSupressOutput;
+extern BOOL		g_fLogPaused;
@@ -0,0 +1,755 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// DirectorySession.cpp: a global catalog search interface kept open for the run, batched SPN
+// lookups over it or over an offline SPN index and a cache of the SPNs and accounts they found,
+// and the forest-wide SPN audit that streams every SPN through the session.
+//
+
+#include "stdafx.h"
+#include <time.h>
+#include "DirectorySession.h"
+#include "DynamicADSI.h"
+#include "PerfStats.h"
+#include "SpnAudit.h"
+#include "SpnIndex.h"
+#include "TestOptions.h"
+
+static IDirectorySearch* g_pDirSearch = NULL;
+static BOOL    g_fDirOpenTried = FALSE;		// Only try to bind once per run, a failure is logged once
+static HRESULT g_hrDirOpen = S_OK;
+static SPN_INDEX g_DirIndex;					// spnindex=<file>, used instead of the global catalog
+static BOOL    g_fDirIndex = FALSE;
+
+static DIR_SPN_ENTRY g_rgDirSPNs[DIR_MAX_SPNS];
+static DWORD g_cDirSPNs = 0;
+static DIR_ACCOUNT g_rgDirAccounts[DIR_MAX_ACCOUNTS];
+static DWORD g_cDirAccounts = 0;
+static DWORD g_cDirAccountsDropped = 0;
+static DWORD g_cDirSearches = 0;
+static double g_dDirSearchMs = 0;
+
+// Maps the offline index named by spnindex.  FALSE if the option is not set.
+static BOOL OpenSpnIndex( HRESULT* phr )
+{
+	char szPath[MAX_PATH];
+	char szCreated[64] = "";
+	struct tm tmCreated;
+	time_t tCreated;
+	int rc;
+
+	GetTestOptionString( "spnindex", "", szPath, sizeof(szPath) );
+	if ( '\0' == szPath[0] ) return FALSE;
+
+	rc = SpnIndexOpen( &g_DirIndex, szPath );
+	if ( 0 != rc )
+	{
+		o_printf( "Cannot open the SPN index %s (%d%s), SPNs are not looked up.", szPath, rc, ( -1 == rc ) ? ", not an SPN index or damaged" : "" );
+		*phr = E_FAIL;
+		return TRUE;
+	}
+
+	tCreated = (time_t) g_DirIndex.pHeader->ui64Created;
+	if ( 0 == gmtime_s( &tmCreated, &tCreated ) ) strftime( szCreated, sizeof(szCreated), "%Y-%m-%d %H:%M:%S UTC", &tmCreated );
+	o_printf( "Using the offline SPN index %s instead of Active Directory: %lu SPNs on %lu accounts, built %s",
+			  szPath, g_DirIndex.pHeader->cSpns, g_DirIndex.pHeader->cAccounts, szCreated );
+	g_fDirIndex = TRUE;
+	*phr = S_OK;
+	return TRUE;
+}
+
+// Binds to the global catalog of the forest and sets up paged subtree searches.  The bind is the
+// expensive part of a lookup, later calls return the same interface.  With spnindex the offline
+// index is used instead and nothing is bound.
+HRESULT DirSessionOpen()
+{
+	HRESULT hr;
+	VARIANT var;
+	ULONG lFetch = 0;
+	IADsContainer* pIADsContainer = NULL;
+	IUnknown* pIUnknown = NULL;
+	IEnumVARIANT* pIEnumVARIANT = NULL;
+	IDispatch* pIDispatch = NULL;
+	ADS_SEARCHPREF_INFO rgSearchPrefs[3];
+
+	if ( NULL != g_pDirSearch || g_fDirIndex ) return S_OK;
+	if ( g_fDirOpenTried ) return g_hrDirOpen;
+	g_fDirOpenTried = TRUE;
+
+	if ( OpenSpnIndex( &g_hrDirOpen ) ) return g_hrDirOpen;
+
+	VariantInit( &var );
+
+	if ( !LoadADSI() )
+	{
+		o_printf( "Failed to load activeds.dll, cannot talk to AD.  This can happen on Windows 9x and NT 4 machines." );
+		g_hrDirOpen = E_FAIL;
+		return g_hrDirOpen;
+	}
+
+	g_STATUS.fLoadedADSI = TRUE;
+
+	hr = GetGCIADsContainer( &pIADsContainer );
+	if ( FAILED(hr) || NULL == pIADsContainer )
+	{
+		o_printf( "ADsOpenObject( \"GC:\",...,ADS_SECURE_AUTHENTICATION) failed with HRESULT=0x%08x", hr );
+		if ( SUCCEEDED(hr) ) hr = E_FAIL;
+		goto DirSessionOpenExit;
+	}
+
+	g_STATUS.fGetGCIADsContainer = TRUE;
+
+	hr = pIADsContainer->get__NewEnum( &pIUnknown );
+	if ( FAILED(hr) )
+	{
+		o_printf( "get__NewEnum failed, hr=0x%08x", hr );
+		goto DirSessionOpenExit;
+	}
+
+	hr = pIUnknown->QueryInterface( IID_IEnumVARIANT, (void**) &pIEnumVARIANT );
+	if ( FAILED(hr) )
+	{
+		o_printf( "QueryInterface(IID_IEnumVARIANT) failed, hr=0x%08x", hr );
+		goto DirSessionOpenExit;
+	}
+
+	// The GC: container holds one object, the global catalog of this forest.
+	hr = pIEnumVARIANT->Next( 1, &var, &lFetch );
+	if ( FAILED(hr) || 1 != lFetch )
+	{
+		o_printf( "pIEnumVARIANT->Next failed, hr=0x%08x", hr );
+		if ( SUCCEEDED(hr) ) hr = E_FAIL;
+		goto DirSessionOpenExit;
+	}
+
+	pIDispatch = V_DISPATCH(&var);
+	hr = pIDispatch->QueryInterface( __uuidof(guid_IID_IDirectorySearch), (void**) &g_pDirSearch );
+	VariantClear( &var );
+	pIDispatch = NULL;	// Released by VariantClear.
+
+	if ( FAILED(hr) )
+	{
+		o_printf( "QueryInterface(IID_IDirectorySearch) failed, hr=0x%08x", hr );
+		g_pDirSearch = NULL;
+		goto DirSessionOpenExit;
+	}
+
+	// Subtree, paged so a batch that matches many accounts is not cut off by the server's size
+	// limit, and without keeping rows in the client once they have been read.
+	rgSearchPrefs[0].dwSearchPref	 = ADS_SEARCHPREF_SEARCH_SCOPE;
+	rgSearchPrefs[0].vValue.dwType	 = ADSTYPE_INTEGER;
+	rgSearchPrefs[0].vValue.Integer	 = ADS_SCOPE_SUBTREE;
+	rgSearchPrefs[1].dwSearchPref	 = ADS_SEARCHPREF_PAGESIZE;
+	rgSearchPrefs[1].vValue.dwType	 = ADSTYPE_INTEGER;
+	rgSearchPrefs[1].vValue.Integer	 = DIR_PAGE_SIZE;
+	rgSearchPrefs[2].dwSearchPref	 = ADS_SEARCHPREF_CACHE_RESULTS;
+	rgSearchPrefs[2].vValue.dwType	 = ADSTYPE_BOOLEAN;
+	rgSearchPrefs[2].vValue.Boolean	 = FALSE;
+
+	hr = g_pDirSearch->SetSearchPreference( rgSearchPrefs, 3 );
+	if ( FAILED(hr) )
+	{
+		o_printf( "SetSearchPreference failed, hr=0x%08x", hr );
+		g_pDirSearch->Release();
+		g_pDirSearch = NULL;
+		goto DirSessionOpenExit;
+	}
+
+DirSessionOpenExit:
+
+	if ( NULL != pIEnumVARIANT ) pIEnumVARIANT->Release();
+	if ( NULL != pIUnknown ) pIUnknown->Release();
+	if ( NULL != pIADsContainer ) pIADsContainer->Release();
+	g_hrDirOpen = hr;
+	return hr;
+}
+
+void DirSessionClose()
+{
+	if ( g_cDirSearches > 0 )
+	{
+		o_printf( "Directory session: %lu SPNs looked up in %lu searches, %.3f ms in all, %lu accounts cached",
+				  g_cDirSPNs, g_cDirSearches, g_dDirSearchMs, g_cDirAccounts );
+	}
+
+	if ( NULL != g_pDirSearch )
+	{
+		g_pDirSearch->Release();
+		g_pDirSearch = NULL;
+	}
+	if ( g_fDirIndex )
+	{
+		SpnIndexClose( &g_DirIndex );
+		g_fDirIndex = FALSE;
+	}
+	g_fDirOpenTried = FALSE;
+	g_hrDirOpen = S_OK;
+	g_cDirSPNs = 0;
+	g_cDirAccounts = 0;
+	g_cDirAccountsDropped = 0;
+	g_cDirSearches = 0;
+	g_dDirSearchMs = 0;
+}
+
+static DIR_SPN_ENTRY* GetSpnEntry( const char* pszSPN, BOOL fAdd )
+{
+	DIR_SPN_ENTRY* pEntry = NULL;
+	DWORD i;
+
+	for ( i=0; i<g_cDirSPNs; i++ )
+	{
+		if ( 0 == lstrcmpi( g_rgDirSPNs[i].szSpn, pszSPN ) ) return &g_rgDirSPNs[i];
+	}
+
+	if ( !fAdd || g_cDirSPNs >= DIR_MAX_SPNS || lstrlen( pszSPN ) >= DIR_MAX_SPN_LENGTH ) return NULL;
+
+	pEntry = &g_rgDirSPNs[g_cDirSPNs++];
+	ZeroMemory( pEntry, sizeof(*pEntry) );
+	lstrcpyn( pEntry->szSpn, pszSPN, sizeof(pEntry->szSpn) );
+	return pEntry;
+}
+
+// Appends (servicePrincipalName=<spn>) with the filter special characters escaped as RFC 4515
+// asks.  FALSE if it does not fit, the filter is left as it was.
+static BOOL AppendSpnFilter( WCHAR* pwszFilter, size_t cchFilter, size_t* pichFilter, const char* pszSPN )
+{
+	static const WCHAR wszPrefix[] = L"(servicePrincipalName=";
+	WCHAR wszSPN[DIR_MAX_SPN_LENGTH];
+	size_t ich = *pichFilter;
+	int cch, i;
+
+	cch = MultiByteToWideChar( CP_ACP, 0, pszSPN, -1, wszSPN, DIR_MAX_SPN_LENGTH );
+	if ( cch <= 1 ) return FALSE;
+	cch--;
+
+	// Worst case every character is escaped, plus ")" and the terminator.
+	if ( ich + ( sizeof(wszPrefix) / sizeof(WCHAR) ) + 3 * cch + 2 > cchFilter ) return FALSE;
+
+	for ( i=0; L'\0' != wszPrefix[i]; i++ ) pwszFilter[ich++] = wszPrefix[i];
+	for ( i=0; i<cch; i++ )
+	{
+		switch ( wszSPN[i] )
+		{
+			case L'*':  pwszFilter[ich++] = L'\\'; pwszFilter[ich++] = L'2'; pwszFilter[ich++] = L'a'; break;
+			case L'(':  pwszFilter[ich++] = L'\\'; pwszFilter[ich++] = L'2'; pwszFilter[ich++] = L'8'; break;
+			case L')':  pwszFilter[ich++] = L'\\'; pwszFilter[ich++] = L'2'; pwszFilter[ich++] = L'9'; break;
+			case L'\\': pwszFilter[ich++] = L'\\'; pwszFilter[ich++] = L'5'; pwszFilter[ich++] = L'c'; break;
+			default:    pwszFilter[ich++] = wszSPN[i]; break;
+		}
+	}
+	pwszFilter[ich++] = L')';
+	pwszFilter[ich] = L'\0';
+	*pichFilter = ich;
+	return TRUE;
+}
+
+static BOOL GetColumnString( ADS_SEARCH_HANDLE hSearch, LPWSTR pwszName, char* pszBuffer, int cchBuffer )
+{
+	ADS_SEARCH_COLUMN col;
+	BOOL fRet = FALSE;
+
+	pszBuffer[0] = '\0';
+	if ( FAILED( g_pDirSearch->GetColumn( hSearch, pwszName, &col ) ) ) return FALSE;
+	if ( col.dwNumValues > 0 && NULL != col.pADsValues->CaseIgnoreString )
+	{
+		// CaseIgnoreString, DNString and CaseExactString share the same LPWSTR in the union.
+		fRet = ( 0 != WideCharToMultiByte( CP_ACP, 0, col.pADsValues->CaseIgnoreString, -1, pszBuffer, cchBuffer, NULL, NULL ) );
+		if ( !fRet ) pszBuffer[0] = '\0';
+	}
+	g_pDirSearch->FreeColumn( &col );
+	return fRet;
+}
+
+static BOOL GetColumnDword( ADS_SEARCH_HANDLE hSearch, LPWSTR pwszName, DWORD* pdwValue )
+{
+	ADS_SEARCH_COLUMN col;
+	BOOL fRet = FALSE;
+
+	*pdwValue = 0;
+	if ( FAILED( g_pDirSearch->GetColumn( hSearch, pwszName, &col ) ) ) return FALSE;
+	if ( col.dwNumValues > 0 && ADSTYPE_INTEGER == col.pADsValues->dwType )
+	{
+		*pdwValue = col.pADsValues->Integer;
+		fRet = TRUE;
+	}
+	g_pDirSearch->FreeColumn( &col );
+	return fRet;
+}
+
+static void AddOwner( DIR_SPN_ENTRY* pEntry, DWORD iAccount )
+{
+	DWORD i;
+
+	// Accounts that are not cached cannot be told apart, each one is another owner.
+	for ( i=0; i<min( pEntry->cOwners, DIR_MAX_OWNERS ) && DIR_ACCOUNT_NOT_CACHED != iAccount; i++ )
+	{
+		if ( pEntry->rgiOwners[i] == iAccount ) return;
+	}
+	if ( pEntry->cOwners < DIR_MAX_OWNERS ) pEntry->rgiOwners[pEntry->cOwners] = iAccount;
+	pEntry->cOwners++;
+}
+
+// Reads the account in the current row into the cache and records it as an owner of each SPN of
+// the batch it carries, as DIR_ACCOUNT_NOT_CACHED once the cache is full.  Columns are read by
+// name so ADSI allocates no column names.
+static void ReadAccountRow( ADS_SEARCH_HANDLE hSearch, DIR_SPN_ENTRY** rgpBatch, DWORD cBatch )
+{
+	DIR_ACCOUNT* pAccount = NULL;
+	ADS_SEARCH_COLUMN col;
+	char szDN[sizeof(pAccount->szDN)];
+	char szValue[DIR_MAX_SPN_LENGTH];
+	DWORD iAccount, i, j;
+	size_t ichSPNs = 0, cchValue;
+	BOOL fNew = FALSE;
+
+	if ( !GetColumnString( hSearch, L"distinguishedName", szDN, sizeof(szDN) ) ) return;
+
+	// An account can come back in more than one batch.
+	for ( iAccount=0; iAccount<g_cDirAccounts; iAccount++ )
+	{
+		if ( 0 == lstrcmpi( g_rgDirAccounts[iAccount].szDN, szDN ) ) break;
+	}
+	if ( iAccount == g_cDirAccounts && g_cDirAccounts >= DIR_MAX_ACCOUNTS )
+	{
+		g_cDirAccountsDropped++;
+		iAccount = DIR_ACCOUNT_NOT_CACHED;
+	}
+	else if ( iAccount == g_cDirAccounts )
+	{
+		pAccount = &g_rgDirAccounts[g_cDirAccounts++];
+		ZeroMemory( pAccount, sizeof(*pAccount) );
+		lstrcpyn( pAccount->szDN, szDN, sizeof(pAccount->szDN) );
+		GetColumnString( hSearch, L"sAMAccountName", pAccount->szSamAccountName, sizeof(pAccount->szSamAccountName) );
+		GetColumnString( hSearch, L"dnsHostName", pAccount->szDnsHostName, sizeof(pAccount->szDnsHostName) );
+		GetColumnDword( hSearch, L"userAccountControl", &pAccount->dwUserAccountControl );
+		pAccount->fEncryptionTypes = GetColumnDword( hSearch, L"msDS-SupportedEncryptionTypes", &pAccount->dwEncryptionTypes );
+		fNew = TRUE;
+	}
+
+	if ( FAILED( g_pDirSearch->GetColumn( hSearch, L"servicePrincipalName", &col ) ) ) return;
+
+	for ( i=0; i<col.dwNumValues; i++ )
+	{
+		if ( NULL == col.pADsValues[i].CaseIgnoreString ) continue;
+		if ( 0 == WideCharToMultiByte( CP_ACP, 0, col.pADsValues[i].CaseIgnoreString, -1, szValue, sizeof(szValue), NULL, NULL ) ) continue;
+
+		if ( fNew )
+		{
+			pAccount->cSPNs++;
+			cchValue = strlen( szValue ) + 1;
+			if ( ichSPNs + cchValue < sizeof(pAccount->szSPNs) )
+			{
+				memcpy( &pAccount->szSPNs[ichSPNs], szValue, cchValue );
+				ichSPNs += cchValue;
+			}
+			else
+			{
+				pAccount->fSPNsTruncated = TRUE;
+			}
+		}
+
+		for ( j=0; j<cBatch; j++ )
+		{
+			if ( 0 == lstrcmpi( rgpBatch[j]->szSpn, szValue ) ) AddOwner( rgpBatch[j], iAccount );
+		}
+	}
+	g_pDirSearch->FreeColumn( &col );
+}
+
+static HRESULT SearchBatch( WCHAR* pwszFilter, DIR_SPN_ENTRY** rgpBatch, DWORD cBatch )
+{
+	LPOLESTR rgwszAttributes[] = { L"distinguishedName", L"sAMAccountName", L"dnsHostName", L"servicePrincipalName",
+								   L"userAccountControl", L"msDS-SupportedEncryptionTypes" };
+	ADS_SEARCH_HANDLE hSearch = NULL;
+	HRESULT hr;
+	DWORD cRows = 0, i;
+	uint64_t ui64Start;
+	double dMs;
+
+	ui64Start = PerfCounter();
+	hr = g_pDirSearch->ExecuteSearch( pwszFilter, rgwszAttributes, sizeof(rgwszAttributes) / sizeof(rgwszAttributes[0]), &hSearch );
+	if ( FAILED(hr) )
+	{
+		o_printf( "ExecuteSearch failed, hr=0x%08x", hr );
+		for ( i=0; i<cBatch; i++ ) rgpBatch[i]->hr = hr;
+		return hr;
+	}
+
+	// GetNextRow asks for the next page when the current one is used up.
+	hr = g_pDirSearch->GetFirstRow( hSearch );
+	while ( SUCCEEDED(hr) && S_ADS_NOMORE_ROWS != hr )
+	{
+		cRows++;
+		ReadAccountRow( hSearch, rgpBatch, cBatch );
+		hr = g_pDirSearch->GetNextRow( hSearch );
+	}
+	g_pDirSearch->CloseSearchHandle( hSearch );
+
+	dMs = PerfElapsedMs( ui64Start );
+	g_cDirSearches++;
+	g_dDirSearchMs += dMs;
+
+	if ( FAILED(hr) )
+	{
+		o_printf( "GetNextRow failed after %lu rows, hr=0x%08x", cRows, hr );
+		for ( i=0; i<cBatch; i++ ) rgpBatch[i]->hr = hr;
+		return hr;
+	}
+
+	for ( i=0; i<cBatch; i++ )
+	{
+		rgpBatch[i]->fSearched = TRUE;
+		rgpBatch[i]->hr = S_OK;
+	}
+	o_printf( "Directory search for %lu SPNs returned %lu accounts in %.3f ms", cBatch, cRows, dMs );
+	return S_OK;
+}
+
+// The cache index of an account from the offline index, DIR_ACCOUNT_NOT_CACHED if the cache is full.
+static DWORD AddIndexAccount( const SPN_INDEX_OWNER* pOwner )
+{
+	DIR_ACCOUNT* pAccount = NULL;
+	DWORD iAccount;
+
+	for ( iAccount=0; iAccount<g_cDirAccounts; iAccount++ )
+	{
+		if ( 0 == lstrcmpi( g_rgDirAccounts[iAccount].szDN, pOwner->pszDN ) ) return iAccount;
+	}
+	if ( g_cDirAccounts >= DIR_MAX_ACCOUNTS )
+	{
+		g_cDirAccountsDropped++;
+		return DIR_ACCOUNT_NOT_CACHED;
+	}
+
+	pAccount = &g_rgDirAccounts[g_cDirAccounts];
+	ZeroMemory( pAccount, sizeof(*pAccount) );
+	lstrcpyn( pAccount->szDN, pOwner->pszDN, sizeof(pAccount->szDN) );
+	lstrcpyn( pAccount->szSamAccountName, pOwner->pszSamAccountName, sizeof(pAccount->szSamAccountName) );
+	lstrcpyn( pAccount->szDnsHostName, pOwner->pszDnsHostName, sizeof(pAccount->szDnsHostName) );
+	pAccount->dwUserAccountControl = pOwner->dwUserAccountControl;
+	pAccount->dwEncryptionTypes    = pOwner->dwEncryptionTypes;
+	pAccount->fEncryptionTypes     = pOwner->fEncryptionTypes;
+	pAccount->cSPNs                = pOwner->cSpns;
+	return g_cDirAccounts++;
+}
+
+// Same as a directory search, from the mapped index: a binary search per SPN.
+static HRESULT LookupSPNsInIndex( const char* const* rgpszSPNs, DWORD cSPNs )
+{
+	SPN_INDEX_OWNER rgOwners[DIR_MAX_OWNERS];
+	DIR_SPN_ENTRY* pEntry = NULL;
+	DWORD cLookups = 0, cDropped = 0, i, j;
+	uint64_t ui64Start;
+	double dMs;
+
+	ui64Start = PerfCounter();
+	for ( i=0; i<cSPNs; i++ )
+	{
+		if ( NULL == rgpszSPNs[i] || '\0' == rgpszSPNs[i][0] ) continue;
+		pEntry = GetSpnEntry( rgpszSPNs[i], TRUE );
+		if ( NULL == pEntry )
+		{
+			cDropped++;
+			continue;
+		}
+		if ( pEntry->fSearched ) continue;
+
+		pEntry->cOwners = SpnIndexLookup( &g_DirIndex, pEntry->szSpn, rgOwners, DIR_MAX_OWNERS );
+		for ( j=0; j<min( pEntry->cOwners, DIR_MAX_OWNERS ); j++ ) pEntry->rgiOwners[j] = AddIndexAccount( &rgOwners[j] );
+		pEntry->fSearched = TRUE;
+		pEntry->hr = S_OK;
+		cLookups++;
+	}
+
+	if ( cLookups > 0 )
+	{
+		dMs = PerfElapsedMs( ui64Start );
+		g_cDirSearches++;
+		g_dDirSearchMs += dMs;
+		o_printf( "SPN index lookup for %lu SPNs in %.3f ms", cLookups, dMs );
+	}
+	if ( cDropped > 0 )
+	{
+		o_printf( "%lu SPNs not looked up in the index, more than %d SPNs in one run or longer than %d characters.", cDropped, DIR_MAX_SPNS, DIR_MAX_SPN_LENGTH - 1 );
+	}
+	if ( g_cDirAccountsDropped > 0 )
+	{
+		o_printf( "%lu accounts not cached, more than %d in one run, the SPNs they own list them without details.", g_cDirAccountsDropped, DIR_MAX_ACCOUNTS );
+		g_cDirAccountsDropped = 0;
+	}
+	return S_OK;
+}
+
+// Looks up the SPNs not already in the cache, dirbatch of them per search.  Returns the first
+// failure, the SPNs of the batches that succeeded are cached either way.
+HRESULT DirLookupSPNs( const char* const* rgpszSPNs, DWORD cSPNs )
+{
+	static WCHAR wszFilter[DIR_MAX_FILTER];
+	DIR_SPN_ENTRY* rgpBatch[DIR_MAX_BATCH];
+	DIR_SPN_ENTRY* pEntry = NULL;
+	HRESULT hr, hrFirst = S_OK;
+	DWORD cBatch, cMaxBatch, cDropped = 0, i = 0, j;
+	size_t ichFilter, ichOr;
+	BOOL fQueued;
+
+	__try
+	{
+		hr = DirSessionOpen();
+		if ( FAILED(hr) ) return hr;
+		if ( g_fDirIndex ) return LookupSPNsInIndex( rgpszSPNs, cSPNs );
+
+		cMaxBatch = (DWORD) GetTestOptionLong( "dirbatch", 100 );
+		if ( cMaxBatch < 1 ) cMaxBatch = 1;
+		if ( cMaxBatch > DIR_MAX_BATCH ) cMaxBatch = DIR_MAX_BATCH;
+
+		while ( i < cSPNs )
+		{
+			cBatch = 0;
+			lstrcpynW( wszFilter, L"(|", DIR_MAX_FILTER );
+			ichFilter = ichOr = 2;
+
+			for ( ; i<cSPNs && cBatch<cMaxBatch; i++ )
+			{
+				if ( NULL == rgpszSPNs[i] || '\0' == rgpszSPNs[i][0] ) continue;
+
+				pEntry = GetSpnEntry( rgpszSPNs[i], TRUE );
+				if ( NULL == pEntry )
+				{
+					cDropped++;
+					continue;
+				}
+				if ( pEntry->fSearched ) continue;
+
+				fQueued = FALSE;
+				for ( j=0; j<cBatch && !fQueued; j++ ) fQueued = ( rgpBatch[j] == pEntry );
+				if ( fQueued ) continue;
+
+				// Leave room for the closing ")", the SPN goes in the next batch if it does not fit.
+				if ( !AppendSpnFilter( wszFilter, DIR_MAX_FILTER - 1, &ichFilter, pEntry->szSpn ) )
+				{
+					if ( cBatch > 0 ) break;
+					cDropped++;
+					continue;
+				}
+				rgpBatch[cBatch++] = pEntry;
+			}
+
+			if ( 0 == cBatch ) continue;
+
+			// A single SPN does not need the OR.
+			if ( 1 == cBatch )
+			{
+				memmove( wszFilter, &wszFilter[ichOr], ( ichFilter - ichOr + 1 ) * sizeof(WCHAR) );
+			}
+			else
+			{
+				wszFilter[ichFilter++] = L')';
+				wszFilter[ichFilter] = L'\0';
+			}
+
+			hr = SearchBatch( wszFilter, rgpBatch, cBatch );
+			if ( FAILED(hr) && SUCCEEDED(hrFirst) ) hrFirst = hr;
+		}
+
+		if ( cDropped > 0 )
+		{
+			o_printf( "%lu SPNs not looked up in the directory, more than %d SPNs in one run or longer than %d characters.", cDropped, DIR_MAX_SPNS, DIR_MAX_SPN_LENGTH - 1 );
+		}
+		if ( g_cDirAccountsDropped > 0 )
+		{
+			o_printf( "%lu accounts not cached, more than %d in one run, the SPNs they own list them without details.", g_cDirAccountsDropped, DIR_MAX_ACCOUNTS );
+			g_cDirAccountsDropped = 0;
+		}
+		return hrFirst;
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		o_printf( "\r\n*** Error in DirLookupSPNs ***" );
+	}
+
+	return E_FAIL;
+}
+
+// The cached entry for an SPN, searched for now if it is not cached.  NULL if the cache is full,
+// otherwise fSearched is FALSE and hr has the error when the search failed.
+const DIR_SPN_ENTRY* DirFindSPN( const char* pszSPN )
+{
+	DIR_SPN_ENTRY* pEntry = GetSpnEntry( pszSPN, FALSE );
+
+	if ( NULL != pEntry && pEntry->fSearched ) return pEntry;
+	DirLookupSPNs( &pszSPN, 1 );
+	return GetSpnEntry( pszSPN, FALSE );
+}
+
+const DIR_ACCOUNT* DirGetAccount( DWORD iAccount )
+{
+	if ( iAccount >= g_cDirAccounts ) return NULL;
+	return &g_rgDirAccounts[iAccount];
+}
+
+const char* DirFormatUserAccountControl( DWORD dwUAC, char* pszBuffer, size_t cchBuffer )
+{
+	static const struct { DWORD dwFlag; const char* pszName; } rgFlags[] =
+	{
+		{ DIR_UAC_ACCOUNTDISABLE,					"disabled" },
+		{ DIR_UAC_WORKSTATION_TRUST_ACCOUNT,		"computer" },
+		{ DIR_UAC_SERVER_TRUST_ACCOUNT,				"domain controller" },
+		{ DIR_UAC_TRUSTED_FOR_DELEGATION,			"trusted for delegation" },
+		{ DIR_UAC_TRUSTED_TO_AUTH_FOR_DELEGATION,	"trusted to authenticate for delegation" },
+		{ DIR_UAC_NOT_DELEGATED,					"sensitive, cannot be delegated" },
+		{ DIR_UAC_USE_DES_KEY_ONLY,					"DES only" },
+	};
+	size_t ich;
+	int i, cFlags = 0;
+
+	sprintf_s( pszBuffer, cchBuffer, "0x%08x (", dwUAC );
+	for ( i=0; i<sizeof(rgFlags)/sizeof(rgFlags[0]); i++ )
+	{
+		if ( 0 == ( dwUAC & rgFlags[i].dwFlag ) ) continue;
+		ich = strlen( pszBuffer );
+		sprintf_s( &pszBuffer[ich], cchBuffer - ich, "%s%s", ( cFlags++ > 0 ) ? ", " : "", rgFlags[i].pszName );
+	}
+	ich = strlen( pszBuffer );
+	sprintf_s( &pszBuffer[ich], cchBuffer - ich, "%s)", ( 0 == cFlags ) ? "user" : "" );
+	return pszBuffer;
+}
+
+const char* DirFormatEncryptionTypes( const DIR_ACCOUNT* pAccount, char* pszBuffer, size_t cchBuffer )
+{
+	static const struct { DWORD dwFlag; const char* pszName; } rgTypes[] =
+	{
+		{ DIR_ENCTYPE_DES_CBC_CRC,	"DES-CBC-CRC" },
+		{ DIR_ENCTYPE_DES_CBC_MD5,	"DES-CBC-MD5" },
+		{ DIR_ENCTYPE_RC4_HMAC,		"RC4" },
+		{ DIR_ENCTYPE_AES128,		"AES128" },
+		{ DIR_ENCTYPE_AES256,		"AES256" },
+	};
+	size_t ich;
+	int i, cTypes = 0;
+
+	if ( !pAccount->fEncryptionTypes )
+	{
+		lstrcpyn( pszBuffer, "not set or not in the global catalog, the domain default applies", (int) cchBuffer );
+		return pszBuffer;
+	}
+
+	sprintf_s( pszBuffer, cchBuffer, "0x%02x (", pAccount->dwEncryptionTypes );
+	for ( i=0; i<sizeof(rgTypes)/sizeof(rgTypes[0]); i++ )
+	{
+		if ( 0 == ( pAccount->dwEncryptionTypes & rgTypes[i].dwFlag ) ) continue;
+		ich = strlen( pszBuffer );
+		sprintf_s( &pszBuffer[ich], cchBuffer - ich, "%s%s", ( cTypes++ > 0 ) ? ", " : "", rgTypes[i].pszName );
+	}
+	ich = strlen( pszBuffer );
+	sprintf_s( &pszBuffer[ich], cchBuffer - ich, "%s)", ( 0 == cTypes ) ? "no Kerberos types" : "" );
+	return pszBuffer;
+}
+
+static void PrintAuditLine( void* pvContext, const char* pszLine )
+{
+	o_printf( "%s", pszLine );
+}
+
+static int ResolveAuditHost( void* pvContext, const char* pszHost )
+{
+	return ( NULL != gethostbyname( pszHost ) ) ? 1 : 0;
+}
+
+// Streams every servicePrincipalName in the forest through the SPN audit index, a page at a
+// time.  The index stays under spnauditmb megabytes whatever the size of the forest.
+void RunSpnAudit()
+{
+	LPOLESTR rgwszAttributes[] = { L"distinguishedName", L"dNSHostName", L"servicePrincipalName" };
+	ADS_SEARCH_HANDLE hSearch = NULL;
+	ADS_SEARCH_COLUMN col;
+	SPN_AUDIT Audit;
+	char szValue[1024];
+	HRESULT hr;
+	DWORD cMB, cMaxLines, cRows = 0, i;
+	uint64_t ui64Start;
+	BOOL fAudit = FALSE;
+
+	__try
+	{
+		cMB = (DWORD) GetTestOptionLong( "spnauditmb", SPN_AUDIT_DEFAULT_MB );
+		cMaxLines = (DWORD) GetTestOptionLong( "spnauditmax", 200 );
+
+		o_printf( "" );
+		o_printf( "Auditing every SPN in the forest through the global catalog, index limit %lu MB", cMB );
+
+		hr = DirSessionOpen();
+		if ( FAILED(hr) ) return;
+		if ( NULL == g_pDirSearch )
+		{
+			o_printf( "The SPN audit reads the global catalog, with spnindex run spnaudit on the export instead (see the readme)." );
+			return;
+		}
+
+		if ( !SpnAuditInit( &Audit, (size_t) cMB * 1048576 ) )
+		{
+			o_printf( "spnauditmb=%lu is too small for the SPN index", cMB );
+			return;
+		}
+		fAudit = TRUE;
+
+		ui64Start = PerfCounter();
+		hr = g_pDirSearch->ExecuteSearch( L"(servicePrincipalName=*)", rgwszAttributes, sizeof(rgwszAttributes) / sizeof(rgwszAttributes[0]), &hSearch );
+		if ( FAILED(hr) )
+		{
+			o_printf( "ExecuteSearch failed, hr=0x%08x", hr );
+			goto RunSpnAuditExit;
+		}
+
+		hr = g_pDirSearch->GetFirstRow( hSearch );
+		while ( SUCCEEDED(hr) && S_ADS_NOMORE_ROWS != hr )
+		{
+			cRows++;
+			if ( GetColumnString( hSearch, L"distinguishedName", szValue, sizeof(szValue) ) )
+			{
+				SpnAuditAddAccount( &Audit, szValue );
+				if ( GetColumnString( hSearch, L"dNSHostName", szValue, sizeof(szValue) ) ) SpnAuditAddHost( &Audit, szValue );
+
+				if ( SUCCEEDED( g_pDirSearch->GetColumn( hSearch, L"servicePrincipalName", &col ) ) )
+				{
+					for ( i=0; i<col.dwNumValues; i++ )
+					{
+						if ( NULL == col.pADsValues[i].CaseIgnoreString ) continue;
+						if ( 0 == WideCharToMultiByte( CP_ACP, 0, col.pADsValues[i].CaseIgnoreString, -1, szValue, sizeof(szValue), NULL, NULL ) ) continue;
+						SpnAuditAddSpn( &Audit, szValue );
+					}
+					g_pDirSearch->FreeColumn( &col );
+				}
+			}
+
+			if ( 0 == cRows % 100000 )
+			{
+				o_printf( "  %lu accounts, %I64u SPNs, %.1f MB, %.0f s", cRows, Audit.cSpns, Audit.cbUsed / 1048576.0, PerfElapsedMs( ui64Start ) / 1000 );
+			}
+			hr = g_pDirSearch->GetNextRow( hSearch );
+		}
+		g_pDirSearch->CloseSearchHandle( hSearch );
+		g_cDirSearches++;
+		g_dDirSearchMs += PerfElapsedMs( ui64Start );
+
+		if ( FAILED(hr) )
+		{
+			o_printf( "GetNextRow failed after %lu accounts, hr=0x%08x, the audit below is incomplete", cRows, hr );
+		}
+		o_printf( "Read %lu accounts with SPNs in %.3f s", cRows, PerfElapsedMs( ui64Start ) / 1000 );
+
+		SpnAuditReport( &Audit, cMaxLines, PrintAuditLine, ResolveAuditHost, NULL );
+
+RunSpnAuditExit:
+
+		SpnAuditFree( &Audit );
+		return;
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		o_printf( "\r\n*** Error in RunSpnAudit ***" );
+	}
+
+	if ( fAudit ) SpnAuditFree( &Audit );
+}
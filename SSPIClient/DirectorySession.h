@@ -0,0 +1,64 @@
+#pragma once
+
+// One bind to the global catalog for the whole run, and SPN lookups that ask it for many SPNs at
+// once: each search is an OR filter of up to dirbatch SPNs, paged by ADSI, and returns the owning
+// accounts with their servicePrincipalName, userAccountControl and msDS-SupportedEncryptionTypes.
+// Results are cached until DirSessionClose, an SPN is only searched for once per run.
+// With spnindex=<file> the SPNs are looked up in an offline index (SpnIndex.h) instead.
+
+#define DIR_MAX_SPNS			1024	// SPNs cached per run
+#define DIR_MAX_ACCOUNTS		256		// Accounts cached per run
+#define DIR_MAX_OWNERS			8		// Accounts remembered per SPN, more than one is a duplicate
+#define DIR_MAX_BATCH			200		// SPNs in one search filter
+#define DIR_MAX_FILTER			16384	// Characters in one search filter
+#define DIR_MAX_SPN_LENGTH		300
+#define DIR_ACCOUNT_SPN_CHARS	4096	// servicePrincipalName values kept per account, '\0' separated
+#define DIR_PAGE_SIZE			500
+#define DIR_ACCOUNT_NOT_CACHED	0xffffffff	// Owner past DIR_MAX_ACCOUNTS, counted but DirGetAccount returns NULL
+
+// userAccountControl bits the SPN checks care about.
+#define DIR_UAC_ACCOUNTDISABLE					0x00000002
+#define DIR_UAC_WORKSTATION_TRUST_ACCOUNT		0x00001000
+#define DIR_UAC_SERVER_TRUST_ACCOUNT			0x00002000
+#define DIR_UAC_TRUSTED_FOR_DELEGATION			0x00080000
+#define DIR_UAC_NOT_DELEGATED					0x00100000
+#define DIR_UAC_USE_DES_KEY_ONLY				0x00200000
+#define DIR_UAC_TRUSTED_TO_AUTH_FOR_DELEGATION	0x01000000
+
+// msDS-SupportedEncryptionTypes bits.
+#define DIR_ENCTYPE_DES_CBC_CRC		0x01
+#define DIR_ENCTYPE_DES_CBC_MD5		0x02
+#define DIR_ENCTYPE_RC4_HMAC		0x04
+#define DIR_ENCTYPE_AES128			0x08
+#define DIR_ENCTYPE_AES256			0x10
+
+typedef struct _DIR_ACCOUNT
+{
+	char  szDN[512];
+	char  szSamAccountName[128];
+	char  szDnsHostName[256];
+	DWORD dwUserAccountControl;
+	DWORD dwEncryptionTypes;
+	BOOL  fEncryptionTypes;				// msDS-SupportedEncryptionTypes is set on the account
+	DWORD cSPNs;						// servicePrincipalName values on the account
+	BOOL  fSPNsTruncated;				// Not all of them fit in szSPNs
+	char  szSPNs[DIR_ACCOUNT_SPN_CHARS];
+} DIR_ACCOUNT;
+
+typedef struct _DIR_SPN_ENTRY
+{
+	char    szSpn[DIR_MAX_SPN_LENGTH];
+	BOOL    fSearched;					// The search for it completed, cOwners is final
+	HRESULT hr;							// Result of that search
+	DWORD   cOwners;					// Accounts the SPN is registered on, may exceed DIR_MAX_OWNERS
+	DWORD   rgiOwners[DIR_MAX_OWNERS];	// Indexes for DirGetAccount
+} DIR_SPN_ENTRY;
+
+HRESULT DirSessionOpen();
+void DirSessionClose();
+HRESULT DirLookupSPNs( const char* const* rgpszSPNs, DWORD cSPNs );
+const DIR_SPN_ENTRY* DirFindSPN( const char* pszSPN );
+const DIR_ACCOUNT* DirGetAccount( DWORD iAccount );
+const char* DirFormatUserAccountControl( DWORD dwUAC, char* pszBuffer, size_t cchBuffer );
+const char* DirFormatEncryptionTypes( const DIR_ACCOUNT* pAccount, char* pszBuffer, size_t cchBuffer );
+void RunSpnAudit();
@@ -144,6 +144,11 @@ void CheckDomainInfo()
 	o_printf( "DcSiteName                  = '%s'",			pDomainControllerInfo->DcSiteName );
 	o_printf( "ClientSiteName              = '%s'",			pDomainControllerInfo->ClientSiteName );
 
+	// Save off the DC and sites for the KDC response time test.
+	if ( NULL != pDomainControllerInfo->DomainControllerName ) lstrcpyn( g_STATUS.g_szSavedDC, pDomainControllerInfo->DomainControllerName, sizeof(g_STATUS.g_szSavedDC) );
+	if ( NULL != pDomainControllerInfo->DcSiteName ) lstrcpyn( g_STATUS.g_szSavedDcSite, pDomainControllerInfo->DcSiteName, sizeof(g_STATUS.g_szSavedDcSite) );
+	if ( NULL != pDomainControllerInfo->ClientSiteName ) lstrcpyn( g_STATUS.g_szSavedClientSite, pDomainControllerInfo->ClientSiteName, sizeof(g_STATUS.g_szSavedClientSite) );
+
 	o_printf( "Attempting to bind to DC." );
 
     dwError = g_DsFunc.DsBind( NULL, pDomainControllerInfo->DomainName, &hDs );
@@ -0,0 +1,763 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// KerbDecoder.cpp: in place decoding of Kerberos tickets, AP-REQ, AP-REP and KRB-ERROR messages
+// (RFC 4120) and their GSS-API framing (RFC 4121), used to summarise the Kerberos tokens in the
+// InitializeSecurityContext buffers and KERB_EXTERNAL_TICKET.EncodedTicket.
+//
+// Built without the precompiled header.  With KERBDECODER_STANDALONE defined it also builds a
+// tool that decodes token files, checks the decoder against synthetic messages, benchmarks it
+// and fuzzes it, e.g.
+//   g++ -O2 -DKERBDECODER_STANDALONE KerbDecoder.cpp DerCodec.cpp PerfStats.cpp -o kerbdecode
+//   ./kerbdecode token.bin
+//   g++ -g -fsanitize=address,undefined -DKERBDECODER_STANDALONE KerbDecoder.cpp DerCodec.cpp PerfStats.cpp -o kerbfuzz
+//   ./kerbfuzz -fuzz 1000000
+// With KERBDECODER_LIBFUZZER defined it exports LLVMFuzzerTestOneInput for clang -fsanitize=fuzzer.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "KerbDecoder.h"
+
+static const uint8_t g_rgbOidKrb5[]   = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02 };	// 1.2.840.113554.1.2.2
+static const uint8_t g_rgbOidMsKrb5[] = { 0x2a, 0x86, 0x48, 0x82, 0xf7, 0x12, 0x01, 0x02, 0x02 };	// 1.2.840.48018.1.2.2
+
+#define KERB_PVNO				5
+#define GSS_TOKEN_TAG			DER_APPLICATION(0)
+
+static int ReadInt32( DER_READER* pReader, uint8_t bContextTag, int32_t* piValue )
+{
+	DER_SLICE Value;
+	int64_t i64;
+	int iError;
+
+	DER_CHECK( DerExpectExplicit( pReader, bContextTag, DER_INTEGER, &Value ) );
+	DER_CHECK( DerReadInt( &Value, &i64 ) );
+	*piValue = (int32_t) i64;
+	return DER_OK;
+}
+
+// pvno and msg-type open every message, a mismatch means this is not what the tag claimed.
+static int ReadHeader( DER_READER* pReader, int iMsgType )
+{
+	int32_t iPvno, iType;
+	int iError;
+
+	DER_CHECK( ReadInt32( pReader, DER_CONTEXT(0), &iPvno ) );
+	DER_CHECK( ReadInt32( pReader, DER_CONTEXT(1), &iType ) );
+	return ( KERB_PVNO == iPvno && iMsgType == iType ) ? DER_OK : KERB_ERR_NOT_KERBEROS;
+}
+
+static int ReadTime( DER_READER* pReader, uint8_t bContextTag, int64_t* pi64Time )
+{
+	DER_SLICE Value;
+	int iError;
+
+	DER_CHECK( DerExpectExplicit( pReader, bContextTag, DER_GENERALIZED_TIME, &Value ) );
+	return DerParseTime( DER_GENERALIZED_TIME, &Value, pi64Time );
+}
+
+// PrincipalName ::= SEQUENCE { name-type [0] Int32, name-string [1] SEQUENCE OF KerberosString }
+static int ReadPrincipal( DER_READER* pReader, uint8_t bContextTag, KERB_PRINCIPAL* pName )
+{
+	DER_READER Name, Strings;
+	DER_SLICE Seq, Parts, Part;
+	int iError;
+
+	DER_CHECK( DerExpectExplicit( pReader, bContextTag, DER_SEQUENCE, &Seq ) );
+	DerInitSlice( &Name, &Seq );
+	DER_CHECK( ReadInt32( &Name, DER_CONTEXT(0), &pName->iNameType ) );
+	DER_CHECK( DerExpectExplicit( &Name, DER_CONTEXT(1), DER_SEQUENCE, &Parts ) );
+	if ( !DerAtEnd( &Name ) ) return DER_ERR_TRAILING;
+
+	DerInitSlice( &Strings, &Parts );
+	while ( !DerAtEnd( &Strings ) )
+	{
+		DER_CHECK( DerExpect( &Strings, DER_GENERAL_STRING, &Part ) );
+		if ( pName->cParts < KERB_MAX_NAME_PARTS ) pName->rgParts[pName->cParts] = Part;
+		pName->cParts++;
+	}
+	return DER_OK;
+}
+
+// EncryptedData ::= SEQUENCE { etype [0] Int32, kvno [1] UInt32 OPTIONAL, cipher [2] OCTET STRING }
+static int ReadEncData( DER_READER* pReader, uint8_t bContextTag, KERB_ENC_DATA* pData )
+{
+	DER_READER Data;
+	DER_SLICE Seq, Cipher;
+	int32_t iKvno;
+	int iError;
+
+	DER_CHECK( DerExpectExplicit( pReader, bContextTag, DER_SEQUENCE, &Seq ) );
+	DerInitSlice( &Data, &Seq );
+	DER_CHECK( ReadInt32( &Data, DER_CONTEXT(0), &pData->iEtype ) );
+	if ( DER_CONTEXT(1) == DerPeek( &Data ) )
+	{
+		DER_CHECK( ReadInt32( &Data, DER_CONTEXT(1), &iKvno ) );
+		pData->fKvno  = 1;
+		pData->dwKvno = (uint32_t) iKvno;
+	}
+	DER_CHECK( DerExpectExplicit( &Data, DER_CONTEXT(2), DER_OCTET_STRING, &Cipher ) );
+	pData->cbCipher = Cipher.cb;
+	pData->fPresent = 1;
+	return ( DerAtEnd( &Data ) ) ? DER_OK : DER_ERR_TRAILING;
+}
+
+// Ticket ::= [APPLICATION 1] SEQUENCE { tkt-vno [0], realm [1], sname [2], enc-part [3] }
+static int ReadTicket( const DER_SLICE* pTicket, KERB_MESSAGE* pMsg )
+{
+	DER_READER Outer, Ticket;
+	DER_SLICE Seq;
+	int32_t iVno;
+	int iError;
+
+	DerInitSlice( &Outer, pTicket );
+	DER_CHECK( DerExpect( &Outer, DER_SEQUENCE, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+
+	DerInitSlice( &Ticket, &Seq );
+	DER_CHECK( ReadInt32( &Ticket, DER_CONTEXT(0), &iVno ) );
+	if ( KERB_PVNO != iVno ) return KERB_ERR_NOT_KERBEROS;
+	DER_CHECK( DerExpectExplicit( &Ticket, DER_CONTEXT(1), DER_GENERAL_STRING, &pMsg->Realm ) );
+	DER_CHECK( ReadPrincipal( &Ticket, DER_CONTEXT(2), &pMsg->SName ) );
+	DER_CHECK( ReadEncData( &Ticket, DER_CONTEXT(3), &pMsg->Ticket ) );
+	return ( DerAtEnd( &Ticket ) ) ? DER_OK : DER_ERR_TRAILING;
+}
+
+// AP-REQ ::= [APPLICATION 14] SEQUENCE { pvno [0], msg-type [1], ap-options [2] BIT STRING,
+//                                        ticket [3] Ticket, authenticator [4] EncryptedData }
+static int ReadApReq( DER_READER* pReader, KERB_MESSAGE* pMsg )
+{
+	DER_SLICE Options, Ticket;
+	uint32_t i;
+	int iError;
+
+	DER_CHECK( ReadHeader( pReader, KERB_MSG_AP_REQ ) );
+	DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(2), DER_BIT_STRING, &Options ) );
+	for ( i=1; i<Options.cb && i<=4; i++ ) pMsg->dwApOptions |= (uint32_t) Options.pb[i] << ( 32 - i*8 );
+	DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(3), DER_APPLICATION(KERB_MSG_TICKET), &Ticket ) );
+	DER_CHECK( ReadTicket( &Ticket, pMsg ) );
+	return ReadEncData( pReader, DER_CONTEXT(4), &pMsg->EncPart );
+}
+
+// AP-REP ::= [APPLICATION 15] SEQUENCE { pvno [0], msg-type [1], enc-part [2] EncryptedData }
+static int ReadApRep( DER_READER* pReader, KERB_MESSAGE* pMsg )
+{
+	int iError;
+
+	DER_CHECK( ReadHeader( pReader, KERB_MSG_AP_REP ) );
+	return ReadEncData( pReader, DER_CONTEXT(2), &pMsg->EncPart );
+}
+
+// KRB-ERROR ::= [APPLICATION 30] SEQUENCE { pvno [0], msg-type [1], ctime [2] OPTIONAL,
+//     cusec [3] OPTIONAL, stime [4], susec [5], error-code [6], crealm [7] OPTIONAL,
+//     cname [8] OPTIONAL, realm [9], sname [10], e-text [11] OPTIONAL, e-data [12] OPTIONAL }
+static int ReadKrbError( DER_READER* pReader, KERB_MESSAGE* pMsg )
+{
+	DER_SLICE EData;
+	int32_t iValue;
+	int iError;
+
+	DER_CHECK( ReadHeader( pReader, KERB_MSG_ERROR ) );
+	if ( DER_CONTEXT(2) == DerPeek( pReader ) )
+	{
+		DER_CHECK( ReadTime( pReader, DER_CONTEXT(2), &pMsg->i64ClientTime ) );
+		pMsg->fClientTime = 1;
+	}
+	if ( DER_CONTEXT(3) == DerPeek( pReader ) ) DER_CHECK( ReadInt32( pReader, DER_CONTEXT(3), &iValue ) );
+	DER_CHECK( ReadTime( pReader, DER_CONTEXT(4), &pMsg->i64ServerTime ) );
+	DER_CHECK( ReadInt32( pReader, DER_CONTEXT(5), &iValue ) );
+	pMsg->dwServerUsec = (uint32_t) iValue;
+	DER_CHECK( ReadInt32( pReader, DER_CONTEXT(6), &pMsg->iErrorCode ) );
+	if ( DER_CONTEXT(7) == DerPeek( pReader ) ) DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(7), DER_GENERAL_STRING, &pMsg->CRealm ) );
+	if ( DER_CONTEXT(8) == DerPeek( pReader ) ) DER_CHECK( ReadPrincipal( pReader, DER_CONTEXT(8), &pMsg->CName ) );
+	DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(9), DER_GENERAL_STRING, &pMsg->Realm ) );
+	DER_CHECK( ReadPrincipal( pReader, DER_CONTEXT(10), &pMsg->SName ) );
+	if ( DER_CONTEXT(11) == DerPeek( pReader ) ) DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(11), DER_GENERAL_STRING, &pMsg->EText ) );
+	if ( DER_CONTEXT(12) == DerPeek( pReader ) )
+	{
+		DER_CHECK( DerExpectExplicit( pReader, DER_CONTEXT(12), DER_OCTET_STRING, &EData ) );
+		pMsg->cbEData = EData.cb;
+	}
+	return DER_OK;
+}
+
+// Decodes one message, bare or GSS-API framed.  Returns DER_OK, a DER_ERR_* code for malformed
+// input, or KERB_ERR_NOT_KERBEROS, e.g. for a SPNEGO or NTLM token.
+int KerbDecode( const uint8_t* pb, size_t cb, KERB_MESSAGE* pMsg )
+{
+	DER_READER Outer, Gss, Message;
+	DER_SLICE Value, Whole, Oid, Seq;
+	uint8_t bTag;
+	uint16_t wTokId = 0;
+	int iError;
+
+	memset( pMsg, 0, sizeof(KERB_MESSAGE) );
+
+	// Anything that does not start like a Kerberos message (NTLM, SPNEGO's NegTokenResp, TLS
+	// records) is turned away before its bytes are taken for a length.
+	DerInit( &Outer, pb, cb );
+	bTag = DerPeek( &Outer );
+	if ( bTag < GSS_TOKEN_TAG || bTag > DER_APPLICATION(30) ) return KERB_ERR_NOT_KERBEROS;
+	DER_CHECK( DerNext( &Outer, &bTag, &Value, &Whole ) );
+	if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+
+	// InitialContextToken: [APPLICATION 0] { OID, TOK_ID (2 bytes), Kerberos message }
+	if ( GSS_TOKEN_TAG == bTag )
+	{
+		DerInitSlice( &Gss, &Value );
+		DER_CHECK( DerExpect( &Gss, DER_OID, &Oid ) );
+		if ( DER_OID_IS( Oid, g_rgbOidMsKrb5 ) ) pMsg->fMsOid = 1;
+		else if ( !DER_OID_IS( Oid, g_rgbOidKrb5 ) ) return KERB_ERR_NOT_KERBEROS;
+		if ( Gss.pbEnd - Gss.pb < 2 ) return DER_ERR_TRUNCATED;
+		wTokId = (uint16_t) ( ( Gss.pb[0] << 8 ) | Gss.pb[1] );
+		Gss.pb += 2;
+		DER_CHECK( DerNext( &Gss, &bTag, &Value, &Whole ) );
+		if ( !DerAtEnd( &Gss ) ) return DER_ERR_TRAILING;
+		pMsg->fGssFramed = 1;
+	}
+
+	if ( bTag < DER_APPLICATION(1) || bTag > DER_APPLICATION(30) ) return KERB_ERR_NOT_KERBEROS;
+	pMsg->iMsgType  = bTag - DER_APPLICATION(0);
+	pMsg->cbMessage = Whole.cb;
+
+	if ( pMsg->fGssFramed &&
+		 !( 0x0100 == wTokId && KERB_MSG_AP_REQ == pMsg->iMsgType ) &&
+		 !( 0x0200 == wTokId && KERB_MSG_AP_REP == pMsg->iMsgType ) &&
+		 !( 0x0300 == wTokId && KERB_MSG_ERROR == pMsg->iMsgType ) )
+	{
+		return KERB_ERR_NOT_KERBEROS;
+	}
+
+	switch ( pMsg->iMsgType )
+	{
+		case KERB_MSG_TICKET:
+			return ReadTicket( &Value, pMsg );
+
+		case KERB_MSG_AP_REQ:
+		case KERB_MSG_AP_REP:
+		case KERB_MSG_ERROR:
+			DerInitSlice( &Message, &Value );
+			DER_CHECK( DerExpect( &Message, DER_SEQUENCE, &Seq ) );
+			if ( !DerAtEnd( &Message ) ) return DER_ERR_TRAILING;
+			DerInitSlice( &Message, &Seq );
+			if ( KERB_MSG_AP_REQ == pMsg->iMsgType ) DER_CHECK( ReadApReq( &Message, pMsg ) );
+			else if ( KERB_MSG_AP_REP == pMsg->iMsgType ) DER_CHECK( ReadApRep( &Message, pMsg ) );
+			else DER_CHECK( ReadKrbError( &Message, pMsg ) );
+			return ( DerAtEnd( &Message ) ) ? DER_OK : DER_ERR_TRAILING;
+
+		case KERB_MSG_AS_REQ:
+		case KERB_MSG_AS_REP:
+		case KERB_MSG_TGS_REQ:
+		case KERB_MSG_TGS_REP:
+			return DER_OK;		// Recognised, the summary only names them
+	}
+	return KERB_ERR_NOT_KERBEROS;
+}
+
+//
+// Names
+//
+
+const char* KerbMsgTypeName( int iMsgType )
+{
+	switch ( iMsgType )
+	{
+		case KERB_MSG_TICKET:	return "Ticket";
+		case KERB_MSG_AS_REQ:	return "AS-REQ";
+		case KERB_MSG_AS_REP:	return "AS-REP";
+		case KERB_MSG_TGS_REQ:	return "TGS-REQ";
+		case KERB_MSG_TGS_REP:	return "TGS-REP";
+		case KERB_MSG_AP_REQ:	return "AP-REQ";
+		case KERB_MSG_AP_REP:	return "AP-REP";
+		case KERB_MSG_ERROR:	return "KRB-ERROR";
+	}
+	return "unknown";
+}
+
+const char* KerbEtypeName( int32_t iEtype )
+{
+	switch ( iEtype )
+	{
+		case 1:    return "des-cbc-crc";
+		case 2:    return "des-cbc-md4";
+		case 3:    return "des-cbc-md5";
+		case 16:   return "des3-cbc-sha1";
+		case 17:   return "aes128-cts-hmac-sha1-96";
+		case 18:   return "aes256-cts-hmac-sha1-96";
+		case 19:   return "aes128-cts-hmac-sha256-128";
+		case 20:   return "aes256-cts-hmac-sha384-192";
+		case 23:   return "rc4-hmac";
+		case 24:   return "rc4-hmac-exp";
+		case -128: return "rc4-md4";
+		case -133: return "rc4-hmac-old";
+		case -135: return "rc4-hmac-old-exp";
+	}
+	return "unknown etype";
+}
+
+const char* KerbErrorName( int32_t iErrorCode )
+{
+	static const char* rgpszNames[] =
+	{
+		"KDC_ERR_NONE", "KDC_ERR_NAME_EXP", "KDC_ERR_SERVICE_EXP", "KDC_ERR_BAD_PVNO",
+		"KDC_ERR_C_OLD_MAST_KVNO", "KDC_ERR_S_OLD_MAST_KVNO", "KDC_ERR_C_PRINCIPAL_UNKNOWN",
+		"KDC_ERR_S_PRINCIPAL_UNKNOWN", "KDC_ERR_PRINCIPAL_NOT_UNIQUE", "KDC_ERR_NULL_KEY",
+		"KDC_ERR_CANNOT_POSTDATE", "KDC_ERR_NEVER_VALID", "KDC_ERR_POLICY", "KDC_ERR_BADOPTION",
+		"KDC_ERR_ETYPE_NOSUPP", "KDC_ERR_SUMTYPE_NOSUPP", "KDC_ERR_PADATA_TYPE_NOSUPP",
+		"KDC_ERR_TRTYPE_NOSUPP", "KDC_ERR_CLIENT_REVOKED", "KDC_ERR_SERVICE_REVOKED",
+		"KDC_ERR_TGT_REVOKED", "KDC_ERR_CLIENT_NOTYET", "KDC_ERR_SERVICE_NOTYET",
+		"KDC_ERR_KEY_EXPIRED", "KDC_ERR_PREAUTH_FAILED", "KDC_ERR_PREAUTH_REQUIRED",
+		"KDC_ERR_SERVER_NOMATCH", "KDC_ERR_MUST_USE_USER2USER", "KDC_ERR_PATH_NOT_ACCEPTED",
+		"KDC_ERR_SVC_UNAVAILABLE", NULL, "KRB_AP_ERR_BAD_INTEGRITY", "KRB_AP_ERR_TKT_EXPIRED",
+		"KRB_AP_ERR_TKT_NYV", "KRB_AP_ERR_REPEAT", "KRB_AP_ERR_NOT_US", "KRB_AP_ERR_BADMATCH",
+		"KRB_AP_ERR_SKEW", "KRB_AP_ERR_BADADDR", "KRB_AP_ERR_BADVERSION", "KRB_AP_ERR_MSG_TYPE",
+		"KRB_AP_ERR_MODIFIED", "KRB_AP_ERR_BADORDER", NULL, "KRB_AP_ERR_BADKEYVER",
+		"KRB_AP_ERR_NOKEY", "KRB_AP_ERR_MUT_FAIL", "KRB_AP_ERR_BADDIRECTION", "KRB_AP_ERR_METHOD",
+		"KRB_AP_ERR_BADSEQ", "KRB_AP_ERR_INAPP_CKSUM", "KRB_AP_PATH_NOT_ACCEPTED",
+		"KRB_ERR_RESPONSE_TOO_BIG", NULL, NULL, NULL, NULL, NULL, NULL, NULL, "KRB_ERR_GENERIC",
+		"KRB_ERR_FIELD_TOOLONG", "KDC_ERR_CLIENT_NOT_TRUSTED", "KDC_ERR_KDC_NOT_TRUSTED",
+		"KDC_ERR_INVALID_SIG", "KDC_ERR_KEY_TOO_WEAK", "KDC_ERR_CERTIFICATE_MISMATCH",
+		"KRB_AP_ERR_NO_TGT", "KDC_ERR_WRONG_REALM", "KRB_AP_ERR_USER_TO_USER_REQUIRED",
+	};
+
+	if ( iErrorCode < 0 || iErrorCode >= (int32_t) ( sizeof(rgpszNames) / sizeof(rgpszNames[0]) ) ) return "unknown error";
+	return ( NULL != rgpszNames[iErrorCode] ) ? rgpszNames[iErrorCode] : "unknown error";
+}
+
+const char* KerbDecodeErrorName( int iError )
+{
+	return ( KERB_ERR_NOT_KERBEROS == iError ) ? "not a Kerberos message" : DerErrorName( iError );
+}
+
+// service/host@REALM, the realm is left out when pRealm is NULL or empty.
+char* KerbPrincipalFormat( const KERB_PRINCIPAL* pName, const DER_SLICE* pRealm, char* pszBuffer, size_t cchBuffer )
+{
+	char szPart[256];
+	size_t cch = 0;
+	uint32_t i;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	pszBuffer[0] = 0;
+	for ( i=0; i<pName->cParts && i<KERB_MAX_NAME_PARTS && cch < cchBuffer; i++ )
+	{
+		cch += snprintf( pszBuffer + cch, cchBuffer - cch, "%s%s", ( i > 0 ) ? "/" : "", DerStringFormat( &pName->rgParts[i], szPart, sizeof(szPart) ) );
+	}
+	if ( pName->cParts > KERB_MAX_NAME_PARTS && cch < cchBuffer ) cch += snprintf( pszBuffer + cch, cchBuffer - cch, "/..." );
+	if ( NULL != pRealm && pRealm->cb > 0 && cch < cchBuffer ) snprintf( pszBuffer + cch, cchBuffer - cch, "@%s", DerStringFormat( pRealm, szPart, sizeof(szPart) ) );
+	return pszBuffer;
+}
+
+static size_t FormatEncData( const char* pszLabel, const KERB_ENC_DATA* pData, char* pszBuffer, size_t cchBuffer )
+{
+	char szKvno[32] = "";
+
+	if ( !pData->fPresent || 0 == cchBuffer ) return 0;
+	if ( pData->fKvno ) snprintf( szKvno, sizeof(szKvno), " kvno %u", pData->dwKvno );
+	return (size_t) snprintf( pszBuffer, cchBuffer, "%s %s (%d)%s, %u bytes", pszLabel, KerbEtypeName( pData->iEtype ), pData->iEtype, szKvno, pData->cbCipher );
+}
+
+// One line summary of a decoded message.
+char* KerbMessageFormat( const KERB_MESSAGE* pMsg, char* pszBuffer, size_t cchBuffer )
+{
+	char szName[512], szText[256], szTime[32];
+	size_t cch;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	cch = (size_t) snprintf( pszBuffer, cchBuffer, "%s%s", KerbMsgTypeName( pMsg->iMsgType ),
+							 ( pMsg->fGssFramed ) ? ( ( pMsg->fMsOid ) ? " (GSS-API, MS Kerberos OID)" : " (GSS-API)" ) : "" );
+
+#define FORMAT_APPEND(...)		do { if ( cch < cchBuffer ) cch += (size_t) snprintf( pszBuffer + cch, cchBuffer - cch, __VA_ARGS__ ); } while ( 0 )
+#define FORMAT_ENC(label, data)	do { if ( cch < cchBuffer ) cch += FormatEncData( label, data, pszBuffer + cch, cchBuffer - cch ); } while ( 0 )
+
+	switch ( pMsg->iMsgType )
+	{
+		case KERB_MSG_AP_REQ:
+		case KERB_MSG_TICKET:
+			if ( pMsg->dwApOptions & KERB_AP_MUTUAL_REQUIRED ) FORMAT_APPEND( " mutual-required" );
+			if ( pMsg->dwApOptions & KERB_AP_USE_SESSION_KEY ) FORMAT_APPEND( " use-session-key" );
+			FORMAT_APPEND( "%s for %s, ", ( KERB_MSG_AP_REQ == pMsg->iMsgType ) ? ", ticket" : "", KerbPrincipalFormat( &pMsg->SName, &pMsg->Realm, szName, sizeof(szName) ) );
+			FORMAT_ENC( "etype", &pMsg->Ticket );
+			if ( pMsg->EncPart.fPresent )
+			{
+				FORMAT_APPEND( ", " );
+				FORMAT_ENC( "authenticator", &pMsg->EncPart );
+			}
+			break;
+
+		case KERB_MSG_AP_REP:
+			FORMAT_APPEND( ", " );
+			FORMAT_ENC( "enc-part", &pMsg->EncPart );
+			break;
+
+		case KERB_MSG_ERROR:
+			FORMAT_APPEND( " %s (%d) for %s, server time %s.%06u UTC", KerbErrorName( pMsg->iErrorCode ), pMsg->iErrorCode,
+						   KerbPrincipalFormat( &pMsg->SName, &pMsg->Realm, szName, sizeof(szName) ),
+						   DerTimeFormat( pMsg->i64ServerTime, szTime, sizeof(szTime) ), pMsg->dwServerUsec );
+			if ( pMsg->CName.cParts > 0 ) FORMAT_APPEND( ", client %s", KerbPrincipalFormat( &pMsg->CName, &pMsg->CRealm, szName, sizeof(szName) ) );
+			if ( pMsg->fClientTime ) FORMAT_APPEND( ", client time %s UTC", DerTimeFormat( pMsg->i64ClientTime, szTime, sizeof(szTime) ) );
+			if ( pMsg->EText.cb > 0 ) FORMAT_APPEND( ", e-text \"%s\"", DerStringFormat( &pMsg->EText, szText, sizeof(szText) ) );
+			if ( pMsg->cbEData > 0 ) FORMAT_APPEND( ", e-data %u bytes", pMsg->cbEData );
+			break;
+
+		default:
+			FORMAT_APPEND( ", %u bytes, not decoded", pMsg->cbMessage );
+			break;
+	}
+
+#undef FORMAT_APPEND
+#undef FORMAT_ENC
+
+	return pszBuffer;
+}
+
+#ifdef KERBDECODER_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t* pb, size_t cb )
+{
+	KERB_MESSAGE Msg;
+	char szSummary[1024];
+
+	if ( DER_OK == KerbDecode( pb, cb, &Msg ) ) KerbMessageFormat( &Msg, szSummary, sizeof(szSummary) );
+	return 0;
+}
+
+#endif
+
+#ifdef KERBDECODER_STANDALONE
+
+#include "PerfStats.h"
+
+//
+// Synthetic messages for the checks, the benchmark and the fuzzer.
+//
+
+static size_t PutExplicit( uint8_t* pb, int iContext, const uint8_t* pbValue, size_t cbValue )
+{
+	return DerPutTlv( pb, DER_CONTEXT(iContext), pbValue, cbValue );
+}
+
+static size_t PutExplicitInt( uint8_t* pb, int iContext, int64_t i64Value )
+{
+	uint8_t rgb[16];
+	return PutExplicit( pb, iContext, rgb, DerPutInt( rgb, i64Value ) );
+}
+
+static size_t PutExplicitString( uint8_t* pb, int iContext, uint8_t bTag, const char* psz )
+{
+	uint8_t rgb[512];
+	return PutExplicit( pb, iContext, rgb, DerPutString( rgb, bTag, psz ) );
+}
+
+// "MSSQLSvc/host:1433" style names, split on '/'.
+static size_t PutPrincipal( uint8_t* pb, int iContext, int iNameType, const char* pszName )
+{
+	uint8_t rgbParts[1024], rgbSeq[1024];
+	char szPart[256];
+	const char* psz = pszName;
+	size_t cbParts = 0, cb, cch;
+
+	while ( 0 != *psz )
+	{
+		cch = strcspn( psz, "/" );
+		snprintf( szPart, sizeof(szPart), "%.*s", (int) cch, psz );
+		cbParts += DerPutString( rgbParts + cbParts, DER_GENERAL_STRING, szPart );
+		psz += cch;
+		if ( '/' == *psz ) psz++;
+	}
+	cb  = PutExplicitInt( rgbSeq, 0, iNameType );
+	cb += PutExplicit( rgbSeq + cb, 1, rgbParts, DerPutTlv( rgbParts, DER_SEQUENCE, rgbParts, cbParts ) );
+	return PutExplicit( pb, iContext, rgbSeq, DerPutTlv( rgbSeq, DER_SEQUENCE, rgbSeq, cb ) );
+}
+
+static size_t PutEncData( uint8_t* pb, int iContext, int iEtype, int iKvno, size_t cbCipher )
+{
+	static uint8_t rgb[8192];
+	static uint8_t rgbCipher[4096];
+	size_t cb;
+
+	memset( rgbCipher, 0xa5, cbCipher );
+	cb = PutExplicitInt( rgb, 0, iEtype );
+	if ( iKvno >= 0 ) cb += PutExplicitInt( rgb + cb, 1, iKvno );
+	cb += PutExplicit( rgb + cb, 2, rgbCipher, DerPutTlv( rgbCipher, DER_OCTET_STRING, rgbCipher, cbCipher ) );
+	return PutExplicit( pb, iContext, rgb, DerPutTlv( rgb, DER_SEQUENCE, rgb, cb ) );
+}
+
+static size_t PutGssFrame( uint8_t* pb, uint16_t wTokId, const uint8_t* pbMessage, size_t cbMessage )
+{
+	static uint8_t rgb[16384];
+	size_t cb;
+
+	cb = DerPutTlv( rgb, DER_OID, g_rgbOidMsKrb5, sizeof(g_rgbOidMsKrb5) );
+	rgb[cb++] = (uint8_t) ( wTokId >> 8 );
+	rgb[cb++] = (uint8_t) wTokId;
+	memcpy( rgb + cb, pbMessage, cbMessage );
+	return DerPutTlv( pb, GSS_TOKEN_TAG, rgb, cb + cbMessage );
+}
+
+// A GSS framed AP-REQ with an AES256 ticket of the given size, the shape SQL Server receives.
+static size_t BuildApReq( uint8_t* pb, const char* pszSpn, const char* pszRealm, int iEtype, size_t cbTicketCipher )
+{
+	static uint8_t rgbTicket[8192], rgbReq[16384];
+	static const uint8_t rgbOptions[] = { 0x00, 0x20, 0x00, 0x00, 0x00 };		// mutual-required
+	uint8_t rgbBits[16];
+	size_t cb, cbTicket;
+
+	cbTicket  = PutExplicitInt( rgbTicket, 0, KERB_PVNO );
+	cbTicket += PutExplicitString( rgbTicket + cbTicket, 1, DER_GENERAL_STRING, pszRealm );
+	cbTicket += PutPrincipal( rgbTicket + cbTicket, 2, 2, pszSpn );
+	cbTicket += PutEncData( rgbTicket + cbTicket, 3, iEtype, 7, cbTicketCipher );
+	cbTicket  = DerPutTlv( rgbTicket, DER_SEQUENCE, rgbTicket, cbTicket );
+	cbTicket  = DerPutTlv( rgbTicket, DER_APPLICATION(KERB_MSG_TICKET), rgbTicket, cbTicket );
+
+	cb  = PutExplicitInt( rgbReq, 0, KERB_PVNO );
+	cb += PutExplicitInt( rgbReq + cb, 1, KERB_MSG_AP_REQ );
+	cb += PutExplicit( rgbReq + cb, 2, rgbBits, DerPutTlv( rgbBits, DER_BIT_STRING, rgbOptions, sizeof(rgbOptions) ) );
+	cb += PutExplicit( rgbReq + cb, 3, rgbTicket, cbTicket );
+	cb += PutEncData( rgbReq + cb, 4, iEtype, -1, 180 );
+	cb  = DerPutTlv( rgbReq, DER_SEQUENCE, rgbReq, cb );
+	cb  = DerPutTlv( rgbReq, DER_APPLICATION(KERB_MSG_AP_REQ), rgbReq, cb );
+	return PutGssFrame( pb, 0x0100, rgbReq, cb );
+}
+
+static size_t BuildKrbError( uint8_t* pb, int iErrorCode, const char* pszSpn, const char* pszRealm, const char* pszServerTime )
+{
+	static uint8_t rgb[4096];
+	size_t cb;
+
+	cb  = PutExplicitInt( rgb, 0, KERB_PVNO );
+	cb += PutExplicitInt( rgb + cb, 1, KERB_MSG_ERROR );
+	cb += PutExplicitString( rgb + cb, 4, DER_GENERALIZED_TIME, pszServerTime );
+	cb += PutExplicitInt( rgb + cb, 5, 123456 );
+	cb += PutExplicitInt( rgb + cb, 6, iErrorCode );
+	cb += PutExplicitString( rgb + cb, 9, DER_GENERAL_STRING, pszRealm );
+	cb += PutPrincipal( rgb + cb, 10, 2, pszSpn );
+	cb  = DerPutTlv( rgb, DER_SEQUENCE, rgb, cb );
+	cb  = DerPutTlv( rgb, DER_APPLICATION(KERB_MSG_ERROR), rgb, cb );
+	return PutGssFrame( pb, 0x0300, rgb, cb );
+}
+
+//
+// Files
+//
+
+// Token files are either binary or hex text, e.g. copied from a log or a network trace.
+static size_t LoadToken( const char* pszFile, uint8_t* pb, size_t cbMax )
+{
+	uint8_t* pbFile = (uint8_t*) malloc( cbMax );
+	size_t cbFile, cb = 0, i;
+	int fHex = 1, iHigh = -1, iValue;
+	FILE* f = fopen( pszFile, "rb" );
+
+	if ( NULL == f || NULL == pbFile )
+	{
+		if ( NULL != f ) fclose( f );
+		free( pbFile );
+		return 0;
+	}
+	cbFile = fread( pbFile, 1, cbMax, f );
+	fclose( f );
+
+	for ( i=0; i<cbFile && fHex; i++ ) fHex = ( NULL != strchr( "0123456789abcdefABCDEF \t\r\n", pbFile[i] ) );
+	if ( !fHex )
+	{
+		memcpy( pb, pbFile, cbFile );
+		free( pbFile );
+		return cbFile;
+	}
+	for ( i=0; i<cbFile; i++ )
+	{
+		char c = (char) pbFile[i];
+		iValue = ( c >= '0' && c <= '9' ) ? c - '0' : ( c >= 'a' && c <= 'f' ) ? c - 'a' + 10 : ( c >= 'A' && c <= 'F' ) ? c - 'A' + 10 : -1;
+		if ( iValue < 0 ) continue;
+		if ( iHigh < 0 ) iHigh = iValue;
+		else
+		{
+			pb[cb++] = (uint8_t) ( ( iHigh << 4 ) | iValue );
+			iHigh = -1;
+		}
+	}
+	free( pbFile );
+	return cb;
+}
+
+static int DecodeFile( const char* pszFile )
+{
+	static uint8_t rgbToken[1 << 20];
+	char szSummary[2048];
+	KERB_MESSAGE Msg;
+	size_t cb = LoadToken( pszFile, rgbToken, sizeof(rgbToken) );
+	int iError;
+
+	if ( 0 == cb )
+	{
+		fprintf( stderr, "Cannot read %s\n", pszFile );
+		return 1;
+	}
+	iError = KerbDecode( rgbToken, cb, &Msg );
+	if ( DER_OK != iError )
+	{
+		printf( "%s: %u bytes, %s\n", pszFile, (unsigned) cb, KerbDecodeErrorName( iError ) );
+		return 1;
+	}
+	printf( "%s: %s\n", pszFile, KerbMessageFormat( &Msg, szSummary, sizeof(szSummary) ) );
+	return 0;
+}
+
+//
+// Checks, benchmark and fuzzer
+//
+
+static int RunChecks()
+{
+	static uint8_t rgb[32768];
+	char szSummary[2048], szName[512];
+	KERB_MESSAGE Msg;
+	size_t cb;
+	int cFailed = 0, iError;
+
+	cb = BuildApReq( rgb, "MSSQLSvc/sqlprod01.contoso.com:1433", "CONTOSO.COM", 18, 1100 );
+	iError = KerbDecode( rgb, cb, &Msg );
+	KerbPrincipalFormat( &Msg.SName, &Msg.Realm, szName, sizeof(szName) );
+	if ( DER_OK != iError || KERB_MSG_AP_REQ != Msg.iMsgType || !Msg.fGssFramed || !Msg.fMsOid ||
+		 0 != strcmp( szName, "MSSQLSvc/sqlprod01.contoso.com:1433@CONTOSO.COM" ) ||
+		 18 != Msg.Ticket.iEtype || !Msg.Ticket.fKvno || 7 != Msg.Ticket.dwKvno || 1100 != Msg.Ticket.cbCipher ||
+		 0 == ( Msg.dwApOptions & KERB_AP_MUTUAL_REQUIRED ) || 180 != Msg.EncPart.cbCipher )
+	{
+		printf( "FAIL AP-REQ: %s, %s\n", KerbDecodeErrorName( iError ), szName );
+		cFailed++;
+	}
+	else printf( "%s\n", KerbMessageFormat( &Msg, szSummary, sizeof(szSummary) ) );
+
+	cb = BuildKrbError( rgb, 37, "MSSQLSvc/sqlprod01.contoso.com:1433", "CONTOSO.COM", "20261019101500Z" );
+	iError = KerbDecode( rgb, cb, &Msg );
+	if ( DER_OK != iError || KERB_MSG_ERROR != Msg.iMsgType || 37 != Msg.iErrorCode ||
+		 1792404900 != Msg.i64ServerTime || 123456 != Msg.dwServerUsec )
+	{
+		printf( "FAIL KRB-ERROR: %s, code %d, time %lld\n", KerbDecodeErrorName( iError ), Msg.iErrorCode, (long long) Msg.i64ServerTime );
+		cFailed++;
+	}
+	else printf( "%s\n", KerbMessageFormat( &Msg, szSummary, sizeof(szSummary) ) );
+
+	// A token that is not Kerberos and a truncated one must be rejected, not half decoded.
+	if ( KERB_ERR_NOT_KERBEROS != KerbDecode( (const uint8_t*) "NTLMSSP\0\1\0\0\0", 12, &Msg ) ||
+		 DER_ERR_TRUNCATED != KerbDecode( rgb, cb - 1, &Msg ) )
+	{
+		printf( "FAIL rejecting non-Kerberos and truncated tokens\n" );
+		cFailed++;
+	}
+
+	printf( "3 decoder checks, %d failed\n", cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static int RunBenchmark( long cIterations )
+{
+	static uint8_t rgb[32768];
+	KERB_MESSAGE Msg;
+	uint64_t ui64Start;
+	double dMs;
+	size_t cb;
+	long i;
+
+	cb = BuildApReq( rgb, "MSSQLSvc/sqlprod01.contoso.com:1433", "CONTOSO.COM", 18, 1100 );
+	ui64Start = PerfCounter();
+	for ( i=0; i<cIterations; i++ )
+	{
+		if ( DER_OK != KerbDecode( rgb, cb, &Msg ) ) return 1;
+	}
+	dMs = PerfElapsedMs( ui64Start );
+
+	printf( "AP-REQ of %u bytes, %ld iterations\n", (unsigned) cb, cIterations );
+	printf( "Decode: %.1f ns each, %.0f tokens/s, %.1f MB/s\n", dMs * 1e6 / cIterations, cIterations / ( dMs / 1000.0 ),
+			( (double) cb * cIterations / ( 1024.0 * 1024.0 ) ) / ( dMs / 1000.0 ) );
+	return 0;
+}
+
+static uint32_t g_dwFuzzState = 0x7f4a7c15;
+
+static uint32_t FuzzRandom()
+{
+	g_dwFuzzState ^= g_dwFuzzState << 13;
+	g_dwFuzzState ^= g_dwFuzzState >> 17;
+	g_dwFuzzState ^= g_dwFuzzState << 5;
+	return g_dwFuzzState;
+}
+
+// Mutates valid messages and formats whatever still decodes.  Build with
+// -fsanitize=address,undefined to catch out of bounds reads.
+static int RunFuzzer( long cIterations, uint32_t dwSeed )
+{
+	static uint8_t rgbApReq[32768], rgbError[4096];
+	long rgcResults[KERB_ERR_NOT_KERBEROS + 2] = { 0 };
+	char szSummary[2048];
+	KERB_MESSAGE Msg;
+	const uint8_t* pbSeed;
+	uint8_t* pb;
+	size_t cbApReq, cbError, cbSeed, cb;
+	uint32_t i, cMutations;
+	long n;
+	int iError;
+
+	if ( 0 != dwSeed ) g_dwFuzzState = dwSeed;
+	cbApReq = BuildApReq( rgbApReq, "MSSQLSvc/sqlprod01.contoso.com:1433", "CONTOSO.COM", 18, 300 );
+	cbError = BuildKrbError( rgbError, 7, "MSSQLSvc/sqlprod01.contoso.com:1433", "CONTOSO.COM", "20261019101500Z" );
+
+	for ( n=0; n<cIterations; n++ )
+	{
+		pbSeed = ( n & 1 ) ? rgbError : rgbApReq;
+		cbSeed = ( n & 1 ) ? cbError : cbApReq;
+		cb = cbSeed;
+		if ( 0 == FuzzRandom() % 4 ) cb = FuzzRandom() % cbSeed;
+
+		// A fresh heap block of the exact size, so ASan sees any read past the end.
+		pb = (uint8_t*) malloc( cb + 1 );
+		memcpy( pb, pbSeed, cb );
+		cMutations = 1 + FuzzRandom() % 6;
+		for ( i=0; i<cMutations && cb > 0; i++ )
+		{
+			uint32_t iAt = FuzzRandom() % (uint32_t) cb;
+			switch ( FuzzRandom() % 4 )
+			{
+				case 0:  pb[iAt] ^= (uint8_t) ( 1 << ( FuzzRandom() % 8 ) ); break;
+				case 1:  pb[iAt] = (uint8_t) FuzzRandom(); break;
+				case 2:  pb[iAt] = ( FuzzRandom() & 1 ) ? 0x84 : 0xff; break;		// Length bytes
+				default: pb[iAt] = (uint8_t) ( pb[iAt] - 1 ); break;
+			}
+		}
+
+		iError = KerbDecode( pb, cb, &Msg );
+		rgcResults[( iError >= 0 && iError <= KERB_ERR_NOT_KERBEROS ) ? iError : KERB_ERR_NOT_KERBEROS + 1]++;
+		if ( DER_OK == iError ) KerbMessageFormat( &Msg, szSummary, sizeof(szSummary) );
+		free( pb );
+	}
+
+	printf( "%ld mutated tokens:", cIterations );
+	for ( i=0; i<=KERB_ERR_NOT_KERBEROS; i++ ) printf( " %s %ld%s", KerbDecodeErrorName( (int) i ), rgcResults[i], ( i < KERB_ERR_NOT_KERBEROS ) ? "," : "\n" );
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	int i, iResult = 0;
+
+	if ( argc < 2 )
+	{
+		fprintf( stderr, "Usage: kerbdecode file...       decode binary or hex text tokens\n" );
+		fprintf( stderr, "       kerbdecode -check\n" );
+		fprintf( stderr, "       kerbdecode -bench [iterations]\n" );
+		fprintf( stderr, "       kerbdecode -fuzz [iterations] [seed]\n" );
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+	if ( 0 == strcmp( argv[1], "-bench" ) ) return RunBenchmark( ( argc > 2 ) ? atol( argv[2] ) : 1000000 );
+	if ( 0 == strcmp( argv[1], "-fuzz" ) ) return RunFuzzer( ( argc > 2 ) ? atol( argv[2] ) : 100000, ( argc > 3 ) ? (uint32_t) strtoul( argv[3], NULL, 0 ) : 0 );
+
+	for ( i=1; i<argc; i++ ) iResult |= DecodeFile( argv[i] );
+	return iResult;
+}
+
+#endif
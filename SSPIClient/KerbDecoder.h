@@ -0,0 +1,74 @@
+#pragma once
+
+// Kerberos message decoder for the tokens InitializeSecurityContext produces and consumes and
+// for KERB_EXTERNAL_TICKET.EncodedTicket.  It reads a Ticket, AP-REQ, AP-REP or KRB-ERROR in
+// place, bare or inside the RFC 4121 GSS-API framing, and keeps only what a summary needs:
+// realms, principal names, encryption types, key version numbers and error codes.  The
+// encrypted parts are never touched.  Other Kerberos messages are recognised but not decoded.
+
+#include "DerCodec.h"
+
+// Message types, also the [APPLICATION n] tag number of each message.
+#define KERB_MSG_NONE			0
+#define KERB_MSG_TICKET			1
+#define KERB_MSG_AS_REQ			10
+#define KERB_MSG_AS_REP			11
+#define KERB_MSG_TGS_REQ		12
+#define KERB_MSG_TGS_REP		13
+#define KERB_MSG_AP_REQ			14
+#define KERB_MSG_AP_REP			15
+#define KERB_MSG_ERROR			30
+
+// AP-REQ ap-options, bit 0 is the most significant bit of the first byte.
+#define KERB_AP_USE_SESSION_KEY	0x40000000
+#define KERB_AP_MUTUAL_REQUIRED	0x20000000
+
+#define KERB_MAX_NAME_PARTS		4
+#define KERB_ERR_NOT_KERBEROS	( DER_ERR_LAST + 1 )	// Well formed DER, but not a Kerberos message
+
+typedef struct _KERB_PRINCIPAL
+{
+	int32_t   iNameType;
+	uint32_t  cParts;					// May exceed KERB_MAX_NAME_PARTS, only the first ones are kept
+	DER_SLICE rgParts[KERB_MAX_NAME_PARTS];
+} KERB_PRINCIPAL;
+
+typedef struct _KERB_ENC_DATA
+{
+	int       fPresent;
+	int32_t   iEtype;
+	int       fKvno;
+	uint32_t  dwKvno;
+	uint32_t  cbCipher;
+} KERB_ENC_DATA;
+
+typedef struct _KERB_MESSAGE
+{
+	int            iMsgType;			// KERB_MSG_*
+	int            fGssFramed;			// Inside an [APPLICATION 0] GSS-API token
+	int            fMsOid;				// Framed with the Microsoft Kerberos OID 1.2.840.48018.1.2.2
+	uint32_t       cbMessage;			// Kerberos message, framing excluded
+	uint32_t       dwApOptions;			// AP-REQ
+	DER_SLICE      Realm;				// Ticket realm, or the server realm of a KRB-ERROR
+	KERB_PRINCIPAL SName;
+	KERB_ENC_DATA  Ticket;				// Ticket enc-part
+	KERB_ENC_DATA  EncPart;				// AP-REQ authenticator or AP-REP enc-part
+	int32_t        iErrorCode;			// KRB-ERROR
+	int64_t        i64ServerTime;		// KRB-ERROR stime, seconds since 1970
+	uint32_t       dwServerUsec;
+	int            fClientTime;
+	int64_t        i64ClientTime;
+	DER_SLICE      CRealm;
+	KERB_PRINCIPAL CName;
+	DER_SLICE      EText;
+	uint32_t       cbEData;
+} KERB_MESSAGE;
+
+int KerbDecode( const uint8_t* pb, size_t cb, KERB_MESSAGE* pMsg );
+
+const char* KerbMsgTypeName( int iMsgType );
+const char* KerbEtypeName( int32_t iEtype );
+const char* KerbErrorName( int32_t iErrorCode );
+const char* KerbDecodeErrorName( int iError );
+char* KerbPrincipalFormat( const KERB_PRINCIPAL* pName, const DER_SLICE* pRealm, char* pszBuffer, size_t cchBuffer );
+char* KerbMessageFormat( const KERB_MESSAGE* pMsg, char* pszBuffer, size_t cchBuffer );
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "PerfStats.h"
+
+// One LSA connection to the Kerberos package, opened on first use and shared by everything that
+// asks it for tickets, and service ticket requests that run on several threads at once over it.
+// Requests are built in a fixed buffer, the only allocation is the response LSA returns.
+
+#define KERB_MAX_SPN_LENGTH		512		// Characters
+#define KERB_MAX_THREADS		16
+#define KERB_MAX_PREWARM		256		// SPNs in the prewarm list
+
+#ifndef KERB_RETRIEVE_TICKET_CACHE_TICKET
+#define KERB_RETRIEVE_TICKET_CACHE_TICKET	0x20
+#endif
+
+typedef struct _KERB_TICKET_RESULT
+{
+	NTSTATUS Status;
+	NTSTATUS SubStatus;				// Kerberos result, e.g. STATUS_NO_TRUST_SAM_ACCOUNT or 0xc000018b for an unknown SPN
+	uint64_t ui64Start;				// PerfCounter around LsaCallAuthenticationPackage
+	uint64_t ui64End;
+	BOOL     fTicket;				// A ticket came back, the fields below are set
+	LONG     lSessionKeyType;
+	ULONG    ulTicketFlags;
+	ULONG    cbEncodedTicket;
+	LARGE_INTEGER StartTime;
+	LARGE_INTEGER EndTime;
+	LARGE_INTEGER TimeSkew;			// LSA's measure of the KDC clock against ours, 100 ns units
+} KERB_TICKET_RESULT;
+
+BOOL KerbSessionOpen( HANDLE* phLogonHandle, ULONG* pulPackageId );
+void KerbSessionClose();
+BOOL KerbRequestTicket( const char* pszSPN, ULONG ulCacheOptions, KERB_TICKET_RESULT* pResult );
+void KerbRequestTickets( const char* const* rgpszSPNs, DWORD cSPNs, ULONG ulCacheOptions, DWORD cThreads, KERB_TICKET_RESULT* rgResults );
+double KerbTicketMs( const KERB_TICKET_RESULT* pResult );
+NTSTATUS KerbResultStatus( const KERB_TICKET_RESULT* pResult );
+const char* KerbStatusName( NTSTATUS Status );
+void PrewarmServiceTickets();
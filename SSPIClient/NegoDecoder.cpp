@@ -0,0 +1,1145 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// NegoDecoder.cpp: in place decoding of SPNEGO NegTokenInit/NegTokenResp (RFC 4178) and NTLM
+// NEGOTIATE/CHALLENGE/AUTHENTICATE messages (MS-NLMP), used to summarise the Negotiate tokens in
+// the InitializeSecurityContext and AcceptSecurityContext buffers and to tell whether a login
+// really used Kerberos or fell back to NTLM.
+//
+// Built without the precompiled header.  With NEGODECODER_STANDALONE defined it also builds a
+// tool that decodes token files, checks the decoder against synthetic tokens, benchmarks it
+// and fuzzes it, e.g.
+//   g++ -O2 -DNEGODECODER_STANDALONE NegoDecoder.cpp KerbDecoder.cpp DerCodec.cpp PerfStats.cpp -o negodecode
+//   ./negodecode token.bin
+//   g++ -g -fsanitize=address,undefined -DNEGODECODER_STANDALONE NegoDecoder.cpp KerbDecoder.cpp DerCodec.cpp PerfStats.cpp -o negofuzz
+//   ./negofuzz -fuzz 1000000
+// With NEGODECODER_LIBFUZZER defined it exports LLVMFuzzerTestOneInput for clang -fsanitize=fuzzer.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "NegoDecoder.h"
+
+static const uint8_t g_rgbOidSpnego[]     = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x02 };								// 1.3.6.1.5.5.2
+static const uint8_t g_rgbOidKrb5[]       = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02 };			// 1.2.840.113554.1.2.2
+static const uint8_t g_rgbOidMsKrb5[]     = { 0x2a, 0x86, 0x48, 0x82, 0xf7, 0x12, 0x01, 0x02, 0x02 };			// 1.2.840.48018.1.2.2
+static const uint8_t g_rgbOidKrb5U2U[]    = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x12, 0x01, 0x02, 0x02, 0x03 };	// 1.2.840.113554.1.2.2.3
+static const uint8_t g_rgbOidNtlm[]       = { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x0a };	// 1.3.6.1.4.1.311.2.2.10
+static const uint8_t g_rgbOidNegoEx[]     = { 0x2b, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x02, 0x1e };	// 1.3.6.1.4.1.311.2.2.30
+static const uint8_t g_rgbNtlmSignature[] = { 'N', 'T', 'L', 'M', 'S', 'S', 'P', 0 };
+static const uint8_t g_rgbNegoExSignature[] = { 'N', 'E', 'G', 'O', 'E', 'X', 'T', 'S' };
+
+#define GSS_TOKEN_TAG			DER_APPLICATION(0)
+
+// 100 ns intervals between 1601-01-01 and 1970-01-01.
+#define FILETIME_UNIX_EPOCH		116444736000000000ULL
+
+//
+// NTLM
+//
+
+static uint16_t GetU16( const uint8_t* pb )
+{
+	return (uint16_t) ( pb[0] | ( pb[1] << 8 ) );
+}
+
+static uint32_t GetU32( const uint8_t* pb )
+{
+	return (uint32_t) pb[0] | ( (uint32_t) pb[1] << 8 ) | ( (uint32_t) pb[2] << 16 ) | ( (uint32_t) pb[3] << 24 );
+}
+
+// Security buffer: Len (2), MaxLen (2), Offset (4) at ibField.  The payload must lie within
+// the message, an empty field leaves the slice empty whatever its offset says.
+static int ReadField( const uint8_t* pb, size_t cb, size_t ibField, DER_SLICE* pSlice )
+{
+	uint32_t cbValue, ibValue;
+
+	pSlice->pb = pb;
+	pSlice->cb = 0;
+	if ( ibField + 8 > cb ) return DER_ERR_TRUNCATED;
+	cbValue = GetU16( pb + ibField );
+	ibValue = GetU32( pb + ibField + 4 );
+	if ( 0 == cbValue ) return DER_OK;
+	if ( ibValue > cb || cbValue > cb - ibValue ) return DER_ERR_TRUNCATED;
+	pSlice->pb = pb + ibValue;
+	pSlice->cb = cbValue;
+	return DER_OK;
+}
+
+// VERSION: ProductMajorVersion, ProductMinorVersion, ProductBuild (2), Reserved (3), NTLMRevisionCurrent.
+static void ReadVersion( const uint8_t* pb, size_t cb, size_t ibVersion, NTLM_MESSAGE* pMsg )
+{
+	if ( 0 == ( pMsg->dwFlags & NTLM_FLAG_VERSION ) || ibVersion + 8 > cb ) return;
+	pMsg->bMajor    = pb[ibVersion];
+	pMsg->bMinor    = pb[ibVersion + 1];
+	pMsg->wBuild    = GetU16( pb + ibVersion + 2 );
+	pMsg->bRevision = pb[ibVersion + 7];
+	pMsg->fVersion  = 1;
+}
+
+// AV_PAIR list: AvId (2), AvLen (2), Value, ended by MsvAvEOL.
+static int ReadTargetInfo( const DER_SLICE* pInfo, NTLM_MESSAGE* pMsg )
+{
+	const uint8_t* pb = pInfo->pb;
+	size_t cb = pInfo->cb, ib = 0;
+	uint64_t ui64Time;
+	uint16_t wId, cbValue;
+	DER_SLICE Value;
+	uint32_t i;
+
+	while ( ib + 4 <= cb )
+	{
+		wId     = GetU16( pb + ib );
+		cbValue = GetU16( pb + ib + 2 );
+		ib += 4;
+		if ( cbValue > cb - ib ) return NEGO_ERR_NTLM;
+		if ( 0 == wId )
+		{
+			pMsg->fTargetInfo = 1;
+			return DER_OK;
+		}
+		Value.pb = pb + ib;
+		Value.cb = cbValue;
+		switch ( wId )
+		{
+			case 1:  pMsg->NbComputer  = Value; break;
+			case 2:  pMsg->NbDomain    = Value; break;
+			case 3:  pMsg->DnsComputer = Value; break;
+			case 4:  pMsg->DnsDomain   = Value; break;
+			case 5:  pMsg->DnsTree     = Value; break;
+			case 9:  pMsg->TargetSpn   = Value; break;
+			case 6:
+				if ( cbValue >= 4 ) pMsg->dwAvFlags = GetU32( Value.pb );
+				break;
+			case 7:
+				if ( cbValue < 8 ) break;
+				ui64Time = GetU32( Value.pb ) | ( (uint64_t) GetU32( Value.pb + 4 ) << 32 );
+				pMsg->i64Timestamp = (int64_t) ( ui64Time - FILETIME_UNIX_EPOCH ) / 10000000;
+				pMsg->fTimestamp = 1;
+				break;
+			case 10:
+				for ( i=0; i<cbValue && !pMsg->fChannelBindings; i++ ) pMsg->fChannelBindings = ( 0 != Value.pb[i] );
+				break;
+		}
+		ib += cbValue;
+	}
+	return NEGO_ERR_NTLM;
+}
+
+// Decodes one NTLMSSP message.  Returns DER_OK, DER_ERR_TRUNCATED when a field points past the
+// end, or NEGO_ERR_NTLM for a bad signature, message type or target info.
+int NtlmDecode( const uint8_t* pb, size_t cb, NTLM_MESSAGE* pMsg )
+{
+	DER_SLICE LmResponse, NtResponse, SessionKey, Info;
+	int iError;
+
+	memset( pMsg, 0, sizeof(NTLM_MESSAGE) );
+	if ( cb < 16 || 0 != memcmp( pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) ) ) return NEGO_ERR_NTLM;
+	pMsg->dwType = GetU32( pb + 8 );
+
+	switch ( pMsg->dwType )
+	{
+		// Signature, MessageType, NegotiateFlags, DomainNameFields, WorkstationFields, Version.
+		// Old clients stop after the flags.
+		case NTLM_NEGOTIATE:
+			pMsg->dwFlags = GetU32( pb + 12 );
+			if ( cb >= 32 )
+			{
+				DER_CHECK( ReadField( pb, cb, 16, &pMsg->Domain ) );
+				DER_CHECK( ReadField( pb, cb, 24, &pMsg->Workstation ) );
+				ReadVersion( pb, cb, 32, pMsg );
+			}
+			return DER_OK;
+
+		// Signature, MessageType, TargetNameFields, NegotiateFlags, ServerChallenge, Reserved,
+		// TargetInfoFields, Version.
+		case NTLM_CHALLENGE:
+			if ( cb < 32 ) return DER_ERR_TRUNCATED;
+			pMsg->dwFlags  = GetU32( pb + 20 );
+			pMsg->fUnicode = ( 0 != ( pMsg->dwFlags & NTLM_FLAG_UNICODE ) );
+			DER_CHECK( ReadField( pb, cb, 12, &pMsg->TargetName ) );
+			if ( cb >= 48 )
+			{
+				DER_CHECK( ReadField( pb, cb, 40, &Info ) );
+				if ( Info.cb > 0 ) DER_CHECK( ReadTargetInfo( &Info, pMsg ) );
+				ReadVersion( pb, cb, 48, pMsg );
+			}
+			return DER_OK;
+
+		// Signature, MessageType, LmChallengeResponseFields, NtChallengeResponseFields,
+		// DomainNameFields, UserNameFields, WorkstationFields, EncryptedRandomSessionKeyFields,
+		// NegotiateFlags, Version, MIC.
+		case NTLM_AUTHENTICATE:
+			if ( cb < 64 ) return DER_ERR_TRUNCATED;
+			pMsg->dwFlags  = GetU32( pb + 60 );
+			pMsg->fUnicode = ( 0 != ( pMsg->dwFlags & NTLM_FLAG_UNICODE ) );
+			DER_CHECK( ReadField( pb, cb, 12, &LmResponse ) );
+			DER_CHECK( ReadField( pb, cb, 20, &NtResponse ) );
+			DER_CHECK( ReadField( pb, cb, 28, &pMsg->Domain ) );
+			DER_CHECK( ReadField( pb, cb, 36, &pMsg->User ) );
+			DER_CHECK( ReadField( pb, cb, 44, &pMsg->Workstation ) );
+			DER_CHECK( ReadField( pb, cb, 52, &SessionKey ) );
+			pMsg->cbLmResponse = LmResponse.cb;
+			pMsg->cbNtResponse = NtResponse.cb;
+			ReadVersion( pb, cb, 64, pMsg );
+
+			// NTLMv2_RESPONSE: NTProofStr (16), then NTLMv2_CLIENT_CHALLENGE with RespType 1,
+			// HiRespType 1, Reserved (6), TimeStamp (8), ChallengeFromClient (8), Reserved (4)
+			// and the client's copy of the target info.
+			if ( NtResponse.cb > 44 && 1 == NtResponse.pb[16] && 1 == NtResponse.pb[17] )
+			{
+				Info.pb = NtResponse.pb + 44;
+				Info.cb = NtResponse.cb - 44;
+				DER_CHECK( ReadTargetInfo( &Info, pMsg ) );
+				pMsg->fMic = ( 0 != ( pMsg->dwAvFlags & NTLM_AV_FLAG_MIC ) );
+			}
+			return DER_OK;
+	}
+	return NEGO_ERR_NTLM;
+}
+
+//
+// SPNEGO
+//
+
+static int MechFromOid( const DER_SLICE* pOid )
+{
+	if ( DER_OID_IS( *pOid, g_rgbOidMsKrb5 ) )  return NEGO_MECH_MS_KERBEROS;
+	if ( DER_OID_IS( *pOid, g_rgbOidKrb5 ) )    return NEGO_MECH_KERBEROS;
+	if ( DER_OID_IS( *pOid, g_rgbOidKrb5U2U ) ) return NEGO_MECH_KERBEROS_U2U;
+	if ( DER_OID_IS( *pOid, g_rgbOidNtlm ) )    return NEGO_MECH_NTLM;
+	if ( DER_OID_IS( *pOid, g_rgbOidNegoEx ) )  return NEGO_MECH_NEGOEX;
+	return NEGO_MECH_OTHER;
+}
+
+// mechToken and responseToken: Kerberos, NTLM or NegoEx.  A token that cannot be decoded is
+// noted in iInnerError but does not fail the SPNEGO token around it.
+static void DecodeInnerToken( const DER_SLICE* pInner, NEGO_TOKEN* pToken )
+{
+	pToken->cbInner = pInner->cb;
+	if ( pInner->cb >= sizeof(g_rgbNtlmSignature) && 0 == memcmp( pInner->pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) ) )
+	{
+		pToken->iInnerMech  = NEGO_MECH_NTLM;
+		pToken->iInnerError = NtlmDecode( pInner->pb, pInner->cb, &pToken->Ntlm );
+		return;
+	}
+	if ( pInner->cb >= sizeof(g_rgbNegoExSignature) && 0 == memcmp( pInner->pb, g_rgbNegoExSignature, sizeof(g_rgbNegoExSignature) ) )
+	{
+		pToken->iInnerMech = NEGO_MECH_NEGOEX;
+		return;
+	}
+	pToken->iInnerError = KerbDecode( pInner->pb, pInner->cb, &pToken->Kerb );
+	if ( KERB_ERR_NOT_KERBEROS == pToken->iInnerError ) pToken->iInnerMech = NEGO_MECH_OTHER;
+	else pToken->iInnerMech = ( pToken->Kerb.fMsOid ) ? NEGO_MECH_MS_KERBEROS : NEGO_MECH_KERBEROS;
+}
+
+// NegTokenInit ::= SEQUENCE { mechTypes [0] MechTypeList, reqFlags [1] ContextFlags OPTIONAL,
+//     mechToken [2] OCTET STRING OPTIONAL, mechListMIC [3] OCTET STRING OPTIONAL }
+// NegTokenInit2, which servers send, has negHints at [3] and moves mechListMIC to [4].
+static int ReadNegTokenInit( const DER_SLICE* pInit, NEGO_TOKEN* pToken )
+{
+	DER_READER Outer, Init, Mechs, Hints;
+	DER_SLICE Seq, Value, Oid;
+	int iError;
+
+	pToken->iType = NEGO_TOKEN_INIT;
+	DerInitSlice( &Outer, pInit );
+	DER_CHECK( DerExpect( &Outer, DER_SEQUENCE, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+	DerInitSlice( &Init, &Seq );
+
+	if ( DER_CONTEXT(0) == DerPeek( &Init ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Init, DER_CONTEXT(0), DER_SEQUENCE, &Value ) );
+		DerInitSlice( &Mechs, &Value );
+		while ( !DerAtEnd( &Mechs ) )
+		{
+			DER_CHECK( DerExpect( &Mechs, DER_OID, &Oid ) );
+			if ( pToken->cMechs < NEGO_MAX_MECHS ) pToken->rgMechs[pToken->cMechs] = MechFromOid( &Oid );
+			pToken->cMechs++;
+		}
+	}
+	if ( DER_CONTEXT(1) == DerPeek( &Init ) ) DER_CHECK( DerExpectExplicit( &Init, DER_CONTEXT(1), DER_BIT_STRING, &Value ) );
+	if ( DER_CONTEXT(2) == DerPeek( &Init ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Init, DER_CONTEXT(2), DER_OCTET_STRING, &Value ) );
+		DecodeInnerToken( &Value, pToken );
+	}
+	if ( DER_CONTEXT(3) == DerPeek( &Init ) )
+	{
+		DER_CHECK( DerExpect( &Init, DER_CONTEXT(3), &Value ) );
+		DerInitSlice( &Hints, &Value );
+		if ( DER_SEQUENCE == DerPeek( &Hints ) )
+		{
+			DER_CHECK( DerExpect( &Hints, DER_SEQUENCE, &Seq ) );
+			DerInitSlice( &Hints, &Seq );
+			if ( DER_CONTEXT(0) == DerPeek( &Hints ) ) DER_CHECK( DerExpectExplicit( &Hints, DER_CONTEXT(0), DER_GENERAL_STRING, &pToken->HintName ) );
+		}
+		else
+		{
+			DER_CHECK( DerExpect( &Hints, DER_OCTET_STRING, &Value ) );
+			pToken->fMechListMic = 1;
+		}
+	}
+	if ( DER_CONTEXT(4) == DerPeek( &Init ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Init, DER_CONTEXT(4), DER_OCTET_STRING, &Value ) );
+		pToken->fMechListMic = 1;
+	}
+	return ( DerAtEnd( &Init ) ) ? DER_OK : DER_ERR_TRAILING;
+}
+
+// NegTokenResp ::= SEQUENCE { negState [0] ENUMERATED OPTIONAL, supportedMech [1] MechType OPTIONAL,
+//     responseToken [2] OCTET STRING OPTIONAL, mechListMIC [3] OCTET STRING OPTIONAL }
+static int ReadNegTokenResp( const DER_SLICE* pResp, NEGO_TOKEN* pToken )
+{
+	DER_READER Outer, Resp;
+	DER_SLICE Seq, Value;
+	int64_t i64State;
+	int iError;
+
+	pToken->iType = NEGO_TOKEN_RESP;
+	DerInitSlice( &Outer, pResp );
+	DER_CHECK( DerExpect( &Outer, DER_SEQUENCE, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+	DerInitSlice( &Resp, &Seq );
+
+	if ( DER_CONTEXT(0) == DerPeek( &Resp ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Resp, DER_CONTEXT(0), DER_ENUMERATED, &Value ) );
+		DER_CHECK( DerReadInt( &Value, &i64State ) );
+		pToken->iNegState = (int) i64State;
+	}
+	if ( DER_CONTEXT(1) == DerPeek( &Resp ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Resp, DER_CONTEXT(1), DER_OID, &Value ) );
+		pToken->iSupportedMech = MechFromOid( &Value );
+	}
+	if ( DER_CONTEXT(2) == DerPeek( &Resp ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Resp, DER_CONTEXT(2), DER_OCTET_STRING, &Value ) );
+		DecodeInnerToken( &Value, pToken );
+	}
+	if ( DER_CONTEXT(3) == DerPeek( &Resp ) )
+	{
+		DER_CHECK( DerExpectExplicit( &Resp, DER_CONTEXT(3), DER_OCTET_STRING, &Value ) );
+		pToken->fMechListMic = 1;
+	}
+	return ( DerAtEnd( &Resp ) ) ? DER_OK : DER_ERR_TRAILING;
+}
+
+// Decodes one token: SPNEGO, bare NTLM or bare Kerberos.  Returns DER_OK, a DER_ERR_* code or
+// NEGO_ERR_NTLM for malformed input, or NEGO_ERR_UNKNOWN for anything else, e.g. Schannel.
+int NegoDecode( const uint8_t* pb, size_t cb, NEGO_TOKEN* pToken )
+{
+	DER_READER Outer, Gss;
+	DER_SLICE Value, Oid;
+	uint8_t bTag;
+	int iError;
+
+	memset( pToken, 0, sizeof(NEGO_TOKEN) );
+	pToken->iNegState = NEGO_STATE_NONE;
+
+	if ( cb >= sizeof(g_rgbNtlmSignature) && 0 == memcmp( pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) ) )
+	{
+		pToken->iType      = NEGO_TOKEN_NTLM;
+		pToken->iInnerMech = NEGO_MECH_NTLM;
+		pToken->cbInner    = (uint32_t) cb;
+		return NtlmDecode( pb, cb, &pToken->Ntlm );
+	}
+
+	DerInit( &Outer, pb, cb );
+	bTag = DerPeek( &Outer );
+
+	// The first token is GSS-API framed: [APPLICATION 0] { OID, NegTokenInit [0] }.  Later ones
+	// are a bare [1] NegTokenResp.  Kerberos uses the same framing with its own OID.
+	if ( GSS_TOKEN_TAG == bTag )
+	{
+		DER_CHECK( DerNext( &Outer, &bTag, &Value, NULL ) );
+		if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+		DerInitSlice( &Gss, &Value );
+		DER_CHECK( DerExpect( &Gss, DER_OID, &Oid ) );
+		if ( DER_OID_IS( Oid, g_rgbOidSpnego ) )
+		{
+			DER_CHECK( DerExpect( &Gss, DER_CONTEXT(0), &Value ) );
+			if ( !DerAtEnd( &Gss ) ) return DER_ERR_TRAILING;
+			return ReadNegTokenInit( &Value, pToken );
+		}
+	}
+	else if ( DER_CONTEXT(0) == bTag || DER_CONTEXT(1) == bTag )
+	{
+		DER_CHECK( DerNext( &Outer, &bTag, &Value, NULL ) );
+		if ( !DerAtEnd( &Outer ) ) return DER_ERR_TRAILING;
+		return ( DER_CONTEXT(0) == bTag ) ? ReadNegTokenInit( &Value, pToken ) : ReadNegTokenResp( &Value, pToken );
+	}
+
+	iError = KerbDecode( pb, cb, &pToken->Kerb );
+	if ( KERB_ERR_NOT_KERBEROS == iError ) return NEGO_ERR_UNKNOWN;
+	pToken->iType      = NEGO_TOKEN_KERBEROS;
+	pToken->iInnerMech = ( pToken->Kerb.fMsOid ) ? NEGO_MECH_MS_KERBEROS : NEGO_MECH_KERBEROS;
+	pToken->cbInner    = (uint32_t) cb;
+	return iError;
+}
+
+// The mechanism a decoded token shows in use: that of its inner token, else the one the
+// server selected.  NEGO_MECH_NONE while Negotiate has not picked one yet.
+int NegoTokenMech( const NEGO_TOKEN* pToken )
+{
+	if ( NEGO_MECH_NONE != pToken->iInnerMech && NEGO_MECH_OTHER != pToken->iInnerMech ) return pToken->iInnerMech;
+	return pToken->iSupportedMech;
+}
+
+// Why a Negotiate token is NTLM rather than Kerberos, or NULL if it is not.
+const char* NegoFallbackReason( const NEGO_TOKEN* pToken )
+{
+	uint32_t i;
+	int fKerberosOffered = 0;
+
+	if ( NEGO_MECH_NTLM != NegoTokenMech( pToken ) ) return NULL;
+
+	switch ( pToken->iType )
+	{
+		case NEGO_TOKEN_NTLM:
+			return "NTLM was used directly, not through Negotiate";
+
+		case NEGO_TOKEN_INIT:
+			for ( i=0; i<pToken->cMechs && i<NEGO_MAX_MECHS; i++ ) fKerberosOffered |= NEGO_IS_KERBEROS( pToken->rgMechs[i] );
+			if ( !fKerberosOffered ) return "Kerberos was not offered, e.g. a local account, a loopback target or an IP address target";
+			return "Kerberos was offered but no ticket was obtained for the target name, e.g. a missing or duplicate SPN or no KDC reachable";
+
+		case NEGO_TOKEN_RESP:
+			if ( NEGO_MECH_NTLM == pToken->iSupportedMech ) return "the server selected NTLM";
+			return "the exchange continues with NTLM";
+	}
+	return NULL;
+}
+
+//
+// Names
+//
+
+const char* NegoMechName( int iMech )
+{
+	switch ( iMech )
+	{
+		case NEGO_MECH_NONE:			return "none";
+		case NEGO_MECH_KERBEROS:		return "Kerberos";
+		case NEGO_MECH_MS_KERBEROS:		return "MS-Kerberos";
+		case NEGO_MECH_KERBEROS_U2U:	return "Kerberos-U2U";
+		case NEGO_MECH_NTLM:			return "NTLM";
+		case NEGO_MECH_NEGOEX:			return "NEGOEX";
+	}
+	return "other";
+}
+
+const char* NegoStateName( int iNegState )
+{
+	switch ( iNegState )
+	{
+		case NEGO_STATE_ACCEPT_COMPLETED:	return "accept-completed";
+		case NEGO_STATE_ACCEPT_INCOMPLETE:	return "accept-incomplete";
+		case NEGO_STATE_REJECT:				return "reject";
+		case NEGO_STATE_REQUEST_MIC:		return "request-mic";
+	}
+	return "unknown negState";
+}
+
+const char* NegoDecodeErrorName( int iError )
+{
+	switch ( iError )
+	{
+		case NEGO_ERR_UNKNOWN:	return "not a Negotiate, NTLM or Kerberos token";
+		case NEGO_ERR_NTLM:		return "malformed NTLM message";
+	}
+	return KerbDecodeErrorName( iError );
+}
+
+const char* NtlmMessageTypeName( uint32_t dwType )
+{
+	switch ( dwType )
+	{
+		case NTLM_NEGOTIATE:	return "NEGOTIATE";
+		case NTLM_CHALLENGE:	return "CHALLENGE";
+		case NTLM_AUTHENTICATE:	return "AUTHENTICATE";
+	}
+	return "unknown";
+}
+
+char* NtlmFlagsFormat( uint32_t dwFlags, char* pszBuffer, size_t cchBuffer )
+{
+	static const struct { uint32_t dwFlag; const char* pszName; } rgFlags[] =
+	{
+		{ 0x00000001, "UNICODE" },					{ 0x00000002, "OEM" },
+		{ 0x00000004, "REQUEST_TARGET" },			{ 0x00000010, "SIGN" },
+		{ 0x00000020, "SEAL" },						{ 0x00000040, "DATAGRAM" },
+		{ 0x00000080, "LM_KEY" },					{ 0x00000200, "NTLM" },
+		{ 0x00000800, "ANONYMOUS" },				{ 0x00001000, "OEM_DOMAIN_SUPPLIED" },
+		{ 0x00002000, "OEM_WORKSTATION_SUPPLIED" },	{ 0x00008000, "ALWAYS_SIGN" },
+		{ 0x00010000, "TARGET_TYPE_DOMAIN" },		{ 0x00020000, "TARGET_TYPE_SERVER" },
+		{ 0x00080000, "EXTENDED_SESSIONSECURITY" },	{ 0x00100000, "IDENTIFY" },
+		{ 0x00400000, "REQUEST_NON_NT_SESSION_KEY" },	{ 0x00800000, "TARGET_INFO" },
+		{ 0x02000000, "VERSION" },					{ 0x20000000, "128" },
+		{ 0x40000000, "KEY_EXCH" },					{ 0x80000000, "56" },
+	};
+	size_t cch, i;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	cch = (size_t) snprintf( pszBuffer, cchBuffer, "0x%08x", dwFlags );
+	for ( i=0; i<sizeof(rgFlags)/sizeof(rgFlags[0]) && cch < cchBuffer; i++ )
+	{
+		if ( dwFlags & rgFlags[i].dwFlag ) cch += (size_t) snprintf( pszBuffer + cch, cchBuffer - cch, " %s", rgFlags[i].pszName );
+	}
+	return pszBuffer;
+}
+
+// UTF-16LE or OEM string, anything outside printable ASCII shows as '?'.
+char* NtlmStringFormat( const DER_SLICE* pSlice, int fUnicode, char* pszBuffer, size_t cchBuffer )
+{
+	uint32_t i, cbChar = ( fUnicode ) ? 2 : 1;
+	size_t cch = 0;
+	uint16_t wChar;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	for ( i=0; i + cbChar <= pSlice->cb && cch + 1 < cchBuffer; i += cbChar )
+	{
+		wChar = ( fUnicode ) ? GetU16( pSlice->pb + i ) : pSlice->pb[i];
+		pszBuffer[cch++] = ( wChar >= 0x20 && wChar <= 0x7e ) ? (char) wChar : '?';
+	}
+	pszBuffer[cch] = 0;
+	return pszBuffer;
+}
+
+#define FORMAT_APPEND(...)		do { if ( cch < cchBuffer ) cch += (size_t) snprintf( pszBuffer + cch, cchBuffer - cch, __VA_ARGS__ ); } while ( 0 )
+
+// One line summary of a decoded NTLM message.
+char* NtlmMessageFormat( const NTLM_MESSAGE* pMsg, char* pszBuffer, size_t cchBuffer )
+{
+	char szFlags[512], szName[256], szDomain[256], szHost[256], szTime[32];
+	size_t cch;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	cch = (size_t) snprintf( pszBuffer, cchBuffer, "NTLM %s", NtlmMessageTypeName( pMsg->dwType ) );
+
+	switch ( pMsg->dwType )
+	{
+		case NTLM_NEGOTIATE:
+			if ( pMsg->Domain.cb > 0 ) FORMAT_APPEND( " domain %s", NtlmStringFormat( &pMsg->Domain, 0, szDomain, sizeof(szDomain) ) );
+			if ( pMsg->Workstation.cb > 0 ) FORMAT_APPEND( " from %s", NtlmStringFormat( &pMsg->Workstation, 0, szHost, sizeof(szHost) ) );
+			break;
+
+		case NTLM_CHALLENGE:
+			FORMAT_APPEND( " from %s", NtlmStringFormat( &pMsg->TargetName, pMsg->fUnicode, szName, sizeof(szName) ) );
+			if ( pMsg->DnsComputer.cb > 0 ) FORMAT_APPEND( ", server %s", NtlmStringFormat( &pMsg->DnsComputer, 1, szHost, sizeof(szHost) ) );
+			else if ( pMsg->NbComputer.cb > 0 ) FORMAT_APPEND( ", server %s", NtlmStringFormat( &pMsg->NbComputer, 1, szHost, sizeof(szHost) ) );
+			if ( pMsg->DnsDomain.cb > 0 ) FORMAT_APPEND( " in %s", NtlmStringFormat( &pMsg->DnsDomain, 1, szDomain, sizeof(szDomain) ) );
+			if ( pMsg->fTimestamp ) FORMAT_APPEND( ", server time %s UTC", DerTimeFormat( pMsg->i64Timestamp, szTime, sizeof(szTime) ) );
+			break;
+
+		case NTLM_AUTHENTICATE:
+			if ( 0 == pMsg->User.cb && pMsg->cbNtResponse <= 1 ) FORMAT_APPEND( " anonymous" );
+			else FORMAT_APPEND( " %s\\%s", NtlmStringFormat( &pMsg->Domain, pMsg->fUnicode, szDomain, sizeof(szDomain) ),
+								NtlmStringFormat( &pMsg->User, pMsg->fUnicode, szName, sizeof(szName) ) );
+			if ( pMsg->Workstation.cb > 0 ) FORMAT_APPEND( " from %s", NtlmStringFormat( &pMsg->Workstation, pMsg->fUnicode, szHost, sizeof(szHost) ) );
+			if ( pMsg->cbNtResponse > 1 ) FORMAT_APPEND( ", %s response %u bytes", ( pMsg->cbNtResponse > 24 ) ? "NTLMv2" : "NTLMv1", pMsg->cbNtResponse );
+			if ( pMsg->TargetSpn.cb > 0 ) FORMAT_APPEND( ", target %s", NtlmStringFormat( &pMsg->TargetSpn, 1, szName, sizeof(szName) ) );
+			if ( pMsg->fMic ) FORMAT_APPEND( ", MIC" );
+			if ( pMsg->fChannelBindings ) FORMAT_APPEND( ", channel bindings" );
+			break;
+	}
+
+	FORMAT_APPEND( ", flags %s", NtlmFlagsFormat( pMsg->dwFlags, szFlags, sizeof(szFlags) ) );
+	if ( pMsg->fVersion ) FORMAT_APPEND( ", version %u.%u.%u rev %u", pMsg->bMajor, pMsg->bMinor, pMsg->wBuild, pMsg->bRevision );
+	return pszBuffer;
+}
+
+static size_t FormatInnerToken( const NEGO_TOKEN* pToken, char* pszBuffer, size_t cchBuffer )
+{
+	char szInner[1536];
+
+	if ( 0 == cchBuffer ) return 0;
+	if ( DER_OK != pToken->iInnerError )
+	{
+		return (size_t) snprintf( pszBuffer, cchBuffer, "%s, %u bytes, cannot be decoded: %s", NegoMechName( pToken->iInnerMech ),
+								  pToken->cbInner, NegoDecodeErrorName( pToken->iInnerError ) );
+	}
+	switch ( pToken->iInnerMech )
+	{
+		case NEGO_MECH_NTLM:
+			return (size_t) snprintf( pszBuffer, cchBuffer, "%s", NtlmMessageFormat( &pToken->Ntlm, szInner, sizeof(szInner) ) );
+
+		case NEGO_MECH_KERBEROS:
+		case NEGO_MECH_MS_KERBEROS:
+			return (size_t) snprintf( pszBuffer, cchBuffer, "Kerberos %s", KerbMessageFormat( &pToken->Kerb, szInner, sizeof(szInner) ) );
+	}
+	return (size_t) snprintf( pszBuffer, cchBuffer, "%s, %u bytes", NegoMechName( pToken->iInnerMech ), pToken->cbInner );
+}
+
+// One line summary of a decoded token.
+char* NegoTokenFormat( const NEGO_TOKEN* pToken, char* pszBuffer, size_t cchBuffer )
+{
+	char szHint[256];
+	size_t cch = 0;
+	uint32_t i;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	pszBuffer[0] = 0;
+
+	switch ( pToken->iType )
+	{
+		case NEGO_TOKEN_INIT:
+			FORMAT_APPEND( "SPNEGO NegTokenInit mechs" );
+			for ( i=0; i<pToken->cMechs && i<NEGO_MAX_MECHS; i++ ) FORMAT_APPEND( "%s %s", ( i > 0 ) ? "," : "", NegoMechName( pToken->rgMechs[i] ) );
+			if ( pToken->cMechs > NEGO_MAX_MECHS ) FORMAT_APPEND( ", ... (%u)", pToken->cMechs );
+			if ( 0 == pToken->cMechs ) FORMAT_APPEND( " none" );
+			if ( pToken->HintName.cb > 0 ) FORMAT_APPEND( ", hint %s", DerStringFormat( &pToken->HintName, szHint, sizeof(szHint) ) );
+			if ( pToken->cbInner > 0 ) FORMAT_APPEND( "; mechToken " );
+			break;
+
+		case NEGO_TOKEN_RESP:
+			FORMAT_APPEND( "SPNEGO NegTokenResp" );
+			if ( NEGO_STATE_NONE != pToken->iNegState ) FORMAT_APPEND( " %s", NegoStateName( pToken->iNegState ) );
+			if ( NEGO_MECH_NONE != pToken->iSupportedMech ) FORMAT_APPEND( ", supportedMech %s", NegoMechName( pToken->iSupportedMech ) );
+			if ( pToken->cbInner > 0 ) FORMAT_APPEND( "; responseToken " );
+			break;
+	}
+
+	if ( pToken->cbInner > 0 && cch < cchBuffer ) cch += FormatInnerToken( pToken, pszBuffer + cch, cchBuffer - cch );
+	if ( pToken->fMechListMic ) FORMAT_APPEND( "; mechListMIC" );
+	return pszBuffer;
+}
+
+#undef FORMAT_APPEND
+
+#ifdef NEGODECODER_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t* pb, size_t cb )
+{
+	NEGO_TOKEN Token;
+	char szSummary[2048];
+
+	if ( DER_OK == NegoDecode( pb, cb, &Token ) )
+	{
+		NegoTokenFormat( &Token, szSummary, sizeof(szSummary) );
+		NegoFallbackReason( &Token );
+	}
+	return 0;
+}
+
+#endif
+
+#ifdef NEGODECODER_STANDALONE
+
+#include "PerfStats.h"
+
+//
+// Synthetic tokens for the checks, the benchmark and the fuzzer.
+//
+
+static void PutU16( uint8_t* pb, uint32_t dwValue )
+{
+	pb[0] = (uint8_t) dwValue;
+	pb[1] = (uint8_t) ( dwValue >> 8 );
+}
+
+static void PutU32( uint8_t* pb, uint32_t dwValue )
+{
+	PutU16( pb, dwValue );
+	PutU16( pb + 2, dwValue >> 16 );
+}
+
+// Appends a UTF-16LE or OEM string to the payload at *pib and points the field at ibField to it.
+static void PutField( uint8_t* pb, size_t ibField, size_t* pib, const uint8_t* pbValue, size_t cbValue )
+{
+	PutU16( pb + ibField, (uint32_t) cbValue );
+	PutU16( pb + ibField + 2, (uint32_t) cbValue );
+	PutU32( pb + ibField + 4, (uint32_t) *pib );
+	memcpy( pb + *pib, pbValue, cbValue );
+	*pib += cbValue;
+}
+
+static size_t PutUnicode( uint8_t* pb, const char* psz )
+{
+	size_t i, cch = strlen( psz );
+	for ( i=0; i<cch; i++ ) PutU16( pb + i*2, (uint8_t) psz[i] );
+	return cch * 2;
+}
+
+static size_t PutAvPair( uint8_t* pb, uint16_t wId, const uint8_t* pbValue, size_t cbValue )
+{
+	PutU16( pb, wId );
+	PutU16( pb + 2, (uint32_t) cbValue );
+	if ( cbValue > 0 ) memcpy( pb + 4, pbValue, cbValue );
+	return 4 + cbValue;
+}
+
+static size_t PutAvString( uint8_t* pb, uint16_t wId, const char* psz )
+{
+	uint8_t rgb[512];
+	return PutAvPair( pb, wId, rgb, PutUnicode( rgb, psz ) );
+}
+
+// Target info as a Windows server sends it.  dwAvFlags and pszSpn are only set in the
+// client's copy inside AUTHENTICATE.
+static size_t PutTargetInfo( uint8_t* pb, const char* pszNbDomain, const char* pszHost, const char* pszDnsDomain, uint32_t dwAvFlags, const char* pszSpn )
+{
+	static const uint8_t rgbTime[8] = { 0x00, 0x6a, 0xd3, 0xb2, 0xb2, 0x5f, 0xdd, 0x01 };	// 2026-10-19 10:15:00 UTC
+	char szDnsHost[256];
+	uint8_t rgbFlags[4];
+	size_t cb;
+
+	snprintf( szDnsHost, sizeof(szDnsHost), "%s.%s", pszHost, pszDnsDomain );
+	cb  = PutAvString( pb, 2, pszNbDomain );
+	cb += PutAvString( pb + cb, 1, pszHost );
+	cb += PutAvString( pb + cb, 4, pszDnsDomain );
+	cb += PutAvString( pb + cb, 3, szDnsHost );
+	cb += PutAvString( pb + cb, 5, pszDnsDomain );
+	cb += PutAvPair( pb + cb, 7, rgbTime, sizeof(rgbTime) );
+	if ( 0 != dwAvFlags )
+	{
+		PutU32( rgbFlags, dwAvFlags );
+		cb += PutAvPair( pb + cb, 6, rgbFlags, sizeof(rgbFlags) );
+	}
+	if ( NULL != pszSpn ) cb += PutAvString( pb + cb, 9, pszSpn );
+	cb += PutAvPair( pb + cb, 0, NULL, 0 );
+	return cb;
+}
+
+static size_t PutVersion( uint8_t* pb )
+{
+	pb[0] = 10;
+	pb[1] = 0;
+	PutU16( pb + 2, 20348 );
+	pb[4] = pb[5] = pb[6] = 0;
+	pb[7] = 15;
+	return 8;
+}
+
+#define BUILD_FLAGS		0xe2888215		// Typical NTLMv2 client flags, no SEAL
+
+static size_t BuildNtlmNegotiate( uint8_t* pb )
+{
+	memset( pb, 0, 40 );
+	memcpy( pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) );
+	PutU32( pb + 8, NTLM_NEGOTIATE );
+	PutU32( pb + 12, 0xe2088297 );
+	PutU32( pb + 20, 40 );
+	PutU32( pb + 28, 40 );
+	return 32 + PutVersion( pb + 32 );
+}
+
+static size_t BuildNtlmChallenge( uint8_t* pb, const char* pszNbDomain, const char* pszHost, const char* pszDnsDomain )
+{
+	uint8_t rgb[2048];
+	size_t ib = 56;
+
+	memset( pb, 0, ib );
+	memcpy( pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) );
+	PutU32( pb + 8, NTLM_CHALLENGE );
+	PutField( pb, 12, &ib, rgb, PutUnicode( rgb, pszNbDomain ) );
+	PutU32( pb + 20, BUILD_FLAGS );
+	memset( pb + 24, 0x11, 8 );
+	PutField( pb, 40, &ib, rgb, PutTargetInfo( rgb, pszNbDomain, pszHost, pszDnsDomain, 0, NULL ) );
+	PutVersion( pb + 48 );
+	return ib;
+}
+
+static size_t BuildNtlmAuthenticate( uint8_t* pb, const char* pszDomain, const char* pszUser, const char* pszWorkstation, const char* pszSpn )
+{
+	uint8_t rgb[2048];
+	size_t ib = 88, cbNt;
+
+	memset( pb, 0, ib );
+	memcpy( pb, g_rgbNtlmSignature, sizeof(g_rgbNtlmSignature) );
+	PutU32( pb + 8, NTLM_AUTHENTICATE );
+
+	// LMv2 is zeroed when the target info has a timestamp, the NTLMv2 response carries a copy.
+	memset( rgb, 0, 24 );
+	PutField( pb, 12, &ib, rgb, 24 );
+	memset( rgb, 0x5a, 16 );
+	memset( rgb + 16, 0, 28 );
+	rgb[16] = rgb[17] = 1;
+	cbNt = 44 + PutTargetInfo( rgb + 44, "CONTOSO", "SQLPROD01", "contoso.com", NTLM_AV_FLAG_MIC, pszSpn );
+	memset( rgb + cbNt, 0, 4 );
+	PutField( pb, 20, &ib, rgb, cbNt + 4 );
+	PutField( pb, 28, &ib, rgb, PutUnicode( rgb, pszDomain ) );
+	PutField( pb, 36, &ib, rgb, PutUnicode( rgb, pszUser ) );
+	PutField( pb, 44, &ib, rgb, PutUnicode( rgb, pszWorkstation ) );
+	memset( rgb, 0x33, 16 );
+	PutField( pb, 52, &ib, rgb, 16 );
+	PutU32( pb + 60, BUILD_FLAGS );
+	PutVersion( pb + 64 );
+	memset( pb + 72, 0x77, 16 );
+	return ib;
+}
+
+// A GSS framed AP-REQ as Negotiate puts it in mechToken, with an opaque ticket of the given size.
+static size_t BuildApReq( uint8_t* pb, const char* pszService, const char* pszHost, const char* pszRealm, size_t cbTicketCipher )
+{
+	static uint8_t rgbTicket[8192], rgbReq[16384], rgbCipher[4096], rgb[8192];
+	static const uint8_t rgbOptions[] = { 0x00, 0x20, 0x00, 0x00, 0x00 };
+	uint8_t rgbInt[16], rgbRealm[256];
+	size_t cb, cbTicket, cbName;
+
+#define PUT_EXPLICIT(pbOut, n, pbIn, cbIn)	DerPutTlv( pbOut, DER_CONTEXT(n), pbIn, cbIn )
+#define PUT_INT(pbOut, n, i)				PUT_EXPLICIT( pbOut, n, rgbInt, DerPutInt( rgbInt, i ) )
+
+	// sname: { name-type [0] 2, name-string [1] { service, host } }
+	cbName  = DerPutString( rgb, DER_GENERAL_STRING, pszService );
+	cbName += DerPutString( rgb + cbName, DER_GENERAL_STRING, pszHost );
+	cbName  = DerPutTlv( rgb, DER_SEQUENCE, rgb, cbName );
+	memmove( rgb + 16, rgb, cbName );
+	cb      = PUT_INT( rgb, 0, 2 );
+	cbName  = cb + PUT_EXPLICIT( rgb + cb, 1, rgb + 16, cbName );
+	cbName  = DerPutTlv( rgb, DER_SEQUENCE, rgb, cbName );
+
+	cbTicket  = PUT_INT( rgbTicket, 0, 5 );
+	cbTicket += PUT_EXPLICIT( rgbTicket + cbTicket, 1, rgbRealm, DerPutString( rgbRealm, DER_GENERAL_STRING, pszRealm ) );
+	cbTicket += PUT_EXPLICIT( rgbTicket + cbTicket, 2, rgb, cbName );
+	memset( rgbCipher, 0xa5, cbTicketCipher );
+	cb  = PUT_INT( rgb, 0, 18 );
+	cb += PUT_INT( rgb + cb, 1, 7 );
+	cb += PUT_EXPLICIT( rgb + cb, 2, rgbCipher, DerPutTlv( rgbCipher, DER_OCTET_STRING, rgbCipher, cbTicketCipher ) );
+	cbTicket += PUT_EXPLICIT( rgbTicket + cbTicket, 3, rgb, DerPutTlv( rgb, DER_SEQUENCE, rgb, cb ) );
+	cbTicket  = DerPutTlv( rgbTicket, DER_SEQUENCE, rgbTicket, cbTicket );
+	cbTicket  = DerPutTlv( rgbTicket, DER_APPLICATION(KERB_MSG_TICKET), rgbTicket, cbTicket );
+
+	cb  = PUT_INT( rgbReq, 0, 5 );
+	cb += PUT_INT( rgbReq + cb, 1, KERB_MSG_AP_REQ );
+	cb += PUT_EXPLICIT( rgbReq + cb, 2, rgbInt, DerPutTlv( rgbInt, DER_BIT_STRING, rgbOptions, sizeof(rgbOptions) ) );
+	cb += PUT_EXPLICIT( rgbReq + cb, 3, rgbTicket, cbTicket );
+	memset( rgbCipher, 0x5a, 180 );
+	cbName  = PUT_INT( rgb, 0, 18 );
+	cbName += PUT_EXPLICIT( rgb + cbName, 2, rgbCipher, DerPutTlv( rgbCipher, DER_OCTET_STRING, rgbCipher, 180 ) );
+	cb += PUT_EXPLICIT( rgbReq + cb, 4, rgb, DerPutTlv( rgb, DER_SEQUENCE, rgb, cbName ) );
+	cb  = DerPutTlv( rgbReq, DER_SEQUENCE, rgbReq, cb );
+	cb  = DerPutTlv( rgbReq, DER_APPLICATION(KERB_MSG_AP_REQ), rgbReq, cb );
+
+#undef PUT_INT
+#undef PUT_EXPLICIT
+
+	// InitialContextToken with the Microsoft Kerberos OID and TOK_ID 01 00.
+	memmove( rgbReq + sizeof(g_rgbOidMsKrb5) + 4, rgbReq, cb );
+	DerPutTlv( rgbReq, DER_OID, g_rgbOidMsKrb5, sizeof(g_rgbOidMsKrb5) );
+	rgbReq[sizeof(g_rgbOidMsKrb5) + 2] = 0x01;
+	rgbReq[sizeof(g_rgbOidMsKrb5) + 3] = 0x00;
+	return DerPutTlv( pb, GSS_TOKEN_TAG, rgbReq, cb + sizeof(g_rgbOidMsKrb5) + 4 );
+}
+
+// GSS framed NegTokenInit listing the Windows mechanisms, or only NTLM when fKerberos is not set.
+static size_t BuildNegTokenInit( uint8_t* pb, int fKerberos, const uint8_t* pbMechToken, size_t cbMechToken )
+{
+	static uint8_t rgb[32768];
+	uint8_t rgbMechs[128];
+	size_t cb, cbMechs = 0;
+
+	if ( fKerberos )
+	{
+		cbMechs += DerPutTlv( rgbMechs + cbMechs, DER_OID, g_rgbOidMsKrb5, sizeof(g_rgbOidMsKrb5) );
+		cbMechs += DerPutTlv( rgbMechs + cbMechs, DER_OID, g_rgbOidKrb5, sizeof(g_rgbOidKrb5) );
+		cbMechs += DerPutTlv( rgbMechs + cbMechs, DER_OID, g_rgbOidNegoEx, sizeof(g_rgbOidNegoEx) );
+	}
+	cbMechs += DerPutTlv( rgbMechs + cbMechs, DER_OID, g_rgbOidNtlm, sizeof(g_rgbOidNtlm) );
+	cbMechs  = DerPutTlv( rgbMechs, DER_SEQUENCE, rgbMechs, cbMechs );
+
+	cb = DerPutTlv( rgb, DER_CONTEXT(0), rgbMechs, cbMechs );
+	cb += DerPutTlv( rgb + cb, DER_CONTEXT(2), pb, DerPutTlv( pb, DER_OCTET_STRING, pbMechToken, cbMechToken ) );
+	cb  = DerPutTlv( rgb, DER_SEQUENCE, rgb, cb );
+	cb  = DerPutTlv( rgb, DER_CONTEXT(0), rgb, cb );
+	memmove( rgb + sizeof(g_rgbOidSpnego) + 2, rgb, cb );
+	cb += DerPutTlv( rgb, DER_OID, g_rgbOidSpnego, sizeof(g_rgbOidSpnego) );
+	return DerPutTlv( pb, GSS_TOKEN_TAG, rgb, cb );
+}
+
+static size_t BuildNegTokenResp( uint8_t* pb, int iNegState, const uint8_t* pbOid, size_t cbOid, const uint8_t* pbResponse, size_t cbResponse )
+{
+	static uint8_t rgb[32768];
+	uint8_t rgbValue[64];
+	size_t cb = 0;
+
+	rgbValue[0] = DER_ENUMERATED;
+	rgbValue[1] = 1;
+	rgbValue[2] = (uint8_t) iNegState;
+	cb += DerPutTlv( rgb + cb, DER_CONTEXT(0), rgbValue, 3 );
+	if ( NULL != pbOid ) cb += DerPutTlv( rgb + cb, DER_CONTEXT(1), rgbValue, DerPutTlv( rgbValue, DER_OID, pbOid, cbOid ) );
+	if ( NULL != pbResponse )
+	{
+		cb += DerPutTlv( rgb + cb, DER_CONTEXT(2), pb, DerPutTlv( pb, DER_OCTET_STRING, pbResponse, cbResponse ) );
+	}
+	cb = DerPutTlv( rgb, DER_SEQUENCE, rgb, cb );
+	return DerPutTlv( pb, DER_CONTEXT(1), rgb, cb );
+}
+
+//
+// Files
+//
+
+// Token files are either binary or hex text, e.g. copied from a log or a network trace.
+static size_t LoadToken( const char* pszFile, uint8_t* pb, size_t cbMax )
+{
+	uint8_t* pbFile = (uint8_t*) malloc( cbMax );
+	size_t cbFile, cb = 0, i;
+	int fHex = 1, iHigh = -1, iValue;
+	FILE* f = fopen( pszFile, "rb" );
+
+	if ( NULL == f || NULL == pbFile )
+	{
+		if ( NULL != f ) fclose( f );
+		free( pbFile );
+		return 0;
+	}
+	cbFile = fread( pbFile, 1, cbMax, f );
+	fclose( f );
+
+	for ( i=0; i<cbFile && fHex; i++ ) fHex = ( NULL != strchr( "0123456789abcdefABCDEF \t\r\n", pbFile[i] ) );
+	if ( !fHex )
+	{
+		memcpy( pb, pbFile, cbFile );
+		free( pbFile );
+		return cbFile;
+	}
+	for ( i=0; i<cbFile; i++ )
+	{
+		char c = (char) pbFile[i];
+		iValue = ( c >= '0' && c <= '9' ) ? c - '0' : ( c >= 'a' && c <= 'f' ) ? c - 'a' + 10 : ( c >= 'A' && c <= 'F' ) ? c - 'A' + 10 : -1;
+		if ( iValue < 0 ) continue;
+		if ( iHigh < 0 ) iHigh = iValue;
+		else
+		{
+			pb[cb++] = (uint8_t) ( ( iHigh << 4 ) | iValue );
+			iHigh = -1;
+		}
+	}
+	free( pbFile );
+	return cb;
+}
+
+static int DecodeFile( const char* pszFile )
+{
+	static uint8_t rgbToken[1 << 20];
+	char szSummary[4096];
+	const char* pszReason;
+	NEGO_TOKEN Token;
+	size_t cb = LoadToken( pszFile, rgbToken, sizeof(rgbToken) );
+	int iError;
+
+	if ( 0 == cb )
+	{
+		fprintf( stderr, "Cannot read %s\n", pszFile );
+		return 1;
+	}
+	iError = NegoDecode( rgbToken, cb, &Token );
+	if ( DER_OK != iError )
+	{
+		printf( "%s: %u bytes, %s\n", pszFile, (unsigned) cb, NegoDecodeErrorName( iError ) );
+		return 1;
+	}
+	printf( "%s: %s\n", pszFile, NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ) );
+	pszReason = NegoFallbackReason( &Token );
+	if ( NULL != pszReason ) printf( "%s: NTLM fallback, %s\n", pszFile, pszReason );
+	return 0;
+}
+
+//
+// Checks, benchmark and fuzzer
+//
+
+static int RunChecks()
+{
+	static uint8_t rgbInner[16384], rgb[32768];
+	char szSummary[4096], szName[256];
+	NEGO_TOKEN Token;
+	size_t cbInner, cb;
+	int cFailed = 0, iError;
+
+	// Kerberos through Negotiate, what a domain joined client sends for a good SPN.
+	cbInner = BuildApReq( rgbInner, "MSSQLSvc", "sqlprod01.contoso.com:1433", "CONTOSO.COM", 1100 );
+	cb = BuildNegTokenInit( rgb, 1, rgbInner, cbInner );
+	iError = NegoDecode( rgb, cb, &Token );
+	if ( DER_OK != iError || NEGO_TOKEN_INIT != Token.iType || 4 != Token.cMechs || NEGO_MECH_MS_KERBEROS != Token.rgMechs[0] ||
+		 NEGO_MECH_NTLM != Token.rgMechs[3] || !NEGO_IS_KERBEROS( NegoTokenMech( &Token ) ) || KERB_MSG_AP_REQ != Token.Kerb.iMsgType ||
+		 NULL != NegoFallbackReason( &Token ) )
+	{
+		printf( "FAIL NegTokenInit with AP-REQ: %s, inner %s\n", NegoDecodeErrorName( iError ), NegoDecodeErrorName( Token.iInnerError ) );
+		cFailed++;
+	}
+	else printf( "%s\n", NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ) );
+
+	// Kerberos offered, NTLM sent: the SPN had no ticket.
+	cbInner = BuildNtlmNegotiate( rgbInner );
+	cb = BuildNegTokenInit( rgb, 1, rgbInner, cbInner );
+	iError = NegoDecode( rgb, cb, &Token );
+	if ( DER_OK != iError || NEGO_MECH_NTLM != NegoTokenMech( &Token ) || NTLM_NEGOTIATE != Token.Ntlm.dwType ||
+		 !Token.Ntlm.fVersion || 20348 != Token.Ntlm.wBuild || NULL == NegoFallbackReason( &Token ) )
+	{
+		printf( "FAIL NegTokenInit with NTLM NEGOTIATE: %s\n", NegoDecodeErrorName( iError ) );
+		cFailed++;
+	}
+	else printf( "%s\n  fallback: %s\n", NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ), NegoFallbackReason( &Token ) );
+
+	cbInner = BuildNtlmChallenge( rgbInner, "CONTOSO", "SQLPROD01", "contoso.com" );
+	cb = BuildNegTokenResp( rgb, NEGO_STATE_ACCEPT_INCOMPLETE, g_rgbOidNtlm, sizeof(g_rgbOidNtlm), rgbInner, cbInner );
+	iError = NegoDecode( rgb, cb, &Token );
+	NtlmStringFormat( &Token.Ntlm.DnsComputer, 1, szName, sizeof(szName) );
+	if ( DER_OK != iError || NEGO_TOKEN_RESP != Token.iType || NEGO_STATE_ACCEPT_INCOMPLETE != Token.iNegState ||
+		 NEGO_MECH_NTLM != Token.iSupportedMech || NTLM_CHALLENGE != Token.Ntlm.dwType || !Token.Ntlm.fTargetInfo ||
+		 0 != strcmp( szName, "SQLPROD01.contoso.com" ) || !Token.Ntlm.fTimestamp || 1792404900 != Token.Ntlm.i64Timestamp )
+	{
+		printf( "FAIL NegTokenResp with NTLM CHALLENGE: %s, %s, time %lld\n", NegoDecodeErrorName( iError ), szName, (long long) Token.Ntlm.i64Timestamp );
+		cFailed++;
+	}
+	else printf( "%s\n", NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ) );
+
+	cbInner = BuildNtlmAuthenticate( rgbInner, "CONTOSO", "svc_app", "APPSRV07", "MSSQLSvc/sqlprod01.contoso.com:1433" );
+	cb = BuildNegTokenResp( rgb, NEGO_STATE_ACCEPT_INCOMPLETE, NULL, 0, rgbInner, cbInner );
+	iError = NegoDecode( rgb, cb, &Token );
+	NtlmStringFormat( &Token.Ntlm.TargetSpn, 1, szName, sizeof(szName) );
+	if ( DER_OK != iError || NTLM_AUTHENTICATE != Token.Ntlm.dwType || Token.Ntlm.cbNtResponse <= 24 || !Token.Ntlm.fMic ||
+		 0 != strcmp( szName, "MSSQLSvc/sqlprod01.contoso.com:1433" ) )
+	{
+		printf( "FAIL NegTokenResp with NTLM AUTHENTICATE: %s, %s\n", NegoDecodeErrorName( iError ), szName );
+		cFailed++;
+	}
+	else printf( "%s\n", NegoTokenFormat( &Token, szSummary, sizeof(szSummary) ) );
+
+	// Tokens that are none of these, and NTLM messages pointing outside themselves.
+	cbInner = BuildNtlmChallenge( rgbInner, "CONTOSO", "SQLPROD01", "contoso.com" );
+	if ( NEGO_ERR_UNKNOWN != NegoDecode( (const uint8_t*) "\x16\x03\x01\x00\x05hello", 10, &Token ) ||
+		 DER_ERR_TRUNCATED != NegoDecode( rgbInner, cbInner - 1, &Token ) ||
+		 DER_ERR_TRUNCATED != NegoDecode( rgb, cb - 1, &Token ) )
+	{
+		printf( "FAIL rejecting unknown and truncated tokens\n" );
+		cFailed++;
+	}
+
+	printf( "5 decoder checks, %d failed\n", cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static int RunBenchmark( long cIterations )
+{
+	static uint8_t rgbInner[16384], rgbInit[32768], rgbChallenge[4096], rgbResp[8192];
+	NEGO_TOKEN Token;
+	uint64_t ui64Start;
+	double dInitMs, dRespMs;
+	size_t cbInit, cbResp, cb;
+	long i;
+
+	cb = BuildApReq( rgbInner, "MSSQLSvc", "sqlprod01.contoso.com:1433", "CONTOSO.COM", 1100 );
+	cbInit = BuildNegTokenInit( rgbInit, 1, rgbInner, cb );
+	cb = BuildNtlmChallenge( rgbChallenge, "CONTOSO", "SQLPROD01", "contoso.com" );
+	cbResp = BuildNegTokenResp( rgbResp, NEGO_STATE_ACCEPT_INCOMPLETE, g_rgbOidNtlm, sizeof(g_rgbOidNtlm), rgbChallenge, cb );
+
+	ui64Start = PerfCounter();
+	for ( i=0; i<cIterations; i++ )
+	{
+		if ( DER_OK != NegoDecode( rgbInit, cbInit, &Token ) ) return 1;
+	}
+	dInitMs = PerfElapsedMs( ui64Start );
+
+	ui64Start = PerfCounter();
+	for ( i=0; i<cIterations; i++ )
+	{
+		if ( DER_OK != NegoDecode( rgbResp, cbResp, &Token ) ) return 1;
+	}
+	dRespMs = PerfElapsedMs( ui64Start );
+
+	printf( "%ld iterations\n", cIterations );
+	printf( "NegTokenInit with AP-REQ, %u bytes:       %.1f ns each\n", (unsigned) cbInit, dInitMs * 1e6 / cIterations );
+	printf( "NegTokenResp with NTLM CHALLENGE, %u bytes: %.1f ns each\n", (unsigned) cbResp, dRespMs * 1e6 / cIterations );
+	return 0;
+}
+
+static uint32_t g_dwFuzzState = 0x2545f491;
+
+static uint32_t FuzzRandom()
+{
+	g_dwFuzzState ^= g_dwFuzzState << 13;
+	g_dwFuzzState ^= g_dwFuzzState >> 17;
+	g_dwFuzzState ^= g_dwFuzzState << 5;
+	return g_dwFuzzState;
+}
+
+// Mutates valid tokens and formats whatever still decodes.  Build with
+// -fsanitize=address,undefined to catch out of bounds reads.
+static int RunFuzzer( long cIterations, uint32_t dwSeed )
+{
+	static uint8_t rgbInner[16384], rgbSeeds[4][32768];
+	long rgcResults[NEGO_ERR_LAST + 1] = { 0 };
+	size_t rgcbSeeds[4], cb;
+	char szSummary[4096];
+	NEGO_TOKEN Token;
+	uint8_t* pb;
+	uint32_t i, cMutations, iSeed;
+	long n;
+	int iError;
+
+	if ( 0 != dwSeed ) g_dwFuzzState = dwSeed;
+	cb = BuildApReq( rgbInner, "MSSQLSvc", "sqlprod01.contoso.com:1433", "CONTOSO.COM", 200 );
+	rgcbSeeds[0] = BuildNegTokenInit( rgbSeeds[0], 1, rgbInner, cb );
+	cb = BuildNtlmNegotiate( rgbInner );
+	rgcbSeeds[1] = BuildNegTokenInit( rgbSeeds[1], 0, rgbInner, cb );
+	cb = BuildNtlmChallenge( rgbInner, "CONTOSO", "SQLPROD01", "contoso.com" );
+	rgcbSeeds[2] = BuildNegTokenResp( rgbSeeds[2], NEGO_STATE_ACCEPT_INCOMPLETE, g_rgbOidNtlm, sizeof(g_rgbOidNtlm), rgbInner, cb );
+	rgcbSeeds[3] = BuildNtlmAuthenticate( rgbSeeds[3], "CONTOSO", "svc_app", "APPSRV07", "MSSQLSvc/sqlprod01.contoso.com:1433" );
+
+	for ( n=0; n<cIterations; n++ )
+	{
+		iSeed = (uint32_t) ( n % 4 );
+		cb = rgcbSeeds[iSeed];
+		if ( 0 == FuzzRandom() % 4 ) cb = FuzzRandom() % rgcbSeeds[iSeed];
+
+		// A fresh heap block of the exact size, so ASan sees any read past the end.
+		pb = (uint8_t*) malloc( cb + 1 );
+		memcpy( pb, rgbSeeds[iSeed], cb );
+		cMutations = 1 + FuzzRandom() % 6;
+		for ( i=0; i<cMutations && cb > 0; i++ )
+		{
+			uint32_t iAt = FuzzRandom() % (uint32_t) cb;
+			switch ( FuzzRandom() % 4 )
+			{
+				case 0:  pb[iAt] ^= (uint8_t) ( 1 << ( FuzzRandom() % 8 ) ); break;
+				case 1:  pb[iAt] = (uint8_t) FuzzRandom(); break;
+				case 2:  pb[iAt] = ( FuzzRandom() & 1 ) ? 0x84 : 0xff; break;		// Lengths and offsets
+				default: pb[iAt] = (uint8_t) ( pb[iAt] - 1 ); break;
+			}
+		}
+
+		iError = NegoDecode( pb, cb, &Token );
+		rgcResults[( iError >= 0 && iError <= NEGO_ERR_LAST ) ? iError : NEGO_ERR_UNKNOWN]++;
+		if ( DER_OK == iError )
+		{
+			NegoTokenFormat( &Token, szSummary, sizeof(szSummary) );
+			NegoFallbackReason( &Token );
+		}
+		free( pb );
+	}
+
+	printf( "%ld mutated tokens:", cIterations );
+	for ( i=0; i<=NEGO_ERR_LAST; i++ ) printf( " %s %ld%s", NegoDecodeErrorName( (int) i ), rgcResults[i], ( i < NEGO_ERR_LAST ) ? "," : "\n" );
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	int i, iResult = 0;
+
+	if ( argc < 2 )
+	{
+		fprintf( stderr, "Usage: negodecode file...       decode binary or hex text tokens\n" );
+		fprintf( stderr, "       negodecode -check\n" );
+		fprintf( stderr, "       negodecode -bench [iterations]\n" );
+		fprintf( stderr, "       negodecode -fuzz [iterations] [seed]\n" );
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+	if ( 0 == strcmp( argv[1], "-bench" ) ) return RunBenchmark( ( argc > 2 ) ? atol( argv[2] ) : 1000000 );
+	if ( 0 == strcmp( argv[1], "-fuzz" ) ) return RunFuzzer( ( argc > 2 ) ? atol( argv[2] ) : 100000, ( argc > 3 ) ? (uint32_t) strtoul( argv[3], NULL, 0 ) : 0 );
+
+	for ( i=1; i<argc; i++ ) iResult |= DecodeFile( argv[i] );
+	return iResult;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#pragma once
+
+// SPNEGO (RFC 4178) and NTLMSSP (MS-NLMP) decoder for the tokens Negotiate passes through
+// InitializeSecurityContext and AcceptSecurityContext.  It reads NegTokenInit and NegTokenResp,
+// the NTLM NEGOTIATE, CHALLENGE and AUTHENTICATE messages and, through KerbDecoder.h, bare or
+// wrapped Kerberos tokens.  Like the other decoders it works in place: names are slices into
+// the caller's buffer and nothing is allocated, so it is safe on the tracing path.
+
+#include "KerbDecoder.h"
+
+// Decode results, the DER reader's plus these two.
+#define NEGO_ERR_UNKNOWN		( DER_ERR_LAST + 1 )	// Not SPNEGO, NTLM or Kerberos, e.g. a TLS record
+#define NEGO_ERR_NTLM			( DER_ERR_LAST + 2 )	// NTLMSSP signature with a malformed message
+#define NEGO_ERR_LAST			NEGO_ERR_NTLM
+
+// Token kinds, NEGO_TOKEN.iType.
+#define NEGO_TOKEN_INIT			1		// NegTokenInit
+#define NEGO_TOKEN_RESP			2		// NegTokenResp
+#define NEGO_TOKEN_KERBEROS		3		// Kerberos without SPNEGO, in NEGO_TOKEN.Kerb
+#define NEGO_TOKEN_NTLM			4		// NTLM without SPNEGO, in NEGO_TOKEN.Ntlm
+
+// Mechanisms.
+#define NEGO_MECH_NONE			0
+#define NEGO_MECH_KERBEROS		1		// 1.2.840.113554.1.2.2
+#define NEGO_MECH_MS_KERBEROS	2		// 1.2.840.48018.1.2.2, what Windows lists first
+#define NEGO_MECH_KERBEROS_U2U	3		// 1.2.840.113554.1.2.2.3
+#define NEGO_MECH_NTLM			4		// 1.3.6.1.4.1.311.2.2.10
+#define NEGO_MECH_NEGOEX		5		// 1.3.6.1.4.1.311.2.2.30
+#define NEGO_MECH_OTHER			6
+
+#define NEGO_IS_KERBEROS(mech)	( NEGO_MECH_KERBEROS == (mech) || NEGO_MECH_MS_KERBEROS == (mech) || NEGO_MECH_KERBEROS_U2U == (mech) )
+
+// NegTokenResp negState, NEGO_STATE_NONE when absent.
+#define NEGO_STATE_NONE				-1
+#define NEGO_STATE_ACCEPT_COMPLETED	0
+#define NEGO_STATE_ACCEPT_INCOMPLETE	1
+#define NEGO_STATE_REJECT			2
+#define NEGO_STATE_REQUEST_MIC		3
+
+#define NEGO_MAX_MECHS			8
+
+// NTLM message types.
+#define NTLM_NEGOTIATE			1
+#define NTLM_CHALLENGE			2
+#define NTLM_AUTHENTICATE		3
+
+// NTLM negotiate flags that the summary calls out.
+#define NTLM_FLAG_UNICODE		0x00000001
+#define NTLM_FLAG_SIGN			0x00000010
+#define NTLM_FLAG_SEAL			0x00000020
+#define NTLM_FLAG_ANONYMOUS		0x00000800
+#define NTLM_FLAG_EXTENDED_SESSIONSECURITY	0x00080000
+#define NTLM_FLAG_TARGET_INFO	0x00800000
+#define NTLM_FLAG_VERSION		0x02000000
+
+// MsvAvFlags.
+#define NTLM_AV_FLAG_MIC		0x00000002
+
+typedef struct _NTLM_MESSAGE
+{
+	uint32_t  dwType;				// NTLM_*
+	uint32_t  dwFlags;				// NegotiateFlags
+	int       fVersion;
+	uint8_t   bMajor;
+	uint8_t   bMinor;
+	uint16_t  wBuild;
+	uint8_t   bRevision;
+	int       fUnicode;				// Strings below are UTF-16LE, otherwise OEM
+	DER_SLICE TargetName;			// CHALLENGE
+	DER_SLICE Domain;				// NEGOTIATE (OEM) and AUTHENTICATE
+	DER_SLICE User;					// AUTHENTICATE
+	DER_SLICE Workstation;			// NEGOTIATE (OEM) and AUTHENTICATE
+	uint32_t  cbLmResponse;			// AUTHENTICATE
+	uint32_t  cbNtResponse;			// AUTHENTICATE, more than 24 bytes is NTLMv2
+	int       fMic;					// AUTHENTICATE carries a MIC (MsvAvFlags bit 1)
+	// Target info, from CHALLENGE or from the NTLMv2 response of AUTHENTICATE.  UTF-16LE.
+	int       fTargetInfo;
+	DER_SLICE NbComputer;
+	DER_SLICE NbDomain;
+	DER_SLICE DnsComputer;
+	DER_SLICE DnsDomain;
+	DER_SLICE DnsTree;
+	DER_SLICE TargetSpn;			// MsvAvTargetName, the SPN the client had in mind
+	uint32_t  dwAvFlags;
+	int       fTimestamp;
+	int64_t   i64Timestamp;			// Seconds since 1970
+	int       fChannelBindings;		// Non zero MsvAvChannelBindings
+} NTLM_MESSAGE;
+
+typedef struct _NEGO_TOKEN
+{
+	int          iType;				// NEGO_TOKEN_*
+	uint32_t     cMechs;			// May exceed NEGO_MAX_MECHS, only the first ones are kept
+	int          rgMechs[NEGO_MAX_MECHS];
+	int          iNegState;			// NEGO_STATE_*
+	int          iSupportedMech;	// NegTokenResp supportedMech, NEGO_MECH_NONE if absent
+	int          fMechListMic;
+	DER_SLICE    HintName;			// NegTokenInit2 negHints, sent by servers
+	uint32_t     cbInner;			// mechToken or responseToken, 0 if absent
+	int          iInnerMech;		// What the inner token (or the bare token) turned out to be
+	int          iInnerError;		// DER_OK, or why the inner token could not be decoded
+	KERB_MESSAGE Kerb;
+	NTLM_MESSAGE Ntlm;
+} NEGO_TOKEN;
+
+int NegoDecode( const uint8_t* pb, size_t cb, NEGO_TOKEN* pToken );
+int NtlmDecode( const uint8_t* pb, size_t cb, NTLM_MESSAGE* pMsg );
+int NegoTokenMech( const NEGO_TOKEN* pToken );
+const char* NegoFallbackReason( const NEGO_TOKEN* pToken );
+
+const char* NegoMechName( int iMech );
+const char* NegoStateName( int iNegState );
+const char* NegoDecodeErrorName( int iError );
+const char* NtlmMessageTypeName( uint32_t dwType );
+char* NtlmFlagsFormat( uint32_t dwFlags, char* pszBuffer, size_t cchBuffer );
+char* NtlmStringFormat( const DER_SLICE* pSlice, int fUnicode, char* pszBuffer, size_t cchBuffer );
+char* NtlmMessageFormat( const NTLM_MESSAGE* pMsg, char* pszBuffer, size_t cchBuffer );
+char* NegoTokenFormat( const NEGO_TOKEN* pToken, char* pszBuffer, size_t cchBuffer );
@@ -0,0 +1,264 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// NegoStats.cpp: the legs, round trips, mechanism and cost of each Negotiate, Kerberos or NTLM
+// exchange, and whether it fell back from Kerberos to NTLM.
+//
+
+#include "stdafx.h"
+#include "NegoStats.h"
+#include "NegoDecoder.h"
+#include "TokenStats.h"
+#include "ClockSkew.h"
+#include "DetourFunctions.h"
+
+static NEGO_EXCHANGE g_NegoExchange;
+static DWORD g_dwNegoExchanges = 0;
+
+void NegoStatsReset()
+{
+	ZeroMemory( &g_NegoExchange, sizeof(g_NegoExchange) );
+	g_dwNegoExchanges = 0;
+}
+
+// "NTLM CHALLENGE", "Kerberos AP-REQ", or the SPNEGO state when the token carries nothing else.
+static void DescribeToken( const NEGO_TOKEN* pToken, char* pszDesc, size_t cchDesc )
+{
+	int iMech = NegoTokenMech( pToken );
+
+	if ( NEGO_MECH_NTLM == pToken->iInnerMech )
+	{
+		sprintf_s( pszDesc, cchDesc, "NTLM %s", NtlmMessageTypeName( pToken->Ntlm.dwType ) );
+	}
+	else if ( NEGO_IS_KERBEROS( pToken->iInnerMech ) )
+	{
+		sprintf_s( pszDesc, cchDesc, "Kerberos %s", KerbMsgTypeName( pToken->Kerb.iMsgType ) );
+	}
+	else if ( NEGO_TOKEN_RESP == pToken->iType && NEGO_STATE_NONE != pToken->iNegState )
+	{
+		sprintf_s( pszDesc, cchDesc, "SPNEGO %s", NegoStateName( pToken->iNegState ) );
+	}
+	else
+	{
+		sprintf_s( pszDesc, cchDesc, "%s", NegoMechName( iMech ) );
+	}
+}
+
+// Size and description of the SECBUFFER_TOKEN buffers of a call, and what they tell about the
+// mechanism in use.
+static DWORD GetTokenLeg( PSecBufferDesc pDesc, char* pszDesc, size_t cchDesc )
+{
+	NEGO_TOKEN Token;
+	const char* pszReason;
+	unsigned long i;
+	DWORD cbToken = 0;
+	int iMech;
+
+	pszDesc[0] = '\0';
+	if ( NULL == pDesc || NULL == pDesc->pBuffers ) return 0;
+
+	for ( i=0; i<pDesc->cBuffers; i++ )
+	{
+		if ( SECBUFFER_TOKEN != ( pDesc->pBuffers[i].BufferType & ~SECBUFFER_ATTRMASK ) ) continue;
+		if ( NULL == pDesc->pBuffers[i].pvBuffer || 0 == pDesc->pBuffers[i].cbBuffer ) continue;
+
+		if ( 0 == cbToken && DER_OK == NegoDecode( (const uint8_t*) pDesc->pBuffers[i].pvBuffer, pDesc->pBuffers[i].cbBuffer, &Token ) )
+		{
+			DescribeToken( &Token, pszDesc, cchDesc );
+			iMech = NegoTokenMech( &Token );
+			if ( NEGO_MECH_NONE != iMech && NEGO_MECH_OTHER != iMech ) g_NegoExchange.iMech = iMech;
+
+			pszReason = NegoFallbackReason( &Token );
+			if ( NULL != pszReason && NULL == g_NegoExchange.pszFallbackReason ) g_NegoExchange.pszFallbackReason = pszReason;
+
+			// KRB-ERROR and NTLM CHALLENGE carry the server's clock.
+			ClockSkewFromToken( &Token );
+		}
+		cbToken += pDesc->pBuffers[i].cbBuffer;
+	}
+	return cbToken;
+}
+
+static BOOL IsCurrentExchange( PCtxtHandle phContext )
+{
+	if ( 0 == g_NegoExchange.dwNumber || NULL == phContext ) return FALSE;
+	return ( phContext->dwLower == g_NegoExchange.hContext.dwLower &&
+			 phContext->dwUpper == g_NegoExchange.hContext.dwUpper );
+}
+
+// Called before each InitializeSecurityContext call on a non stream context.  A call without an
+// existing context, or with one we have not seen, starts a new exchange and reports the last.
+void NegoExchangeLegStart( PCtxtHandle phContext, const char* pszTarget, PSecBufferDesc pInput, uint64_t ui64Start )
+{
+	NEGO_LEG* pLeg = NULL;
+
+	if ( !IsCurrentExchange( phContext ) )
+	{
+		DumpNegoExchange();
+		ZeroMemory( &g_NegoExchange, sizeof(g_NegoExchange) );
+		g_NegoExchange.dwNumber = ++g_dwNegoExchanges;
+		g_NegoExchange.rvFinal  = SEC_I_CONTINUE_NEEDED;
+		if ( NULL != phContext ) g_NegoExchange.hContext = *phContext;
+		lstrcpyn( g_NegoExchange.szTarget, ( NULL == pszTarget ) ? "<NULL>" : pszTarget, sizeof(g_NegoExchange.szTarget) );
+	}
+
+	g_NegoExchange.fInLeg = TRUE;
+	if ( g_NegoExchange.cLegs < NEGO_MAX_LEGS )
+	{
+		pLeg = &g_NegoExchange.rgLegs[g_NegoExchange.cLegs];
+		pLeg->ui64Start = ui64Start;
+		pLeg->cbIn = GetTokenLeg( pInput, pLeg->szIn, sizeof(pLeg->szIn) );
+	}
+}
+
+void NegoExchangeLegEnd( PCtxtHandle phNewContext, PSecBufferDesc pOutput, SECURITY_STATUS rv, uint64_t ui64End )
+{
+	NEGO_LEG* pLeg = NULL;
+
+	if ( 0 == g_NegoExchange.dwNumber || !g_NegoExchange.fInLeg ) return;
+
+	if ( g_NegoExchange.cLegs < NEGO_MAX_LEGS )
+	{
+		pLeg = &g_NegoExchange.rgLegs[g_NegoExchange.cLegs];
+		pLeg->ui64End = ui64End;
+		pLeg->rv      = rv;
+		pLeg->cbOut   = ( rv >= 0 ) ? GetTokenLeg( pOutput, pLeg->szOut, sizeof(pLeg->szOut) ) : 0;
+		TokenStatsAdd( g_NegoExchange.szTarget, g_NegoExchange.iMech, pLeg->cbOut, 0 == g_NegoExchange.cLegs );
+	}
+	g_NegoExchange.cLegs++;
+	g_NegoExchange.fInLeg = FALSE;
+
+	// The first call returns the context handle, later calls pass it back in.
+	if ( NULL != phNewContext && ( SEC_E_OK == rv || SEC_I_CONTINUE_NEEDED == rv ) )
+	{
+		g_NegoExchange.hContext = *phNewContext;
+	}
+
+	if ( SEC_E_OK == rv )
+	{
+		g_NegoExchange.fComplete = TRUE;
+		g_NegoExchange.rvFinal   = rv;
+	}
+	else if ( FAILED(rv) )
+	{
+		g_NegoExchange.rvFinal = rv;
+	}
+}
+
+void NegoExchangePackage( const char* pszPackage )
+{
+	if ( 0 == g_NegoExchange.dwNumber ) return;
+	lstrcpyn( g_NegoExchange.szPackage, pszPackage, sizeof(g_NegoExchange.szPackage) );
+}
+
+BOOL NegoGetLastExchange( NEGO_EXCHANGE* pExchange )
+{
+	if ( 0 == g_NegoExchange.dwNumber ) return FALSE;
+	*pExchange = g_NegoExchange;
+	return TRUE;
+}
+
+// The tokens decide, the package name is the fallback when none could be decoded.
+BOOL NegoExchangeIsNtlm( const NEGO_EXCHANGE* pExchange )
+{
+	if ( NEGO_MECH_NONE != pExchange->iMech ) return ( NEGO_MECH_NTLM == pExchange->iMech );
+	return ( 0 == lstrcmpi( pExchange->szPackage, "NTLM" ) );
+}
+
+// Tokens sent to the server.  The reply to the last one may not come back through
+// InitializeSecurityContext, so this counts round trips the login waits for, not legs.
+DWORD NegoExchangeRoundTrips( const NEGO_EXCHANGE* pExchange )
+{
+	DWORD i, cRoundTrips = 0;
+
+	for ( i=0; i<min( pExchange->cLegs, NEGO_MAX_LEGS ); i++ )
+	{
+		if ( pExchange->rgLegs[i].cbOut > 0 ) cRoundTrips++;
+	}
+	return cRoundTrips;
+}
+
+// First leg start to last leg end.
+double NegoExchangeMs( const NEGO_EXCHANGE* pExchange )
+{
+	DWORD cLegs = min( pExchange->cLegs, NEGO_MAX_LEGS );
+
+	if ( 0 == cLegs ) return 0;
+	return PerfCounterToMs( pExchange->rgLegs[cLegs-1].ui64End - pExchange->rgLegs[0].ui64Start );
+}
+
+// Time inside InitializeSecurityContext, which includes the TGS exchange with the KDC when the
+// ticket is not cached, or the failed one before a fallback to NTLM.
+double NegoExchangeClientMs( const NEGO_EXCHANGE* pExchange )
+{
+	DWORD i;
+	uint64_t ui64Ticks = 0;
+
+	for ( i=0; i<min( pExchange->cLegs, NEGO_MAX_LEGS ); i++ )
+	{
+		ui64Ticks += pExchange->rgLegs[i].ui64End - pExchange->rgLegs[i].ui64Start;
+	}
+	return PerfCounterToMs( ui64Ticks );
+}
+
+// Reports the exchange in progress or last completed, once.  Called when the next exchange
+// starts and at the end of the test.
+void DumpNegoExchange()
+{
+	NEGO_EXCHANGE* p = &g_NegoExchange;
+	DWORD i, cLegs, cRoundTrips;
+	uint64_t ui64WaitUs = 0;
+	double dClientMs;
+
+	if ( 0 == p->dwNumber || p->fReported || 0 == p->cLegs ) return;
+	p->fReported = TRUE;
+
+	cLegs = min( p->cLegs, NEGO_MAX_LEGS );
+	cRoundTrips = NegoExchangeRoundTrips( p );
+
+	o_printf( "" );
+	if ( p->fComplete )
+	{
+		o_printf( "Authentication %lu to [%s] completed with %s in %lu legs.", p->dwNumber, p->szTarget,
+				  ( '\0' != p->szPackage[0] ) ? p->szPackage : NegoMechName( p->iMech ), p->cLegs );
+	}
+	else if ( SEC_I_CONTINUE_NEEDED == p->rvFinal )
+	{
+		o_printf( "Authentication %lu to [%s] did not complete after %lu legs.", p->dwNumber, p->szTarget, p->cLegs );
+	}
+	else
+	{
+		o_printf( "Authentication %lu to [%s] failed after %lu legs with 0x%08x %s", p->dwNumber, p->szTarget, p->cLegs, p->rvFinal, GetSecurityErrorString( p->rvFinal ) );
+	}
+
+	for ( i=0; i<cLegs; i++ )
+	{
+		const NEGO_LEG* pLeg = &p->rgLegs[i];
+
+		if ( i > 0 )
+		{
+			uint64_t ui64GapUs = PerfCounterToUs( pLeg->ui64Start - p->rgLegs[i-1].ui64End );
+			ui64WaitUs += ui64GapUs;
+			o_printf( "  wait  %10.3f ms  network and server", ui64GapUs / 1000.0 );
+		}
+		o_printf( "  leg %lu %10.3f ms  received %5lu bytes [%s], sent %5lu bytes [%s], returned 0x%08x",
+				  i+1, PerfCounterToMs( pLeg->ui64End - pLeg->ui64Start ), pLeg->cbIn, pLeg->szIn, pLeg->cbOut, pLeg->szOut, pLeg->rv );
+	}
+
+	dClientMs = NegoExchangeClientMs( p );
+	o_printf( "  Total %.3f ms: inside InitializeSecurityContext %.3f ms, network and server %.3f ms, %lu round trips to the server.",
+			  NegoExchangeMs( p ), dClientMs, ui64WaitUs / 1000.0, cRoundTrips );
+
+	if ( NegoExchangeIsNtlm( p ) )
+	{
+		o_printf( "  NTLM fallback: %s.", ( NULL != p->pszFallbackReason ) ? p->pszFallbackReason : "the tokens do not say why" );
+		if ( cRoundTrips > NEGO_KERBEROS_ROUND_TRIPS )
+		{
+			o_printf( "  NTLM took %lu round trips where Kerberos needs %d, and the server verifies the last one at a domain controller",
+					  cRoundTrips, NEGO_KERBEROS_ROUND_TRIPS );
+			o_printf( "  before it answers, which is part of the login time but not of the total above." );
+		}
+	}
+}
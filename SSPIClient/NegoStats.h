@@ -0,0 +1,54 @@
+#pragma once
+
+#include "PerfStats.h"
+
+// Negotiate, Kerberos and NTLM exchanges, reconstructed from the InitializeSecurityContext
+// detour the same way TlsStats.h follows Schannel handshakes.  Each call is a leg, the gap
+// between two legs is a round trip to the server.  The mechanism comes from the tokens
+// (NegoDecoder.h), so a fallback to NTLM is seen even when the login fails.
+
+#define NEGO_MAX_LEGS				8
+#define NEGO_LEG_DESC_SIZE			48
+
+// Server round trips of a Kerberos login: AP-REQ out, AP-REP back.  NTLM needs two, NEGOTIATE
+// for a CHALLENGE and AUTHENTICATE for the verdict, and on the second one the server passes
+// the response through to a domain controller.
+#define NEGO_KERBEROS_ROUND_TRIPS	1
+
+typedef struct _NEGO_LEG
+{
+	uint64_t ui64Start;			// PerfCounter at the start of the InitializeSecurityContext call
+	uint64_t ui64End;
+	DWORD    cbIn;				// Server token handed to this call
+	DWORD    cbOut;				// Client token returned by it
+	SECURITY_STATUS rv;
+	char     szIn[NEGO_LEG_DESC_SIZE];		// e.g. "NTLM CHALLENGE" or "Kerberos AP-REP"
+	char     szOut[NEGO_LEG_DESC_SIZE];
+} NEGO_LEG;
+
+typedef struct _NEGO_EXCHANGE
+{
+	DWORD    dwNumber;			// 1 for the first exchange since NegoStatsReset
+	CtxtHandle hContext;
+	char     szTarget[256];
+	char     szPackage[64];		// Package the completed context reports
+	BOOL     fComplete;
+	BOOL     fReported;
+	BOOL     fInLeg;
+	SECURITY_STATUS rvFinal;	// SEC_I_CONTINUE_NEEDED until the exchange completes or fails
+	int      iMech;				// NEGO_MECH_* the tokens show, NEGO_MECH_NONE if none was decoded
+	const char* pszFallbackReason;	// Why the first NTLM token was NTLM, a static string
+	DWORD    cLegs;				// May exceed NEGO_MAX_LEGS, only the first legs are kept
+	NEGO_LEG rgLegs[NEGO_MAX_LEGS];
+} NEGO_EXCHANGE;
+
+void NegoStatsReset();
+void NegoExchangeLegStart( PCtxtHandle phContext, const char* pszTarget, PSecBufferDesc pInput, uint64_t ui64Start );
+void NegoExchangeLegEnd( PCtxtHandle phNewContext, PSecBufferDesc pOutput, SECURITY_STATUS rv, uint64_t ui64End );
+void NegoExchangePackage( const char* pszPackage );
+BOOL NegoGetLastExchange( NEGO_EXCHANGE* pExchange );
+BOOL NegoExchangeIsNtlm( const NEGO_EXCHANGE* pExchange );
+DWORD NegoExchangeRoundTrips( const NEGO_EXCHANGE* pExchange );
+double NegoExchangeMs( const NEGO_EXCHANGE* pExchange );
+double NegoExchangeClientMs( const NEGO_EXCHANGE* pExchange );
+void DumpNegoExchange();
@@ -0,0 +1,331 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// NetlibStats.cpp: per-connection throughput, packet size and wait time statistics
+// collected by the dbnetlib ConnectionRead/ConnectionWrite detours.
+//
+
+#include "stdafx.h"
+#include "NetlibStats.h"
+#include "TokenStats.h"
+#include "DetourFunctions.h"
+#include "TestOptions.h"
+
+static NETLIB_CONNECTION_STATS g_NetlibStats[NETLIB_MAX_CONNECTIONS];
+static LONG g_lNetlibConnectionNumber = 0;
+static NETLIB_TOTALS g_NetlibTotals;
+static BOOL g_fNetlibPayload = FALSE;
+static BOOL g_fNetlibRecords = FALSE;
+static BOOL g_fTdsDecode = FALSE;
+static HANDLE g_hTdsCapture = INVALID_HANDLE_VALUE;
+static uint64_t g_ui64TdsCaptureStart = 0;
+static CRITICAL_SECTION g_csTdsCapture;
+static BOOL g_fTdsCaptureInit = FALSE;
+
+static void CloseTdsCapture()
+{
+	if ( INVALID_HANDLE_VALUE == g_hTdsCapture ) return;
+	CloseHandle( g_hTdsCapture );
+	g_hTdsCapture = INVALID_HANDLE_VALUE;
+}
+
+// Opens the TDSCAP file named by the tdscapture option, see TdsDecoder.h for the format.
+static void OpenTdsCapture()
+{
+	char szFile[MAX_PATH];
+	DWORD dwBytesWritten = 0;
+
+	GetTestOptionString( "tdscapture", "", szFile, sizeof(szFile) );
+	if ( '\0' == szFile[0] ) return;
+
+	if ( !g_fTdsCaptureInit )
+	{
+		InitializeCriticalSection( &g_csTdsCapture );
+		g_fTdsCaptureInit = TRUE;
+	}
+
+	g_hTdsCapture = CreateFile( szFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( INVALID_HANDLE_VALUE == g_hTdsCapture )
+	{
+		o_printf( "*** ERROR: Could not create TDS capture file [%s]. Error = %d", szFile, GetLastError() );
+		return;
+	}
+	WriteFile( g_hTdsCapture, TDSCAP_MAGIC, TDSCAP_MAGIC_SIZE, &dwBytesWritten, NULL );
+	g_ui64TdsCaptureStart = PerfCounter();
+	o_printf( "Writing dbnetlib traffic to TDS capture file [%s].", szFile );
+}
+
+static void WriteTdsCapture( DWORD dwConnectionNumber, BYTE bDirection, const BYTE* pBuffer, DWORD cbData, uint64_t ui64End )
+{
+	TDSCAP_RECORD rec;
+	DWORD dwBytesWritten = 0;
+
+	rec.ui64TimeUs = PerfCounterToUs( ui64End - g_ui64TdsCaptureStart );
+	rec.cbData     = cbData;
+	rec.wStream    = (uint16_t) dwConnectionNumber;
+	rec.bDirection = ( NETLIB_IO_READ == bDirection ) ? TDS_DIR_SERVER : TDS_DIR_CLIENT;
+	rec.bReserved  = 0;
+
+	EnterCriticalSection( &g_csTdsCapture );
+	WriteFile( g_hTdsCapture, &rec, sizeof(rec), &dwBytesWritten, NULL );
+	WriteFile( g_hTdsCapture, pBuffer, cbData, &dwBytesWritten, NULL );
+	LeaveCriticalSection( &g_csTdsCapture );
+}
+
+void NetlibStatsReset()
+{
+	ZeroMemory( g_NetlibStats, sizeof(g_NetlibStats) );
+	ZeroMemory( &g_NetlibTotals, sizeof(g_NetlibTotals) );
+	g_lNetlibConnectionNumber = 0;
+
+	// Payloads are only dumped when asked for, they are large and may contain data.
+	g_fNetlibPayload = GetTestOptionBool( "netlibpayload", FALSE );
+	g_fNetlibRecords = GetTestOptionBool( "netlibrecords", FALSE );
+	g_fTdsDecode     = GetTestOptionBool( "tdsdecode", FALSE );
+
+	CloseTdsCapture();
+	OpenTdsCapture();
+}
+
+// Writes the TDS message timeline as the decoder produces it.
+static void LogTdsEvent( const TDS_EVENT* pEvent, void* pvContext )
+{
+	NETLIB_CONNECTION_STATS* pStats = (NETLIB_CONNECTION_STATS*) pvContext;
+	char szLine[512];
+
+	o_printf( "TDS #%lu %s", pStats->dwConnectionNumber, TdsEventFormat( pEvent, 0, szLine, sizeof(szLine) ) );
+}
+
+// Returns the slot for pConnection, claiming a free one if fCreate is set.
+// Slots are claimed with an interlocked exchange so no lock is taken on the I/O path.
+static NETLIB_CONNECTION_STATS* GetNetlibStats( CONNECTIONOBJECT* pConnection, BOOL fCreate )
+{
+	int i;
+
+	if ( NULL == pConnection ) return NULL;
+
+	for ( i=0; i<NETLIB_MAX_CONNECTIONS; i++ )
+	{
+		if ( pConnection == g_NetlibStats[i].pConnection ) return &g_NetlibStats[i];
+	}
+
+	if ( !fCreate ) return NULL;
+
+	for ( i=0; i<NETLIB_MAX_CONNECTIONS; i++ )
+	{
+		if ( NULL == InterlockedCompareExchangePointer( (PVOID*) &g_NetlibStats[i].pConnection, pConnection, NULL ) )
+		{
+			g_NetlibStats[i].dwConnectionNumber = (DWORD) InterlockedIncrement( &g_lNetlibConnectionNumber );
+			g_NetlibStats[i].ui64Opened = PerfCounter();
+			lstrcpyn( g_NetlibStats[i].szServer, "(opened before logging started)", sizeof(g_NetlibStats[i].szServer) );
+			TdsDecoderInit( &g_NetlibStats[i].Tds, LogTdsEvent, &g_NetlibStats[i] );
+			return &g_NetlibStats[i];
+		}
+	}
+
+	return NULL;
+}
+
+void NetlibStatsOpen( CONNECTIONOBJECT* pConnection, const char* pszServer, uint64_t ui64Start, uint64_t ui64End )
+{
+	NETLIB_CONNECTION_STATS* pStats = GetNetlibStats( pConnection, TRUE );
+	if ( NULL == pStats )
+	{
+		o_printf( "Netlib statistics table full (%d connections), connection 0x%08x not tracked.", NETLIB_MAX_CONNECTIONS, pConnection );
+		return;
+	}
+
+	pStats->ui64Opened = ui64Start;
+	pStats->ui64OpenUs = PerfCounterToUs( ui64End - ui64Start );
+	lstrcpyn( pStats->szServer, ( NULL == pszServer ) ? "<NULL>" : pszServer, sizeof(pStats->szServer) );
+}
+
+void NetlibStatsOption( CONNECTIONOBJECT* pConnection, OPTSTRUCT* pOptions )
+{
+	NETLIB_CONNECTION_STATS* pStats = GetNetlibStats( pConnection, TRUE );
+	if ( NULL == pStats || NULL == pOptions ) return;
+
+	if ( NLOPT_SET_PACKET_SIZE == pOptions->iRequest )
+	{
+		pStats->dwPacketSize = pOptions->dwPacketSize;
+		TokenStatsPacketSize( pOptions->dwPacketSize );
+	}
+	if ( NLOPT_SET_ENCRYPT == pOptions->iRequest ) pStats->fEncrypt = pOptions->fEncrypt;
+}
+
+void NetlibStatsIO( CONNECTIONOBJECT* pConnection,
+					BYTE bDirection,
+					BYTE* pBuffer,
+					DWORD cbRequested,
+					DWORD cbTransferred,
+					TIMEINT wTimeout,
+					BOOL fFailed,
+					uint64_t ui64Start,
+					uint64_t ui64End )
+{
+	NETLIB_CONNECTION_STATS* pStats = GetNetlibStats( pConnection, TRUE );
+	NETLIB_IO_RECORD* pRecord;
+	uint64_t ui64Us = PerfCounterToUs( ui64End - ui64Start );
+
+	if ( NULL == pStats ) return;
+
+	pRecord = &pStats->rgRecords[pStats->dwRecords % NETLIB_MAX_IO_RECORDS];
+	pRecord->ui64Start     = ui64Start;
+	pRecord->dwElapsedUs   = (DWORD) ui64Us;
+	pRecord->cbRequested   = cbRequested;
+	pRecord->cbTransferred = cbTransferred;
+	pRecord->wTimeout      = wTimeout;
+	pRecord->bDirection    = bDirection;
+	pRecord->bFailed       = (BYTE) fFailed;
+	pStats->dwRecords++;
+
+	if ( fFailed ) pStats->dwErrors++;
+
+	if ( NETLIB_IO_READ == bDirection )
+	{
+		if ( NETLIB_IO_WRITE == pStats->bLastDirection ) g_NetlibTotals.dwTurnarounds++;
+		g_NetlibTotals.dwReads++;
+		g_NetlibTotals.ui64BytesRead += cbTransferred;
+		pStats->dwReads++;
+		pStats->ui64BytesRead += cbTransferred;
+		pStats->ui64ReadUs    += ui64Us;
+		PerfHistogramAdd( &pStats->ReadSize, cbTransferred );
+		PerfHistogramAdd( &pStats->ReadWait, ui64Us );
+	}
+	else
+	{
+		g_NetlibTotals.dwWrites++;
+		g_NetlibTotals.ui64BytesWritten += cbTransferred;
+		pStats->dwWrites++;
+		pStats->ui64BytesWritten += cbTransferred;
+		pStats->ui64WriteUs      += ui64Us;
+		PerfHistogramAdd( &pStats->WriteSize, cbTransferred );
+		PerfHistogramAdd( &pStats->WriteWait, ui64Us );
+	}
+	pStats->bLastDirection = bDirection;
+
+	if ( g_fNetlibPayload && NULL != pBuffer && cbTransferred > 0 )
+	{
+		o_printf( "Netlib #%lu %s %lu bytes in %I64u us",
+				  pStats->dwConnectionNumber,
+				  ( NETLIB_IO_READ == bDirection ) ? "read" : "wrote",
+				  cbTransferred,
+				  ui64Us );
+		DumpHex( pBuffer, cbTransferred );
+	}
+
+	if ( fFailed || NULL == pBuffer || 0 == cbTransferred ) return;
+
+	if ( INVALID_HANDLE_VALUE != g_hTdsCapture )
+	{
+		WriteTdsCapture( pStats->dwConnectionNumber, bDirection, pBuffer, cbTransferred, ui64End );
+	}
+
+	// Reads are timed when the data arrived, writes when dbnetlib handed it off.
+	if ( g_fTdsDecode )
+	{
+		TdsDecoderFeed( &pStats->Tds,
+						( NETLIB_IO_READ == bDirection ) ? TDS_DIR_SERVER : TDS_DIR_CLIENT,
+						pBuffer,
+						cbTransferred,
+						PerfCounterToUs( ui64End - pStats->ui64Opened ) );
+	}
+}
+
+// Bytes per second, guarding against zero elapsed time.
+static double BytesPerSecond( uint64_t ui64Bytes, uint64_t ui64Us )
+{
+	if ( 0 == ui64Us ) return 0.0;
+	return ( (double) ui64Bytes * 1000000.0 ) / (double) ui64Us;
+}
+
+static void DumpNetlibConnectionStats( NETLIB_CONNECTION_STATS* pStats, BOOL fClosed )
+{
+	char szHist[1024];
+	uint64_t ui64LifeUs = PerfCounterToUs( PerfCounter() - pStats->ui64Opened );
+	DWORD i, dwFirst, dwCount;
+	NETLIB_IO_RECORD* pRecord;
+
+	o_printf( "" );
+	o_printf( "Netlib connection #%lu to [%s] %s", pStats->dwConnectionNumber, pStats->szServer, ( fClosed ) ? "closed" : "still open" );
+	o_printf( "  ConnectionOpen time       = %.3f ms", pStats->ui64OpenUs / 1000.0 );
+	o_printf( "  Connection lifetime       = %.3f ms", ui64LifeUs / 1000.0 );
+	o_printf( "  Packet size option        = %lu", pStats->dwPacketSize );
+	o_printf( "  Encrypt option            = %s", ( pStats->fEncrypt ) ? "TRUE" : "FALSE" );
+	o_printf( "  Reads                     = %lu calls, %I64u bytes, %.3f ms waiting, %.1f KB/s while reading",
+			  pStats->dwReads, pStats->ui64BytesRead, pStats->ui64ReadUs / 1000.0,
+			  BytesPerSecond( pStats->ui64BytesRead, pStats->ui64ReadUs ) / 1024.0 );
+	o_printf( "  Writes                    = %lu calls, %I64u bytes, %.3f ms waiting, %.1f KB/s while writing",
+			  pStats->dwWrites, pStats->ui64BytesWritten, pStats->ui64WriteUs / 1000.0,
+			  BytesPerSecond( pStats->ui64BytesWritten, pStats->ui64WriteUs ) / 1024.0 );
+	o_printf( "  Lifetime throughput       = %.1f KB/s read, %.1f KB/s written",
+			  BytesPerSecond( pStats->ui64BytesRead, ui64LifeUs ) / 1024.0,
+			  BytesPerSecond( pStats->ui64BytesWritten, ui64LifeUs ) / 1024.0 );
+	o_printf( "  Failed calls              = %lu", pStats->dwErrors );
+	o_printf( "  Read sizes   (bytes)      = %s", PerfHistogramFormat( &pStats->ReadSize, szHist, sizeof(szHist) ) );
+	o_printf( "  Write sizes  (bytes)      = %s", PerfHistogramFormat( &pStats->WriteSize, szHist, sizeof(szHist) ) );
+	o_printf( "  Read waits   (us)         = %s", PerfHistogramFormat( &pStats->ReadWait, szHist, sizeof(szHist) ) );
+	o_printf( "  Write waits  (us)         = %s", PerfHistogramFormat( &pStats->WriteWait, szHist, sizeof(szHist) ) );
+
+	if ( g_fNetlibRecords && pStats->dwRecords > 0 )
+	{
+		dwCount = min( pStats->dwRecords, (DWORD) NETLIB_MAX_IO_RECORDS );
+		dwFirst = pStats->dwRecords - dwCount;
+		if ( dwFirst > 0 ) o_printf( "  (first %lu records overwritten)", dwFirst );
+		for ( i=dwFirst; i<pStats->dwRecords; i++ )
+		{
+			pRecord = &pStats->rgRecords[i % NETLIB_MAX_IO_RECORDS];
+			o_printf( "  %6lu +%10.3f ms %c %6lu/%6lu bytes timeout=%u %6lu us%s",
+					  i,
+					  PerfCounterToMs( pRecord->ui64Start - pStats->ui64Opened ),
+					  pRecord->bDirection,
+					  pRecord->cbTransferred,
+					  pRecord->cbRequested,
+					  pRecord->wTimeout,
+					  pRecord->dwElapsedUs,
+					  ( pRecord->bFailed ) ? " FAILED" : "" );
+		}
+	}
+}
+
+void NetlibStatsClose( CONNECTIONOBJECT* pConnection )
+{
+	NETLIB_CONNECTION_STATS* pStats = GetNetlibStats( pConnection, FALSE );
+	if ( NULL == pStats ) return;
+
+	if ( g_fTdsDecode ) TdsDecoderFinish( &pStats->Tds );
+	DumpNetlibConnectionStats( pStats, TRUE );
+
+	// Free up the slot for the next connection.
+	ZeroMemory( (BYTE*) pStats + sizeof(pStats->pConnection), sizeof(NETLIB_CONNECTION_STATS) - sizeof(pStats->pConnection) );
+	InterlockedExchangePointer( (PVOID*) &pStats->pConnection, NULL );
+}
+
+void NetlibStatsGetTotals( NETLIB_TOTALS* pTotals )
+{
+	*pTotals = g_NetlibTotals;
+}
+
+// Dumps connections that are still open, closed ones were reported by NetlibStatsClose.
+// Called at the end of the test so it also closes the TDS capture file.
+void DumpNetlibStats()
+{
+	int i;
+	BOOL fHeader = FALSE;
+
+	for ( i=0; i<NETLIB_MAX_CONNECTIONS; i++ )
+	{
+		if ( NULL == g_NetlibStats[i].pConnection ) continue;
+		if ( !fHeader )
+		{
+			o_printf( "" );
+			o_printf( "Dumping dbnetlib I/O statistics for open connections." );
+			fHeader = TRUE;
+		}
+		DumpNetlibConnectionStats( &g_NetlibStats[i], FALSE );
+	}
+
+	CloseTdsCapture();
+}
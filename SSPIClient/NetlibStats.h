@@ -0,0 +1,70 @@
+#pragma once
+
+#include "dbnetlib.h"
+#include "PerfStats.h"
+#include "TdsDecoder.h"
+
+// Per-connection I/O statistics for the dbnetlib ConnectionRead/ConnectionWrite detours.
+// All storage is allocated up front so the detours never touch the heap.
+
+#define NETLIB_MAX_CONNECTIONS	32
+#define NETLIB_MAX_IO_RECORDS	2048
+
+#define NETLIB_IO_READ			'R'
+#define NETLIB_IO_WRITE			'W'
+
+typedef struct _NETLIB_IO_RECORD
+{
+	uint64_t ui64Start;			// PerfCounter() ticks when the call was made
+	DWORD    dwElapsedUs;		// Time spent inside dbnetlib
+	DWORD    cbRequested;		// readmax for reads, writecount for writes
+	DWORD    cbTransferred;		// Return value of ConnectionRead/ConnectionWrite
+	TIMEINT  wTimeout;			// Read timeout passed by the driver (0 for writes)
+	BYTE     bDirection;		// NETLIB_IO_READ or NETLIB_IO_WRITE
+	BYTE     bFailed;			// TRUE if *neterrno was set
+} NETLIB_IO_RECORD;
+
+typedef struct _NETLIB_CONNECTION_STATS
+{
+	CONNECTIONOBJECT* pConnection;	// NULL when slot is free
+	DWORD    dwConnectionNumber;
+	char     szServer[128];
+	uint64_t ui64Opened;
+	uint64_t ui64OpenUs;
+	DWORD    dwPacketSize;			// Last NLOPT_SET_PACKET_SIZE seen, 0 if none
+	BOOL     fEncrypt;				// Last NLOPT_SET_ENCRYPT seen
+	DWORD    dwReads;
+	DWORD    dwWrites;
+	DWORD    dwErrors;
+	uint64_t ui64BytesRead;
+	uint64_t ui64BytesWritten;
+	uint64_t ui64ReadUs;
+	uint64_t ui64WriteUs;
+	PERF_HISTOGRAM ReadSize;		// Bytes
+	PERF_HISTOGRAM WriteSize;		// Bytes
+	PERF_HISTOGRAM ReadWait;		// Microseconds
+	PERF_HISTOGRAM WriteWait;		// Microseconds
+	BYTE     bLastDirection;		// Direction of the previous call, for counting turnarounds
+	DWORD    dwRecords;				// Total records, ring wraps after NETLIB_MAX_IO_RECORDS
+	NETLIB_IO_RECORD rgRecords[NETLIB_MAX_IO_RECORDS];
+	TDS_DECODER Tds;				// Message timeline, only fed when the tdsdecode option is set
+} NETLIB_CONNECTION_STATS;
+
+// Totals over every connection since NetlibStatsReset, for tests that take before/after deltas.
+// A turnaround is a read that follows a write on the same connection, i.e. one network round trip.
+typedef struct _NETLIB_TOTALS
+{
+	DWORD    dwReads;
+	DWORD    dwWrites;
+	DWORD    dwTurnarounds;
+	uint64_t ui64BytesRead;
+	uint64_t ui64BytesWritten;
+} NETLIB_TOTALS;
+
+void NetlibStatsReset();
+void NetlibStatsOpen( CONNECTIONOBJECT* pConnection, const char* pszServer, uint64_t ui64Start, uint64_t ui64End );
+void NetlibStatsOption( CONNECTIONOBJECT* pConnection, OPTSTRUCT* pOptions );
+void NetlibStatsIO( CONNECTIONOBJECT* pConnection, BYTE bDirection, BYTE* pBuffer, DWORD cbRequested, DWORD cbTransferred, TIMEINT wTimeout, BOOL fFailed, uint64_t ui64Start, uint64_t ui64End );
+void NetlibStatsClose( CONNECTIONOBJECT* pConnection );
+void NetlibStatsGetTotals( NETLIB_TOTALS* pTotals );
+void DumpNetlibStats();
@@ -0,0 +1,239 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// PerfStats.cpp: high resolution timer, log2 histograms and percentile summaries.
+//
+// Built without the precompiled header so it can be compiled on its own, e.g.
+//   g++ -O2 -c PerfStats.cpp
+//
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "PerfStats.h"
+
+#ifdef _WIN32
+
+static uint64_t g_ui64PerfFrequency = 0;
+
+uint64_t PerfCounter( void )
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter( &li );
+	return (uint64_t) li.QuadPart;
+}
+
+static uint64_t PerfFrequency( void )
+{
+	LARGE_INTEGER li;
+	if ( 0 == g_ui64PerfFrequency )
+	{
+		QueryPerformanceFrequency( &li );
+		g_ui64PerfFrequency = (uint64_t) li.QuadPart;
+	}
+	return g_ui64PerfFrequency;
+}
+
+#else
+
+uint64_t PerfCounter( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t PerfFrequency( void )
+{
+	return 1000000000ULL;
+}
+
+#endif
+
+uint64_t PerfCounterToUs( uint64_t ui64Ticks )
+{
+	uint64_t ui64Freq = PerfFrequency();
+	// Split to avoid overflowing on long intervals.
+	return ( ui64Ticks / ui64Freq ) * 1000000ULL + ( ( ui64Ticks % ui64Freq ) * 1000000ULL ) / ui64Freq;
+}
+
+double PerfCounterToMs( uint64_t ui64Ticks )
+{
+	return ( (double) ui64Ticks * 1000.0 ) / (double) PerfFrequency();
+}
+
+double PerfElapsedMs( uint64_t ui64Start )
+{
+	return PerfCounterToMs( PerfCounter() - ui64Start );
+}
+
+void PerfHistogramReset( PERF_HISTOGRAM* pHist )
+{
+	if ( NULL == pHist ) return;
+	memset( pHist, 0, sizeof(PERF_HISTOGRAM) );
+}
+
+void PerfHistogramAdd( PERF_HISTOGRAM* pHist, uint64_t ui64Value )
+{
+	uint32_t iBucket = 0;
+	uint64_t v = ui64Value;
+
+	if ( NULL == pHist ) return;
+
+	while ( v )
+	{
+		iBucket++;
+		v >>= 1;
+	}
+	if ( iBucket >= PERF_HISTOGRAM_BUCKETS ) iBucket = PERF_HISTOGRAM_BUCKETS - 1;
+
+	pHist->rgBuckets[iBucket]++;
+	if ( 0 == pHist->ui64Count || ui64Value < pHist->ui64Min ) pHist->ui64Min = ui64Value;
+	if ( ui64Value > pHist->ui64Max ) pHist->ui64Max = ui64Value;
+	pHist->ui64Count++;
+	pHist->ui64Sum += ui64Value;
+}
+
+void PerfHistogramMerge( PERF_HISTOGRAM* pDest, const PERF_HISTOGRAM* pSource )
+{
+	uint32_t i;
+	if ( NULL == pDest || NULL == pSource || 0 == pSource->ui64Count ) return;
+
+	for ( i=0; i<PERF_HISTOGRAM_BUCKETS; i++ ) pDest->rgBuckets[i] += pSource->rgBuckets[i];
+	if ( 0 == pDest->ui64Count || pSource->ui64Min < pDest->ui64Min ) pDest->ui64Min = pSource->ui64Min;
+	if ( pSource->ui64Max > pDest->ui64Max ) pDest->ui64Max = pSource->ui64Max;
+	pDest->ui64Count += pSource->ui64Count;
+	pDest->ui64Sum   += pSource->ui64Sum;
+}
+
+// Formats non-empty buckets as "<upper bound>:<count>" pairs, e.g. "<1:3 <4:10 <8:2".
+char* PerfHistogramFormat( const PERF_HISTOGRAM* pHist, char* pszBuffer, size_t cchBuffer )
+{
+	uint32_t i;
+	size_t cchUsed = 0;
+	int cch;
+
+	if ( NULL == pszBuffer || 0 == cchBuffer ) return (char*) "";
+	pszBuffer[0] = '\0';
+	if ( NULL == pHist ) return pszBuffer;
+
+	for ( i=0; i<PERF_HISTOGRAM_BUCKETS; i++ )
+	{
+		if ( 0 == pHist->rgBuckets[i] ) continue;
+		if ( i == PERF_HISTOGRAM_BUCKETS - 1 )
+		{
+			cch = snprintf( pszBuffer + cchUsed, cchBuffer - cchUsed, "%s>=%llu:%u",
+							( cchUsed ) ? " " : "",
+							(unsigned long long) ( 1ULL << ( i - 1 ) ),
+							pHist->rgBuckets[i] );
+		}
+		else
+		{
+			cch = snprintf( pszBuffer + cchUsed, cchBuffer - cchUsed, "%s<%llu:%u",
+							( cchUsed ) ? " " : "",
+							(unsigned long long) ( 1ULL << i ),
+							pHist->rgBuckets[i] );
+		}
+		if ( cch < 0 || (size_t) cch >= cchBuffer - cchUsed ) break;
+		cchUsed += cch;
+	}
+	return pszBuffer;
+}
+
+void PerfSamplesInit( PERF_SAMPLES* pSamples, double* pdBuffer, uint32_t cMaxSamples )
+{
+	if ( NULL == pSamples ) return;
+	pSamples->pdSamples   = pdBuffer;
+	pSamples->cSamples    = 0;
+	pSamples->cMaxSamples = ( NULL == pdBuffer ) ? 0 : cMaxSamples;
+	pSamples->cDropped    = 0;
+}
+
+void PerfSamplesAdd( PERF_SAMPLES* pSamples, double dValue )
+{
+	if ( NULL == pSamples ) return;
+	if ( pSamples->cSamples >= pSamples->cMaxSamples )
+	{
+		pSamples->cDropped++;
+		return;
+	}
+	pSamples->pdSamples[pSamples->cSamples++] = dValue;
+}
+
+static int CompareDouble( const void* a, const void* b )
+{
+	double da = *(const double*) a;
+	double db = *(const double*) b;
+	if ( da < db ) return -1;
+	if ( da > db ) return 1;
+	return 0;
+}
+
+// Nearest-rank percentile on a sorted array.
+static double Percentile( const double* pdSorted, uint32_t cSamples, double dPercent )
+{
+	uint32_t iRank;
+	if ( 0 == cSamples ) return 0.0;
+	iRank = (uint32_t) ceil( ( dPercent / 100.0 ) * cSamples );
+	if ( iRank < 1 ) iRank = 1;
+	if ( iRank > cSamples ) iRank = cSamples;
+	return pdSorted[iRank-1];
+}
+
+// Sorts the samples in place.
+void PerfSamplesSummarize( PERF_SAMPLES* pSamples, PERF_SUMMARY* pSummary )
+{
+	uint32_t i;
+	double dSum = 0.0, dSumSq = 0.0, dVar;
+
+	if ( NULL == pSummary ) return;
+	memset( pSummary, 0, sizeof(PERF_SUMMARY) );
+	if ( NULL == pSamples || 0 == pSamples->cSamples ) return;
+
+	qsort( pSamples->pdSamples, pSamples->cSamples, sizeof(double), CompareDouble );
+
+	for ( i=0; i<pSamples->cSamples; i++ )
+	{
+		dSum   += pSamples->pdSamples[i];
+		dSumSq += pSamples->pdSamples[i] * pSamples->pdSamples[i];
+	}
+
+	pSummary->cSamples = pSamples->cSamples;
+	pSummary->dMin     = pSamples->pdSamples[0];
+	pSummary->dMax     = pSamples->pdSamples[pSamples->cSamples-1];
+	pSummary->dAvg     = dSum / pSamples->cSamples;
+	dVar               = ( dSumSq / pSamples->cSamples ) - ( pSummary->dAvg * pSummary->dAvg );
+	pSummary->dStdDev  = ( dVar > 0.0 ) ? sqrt( dVar ) : 0.0;
+	pSummary->dP50     = Percentile( pSamples->pdSamples, pSamples->cSamples, 50.0 );
+	pSummary->dP90     = Percentile( pSamples->pdSamples, pSamples->cSamples, 90.0 );
+	pSummary->dP99     = Percentile( pSamples->pdSamples, pSamples->cSamples, 99.0 );
+}
+
+char* PerfSummaryFormat( const PERF_SUMMARY* pSummary, const char* pszUnit, char* pszBuffer, size_t cchBuffer )
+{
+	if ( NULL == pszBuffer || 0 == cchBuffer ) return (char*) "";
+	if ( NULL == pSummary || 0 == pSummary->cSamples )
+	{
+		snprintf( pszBuffer, cchBuffer, "n=0" );
+		return pszBuffer;
+	}
+	snprintf( pszBuffer, cchBuffer,
+			  "n=%u min=%.3f%s avg=%.3f%s p50=%.3f%s p90=%.3f%s p99=%.3f%s max=%.3f%s stddev=%.3f%s",
+			  pSummary->cSamples,
+			  pSummary->dMin, pszUnit,
+			  pSummary->dAvg, pszUnit,
+			  pSummary->dP50, pszUnit,
+			  pSummary->dP90, pszUnit,
+			  pSummary->dP99, pszUnit,
+			  pSummary->dMax, pszUnit,
+			  pSummary->dStdDev, pszUnit );
+	return pszBuffer;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+// Timing and distribution helpers shared by the hooks and the benchmark modes.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Power-of-two buckets: bucket 0 holds 0, bucket n holds values in [2^(n-1), 2^n).
+// The last bucket holds everything at or above 2^(PERF_HISTOGRAM_BUCKETS-2).
+#define PERF_HISTOGRAM_BUCKETS 32
+
+typedef struct _PERF_HISTOGRAM
+{
+	uint32_t rgBuckets[PERF_HISTOGRAM_BUCKETS];
+	uint64_t ui64Count;
+	uint64_t ui64Sum;
+	uint64_t ui64Min;
+	uint64_t ui64Max;
+} PERF_HISTOGRAM;
+
+// Fixed capacity sample set used for percentiles.  The caller owns the buffer.
+typedef struct _PERF_SAMPLES
+{
+	double*  pdSamples;
+	uint32_t cSamples;
+	uint32_t cMaxSamples;
+	uint32_t cDropped;
+} PERF_SAMPLES;
+
+typedef struct _PERF_SUMMARY
+{
+	uint32_t cSamples;
+	double dMin;
+	double dMax;
+	double dAvg;
+	double dStdDev;
+	double dP50;
+	double dP90;
+	double dP99;
+} PERF_SUMMARY;
+
+uint64_t PerfCounter( void );
+uint64_t PerfCounterToUs( uint64_t ui64Ticks );
+double   PerfCounterToMs( uint64_t ui64Ticks );
+double   PerfElapsedMs( uint64_t ui64Start );
+
+void PerfHistogramReset( PERF_HISTOGRAM* pHist );
+void PerfHistogramAdd( PERF_HISTOGRAM* pHist, uint64_t ui64Value );
+void PerfHistogramMerge( PERF_HISTOGRAM* pDest, const PERF_HISTOGRAM* pSource );
+char* PerfHistogramFormat( const PERF_HISTOGRAM* pHist, char* pszBuffer, size_t cchBuffer );
+
+void PerfSamplesInit( PERF_SAMPLES* pSamples, double* pdBuffer, uint32_t cMaxSamples );
+void PerfSamplesAdd( PERF_SAMPLES* pSamples, double dValue );
+void PerfSamplesSummarize( PERF_SAMPLES* pSamples, PERF_SUMMARY* pSummary );
+char* PerfSummaryFormat( const PERF_SUMMARY* pSummary, const char* pszUnit, char* pszBuffer, size_t cchBuffer );
@@ -0,0 +1,605 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// RevocationProfile.cpp: revocation checking profile of a certificate chain build, fed by the
+// CertGetCertificateChain and CryptRetrieveObjectByUrlW detours.
+//
+// Built without the precompiled header.  With REVPROFILE_STANDALONE defined it also builds a
+// tool that serves CRLs from a local HTTP stand-in with configurable delays, retrieves them the
+// way the chain engine does and runs the same analysis on the result, e.g.
+//   g++ -O2 -DREVPROFILE_STANDALONE RevocationProfile.cpp PerfStats.cpp -o revprofile -lpthread
+//   ./revprofile -d 0,300,2500 -t 2000
+//
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RevocationProfile.h"
+
+void RevProfileStart( REV_CHAIN_PROFILE* pProfile, uint32_t dwFlags, uint32_t dwUrlTimeoutMs, uint64_t ui64StartUs )
+{
+	memset( pProfile, 0, sizeof(REV_CHAIN_PROFILE) );
+	pProfile->dwFlags        = dwFlags;
+	pProfile->dwUrlTimeoutMs = dwUrlTimeoutMs;
+	pProfile->ui64StartUs    = ui64StartUs;
+}
+
+// Returns the stored retrieval, or NULL when the profile is full and it was only counted.
+REV_RETRIEVAL* RevProfileAddRetrieval( REV_CHAIN_PROFILE* pProfile, const char* pszUrl, uint64_t ui64Us, uint32_t dwTimeoutMs,
+									   int fSuccess, uint32_t dwError, int fCacheOnly )
+{
+	REV_RETRIEVAL* pRetrieval;
+
+	if ( pProfile->cRetrievals++ >= REV_MAX_RETRIEVALS ) return NULL;
+
+	pRetrieval = &pProfile->rgRetrievals[pProfile->cRetrievals-1];
+	snprintf( pRetrieval->szUrl, sizeof(pRetrieval->szUrl), "%s", ( NULL == pszUrl ) ? "<NULL>" : pszUrl );
+	pRetrieval->ui64Us      = ui64Us;
+	pRetrieval->dwTimeoutMs = dwTimeoutMs;
+	pRetrieval->fSuccess    = fSuccess;
+	pRetrieval->dwError     = ( fSuccess ) ? 0 : dwError;
+	pRetrieval->fCacheOnly  = fCacheOnly;
+	return pRetrieval;
+}
+
+void RevProfileFinish( REV_CHAIN_PROFILE* pProfile, uint32_t dwTrustErrorStatus, uint64_t ui64EndUs )
+{
+	pProfile->dwTrustErrorStatus = dwTrustErrorStatus;
+	pProfile->ui64Us             = ( ui64EndUs > pProfile->ui64StartUs ) ? ui64EndUs - pProfile->ui64StartUs : 0;
+	pProfile->fFinished          = 1;
+}
+
+static int IsTimeoutError( uint32_t dwError )
+{
+	switch ( dwError )
+	{
+		case 258:			// WAIT_TIMEOUT
+		case 1460:			// ERROR_TIMEOUT
+		case 12002:			// ERROR_INTERNET_TIMEOUT
+		case 0x80072ee2:	// HRESULT_FROM_WIN32(ERROR_INTERNET_TIMEOUT)
+			return 1;
+	}
+#ifndef _WIN32
+	if ( ETIMEDOUT == dwError || EAGAIN == dwError ) return 1;
+#endif
+	return 0;
+}
+
+// A failed retrieval timed out if it says so, or if it gave up at (about) its timeout.
+static int IsTimedOut( const REV_RETRIEVAL* pRetrieval )
+{
+	if ( pRetrieval->fSuccess ) return 0;
+	if ( IsTimeoutError( pRetrieval->dwError ) ) return 1;
+	return ( pRetrieval->dwTimeoutMs > 0 && pRetrieval->ui64Us >= (uint64_t) pRetrieval->dwTimeoutMs * 900 );
+}
+
+void RevProfileAnalyze( const REV_CHAIN_PROFILE* pProfile, uint32_t dwSlowMs, REV_ANALYSIS* pAnalysis )
+{
+	uint32_t i;
+	uint32_t cKept = ( pProfile->cRetrievals < REV_MAX_RETRIEVALS ) ? pProfile->cRetrievals : REV_MAX_RETRIEVALS;
+
+	memset( pAnalysis, 0, sizeof(REV_ANALYSIS) );
+	pAnalysis->iSlowest = -1;
+
+	for ( i=0; i<cKept; i++ )
+	{
+		const REV_RETRIEVAL* pRetrieval = &pProfile->rgRetrievals[i];
+
+		if ( pRetrieval->fCacheOnly )
+		{
+			pAnalysis->cCache++;
+			continue;
+		}
+
+		pAnalysis->cWire++;
+		pAnalysis->ui64WireUs += pRetrieval->ui64Us;
+		if ( !pRetrieval->fSuccess ) pAnalysis->cFailed++;
+		if ( IsTimedOut( pRetrieval ) ) pAnalysis->cTimedOut++;
+		else if ( pRetrieval->ui64Us >= (uint64_t) dwSlowMs * 1000 ) pAnalysis->cSlow++;
+		if ( pAnalysis->iSlowest < 0 || pRetrieval->ui64Us > pAnalysis->ui64MaxUs )
+		{
+			pAnalysis->ui64MaxUs = pRetrieval->ui64Us;
+			pAnalysis->iSlowest  = (int) i;
+		}
+	}
+
+	if ( pProfile->ui64Us > 0 )
+	{
+		pAnalysis->dWireShare = pAnalysis->ui64WireUs * 100.0 / pProfile->ui64Us;
+		if ( pAnalysis->dWireShare > 100.0 ) pAnalysis->dWireShare = 100.0;
+	}
+
+	if ( pProfile->dwTrustErrorStatus & REV_TRUST_IS_REVOKED )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_REVOKED;
+	}
+	else if ( pProfile->dwTrustErrorStatus & ( REV_TRUST_IS_OFFLINE_REVOCATION | REV_TRUST_REVOCATION_STATUS_UNKNOWN ) )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_OFFLINE;
+	}
+	else if ( pAnalysis->cTimedOut > 0 )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_TIMEOUT;
+	}
+	else if ( pAnalysis->cSlow > 0 )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_SLOW;
+	}
+	else if ( pAnalysis->cWire > 0 )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_FETCHED;
+	}
+	else if ( 0 != ( pProfile->dwFlags & REV_CHECK_ANY ) )
+	{
+		pAnalysis->iVerdict = REV_VERDICT_CACHED;
+	}
+	else
+	{
+		pAnalysis->iVerdict = REV_VERDICT_NOT_CHECKED;
+	}
+}
+
+const char* RevVerdictName( int iVerdict )
+{
+	switch ( iVerdict )
+	{
+		case REV_VERDICT_NOT_CHECKED:	return "not checked";
+		case REV_VERDICT_CACHED:		return "cached";
+		case REV_VERDICT_FETCHED:		return "fetched";
+		case REV_VERDICT_SLOW:			return "slow";
+		case REV_VERDICT_TIMEOUT:		return "timeout";
+		case REV_VERDICT_OFFLINE:		return "offline";
+		case REV_VERDICT_REVOKED:		return "revoked";
+	}
+	return "unknown";
+}
+
+static void AppendName( char* pszBuffer, size_t cchBuffer, const char* pszName )
+{
+	size_t cch = strlen( pszBuffer );
+	snprintf( pszBuffer + cch, cchBuffer - cch, "%s%s", ( 0 == cch ) ? "" : ", ", pszName );
+}
+
+char* RevFlagsFormat( uint32_t dwFlags, char* pszBuffer, size_t cchBuffer )
+{
+	pszBuffer[0] = '\0';
+	if ( dwFlags & REV_CHECK_END_CERT )				AppendName( pszBuffer, cchBuffer, "CHECK_END_CERT" );
+	if ( dwFlags & REV_CHECK_CHAIN )				AppendName( pszBuffer, cchBuffer, "CHECK_CHAIN" );
+	if ( dwFlags & REV_CHECK_CHAIN_EXCLUDE_ROOT )	AppendName( pszBuffer, cchBuffer, "CHECK_CHAIN_EXCLUDE_ROOT" );
+	if ( dwFlags & REV_CHECK_CACHE_ONLY )			AppendName( pszBuffer, cchBuffer, "CHECK_CACHE_ONLY" );
+	if ( dwFlags & REV_ACCUMULATIVE_TIMEOUT )		AppendName( pszBuffer, cchBuffer, "ACCUMULATIVE_TIMEOUT" );
+	if ( dwFlags & REV_CHECK_OCSP_CERT )			AppendName( pszBuffer, cchBuffer, "CHECK_OCSP_CERT" );
+	if ( '\0' == pszBuffer[0] ) snprintf( pszBuffer, cchBuffer, "no revocation flags" );
+	return pszBuffer;
+}
+
+char* RevTrustFormat( uint32_t dwErrorStatus, char* pszBuffer, size_t cchBuffer )
+{
+	pszBuffer[0] = '\0';
+	if ( dwErrorStatus & REV_TRUST_IS_REVOKED )					AppendName( pszBuffer, cchBuffer, "IS_REVOKED" );
+	if ( dwErrorStatus & REV_TRUST_REVOCATION_STATUS_UNKNOWN )	AppendName( pszBuffer, cchBuffer, "REVOCATION_STATUS_UNKNOWN" );
+	if ( dwErrorStatus & REV_TRUST_IS_OFFLINE_REVOCATION )		AppendName( pszBuffer, cchBuffer, "IS_OFFLINE_REVOCATION" );
+	if ( '\0' == pszBuffer[0] ) snprintf( pszBuffer, cchBuffer, ( 0 == dwErrorStatus ) ? "no errors" : "no revocation errors" );
+	return pszBuffer;
+}
+
+static void ReportLine( PFN_REV_LINE pfnLine, void* pvContext, const char* pszFormat, ... )
+{
+	char szLine[512];
+	va_list args;
+
+	va_start( args, pszFormat );
+	vsnprintf( szLine, sizeof(szLine), pszFormat, args );
+	va_end( args );
+	pfnLine( szLine, pvContext );
+}
+
+void RevProfileReport( const REV_CHAIN_PROFILE* pProfile, const REV_ANALYSIS* pAnalysis, PFN_REV_LINE pfnLine, void* pvContext )
+{
+	char szFlags[160];
+	char szTrust[160];
+	char szTimeout[32];
+	uint32_t i;
+	uint32_t cKept = ( pProfile->cRetrievals < REV_MAX_RETRIEVALS ) ? pProfile->cRetrievals : REV_MAX_RETRIEVALS;
+
+	if ( pProfile->dwUrlTimeoutMs > 0 ) snprintf( szTimeout, sizeof(szTimeout), "%u ms", pProfile->dwUrlTimeoutMs );
+	else snprintf( szTimeout, sizeof(szTimeout), "default (%u ms)", REV_DEFAULT_TIMEOUT_MS );
+
+	ReportLine( pfnLine, pvContext, "Revocation check: %s", RevVerdictName( pAnalysis->iVerdict ) );
+	ReportLine( pfnLine, pvContext, "  Chain build %.3f ms, dwFlags 0x%08x (%s), URL retrieval timeout %s",
+				pProfile->ui64Us / 1000.0, pProfile->dwFlags, RevFlagsFormat( pProfile->dwFlags, szFlags, sizeof(szFlags) ), szTimeout );
+
+	if ( pProfile->cRetrievals > 0 )
+	{
+		ReportLine( pfnLine, pvContext, "  %u URL retrievals, %u from the network and %u from the URL cache, %.3f ms on the network (%.1f%% of the chain build), %u failed, %u timed out",
+					pProfile->cRetrievals, pAnalysis->cWire, pAnalysis->cCache, pAnalysis->ui64WireUs / 1000.0,
+					pAnalysis->dWireShare, pAnalysis->cFailed, pAnalysis->cTimedOut );
+		for ( i=0; i<cKept; i++ )
+		{
+			const REV_RETRIEVAL* pRetrieval = &pProfile->rgRetrievals[i];
+			char szResult[48];
+
+			if ( pRetrieval->fSuccess ) snprintf( szResult, sizeof(szResult), "%s", ( pRetrieval->fCacheOnly ) ? "cache hit" : "ok" );
+			else if ( IsTimedOut( pRetrieval ) ) snprintf( szResult, sizeof(szResult), "timed out 0x%08x", pRetrieval->dwError );
+			else snprintf( szResult, sizeof(szResult), "%s 0x%08x", ( pRetrieval->fCacheOnly ) ? "cache miss" : "failed", pRetrieval->dwError );
+
+			ReportLine( pfnLine, pvContext, "    %2u. %10.3f ms  %-20s %s", i+1, pRetrieval->ui64Us / 1000.0, szResult, pRetrieval->szUrl );
+		}
+		if ( pProfile->cRetrievals > cKept )
+		{
+			ReportLine( pfnLine, pvContext, "    ... %u more not listed", pProfile->cRetrievals - cKept );
+		}
+	}
+	else
+	{
+		ReportLine( pfnLine, pvContext, "  No URL retrievals." );
+	}
+
+	ReportLine( pfnLine, pvContext, "  Chain trust status 0x%08x (%s)", pProfile->dwTrustErrorStatus, RevTrustFormat( pProfile->dwTrustErrorStatus, szTrust, sizeof(szTrust) ) );
+
+	switch ( pAnalysis->iVerdict )
+	{
+		case REV_VERDICT_OFFLINE:
+			ReportLine( pfnLine, pvContext, "  The revocation server could not be reached, so the revocation status is unknown.  Check that" );
+			ReportLine( pfnLine, pvContext, "  this machine can reach the URLs above through its proxy and firewall." );
+			break;
+
+		case REV_VERDICT_TIMEOUT:
+			ReportLine( pfnLine, pvContext, "  %u retrievals timed out but revocation was still determined.  The chain build waited %.3f ms for",
+						pAnalysis->cTimedOut, pAnalysis->ui64MaxUs / 1000.0 );
+			ReportLine( pfnLine, pvContext, "  the slowest one, a login timeout shorter than that fails before the handshake completes." );
+			break;
+
+		case REV_VERDICT_SLOW:
+			ReportLine( pfnLine, pvContext, "  The slowest retrieval took %.3f ms: %s", pAnalysis->ui64MaxUs / 1000.0,
+						pProfile->rgRetrievals[pAnalysis->iSlowest].szUrl );
+			break;
+
+		case REV_VERDICT_REVOKED:
+			ReportLine( pfnLine, pvContext, "  A certificate in the chain has been revoked." );
+			break;
+	}
+}
+
+#ifdef REVPROFILE_STANDALONE
+
+#include "PerfStats.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define SLEEP_MS(ms)		Sleep( ms )
+#define SOCKET_ERROR_CODE()	( (uint32_t) WSAGetLastError() )
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+typedef int SOCKET;
+#define INVALID_SOCKET		(-1)
+#define closesocket(s)		close(s)
+#define SLEEP_MS(ms)		usleep( (useconds_t) (ms) * 1000 )
+#define SOCKET_ERROR_CODE()	( (uint32_t) errno )
+#endif
+
+#define STANDIN_MAX_URLS	REV_MAX_RETRIEVALS
+#define STANDIN_CRL_SIZE	2048
+
+static uint32_t g_rgdwDelayMs[STANDIN_MAX_URLS];
+static uint32_t g_cUrls = 0;
+static uint16_t g_wPort = 0;
+
+// Serves GET /<n>.crl after the n-th configured delay, with a dummy DER body.  Each request
+// gets its own thread so a slow URL does not hold up the next one once the client gives up.
+static void ServeRequest( SOCKET s )
+{
+	static uint8_t rgbCrl[STANDIN_CRL_SIZE];
+	char szRequest[512];
+	char szHeader[256];
+	int cbRequest = 0;
+	int cb;
+	unsigned int iUrl = 0;
+
+	while ( cbRequest < (int) sizeof(szRequest) - 1 )
+	{
+		cb = recv( s, szRequest + cbRequest, (int) sizeof(szRequest) - 1 - cbRequest, 0 );
+		if ( cb <= 0 ) break;
+		cbRequest += cb;
+		szRequest[cbRequest] = '\0';
+		if ( NULL != strstr( szRequest, "\r\n\r\n" ) ) break;
+	}
+	szRequest[cbRequest] = '\0';
+
+	if ( 1 != sscanf( szRequest, "GET /%u.crl", &iUrl ) || iUrl >= g_cUrls )
+	{
+		snprintf( szHeader, sizeof(szHeader), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n" );
+		send( s, szHeader, (int) strlen( szHeader ), 0 );
+		closesocket( s );
+		return;
+	}
+
+	SLEEP_MS( g_rgdwDelayMs[iUrl] );
+
+	// SEQUENCE with a long form length, enough for the client to see a CRL sized answer.
+	memset( rgbCrl, 0, sizeof(rgbCrl) );
+	rgbCrl[0] = 0x30;
+	rgbCrl[1] = 0x82;
+	rgbCrl[2] = (uint8_t) ( ( STANDIN_CRL_SIZE - 4 ) >> 8 );
+	rgbCrl[3] = (uint8_t) ( STANDIN_CRL_SIZE - 4 );
+	snprintf( szHeader, sizeof(szHeader), "HTTP/1.0 200 OK\r\nContent-Type: application/pkix-crl\r\nContent-Length: %d\r\n\r\n", STANDIN_CRL_SIZE );
+	send( s, szHeader, (int) strlen( szHeader ), 0 );
+	send( s, (const char*) rgbCrl, STANDIN_CRL_SIZE, 0 );
+	closesocket( s );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ServeRequestThread( LPVOID pv )
+{
+	ServeRequest( (SOCKET) (uintptr_t) pv );
+	return 0;
+}
+static DWORD WINAPI ListenThread( LPVOID pv )
+#else
+static void* ServeRequestThread( void* pv )
+{
+	ServeRequest( (SOCKET) (intptr_t) pv );
+	return NULL;
+}
+static void* ListenThread( void* pv )
+#endif
+{
+	SOCKET sListen = (SOCKET) (intptr_t) pv;
+	SOCKET s;
+
+	for ( ;; )
+	{
+		s = accept( sListen, NULL, NULL );
+		if ( INVALID_SOCKET == s ) break;
+#ifdef _WIN32
+		{
+			HANDLE hThread = CreateThread( NULL, 0, ServeRequestThread, (LPVOID) (uintptr_t) s, 0, NULL );
+			if ( NULL == hThread ) closesocket( s );
+			else CloseHandle( hThread );
+		}
+#else
+		{
+			pthread_t thread;
+			if ( 0 != pthread_create( &thread, NULL, ServeRequestThread, (void*) (intptr_t) s ) ) closesocket( s );
+			else pthread_detach( thread );
+		}
+#endif
+	}
+	return 0;
+}
+
+static SOCKET StartStandIn()
+{
+	struct sockaddr_in sin;
+	socklen_t cbSin = sizeof(sin);
+	SOCKET s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+	if ( INVALID_SOCKET == s ) return s;
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	if ( 0 != bind( s, (struct sockaddr*) &sin, sizeof(sin) ) || 0 != listen( s, 16 ) ||
+		 0 != getsockname( s, (struct sockaddr*) &sin, &cbSin ) )
+	{
+		closesocket( s );
+		return INVALID_SOCKET;
+	}
+	g_wPort = ntohs( sin.sin_port );
+
+#ifdef _WIN32
+	{
+		HANDLE hThread = CreateThread( NULL, 0, ListenThread, (LPVOID) (intptr_t) s, 0, NULL );
+		if ( NULL != hThread ) CloseHandle( hThread );
+	}
+#else
+	{
+		pthread_t thread;
+		if ( 0 == pthread_create( &thread, NULL, ListenThread, (void*) (intptr_t) s ) ) pthread_detach( thread );
+	}
+#endif
+	return s;
+}
+
+// HTTP GET with an overall timeout, like the chain engine's URL retrieval.  Returns 1 on a 200
+// answer with the whole body, 0 with *pdwError set otherwise.
+static int RetrieveUrl( unsigned int iUrl, uint32_t dwTimeoutMs, uint32_t* pdwError )
+{
+	struct sockaddr_in sin;
+	char szRequest[128];
+	char szResponse[4096];
+	uint64_t ui64Start = PerfCounter();
+	size_t cbResponse = 0;
+	long cbContent = -1;
+	SOCKET s;
+	int cb;
+
+	*pdwError = 0;
+	s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+	if ( INVALID_SOCKET == s )
+	{
+		*pdwError = SOCKET_ERROR_CODE();
+		return 0;
+	}
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	sin.sin_port        = htons( g_wPort );
+	if ( 0 != connect( s, (struct sockaddr*) &sin, sizeof(sin) ) )
+	{
+		*pdwError = SOCKET_ERROR_CODE();
+		closesocket( s );
+		return 0;
+	}
+
+	snprintf( szRequest, sizeof(szRequest), "GET /%u.crl HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n", iUrl );
+	send( s, szRequest, (int) strlen( szRequest ), 0 );
+
+	for ( ;; )
+	{
+		fd_set fds;
+		struct timeval tv;
+		double dLeftMs = dwTimeoutMs - PerfElapsedMs( ui64Start );
+		char* pszBody;
+
+		if ( dLeftMs <= 0 )
+		{
+			*pdwError = 1460;	// ERROR_TIMEOUT, what cryptnet reports
+			break;
+		}
+		FD_ZERO( &fds );
+		FD_SET( s, &fds );
+		tv.tv_sec  = (long) ( dLeftMs / 1000 );
+		tv.tv_usec = (long) ( ( dLeftMs - tv.tv_sec * 1000.0 ) * 1000 );
+		if ( select( (int) s + 1, &fds, NULL, NULL, &tv ) <= 0 ) continue;
+
+		// Keep the headers, count the body.
+		cb = recv( s, szResponse + cbResponse, (int) ( sizeof(szResponse) - 1 - cbResponse ), 0 );
+		if ( cb <= 0 )
+		{
+			*pdwError = ( 0 == cb ) ? 12030 : SOCKET_ERROR_CODE();	// ERROR_INTERNET_CONNECTION_ABORTED
+			break;
+		}
+		cbResponse += cb;
+		szResponse[cbResponse] = '\0';
+
+		pszBody = strstr( szResponse, "\r\n\r\n" );
+		if ( NULL == pszBody ) continue;
+		if ( 0 != strncmp( szResponse, "HTTP/1.0 200", 12 ) )
+		{
+			*pdwError = 12007;	// ERROR_INTERNET_NAME_NOT_RESOLVED stands in for any bad answer
+			break;
+		}
+		if ( cbContent < 0 )
+		{
+			const char* pszLength = strstr( szResponse, "Content-Length:" );
+			cbContent = ( NULL == pszLength ) ? 0 : atol( pszLength + 15 );
+		}
+		if ( (long) ( szResponse + cbResponse - ( pszBody + 4 ) ) >= cbContent )
+		{
+			closesocket( s );
+			return 1;
+		}
+		// Drop the body read so far so the buffer does not fill up.
+		cbContent -= (long) ( szResponse + cbResponse - ( pszBody + 4 ) );
+		cbResponse = (size_t) ( pszBody + 4 - szResponse );
+		szResponse[cbResponse] = '\0';
+	}
+
+	closesocket( s );
+	return 0;
+}
+
+static void PrintLine( const char* pszLine, void* /*pvContext*/ )
+{
+	printf( "%s\n", pszLine );
+}
+
+int main( int argc, char* argv[] )
+{
+	REV_CHAIN_PROFILE Profile;
+	REV_ANALYSIS Analysis;
+	const char* pszDelays = "0,300,2500";
+	const char* pszExpect = NULL;
+	uint32_t dwTimeoutMs = 2000;
+	uint32_t dwSlowMs = REV_DEFAULT_SLOW_MS;
+	uint32_t dwFlags = REV_CHECK_CHAIN_EXCLUDE_ROOT;
+	uint32_t dwTrust = 0;
+	uint32_t dwLeftMs;
+	const char* p;
+	uint32_t i;
+	SOCKET sListen;
+
+	for ( i=1; i<(uint32_t) argc; i++ )
+	{
+		if      ( 0 == strcmp( argv[i], "-d" ) && i+1 < (uint32_t) argc ) pszDelays   = argv[++i];
+		else if ( 0 == strcmp( argv[i], "-t" ) && i+1 < (uint32_t) argc ) dwTimeoutMs = (uint32_t) strtoul( argv[++i], NULL, 10 );
+		else if ( 0 == strcmp( argv[i], "-s" ) && i+1 < (uint32_t) argc ) dwSlowMs    = (uint32_t) strtoul( argv[++i], NULL, 10 );
+		else if ( 0 == strcmp( argv[i], "-e" ) && i+1 < (uint32_t) argc ) pszExpect   = argv[++i];
+		else if ( 0 == strcmp( argv[i], "-a" ) ) dwFlags |= REV_ACCUMULATIVE_TIMEOUT;
+		else
+		{
+			fprintf( stderr, "Usage: revprofile [-d delay ms per URL, comma separated] [-t URL timeout ms] [-a] [-s slow ms] [-e expected verdict]\n" );
+			fprintf( stderr, "  -a  share the timeout across all URLs, like CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT\n" );
+			return 2;
+		}
+	}
+
+	for ( p = pszDelays; '\0' != *p && g_cUrls < STANDIN_MAX_URLS; )
+	{
+		g_rgdwDelayMs[g_cUrls++] = (uint32_t) strtoul( p, (char**) &p, 10 );
+		while ( ',' == *p || ' ' == *p ) p++;
+	}
+	if ( 0 == g_cUrls ) g_rgdwDelayMs[g_cUrls++] = 0;
+
+#ifdef _WIN32
+	{
+		WSADATA wsa;
+		WSAStartup( MAKEWORD(2,2), &wsa );
+	}
+#else
+	signal( SIGPIPE, SIG_IGN );		// The stand-in writes to clients that gave up
+#endif
+
+	sListen = StartStandIn();
+	if ( INVALID_SOCKET == sListen )
+	{
+		fprintf( stderr, "Could not start the HTTP stand-in.\n" );
+		return 1;
+	}
+	printf( "CRL stand-in on 127.0.0.1:%u, %u URLs, timeout %u ms%s\n\n", g_wPort, g_cUrls, dwTimeoutMs,
+			( dwFlags & REV_ACCUMULATIVE_TIMEOUT ) ? " shared across all URLs" : " per URL" );
+
+	// One chain build: every URL is tried in turn, like CRL distribution points and OCSP
+	// responders of the certificates in a chain.
+	RevProfileStart( &Profile, dwFlags, dwTimeoutMs, PerfCounterToUs( PerfCounter() ) );
+	dwLeftMs = dwTimeoutMs;
+	for ( i=0; i<g_cUrls; i++ )
+	{
+		char szUrl[64];
+		uint32_t dwUrlTimeoutMs = ( dwFlags & REV_ACCUMULATIVE_TIMEOUT ) ? dwLeftMs : dwTimeoutMs;
+		uint32_t dwError = 0;
+		uint64_t ui64Start = PerfCounter();
+		uint64_t ui64Us;
+		int fSuccess;
+
+		snprintf( szUrl, sizeof(szUrl), "http://127.0.0.1:%u/%u.crl", g_wPort, i );
+		if ( 0 == dwUrlTimeoutMs )
+		{
+			RevProfileAddRetrieval( &Profile, szUrl, 0, 0, 0, 1460, 0 );
+			continue;
+		}
+		fSuccess = RetrieveUrl( i, dwUrlTimeoutMs, &dwError );
+		ui64Us = PerfCounterToUs( PerfCounter() - ui64Start );
+		RevProfileAddRetrieval( &Profile, szUrl, ui64Us, dwUrlTimeoutMs, fSuccess, dwError, 0 );
+		// Each URL stands for a different certificate, so any failure leaves one with unknown status.
+		if ( !fSuccess ) dwTrust |= REV_TRUST_REVOCATION_STATUS_UNKNOWN | REV_TRUST_IS_OFFLINE_REVOCATION;
+		dwLeftMs = ( ui64Us / 1000 >= dwLeftMs ) ? 0 : dwLeftMs - (uint32_t) ( ui64Us / 1000 );
+	}
+	RevProfileFinish( &Profile, dwTrust, PerfCounterToUs( PerfCounter() ) );
+
+	RevProfileAnalyze( &Profile, dwSlowMs, &Analysis );
+	RevProfileReport( &Profile, &Analysis, PrintLine, NULL );
+
+	closesocket( sListen );
+
+	if ( NULL != pszExpect && 0 != strcmp( pszExpect, RevVerdictName( Analysis.iVerdict ) ) )
+	{
+		printf( "\nExpected verdict '%s', got '%s'.\n", pszExpect, RevVerdictName( Analysis.iVerdict ) );
+		return 1;
+	}
+	return 0;
+}
+
+#endif
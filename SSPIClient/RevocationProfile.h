@@ -0,0 +1,86 @@
+#pragma once
+
+// Revocation checking profile of one CertGetCertificateChain call: the revocation flags it was
+// called with, every CRL/OCSP URL retrieval cryptnet made for it and how long each took, and the
+// trust status the chain ended up with.  The analysis decides whether a slow chain build was
+// caused by revocation checking and whether revocation information was unreachable (offline).
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CertGetCertificateChain dwFlags, spelled out so the file builds without wincrypt.h.
+#define REV_CHECK_END_CERT				0x10000000	// CERT_CHAIN_REVOCATION_CHECK_END_CERT
+#define REV_CHECK_CHAIN					0x20000000	// CERT_CHAIN_REVOCATION_CHECK_CHAIN
+#define REV_CHECK_CHAIN_EXCLUDE_ROOT	0x40000000	// CERT_CHAIN_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT
+#define REV_CHECK_CACHE_ONLY			0x80000000	// CERT_CHAIN_REVOCATION_CHECK_CACHE_ONLY
+#define REV_ACCUMULATIVE_TIMEOUT		0x08000000	// CERT_CHAIN_REVOCATION_ACCUMULATIVE_TIMEOUT
+#define REV_CHECK_OCSP_CERT				0x04000000	// CERT_CHAIN_REVOCATION_CHECK_OCSP_CERT
+#define REV_CHECK_ANY					( REV_CHECK_END_CERT | REV_CHECK_CHAIN | REV_CHECK_CHAIN_EXCLUDE_ROOT )
+
+// CERT_TRUST_STATUS.dwErrorStatus bits that concern revocation.
+#define REV_TRUST_IS_REVOKED				0x00000004	// CERT_TRUST_IS_REVOKED
+#define REV_TRUST_REVOCATION_STATUS_UNKNOWN	0x00000040	// CERT_TRUST_REVOCATION_STATUS_UNKNOWN
+#define REV_TRUST_IS_OFFLINE_REVOCATION		0x01000000	// CERT_TRUST_IS_OFFLINE_REVOCATION
+
+#define REV_DEFAULT_TIMEOUT_MS		15000	// Chain engine URL retrieval timeout when the caller sets none
+#define REV_DEFAULT_SLOW_MS			1000
+#define REV_MAX_RETRIEVALS			16
+#define REV_URL_SIZE				256
+
+// Verdicts, worst last.
+#define REV_VERDICT_NOT_CHECKED		0	// No revocation flags
+#define REV_VERDICT_CACHED			1	// Checked without going to the network
+#define REV_VERDICT_FETCHED			2	// Went to the network, every retrieval was quick
+#define REV_VERDICT_SLOW			3	// A retrieval took longer than the slow threshold
+#define REV_VERDICT_TIMEOUT			4	// A retrieval timed out, revocation still determined
+#define REV_VERDICT_OFFLINE			5	// Revocation server unreachable, status unknown
+#define REV_VERDICT_REVOKED			6
+
+typedef struct _REV_RETRIEVAL
+{
+	char     szUrl[REV_URL_SIZE];
+	uint64_t ui64Us;
+	uint32_t dwTimeoutMs;		// Timeout passed to this retrieval, 0 if unknown
+	uint32_t dwError;			// GetLastError or errno when it failed
+	int      fSuccess;
+	int      fCacheOnly;		// Answered from the URL cache, no network access
+} REV_RETRIEVAL;
+
+typedef struct _REV_CHAIN_PROFILE
+{
+	uint32_t      dwFlags;
+	uint32_t      dwUrlTimeoutMs;		// CERT_CHAIN_PARA dwUrlRetrievalTimeout, 0 for the default
+	uint64_t      ui64StartUs;
+	uint64_t      ui64Us;				// Whole chain build
+	uint32_t      dwTrustErrorStatus;
+	int           fFinished;
+	uint32_t      cRetrievals;			// May exceed REV_MAX_RETRIEVALS, only the first ones are kept
+	REV_RETRIEVAL rgRetrievals[REV_MAX_RETRIEVALS];
+} REV_CHAIN_PROFILE;
+
+typedef struct _REV_ANALYSIS
+{
+	int      iVerdict;
+	uint32_t cWire;					// Retrievals that went to the network
+	uint32_t cCache;				// Retrievals answered from the URL cache
+	uint32_t cFailed;
+	uint32_t cTimedOut;
+	uint32_t cSlow;
+	uint64_t ui64WireUs;			// Time in network retrievals
+	uint64_t ui64MaxUs;
+	int      iSlowest;				// Index of the slowest retrieval, -1 if none
+	double   dWireShare;			// Percentage of the chain build spent in network retrievals
+} REV_ANALYSIS;
+
+typedef void (*PFN_REV_LINE)( const char* pszLine, void* pvContext );
+
+void RevProfileStart( REV_CHAIN_PROFILE* pProfile, uint32_t dwFlags, uint32_t dwUrlTimeoutMs, uint64_t ui64StartUs );
+REV_RETRIEVAL* RevProfileAddRetrieval( REV_CHAIN_PROFILE* pProfile, const char* pszUrl, uint64_t ui64Us, uint32_t dwTimeoutMs,
+									   int fSuccess, uint32_t dwError, int fCacheOnly );
+void RevProfileFinish( REV_CHAIN_PROFILE* pProfile, uint32_t dwTrustErrorStatus, uint64_t ui64EndUs );
+void RevProfileAnalyze( const REV_CHAIN_PROFILE* pProfile, uint32_t dwSlowMs, REV_ANALYSIS* pAnalysis );
+void RevProfileReport( const REV_CHAIN_PROFILE* pProfile, const REV_ANALYSIS* pAnalysis, PFN_REV_LINE pfnLine, void* pvContext );
+
+const char* RevVerdictName( int iVerdict );
+char* RevFlagsFormat( uint32_t dwFlags, char* pszBuffer, size_t cchBuffer );
+char* RevTrustFormat( uint32_t dwErrorStatus, char* pszBuffer, size_t cchBuffer );
@@ -0,0 +1,1826 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// SQLTests.cpp: connection string builder and the measured ODBC tests run from the
+// "Run Selected Test" button.
+//
+
+#include "stdafx.h"
+#include "SQLTests.h"
+#include "DetourFunctions.h"
+#include "TestOptions.h"
+#include "NetlibStats.h"
+#include "TlsStats.h"
+#include "NegoStats.h"
+#include "NegoDecoder.h"
+#include "KerbTickets.h"
+
+#define SQL_TEST_PROTOCOL_COUNT		3
+
+typedef struct _PROTOCOL_RESULT
+{
+	SQL_TARGET   Target;
+	BOOL         fSkipped;
+	char         szSkipReason[128];
+	DWORD        dwFailures;
+	char         szPackage[64];
+	BOOL         fMixedPackages;
+	PERF_SAMPLES Login;
+	PERF_SAMPLES Query;
+	PERF_SUMMARY LoginSummary;
+	PERF_SUMMARY QuerySummary;
+	double       rgdLogin[SQL_TEST_MAX_ITERATIONS];
+	double       rgdQuery[SQL_TEST_MAX_ITERATIONS];
+} PROTOCOL_RESULT;
+
+static PROTOCOL_RESULT g_rgProtocolResults[SQL_TEST_PROTOCOL_COUNT];
+static char* g_rgpszProtocols[SQL_TEST_PROTOCOL_COUNT] = { "tcp", "np", "lpc" };
+static double g_rgdRoundTrips[SQL_TEST_MAX_ITERATIONS];
+static char g_szLastODBCError[1024];
+
+// Select driver.  By default just use SQL Server driver (MDAC version).
+char* SelectODBCDriver( BOOL fUseLatest )
+{
+	char* pszDriver = "SQL Server";
+
+	if ( fUseLatest )
+	{
+		// Check which version of SNAC is available and try to use latest.
+		o_printf( "Attempting to connect using the latest driver.");
+		if ( g_STATUS.fSnac9Available )
+		{
+			pszDriver = "SQL Native Client";
+			o_printf( "Detected SNAC9." );
+		}
+
+		if ( g_STATUS.fSnac10Available )
+		{
+			pszDriver = "SQL Server Native Client 10.0";
+			o_printf( "Detected SNAC10." );
+		}
+
+		if (g_STATUS.fSnac11Available)
+		{
+			pszDriver = "SQL Server Native Client 11.0";
+			o_printf("Detected SNAC11.");
+		}
+
+		if (g_STATUS.fodbc11Available)
+		{
+			pszDriver = "ODBC Driver 11 for SQL Server";
+			o_printf("Detected ODBC Driver 11.");
+		}
+
+		if (g_STATUS.fodbc13Available)
+		{
+			pszDriver = "ODBC Driver 13 for SQL Server";
+			o_printf("Detected ODBC Driver 13.");
+		}
+
+		if (g_STATUS.fodbc17Available)
+		{
+			pszDriver = "ODBC Driver 17 for SQL Server";
+			o_printf("Detected ODBC Driver 17.");
+		}
+
+		if (g_STATUS.fodbc18Available)
+		{
+			pszDriver = "ODBC Driver 18 for SQL Server";
+			o_printf("Detected ODBC Driver 18.");
+		}
+
+		o_printf( "Selected latest detected Driver=%s.", pszDriver );
+	}
+
+	return pszDriver;
+}
+
+// Builds the ODBC connection string for pTarget.  With fMaskPassword the password is replaced
+// by ***** so the result can be written to the log.
+char* BuildConnectString( const SQL_TARGET* pTarget, BOOL fMaskPassword, char* pszConnect, size_t cchConnect )
+{
+	char* pszEncrypt = NULL;
+	char szServerSPN[300] = "";
+
+	if ( !pTarget->fEncrypt )
+	{
+		pszEncrypt = "Encrypt=No";	// explicitly turn it off since the ODBC Driver 18 and later enable encryption by default
+	}
+	else if ( pTarget->fTrustServerCertificate )
+	{
+		pszEncrypt = "Encrypt=Yes;TrustServerCertificate=Yes;";
+	}
+	else
+	{
+		pszEncrypt = "Encrypt=Yes;";
+	}
+
+	if ( pTarget->fIntegrated )
+	{
+		if ( '\0' != pTarget->szServerSPN[0] )
+		{
+			sprintf_s( szServerSPN, sizeof(szServerSPN), "ServerSPN=%s;", pTarget->szServerSPN );
+		}
+
+		// Create connection string using integrated security.
+		sprintf_s( pszConnect, cchConnect,
+				   "Driver=%s;Server=%s%s%s;Trusted_Connection=Yes;%s%s",
+				   pTarget->pszDriver,
+				   pTarget->szProtocol,
+				   ( '\0' != pTarget->szProtocol[0] ) ? ":" : "",
+				   pTarget->szServer,
+				   szServerSPN,
+				   pszEncrypt );
+	}
+	else
+	{
+		// Create connection string using userid and password (standard login).
+		sprintf_s( pszConnect, cchConnect,
+				   "Driver=%s;Server=%s%s%s;UID=%s;PWD=%s;%s",
+				   pTarget->pszDriver,
+				   pTarget->szProtocol,
+				   ( '\0' != pTarget->szProtocol[0] ) ? ":" : "",
+				   pTarget->szServer,
+				   pTarget->szUserId,
+				   ( fMaskPassword ) ? "*****" : pTarget->szPassword,
+				   pszEncrypt );
+	}
+
+	return pszConnect;
+}
+
+// TRUE if pszServer (optionally with \instance or ,port) names this machine, which is the
+// only case where the shared memory (lpc:) protocol can be used.
+BOOL IsLocalServer( const char* pszServer )
+{
+	char szHost[1024];
+	char szComputer[1024];
+	DWORD cchComputer;
+	char* s = NULL;
+	int i;
+	COMPUTER_NAME_FORMAT rgFormats[] = { ComputerNameNetBIOS, ComputerNameDnsHostname, ComputerNameDnsFullyQualified };
+
+	lstrcpyn( szHost, pszServer, sizeof(szHost) );
+	s = strchr( szHost, ',' );
+	if ( NULL != s ) *s = '\0';
+	s = strchr( szHost, '\\' );
+	if ( NULL != s ) *s = '\0';
+
+	if ( 0 == lstrcmpi( szHost, "." ) ||
+		 0 == lstrcmpi( szHost, "(local)" ) ||
+		 0 == lstrcmpi( szHost, "localhost" ) ||
+		 0 == lstrcmpi( szHost, "127.0.0.1" ) ||
+		 0 == lstrcmpi( szHost, "::1" ) )
+	{
+		return TRUE;
+	}
+
+	for ( i=0; i<(int)(sizeof(rgFormats)/sizeof(rgFormats[0])); i++ )
+	{
+		cchComputer = sizeof(szComputer);
+		ZeroMemory( szComputer, sizeof(szComputer) );
+		if ( GetComputerNameEx( rgFormats[i], szComputer, &cchComputer ) &&
+			 0 == lstrcmpi( szHost, szComputer ) )
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+// Writes the diagnostic records of an ODBC handle to the log.  Unlike DUMP_ODBC_ERRORS this
+// does not show a message box, so it can be used inside test loops.  The last message is kept
+// for GetLastODBCError since nothing reaches the log while it is paused.
+void LogODBCErrors( SQLSMALLINT fHandleType, SQLHANDLE hHandle )
+{
+	SQLCHAR szSQLState[6];
+	SQLCHAR szErrorMsg[1024];
+	SQLINTEGER lNativeError;
+	SQLSMALLINT cchErrorMsg;
+	SQLSMALLINT iRecord;
+
+	for ( iRecord=1; ; iRecord++ )
+	{
+		if ( !SQL_SUCCEEDED( SQLGetDiagRec( fHandleType, hHandle, iRecord, szSQLState, &lNativeError, szErrorMsg, (SQLSMALLINT) sizeof(szErrorMsg), &cchErrorMsg ) ) ) break;
+		o_printf( "SQLError[%02d] SQLState '%s' NativeError %ld '%s'", iRecord-1, szSQLState, lNativeError, szErrorMsg );
+		sprintf_s( g_szLastODBCError, sizeof(g_szLastODBCError), "[%s] %s", szSQLState, szErrorMsg );
+	}
+}
+
+const char* GetLastODBCError()
+{
+	return ( '\0' != g_szLastODBCError[0] ) ? g_szLastODBCError : "none";
+}
+
+// Connects to pTarget and returns the connection handle, or NULL after logging the errors.
+// *pdLoginMs is the time spent in SQLDriverConnect.
+HDBC SQLTestConnect( HENV henv, const SQL_TARGET* pTarget, double* pdLoginMs )
+{
+	HDBC hdbc = NULL;
+	RETCODE rc;
+	char szConnect[2048];
+	uint64_t ui64Start;
+
+	*pdLoginMs = 0;
+
+	rc = SQLAllocHandle( SQL_HANDLE_DBC, henv, &hdbc );
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_ENV, henv );
+		return NULL;
+	}
+
+	if ( 0 != pTarget->dwPacketSize )
+	{
+		SQLSetConnectAttr( hdbc, SQL_ATTR_PACKET_SIZE, (SQLPOINTER) (SQLULEN) pTarget->dwPacketSize, SQL_IS_UINTEGER );
+	}
+
+	BuildConnectString( pTarget, FALSE, szConnect, sizeof(szConnect) );
+
+	ui64Start = PerfCounter();
+	rc = SQLDriverConnect( hdbc, NULL, (SQLCHAR*) szConnect, SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT );
+	*pdLoginMs = PerfElapsedMs( ui64Start );
+
+	SecureZeroMemory( szConnect, sizeof(szConnect) );
+
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_DBC, hdbc );
+		SQLFreeHandle( SQL_HANDLE_DBC, hdbc );
+		return NULL;
+	}
+
+	return hdbc;
+}
+
+// Runs pszQuery and fetches every row.  *pdQueryMs covers SQLExecDirect through the last
+// SQLFetch, so it includes reading the whole result from the network.
+BOOL SQLTestQuery( HDBC hdbc, char* pszQuery, double* pdQueryMs, SQLLEN* pcRows )
+{
+	HSTMT hstmt = NULL;
+	RETCODE rc;
+	uint64_t ui64Start;
+	SQLLEN cRows = 0;
+	BOOL fSuccess = FALSE;
+
+	*pdQueryMs = 0;
+
+	rc = SQLAllocHandle( SQL_HANDLE_STMT, hdbc, &hstmt );
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_DBC, hdbc );
+		return FALSE;
+	}
+
+	ui64Start = PerfCounter();
+
+	rc = SQLExecDirect( hstmt, (SQLCHAR*) pszQuery, SQL_NTS );
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_STMT, hstmt );
+		goto SQLTestQueryExit;
+	}
+
+	for ( ; ; )
+	{
+		rc = SQLFetch( hstmt );
+		if ( SQL_NO_DATA == rc ) break;
+		if ( !SQL_SUCCEEDED(rc) )
+		{
+			LogODBCErrors( SQL_HANDLE_STMT, hstmt );
+			goto SQLTestQueryExit;
+		}
+		cRows++;
+	}
+
+	*pdQueryMs = PerfElapsedMs( ui64Start );
+	fSuccess = TRUE;
+
+SQLTestQueryExit:
+
+	if ( NULL != pcRows ) *pcRows = cRows;
+	SQLFreeHandle( SQL_HANDLE_STMT, hstmt );
+	return fSuccess;
+}
+
+// Fetches lRows rows of cbRow bytes generated on the server.  The column is read with SQLGetData
+// so the whole result crosses the network and the driver, not just the row headers.
+BOOL SQLTestBulkFetch( HDBC hdbc, long lRows, long cbRow, SQL_BULK_RESULT* pResult )
+{
+	HSTMT hstmt = NULL;
+	RETCODE rc;
+	uint64_t ui64Start;
+	char szQuery[512];
+	BYTE rgbData[8192];
+	SQLLEN cbIndicator;
+	BOOL fSuccess = FALSE;
+
+	ZeroMemory( pResult, sizeof(*pResult) );
+
+	// sys.all_columns has a few thousand rows on an empty instance, so the cross join covers any
+	// row count we accept.  varchar(max) is only used when the row does not fit in varchar(8000).
+	sprintf_s( szQuery, sizeof(szQuery),
+			   "SELECT TOP (%ld) REPLICATE(CONVERT(varchar(%s), 'x'), %ld) FROM sys.all_columns a CROSS JOIN sys.all_columns b",
+			   lRows,
+			   ( cbRow > 8000 ) ? "max" : "8000",
+			   cbRow );
+
+	rc = SQLAllocHandle( SQL_HANDLE_STMT, hdbc, &hstmt );
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_DBC, hdbc );
+		return FALSE;
+	}
+
+	ui64Start = PerfCounter();
+
+	rc = SQLExecDirect( hstmt, (SQLCHAR*) szQuery, SQL_NTS );
+	if ( !SQL_SUCCEEDED(rc) )
+	{
+		LogODBCErrors( SQL_HANDLE_STMT, hstmt );
+		goto SQLTestBulkFetchExit;
+	}
+
+	for ( ; ; )
+	{
+		rc = SQLFetch( hstmt );
+		if ( SQL_NO_DATA == rc ) break;
+		if ( !SQL_SUCCEEDED(rc) )
+		{
+			LogODBCErrors( SQL_HANDLE_STMT, hstmt );
+			goto SQLTestBulkFetchExit;
+		}
+		if ( 0 == pResult->cRows ) pResult->dFirstRowMs = PerfElapsedMs( ui64Start );
+		pResult->cRows++;
+
+		// SQL_SUCCESS_WITH_INFO (01004) means the value did not fit and there is more to read.
+		for ( ; ; )
+		{
+			rc = SQLGetData( hstmt, 1, SQL_C_BINARY, rgbData, sizeof(rgbData), &cbIndicator );
+			if ( SQL_NO_DATA == rc ) break;
+			if ( !SQL_SUCCEEDED(rc) )
+			{
+				LogODBCErrors( SQL_HANDLE_STMT, hstmt );
+				goto SQLTestBulkFetchExit;
+			}
+			if ( SQL_NULL_DATA == cbIndicator ) break;
+			pResult->cbData += ( SQL_NO_TOTAL == cbIndicator || cbIndicator > (SQLLEN) sizeof(rgbData) ) ? sizeof(rgbData) : cbIndicator;
+			if ( SQL_SUCCESS == rc ) break;
+		}
+	}
+
+	pResult->dTotalMs = PerfElapsedMs( ui64Start );
+	fSuccess = TRUE;
+
+SQLTestBulkFetchExit:
+
+	SQLFreeHandle( SQL_HANDLE_STMT, hstmt );
+	return fSuccess;
+}
+
+void SQLTestDisconnect( HDBC hdbc )
+{
+	if ( NULL == hdbc ) return;
+	SQLDisconnect( hdbc );
+	SQLFreeHandle( SQL_HANDLE_DBC, hdbc );
+}
+
+void LogBulkResult( const char* pszLabel, const SQL_BULK_RESULT* pResult )
+{
+	double dSeconds = pResult->dTotalMs / 1000.0;
+
+	o_printf( "  %-12s %ld rows, %.2f MB in %.3fms, first row after %.3fms, %.0f rows/s, %.2f MB/s",
+			  pszLabel,
+			  (long) pResult->cRows,
+			  pResult->cbData / ( 1024.0 * 1024.0 ),
+			  pResult->dTotalMs,
+			  pResult->dFirstRowMs,
+			  ( dSeconds > 0 ) ? pResult->cRows / dSeconds : 0.0,
+			  ( dSeconds > 0 ) ? pResult->cbData / ( 1024.0 * 1024.0 ) / dSeconds : 0.0 );
+}
+
+// Post-login probe run by the normal SSPI test in place of the single test query.  The test
+// query still goes first, logged as before, since the encryption check looks for it.  Then
+// roundtrips=<n> more test queries, and a bulk fetch of bulkrows=<n> rows of bulkrowsize=<bytes>
+// when asked for, run with the log paused, so network latency can be read next to the login time.
+void RunRoundTripProbe( HDBC hdbc, double dLoginMs )
+{
+	PERF_SAMPLES RoundTrips;
+	PERF_SUMMARY Summary;
+	SQL_BULK_RESULT Bulk;
+	char szSummary[512];
+	double dFirstMs = 0;
+	double dMs = 0;
+	long lRoundTrips;
+	long lBulkRows;
+	long lBulkRowSize;
+	long i;
+	BOOL fRoundTripFailed = FALSE;
+	BOOL fBulk = FALSE;
+
+	lRoundTrips = GetTestOptionLong( "roundtrips", 10 );
+	if ( lRoundTrips < 0 ) lRoundTrips = 0;
+	if ( lRoundTrips > SQL_TEST_MAX_ITERATIONS ) lRoundTrips = SQL_TEST_MAX_ITERATIONS;
+	// The bulk fetch moves bulkrows * bulkrowsize bytes on every connection test, so it is opt-in.
+	lBulkRows = GetTestOptionLong( "bulkrows", 0 );
+	if ( lBulkRows < 0 ) lBulkRows = 0;
+	lBulkRowSize = GetTestOptionLong( "bulkrowsize", 1000 );
+	if ( lBulkRowSize < 1 ) lBulkRowSize = 1;
+	if ( lBulkRowSize > SQL_TEST_MAX_ROW_SIZE ) lBulkRowSize = SQL_TEST_MAX_ROW_SIZE;
+
+	if ( !SQLTestQuery( hdbc, SQL_TEST_QUERY, &dFirstMs, NULL ) )
+	{
+		o_printf( "Test query failed, skipping the round trip probe." );
+		return;
+	}
+
+	PerfSamplesInit( &RoundTrips, g_rgdRoundTrips, SQL_TEST_MAX_ITERATIONS );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+
+	g_fLogPaused = TRUE;
+	for ( i=0; i<lRoundTrips; i++ )
+	{
+		if ( !SQLTestQuery( hdbc, SQL_TEST_QUERY, &dMs, NULL ) )
+		{
+			fRoundTripFailed = TRUE;
+			break;
+		}
+		PerfSamplesAdd( &RoundTrips, dMs );
+	}
+	if ( lBulkRows > 0 ) fBulk = SQLTestBulkFetch( hdbc, lBulkRows, lBulkRowSize, &Bulk );
+	g_fLogPaused = FALSE;
+
+	PerfSamplesSummarize( &RoundTrips, &Summary );
+
+	o_printf( "" );
+	o_printf( "Round trip probe:" );
+	o_printf( "  %-12s %.3fms (SQLDriverConnect)", "login", dLoginMs );
+	o_printf( "  %-12s %.3fms", "first query", dFirstMs );
+	if ( lRoundTrips > 0 )
+	{
+		o_printf( "  %-12s %s", "round trip", PerfSummaryFormat( &Summary, "ms", szSummary, sizeof(szSummary) ) );
+		if ( fRoundTripFailed )
+		{
+			o_printf( "  %-12s failed after %u of %ld, last error %s", "round trip", Summary.cSamples, lRoundTrips, GetLastODBCError() );
+		}
+		if ( Summary.cSamples > 0 && Summary.dP50 > 0 )
+		{
+			o_printf( "  %-12s login took as long as %.1f round trips, the rest is authentication and server work", "", dLoginMs / Summary.dP50 );
+		}
+	}
+	if ( lBulkRows > 0 )
+	{
+		if ( fBulk )
+		{
+			LogBulkResult( "bulk fetch", &Bulk );
+		}
+		else
+		{
+			o_printf( "  %-12s failed, last error %s", "bulk fetch", GetLastODBCError() );
+		}
+	}
+}
+
+const char* GetSQLTestName( int iTest )
+{
+	switch( iTest )
+	{
+		case SQL_TEST_PROTOCOLS:	return "Protocol comparison (tcp, np, lpc)";
+		case SQL_TEST_PACKET_SIZES:	return "Packet size sweep (bulk fetch throughput)";
+		case SQL_TEST_ENCRYPTION:	return "Encryption comparison (Encrypt=No vs Yes)";
+		case SQL_TEST_RESUMPTION:	return "TLS session resumption (full vs resumed)";
+		case SQL_TEST_NEGOTIATE:	return "Negotiate cost (Kerberos vs NTLM fallback)";
+		case SQL_TEST_KDC:			return "KDC response time (uncached vs cached tickets)";
+		default:					return "None";
+	}
+}
+
+// Runs one of the SQL_TEST_* tests against the server the normal SSPI test connected to.
+void RunSQLTest( int iTest, const SQL_TARGET* pTarget )
+{
+	o_printf( "" );
+	o_printf( "******************** %s ********************", GetSQLTestName( iTest ) );
+
+	switch( iTest )
+	{
+		case SQL_TEST_PROTOCOLS:
+			RunProtocolComparison( pTarget );
+			break;
+
+		case SQL_TEST_PACKET_SIZES:
+			RunPacketSizeSweep( pTarget );
+			break;
+
+		case SQL_TEST_ENCRYPTION:
+			RunEncryptionComparison( pTarget );
+			break;
+
+		case SQL_TEST_RESUMPTION:
+			RunResumptionTest( pTarget );
+			break;
+
+		case SQL_TEST_NEGOTIATE:
+			RunNegotiateCostTest( pTarget );
+			break;
+
+		case SQL_TEST_KDC:
+			RunKdcProfileTest( pTarget );
+			break;
+
+		default:
+			o_printf( "Unknown test %d.", iTest );
+			break;
+	}
+
+	o_printf( "" );
+}
+
+// One login plus test query over pResult's protocol.  Timings are only kept when fRecord is set,
+// the first login per protocol is a warm-up that primes name resolution and the ticket cache.
+static BOOL RunProtocolIteration( HENV henv, PROTOCOL_RESULT* pResult, BOOL fRecord )
+{
+	HDBC hdbc = NULL;
+	double dLoginMs = 0;
+	double dQueryMs = 0;
+	char* pszPackage = NULL;
+
+	ZeroMemory( g_STATUS.szNegotiatedPackage, sizeof(g_STATUS.szNegotiatedPackage) );
+
+	hdbc = SQLTestConnect( henv, &pResult->Target, &dLoginMs );
+	if ( NULL == hdbc )
+	{
+		pResult->dwFailures++;
+		return FALSE;
+	}
+
+	if ( !pResult->Target.fIntegrated )
+	{
+		pszPackage = "None (SQL login)";
+	}
+	else if ( '\0' == g_STATUS.szNegotiatedPackage[0] )
+	{
+		pszPackage = "Unknown";
+	}
+	else
+	{
+		pszPackage = g_STATUS.szNegotiatedPackage;
+	}
+
+	if ( '\0' == pResult->szPackage[0] )
+	{
+		lstrcpyn( pResult->szPackage, pszPackage, sizeof(pResult->szPackage) );
+	}
+	else if ( 0 != lstrcmpi( pResult->szPackage, pszPackage ) )
+	{
+		pResult->fMixedPackages = TRUE;
+	}
+
+	if ( !SQLTestQuery( hdbc, SQL_TEST_QUERY, &dQueryMs, NULL ) )
+	{
+		SQLTestDisconnect( hdbc );
+		pResult->dwFailures++;
+		return FALSE;
+	}
+
+	SQLTestDisconnect( hdbc );
+
+	if ( fRecord )
+	{
+		PerfSamplesAdd( &pResult->Login, dLoginMs );
+		PerfSamplesAdd( &pResult->Query, dQueryMs );
+	}
+
+	return TRUE;
+}
+
+static void LogProtocolDelta( const char* pszWhat, const PERF_SUMMARY* pBase, const PERF_SUMMARY* pOther, const char* pszBase, const char* pszOther )
+{
+	double dDelta;
+
+	if ( 0 == pBase->cSamples || 0 == pOther->cSamples ) return;
+
+	dDelta = pOther->dP50 - pBase->dP50;
+	o_printf( "  %-6s p50 %s: vs %s: %+.3fms (%+.1f%%)",
+			  pszWhat,
+			  pszOther,
+			  pszBase,
+			  dDelta,
+			  ( pBase->dP50 > 0 ) ? dDelta * 100.0 / pBase->dP50 : 0.0 );
+}
+
+// Runs the same login and test query over tcp:, np: and lpc: and reports the login and query
+// latency of each protocol side by side.  Protocols are interleaved on every iteration so a
+// change in network or server load during the run affects all of them alike.
+void RunProtocolComparison( const SQL_TARGET* pTarget )
+{
+	HENV henv = NULL;
+	PROTOCOL_RESULT* pResult = NULL;
+	char szHost[1024];
+	char szConnect[2048];
+	char szSummary[512];
+	char* s = NULL;
+	long lIterations;
+	long lIteration;
+	int i;
+
+	lIterations = GetTestOptionLong( "iterations", 10 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_ITERATIONS ) lIterations = SQL_TEST_MAX_ITERATIONS;
+
+	// np: and lpc: do not take a port.  A pipe name typed with np: is reduced to its host so
+	// the tcp: and lpc: logins have something to connect to.
+	if ( 0 == strncmp( pTarget->szServer, "\\\\", 2 ) )
+	{
+		lstrcpyn( szHost, pTarget->szServer+2, sizeof(szHost) );
+		s = strchr( szHost, '\\' );
+		if ( NULL != s ) *s = '\0';
+	}
+	else
+	{
+		lstrcpyn( szHost, pTarget->szServer, sizeof(szHost) );
+		s = strchr( szHost, ',' );
+		if ( NULL != s ) *s = '\0';
+	}
+
+	ZeroMemory( g_rgProtocolResults, sizeof(g_rgProtocolResults) );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+	for ( i=0; i<SQL_TEST_PROTOCOL_COUNT; i++ )
+	{
+		pResult = &g_rgProtocolResults[i];
+		pResult->Target = *pTarget;
+		lstrcpyn( pResult->Target.szProtocol, g_rgpszProtocols[i], sizeof(pResult->Target.szProtocol) );
+		if ( 0 == lstrcmpi( g_rgpszProtocols[i], "tcp" ) && 0 != strncmp( pTarget->szServer, "\\\\", 2 ) )
+		{
+			lstrcpyn( pResult->Target.szServer, pTarget->szServer, sizeof(pResult->Target.szServer) );
+		}
+		else
+		{
+			lstrcpyn( pResult->Target.szServer, szHost, sizeof(pResult->Target.szServer) );
+		}
+		PerfSamplesInit( &pResult->Login, pResult->rgdLogin, SQL_TEST_MAX_ITERATIONS );
+		PerfSamplesInit( &pResult->Query, pResult->rgdQuery, SQL_TEST_MAX_ITERATIONS );
+	}
+
+	if ( !IsLocalServer( szHost ) )
+	{
+		g_rgProtocolResults[2].fSkipped = TRUE;
+		lstrcpy( g_rgProtocolResults[2].szSkipReason, "server is not on this machine" );
+	}
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv ) ) )
+	{
+		o_printf( "*** ERROR: SQLAllocHandle(SQL_HANDLE_ENV) failed, cannot run the protocol comparison." );
+		return;
+	}
+	SQLSetEnvAttr( henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, 0 );
+
+	o_printf( "Running %ld logins per protocol, each followed by [%s].", lIterations, SQL_TEST_QUERY );
+	o_printf( "Login is the time spent in SQLDriverConnect, query is SQLExecDirect through the last SQLFetch." );
+
+	// Warm-up login per protocol, with full logging so each protocol's SSPI exchange is in the log.
+	for ( i=0; i<SQL_TEST_PROTOCOL_COUNT; i++ )
+	{
+		pResult = &g_rgProtocolResults[i];
+		if ( pResult->fSkipped ) continue;
+
+		o_printf( "" );
+		o_printf( "Warm-up login over %s: [%s]", pResult->Target.szProtocol, BuildConnectString( &pResult->Target, TRUE, szConnect, sizeof(szConnect) ) );
+		if ( !RunProtocolIteration( henv, pResult, FALSE ) )
+		{
+			pResult->fSkipped = TRUE;
+			lstrcpy( pResult->szSkipReason, "warm-up login failed, see the errors above" );
+		}
+	}
+
+	// Measured logins.  The log is paused so file writes from the detours stay out of the timings.
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		for ( i=0; i<SQL_TEST_PROTOCOL_COUNT; i++ )
+		{
+			if ( g_rgProtocolResults[i].fSkipped ) continue;
+			RunProtocolIteration( henv, &g_rgProtocolResults[i], TRUE );
+		}
+	}
+	g_fLogPaused = FALSE;
+
+	SQLFreeHandle( SQL_HANDLE_ENV, henv );
+
+	o_printf( "" );
+	o_printf( "Protocol comparison results:" );
+	for ( i=0; i<SQL_TEST_PROTOCOL_COUNT; i++ )
+	{
+		pResult = &g_rgProtocolResults[i];
+		if ( pResult->fSkipped )
+		{
+			o_printf( "  %-4s skipped, %s.", pResult->Target.szProtocol, pResult->szSkipReason );
+			continue;
+		}
+
+		PerfSamplesSummarize( &pResult->Login, &pResult->LoginSummary );
+		PerfSamplesSummarize( &pResult->Query, &pResult->QuerySummary );
+
+		o_printf( "  %-4s server  [%s]", pResult->Target.szProtocol, pResult->Target.szServer );
+		o_printf( "       package %s%s", pResult->szPackage, ( pResult->fMixedPackages ) ? " (changed between logins)" : "" );
+		o_printf( "       login   %s", PerfSummaryFormat( &pResult->LoginSummary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "       query   %s", PerfSummaryFormat( &pResult->QuerySummary, "ms", szSummary, sizeof(szSummary) ) );
+		if ( pResult->dwFailures > 0 )
+		{
+			o_printf( "       failed  %lu of %ld measured logins, last error %s", pResult->dwFailures, lIterations, GetLastODBCError() );
+		}
+	}
+
+	// Everything relative to tcp:, the protocol the normal test uses.
+	if ( !g_rgProtocolResults[0].fSkipped )
+	{
+		o_printf( "" );
+		for ( i=1; i<SQL_TEST_PROTOCOL_COUNT; i++ )
+		{
+			if ( g_rgProtocolResults[i].fSkipped ) continue;
+			LogProtocolDelta( "login", &g_rgProtocolResults[0].LoginSummary, &g_rgProtocolResults[i].LoginSummary, g_rgpszProtocols[0], g_rgpszProtocols[i] );
+			LogProtocolDelta( "query", &g_rgProtocolResults[0].QuerySummary, &g_rgProtocolResults[i].QuerySummary, g_rgpszProtocols[0], g_rgpszProtocols[i] );
+		}
+	}
+
+	// Results hold copies of the target, including the password.
+	SecureZeroMemory( g_rgProtocolResults, sizeof(g_rgProtocolResults) );
+}
+
+typedef struct _PACKET_SIZE_RESULT
+{
+	SQL_TARGET   Target;
+	SQLUINTEGER  dwNegotiated;			// SQL_ATTR_PACKET_SIZE read back after the login
+	BOOL         fFailed;
+	DWORD        dwFetches;
+	uint64_t     ui64Bytes;
+	double       dCpuMs;				// Process user+kernel time during the fetches
+	DWORD        dwTurnarounds;			// dbnetlib reads that followed a write
+	DWORD        dwReads;
+	PERF_SAMPLES Throughput;			// MB/s per fetch
+	double       rgdThroughput[SQL_TEST_MAX_SWEEP];
+} PACKET_SIZE_RESULT;
+
+static PACKET_SIZE_RESULT g_rgPacketSizeResults[2][SQL_TEST_MAX_PACKET_SIZES];
+
+// User plus kernel time of this process in milliseconds.
+static double ProcessCpuMs()
+{
+	FILETIME ftCreate, ftExit, ftKernel, ftUser;
+	ULARGE_INTEGER uKernel, uUser;
+
+	if ( !GetProcessTimes( GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser ) ) return 0;
+	uKernel.LowPart  = ftKernel.dwLowDateTime;
+	uKernel.HighPart = ftKernel.dwHighDateTime;
+	uUser.LowPart    = ftUser.dwLowDateTime;
+	uUser.HighPart   = ftUser.dwHighDateTime;
+	return ( uKernel.QuadPart + uUser.QuadPart ) / 10000.0;
+}
+
+// Parses a comma separated list of packet sizes, returns the number of sizes stored.
+static int ParsePacketSizes( const char* pszList, SQLUINTEGER* rgdwSizes, int cMaxSizes )
+{
+	const char* s = pszList;
+	char* pszEnd = NULL;
+	unsigned long ulSize;
+	int cSizes = 0;
+
+	while ( '\0' != *s && cSizes < cMaxSizes )
+	{
+		ulSize = strtoul( s, &pszEnd, 10 );
+		if ( pszEnd == s ) break;
+		// TDS accepts 512 to 32767 bytes.
+		if ( ulSize >= 512 && ulSize <= 32767 ) rgdwSizes[cSizes++] = (SQLUINTEGER) ulSize;
+		s = pszEnd;
+		while ( ',' == *s || ' ' == *s ) s++;
+	}
+
+	return cSizes;
+}
+
+// One login plus one bulk fetch at pResult's packet size.  The fetch is recorded when fRecord
+// is set, the login itself is not part of the numbers.
+static BOOL RunPacketSizeIteration( HENV henv, PACKET_SIZE_RESULT* pResult, long lRows, long cbRow, BOOL fRecord )
+{
+	HDBC hdbc = NULL;
+	SQL_BULK_RESULT Bulk;
+	NETLIB_TOTALS Before, After;
+	double dLoginMs = 0;
+	double dCpuMs;
+	BOOL fSuccess = FALSE;
+
+	hdbc = SQLTestConnect( henv, &pResult->Target, &dLoginMs );
+	if ( NULL == hdbc ) return FALSE;
+
+	SQLGetConnectAttr( hdbc, SQL_ATTR_PACKET_SIZE, &pResult->dwNegotiated, SQL_IS_UINTEGER, NULL );
+
+	NetlibStatsGetTotals( &Before );
+	dCpuMs = ProcessCpuMs();
+	fSuccess = SQLTestBulkFetch( hdbc, lRows, cbRow, &Bulk );
+	dCpuMs = ProcessCpuMs() - dCpuMs;
+	NetlibStatsGetTotals( &After );
+
+	SQLTestDisconnect( hdbc );
+
+	if ( fSuccess && fRecord )
+	{
+		pResult->dwFetches++;
+		pResult->ui64Bytes     += Bulk.cbData;
+		pResult->dCpuMs        += dCpuMs;
+		pResult->dwTurnarounds += After.dwTurnarounds - Before.dwTurnarounds;
+		pResult->dwReads       += After.dwReads - Before.dwReads;
+		if ( Bulk.dTotalMs > 0 )
+		{
+			PerfSamplesAdd( &pResult->Throughput, Bulk.cbData / ( 1024.0 * 1024.0 ) / ( Bulk.dTotalMs / 1000.0 ) );
+		}
+	}
+
+	return fSuccess;
+}
+
+// Repeats the same bulk fetch at each packet size in packetsizes=<list>, unencrypted and
+// encrypted, and reports throughput, network round trips and client CPU per size.  Sizes and
+// encryption settings are interleaved on every iteration, like the protocol comparison.
+void RunPacketSizeSweep( const SQL_TARGET* pTarget )
+{
+	HENV henv = NULL;
+	PACKET_SIZE_RESULT* pResult = NULL;
+	PERF_SUMMARY Summary;
+	SQLUINTEGER rgdwSizes[SQL_TEST_MAX_PACKET_SIZES];
+	char szSizes[256];
+	char szConnect[2048];
+	char szRoundTrips[64];
+	int cSizes;
+	int iEncrypt, iFirstEncrypt, iLastEncrypt;
+	int i;
+	long lIterations, lIteration;
+	long lRows, cbRow;
+	double dMB;
+
+	GetTestOptionString( "packetsizes", "512,1024,2048,4096,8192,16383,32767", szSizes, sizeof(szSizes) );
+	cSizes = ParsePacketSizes( szSizes, rgdwSizes, SQL_TEST_MAX_PACKET_SIZES );
+	if ( 0 == cSizes )
+	{
+		o_printf( "No valid packet size in [%s], sizes must be 512 to 32767.", szSizes );
+		return;
+	}
+
+	lIterations = GetTestOptionLong( "iterations", 3 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_SWEEP ) lIterations = SQL_TEST_MAX_SWEEP;
+	lRows = GetTestOptionLong( "bulkrows", 10000 );
+	if ( lRows < 1 ) lRows = 1;
+	cbRow = GetTestOptionLong( "bulkrowsize", 1000 );
+	if ( cbRow < 1 ) cbRow = 1;
+	if ( cbRow > SQL_TEST_MAX_ROW_SIZE ) cbRow = SQL_TEST_MAX_ROW_SIZE;
+
+	// encrypt=0 or encrypt=1 limits the sweep to one setting, by default both are run.
+	iFirstEncrypt = 0;
+	iLastEncrypt  = 1;
+	if ( HasTestOption( "encrypt" ) )
+	{
+		iFirstEncrypt = iLastEncrypt = ( GetTestOptionBool( "encrypt", FALSE ) ) ? 1 : 0;
+	}
+
+	ZeroMemory( g_rgPacketSizeResults, sizeof(g_rgPacketSizeResults) );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+	for ( iEncrypt=iFirstEncrypt; iEncrypt<=iLastEncrypt; iEncrypt++ )
+	{
+		for ( i=0; i<cSizes; i++ )
+		{
+			pResult = &g_rgPacketSizeResults[iEncrypt][i];
+			pResult->Target = *pTarget;
+			pResult->Target.fEncrypt = iEncrypt;
+			pResult->Target.fTrustServerCertificate = GetTestOptionBool( "trustservercert", FALSE );
+			pResult->Target.dwPacketSize = rgdwSizes[i];
+			PerfSamplesInit( &pResult->Throughput, pResult->rgdThroughput, SQL_TEST_MAX_SWEEP );
+		}
+	}
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv ) ) )
+	{
+		o_printf( "*** ERROR: SQLAllocHandle(SQL_HANDLE_ENV) failed, cannot run the packet size sweep." );
+		return;
+	}
+	SQLSetEnvAttr( henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, 0 );
+
+	o_printf( "Fetching %ld rows of %ld bytes %ld times per packet size, sizes [%s].", lRows, cbRow, lIterations, szSizes );
+
+	// Warm-up with full logging, once per encryption setting, so login or certificate errors
+	// show up in the log and the bulk query plan is cached before anything is measured.
+	for ( iEncrypt=iFirstEncrypt; iEncrypt<=iLastEncrypt; iEncrypt++ )
+	{
+		pResult = &g_rgPacketSizeResults[iEncrypt][0];
+		o_printf( "" );
+		o_printf( "Warm-up fetch: [%s]", BuildConnectString( &pResult->Target, TRUE, szConnect, sizeof(szConnect) ) );
+		if ( !RunPacketSizeIteration( henv, pResult, lRows, cbRow, FALSE ) )
+		{
+			o_printf( "Warm-up failed, skipping the %s runs.", ( iEncrypt ) ? "encrypted" : "unencrypted" );
+			for ( i=0; i<cSizes; i++ ) g_rgPacketSizeResults[iEncrypt][i].fFailed = TRUE;
+		}
+	}
+
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		for ( iEncrypt=iFirstEncrypt; iEncrypt<=iLastEncrypt; iEncrypt++ )
+		{
+			for ( i=0; i<cSizes; i++ )
+			{
+				pResult = &g_rgPacketSizeResults[iEncrypt][i];
+				if ( pResult->fFailed ) continue;
+				RunPacketSizeIteration( henv, pResult, lRows, cbRow, TRUE );
+			}
+		}
+	}
+	g_fLogPaused = FALSE;
+
+	SQLFreeHandle( SQL_HANDLE_ENV, henv );
+
+	o_printf( "" );
+	o_printf( "Packet size sweep results (MB/s per fetch, round trips and client CPU per fetch):" );
+	o_printf( "  encrypt  packet negotiated  MB/s p50  MB/s min  MB/s max  round trips  reads  CPU ms  CPU ms/MB" );
+	for ( iEncrypt=iFirstEncrypt; iEncrypt<=iLastEncrypt; iEncrypt++ )
+	{
+		for ( i=0; i<cSizes; i++ )
+		{
+			pResult = &g_rgPacketSizeResults[iEncrypt][i];
+			if ( pResult->fFailed || 0 == pResult->dwFetches )
+			{
+				o_printf( "  %-7s %7lu  failed, last error %s", ( iEncrypt ) ? "yes" : "no", rgdwSizes[i], GetLastODBCError() );
+				continue;
+			}
+
+			PerfSamplesSummarize( &pResult->Throughput, &Summary );
+			dMB = pResult->ui64Bytes / ( 1024.0 * 1024.0 );
+
+			// Round trips come from the dbnetlib detours, other drivers do not go through dbnetlib.
+			if ( 0 == pResult->dwReads )
+			{
+				lstrcpy( szRoundTrips, "n/a" );
+			}
+			else
+			{
+				sprintf_s( szRoundTrips, sizeof(szRoundTrips), "%.1f", (double) pResult->dwTurnarounds / pResult->dwFetches );
+			}
+
+			o_printf( "  %-7s %7lu %10lu %9.2f %9.2f %9.2f %12s %6.0f %7.1f %10.2f",
+					  ( iEncrypt ) ? "yes" : "no",
+					  rgdwSizes[i],
+					  pResult->dwNegotiated,
+					  Summary.dP50,
+					  Summary.dMin,
+					  Summary.dMax,
+					  szRoundTrips,
+					  (double) pResult->dwReads / pResult->dwFetches,
+					  pResult->dCpuMs / pResult->dwFetches,
+					  ( dMB > 0 ) ? pResult->dCpuMs / dMB : 0.0 );
+		}
+	}
+	o_printf( "Round trips and reads are only counted for the \"SQL Server\" driver, which uses dbnetlib.dll." );
+
+	SecureZeroMemory( g_rgPacketSizeResults, sizeof(g_rgPacketSizeResults) );
+}
+
+typedef struct _ENCRYPTION_RESULT
+{
+	SQL_TARGET   Target;
+	BOOL         fFailed;
+	DWORD        dwRuns;
+	DWORD        dwFailures;
+	char         szLastError[1024];		// Last ODBC error of this setting, "none" if there was none
+	uint64_t     ui64Bytes;				// Bulk fetch bytes
+	double       dCpuMs;				// Process CPU during the bulk fetches
+	TLS_TOTALS   Tls;					// Records after the login, i.e. from the workload
+	PERF_SAMPLES Login;
+	PERF_SAMPLES RoundTrip;
+	PERF_SAMPLES Throughput;			// MB/s per bulk fetch
+	PERF_SUMMARY LoginSummary;
+	PERF_SUMMARY RoundTripSummary;
+	PERF_SUMMARY ThroughputSummary;
+	double       rgdLogin[SQL_TEST_MAX_SWEEP];
+	double       rgdRoundTrip[SQL_TEST_MAX_ITERATIONS];
+	double       rgdThroughput[SQL_TEST_MAX_SWEEP];
+} ENCRYPTION_RESULT;
+
+static ENCRYPTION_RESULT g_rgEncryptionResults[2];
+
+static BOOL EncryptionIterationFailed( ENCRYPTION_RESULT* pResult )
+{
+	pResult->dwFailures++;
+	lstrcpyn( pResult->szLastError, GetLastODBCError(), sizeof(pResult->szLastError) );
+	return FALSE;
+}
+
+// One login, lRoundTrips test queries and one bulk fetch with pResult's Encrypt setting.
+static BOOL RunEncryptionIteration( HENV henv, ENCRYPTION_RESULT* pResult, long lRoundTrips, long lRows, long cbRow, BOOL fRecord )
+{
+	HDBC hdbc = NULL;
+	SQL_BULK_RESULT Bulk;
+	TLS_TOTALS Before, After, Delta;
+	double dLoginMs = 0;
+	double dMs = 0;
+	double dCpuMs;
+	long i;
+
+	// The last error is kept per setting, so each attempt starts without one.
+	g_szLastODBCError[0] = '\0';
+	hdbc = SQLTestConnect( henv, &pResult->Target, &dLoginMs );
+	if ( NULL == hdbc ) return EncryptionIterationFailed( pResult );
+	if ( fRecord ) PerfSamplesAdd( &pResult->Login, dLoginMs );
+
+	TlsStatsGetTotals( &Before );
+
+	for ( i=0; i<lRoundTrips; i++ )
+	{
+		if ( !SQLTestQuery( hdbc, SQL_TEST_QUERY, &dMs, NULL ) )
+		{
+			SQLTestDisconnect( hdbc );
+			return EncryptionIterationFailed( pResult );
+		}
+		if ( fRecord ) PerfSamplesAdd( &pResult->RoundTrip, dMs );
+	}
+
+	dCpuMs = ProcessCpuMs();
+	if ( !SQLTestBulkFetch( hdbc, lRows, cbRow, &Bulk ) )
+	{
+		SQLTestDisconnect( hdbc );
+		return EncryptionIterationFailed( pResult );
+	}
+	dCpuMs = ProcessCpuMs() - dCpuMs;
+
+	TlsStatsGetTotals( &After );
+	SQLTestDisconnect( hdbc );
+
+	if ( fRecord )
+	{
+		TlsTotalsDelta( &Before, &After, &Delta );
+		pResult->Tls.dwEncryptRecords         += Delta.dwEncryptRecords;
+		pResult->Tls.dwDecryptRecords         += Delta.dwDecryptRecords;
+		pResult->Tls.dwFailures               += Delta.dwFailures;
+		pResult->Tls.ui64EncryptDataBytes     += Delta.ui64EncryptDataBytes;
+		pResult->Tls.ui64EncryptOverheadBytes += Delta.ui64EncryptOverheadBytes;
+		pResult->Tls.ui64DecryptDataBytes     += Delta.ui64DecryptDataBytes;
+		pResult->Tls.ui64DecryptOverheadBytes += Delta.ui64DecryptOverheadBytes;
+		pResult->Tls.ui64EncryptUs            += Delta.ui64EncryptUs;
+		pResult->Tls.ui64DecryptUs            += Delta.ui64DecryptUs;
+
+		pResult->dwRuns++;
+		pResult->ui64Bytes += Bulk.cbData;
+		pResult->dCpuMs    += dCpuMs;
+		if ( Bulk.dTotalMs > 0 )
+		{
+			PerfSamplesAdd( &pResult->Throughput, Bulk.cbData / ( 1024.0 * 1024.0 ) / ( Bulk.dTotalMs / 1000.0 ) );
+		}
+	}
+
+	return TRUE;
+}
+
+static void LogEncryptionDelta( const char* pszWhat, double dPlain, double dEncrypted, const char* pszUnit )
+{
+	o_printf( "  %-22s %+.3f%s (%+.1f%%)",
+			  pszWhat,
+			  dEncrypted - dPlain,
+			  pszUnit,
+			  ( dPlain > 0 ) ? ( dEncrypted - dPlain ) * 100.0 / dPlain : 0.0 );
+}
+
+static void LogTlsRecords( const char* pszDirection, DWORD dwRecords, uint64_t ui64Data, uint64_t ui64Overhead, uint64_t ui64Us )
+{
+	if ( 0 == dwRecords )
+	{
+		o_printf( "  %-25s none", pszDirection );
+		return;
+	}
+
+	o_printf( "  %-25s %lu records, %.0f payload bytes and %.1f overhead bytes per record (%.2f%%), %.2fus per record",
+			  pszDirection,
+			  dwRecords,
+			  (double) ui64Data / dwRecords,
+			  (double) ui64Overhead / dwRecords,
+			  ( ui64Data > 0 ) ? ui64Overhead * 100.0 / ui64Data : 0.0,
+			  (double) ui64Us / dwRecords );
+}
+
+// Runs the same login, round trips and bulk fetch with Encrypt=No and Encrypt=Yes and reports
+// what encryption costs: extra login (TLS handshake) time, round trip and throughput deltas,
+// and from the EncryptMessage/DecryptMessage detours the record count, size, overhead and time.
+void RunEncryptionComparison( const SQL_TARGET* pTarget )
+{
+	HENV henv = NULL;
+	ENCRYPTION_RESULT* pResult = NULL;
+	ENCRYPTION_RESULT* pPlain = &g_rgEncryptionResults[0];
+	ENCRYPTION_RESULT* pEncrypted = &g_rgEncryptionResults[1];
+	char szConnect[2048];
+	char szSummary[512];
+	long lIterations, lIteration;
+	long lRoundTrips, lRows, cbRow;
+	int i;
+
+	lIterations = GetTestOptionLong( "iterations", 5 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_SWEEP ) lIterations = SQL_TEST_MAX_SWEEP;
+	lRoundTrips = GetTestOptionLong( "roundtrips", 10 );
+	if ( lRoundTrips < 0 ) lRoundTrips = 0;
+	if ( lRoundTrips > SQL_TEST_MAX_ITERATIONS ) lRoundTrips = SQL_TEST_MAX_ITERATIONS;
+	lRows = GetTestOptionLong( "bulkrows", 10000 );
+	if ( lRows < 1 ) lRows = 1;
+	cbRow = GetTestOptionLong( "bulkrowsize", 1000 );
+	if ( cbRow < 1 ) cbRow = 1;
+	if ( cbRow > SQL_TEST_MAX_ROW_SIZE ) cbRow = SQL_TEST_MAX_ROW_SIZE;
+
+	ZeroMemory( g_rgEncryptionResults, sizeof(g_rgEncryptionResults) );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+	for ( i=0; i<2; i++ )
+	{
+		pResult = &g_rgEncryptionResults[i];
+		pResult->Target = *pTarget;
+		pResult->Target.fEncrypt = ( 1 == i );
+		pResult->Target.fTrustServerCertificate = GetTestOptionBool( "trustservercert", FALSE );
+		PerfSamplesInit( &pResult->Login, pResult->rgdLogin, SQL_TEST_MAX_SWEEP );
+		PerfSamplesInit( &pResult->RoundTrip, pResult->rgdRoundTrip, SQL_TEST_MAX_ITERATIONS );
+		PerfSamplesInit( &pResult->Throughput, pResult->rgdThroughput, SQL_TEST_MAX_SWEEP );
+	}
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv ) ) )
+	{
+		o_printf( "*** ERROR: SQLAllocHandle(SQL_HANDLE_ENV) failed, cannot run the encryption comparison." );
+		return;
+	}
+	SQLSetEnvAttr( henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, 0 );
+
+	o_printf( "Running %ld logins per setting, each followed by %ld round trips and a fetch of %ld rows of %ld bytes.",
+			  lIterations, lRoundTrips, lRows, cbRow );
+
+	// Warm-up with full logging so certificate errors on the encrypted side are in the log.  The
+	// encrypted side goes first: when it cannot log in there is nothing to compare.
+	for ( i=1; i>=0; i-- )
+	{
+		pResult = &g_rgEncryptionResults[i];
+		o_printf( "" );
+		o_printf( "Warm-up: [%s]", BuildConnectString( &pResult->Target, TRUE, szConnect, sizeof(szConnect) ) );
+		if ( !RunEncryptionIteration( henv, pResult, lRoundTrips, lRows, cbRow, FALSE ) )
+		{
+			if ( pResult == pEncrypted )
+			{
+				o_printf( "Encrypt=Yes warm-up failed, last error %s, skipping the encryption comparison.", pResult->szLastError );
+				SQLFreeHandle( SQL_HANDLE_ENV, henv );
+				goto RunEncryptionComparisonExit;
+			}
+			o_printf( "Warm-up failed, skipping the Encrypt=%s runs.", ( pResult->Target.fEncrypt ) ? "Yes" : "No" );
+			pResult->fFailed = TRUE;
+		}
+		pResult->dwFailures = 0;
+	}
+
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		for ( i=0; i<2; i++ )
+		{
+			if ( g_rgEncryptionResults[i].fFailed ) continue;
+			RunEncryptionIteration( henv, &g_rgEncryptionResults[i], lRoundTrips, lRows, cbRow, TRUE );
+		}
+	}
+	g_fLogPaused = FALSE;
+
+	SQLFreeHandle( SQL_HANDLE_ENV, henv );
+
+	o_printf( "" );
+	o_printf( "Encryption comparison results:" );
+	for ( i=0; i<2; i++ )
+	{
+		pResult = &g_rgEncryptionResults[i];
+		if ( pResult->fFailed || 0 == pResult->dwRuns )
+		{
+			o_printf( "  Encrypt=%-3s failed, last error %s", ( pResult->Target.fEncrypt ) ? "Yes" : "No", pResult->szLastError );
+			continue;
+		}
+
+		PerfSamplesSummarize( &pResult->Login, &pResult->LoginSummary );
+		PerfSamplesSummarize( &pResult->RoundTrip, &pResult->RoundTripSummary );
+		PerfSamplesSummarize( &pResult->Throughput, &pResult->ThroughputSummary );
+
+		o_printf( "  Encrypt=%s", ( pResult->Target.fEncrypt ) ? "Yes" : "No" );
+		o_printf( "    login      %s", PerfSummaryFormat( &pResult->LoginSummary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "    round trip %s", PerfSummaryFormat( &pResult->RoundTripSummary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "    bulk MB/s  %s", PerfSummaryFormat( &pResult->ThroughputSummary, "", szSummary, sizeof(szSummary) ) );
+		o_printf( "    client CPU %.2f ms per MB fetched", ( pResult->ui64Bytes > 0 ) ? pResult->dCpuMs / ( pResult->ui64Bytes / ( 1024.0 * 1024.0 ) ) : 0.0 );
+		if ( pResult->dwFailures > 0 )
+		{
+			o_printf( "    failed     %lu of %ld runs, last error %s", pResult->dwFailures, lIterations, pResult->szLastError );
+		}
+	}
+
+	if ( pPlain->fFailed || pEncrypted->fFailed || 0 == pPlain->dwRuns || 0 == pEncrypted->dwRuns ) goto RunEncryptionComparisonExit;
+
+	o_printf( "" );
+	o_printf( "Cost of Encrypt=Yes (p50 against Encrypt=No):" );
+	LogEncryptionDelta( "login (TLS handshake)", pPlain->LoginSummary.dP50, pEncrypted->LoginSummary.dP50, "ms" );
+	LogEncryptionDelta( "round trip", pPlain->RoundTripSummary.dP50, pEncrypted->RoundTripSummary.dP50, "ms" );
+	LogEncryptionDelta( "bulk throughput", pPlain->ThroughputSummary.dP50, pEncrypted->ThroughputSummary.dP50, "MB/s" );
+	LogEncryptionDelta( "client CPU per MB",
+						( pPlain->ui64Bytes > 0 ) ? pPlain->dCpuMs / ( pPlain->ui64Bytes / ( 1024.0 * 1024.0 ) ) : 0.0,
+						( pEncrypted->ui64Bytes > 0 ) ? pEncrypted->dCpuMs / ( pEncrypted->ui64Bytes / ( 1024.0 * 1024.0 ) ) : 0.0,
+						"ms" );
+
+	// Records counted after the login, so Encrypt=No should show none: it only encrypts the login packet.
+	o_printf( "" );
+	o_printf( "TLS records after login, Encrypt=Yes runs (EncryptMessage/DecryptMessage detours):" );
+	LogTlsRecords( "sent (EncryptMessage)", pEncrypted->Tls.dwEncryptRecords, pEncrypted->Tls.ui64EncryptDataBytes, pEncrypted->Tls.ui64EncryptOverheadBytes, pEncrypted->Tls.ui64EncryptUs );
+	LogTlsRecords( "received (DecryptMessage)", pEncrypted->Tls.dwDecryptRecords, pEncrypted->Tls.ui64DecryptDataBytes, pEncrypted->Tls.ui64DecryptOverheadBytes, pEncrypted->Tls.ui64DecryptUs );
+	if ( pEncrypted->Tls.dwFailures > 0 ) o_printf( "  %-25s %lu", "failed calls", pEncrypted->Tls.dwFailures );
+	if ( pPlain->Tls.dwEncryptRecords + pPlain->Tls.dwDecryptRecords > 0 )
+	{
+		o_printf( "  Encrypt=No runs also had %lu TLS records after login, the server may force encryption.",
+				  pPlain->Tls.dwEncryptRecords + pPlain->Tls.dwDecryptRecords );
+	}
+
+RunEncryptionComparisonExit:
+
+	SecureZeroMemory( g_rgEncryptionResults, sizeof(g_rgEncryptionResults) );
+}
+
+typedef struct _RESUMPTION_RESULT
+{
+	DWORD        dwLogins;
+	PERF_SAMPLES Login;
+	PERF_SAMPLES Handshake;
+	PERF_SUMMARY LoginSummary;
+	PERF_SUMMARY HandshakeSummary;
+	double       rgdLogin[SQL_TEST_MAX_SWEEP];
+	double       rgdHandshake[SQL_TEST_MAX_SWEEP];
+} RESUMPTION_RESULT;
+
+static RESUMPTION_RESULT g_rgResumptionResults[3];	// Indexed by TLS_HANDSHAKE_*
+
+// One Encrypt=Yes login.  Returns the kind of TLS handshake it did, or -1 if the login failed
+// or no Schannel handshake was seen.
+static int RunResumptionIteration( HENV henv, const SQL_TARGET* pTarget, BOOL fRecord )
+{
+	HDBC hdbc = NULL;
+	TLS_HANDSHAKE Before, After;
+	RESUMPTION_RESULT* pResult;
+	double dLoginMs = 0;
+	int iKind;
+
+	if ( !TlsGetLastHandshake( &Before ) ) Before.dwNumber = 0;
+
+	hdbc = SQLTestConnect( henv, pTarget, &dLoginMs );
+	if ( NULL == hdbc ) return -1;
+	SQLTestDisconnect( hdbc );
+
+	if ( !TlsGetLastHandshake( &After ) || After.dwNumber == Before.dwNumber ) return -1;
+
+	iKind = GetTlsHandshakeKind( &After );
+	if ( fRecord )
+	{
+		pResult = &g_rgResumptionResults[iKind];
+		pResult->dwLogins++;
+		PerfSamplesAdd( &pResult->Login, dLoginMs );
+		PerfSamplesAdd( &pResult->Handshake, TlsHandshakeMs( &After ) );
+	}
+	return iKind;
+}
+
+// Logs in with Encrypt=Yes over and over and sorts the logins by the TLS handshake they did,
+// full or resumed from Schannel's session cache, to show the resumption hit rate and what a
+// full handshake costs compared to a resumed one.
+void RunResumptionTest( const SQL_TARGET* pTarget )
+{
+	HENV henv = NULL;
+	SQL_TARGET Target;
+	RESUMPTION_RESULT* pResult = NULL;
+	RESUMPTION_RESULT* pFull = &g_rgResumptionResults[TLS_HANDSHAKE_FULL];
+	RESUMPTION_RESULT* pResumed = &g_rgResumptionResults[TLS_HANDSHAKE_RESUMED];
+	char szConnect[2048];
+	char szSummary[512];
+	long lIterations, lIteration;
+	DWORD dwFailures = 0;
+	DWORD dwClassified;
+	int iKind;
+	int i;
+
+	lIterations = GetTestOptionLong( "iterations", 20 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_SWEEP ) lIterations = SQL_TEST_MAX_SWEEP;
+
+	Target = *pTarget;
+	Target.fEncrypt = TRUE;
+	Target.fTrustServerCertificate = GetTestOptionBool( "trustservercert", FALSE );
+
+	ZeroMemory( g_rgResumptionResults, sizeof(g_rgResumptionResults) );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+	for ( i=0; i<3; i++ )
+	{
+		pResult = &g_rgResumptionResults[i];
+		PerfSamplesInit( &pResult->Login, pResult->rgdLogin, SQL_TEST_MAX_SWEEP );
+		PerfSamplesInit( &pResult->Handshake, pResult->rgdHandshake, SQL_TEST_MAX_SWEEP );
+	}
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv ) ) )
+	{
+		o_printf( "*** ERROR: SQLAllocHandle(SQL_HANDLE_ENV) failed, cannot run the session resumption test." );
+		goto RunResumptionTestExit;
+	}
+	SQLSetEnvAttr( henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, 0 );
+
+	// The warm-up is expected to be a full handshake, it fills Schannel's session cache.
+	o_printf( "Warm-up: [%s]", BuildConnectString( &Target, TRUE, szConnect, sizeof(szConnect) ) );
+	iKind = RunResumptionIteration( henv, &Target, FALSE );
+	if ( iKind < 0 )
+	{
+		if ( '\0' != g_szLastODBCError[0] )
+		{
+			o_printf( "Warm-up login failed, last error %s", GetLastODBCError() );
+		}
+		else
+		{
+			o_printf( "Warm-up login did not go through a Schannel handshake, is the driver using Schannel from this process?" );
+		}
+		SQLFreeHandle( SQL_HANDLE_ENV, henv );
+		goto RunResumptionTestExit;
+	}
+	DumpTlsHandshake();
+	o_printf( "Warm-up handshake was %s.", GetTlsHandshakeKindName( iKind ) );
+
+	o_printf( "" );
+	o_printf( "Running %ld Encrypt=Yes logins.", lIterations );
+
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		if ( RunResumptionIteration( henv, &Target, TRUE ) < 0 ) dwFailures++;
+	}
+	g_fLogPaused = FALSE;
+
+	SQLFreeHandle( SQL_HANDLE_ENV, henv );
+
+	o_printf( "" );
+	o_printf( "TLS session resumption results:" );
+	for ( i=TLS_HANDSHAKE_FULL; i<=TLS_HANDSHAKE_RESUMED; i++ )
+	{
+		pResult = &g_rgResumptionResults[i];
+		o_printf( "  %-8s %lu logins", GetTlsHandshakeKindName( i ), pResult->dwLogins );
+		if ( 0 == pResult->dwLogins ) continue;
+
+		PerfSamplesSummarize( &pResult->Login, &pResult->LoginSummary );
+		PerfSamplesSummarize( &pResult->Handshake, &pResult->HandshakeSummary );
+		o_printf( "    login     %s", PerfSummaryFormat( &pResult->LoginSummary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "    handshake %s", PerfSummaryFormat( &pResult->HandshakeSummary, "ms", szSummary, sizeof(szSummary) ) );
+	}
+	if ( g_rgResumptionResults[TLS_HANDSHAKE_UNKNOWN].dwLogins > 0 )
+	{
+		o_printf( "  %lu logins could not be classified (TLS 1.3 without SECPKG_ATTR_SESSION_INFO support).",
+				  g_rgResumptionResults[TLS_HANDSHAKE_UNKNOWN].dwLogins );
+	}
+	if ( dwFailures > 0 )
+	{
+		o_printf( "  %lu of %ld logins failed or had no Schannel handshake, last error %s", dwFailures, lIterations, GetLastODBCError() );
+	}
+
+	dwClassified = pFull->dwLogins + pResumed->dwLogins;
+	if ( 0 == dwClassified ) goto RunResumptionTestExit;
+
+	o_printf( "" );
+	o_printf( "  Resumption hit rate %.1f%% (%lu of %lu logins)", pResumed->dwLogins * 100.0 / dwClassified, pResumed->dwLogins, dwClassified );
+	if ( pFull->dwLogins > 0 && pResumed->dwLogins > 0 )
+	{
+		o_printf( "  A resumed handshake saves %.3f ms of handshake and %.3f ms of login time at p50.",
+				  pFull->HandshakeSummary.dP50 - pResumed->HandshakeSummary.dP50,
+				  pFull->LoginSummary.dP50 - pResumed->LoginSummary.dP50 );
+	}
+	else if ( 0 == pResumed->dwLogins )
+	{
+		o_printf( "  No session was resumed.  Schannel only resumes a session for the same target name and" );
+		o_printf( "  credentials, so the driver may be acquiring new credentials for every connection, or the" );
+		o_printf( "  server is not caching sessions." );
+	}
+
+RunResumptionTestExit:
+
+	SecureZeroMemory( &Target, sizeof(Target) );
+}
+
+#define NEGO_RESULT_KERBEROS	0
+#define NEGO_RESULT_NTLM		1
+#define NEGO_RESULT_OTHER		2		// No exchange seen, or the tokens could not be decoded
+#define NEGO_RESULT_COUNT		3
+
+// An SPN no KDC knows, so Kerberos fails the way it does for a missing SPN and Negotiate falls
+// back to NTLM.  The failed TGS request is part of what the fallback costs.
+#define NEGO_FALLBACK_SPN		"MSSQLSvc/sspiclient-ntlm-fallback.invalid"
+
+typedef struct _NEGO_COST_RESULT
+{
+	DWORD        dwLogins;
+	DWORD        dwRoundTrips;		// Summed over the logins
+	PERF_SAMPLES Login;
+	PERF_SAMPLES Exchange;
+	PERF_SAMPLES Client;
+	PERF_SUMMARY LoginSummary;
+	PERF_SUMMARY ExchangeSummary;
+	PERF_SUMMARY ClientSummary;
+	double       rgdLogin[SQL_TEST_MAX_ITERATIONS];
+	double       rgdExchange[SQL_TEST_MAX_ITERATIONS];
+	double       rgdClient[SQL_TEST_MAX_ITERATIONS];
+} NEGO_COST_RESULT;
+
+static NEGO_COST_RESULT g_rgNegoCostResults[NEGO_RESULT_COUNT];
+
+static const char* GetNegoResultName( int iResult )
+{
+	switch ( iResult )
+	{
+		case NEGO_RESULT_KERBEROS:	return "Kerberos";
+		case NEGO_RESULT_NTLM:		return "NTLM";
+	}
+	return "unclassified";
+}
+
+// One integrated login.  Returns the NEGO_RESULT_* it is filed under, or -1 if it failed.
+static int RunNegotiateIteration( HENV henv, const SQL_TARGET* pTarget, BOOL fRecord )
+{
+	HDBC hdbc = NULL;
+	NEGO_EXCHANGE Before, After;
+	NEGO_COST_RESULT* pResult;
+	double dLoginMs = 0;
+	BOOL fExchange;
+	int iResult;
+
+	if ( !NegoGetLastExchange( &Before ) ) Before.dwNumber = 0;
+
+	hdbc = SQLTestConnect( henv, pTarget, &dLoginMs );
+	if ( NULL == hdbc ) return -1;
+	SQLTestDisconnect( hdbc );
+
+	fExchange = ( NegoGetLastExchange( &After ) && After.dwNumber != Before.dwNumber );
+	if ( !fExchange )
+	{
+		iResult = NEGO_RESULT_OTHER;
+	}
+	else if ( NegoExchangeIsNtlm( &After ) )
+	{
+		iResult = NEGO_RESULT_NTLM;
+	}
+	else if ( NEGO_IS_KERBEROS( After.iMech ) || 0 == lstrcmpi( After.szPackage, "Kerberos" ) )
+	{
+		iResult = NEGO_RESULT_KERBEROS;
+	}
+	else
+	{
+		iResult = NEGO_RESULT_OTHER;
+	}
+
+	if ( fRecord )
+	{
+		pResult = &g_rgNegoCostResults[iResult];
+		pResult->dwLogins++;
+		PerfSamplesAdd( &pResult->Login, dLoginMs );
+		if ( fExchange )
+		{
+			pResult->dwRoundTrips += NegoExchangeRoundTrips( &After );
+			PerfSamplesAdd( &pResult->Exchange, NegoExchangeMs( &After ) );
+			PerfSamplesAdd( &pResult->Client, NegoExchangeClientMs( &After ) );
+		}
+	}
+	return iResult;
+}
+
+// Logs in with integrated authentication over and over, alternating the SPN the driver builds
+// with one that cannot resolve, and sorts the logins by the mechanism their tokens show.  The
+// difference between the Kerberos and the NTLM logins is what a fallback costs per login: the
+// failed ticket request, the extra round trip and the server's pass-through authentication.
+void RunNegotiateCostTest( const SQL_TARGET* pTarget )
+{
+	HENV henv = NULL;
+	SQL_TARGET rgTargets[2];
+	NEGO_COST_RESULT* pResult = NULL;
+	NEGO_COST_RESULT* pKerberos = &g_rgNegoCostResults[NEGO_RESULT_KERBEROS];
+	NEGO_COST_RESULT* pNtlm = &g_rgNegoCostResults[NEGO_RESULT_NTLM];
+	BOOL fUsedKerberos = g_STATUS.fUsedKerberos;		// The normal login, before the test adds to it
+	BOOL fSPNProblem;
+	char szConnect[2048];
+	char szSummary[512];
+	long lIterations, lIteration;
+	DWORD dwFailures = 0;
+	int cTargets = 1;
+	int iResult;
+	int i;
+
+	if ( !pTarget->fIntegrated )
+	{
+		o_printf( "The Negotiate cost test needs integrated authentication, check 'Use Integrated Security'." );
+		return;
+	}
+
+	lIterations = GetTestOptionLong( "iterations", 20 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_ITERATIONS / 2 ) lIterations = SQL_TEST_MAX_ITERATIONS / 2;
+
+	rgTargets[0] = *pTarget;
+	rgTargets[1] = *pTarget;
+	lstrcpyn( rgTargets[1].szServerSPN, NEGO_FALLBACK_SPN, sizeof(rgTargets[1].szServerSPN) );
+
+	// ServerSPN came with SQL Server Native Client 10.0, older drivers ignore it.
+	if ( !GetTestOptionBool( "forcentlm", TRUE ) )
+	{
+		o_printf( "forcentlm=0, only the SPN the driver builds is used." );
+	}
+	else if ( 0 == lstrcmpi( pTarget->pszDriver, "SQL Server" ) || 0 == lstrcmpi( pTarget->pszDriver, "SQL Native Client" ) )
+	{
+		o_printf( "Driver=%s does not support ServerSPN, so no NTLM fallback can be forced.  Use the latest driver to compare.", pTarget->pszDriver );
+	}
+	else
+	{
+		cTargets = 2;
+	}
+
+	ZeroMemory( g_rgNegoCostResults, sizeof(g_rgNegoCostResults) );
+	ZeroMemory( g_szLastODBCError, sizeof(g_szLastODBCError) );
+	for ( i=0; i<NEGO_RESULT_COUNT; i++ )
+	{
+		pResult = &g_rgNegoCostResults[i];
+		PerfSamplesInit( &pResult->Login, pResult->rgdLogin, SQL_TEST_MAX_ITERATIONS );
+		PerfSamplesInit( &pResult->Exchange, pResult->rgdExchange, SQL_TEST_MAX_ITERATIONS );
+		PerfSamplesInit( &pResult->Client, pResult->rgdClient, SQL_TEST_MAX_ITERATIONS );
+	}
+
+	if ( !SQL_SUCCEEDED( SQLAllocHandle( SQL_HANDLE_ENV, SQL_NULL_HANDLE, &henv ) ) )
+	{
+		o_printf( "*** ERROR: SQLAllocHandle(SQL_HANDLE_ENV) failed, cannot run the Negotiate cost test." );
+		goto RunNegotiateCostTestExit;
+	}
+	SQLSetEnvAttr( henv, SQL_ATTR_ODBC_VERSION, (SQLPOINTER) SQL_OV_ODBC3, 0 );
+
+	// One warm-up login per SPN, logged in full, primes the ticket cache.
+	for ( i=0; i<cTargets; i++ )
+	{
+		o_printf( "Warm-up: [%s]", BuildConnectString( &rgTargets[i], TRUE, szConnect, sizeof(szConnect) ) );
+		iResult = RunNegotiateIteration( henv, &rgTargets[i], FALSE );
+		DumpNegoExchange();
+		if ( iResult < 0 )
+		{
+			o_printf( "Warm-up login failed, last error %s", GetLastODBCError() );
+		}
+		else
+		{
+			o_printf( "Warm-up login used %s.", GetNegoResultName( iResult ) );
+		}
+	}
+
+	o_printf( "" );
+	o_printf( "Running %ld integrated logins%s.", lIterations * cTargets,
+			  ( cTargets > 1 ) ? ", alternating the driver's SPN and ServerSPN=" NEGO_FALLBACK_SPN : "" );
+
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		for ( i=0; i<cTargets; i++ )
+		{
+			if ( RunNegotiateIteration( henv, &rgTargets[i], TRUE ) < 0 ) dwFailures++;
+		}
+	}
+	g_fLogPaused = FALSE;
+
+	SQLFreeHandle( SQL_HANDLE_ENV, henv );
+
+	o_printf( "" );
+	o_printf( "Negotiate results:" );
+	for ( i=0; i<NEGO_RESULT_COUNT; i++ )
+	{
+		pResult = &g_rgNegoCostResults[i];
+		if ( 0 == pResult->dwLogins ) continue;
+
+		PerfSamplesSummarize( &pResult->Login, &pResult->LoginSummary );
+		PerfSamplesSummarize( &pResult->Exchange, &pResult->ExchangeSummary );
+		PerfSamplesSummarize( &pResult->Client, &pResult->ClientSummary );
+		o_printf( "  %-12s %lu logins, %.1f round trips per login", GetNegoResultName( i ), pResult->dwLogins,
+				  (double) pResult->dwRoundTrips / pResult->dwLogins );
+		o_printf( "    login          %s", PerfSummaryFormat( &pResult->LoginSummary, "ms", szSummary, sizeof(szSummary) ) );
+		if ( 0 == pResult->ExchangeSummary.cSamples ) continue;
+		o_printf( "    exchange       %s", PerfSummaryFormat( &pResult->ExchangeSummary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "    inside ISC     %s", PerfSummaryFormat( &pResult->ClientSummary, "ms", szSummary, sizeof(szSummary) ) );
+	}
+	if ( dwFailures > 0 )
+	{
+		o_printf( "  %lu of %ld logins failed, last error %s", dwFailures, lIterations * cTargets, GetLastODBCError() );
+	}
+
+	// The SPN checks of the normal test ran before this one, say what their finding costs.
+	fSPNProblem = !fUsedKerberos && ( g_STATUS.fDuplicateSPNFound || ( g_STATUS.fExecuteSearch && !g_STATUS.fSPNFoundInAD ) );
+
+	o_printf( "" );
+	if ( pKerberos->dwLogins > 0 && pNtlm->dwLogins > 0 )
+	{
+		o_printf( "  NTLM fallback costs %.3f ms per login at p50 and %.3f ms at p90, with %.1f more round trips.",
+				  pNtlm->LoginSummary.dP50 - pKerberos->LoginSummary.dP50,
+				  pNtlm->LoginSummary.dP90 - pKerberos->LoginSummary.dP90,
+				  (double) pNtlm->dwRoundTrips / pNtlm->dwLogins - (double) pKerberos->dwRoundTrips / pKerberos->dwLogins );
+		if ( fSPNProblem )
+		{
+			o_printf( "  The %s SPN reported above makes every login pay this.", ( g_STATUS.fDuplicateSPNFound ) ? "duplicate" : "missing" );
+		}
+	}
+	else if ( pNtlm->dwLogins > 0 )
+	{
+		o_printf( "  No login used Kerberos, so there is no baseline to compare with.  Each login spends %.3f ms at p50",
+				  pNtlm->LoginSummary.dP50 );
+		o_printf( "  logging in with NTLM in %.1f round trips, Kerberos needs %d.", (double) pNtlm->dwRoundTrips / pNtlm->dwLogins, NEGO_KERBEROS_ROUND_TRIPS );
+		if ( fSPNProblem )
+		{
+			o_printf( "  Fix the %s SPN reported above and run the test again to measure the difference.", ( g_STATUS.fDuplicateSPNFound ) ? "duplicate" : "missing" );
+		}
+	}
+	else if ( pKerberos->dwLogins > 0 && cTargets > 1 )
+	{
+		o_printf( "  Every login used Kerberos, even with ServerSPN=%s.  The driver may not pass ServerSPN", NEGO_FALLBACK_SPN );
+		o_printf( "  to Negotiate, or NTLM is blocked for this client." );
+	}
+
+RunNegotiateCostTestExit:
+
+	SecureZeroMemory( rgTargets, sizeof(rgTargets) );
+}
+
+#define KDC_RESULT_UNCACHED		0		// KERB_RETRIEVE_TICKET_DONT_USE_CACHE, a TGS exchange with the KDC
+#define KDC_RESULT_CACHED		1		// KERB_RETRIEVE_TICKET_USE_CACHE_ONLY, answered by LSA
+#define KDC_RESULT_COUNT		2
+#define KDC_MAX_ERRORS			8		// Distinct error statuses counted per kind
+
+typedef struct _KDC_ERROR_COUNT
+{
+	NTSTATUS Status;
+	DWORD    dwCount;
+} KDC_ERROR_COUNT;
+
+typedef struct _KDC_PROFILE_RESULT
+{
+	DWORD           dwRequests;
+	DWORD           dwErrors;
+	DWORD           cErrorKinds;
+	KDC_ERROR_COUNT rgErrors[KDC_MAX_ERRORS];
+	PERF_HISTOGRAM  Latency;			// Microseconds, successful and failed requests
+	PERF_SAMPLES    Ms;
+	PERF_SUMMARY    Summary;
+	double          rgdMs[SQL_TEST_MAX_ITERATIONS];
+} KDC_PROFILE_RESULT;
+
+static KDC_PROFILE_RESULT g_rgKdcResults[KDC_RESULT_COUNT];
+
+static void AddKdcResult( KDC_PROFILE_RESULT* pResult, const KERB_TICKET_RESULT* pTicket )
+{
+	NTSTATUS Status;
+	DWORD i;
+
+	pResult->dwRequests++;
+	if ( 0 != pTicket->ui64Start )
+	{
+		PerfHistogramAdd( &pResult->Latency, PerfCounterToUs( pTicket->ui64End - pTicket->ui64Start ) );
+		PerfSamplesAdd( &pResult->Ms, KerbTicketMs( pTicket ) );
+	}
+	if ( pTicket->fTicket ) return;
+
+	pResult->dwErrors++;
+	Status = KerbResultStatus( pTicket );
+	for ( i=0; i<pResult->cErrorKinds; i++ )
+	{
+		if ( pResult->rgErrors[i].Status == Status ) break;
+	}
+	if ( i == pResult->cErrorKinds )
+	{
+		if ( pResult->cErrorKinds >= KDC_MAX_ERRORS ) return;
+		pResult->rgErrors[i].Status = Status;
+		pResult->cErrorKinds++;
+	}
+	pResult->rgErrors[i].dwCount++;
+}
+
+// Requests a service ticket for the SPN over and over, alternating a request that has to go to
+// the KDC with one the ticket cache answers.  The cached request is LSA alone, so the difference
+// between the two is the KDC: network round trip to the DC plus its TGS processing.
+void RunKdcProfileTest( const SQL_TARGET* pTarget )
+{
+	static const char* rgpszKinds[KDC_RESULT_COUNT] = { "uncached (KDC)", "cached (LSA)" };
+	static const ULONG rgulOptions[KDC_RESULT_COUNT] = { KERB_RETRIEVE_TICKET_DONT_USE_CACHE, KERB_RETRIEVE_TICKET_USE_CACHE_ONLY };
+	KDC_PROFILE_RESULT* pResult = NULL;
+	KDC_PROFILE_RESULT* pUncached = &g_rgKdcResults[KDC_RESULT_UNCACHED];
+	KDC_PROFILE_RESULT* pCached = &g_rgKdcResults[KDC_RESULT_CACHED];
+	KERB_TICKET_RESULT Ticket;
+	char szSPN[1024];
+	char szSummary[512];
+	char szHist[1024];
+	double dKdcMs;
+	long lIterations, lIteration, lSlowMs;
+	DWORD i;
+	int iKind;
+
+	// kdcspn, else ServerSPN, else the SPN the normal test captured or guessed.
+	GetTestOptionString( "kdcspn", "", szSPN, sizeof(szSPN) );
+	if ( '\0' == szSPN[0] ) lstrcpyn( szSPN, pTarget->szServerSPN, sizeof(szSPN) );
+	if ( '\0' == szSPN[0] ) lstrcpyn( szSPN, g_STATUS.g_szSavedSPN, sizeof(szSPN) );
+	if ( '\0' == szSPN[0] )
+	{
+		o_printf( "No SPN to request tickets for, the normal test found none.  Set kdcspn=<spn>." );
+		return;
+	}
+
+	if ( !KerbSessionOpen( NULL, NULL ) )
+	{
+		o_printf( "*** ERROR: Could not connect to the Kerberos package, cannot run the KDC response time test." );
+		return;
+	}
+
+	lIterations = GetTestOptionLong( "iterations", 50 );
+	if ( lIterations < 1 ) lIterations = 1;
+	if ( lIterations > SQL_TEST_MAX_ITERATIONS ) lIterations = SQL_TEST_MAX_ITERATIONS;
+	lSlowMs = GetTestOptionLong( "kdcslowms", 50 );
+
+	ZeroMemory( g_rgKdcResults, sizeof(g_rgKdcResults) );
+	for ( iKind=0; iKind<KDC_RESULT_COUNT; iKind++ )
+	{
+		pResult = &g_rgKdcResults[iKind];
+		PerfHistogramReset( &pResult->Latency );
+		PerfSamplesInit( &pResult->Ms, pResult->rgdMs, SQL_TEST_MAX_ITERATIONS );
+	}
+
+	o_printf( "SPN [%s]", szSPN );
+	if ( '\0' != g_STATUS.g_szSavedDC[0] )
+	{
+		o_printf( "Domain controller %s in site '%s', this client is in site '%s'", g_STATUS.g_szSavedDC, g_STATUS.g_szSavedDcSite, g_STATUS.g_szSavedClientSite );
+	}
+
+	// Warm-up, puts the ticket in the cache for the cached requests.
+	KerbRequestTicket( szSPN, KERB_RETRIEVE_TICKET_DEFAULT, &Ticket );
+	if ( Ticket.fTicket )
+	{
+		o_printf( "Warm-up ticket request took %.3f ms.", KerbTicketMs( &Ticket ) );
+	}
+	else
+	{
+		o_printf( "Warm-up ticket request failed, status 0x%08x %s", KerbResultStatus( &Ticket ), KerbStatusName( KerbResultStatus( &Ticket ) ) );
+	}
+
+	o_printf( "Running %ld uncached and %ld cached ticket requests.", lIterations, lIterations );
+
+	g_fLogPaused = TRUE;
+	for ( lIteration=0; lIteration<lIterations; lIteration++ )
+	{
+		for ( iKind=0; iKind<KDC_RESULT_COUNT; iKind++ )
+		{
+			KerbRequestTicket( szSPN, rgulOptions[iKind], &Ticket );
+			AddKdcResult( &g_rgKdcResults[iKind], &Ticket );
+		}
+	}
+	g_fLogPaused = FALSE;
+
+	o_printf( "" );
+	o_printf( "KDC response time results:" );
+	for ( iKind=0; iKind<KDC_RESULT_COUNT; iKind++ )
+	{
+		pResult = &g_rgKdcResults[iKind];
+		PerfSamplesSummarize( &pResult->Ms, &pResult->Summary );
+		o_printf( "  %-16s %lu requests, %lu failed (%.1f%%)", rgpszKinds[iKind], pResult->dwRequests, pResult->dwErrors,
+				  ( pResult->dwRequests > 0 ) ? 100.0 * pResult->dwErrors / pResult->dwRequests : 0.0 );
+		o_printf( "    latency        %s", PerfSummaryFormat( &pResult->Summary, "ms", szSummary, sizeof(szSummary) ) );
+		o_printf( "    histogram (us) %s", PerfHistogramFormat( &pResult->Latency, szHist, sizeof(szHist) ) );
+		for ( i=0; i<pResult->cErrorKinds; i++ )
+		{
+			o_printf( "    0x%08x %s: %lu", pResult->rgErrors[i].Status, KerbStatusName( pResult->rgErrors[i].Status ), pResult->rgErrors[i].dwCount );
+		}
+	}
+
+	o_printf( "" );
+	if ( pUncached->dwErrors == pUncached->dwRequests )
+	{
+		o_printf( "  Every uncached request failed, see the errors above: the SPN or the KDC is the problem, not the latency." );
+		return;
+	}
+
+	dKdcMs = pUncached->Summary.dP50 - ( ( pCached->Summary.cSamples > 0 ) ? pCached->Summary.dP50 : 0 );
+	o_printf( "  A ticket from the KDC costs %.3f ms more than one from the cache at p50, %.3f ms at p90.", dKdcMs,
+			  pUncached->Summary.dP90 - ( ( pCached->Summary.cSamples > 0 ) ? pCached->Summary.dP90 : 0 ) );
+	if ( lSlowMs > 0 && dKdcMs >= lSlowMs )
+	{
+		if ( '\0' != g_STATUS.g_szSavedDcSite[0] && 0 != lstrcmpi( g_STATUS.g_szSavedDcSite, g_STATUS.g_szSavedClientSite ) )
+		{
+			o_printf( "  WARNING! The KDC is slow and the domain controller is in another site ('%s', this client is in '%s').", g_STATUS.g_szSavedDcSite, g_STATUS.g_szSavedClientSite );
+			o_printf( "           Check the AD site and subnet definitions for this client, or add a domain controller to its site." );
+		}
+		else
+		{
+			o_printf( "  WARNING! The KDC takes %ld ms or more per ticket, check the load on the domain controller and the network path to it.", lSlowMs );
+		}
+	}
+	else if ( pUncached->Summary.dP99 >= 10 * pUncached->Summary.dP50 && pUncached->Summary.dP99 >= lSlowMs )
+	{
+		o_printf( "  The KDC is usually fast but the slowest requests take %.3f ms, look for retransmits or a busy domain controller.", pUncached->Summary.dP99 );
+	}
+	if ( pUncached->dwErrors > 0 )
+	{
+		o_printf( "  %.1f%% of the uncached requests failed, a login that gets one of them falls back to NTLM.", 100.0 * pUncached->dwErrors / pUncached->dwRequests );
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "PerfStats.h"
+
+// Measured ODBC tests run from the "Run Selected Test" button.  They all connect through
+// BuildConnectString so the connection string matches the one used by the normal SSPI test.
+
+#define SQL_TEST_NONE			0
+#define SQL_TEST_PROTOCOLS		1	// Same login and query over tcp:, np: and lpc:
+#define SQL_TEST_PACKET_SIZES	2	// Bulk fetch at a series of packet sizes, encrypted and not
+#define SQL_TEST_ENCRYPTION		3	// Same workload with Encrypt=No and Encrypt=Yes
+#define SQL_TEST_RESUMPTION		4	// Repeated Encrypt=Yes logins, full vs resumed TLS handshakes
+#define SQL_TEST_NEGOTIATE		5	// Repeated integrated logins, Kerberos vs NTLM fallback cost
+#define SQL_TEST_KDC			6	// Repeated uncached and cached service ticket requests
+#define SQL_TEST_LAST			SQL_TEST_KDC
+
+#define SQL_TEST_QUERY			"SELECT '**** SSPICLIENT SUCCESS ****'"
+#define SQL_TEST_MAX_ITERATIONS	1000
+#define SQL_TEST_MAX_ROW_SIZE	( 1024 * 1024 )
+#define SQL_TEST_MAX_SWEEP		100		// Iterations per packet size
+#define SQL_TEST_MAX_PACKET_SIZES	16
+
+typedef struct _SQL_TARGET
+{
+	char* pszDriver;
+	char  szProtocol[16];		// "tcp", "np", "lpc" or "" to let the driver pick
+	char  szServer[1024];		// Server as typed, without the protocol prefix, may include ",port"
+	BOOL  fIntegrated;
+	char  szUserId[256];
+	char  szPassword[256];
+	BOOL  fEncrypt;
+	BOOL  fTrustServerCertificate;	// Measured tests only, the normal test always validates
+	SQLUINTEGER dwPacketSize;		// SQL_ATTR_PACKET_SIZE, 0 for the driver default
+	char  szServerSPN[256];			// ServerSPN keyword (SNAC 10 and later), "" to let the driver build it
+} SQL_TARGET;
+
+typedef struct _SQL_BULK_RESULT
+{
+	SQLLEN   cRows;
+	uint64_t cbData;			// Bytes returned by SQLGetData
+	double   dFirstRowMs;		// SQLExecDirect through the first SQLFetch
+	double   dTotalMs;			// SQLExecDirect through the last SQLGetData
+} SQL_BULK_RESULT;
+
+char* SelectODBCDriver( BOOL fUseLatest );
+char* BuildConnectString( const SQL_TARGET* pTarget, BOOL fMaskPassword, char* pszConnect, size_t cchConnect );
+BOOL  IsLocalServer( const char* pszServer );
+void  LogODBCErrors( SQLSMALLINT fHandleType, SQLHANDLE hHandle );
+const char* GetLastODBCError();
+
+HDBC  SQLTestConnect( HENV henv, const SQL_TARGET* pTarget, double* pdLoginMs );
+BOOL  SQLTestQuery( HDBC hdbc, char* pszQuery, double* pdQueryMs, SQLLEN* pcRows );
+BOOL  SQLTestBulkFetch( HDBC hdbc, long lRows, long cbRow, SQL_BULK_RESULT* pResult );
+void  SQLTestDisconnect( HDBC hdbc );
+void  LogBulkResult( const char* pszLabel, const SQL_BULK_RESULT* pResult );
+
+void  RunRoundTripProbe( HDBC hdbc, double dLoginMs );
+
+const char* GetSQLTestName( int iTest );
+void  RunSQLTest( int iTest, const SQL_TARGET* pTarget );
+void  RunProtocolComparison( const SQL_TARGET* pTarget );
+void  RunPacketSizeSweep( const SQL_TARGET* pTarget );
+void  RunEncryptionComparison( const SQL_TARGET* pTarget );
+void  RunResumptionTest( const SQL_TARGET* pTarget );
+void  RunNegotiateCostTest( const SQL_TARGET* pTarget );
+void  RunKdcProfileTest( const SQL_TARGET* pTarget );
@@ -14,6 +14,19 @@
 #include "DetourFunctions.h"
 #include "DynamicDCInfo.h"
 #include "FileInfo.h"
+#include "NetlibStats.h"
+#include "TlsStats.h"
+#include "NegoStats.h"
+#include "TokenStats.h"
+#include "CertCache.h"
+#include "KerbDecoder.h"
+#include "KerbTickets.h"
+#include "SpnCandidates.h"
+#include "TicketCache.h"
+#include "ClockSkew.h"
+#include "DirectorySession.h"
+#include "TestOptions.h"
+#include "SQLTests.h"
 #include ".\sspiclientdlg.h"
 
 #ifdef _DEBUG
@@ -49,6 +62,8 @@ CSSPIClientDlg::CSSPIClientDlg(CWnd* pParent /*=NULL*/)
 	, m_strPassword(_T(""))
 	, m_strUserId(_T(""))
 	, m_fUseSQLNCLI(FALSE)
+	, m_strOptions(_T(""))
+	, m_iSelectedTest(SQL_TEST_NONE)
 {
 	//{{AFX_DATA_INIT(CSSPIClientDlg)
 	m_strConnect = _T("<Enter your SQL Server Name Here>");
@@ -71,6 +86,8 @@ void CSSPIClientDlg::DoDataExchange(CDataExchange* pDX)
 	DDX_Text(pDX, IDC_EDT_PASSWORD, m_strPassword);
 	DDX_Text(pDX, IDC_EDT_USERID, m_strUserId);
 	DDX_Check(pDX, IDC_CHECK2, m_fUseSQLNCLI);
+	DDX_Text(pDX, IDC_EDT_OPTIONS, m_strOptions);
+	DDX_Control(pDX, IDC_CMB_TEST, m_cmbTest);
 }
 
 BEGIN_MESSAGE_MAP(CSSPIClientDlg, CDialog)
@@ -84,6 +101,7 @@ BEGIN_MESSAGE_MAP(CSSPIClientDlg, CDialog)
 	ON_BN_CLICKED(IDC_BTN_CONNECT2, OnBnClickedBtnConnect2)
 	ON_BN_CLICKED(IDC_CHECK1, OnBnClickedCheck1)
 	ON_BN_CLICKED(IDC_BTN_CONNECT3, OnBnClickedBtnConnect3)
+	ON_BN_CLICKED(IDC_BTN_RUNTEST, OnBnClickedBtnRunTest)
 END_MESSAGE_MAP()
 
 /////////////////////////////////////////////////////////////////////////////
@@ -92,6 +110,7 @@ BOOL CSSPIClientDlg::OnInitDialog()
 {
 	char szCurDir[2048];
 	char* s = NULL;
+	int iTest, iItem;
 	CDialog::OnInitDialog();
 
 	// Set the icon for this dialog.  The framework does this automatically
@@ -104,6 +123,14 @@ BOOL CSSPIClientDlg::OnInitDialog()
 
 	OnBnClickedCheck1();
 
+	// Fill the test list, the item data is the SQL_TEST_* number.
+	for ( iTest = SQL_TEST_NONE+1; iTest <= SQL_TEST_LAST; iTest++ )
+	{
+		iItem = m_cmbTest.AddString( GetSQLTestName( iTest ) );
+		m_cmbTest.SetItemData( iItem, iTest );
+	}
+	m_cmbTest.SetCurSel( 0 );
+
 	LoadLSA();
 
 	ZeroMemory( szCurDir, sizeof(szCurDir) );
@@ -730,6 +757,8 @@ void DumpKERB_EXTERNAL_TICKET( PKERB_EXTERNAL_TICKET pExTicket )
 	SYSTEMTIME ST;
 	FILETIME FT;
 	long comp;
+	KERB_MESSAGE Msg;
+	int iError;
 
 	if ( NULL == pExTicket ) return;
 
@@ -754,7 +783,7 @@ void DumpKERB_EXTERNAL_TICKET( PKERB_EXTERNAL_TICKET pExTicket )
 
 		o_printf( "  Flags               = 0x%08x", pExTicket->Flags ); 
 
-		o_printf( "  KeyExpirationTime   = %i64", (__int64) pExTicket->KeyExpirationTime.QuadPart );
+		o_printf( "  KeyExpirationTime   = %I64d", (__int64) pExTicket->KeyExpirationTime.QuadPart );
 		o_printf( "  StartTime           = %s", StringTimeFromFileTime( (FILETIME*) &pExTicket->StartTime ) );
 
 		// Check expiration date...
@@ -768,13 +797,20 @@ void DumpKERB_EXTERNAL_TICKET( PKERB_EXTERNAL_TICKET pExTicket )
 				  GetDateDiff( (FILETIME*) &pExTicket->StartTime, (FILETIME*) &pExTicket->EndTime ) );
 
 		o_printf( "  RenewUntil          = %s", StringTimeFromFileTime( (FILETIME*) &pExTicket->RenewUntil ) );
-		o_printf( "  TimeSkew            = %i64", (__int64) pExTicket->TimeSkew.QuadPart );
+		o_printf( "  TimeSkew            = %I64d (%+.3f s)", (__int64) pExTicket->TimeSkew.QuadPart, pExTicket->TimeSkew.QuadPart / 10000000.0 );
 
 		o_printf( "  EncodedTicketSize   = %lu", pExTicket->EncodedTicketSize );
-		o_printf( "  EncodedTicket       = 0x%08x", pExTicket->EncodedTicket );
 
-		// Skipping this for now, it's not very useful and it fills the log up.
-		// DumpHex( pExTicket->EncodedTicket, pExTicket->EncodedTicketSize );
+		// The ticket is decoded in place rather than hex dumped, the encrypted part is only sized.
+		iError = KerbDecode( pExTicket->EncodedTicket, pExTicket->EncodedTicketSize, &Msg );
+		if ( DER_OK == iError )
+		{
+			o_printf( "  EncodedTicket       = %s", KerbMessageFormat( &Msg, szBuffer, sizeof(szBuffer) ) );
+		}
+		else
+		{
+			o_printf( "  EncodedTicket       = 0x%08x, cannot be decoded: %s", pExTicket->EncodedTicket, KerbDecodeErrorName( iError ) );
+		}
 
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
@@ -786,170 +822,77 @@ void DumpKERB_EXTERNAL_TICKET( PKERB_EXTERNAL_TICKET pExTicket )
 
 HRESULT FindSPNViaAD( char* pszSPN )
 {
-    HRESULT hr		= E_FAIL;
-	VARIANT var;
-	ULONG lFetch;
-	DWORD dwSPNCount, dwColCount;
-    IDirectorySearch *pIDirectorySearch	= NULL;
-	IADsContainer *pIADsContainer		= NULL;
-    IUnknown* pIUnknown					= NULL;
-	IEnumVARIANT *pIEnumVARIANT			= NULL;
-   	IDispatch *pIDispatch				= NULL;
-    IADs *pADs							= NULL;
-	#define ATTRIBUTE_COUNT 2
-	ADS_SEARCHPREF_INFO SearchPrefs;
-	SearchPrefs.dwSearchPref	= ADS_SEARCHPREF_SEARCH_SCOPE;
-	SearchPrefs.vValue.dwType	= ADSTYPE_INTEGER;
-	SearchPrefs.vValue.Integer	= ADS_SCOPE_SUBTREE;
-	DWORD dwNumPrefs			= 1;
-	ADS_SEARCH_COLUMN col1;
-	ADS_SEARCH_HANDLE hSearch   = NULL;
-	LPOLESTR rgwszAttributes[ATTRIBUTE_COUNT] = { L"dnsHostName", L"distinguishedName" };
-	WCHAR wszSearchFilter[1024];
-	LPWSTR pszColumn = NULL;
-	BSTR bstrSPN = NULL;
+	HRESULT hr = E_FAIL;
+	const DIR_SPN_ENTRY* pEntry = NULL;
+	const DIR_ACCOUNT* pAccount = NULL;
+	char szFlags[256];
+	DWORD i;
 
 	__try
 	{
-
-		bstrSPN = AnsiToBSTR( pszSPN );
-
-		wsprintfW( wszSearchFilter, L"(servicePrincipalName=%s)", (WCHAR*) bstrSPN );
-
 		o_printf( "" );
 		o_printf( "Attempting to load up Active Directory dll and check AD for SPN" );
 
-		if ( !LoadADSI() ) 
-		{
-			o_printf( "Failed to load activeds.dll, cannot talk to AD.  This can happen on Windows 9x and NT 4 machines." );
-			return E_FAIL;
-		}
-
-		g_STATUS.fLoadedADSI = TRUE;
-
-		hr = GetGCIADsContainer( &pIADsContainer );
-		if ( FAILED(hr) )
-		{
-			o_printf( "ADsOpenObject( \"GC:\",...,ADS_SECURE_AUTHENTICATION) failed with HRESULT=0x%08x", hr );
-			return hr;
-		}
-
-		g_STATUS.fGetGCIADsContainer = TRUE;
-
-		hr = pIADsContainer->get__NewEnum( &pIUnknown );
-		if (FAILED(hr))
-		{
-			o_printf( "get__NewEnum failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
-		}
-
-		hr = pIUnknown->QueryInterface( IID_IEnumVARIANT, (void**) &pIEnumVARIANT );
-		if (FAILED(hr))
-		{
-			o_printf( "QueryInterface(IID_IEnumVARIANT) failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
-		}
-
-		// Now Enumerate--there should be only one item.
-		hr = pIEnumVARIANT->Next( 1, &var, &lFetch );
-		if (FAILED(hr))
-		{
-			o_printf( "pIEnumVARIANT->Next failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
-		}
-
-		// QI for pIDirectorySearch interface.
-		pIDispatch = V_DISPATCH(&var);
-		hr = pIDispatch->QueryInterface( __uuidof(guid_IID_IDirectorySearch), (void**)&pIDirectorySearch ); 
-		VariantClear(&var);
-		pIDispatch = NULL; // Set this to NULL because we already released the interface with VariantClear.
+		// The session is kept for the run, a failure to bind has been logged.
+		hr = DirSessionOpen();
+		if ( FAILED(hr) ) return hr;
 
-		if ( FAILED(hr) )
-		{
-			o_printf( "QueryInterface(IID_IDirectorySearch) failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
-		}
-		
-		// Set the search preference
-		hr = pIDirectorySearch->SetSearchPreference( &SearchPrefs, dwNumPrefs );
-		if ( FAILED(hr) )
-		{
-			o_printf( "SetSearchPreference failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
-		}
-		
-		// Execute the search
-		hr = pIDirectorySearch->ExecuteSearch( wszSearchFilter,
-											   rgwszAttributes,
-											   ATTRIBUTE_COUNT,
-											   &hSearch	);
-		if ( FAILED(hr) )
+		pEntry = DirFindSPN( pszSPN );
+		if ( NULL == pEntry )
 		{
-			o_printf( "ExecuteSearch failed, hr=0x%08x", hr );
-			goto FindSPNViaADExit;
+			o_printf( "SPN %s not looked up, the directory cache is full or the SPN is too long", pszSPN );
+			return E_FAIL;
 		}
+		if ( !pEntry->fSearched ) return ( FAILED(pEntry->hr) ) ? pEntry->hr : E_FAIL;
 
 		g_STATUS.fExecuteSearch = TRUE;
 
-		if( S_ADS_NOMORE_ROWS == pIDirectorySearch->GetFirstRow( hSearch ) )
+		if ( 0 == pEntry->cOwners )
 		{
 			o_printf( "SPN %s not found anywhere in Active Directory", pszSPN );
-			goto FindSPNViaADExit;
+			return S_OK;
 		}
 
 		g_STATUS.fSPNFoundInAD = TRUE;
+		if ( pEntry->cOwners > 1 ) g_STATUS.fDuplicateSPNFound = TRUE;
 
-		dwSPNCount = 0;
 		o_printf( "" );
 		o_printf( "Searching AD for SPN complete." );
 		o_printf( "SPN %s found on following object(s) in AD:", pszSPN );
-		do
-		{	
-			dwSPNCount++;
-			dwColCount = 0;
-			while( pIDirectorySearch->GetNextColumnName( hSearch, &pszColumn ) != S_ADS_NOMORE_COLUMNS )
+		for ( i=0; i<min( pEntry->cOwners, DIR_MAX_OWNERS ); i++ )
+		{
+			pAccount = DirGetAccount( pEntry->rgiOwners[i] );
+			if ( NULL == pAccount )
 			{
-				// Get the data for this column
-				hr  = pIDirectorySearch->GetColumn( hSearch, pszColumn, &col1 );
-
-				if ( SUCCEEDED(hr) )
-				{
-					dwColCount++;
-					if ( 1 == dwColCount )
-					{
-						o_printf( "  %02lu. %20S = %S", 
-								  dwSPNCount,
-								  pszColumn,
-								  col1.pADsValues->CaseIgnoreString );
-					}
-					else
-					{
-						o_printf( "      %20S = %S", 
-								  pszColumn,
-								  col1.pADsValues->CaseIgnoreString );
-					}
-					pIDirectorySearch->FreeColumn( &col1 );
-				}
-				// 	FreeADsMem( pszColumn ); Leaking this for now, don't want to bind to adsi.
+				o_printf( "  %02lu. account details not cached, more than %d accounts in this run", i + 1, DIR_MAX_ACCOUNTS );
+				continue;
 			}
-			
-			if ( dwSPNCount > 1 ) g_STATUS.fDuplicateSPNFound = TRUE;
-			
-		}
-		while ( S_ADS_NOMORE_ROWS != pIDirectorySearch->GetNextRow( hSearch ) );
+			if ( 0 == i ) lstrcpyn( g_STATUS.g_szSavedSPNObject, pAccount->szDN, sizeof(g_STATUS.g_szSavedSPNObject) );
 
-		// Close the search handle to clean up
-		pIDirectorySearch->CloseSearchHandle(hSearch);
-	
-FindSPNViaADExit:
-
-		SAFE_RELEASE( pIDirectorySearch );
-		SAFE_RELEASE( pIEnumVARIANT );
-		SAFE_RELEASE( pIUnknown );
-		SAFE_RELEASE( pIADsContainer );
-		SAFE_SYSFREE( bstrSPN );
-		return hr;
+			o_printf( "  %02lu. %29s = %s", i + 1, "distinguishedName", pAccount->szDN );
+			o_printf( "      %29s = %s", "sAMAccountName", pAccount->szSamAccountName );
+			if ( '\0' != pAccount->szDnsHostName[0] )
+			{
+				o_printf( "      %29s = %s", "dnsHostName", pAccount->szDnsHostName );
+			}
+			o_printf( "      %29s = %s", "userAccountControl", DirFormatUserAccountControl( pAccount->dwUserAccountControl, szFlags, sizeof(szFlags) ) );
+			o_printf( "      %29s = %s", "msDS-SupportedEncryptionTypes", DirFormatEncryptionTypes( pAccount, szFlags, sizeof(szFlags) ) );
+			o_printf( "      %29s = %lu values", "servicePrincipalName", pAccount->cSPNs );
 
+			if ( pAccount->dwUserAccountControl & DIR_UAC_ACCOUNTDISABLE )
+			{
+				o_printf( "      WARNING! The account is disabled, the KDC does not issue tickets for its SPNs." );
+			}
+			if ( pAccount->fEncryptionTypes && 0 == ( pAccount->dwEncryptionTypes & ( DIR_ENCTYPE_AES128 | DIR_ENCTYPE_AES256 ) ) )
+			{
+				o_printf( "      WARNING! The account does not allow AES, logins fail where RC4 and DES are disabled." );
+			}
+		}
+		if ( pEntry->cOwners > DIR_MAX_OWNERS )
+		{
+			o_printf( "  ... and %lu more accounts", pEntry->cOwners - DIR_MAX_OWNERS );
+		}
+		return S_OK;
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
@@ -957,8 +900,6 @@ FindSPNViaADExit:
 	}
 
 	return E_FAIL;
-
-
 }
 
 void DumpKerberosTickets()
@@ -967,7 +908,6 @@ void DumpKerberosTickets()
 	KERB_QUERY_TKT_CACHE_REQUEST CacheRequest;
 	ULONG ulResponseSize;
 	ULONG ulPackageId;
-	LSA_STRING Name;
 	HANDLE hLogonHandle = NULL;
 	PKERB_QUERY_TKT_CACHE_RESPONSE pTickets  = NULL;
 	PKERB_RETRIEVE_TKT_RESPONSE pTicketEntry = NULL;
@@ -978,27 +918,8 @@ void DumpKerberosTickets()
 
 	o_printf( "Dumping Kerberos tickets for local client machine." );
 
-	// Connect to LSA.
-    Status = pfnLsaConnectUntrusted( &hLogonHandle );
-    if ( !SEC_SUCCESS( Status ) ) 
-	{
-		o_printf( "LsaConnectUntrusted failed, Status=0x%08x\n", Status );
-        goto DumpKerberosTicketsExit;
-    }
-
-	// Get the Kerberos package.
-    Name.Buffer = MICROSOFT_KERBEROS_NAME_A;
-    Name.Length = (USHORT) strlen(Name.Buffer);
-    Name.MaximumLength = Name.Length + 1;
-    Status = pfnLsaLookupAuthenticationPackage( hLogonHandle,
-											    &Name,
-											    &ulPackageId
-										      );
-    if ( !SEC_SUCCESS(Status) ) 
-	{
-		o_printf( "LsaLookupAuthenticationPackage failed, Status=0x%08x\n", Status );
-        goto DumpKerberosTicketsExit;
-    }
+	// Connect to LSA and get the Kerberos package.
+	if ( !KerbSessionOpen( &hLogonHandle, &ulPackageId ) ) goto DumpKerberosTicketsExit;
 
 	// Get the KerbRetrieveTicketMessage message.
     CacheRequest.MessageType	  = KerbRetrieveTicketMessage;
@@ -1068,7 +989,6 @@ DumpKerberosTicketsExit:
 		pTicketEntry = NULL;
 	}
 
-	if ( hLogonHandle ) pfnLsaDeregisterLogonProcess( hLogonHandle );
 	o_printf( "" );
 
 }
@@ -1077,7 +997,6 @@ void VerifySPN( char* pszSPN )
 {
 	NTSTATUS Status, SubStatus;
 	ULONG ulResponseSize, ulRequestSize, ulPackageId;
-	LSA_STRING Name;
 	HANDLE hLogonHandle						   = NULL;
 	PKERB_RETRIEVE_TKT_RESPONSE pCacheResponse = NULL;
 	PKERB_RETRIEVE_TKT_REQUEST pCacheRequest   = NULL;
@@ -1087,6 +1006,7 @@ void VerifySPN( char* pszSPN )
 	PKERB_RETRIEVE_TKT_RESPONSE  pTicketEntry  = NULL;
 	char szErrorBuffer[1024];
 	BSTR bstrSPN = NULL;
+	FILETIME ftRequested, ftReceived;
 
 	__try
 	{
@@ -1096,31 +1016,14 @@ void VerifySPN( char* pszSPN )
 		o_printf( "" );
 		o_printf( "Attempting to manually verify Kerberos ticket for SPN" );
 
-		// Connect to LSA.
-		Status = pfnLsaConnectUntrusted( &hLogonHandle );
-		if ( !SEC_SUCCESS( Status ) ) 
-		{
-			o_printf( "LsaConnectUntrusted failed, Status=0x%08x", Status );
-			goto VerifySPNExit;
-		}
+		// Connect to LSA and get the Kerberos package, the session is shared with the other
+		// Kerberos checks and closed at the end of the test.
+		if ( !KerbSessionOpen( &hLogonHandle, &ulPackageId ) ) goto VerifySPNExit;
 
 		g_STATUS.fLsaConnectUntrusted = TRUE;
 
 		o_printf( "Attempting to get TGT" );
 
-		// Get the Kerberos package.
-		Name.Buffer = MICROSOFT_KERBEROS_NAME_A;
-		Name.Length = (USHORT) strlen(Name.Buffer);
-		Name.MaximumLength = Name.Length + 1;
-		Status = pfnLsaLookupAuthenticationPackage( hLogonHandle,
-													&Name,
-													&ulPackageId );
-		if ( !SEC_SUCCESS(Status) ) 
-		{
-			o_printf( "LsaLookupAuthenticationPackage failed, Status=0x%08x\n", Status );
-			goto VerifySPNExit;
-		}
-
 		// See if we can get the TGT first.
 		ZeroMemory( &tgtCacheRequest, sizeof(tgtCacheRequest) );
 		tgtCacheRequest.MessageType      = KerbRetrieveTicketMessage; // Retrieve TGT message
@@ -1192,6 +1095,7 @@ void VerifySPN( char* pszSPN )
 		o_printf( "Attempting to get ticket to SPN with KERB_RETRIEVE_TICKET_DONT_USE_CACHE (meaning don't use ticket from cache)" );
 
 		// Request ticket.
+		GetSystemTimeAsFileTime( &ftRequested );
 		Status = pfnLsaCallAuthenticationPackage( hLogonHandle,              // [IN] LSA connection handle
 												 ulPackageId,                // [IN] Kerberos package ID
 												 pCacheRequest,              // [IN] Request message
@@ -1199,6 +1103,7 @@ void VerifySPN( char* pszSPN )
 												 (PVOID *) &pCacheResponse,  // [OUT] Response buffer
 												 &ulResponseSize,            // [OUT] Response length
 												 &SubStatus );               // [OUT] Completion status
+		GetSystemTimeAsFileTime( &ftReceived );
 
 		if ( ( !SEC_SUCCESS(Status) ) || ( !SEC_SUCCESS(SubStatus) ) )
 		{
@@ -1221,6 +1126,9 @@ void VerifySPN( char* pszSPN )
 			o_printf( "Successfully retrieved ticket for SPN, displaying SPN ticket" );
 			pExTicket = &(pCacheResponse->Ticket);
 			DumpKERB_EXTERNAL_TICKET( pExTicket );
+
+			// The KDC just issued this ticket, it is also the first clock skew sample.
+			ClockSkewFromTicket( pExTicket, &ftRequested, &ftReceived );
 		}
 
 	VerifySPNExit:
@@ -1253,173 +1161,212 @@ void VerifySPN( char* pszSPN )
 
 }
 
-// Purges a ticket from Kerberos ticket cache.
-BOOL PurgeTicket( HANDLE LogonHandle, ULONG PackageId, LPWSTR Server, DWORD cbServer, LPWSTR Realm, DWORD cbRealm )
+// Asks the KDC for a ticket for every SPN the target could be registered under (the one the driver
+// used, FQDN, name as typed, CNAME aliases and short names, each with the port, the instance name or
+// nothing), a few at a time.  Shows which forms resolve when the driver's SPN does not.
+void VerifySPNVariants( const char* pszServer, int port )
 {
-    NTSTATUS Status;
-    PVOID Response;
-    ULONG ResponseSize;
-    NTSTATUS SubStatus=0;
-
-    PKERB_PURGE_TKT_CACHE_REQUEST pCacheRequest = NULL;
+	SPN_TARGET Target;
+	SPN_CANDIDATE rgCandidates[SPN_MAX_CANDIDATES];
+	const char* rgpszSPNs[SPN_MAX_CANDIDATES];
+	KERB_TICKET_RESULT rgResults[SPN_MAX_CANDIDATES];
+	char szHost[256], szInstance[128], szFqdn[256];
+	char rgszAliases[SPN_MAX_ALIASES][256];
+	char szErrorBuffer[1024];
+	char szResult[256];
+	char szSummary[512];
+	double rgdMs[SPN_MAX_CANDIDATES];
+	PERF_SAMPLES Samples;
+	PERF_SUMMARY Summary;
+	struct hostent* hostent = NULL;
+	uint32_t dwPort = 0;
+	DWORD cCandidates, cResolved = 0, cThreads, i, j;
+	BOOL fCapturedFailed = FALSE, fSplitOwners = FALSE, fDuplicate = FALSE, fRegistered = FALSE;
+	const DIR_SPN_ENTRY* pEntry = NULL;
+	const DIR_ACCOUNT* pAccount = NULL;
+	const DIR_ACCOUNT* pFirstOwner = NULL;
+	uint64_t ui64Start;
+	double dElapsedMs;
 
 	__try
 	{
+		if ( !g_fKerberosLoaded ) return;
 
-		pCacheRequest = (PKERB_PURGE_TKT_CACHE_REQUEST)	
-			LocalAlloc(LMEM_ZEROINIT, cbServer + cbRealm + sizeof(KERB_PURGE_TKT_CACHE_REQUEST));
-		if (pCacheRequest == NULL)
-		{
-			o_printf( "[PurgeTicket] LocalAlloc failed to allocate Memory.");
-			return FALSE;
-		}
-
-		pCacheRequest->MessageType		= KerbPurgeTicketCacheMessage;
-		pCacheRequest->LogonId.LowPart	= 0;
-		pCacheRequest->LogonId.HighPart = 0;
-
-		CopyMemory( (LPBYTE)pCacheRequest+sizeof(KERB_PURGE_TKT_CACHE_REQUEST),
-					Server,
-					cbServer );
-		CopyMemory( (LPBYTE)pCacheRequest+sizeof(KERB_PURGE_TKT_CACHE_REQUEST)+cbServer,
-					Realm,
-					cbRealm );
-
-		pCacheRequest->ServerName.Buffer = (LPWSTR)((LPBYTE)pCacheRequest+sizeof(KERB_PURGE_TKT_CACHE_REQUEST));
-
-		pCacheRequest->ServerName.Length = (unsigned short)cbServer;
-
-		pCacheRequest->ServerName.MaximumLength = (unsigned short)cbServer;
+		ZeroMemory( &Target, sizeof(Target) );
+		szFqdn[0] = '\0';
+		if ( !SpnParseServer( pszServer, szHost, sizeof(szHost), szInstance, sizeof(szInstance), &dwPort ) ) return;
+		if ( 0 != port ) dwPort = port;
 
-		pCacheRequest->RealmName.Buffer = (LPWSTR)((LPBYTE)pCacheRequest+sizeof(KERB_PURGE_TKT_CACHE_REQUEST)+cbServer);
-
-		pCacheRequest->RealmName.Length = (unsigned short)cbRealm;
-
-		pCacheRequest->RealmName.MaximumLength = (unsigned short)cbRealm;
-
-		Status = pfnLsaCallAuthenticationPackage( LogonHandle,
-												  PackageId,
-												  pCacheRequest,
-												  sizeof(KERB_PURGE_TKT_CACHE_REQUEST)+cbServer+cbRealm,
-												  &Response,
-												  &ResponseSize,
-												  &SubStatus );
-
-		if (!SEC_SUCCESS(Status) || !SEC_SUCCESS(Status))
+		// Canonical name and the CNAMEs DNS followed to get there, an IP address is only used
+		// through the name it resolved back to.
+		if ( INADDR_NONE == inet_addr( szHost ) )
 		{
-			return FALSE;
+			Target.pszInput = szHost;
+			hostent = gethostbyname( szHost );
+			if ( NULL != hostent )
+			{
+				lstrcpyn( szFqdn, hostent->h_name, sizeof(szFqdn) );
+				for ( i=0; NULL != hostent->h_aliases && NULL != hostent->h_aliases[i] && Target.cAliases < SPN_MAX_ALIASES; i++ )
+				{
+					if ( INADDR_NONE == inet_addr( hostent->h_aliases[i] ) )
+					{
+						lstrcpyn( rgszAliases[Target.cAliases], hostent->h_aliases[i], sizeof(rgszAliases[0]) );
+						Target.rgpszAliases[Target.cAliases] = rgszAliases[Target.cAliases];
+						Target.cAliases++;
+					}
+				}
+			}
 		}
 		else
 		{
-			return TRUE;
+			lstrcpyn( szFqdn, g_STATUS.g_szSavedFQDN, sizeof(szFqdn) );
 		}
-	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
-	{
-		o_printf( "[PurgeTicket] Unexpected error in PurgeTicket" );
-	}
 
-	return FALSE;
+		Target.pszService  = "MSSQLSvc";
+		Target.pszFqdn     = ( '\0' != szFqdn[0] ) ? szFqdn : NULL;
+		Target.dwPort      = dwPort;
+		Target.pszInstance = szInstance;
+		Target.pszCaptured = g_STATUS.g_szSavedSPN;
 
-}
+		cCandidates = SpnBuildCandidates( &Target, rgCandidates, SPN_MAX_CANDIDATES );
+		if ( 0 == cCandidates ) return;
+		for ( i=0; i<cCandidates; i++ ) rgpszSPNs[i] = rgCandidates[i].szSpn;
 
-void FlushAllKerberosTickets()
-{
-	NTSTATUS Status, SubStatus;
-	KERB_QUERY_TKT_CACHE_REQUEST CacheRequest;
-	ULONG ulResponseSize;
-	ULONG ulPackageId;
-	LSA_STRING Name;
-	HANDLE hLogonHandle = NULL;
-	PKERB_QUERY_TKT_CACHE_RESPONSE pTickets  = NULL;
-	PKERB_RETRIEVE_TKT_RESPONSE pTicketEntry = NULL;
-	PKERB_EXTERNAL_TICKET pExTicket			 = NULL;
-	PKERB_TICKET_CACHE_INFO pTicketCI        = NULL;
-	ULONG i;
-	BOOL fPurged;
-
-	__try
-	{
+		cThreads = (DWORD) GetTestOptionLong( "spnthreads", 4 );
+		if ( cThreads < 1 ) cThreads = 1;
+		if ( cThreads > KERB_MAX_THREADS ) cThreads = KERB_MAX_THREADS;
 
-		// Connect to LSA.
-		Status = pfnLsaConnectUntrusted( &hLogonHandle );
-		if ( !SEC_SUCCESS( Status ) ) 
-		{
-			// o_printf( "LsaConnectUntrusted failed, Status=0x%08x", Status );
-			goto FlushAllKerberosTicketsExit;
-		}
-
-		g_STATUS.fLsaConnectUntrusted = TRUE;
-
-		// Get the Kerberos package.
-		Name.Buffer = MICROSOFT_KERBEROS_NAME_A;
-		Name.Length = (USHORT) strlen(Name.Buffer);
-		Name.MaximumLength = Name.Length + 1;
-		Status = pfnLsaLookupAuthenticationPackage( hLogonHandle,
-													&Name,
-													&ulPackageId
-												  );
-		if ( !SEC_SUCCESS(Status) ) 
-		{
-			//o_printf( "LsaLookupAuthenticationPackage failed, Status=0x%08x", Status );
-			goto FlushAllKerberosTicketsExit;
-		}
-
-		g_STATUS.fLsaLookupAuthenticationPackage = TRUE;
+		o_printf( "" );
+		o_printf( "Verifying %lu candidate SPNs with the KDC, %lu at a time (the ticket cache is not used)", cCandidates, cThreads );
 
-		CacheRequest.MessageType = KerbQueryTicketCacheMessage;
-		CacheRequest.LogonId.LowPart = 0;
-		CacheRequest.LogonId.HighPart = 0;
+		ui64Start = PerfCounter();
+		KerbRequestTickets( rgpszSPNs, cCandidates, KERB_RETRIEVE_TICKET_DONT_USE_CACHE, cThreads, rgResults );
+		dElapsedMs = PerfElapsedMs( ui64Start );
 
-		Status = pfnLsaCallAuthenticationPackage( hLogonHandle,
-												  ulPackageId,
-												  &CacheRequest,
-												  sizeof(CacheRequest),
-												  (PVOID *) &pTickets,
-												  &ulResponseSize,
-												  &SubStatus );
-		if ( SEC_SUCCESS(Status) && SEC_SUCCESS(SubStatus) ) 
+		PerfSamplesInit( &Samples, rgdMs, SPN_MAX_CANDIDATES );
+		for ( i=0; i<cCandidates; i++ )
 		{
-			g_STATUS.fLsaCallAuthenticationPackage = TRUE;
-			for ( i=0; i<pTickets->CountOfTickets; i++ ) 
+			if ( rgResults[i].fTicket )
 			{
-				pTicketCI = &pTickets->Tickets[i];
-				fPurged = PurgeTicket( hLogonHandle,
- 									   ulPackageId,
-									   pTickets->Tickets[i].ServerName.Buffer,
-									   pTickets->Tickets[i].ServerName.Length,
-									   pTickets->Tickets[i].RealmName.Buffer,
-									   pTickets->Tickets[i].RealmName.Length );
+				cResolved++;
+				sprintf_s( szResult, sizeof(szResult), "ticket, %s", GetEncryptionTypeString( rgResults[i].lSessionKeyType ) );
 			}
-			pfnLsaFreeReturnBuffer( pTickets );
-			pTickets = NULL;
+			else if ( 0 == rgResults[i].ui64Start )
+			{
+				lstrcpyn( szResult, "not requested", sizeof(szResult) );
+			}
+			else
+			{
+				NTSTATUS Status = KerbResultStatus( &rgResults[i] );
+
+				if ( 0xc000018b == Status )
+				{
+					lstrcpyn( szResult, "0xc000018b, SPN not registered", sizeof(szResult) );
+				}
+				else if ( GetLSAStatusError( Status, szErrorBuffer, sizeof(szErrorBuffer) ) )
+				{
+					sprintf_s( szResult, sizeof(szResult), "0x%08x %.200s", Status, szErrorBuffer );
+				}
+				else
+				{
+					sprintf_s( szResult, sizeof(szResult), "0x%08x", Status );
+				}
+				if ( SPN_HOST_CAPTURED == rgCandidates[i].iHost ) fCapturedFailed = TRUE;
+			}
+			if ( 0 != rgResults[i].ui64Start ) PerfSamplesAdd( &Samples, KerbTicketMs( &rgResults[i] ) );
+
+			o_printf( "  %-60s %-10s %-13s %8.3f ms  %s", rgCandidates[i].szSpn,
+					  SpnHostName( rgCandidates[i].iHost ), SpnSuffixName( rgCandidates[i].iSuffix ),
+					  KerbTicketMs( &rgResults[i] ), szResult );
 		}
 
-FlushAllKerberosTicketsExit:
+		PerfSamplesSummarize( &Samples, &Summary );
+		o_printf( "%lu of %lu candidate SPNs resolved in %.3f ms, KDC round trip %s", cResolved, cCandidates, dElapsedMs,
+				  PerfSummaryFormat( &Summary, "ms", szSummary, sizeof(szSummary) ) );
 
-		if ( pTickets )
+		if ( fCapturedFailed && cResolved > 0 )
 		{
-			pfnLsaFreeReturnBuffer( pTickets );
-			pTickets = NULL;
+			o_printf( "WARNING! The SPN the driver used [%s] has no ticket but other forms above do.", g_STATUS.g_szSavedSPN );
+			o_printf( "         Register the driver's form with setspn -S, or connect with a name or ServerSPN that matches a registered one." );
 		}
-
-		if ( pTicketEntry )
+		else if ( 0 == cResolved )
 		{
-			pfnLsaFreeReturnBuffer( pTicketEntry );
-			pTicketEntry = NULL;
+			o_printf( "WARNING! No candidate SPN resolved, the SQL Server service account has no MSSQLSvc SPN for this server or the KDC cannot be reached." );
 		}
 
-		// if ( hLogonHandle ) pfnLsaDeregisterLogonProcess( hLogonHandle );
-		// o_printf( "[FlushAllKerberosTickets] Kerberos ticket flush complete." );
+		// One directory search for all of the candidates, the owners come from the run's cache.
+		if ( g_STATUS.fExecuteSearch && SUCCEEDED( DirLookupSPNs( rgpszSPNs, cCandidates ) ) )
+		{
+			o_printf( "Accounts the candidate SPNs are registered on:" );
+			for ( i=0; i<cCandidates; i++ )
+			{
+				pEntry = DirFindSPN( rgpszSPNs[i] );
+				if ( NULL == pEntry || !pEntry->fSearched || 0 == pEntry->cOwners ) continue;
 
+				for ( j=0; j<min( pEntry->cOwners, DIR_MAX_OWNERS ); j++ )
+				{
+					pAccount = DirGetAccount( pEntry->rgiOwners[j] );
+					fRegistered = TRUE;
+					if ( NULL == pAccount )
+					{
+						o_printf( "  %-60s account details not cached", rgpszSPNs[i] );
+						continue;
+					}
+					o_printf( "  %-60s %s", rgpszSPNs[i], pAccount->szSamAccountName );
+					if ( NULL == pFirstOwner ) pFirstOwner = pAccount;
+					else if ( pFirstOwner != pAccount ) fSplitOwners = TRUE;
+				}
+				if ( pEntry->cOwners > 1 ) fDuplicate = TRUE;
+			}
+			if ( !fRegistered )
+			{
+				o_printf( "  none, no candidate SPN is registered in the forest." );
+			}
+			if ( fDuplicate )
+			{
+				o_printf( "WARNING! A candidate SPN is registered on more than one account, the KDC fails ticket requests for it." );
+			}
+			else if ( fSplitOwners )
+			{
+				o_printf( "WARNING! The candidate SPNs are registered on different accounts, only the forms on the SQL Server service account work." );
+			}
+		}
 	}
 	__except(EXCEPTION_EXECUTE_HANDLER)
 	{
-		// o_printf( "[FlushAllKerberosTickets] Unexpected error in FlushAllKerberosTickets" );
+		o_printf( "[VerifySPNVariants] Unexpected error verifying SPN variants" );
 	}
+}
+
+// Purges the Kerberos tickets the purgeservice, purgerealm and purgeexpired options select, all
+// of them when none is set.  Returns the number purged, pszSummary gets a line for each of them.
+DWORD FlushKerberosTickets( char* pszSummary, size_t cchSummary )
+{
+	TICKET_PURGE_FILTER Filter;
+	TICKET_PURGE_RESULT Result;
+	char szFilter[256];
+
+	GetTicketPurgeFilter( &Filter );
+	FormatTicketPurgeFilter( &Filter, szFilter, sizeof(szFilter) );
+	o_printf( "Purging %s from the Kerberos ticket cache.", szFilter );
 
-	// o_printf( "" );
+	if ( !PurgeTickets( &Filter, &Result ) )
+	{
+		sprintf_s( pszSummary, cchSummary, "Could not read the Kerberos ticket cache, status 0x%08x.", Result.LastError );
+		o_printf( "%s", pszSummary );
+		return 0;
+	}
 
+	g_STATUS.fLsaConnectUntrusted = TRUE;
+	g_STATUS.fLsaLookupAuthenticationPackage = TRUE;
+	g_STATUS.fLsaCallAuthenticationPackage = TRUE;
+
+	sprintf_s( pszSummary, cchSummary, "Purged %lu of %lu tickets (%s) in %.3f ms%s.\r\n\r\n%s",
+			   Result.cPurged, Result.cTickets, szFilter, Result.dMs,
+			   ( Result.cFailed > 0 ) ? ", some purges failed" : "", Result.szPurged );
+	o_printf( "Purged %lu of %lu tickets in %.3f ms, %lu matched, %lu failed.", Result.cPurged, Result.cTickets, Result.dMs, Result.cMatched, Result.cFailed );
+	o_printf( "" );
+	return Result.cPurged;
 }
 
 void CheckKeyFiles()
@@ -1538,12 +1485,17 @@ void CSSPIClientDlg::OnBtnConnect()
 	CString strMessage;
 	HENV henv   = NULL;
 	HDBC hdbc   = NULL;
-	HSTMT hstmt = NULL;
 	RETCODE rc;
 	SQLCHAR szConnectIn[2048];
 	SQLCHAR szConnectOut[2048];
+	char szConnectLog[2048];
+	char szPurgeSummary[TICKET_PURGE_LIST_SIZE + 256];
+	SQL_TARGET Target;
+	uint64_t ui64LoginStart;
+	double dLoginMs;
 	SQLSMALLINT ssicbConnStringOut;
 	BOOL fConnected = FALSE;
+	NEGO_EXCHANGE NegoExchange;
 	int index, port;
 	BOOL fUserSetProtocol = FALSE;
 	CString strActualConnect, strTempConnect;
@@ -1610,7 +1562,32 @@ void CSSPIClientDlg::OnBtnConnect()
 	strActualConnect = m_strConnect;
 	m_strConnect = strTempConnect;
 
+	// Target for the connection string, the protocol defaults to tcp.
+	ZeroMemory( &Target, sizeof(Target) );
+	index = strActualConnect.Find(":");
+	if ( index > -1 )
+	{
+		lstrcpyn( Target.szProtocol, strActualConnect.Left( index ), sizeof(Target.szProtocol) );
+		lstrcpyn( Target.szServer, strActualConnect.Mid( index+1 ), sizeof(Target.szServer) );
+	}
+	else
+	{
+		lstrcpy( Target.szProtocol, "tcp" );
+		lstrcpyn( Target.szServer, strActualConnect, sizeof(Target.szServer) );
+	}
+	Target.fIntegrated = m_fUseIntegrated;
+	Target.fEncrypt = m_fEncryptionTest;
+	lstrcpyn( Target.szUserId, m_strUserId, sizeof(Target.szUserId) );
+	lstrcpyn( Target.szPassword, m_strPassword, sizeof(Target.szPassword) );
+
 	ZeroMemory( &g_STATUS, sizeof(g_STATUS) );
+	SetTestOptions( m_strOptions.GetBuffer(0) );
+	NetlibStatsReset();
+	TlsStatsReset();
+	NegoStatsReset();
+	TokenStatsReset();
+	ClockSkewReset();
+	CertCacheReset();
 
 	hr = OpenLogFile( m_strLogFile.GetBuffer(0) );
 	if ( FAILED(hr) )
@@ -1622,12 +1599,23 @@ void CSSPIClientDlg::OnBtnConnect()
 	o_printf( "*** Opening SSPIClient log v.2022.10.07 PID=%lu ***", GetCurrentProcessId() );
 	o_printf( "" );
 
+	if ( m_strOptions.GetLength() > 0 )
+	{
+		o_printf( "Test options: [%s]", m_strOptions.GetBuffer(0) );
+		o_printf( "" );
+	}
+
 	// Dump out what sort of test we are performing.
 	if ( m_fEncryptionTest )
 	{
 		o_printf( "User clicked 'Run Client Certificate Test' button to test an encrypted connection and certificate validation." );
 		o_printf( "" );
 	}
+	else if ( SQL_TEST_NONE != m_iSelectedTest )
+	{
+		o_printf( "User clicked 'Run Selected Test' button for test '%s'.", GetSQLTestName( m_iSelectedTest ) );
+		o_printf( "" );
+	}
 	else
 	{
 		o_printf( "User clicked 'Run SSPI Connection Test' button." );
@@ -1652,10 +1640,17 @@ void CSSPIClientDlg::OnBtnConnect()
 	// Perform forward, reverse lookup of SQL Server name/IP.
 	VerifySQLServerInfo( m_strConnect.GetBuffer(0) );
 
-	// Dump all kerberos tickets prior to connection attempt.
+	// Snapshot the kerberos tickets prior to connection attempt, the full dump is optional.
 	if ( g_fKerberosLoaded )
 	{
-		if ( m_fUseIntegrated ) DumpKerberosTickets();
+		if ( m_fUseIntegrated )
+		{
+			if ( GetTestOptionBool( "ticketdump", FALSE ) ) DumpKerberosTickets();
+			if ( GetTestOptionBool( "purgebefore", FALSE ) ) FlushKerberosTickets( szPurgeSummary, sizeof(szPurgeSummary) );
+			PrewarmServiceTickets();
+			TicketCacheBaseline();
+			TicketWatchStart( (DWORD) max( GetTestOptionLong( "ticketwatch", 0 ), 0 ) );
+		}
 	}
 	else
 	{
@@ -1672,92 +1667,16 @@ void CSSPIClientDlg::OnBtnConnect()
 	rc = SQLAllocConnect( henv, &hdbc );
 
 	// Select driver.  By default just use SQL Server driver (MDAC version).
-	pszDriver = "SQL Server";
-
-	if ( m_fUseSQLNCLI )
-	{
-		// Check which version of SNAC is available and try to use latest.
-		o_printf( "Attempting to connect using the latest driver.");
-		if ( g_STATUS.fSnac9Available )
-		{
-			pszDriver = "SQL Native Client";
-			o_printf( "Detected SNAC9." );
-		}
-
-		if ( g_STATUS.fSnac10Available )
-		{
-			pszDriver = "SQL Server Native Client 10.0";
-			o_printf( "Detected SNAC10." );
-		}
-
-		if (g_STATUS.fSnac11Available)
-		{
-			pszDriver = "SQL Server Native Client 11.0";
-			o_printf("Detected SNAC11.");
-		}
-
-		if (g_STATUS.fodbc11Available)
-		{
-			pszDriver = "ODBC Driver 11 for SQL Server";
-			o_printf("Detected ODBC Driver 11.");
-		}
-
-		if (g_STATUS.fodbc13Available)
-		{
-			pszDriver = "ODBC Driver 13 for SQL Server";
-			o_printf("Detected ODBC Driver 13.");
-		}
-
-		if (g_STATUS.fodbc17Available)
-		{
-			pszDriver = "ODBC Driver 17 for SQL Server";
-			o_printf("Detected ODBC Driver 17.");
-		}
-
-		if (g_STATUS.fodbc18Available)
-		{
-			pszDriver = "ODBC Driver 18 for SQL Server";
-			o_printf("Detected ODBC Driver 18.");
-		}
+	pszDriver = SelectODBCDriver( m_fUseSQLNCLI );
+	Target.pszDriver = pszDriver;
 
-		o_printf( "Selected latest detected Driver=%s.", pszDriver );
-	}
-
-	if ( m_fUseIntegrated )
-	{
-		// Create connection string using integrated security.
-		sprintf_s( (char*)szConnectIn, sizeof(szConnectIn),
-				 "Driver=%s;Server=%s%s;Trusted_Connection=Yes;%s",
-				  pszDriver,
-				  ( fUserSetProtocol ) ? "" : "tcp:",
-				  strActualConnect.GetBuffer(0),
-				  ( m_fEncryptionTest ) ? "Encrypt=Yes;" : "Encrypt=No" );   // explicitly turn it off since the ODBC Driver 18 and later enable encryption by default
-		strTempConnect = szConnectIn;
-	}
-	else
-	{
-		// Create connection string using userid and password (standard login).
-		sprintf_s( (char*)szConnectIn, sizeof(szConnectIn),
-				 "Driver=%s;Server=%s%s;UID=%s;PWD=%s;%s",
-				  pszDriver,
-				  ( fUserSetProtocol ) ? "" : "tcp:",
-				  strActualConnect.GetBuffer(0),
-				  m_strUserId.GetBuffer(0),
-				  m_strPassword.GetBuffer(0),
-				  ( m_fEncryptionTest ) ? "Encrypt=Yes;" : "Encrypt=No" );    // explicitly turn it off since the ODBC Driver 18 and later enable encryption by default
-
-		strTempConnect.Format( "Driver=%s;Server=%s%s;UID=%s;PWD=*****;%s",
-							   pszDriver,
-							   ( fUserSetProtocol ) ? "" : "tcp:",
-							   strActualConnect.GetBuffer(0),
-							   m_strUserId.GetBuffer(0),
-							   ( m_fEncryptionTest ) ? "Encrypt=Yes;" : "Encrypt=No" );   // explicitly turn it off since the ODBC Driver 18 and later enable encryption by default
-
-	}
+	BuildConnectString( &Target, FALSE, (char*) szConnectIn, sizeof(szConnectIn) );
+	BuildConnectString( &Target, TRUE, szConnectLog, sizeof(szConnectLog) );
 	
-	o_printf( "Connecting via ODBC to [%s]", strTempConnect.GetBuffer(0) );
+	o_printf( "Connecting via ODBC to [%s]", szConnectLog );
 
 	ssicbConnStringOut = 0;
+	ui64LoginStart = PerfCounter();
 	rc = SQLDriverConnect( hdbc, 
 						   m_hWnd, 
 						   szConnectIn, 
@@ -1766,6 +1685,7 @@ void CSSPIClientDlg::OnBtnConnect()
 						   sizeof(szConnectOut), 
 						   &ssicbConnStringOut, 
 						   SQL_DRIVER_NOPROMPT );
+	dLoginMs = PerfElapsedMs( ui64LoginStart );
 
 	if ( !SQL_SUCCEEDED(rc) )
 	{
@@ -1777,11 +1697,9 @@ void CSSPIClientDlg::OnBtnConnect()
 		g_STATUS.fODBCConnected = TRUE;
 		fConnected = TRUE;
 
-		// Send over a test SQL statement (will be used later to check for encryption).
-		rc = SQLAllocStmt( hdbc, &hstmt );
-		rc = SQLExecDirect( hstmt, (SQLCHAR*)"SELECT '**** SSPICLIENT SUCCESS ****'", SQL_NTS );
-		rc = SQLFreeStmt( hstmt, SQL_DROP );
-		hstmt = NULL;
+		// Send over a test SQL statement (will be used later to check for encryption), followed
+		// by timed round trips (and a bulk fetch with bulkrows) to tell network latency from login latency.
+		RunRoundTripProbe( hdbc, dLoginMs );
 
 		o_printf( "" );
 		o_printf( "Successfully connected to SQL Server '%s'", m_strConnect.GetBuffer(0) );
@@ -1795,6 +1713,25 @@ void CSSPIClientDlg::OnBtnConnect()
 		// Temporarily supress output from detours (cleans up some junk output).
 		g_fSupressOutput = TRUE;
 
+		// fUsedKerberos is set by the ISC hook from the tokens it decoded and the package the
+		// context ended up with, see DumpAuthToken.  A login that failed before a token was sent
+		// (server not found, TLS error) says nothing about Kerberos.
+		DumpNegoExchange();
+		o_printf( "" );
+		if ( g_STATUS.fUsedKerberos )
+		{
+			o_printf( "Login used Kerberos." );
+		}
+		else if ( !fConnected && ( !NegoGetLastExchange( &NegoExchange ) || 0 == NegoExchangeRoundTrips( &NegoExchange ) ) )
+		{
+			o_printf( "Authentication was not reached, the login failed before any token was exchanged." );
+		}
+		else
+		{
+			o_printf( "WARNING! Login did not use Kerberos%s%s, see the NTLM fallback lines above.",
+					  ( '\0' != g_STATUS.szNegotiatedPackage[0] ) ? ", negotiated package " : "", g_STATUS.szNegotiatedPackage );
+		}
+
 		// See if SPN was located, if not, try to build a fake one.
 		if ( 0 == lstrlen(g_STATUS.g_szSavedSPN) )
 		{
@@ -1824,18 +1761,51 @@ void CSSPIClientDlg::OnBtnConnect()
 			FindSPNViaAD( g_STATUS.g_szSavedSPN );
 		}
 
+		// Try the other SPNs the server could be registered under, a TGS request each so only on request.
+		if ( GetTestOptionBool( "spnvariants", FALSE ) )
+		{
+			VerifySPNVariants( m_strConnect.GetBuffer(0), ( strActualConnect.Find(",") > -1 ) ? port : 0 );
+		}
 
-		// Dump all kerberos tickets after to connection attempt.
+		// Every duplicate in the forest, not only the target's SPN.
+		if ( GetTestOptionBool( "spnaudit", FALSE ) ) RunSpnAudit();
+
+		// Log what the connection attempt changed in the ticket cache, the full dump is optional.
 		if ( g_fKerberosLoaded )
 		{
 			o_printf( "" );
-			DumpKerberosTickets();
+			DumpTicketCacheChanges();
+			if ( GetTestOptionBool( "ticketdump", FALSE ) ) DumpKerberosTickets();
 		}
 
 	}
 
+	// Clock skew against the KDC and the server once the SPN is settled, repeated with skewsamples
+	// for a monitoring run.
+	if ( fConnected ) RunClockSkewMonitor( hdbc, ( m_fUseIntegrated ) ? g_STATUS.g_szSavedSPN : "" );
+
+	// Run the measured test picked with the "Run Selected Test" button, only against a server
+	// that accepted the login.
+	if ( SQL_TEST_NONE != m_iSelectedTest )
+	{
+		g_fSupressOutput = FALSE;
+		if ( fConnected )
+		{
+			RunSQLTest( m_iSelectedTest, &Target );
+		}
+		else
+		{
+			o_printf( "" );
+			o_printf( "Skipping the selected test, the connection test could not log in." );
+		}
+	}
+
 SSPITestExit:
 
+	TicketWatchStop();
+	KerbSessionClose();
+	DirSessionClose();
+
 	if ( NULL != hdbc )
 	{
 		if ( fConnected ) SQLDisconnect( hdbc );
@@ -1849,6 +1819,24 @@ SSPITestExit:
 		henv = NULL;
 	}
 
+	SecureZeroMemory( szConnectIn, sizeof(szConnectIn) );
+	SecureZeroMemory( &Target, sizeof(Target) );
+
+	// Report dbnetlib connections that were not closed through ConnectionClose, and the last
+	// TLS handshake, which is otherwise reported when the next one starts.
+	DumpNetlibStats();
+	DumpTlsHandshake();
+	DumpNegoExchange();
+	DumpTokenStats();
+	DumpClockSkew();
+	DumpCertCache();
+	if ( HasTestOption( "certscan" ) )
+	{
+		char szCertStore[64];
+		GetTestOptionString( "certscan", "MY", szCertStore, sizeof(szCertStore) );
+		ScanCertStoreNames( szCertStore, g_STATUS.g_szSavedFQDN );
+	}
+
 	o_printf( "*** Closing SSPIClient log v.2021.08.13 PID %lu ***", GetCurrentProcessId() );
 	CloseLogFile();
 	g_fSupressOutput = FALSE;
@@ -1895,8 +1883,15 @@ void CSSPIClientDlg::OnLButtonDblClk(UINT nFlags, CPoint point)
 }
 void CSSPIClientDlg::OnBnClickedBtnConnect2()
 {
-	// Flush all kerberos tickets for client.
-	FlushAllKerberosTickets();
+	char szSummary[TICKET_PURGE_LIST_SIZE + 256];
+
+	// Flush the client's Kerberos tickets, the options can narrow it down to e.g. the SQL Server tickets.
+	// No log is open outside the connection test, so the message box is the only report.
+	UpdateData( TRUE );
+	SetTestOptions( m_strOptions.GetBuffer(0) );
+	FlushKerberosTickets( szSummary, sizeof(szSummary) );
+	KerbSessionClose();
+	MessageBox( szSummary, "SSPIClient", MB_ICONINFORMATION );
 }
 
 void CSSPIClientDlg::OnBnClickedCheck1()
@@ -1920,7 +1915,25 @@ void CSSPIClientDlg::OnBnClickedCheck1()
 
 void CSSPIClientDlg::OnBnClickedBtnConnect3()
 {
+	// After the certificate checks, measure what encryption costs against the same server.
 	m_fEncryptionTest = TRUE;
+	m_iSelectedTest = SQL_TEST_ENCRYPTION;
 	OnBtnConnect();
+	m_iSelectedTest = SQL_TEST_NONE;
 	m_fEncryptionTest = FALSE;
 }
+
+void CSSPIClientDlg::OnBnClickedBtnRunTest()
+{
+	int iItem = m_cmbTest.GetCurSel();
+
+	if ( CB_ERR == iItem )
+	{
+		MessageBox( "Please select a test to run.", "SSPIClient" );
+		return;
+	}
+
+	m_iSelectedTest = (int) m_cmbTest.GetItemData( iItem );
+	OnBtnConnect();
+	m_iSelectedTest = SQL_TEST_NONE;
+}
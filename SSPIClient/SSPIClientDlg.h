@@ -48,6 +48,10 @@ public:
 	afx_msg void OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
 	afx_msg void OnSysKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
 	BOOL m_fUseSQLNCLI;
+	CString m_strOptions;
+	CComboBox m_cmbTest;
+	int m_iSelectedTest;
+	afx_msg void OnBnClickedBtnRunTest();
 };
 
 //{{AFX_INSERT_LOCATION}}
@@ -0,0 +1,841 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// SharedMemTransport.cpp: shared memory request/response transport modelled on the dbnetlib
+// shared memory netlib (QUERY_INFO header, posted/completed events).
+//
+// Built without the precompiled header.  With SMBENCH_STANDALONE defined it also builds a
+// benchmark comparing the event and spin variants against TCP loopback, e.g.
+//   g++ -O2 -DSMBENCH_STANDALONE SharedMemTransport.cpp PerfStats.cpp -o smbench -lrt -lpthread
+//   ./smbench -n 20000 -m 512
+//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SharedMemTransport.h"
+
+// The header counters are the only thing shared without a lock: writers store them with
+// release semantics after copying the data, readers load them with acquire semantics.
+#if defined(_MSC_VER)
+#define SM_LOAD(p)			( *(p) )					// volatile has acquire/release semantics with /volatile:ms
+#define SM_STORE(p, v)		( *(p) = (v) )
+#define SM_PAUSE()			_mm_pause()
+#else
+#define SM_LOAD(p)			__atomic_load_n( (p), __ATOMIC_ACQUIRE )
+#define SM_STORE(p, v)		__atomic_store_n( (p), (v), __ATOMIC_RELEASE )
+#if defined(__i386__) || defined(__x86_64__)
+#define SM_PAUSE()			__builtin_ia32_pause()
+#else
+#define SM_PAUSE()			do {} while ( 0 )
+#endif
+#endif
+
+// Layout of the mapping: header, synchronization area (semaphores on Linux), client data, server data.
+#define SM_HEADER_AREA		256
+#define SM_SYNC_AREA		256
+
+static size_t SmMappingSize( uint32_t cbBuffer )
+{
+	return SM_HEADER_AREA + SM_SYNC_AREA + 2 * (size_t) cbBuffer;
+}
+
+static void SmSetPointers( SM_CHANNEL* pChannel )
+{
+	uint8_t* pb = (uint8_t*) pChannel->pvMapping;
+	pChannel->pQueryInfo   = (SM_QUERY_INFO*) pb;
+	pChannel->pbClientData = pb + SM_HEADER_AREA + SM_SYNC_AREA;
+	pChannel->pbServerData = pChannel->pbClientData + pChannel->pQueryInfo->dwBufferSize;
+}
+
+#ifdef _WIN32
+
+static void SmYield( void )
+{
+	SwitchToThread();
+}
+
+static uint32_t SmCpuCount( void )
+{
+	SYSTEM_INFO si;
+	GetSystemInfo( &si );
+	return si.dwNumberOfProcessors;
+}
+
+static void SmSignal( SM_CHANNEL* pChannel, int iEvent )
+{
+	SetEvent( (HANDLE) pChannel->rgpvEvents[iEvent] );
+}
+
+static void SmWaitEvent( SM_CHANNEL* pChannel, int iEvent )
+{
+	WaitForSingleObject( (HANDLE) pChannel->rgpvEvents[iEvent], INFINITE );
+}
+
+static int SmOpenEvents( SM_CHANNEL* pChannel )
+{
+	char szEvent[96];
+	int i;
+
+	for ( i=0; i<SM_EVENT_COUNT; i++ )
+	{
+		snprintf( szEvent, sizeof(szEvent), "Local\\%s_%d", pChannel->szName, i );
+		pChannel->rgpvEvents[i] = CreateEventA( NULL, FALSE, FALSE, szEvent );
+		if ( NULL == pChannel->rgpvEvents[i] ) return (int) GetLastError();
+	}
+	return 0;
+}
+
+static int SmMap( SM_CHANNEL* pChannel, uint32_t cbBuffer, int fCreate )
+{
+	char szMapping[96];
+
+	snprintf( szMapping, sizeof(szMapping), "Local\\%s", pChannel->szName );
+
+	if ( fCreate )
+	{
+		pChannel->cbMapping = SmMappingSize( cbBuffer );
+		pChannel->hMapping  = CreateFileMappingA( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD) pChannel->cbMapping, szMapping );
+	}
+	else
+	{
+		pChannel->hMapping  = OpenFileMappingA( FILE_MAP_ALL_ACCESS, FALSE, szMapping );
+	}
+	if ( NULL == pChannel->hMapping ) return (int) GetLastError();
+
+	pChannel->pvMapping = MapViewOfFile( (HANDLE) pChannel->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0 );
+	if ( NULL == pChannel->pvMapping ) return (int) GetLastError();
+
+	if ( fCreate ) pChannel->pQueryInfo = (SM_QUERY_INFO*) pChannel->pvMapping;
+	return SmOpenEvents( pChannel );
+}
+
+static void SmUnmap( SM_CHANNEL* pChannel )
+{
+	int i;
+
+	for ( i=0; i<SM_EVENT_COUNT; i++ )
+	{
+		if ( NULL != pChannel->rgpvEvents[i] ) CloseHandle( (HANDLE) pChannel->rgpvEvents[i] );
+	}
+	if ( NULL != pChannel->pvMapping ) UnmapViewOfFile( pChannel->pvMapping );
+	if ( NULL != pChannel->hMapping )  CloseHandle( (HANDLE) pChannel->hMapping );
+}
+
+#else
+
+static void SmYield( void )
+{
+	sched_yield();
+}
+
+static uint32_t SmCpuCount( void )
+{
+	long cCpus = sysconf( _SC_NPROCESSORS_ONLN );
+	return ( cCpus > 0 ) ? (uint32_t) cCpus : 1;
+}
+
+static void SmSignal( SM_CHANNEL* pChannel, int iEvent )
+{
+	sem_post( (sem_t*) pChannel->rgpvEvents[iEvent] );
+}
+
+static void SmWaitEvent( SM_CHANNEL* pChannel, int iEvent )
+{
+	while ( 0 != sem_wait( (sem_t*) pChannel->rgpvEvents[iEvent] ) && EINTR == errno ) {}
+}
+
+// POSIX shared memory, the "events" are process shared semaphores kept in the mapping itself.
+static int SmMap( SM_CHANNEL* pChannel, uint32_t cbBuffer, int fCreate )
+{
+	char szMapping[96];
+	struct stat st;
+	sem_t* pSem;
+	int fd, i;
+
+	snprintf( szMapping, sizeof(szMapping), "/%s", pChannel->szName );
+
+	fd = shm_open( szMapping, ( fCreate ) ? ( O_CREAT | O_EXCL | O_RDWR ) : O_RDWR, 0600 );
+	if ( fd < 0 ) return errno;
+
+	if ( fCreate )
+	{
+		pChannel->cbMapping = SmMappingSize( cbBuffer );
+		if ( 0 != ftruncate( fd, (off_t) pChannel->cbMapping ) )
+		{
+			close( fd );
+			return errno;
+		}
+	}
+	else
+	{
+		if ( 0 != fstat( fd, &st ) )
+		{
+			close( fd );
+			return errno;
+		}
+		pChannel->cbMapping = (size_t) st.st_size;
+	}
+
+	pChannel->pvMapping = mmap( NULL, pChannel->cbMapping, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( MAP_FAILED == pChannel->pvMapping )
+	{
+		pChannel->pvMapping = NULL;
+		return errno;
+	}
+
+	pSem = (sem_t*) ( (uint8_t*) pChannel->pvMapping + SM_HEADER_AREA );
+	for ( i=0; i<SM_EVENT_COUNT; i++ )
+	{
+		pChannel->rgpvEvents[i] = &pSem[i];
+		if ( fCreate && 0 != sem_init( &pSem[i], 1, 0 ) ) return errno;
+	}
+	return 0;
+}
+
+static void SmUnmap( SM_CHANNEL* pChannel )
+{
+	char szMapping[96];
+
+	if ( NULL != pChannel->pvMapping ) munmap( pChannel->pvMapping, pChannel->cbMapping );
+	if ( pChannel->fServer )
+	{
+		snprintf( szMapping, sizeof(szMapping), "/%s", pChannel->szName );
+		shm_unlink( szMapping );
+	}
+}
+
+#endif
+
+// The server creates the mapping, like SQL Server does for the lpc: protocol.
+int SmCreate( SM_CHANNEL* pChannel, const char* pszName, uint32_t cbBuffer, int iMode )
+{
+	int rc;
+
+	if ( NULL == pChannel || NULL == pszName ) return -1;
+	memset( pChannel, 0, sizeof(SM_CHANNEL) );
+	snprintf( pChannel->szName, sizeof(pChannel->szName), "%s", pszName );
+	pChannel->fServer = 1;
+	pChannel->iMode   = iMode;
+	pChannel->cSpinLimit = ( SmCpuCount() > 1 ) ? SM_SPIN_LIMIT : 0;
+	if ( 0 == cbBuffer ) cbBuffer = SM_DEFAULT_BUFFER_SIZE;
+
+	rc = SmMap( pChannel, cbBuffer, 1 );
+	if ( 0 != rc )
+	{
+		SmUnmap( pChannel );
+		return rc;
+	}
+
+	pChannel->pQueryInfo = (SM_QUERY_INFO*) pChannel->pvMapping;
+	memset( pChannel->pQueryInfo, 0, sizeof(SM_QUERY_INFO) );
+	pChannel->pQueryInfo->dwBufferSize = cbBuffer;
+	SmSetPointers( pChannel );
+	return 0;
+}
+
+int SmOpen( SM_CHANNEL* pChannel, const char* pszName, int iMode )
+{
+	int rc;
+
+	if ( NULL == pChannel || NULL == pszName ) return -1;
+	memset( pChannel, 0, sizeof(SM_CHANNEL) );
+	snprintf( pChannel->szName, sizeof(pChannel->szName), "%s", pszName );
+	pChannel->fServer = 0;
+	pChannel->iMode   = iMode;
+	pChannel->cSpinLimit = ( SmCpuCount() > 1 ) ? SM_SPIN_LIMIT : 0;
+
+	rc = SmMap( pChannel, 0, 0 );
+	if ( 0 != rc )
+	{
+		SmUnmap( pChannel );
+		return rc;
+	}
+	SmSetPointers( pChannel );
+	return 0;
+}
+
+// Waits until *pdwCount is non zero (fNonZero) or zero.  Returns -1 if the other side closed.
+static int SmWaitFor( SM_CHANNEL* pChannel, volatile uint32_t* pdwCount, int fNonZero, int iEvent )
+{
+	uint32_t cSpins = 0;
+
+	for ( ;; )
+	{
+		if ( ( 0 != SM_LOAD( pdwCount ) ) == ( 0 != fNonZero ) ) return 0;
+		if ( SM_LOAD( &pChannel->pQueryInfo->fClientOrServerClosed ) ) return -1;
+
+		if ( SM_MODE_SPIN == pChannel->iMode )
+		{
+			if ( cSpins < pChannel->cSpinLimit )
+			{
+				cSpins++;
+				SM_PAUSE();
+			}
+			else
+			{
+				SmYield();
+			}
+		}
+		else
+		{
+			// A stale signal only costs one more trip around the loop.
+			SmWaitEvent( pChannel, iEvent );
+		}
+	}
+}
+
+// Writes the whole buffer, in pieces of dwBufferSize, each waiting for the reader to take the previous one.
+int SmWrite( SM_CHANNEL* pChannel, const void* pvData, uint32_t cbData )
+{
+	SM_QUERY_INFO* pQI;
+	volatile uint32_t* pdwAvailable;
+	uint8_t* pbDest;
+	const uint8_t* pb = (const uint8_t*) pvData;
+	int iPosted, iCompleted;
+	uint32_t n;
+
+	if ( NULL == pChannel || NULL == pChannel->pQueryInfo ) return -1;
+	pQI = pChannel->pQueryInfo;
+
+	if ( pChannel->fServer )
+	{
+		pdwAvailable = &pQI->dwServerWriteBytesAvailable;
+		pbDest       = pChannel->pbServerData;
+		iPosted      = SM_EVENT_SERVER_WRITE_POSTED;
+		iCompleted   = SM_EVENT_CLIENT_READ_COMPLETED;
+	}
+	else
+	{
+		pdwAvailable = &pQI->dwClientWriteBytesAvailable;
+		pbDest       = pChannel->pbClientData;
+		iPosted      = SM_EVENT_CLIENT_WRITE_POSTED;
+		iCompleted   = SM_EVENT_SERVER_READ_COMPLETED;
+	}
+
+	while ( cbData > 0 )
+	{
+		if ( 0 != SmWaitFor( pChannel, pdwAvailable, 0, iCompleted ) ) return -1;
+
+		n = ( cbData < pQI->dwBufferSize ) ? cbData : pQI->dwBufferSize;
+		memcpy( pbDest, pb, n );
+		SM_STORE( pdwAvailable, n );
+		if ( SM_MODE_EVENT == pChannel->iMode ) SmSignal( pChannel, iPosted );
+
+		pb     += n;
+		cbData -= n;
+	}
+	return 0;
+}
+
+// Reads what the other side posted, up to cbMax bytes, waiting if nothing is there yet.
+int SmRead( SM_CHANNEL* pChannel, void* pvData, uint32_t cbMax, uint32_t* pcbRead )
+{
+	SM_QUERY_INFO* pQI;
+	volatile uint32_t* pdwAvailable;
+	const uint8_t* pbSource;
+	int iPosted, iCompleted;
+	uint32_t cbAvailable, n;
+
+	if ( NULL != pcbRead ) *pcbRead = 0;
+	if ( NULL == pChannel || NULL == pChannel->pQueryInfo ) return -1;
+	pQI = pChannel->pQueryInfo;
+
+	if ( pChannel->fServer )
+	{
+		pdwAvailable = &pQI->dwClientWriteBytesAvailable;
+		pbSource     = pChannel->pbClientData;
+		iPosted      = SM_EVENT_CLIENT_WRITE_POSTED;
+		iCompleted   = SM_EVENT_SERVER_READ_COMPLETED;
+	}
+	else
+	{
+		pdwAvailable = &pQI->dwServerWriteBytesAvailable;
+		pbSource     = pChannel->pbServerData;
+		iPosted      = SM_EVENT_SERVER_WRITE_POSTED;
+		iCompleted   = SM_EVENT_CLIENT_READ_COMPLETED;
+	}
+
+	if ( 0 != SmWaitFor( pChannel, pdwAvailable, 1, iPosted ) ) return -1;
+
+	cbAvailable = SM_LOAD( pdwAvailable );
+	n = cbAvailable - pChannel->cbReadOffset;
+	if ( n > cbMax ) n = cbMax;
+	memcpy( pvData, pbSource + pChannel->cbReadOffset, n );
+	pChannel->cbReadOffset += n;
+
+	if ( pChannel->cbReadOffset == cbAvailable )
+	{
+		pChannel->cbReadOffset = 0;
+		SM_STORE( pdwAvailable, 0 );
+		if ( SM_MODE_EVENT == pChannel->iMode ) SmSignal( pChannel, iCompleted );
+	}
+
+	if ( NULL != pcbRead ) *pcbRead = n;
+	return 0;
+}
+
+void SmClose( SM_CHANNEL* pChannel )
+{
+	int i;
+
+	if ( NULL == pChannel ) return;
+
+	// Wake up the other side so it sees fClientOrServerClosed.
+	if ( NULL != pChannel->pQueryInfo )
+	{
+		SM_STORE( &pChannel->pQueryInfo->fClientOrServerClosed, 1 );
+		for ( i=0; i<SM_EVENT_COUNT; i++ )
+		{
+			if ( NULL != pChannel->rgpvEvents[i] ) SmSignal( pChannel, i );
+		}
+	}
+	SmUnmap( pChannel );
+	memset( pChannel, 0, sizeof(SM_CHANNEL) );
+}
+
+#ifdef SMBENCH_STANDALONE
+
+#include "PerfStats.h"
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+typedef int SOCKET;
+#define INVALID_SOCKET		(-1)
+#define closesocket(s)		close(s)
+#endif
+
+#define BENCH_TCP			0
+#define BENCH_SHM_EVENT		1
+#define BENCH_SHM_SPIN		2
+#define BENCH_TRANSPORTS	3
+
+#define BENCH_OP_ECHO		1
+#define BENCH_OP_BULK		2
+#define BENCH_OP_QUIT		3
+
+#define BENCH_MAX_MESSAGE	( 64 * 1024 )
+
+static const char* g_rgpszTransports[BENCH_TRANSPORTS] = { "tcp loopback", "shm event", "shm spin" };
+static const uint32_t g_rgcbPing[]  = { 64, 1024, 8192 };
+static const uint32_t g_rgcbChunk[] = { 4096, 32767 };
+#define BENCH_PING_SIZES	( sizeof(g_rgcbPing) / sizeof(g_rgcbPing[0]) )
+#define BENCH_CHUNK_SIZES	( sizeof(g_rgcbChunk) / sizeof(g_rgcbChunk[0]) )
+
+typedef struct _BENCH_REQUEST
+{
+	uint32_t dwOp;
+	uint32_t cbChunk;
+	uint64_t cbTotal;
+} BENCH_REQUEST;
+
+typedef struct _BENCH_PEER
+{
+	int        iTransport;
+	SM_CHANNEL sm;
+	SOCKET     s;
+} BENCH_PEER;
+
+typedef struct _BENCH_RESULTS
+{
+	PERF_SUMMARY rgPing[BENCH_PING_SIZES];		// Round trip, microseconds
+	double       rgdBulk[BENCH_CHUNK_SIZES];		// MB/s
+} BENCH_RESULTS;
+
+static uint32_t g_cIterations = 20000;
+static uint64_t g_cbBulk      = 256ULL * 1024 * 1024;
+static uint32_t g_cbBuffer    = SM_DEFAULT_BUFFER_SIZE;
+static char     g_szName[64];
+
+static int PeerSend( BENCH_PEER* pPeer, const void* pv, uint32_t cb )
+{
+	const char* pb = (const char*) pv;
+	int n;
+
+	if ( BENCH_TCP != pPeer->iTransport ) return SmWrite( &pPeer->sm, pv, cb );
+	while ( cb > 0 )
+	{
+		n = send( pPeer->s, pb, (int) cb, 0 );
+		if ( n <= 0 ) return -1;
+		pb += n;
+		cb -= (uint32_t) n;
+	}
+	return 0;
+}
+
+// Receives exactly cb bytes.
+static int PeerRecv( BENCH_PEER* pPeer, void* pv, uint32_t cb )
+{
+	char* pb = (char*) pv;
+	uint32_t cbRead;
+	int n;
+
+	while ( cb > 0 )
+	{
+		if ( BENCH_TCP == pPeer->iTransport )
+		{
+			n = recv( pPeer->s, pb, (int) cb, 0 );
+			if ( n <= 0 ) return -1;
+			cbRead = (uint32_t) n;
+		}
+		else if ( 0 != SmRead( &pPeer->sm, pb, cb, &cbRead ) )
+		{
+			return -1;
+		}
+		pb += cbRead;
+		cb -= cbRead;
+	}
+	return 0;
+}
+
+static void PeerClose( BENCH_PEER* pPeer )
+{
+	if ( BENCH_TCP == pPeer->iTransport ) closesocket( pPeer->s );
+	else                                  SmClose( &pPeer->sm );
+}
+
+// Echoes pings and swallows bulk transfers until told to quit.
+static void RunServer( BENCH_PEER* pPeer )
+{
+	static uint8_t rgbBuffer[BENCH_MAX_MESSAGE];
+	BENCH_REQUEST req;
+	uint64_t cbLeft;
+	uint32_t n;
+	uint8_t bAck = 1;
+
+	while ( 0 == PeerRecv( pPeer, &req, sizeof(req) ) )
+	{
+		if ( BENCH_OP_ECHO == req.dwOp )
+		{
+			if ( 0 != PeerRecv( pPeer, rgbBuffer, req.cbChunk ) ) break;
+			if ( 0 != PeerSend( pPeer, rgbBuffer, req.cbChunk ) ) break;
+		}
+		else if ( BENCH_OP_BULK == req.dwOp )
+		{
+			for ( cbLeft = req.cbTotal; cbLeft > 0; cbLeft -= n )
+			{
+				n = ( cbLeft < req.cbChunk ) ? (uint32_t) cbLeft : req.cbChunk;
+				if ( 0 != PeerRecv( pPeer, rgbBuffer, n ) ) return;
+			}
+			if ( 0 != PeerSend( pPeer, &bAck, 1 ) ) break;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+static int RunClient( BENCH_PEER* pPeer, BENCH_RESULTS* pResults )
+{
+	static uint8_t rgbRequest[sizeof(BENCH_REQUEST) + BENCH_MAX_MESSAGE], rgbReply[BENCH_MAX_MESSAGE];
+	BENCH_REQUEST* pReq = (BENCH_REQUEST*) rgbRequest;
+	PERF_SAMPLES samples;
+	double* pdSamples;
+	uint64_t ui64Start, cbLeft;
+	uint32_t i, iSize, n;
+	int rc = 0;
+
+	pdSamples = (double*) malloc( g_cIterations * sizeof(double) );
+	if ( NULL == pdSamples ) return -1;
+	memset( rgbRequest, 0x5A, sizeof(rgbRequest) );
+
+	// Ping-pong: request and reply of the same size, like a small query and its result.
+	for ( iSize=0; iSize<BENCH_PING_SIZES && 0 == rc; iSize++ )
+	{
+		PerfSamplesInit( &samples, pdSamples, g_cIterations );
+		pReq->dwOp    = BENCH_OP_ECHO;
+		pReq->cbChunk = g_rgcbPing[iSize];
+		pReq->cbTotal = 0;
+		for ( i=0; i<g_cIterations && 0 == rc; i++ )
+		{
+			ui64Start = PerfCounter();
+			rc = PeerSend( pPeer, rgbRequest, sizeof(BENCH_REQUEST) + pReq->cbChunk );
+			if ( 0 == rc ) rc = PeerRecv( pPeer, rgbReply, pReq->cbChunk );
+			PerfSamplesAdd( &samples, (double) PerfCounterToUs( PerfCounter() - ui64Start ) );
+		}
+		PerfSamplesSummarize( &samples, &pResults->rgPing[iSize] );
+	}
+
+	// Bulk: one way transfer in packet sized writes, timed until the server acknowledges the end.
+	for ( iSize=0; iSize<BENCH_CHUNK_SIZES && 0 == rc; iSize++ )
+	{
+		pReq->dwOp    = BENCH_OP_BULK;
+		pReq->cbChunk = g_rgcbChunk[iSize];
+		pReq->cbTotal = g_cbBulk;
+		ui64Start = PerfCounter();
+		rc = PeerSend( pPeer, pReq, sizeof(BENCH_REQUEST) );
+		for ( cbLeft = g_cbBulk; cbLeft > 0 && 0 == rc; cbLeft -= n )
+		{
+			n = ( cbLeft < pReq->cbChunk ) ? (uint32_t) cbLeft : pReq->cbChunk;
+			rc = PeerSend( pPeer, rgbRequest + sizeof(BENCH_REQUEST), n );
+		}
+		if ( 0 == rc ) rc = PeerRecv( pPeer, rgbReply, 1 );
+		pResults->rgdBulk[iSize] = ( g_cbBulk / ( 1024.0 * 1024.0 ) ) / ( PerfElapsedMs( ui64Start ) / 1000.0 );
+	}
+
+	pReq->dwOp = BENCH_OP_QUIT;
+	PeerSend( pPeer, pReq, sizeof(BENCH_REQUEST) );
+	free( pdSamples );
+	return rc;
+}
+
+static SOCKET TcpListen( uint16_t* pwPort )
+{
+	struct sockaddr_in sin;
+	socklen_t cbSin = sizeof(sin);
+	SOCKET s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+	if ( INVALID_SOCKET == s ) return s;
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	if ( 0 != bind( s, (struct sockaddr*) &sin, sizeof(sin) ) || 0 != listen( s, 1 ) ||
+		 0 != getsockname( s, (struct sockaddr*) &sin, &cbSin ) )
+	{
+		closesocket( s );
+		return INVALID_SOCKET;
+	}
+	*pwPort = ntohs( sin.sin_port );
+	return s;
+}
+
+static void TcpNoDelay( SOCKET s )
+{
+	int fOn = 1;
+	setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char*) &fOn, sizeof(fOn) );
+}
+
+static SOCKET TcpConnect( uint16_t wPort )
+{
+	struct sockaddr_in sin;
+	SOCKET s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+
+	if ( INVALID_SOCKET == s ) return s;
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	sin.sin_port        = htons( wPort );
+	if ( 0 != connect( s, (struct sockaddr*) &sin, sizeof(sin) ) )
+	{
+		closesocket( s );
+		return INVALID_SOCKET;
+	}
+	TcpNoDelay( s );
+	return s;
+}
+
+// Client side of one run, on its own process (Linux) or thread (Windows).
+typedef struct _BENCH_CLIENT_ARGS
+{
+	int            iTransport;
+	uint16_t       wPort;
+	BENCH_RESULTS* pResults;
+	int            rc;
+} BENCH_CLIENT_ARGS;
+
+static void BenchClient( BENCH_CLIENT_ARGS* pArgs )
+{
+	BENCH_PEER peer;
+
+	memset( &peer, 0, sizeof(peer) );
+	peer.iTransport = pArgs->iTransport;
+	if ( BENCH_TCP == pArgs->iTransport )
+	{
+		peer.s = TcpConnect( pArgs->wPort );
+		pArgs->rc = ( INVALID_SOCKET == peer.s ) ? -1 : 0;
+	}
+	else
+	{
+		pArgs->rc = SmOpen( &peer.sm, g_szName, ( BENCH_SHM_SPIN == pArgs->iTransport ) ? SM_MODE_SPIN : SM_MODE_EVENT );
+	}
+	if ( 0 != pArgs->rc ) return;
+
+	pArgs->rc = RunClient( &peer, pArgs->pResults );
+	PeerClose( &peer );
+}
+
+#ifdef _WIN32
+static DWORD WINAPI BenchClientThread( LPVOID pv )
+{
+	BenchClient( (BENCH_CLIENT_ARGS*) pv );
+	return 0;
+}
+#endif
+
+static int RunTransport( int iTransport, BENCH_RESULTS* pResults )
+{
+	BENCH_CLIENT_ARGS args;
+	BENCH_PEER peer;
+	SOCKET sListen = INVALID_SOCKET;
+	int rc;
+
+	memset( &args, 0, sizeof(args) );
+	memset( &peer, 0, sizeof(peer) );
+	args.iTransport = iTransport;
+	args.pResults   = pResults;
+	peer.iTransport = iTransport;
+
+	if ( BENCH_TCP == iTransport )
+	{
+		sListen = TcpListen( &args.wPort );
+		if ( INVALID_SOCKET == sListen ) return -1;
+	}
+	else
+	{
+		rc = SmCreate( &peer.sm, g_szName, g_cbBuffer, ( BENCH_SHM_SPIN == iTransport ) ? SM_MODE_SPIN : SM_MODE_EVENT );
+		if ( 0 != rc )
+		{
+			fprintf( stderr, "SmCreate failed, error %d\n", rc );
+			return rc;
+		}
+	}
+
+#ifdef _WIN32
+	{
+		HANDLE hThread = CreateThread( NULL, 0, BenchClientThread, &args, 0, NULL );
+		if ( NULL == hThread ) return -1;
+		if ( BENCH_TCP == iTransport ) peer.s = accept( sListen, NULL, NULL );
+		if ( BENCH_TCP != iTransport || INVALID_SOCKET != peer.s )
+		{
+			if ( BENCH_TCP == iTransport ) TcpNoDelay( peer.s );
+			RunServer( &peer );
+		}
+		WaitForSingleObject( hThread, INFINITE );
+		CloseHandle( hThread );
+	}
+#else
+	{
+		// The results come back through a shared anonymous page.
+		BENCH_CLIENT_ARGS* pShared = (BENCH_CLIENT_ARGS*) mmap( NULL, sizeof(BENCH_CLIENT_ARGS) + sizeof(BENCH_RESULTS),
+																  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+		pid_t pid;
+		int iStatus;
+
+		if ( MAP_FAILED == (void*) pShared ) return -1;
+		*pShared = args;
+		pShared->pResults = (BENCH_RESULTS*) ( pShared + 1 );
+
+		pid = fork();
+		if ( 0 == pid )
+		{
+			if ( INVALID_SOCKET != sListen ) closesocket( sListen );
+			BenchClient( pShared );
+			_exit( 0 );
+		}
+		if ( BENCH_TCP == iTransport ) peer.s = accept( sListen, NULL, NULL );
+		if ( BENCH_TCP != iTransport || INVALID_SOCKET != peer.s )
+		{
+			if ( BENCH_TCP == iTransport ) TcpNoDelay( peer.s );
+			RunServer( &peer );
+		}
+		waitpid( pid, &iStatus, 0 );
+		args.rc = pShared->rc;
+		memcpy( pResults, pShared->pResults, sizeof(BENCH_RESULTS) );
+		munmap( pShared, sizeof(BENCH_CLIENT_ARGS) + sizeof(BENCH_RESULTS) );
+	}
+#endif
+
+	if ( INVALID_SOCKET != sListen ) closesocket( sListen );
+	if ( BENCH_TCP != iTransport || INVALID_SOCKET != peer.s ) PeerClose( &peer );
+	return args.rc;
+}
+
+int main( int argc, char* argv[] )
+{
+	static BENCH_RESULTS rgResults[BENCH_TRANSPORTS];
+	int rgrc[BENCH_TRANSPORTS];
+	int i, j;
+	char szSummary[256];
+
+	for ( i=1; i<argc; i++ )
+	{
+		if      ( 0 == strcmp( argv[i], "-n" ) && i+1 < argc ) g_cIterations = (uint32_t) strtoul( argv[++i], NULL, 10 );
+		else if ( 0 == strcmp( argv[i], "-m" ) && i+1 < argc ) g_cbBulk      = strtoull( argv[++i], NULL, 10 ) * 1024 * 1024;
+		else if ( 0 == strcmp( argv[i], "-b" ) && i+1 < argc ) g_cbBuffer    = (uint32_t) strtoul( argv[++i], NULL, 10 );
+		else
+		{
+			fprintf( stderr, "Usage: smbench [-n pings per size] [-m bulk MB] [-b shared memory buffer bytes]\n" );
+			return 2;
+		}
+	}
+	if ( 0 == g_cIterations ) g_cIterations = 1;
+	if ( 0 == g_cbBulk ) g_cbBulk = 1024 * 1024;
+
+#ifdef _WIN32
+	{
+		WSADATA wsa;
+		WSAStartup( MAKEWORD(2,2), &wsa );
+	}
+	snprintf( g_szName, sizeof(g_szName), "smbench_%lu", (unsigned long) GetCurrentProcessId() );
+#else
+	snprintf( g_szName, sizeof(g_szName), "smbench_%lu", (unsigned long) getpid() );
+#endif
+
+	printf( "%u pings per size, %llu MB bulk transfers, %u byte shared memory buffers, %u CPUs\n",
+			g_cIterations, (unsigned long long) ( g_cbBulk / ( 1024 * 1024 ) ), g_cbBuffer, SmCpuCount() );
+	if ( 1 == SmCpuCount() ) printf( "Only one CPU: the spin variant yields on every poll and cannot beat the event variant.\n" );
+	printf( "\n" );
+
+	for ( i=0; i<BENCH_TRANSPORTS; i++ )
+	{
+		rgrc[i] = RunTransport( i, &rgResults[i] );
+		printf( "%s%s\n", g_rgpszTransports[i], ( 0 == rgrc[i] ) ? "" : " FAILED" );
+		if ( 0 != rgrc[i] ) continue;
+		for ( j=0; j<(int) BENCH_PING_SIZES; j++ )
+		{
+			printf( "  ping %5u bytes: %s\n", g_rgcbPing[j], PerfSummaryFormat( &rgResults[i].rgPing[j], "us", szSummary, sizeof(szSummary) ) );
+		}
+		for ( j=0; j<(int) BENCH_CHUNK_SIZES; j++ )
+		{
+			printf( "  bulk %5u byte writes: %.1f MB/s\n", g_rgcbChunk[j], rgResults[i].rgdBulk[j] );
+		}
+	}
+
+	// Against TCP loopback, what the lpc: protocol would save.
+	if ( 0 == rgrc[BENCH_TCP] )
+	{
+		printf( "\nCompared to tcp loopback (p50 round trip, bulk throughput):\n" );
+		for ( i=BENCH_SHM_EVENT; i<BENCH_TRANSPORTS; i++ )
+		{
+			if ( 0 != rgrc[i] ) continue;
+			printf( "  %-10s", g_rgpszTransports[i] );
+			for ( j=0; j<(int) BENCH_PING_SIZES; j++ )
+			{
+				printf( "  ping %u: %.2fx", g_rgcbPing[j],
+						( rgResults[i].rgPing[j].dP50 > 0.0 ) ? rgResults[BENCH_TCP].rgPing[j].dP50 / rgResults[i].rgPing[j].dP50 : 0.0 );
+			}
+			for ( j=0; j<(int) BENCH_CHUNK_SIZES; j++ )
+			{
+				printf( "  bulk %u: %.2fx", g_rgcbChunk[j],
+						( rgResults[BENCH_TCP].rgdBulk[j] > 0.0 ) ? rgResults[i].rgdBulk[j] / rgResults[BENCH_TCP].rgdBulk[j] : 0.0 );
+			}
+			printf( "\n" );
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+// Request/response transport over shared memory, laid out like the dbnetlib shared memory
+// netlib in Dbnetlib.h: a QUERY_INFO style header followed by the data area.  The data area is
+// split into a client-to-server and a server-to-client half so bulk writes in one direction do
+// not have to wait for the other side to answer.  Waiting is done either with events, as
+// dbnetlib does, or by polling the byte counts in the header.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SM_MODE_EVENT					0	// Block on the posted/completed events
+#define SM_MODE_SPIN					1	// Poll the header, yield the CPU after SM_SPIN_LIMIT polls
+
+// Polls before the spin variant starts yielding.  On a single CPU the other side cannot run while
+// we spin, so the limit drops to 0 there.
+#define SM_SPIN_LIMIT					20000
+
+// Same roles as the hClient*/hServer* events in CONNECTIONOBJECT.
+#define SM_EVENT_CLIENT_WRITE_POSTED	0
+#define SM_EVENT_SERVER_WRITE_POSTED	1
+#define SM_EVENT_CLIENT_READ_COMPLETED	2
+#define SM_EVENT_SERVER_READ_COMPLETED	3
+#define SM_EVENT_COUNT					4
+
+#define SM_DEFAULT_BUFFER_SIZE			( 64 * 1024 )
+
+// QUERY_INFO with fixed size fields, so 32 bit, 64 bit and Linux processes agree on the layout.
+typedef struct _SM_QUERY_INFO
+{
+	uint64_t          dwClientPort;
+	uint64_t          dwServerPort;
+	volatile uint32_t dwServerWriteBytesAvailable;
+	volatile uint32_t dwClientWriteBytesAvailable;
+	volatile uint32_t fServerPeekPosted;
+	volatile uint32_t fServerAsyncReadPosted;
+	volatile uint32_t fClientAttentionPosted;
+	volatile uint32_t fClientOrServerClosed;
+	uint8_t           AttentionPacket[8];
+	uint32_t          dwConnectionID;
+	uint32_t          dwBufferSize;			// Size of each half of the data area
+} SM_QUERY_INFO;
+
+typedef struct _SM_CHANNEL
+{
+	SM_QUERY_INFO* pQueryInfo;
+	uint8_t*       pbClientData;			// Client writes, server reads
+	uint8_t*       pbServerData;			// Server writes, client reads
+	uint32_t       cbReadOffset;			// Bytes of the current posted write already read
+	int            fServer;
+	int            iMode;
+	uint32_t       cSpinLimit;
+	void*          pvMapping;
+	size_t         cbMapping;
+	void*          rgpvEvents[SM_EVENT_COUNT];	// HANDLE on Windows, sem_t* on Linux
+	void*          hMapping;
+	char           szName[64];
+} SM_CHANNEL;
+
+int  SmCreate( SM_CHANNEL* pChannel, const char* pszName, uint32_t cbBuffer, int iMode );
+int  SmOpen( SM_CHANNEL* pChannel, const char* pszName, int iMode );
+int  SmWrite( SM_CHANNEL* pChannel, const void* pvData, uint32_t cbData );
+int  SmRead( SM_CHANNEL* pChannel, void* pvData, uint32_t cbMax, uint32_t* pcbRead );
+void SmClose( SM_CHANNEL* pChannel );
@@ -0,0 +1,1100 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// SpnAudit.cpp: duplicate SPN and MSSQLSvc host audit over every SPN in a forest, fed by the
+// global catalog search in DirectorySession.cpp or by an LDIF export.
+//
+// Built without the precompiled header.  With SPNAUDIT_STANDALONE defined it also builds a tool
+// that audits an LDIF or csvde export, e.g. from ldifde -f spns.ldf -r "(servicePrincipalName=*)"
+// -l dn,dNSHostName,servicePrincipalName -t 3268, and checks the index, e.g.
+//   g++ -O2 -DSPNAUDIT_STANDALONE SpnAudit.cpp -o spnaudit
+//   ./spnaudit -m 64 spns.ldf
+//   ./spnaudit -bench 2000000 -m 64
+//   ./spnaudit -check
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SpnAudit.h"
+
+static int ToLower( int c )
+{
+	return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+static int EqualNoCase( const char* psz1, const char* psz2 )
+{
+	while ( '\0' != *psz1 && ToLower( (unsigned char) *psz1 ) == ToLower( (unsigned char) *psz2 ) )
+	{
+		psz1++;
+		psz2++;
+	}
+	return ( '\0' == *psz1 && '\0' == *psz2 );
+}
+
+// FNV-1a over the lower case characters.  SPNs compare without case, so the hash does too.
+uint64_t SpnHashNoCase( const char* psz, size_t cch )
+{
+	uint64_t ui64Hash = 14695981039346656037ULL;
+	size_t i;
+
+	for ( i=0; i<cch && '\0' != psz[i]; i++ )
+	{
+		ui64Hash ^= (uint64_t) ToLower( (unsigned char) psz[i] );
+		ui64Hash *= 1099511628211ULL;
+	}
+	return ( 0 == ui64Hash ) ? 1 : ui64Hash;		// 0 marks an empty slot
+}
+
+// Every allocation of the index goes through here so cbUsed never passes cbLimit.
+static void* AuditAlloc( SPN_AUDIT* pAudit, size_t cb )
+{
+	void* pv = NULL;
+
+	if ( pAudit->cbUsed + cb > pAudit->cbLimit )
+	{
+		pAudit->fFull = 1;
+		return NULL;
+	}
+	pv = calloc( 1, cb );
+	if ( NULL == pv )
+	{
+		pAudit->fFull = 1;
+		return NULL;
+	}
+	pAudit->cbUsed += cb;
+	return pv;
+}
+
+static void AuditRelease( SPN_AUDIT* pAudit, void* pv, size_t cb )
+{
+	if ( NULL == pv ) return;
+	free( pv );
+	pAudit->cbUsed -= cb;
+}
+
+// Doubles an array of cbItem items, 1024 at first.
+static int GrowArray( SPN_AUDIT* pAudit, void** ppv, uint32_t* pcMax, size_t cbItem )
+{
+	uint32_t cNew = ( 0 == *pcMax ) ? 1024 : *pcMax * 2;
+	void* pvNew = NULL;
+
+	if ( cNew < *pcMax ) return 0;
+	pvNew = AuditAlloc( pAudit, cNew * cbItem );
+	if ( NULL == pvNew ) return 0;
+	if ( NULL != *ppv )
+	{
+		memcpy( pvNew, *ppv, *pcMax * cbItem );
+		AuditRelease( pAudit, *ppv, *pcMax * cbItem );
+	}
+	*ppv = pvNew;
+	*pcMax = cNew;
+	return 1;
+}
+
+// Copies a string into the arena, which is only freed as a whole.
+static const char* ArenaCopy( SPN_AUDIT* pAudit, const char* psz )
+{
+	SPN_AUDIT_ARENA_BLOCK* pBlock = pAudit->pArena;
+	size_t cb = strlen( psz ) + 1;
+	size_t cbBlock;
+	char* pszCopy = NULL;
+
+	if ( NULL == pBlock || pBlock->cbUsed + cb > pBlock->cbSize )
+	{
+		cbBlock = ( cb > SPN_AUDIT_BLOCK_SIZE ) ? cb : SPN_AUDIT_BLOCK_SIZE;
+		pBlock = (SPN_AUDIT_ARENA_BLOCK*) AuditAlloc( pAudit, sizeof(SPN_AUDIT_ARENA_BLOCK) + cbBlock );
+		if ( NULL == pBlock ) return NULL;
+		pBlock->cbSize = cbBlock;
+		pBlock->pNext = pAudit->pArena;
+		pAudit->pArena = pBlock;
+	}
+	pszCopy = &pBlock->rgb[pBlock->cbUsed];
+	memcpy( pszCopy, psz, cb );
+	pBlock->cbUsed += cb;
+	return pszCopy;
+}
+
+int SpnAuditInit( SPN_AUDIT* pAudit, size_t cbLimit )
+{
+	memset( pAudit, 0, sizeof(*pAudit) );
+	pAudit->cbLimit = cbLimit;
+	pAudit->iCurrentAccount = SPN_AUDIT_NONE;
+
+	pAudit->rgSlots = (SPN_AUDIT_SLOT*) AuditAlloc( pAudit, SPN_AUDIT_MIN_SLOTS * sizeof(SPN_AUDIT_SLOT) );
+	pAudit->rgHosts = (uint64_t*) AuditAlloc( pAudit, 4096 * sizeof(uint64_t) );
+	if ( NULL == pAudit->rgSlots || NULL == pAudit->rgHosts )
+	{
+		SpnAuditFree( pAudit );
+		return 0;
+	}
+	pAudit->cSlots = SPN_AUDIT_MIN_SLOTS;
+	pAudit->cHostSlots = 4096;
+	pAudit->fFull = 0;
+	return 1;
+}
+
+void SpnAuditFree( SPN_AUDIT* pAudit )
+{
+	SPN_AUDIT_ARENA_BLOCK* pBlock = pAudit->pArena;
+	SPN_AUDIT_ARENA_BLOCK* pNext = NULL;
+
+	while ( NULL != pBlock )
+	{
+		pNext = pBlock->pNext;
+		free( pBlock );
+		pBlock = pNext;
+	}
+	free( pAudit->rgSlots );
+	free( pAudit->rgHosts );
+	free( pAudit->rgpszAccounts );
+	free( pAudit->rgDups );
+	free( pAudit->rgOwners );
+	free( pAudit->rgSqlSpns );
+	memset( pAudit, 0, sizeof(*pAudit) );
+}
+
+// Rehashes into a table twice the size.  Both tables count against the limit while it runs.
+static int GrowSlots( SPN_AUDIT* pAudit )
+{
+	SPN_AUDIT_SLOT* rgNew = NULL;
+	uint32_t cNew = pAudit->cSlots * 2;
+	uint32_t i, j;
+
+	if ( cNew < pAudit->cSlots ) return 0;
+	rgNew = (SPN_AUDIT_SLOT*) AuditAlloc( pAudit, cNew * sizeof(SPN_AUDIT_SLOT) );
+	if ( NULL == rgNew ) return 0;
+
+	for ( i=0; i<pAudit->cSlots; i++ )
+	{
+		if ( 0 == pAudit->rgSlots[i].ui64Hash ) continue;
+		j = (uint32_t) pAudit->rgSlots[i].ui64Hash & ( cNew - 1 );
+		while ( 0 != rgNew[j].ui64Hash ) j = ( j + 1 ) & ( cNew - 1 );
+		rgNew[j] = pAudit->rgSlots[i];
+	}
+	AuditRelease( pAudit, pAudit->rgSlots, pAudit->cSlots * sizeof(SPN_AUDIT_SLOT) );
+	pAudit->rgSlots = rgNew;
+	pAudit->cSlots = cNew;
+	return 1;
+}
+
+static int FindHost( const SPN_AUDIT* pAudit, uint64_t ui64Hash )
+{
+	uint32_t j = (uint32_t) ui64Hash & ( pAudit->cHostSlots - 1 );
+
+	while ( 0 != pAudit->rgHosts[j] )
+	{
+		if ( pAudit->rgHosts[j] == ui64Hash ) return 1;
+		j = ( j + 1 ) & ( pAudit->cHostSlots - 1 );
+	}
+	return 0;
+}
+
+static void InsertHost( SPN_AUDIT* pAudit, uint64_t ui64Hash )
+{
+	uint64_t* rgNew = NULL;
+	uint32_t cNew, i, j;
+
+	if ( FindHost( pAudit, ui64Hash ) ) return;
+
+	if ( ( pAudit->cHosts + 1 ) * 10 > pAudit->cHostSlots * 7 )
+	{
+		cNew = pAudit->cHostSlots * 2;
+		rgNew = (uint64_t*) AuditAlloc( pAudit, cNew * sizeof(uint64_t) );
+		if ( NULL == rgNew ) return;
+		for ( i=0; i<pAudit->cHostSlots; i++ )
+		{
+			if ( 0 == pAudit->rgHosts[i] ) continue;
+			j = (uint32_t) pAudit->rgHosts[i] & ( cNew - 1 );
+			while ( 0 != rgNew[j] ) j = ( j + 1 ) & ( cNew - 1 );
+			rgNew[j] = pAudit->rgHosts[i];
+		}
+		AuditRelease( pAudit, pAudit->rgHosts, pAudit->cHostSlots * sizeof(uint64_t) );
+		pAudit->rgHosts = rgNew;
+		pAudit->cHostSlots = cNew;
+	}
+
+	j = (uint32_t) ui64Hash & ( pAudit->cHostSlots - 1 );
+	while ( 0 != pAudit->rgHosts[j] ) j = ( j + 1 ) & ( pAudit->cHostSlots - 1 );
+	pAudit->rgHosts[j] = ui64Hash;
+	pAudit->cHosts++;
+}
+
+void SpnAuditAddAccount( SPN_AUDIT* pAudit, const char* pszDN )
+{
+	const char* pszCopy = NULL;
+
+	pAudit->iCurrentAccount = SPN_AUDIT_NONE;
+	if ( pAudit->cAccounts == pAudit->cMaxAccounts &&
+		 !GrowArray( pAudit, (void**) &pAudit->rgpszAccounts, &pAudit->cMaxAccounts, sizeof(const char*) ) )
+	{
+		return;
+	}
+	pszCopy = ArenaCopy( pAudit, pszDN );
+	if ( NULL == pszCopy ) return;
+
+	pAudit->rgpszAccounts[pAudit->cAccounts] = pszCopy;
+	pAudit->iCurrentAccount = pAudit->cAccounts++;
+}
+
+// A host counts under its full name and, for the short name SPNs, its first label.
+void SpnAuditAddHost( SPN_AUDIT* pAudit, const char* pszDnsHostName )
+{
+	size_t cch = strlen( pszDnsHostName );
+	const char* pszDot = NULL;
+
+	if ( cch > 0 && '.' == pszDnsHostName[cch-1] ) cch--;
+	if ( 0 == cch ) return;
+	InsertHost( pAudit, SpnHashNoCase( pszDnsHostName, cch ) );
+
+	pszDot = strchr( pszDnsHostName, '.' );
+	if ( NULL != pszDot && pszDot > pszDnsHostName )
+	{
+		InsertHost( pAudit, SpnHashNoCase( pszDnsHostName, (size_t) ( pszDot - pszDnsHostName ) ) );
+	}
+}
+
+static void AddOwner( SPN_AUDIT* pAudit, SPN_AUDIT_DUP* pDup, uint32_t iAccount )
+{
+	SPN_AUDIT_OWNER* pOwner = NULL;
+
+	if ( pAudit->cOwners == pAudit->cMaxOwners &&
+		 !GrowArray( pAudit, (void**) &pAudit->rgOwners, &pAudit->cMaxOwners, sizeof(SPN_AUDIT_OWNER) ) )
+	{
+		pAudit->cDropped++;
+		return;
+	}
+	pOwner = &pAudit->rgOwners[pAudit->cOwners];
+	pOwner->iAccount = iAccount;
+	pOwner->iNext = SPN_AUDIT_NONE;
+
+	if ( 0 == pDup->cOwners ) pDup->iFirstOwner = pAudit->cOwners;
+	else pAudit->rgOwners[pDup->iLastOwner].iNext = pAudit->cOwners;
+	pDup->iLastOwner = pAudit->cOwners++;
+	pDup->cOwners++;
+}
+
+// Second account with the SPN, from here on the SPN keeps its text and its list of owners.
+static void AddDuplicate( SPN_AUDIT* pAudit, SPN_AUDIT_SLOT* pSlot, const char* pszSpn )
+{
+	SPN_AUDIT_DUP* pDup = NULL;
+
+	if ( 0 == pSlot->iDup )
+	{
+		if ( pAudit->cDups == pAudit->cMaxDups &&
+			 !GrowArray( pAudit, (void**) &pAudit->rgDups, &pAudit->cMaxDups, sizeof(SPN_AUDIT_DUP) ) )
+		{
+			pAudit->cDropped++;
+			return;
+		}
+		pDup = &pAudit->rgDups[pAudit->cDups];
+		memset( pDup, 0, sizeof(*pDup) );
+		pDup->iFirstOwner = SPN_AUDIT_NONE;
+		pDup->pszSpn = ArenaCopy( pAudit, pszSpn );
+		if ( NULL == pDup->pszSpn )
+		{
+			pAudit->cDropped++;
+			return;
+		}
+		pSlot->iDup = ++pAudit->cDups;
+		AddOwner( pAudit, pDup, pSlot->iAccount );
+	}
+
+	// No owner is listed when the memory limit stopped the first AddOwner.
+	pDup = &pAudit->rgDups[pSlot->iDup - 1];
+	if ( 0 == pDup->cOwners || pAudit->rgOwners[pDup->iLastOwner].iAccount != pAudit->iCurrentAccount )
+	{
+		AddOwner( pAudit, pDup, pAudit->iCurrentAccount );
+	}
+}
+
+// Only the hash is kept, so two different SPNs with the same 64-bit hash would show as a
+// duplicate: about one chance in ten million for two million SPNs.
+void SpnAuditAddSpn( SPN_AUDIT* pAudit, const char* pszSpn )
+{
+	SPN_AUDIT_SLOT* pSlot = NULL;
+	SPN_AUDIT_SQL_SPN* pSql = NULL;
+	char szHost[256];
+	uint64_t ui64Hash;
+	uint32_t j;
+
+	pAudit->cSpns++;
+	if ( SPN_AUDIT_NONE == pAudit->iCurrentAccount || '\0' == pszSpn[0] )
+	{
+		pAudit->cDropped++;
+		return;
+	}
+
+	// Keep the load under 70%, or 90% once the table can no longer grow.
+	if ( ( pAudit->cUnique + 1 ) * 10ULL > pAudit->cSlots * 7ULL && !GrowSlots( pAudit ) &&
+		 ( pAudit->cUnique + 1 ) * 10ULL > pAudit->cSlots * 9ULL )
+	{
+		pAudit->cDropped++;
+		return;
+	}
+
+	ui64Hash = SpnHashNoCase( pszSpn, (size_t) -1 );
+	j = (uint32_t) ui64Hash & ( pAudit->cSlots - 1 );
+	while ( 0 != pAudit->rgSlots[j].ui64Hash && ui64Hash != pAudit->rgSlots[j].ui64Hash )
+	{
+		j = ( j + 1 ) & ( pAudit->cSlots - 1 );
+	}
+	pSlot = &pAudit->rgSlots[j];
+
+	if ( 0 != pSlot->ui64Hash )
+	{
+		if ( pSlot->iAccount != pAudit->iCurrentAccount || 0 != pSlot->iDup ) AddDuplicate( pAudit, pSlot, pszSpn );
+		return;
+	}
+
+	pSlot->ui64Hash = ui64Hash;
+	pSlot->iAccount = pAudit->iCurrentAccount;
+	pSlot->iDup = 0;
+	pAudit->cUnique++;
+
+	// MSSQLSvc hosts are checked once every dNSHostName has been seen.
+	if ( SpnSqlHost( pszSpn, szHost, sizeof(szHost) ) )
+	{
+		if ( pAudit->cSqlSpns == pAudit->cMaxSqlSpns &&
+			 !GrowArray( pAudit, (void**) &pAudit->rgSqlSpns, &pAudit->cMaxSqlSpns, sizeof(SPN_AUDIT_SQL_SPN) ) )
+		{
+			return;
+		}
+		pSql = &pAudit->rgSqlSpns[pAudit->cSqlSpns];
+		pSql->pszSpn = ArenaCopy( pAudit, pszSpn );
+		pSql->iAccount = pAudit->iCurrentAccount;
+		if ( NULL != pSql->pszSpn ) pAudit->cSqlSpns++;
+	}
+}
+
+static void SourceAccount( void* pvContext, const char* pszDN )
+{
+	SpnAuditAddAccount( (SPN_AUDIT*) pvContext, pszDN );
+}
+
+static void SourceHost( void* pvContext, const char* pszDnsHostName )
+{
+	SpnAuditAddHost( (SPN_AUDIT*) pvContext, pszDnsHostName );
+}
+
+static void SourceSpn( void* pvContext, const char* pszSpn )
+{
+	SpnAuditAddSpn( (SPN_AUDIT*) pvContext, pszSpn );
+}
+
+void SpnAuditSource( SPN_AUDIT* pAudit, SPN_SOURCE* pSource )
+{
+	pSource->pvContext  = pAudit;
+	pSource->pfnAccount = SourceAccount;
+	pSource->pfnHost    = SourceHost;
+	pSource->pfnSpn     = SourceSpn;
+	pSource->pfnAttribute = NULL;
+}
+
+// Host of an MSSQLSvc/host[:port or instance] SPN.  0 for other services.
+int SpnSqlHost( const char* pszSpn, char* pszHost, size_t cchHost )
+{
+	static const char szService[] = "MSSQLSvc/";
+	size_t cchService = sizeof(szService) - 1;
+	size_t i;
+
+	if ( 0 == cchHost ) return 0;
+	pszHost[0] = '\0';
+	for ( i=0; i<cchService; i++ )
+	{
+		if ( ToLower( (unsigned char) pszSpn[i] ) != ToLower( (unsigned char) szService[i] ) ) return 0;
+	}
+	pszSpn += cchService;
+	for ( i=0; i + 1 < cchHost && '\0' != pszSpn[i] && ':' != pszSpn[i] && '/' != pszSpn[i]; i++ ) pszHost[i] = pszSpn[i];
+	if ( i > 0 && '.' == pszHost[i-1] ) i--;
+	pszHost[i] = '\0';
+	return ( i > 0 );
+}
+
+static int IsSqlSpnMatched( const SPN_AUDIT* pAudit, const SPN_AUDIT_SQL_SPN* pSql )
+{
+	char szHost[256];
+
+	if ( !SpnSqlHost( pSql->pszSpn, szHost, sizeof(szHost) ) ) return 1;
+	return FindHost( pAudit, SpnHashNoCase( szHost, (size_t) -1 ) );
+}
+
+uint32_t SpnAuditUnmatchedCount( const SPN_AUDIT* pAudit )
+{
+	uint32_t cUnmatched = 0, i;
+
+	for ( i=0; i<pAudit->cSqlSpns; i++ )
+	{
+		if ( !IsSqlSpnMatched( pAudit, &pAudit->rgSqlSpns[i] ) ) cUnmatched++;
+	}
+	return cUnmatched;
+}
+
+// Writes the audit a line at a time, at most cMaxLines duplicates and cMaxLines MSSQLSvc SPNs.
+// pfnResolve may be NULL, otherwise it is asked whether each unmatched MSSQLSvc host is in DNS.
+void SpnAuditReport( const SPN_AUDIT* pAudit, uint32_t cMaxLines, SPN_AUDIT_PRINT pfnPrint, SPN_AUDIT_RESOLVE pfnResolve, void* pvContext )
+{
+	const SPN_AUDIT_DUP* pDup = NULL;
+	const SPN_AUDIT_OWNER* pOwner = NULL;
+	const SPN_AUDIT_SQL_SPN* pSql = NULL;
+	char szLine[1024];
+	char szHost[256];
+	const char* pszDns = NULL;
+	uint32_t cUnmatched, cListed = 0, i, iOwner;
+
+	snprintf( szLine, sizeof(szLine), "%u accounts, %llu SPNs, %u distinct, %u MSSQLSvc, index %.1f MB of %.0f MB",
+			  pAudit->cAccounts, (unsigned long long) pAudit->cSpns, pAudit->cUnique, pAudit->cSqlSpns,
+			  pAudit->cbUsed / 1048576.0, pAudit->cbLimit / 1048576.0 );
+	pfnPrint( pvContext, szLine );
+	if ( pAudit->cDropped > 0 )
+	{
+		snprintf( szLine, sizeof(szLine), "WARNING! The index reached its memory limit, %llu SPNs were not indexed and duplicates among them are not reported.",
+				  (unsigned long long) pAudit->cDropped );
+		pfnPrint( pvContext, szLine );
+	}
+
+	if ( 0 == pAudit->cDups )
+	{
+		pfnPrint( pvContext, "No SPN is registered on more than one account." );
+	}
+	else
+	{
+		snprintf( szLine, sizeof(szLine), "%u SPNs are registered on more than one account, the KDC fails ticket requests for them:", pAudit->cDups );
+		pfnPrint( pvContext, szLine );
+	}
+	for ( i=0; i<pAudit->cDups && i<cMaxLines; i++ )
+	{
+		pDup = &pAudit->rgDups[i];
+		if ( 0 == pDup->cOwners ) snprintf( szLine, sizeof(szLine), "  %s (accounts not recorded, memory limit)", pDup->pszSpn );
+		else snprintf( szLine, sizeof(szLine), "  %s (%u accounts)", pDup->pszSpn, pDup->cOwners );
+		pfnPrint( pvContext, szLine );
+		for ( iOwner=pDup->iFirstOwner; SPN_AUDIT_NONE != iOwner; iOwner=pOwner->iNext )
+		{
+			pOwner = &pAudit->rgOwners[iOwner];
+			snprintf( szLine, sizeof(szLine), "    %s", pAudit->rgpszAccounts[pOwner->iAccount] );
+			pfnPrint( pvContext, szLine );
+		}
+	}
+	if ( pAudit->cDups > cMaxLines )
+	{
+		snprintf( szLine, sizeof(szLine), "  ... and %u more", pAudit->cDups - cMaxLines );
+		pfnPrint( pvContext, szLine );
+	}
+
+	cUnmatched = SpnAuditUnmatchedCount( pAudit );
+	if ( 0 == cUnmatched )
+	{
+		pfnPrint( pvContext, "Every MSSQLSvc SPN names the dNSHostName of an account, or its first label." );
+		return;
+	}
+	snprintf( szLine, sizeof(szLine), "%u MSSQLSvc SPNs name a host that is not the dNSHostName of any account (an alias, or a stale SPN):", cUnmatched );
+	pfnPrint( pvContext, szLine );
+	for ( i=0; i<pAudit->cSqlSpns && cListed<cMaxLines; i++ )
+	{
+		pSql = &pAudit->rgSqlSpns[i];
+		if ( IsSqlSpnMatched( pAudit, pSql ) ) continue;
+		cListed++;
+
+		pszDns = "";
+		if ( NULL != pfnResolve && SpnSqlHost( pSql->pszSpn, szHost, sizeof(szHost) ) )
+		{
+			switch ( pfnResolve( pvContext, szHost ) )
+			{
+				case 1:  pszDns = ", resolves in DNS"; break;
+				case 0:  pszDns = ", NOT in DNS"; break;
+				default: break;
+			}
+		}
+		snprintf( szLine, sizeof(szLine), "  %-60s on %s%s", pSql->pszSpn, pAudit->rgpszAccounts[pSql->iAccount], pszDns );
+		pfnPrint( pvContext, szLine );
+	}
+	if ( cUnmatched > cListed )
+	{
+		snprintf( szLine, sizeof(szLine), "  ... and %u more", cUnmatched - cListed );
+		pfnPrint( pvContext, szLine );
+	}
+}
+
+// Reads one line of any length into *ppszLine without its end of line.  -1 at the end of the file.
+static long ReadLine( FILE* pFile, char** ppszLine, size_t* pcbLine )
+{
+	size_t cch = 0;
+	char* pszNew = NULL;
+	int c;
+
+	if ( NULL == *ppszLine )
+	{
+		*pcbLine = 256;
+		*ppszLine = (char*) malloc( *pcbLine );
+		if ( NULL == *ppszLine ) return -1;
+	}
+
+	while ( EOF != ( c = getc( pFile ) ) && '\n' != c )
+	{
+		if ( cch + 2 > *pcbLine )
+		{
+			pszNew = (char*) realloc( *ppszLine, *pcbLine * 2 );
+			if ( NULL == pszNew ) return -1;
+			*ppszLine = pszNew;
+			*pcbLine *= 2;
+		}
+		(*ppszLine)[cch++] = (char) c;
+	}
+	if ( EOF == c && 0 == cch ) return -1;
+	if ( cch > 0 && '\r' == (*ppszLine)[cch-1] ) cch--;
+	(*ppszLine)[cch] = '\0';
+	return (long) cch;
+}
+
+static int Base64Value( int c )
+{
+	if ( c >= 'A' && c <= 'Z' ) return c - 'A';
+	if ( c >= 'a' && c <= 'z' ) return c - 'a' + 26;
+	if ( c >= '0' && c <= '9' ) return c - '0' + 52;
+	if ( '+' == c ) return 62;
+	if ( '/' == c ) return 63;
+	return -1;
+}
+
+// Decodes in place, the result is never longer than the input.
+static void Base64DecodeInPlace( char* psz )
+{
+	const char* pszIn = psz;
+	char* pszOut = psz;
+	uint32_t dwBits = 0;
+	int cBits = 0, v;
+
+	for ( ; '\0' != *pszIn; pszIn++ )
+	{
+		v = Base64Value( (unsigned char) *pszIn );
+		if ( v < 0 ) continue;
+		dwBits = ( dwBits << 6 ) | (uint32_t) v;
+		cBits += 6;
+		if ( cBits >= 8 )
+		{
+			cBits -= 8;
+			*pszOut++ = (char) ( ( dwBits >> cBits ) & 0xff );
+		}
+	}
+	*pszOut = '\0';
+}
+
+// One unfolded LDIF line: "attr: value", "attr:: base64" or "attr:< url", options such as
+// ";range=0-1499" after the attribute name are ignored.
+static int ParseLdifLine( char* pszLine, const SPN_SOURCE* pSource )
+{
+	char* pszColon = NULL;
+	char* pszOption = NULL;
+	char* pszValue = NULL;
+	int fBase64 = 0;
+
+	if ( '#' == pszLine[0] || '\0' == pszLine[0] ) return 0;
+	pszColon = strchr( pszLine, ':' );
+	if ( NULL == pszColon ) return 0;
+	*pszColon = '\0';
+	pszOption = strchr( pszLine, ';' );
+	if ( NULL != pszOption ) *pszOption = '\0';
+
+	pszValue = pszColon + 1;
+	if ( '<' == *pszValue ) return 0;
+	if ( ':' == *pszValue )
+	{
+		fBase64 = 1;
+		pszValue++;
+	}
+	while ( ' ' == *pszValue ) pszValue++;
+	if ( fBase64 ) Base64DecodeInPlace( pszValue );
+
+	if ( EqualNoCase( pszLine, "dn" ) )
+	{
+		pSource->pfnAccount( pSource->pvContext, pszValue );
+		return 1;
+	}
+	if ( EqualNoCase( pszLine, "dNSHostName" ) ) pSource->pfnHost( pSource->pvContext, pszValue );
+	else if ( EqualNoCase( pszLine, "servicePrincipalName" ) ) pSource->pfnSpn( pSource->pvContext, pszValue );
+	else if ( NULL != pSource->pfnAttribute ) pSource->pfnAttribute( pSource->pvContext, pszLine, pszValue );
+	return 0;
+}
+
+// Streams an LDIF file into pSource a record at a time, a line starting with a space continues
+// the line before it.  Returns the number of records (dn lines), -1 if memory ran out.
+long SpnReadLdif( FILE* pFile, const SPN_SOURCE* pSource )
+{
+	char* pszLine = NULL;
+	char* pszLogical = NULL;
+	char* pszNew = NULL;
+	size_t cbLine = 0, cbLogical = 256, cchLogical = 0;
+	long cch, cRecords = 0;
+	int fPending = 0;
+
+	pszLogical = (char*) malloc( cbLogical );
+	if ( NULL == pszLogical ) return -1;
+	pszLogical[0] = '\0';
+
+	for ( ;; )
+	{
+		cch = ReadLine( pFile, &pszLine, &cbLine );
+
+		if ( cch > 0 && ' ' == pszLine[0] && fPending )
+		{
+			if ( cchLogical + (size_t) cch + 1 > cbLogical )
+			{
+				while ( cchLogical + (size_t) cch + 1 > cbLogical ) cbLogical *= 2;
+				pszNew = (char*) realloc( pszLogical, cbLogical );
+				if ( NULL == pszNew )
+				{
+					cRecords = -1;
+					break;
+				}
+				pszLogical = pszNew;
+			}
+			memcpy( &pszLogical[cchLogical], &pszLine[1], (size_t) cch );	// Drops the space, copies the '\0'
+			cchLogical += (size_t) cch - 1;
+			continue;
+		}
+
+		if ( fPending ) cRecords += ParseLdifLine( pszLogical, pSource );
+		fPending = 0;
+		if ( cch < 0 ) break;
+
+		if ( (size_t) cch + 1 > cbLogical )
+		{
+			while ( (size_t) cch + 1 > cbLogical ) cbLogical *= 2;
+			pszNew = (char*) realloc( pszLogical, cbLogical );
+			if ( NULL == pszNew )
+			{
+				cRecords = -1;
+				break;
+			}
+			pszLogical = pszNew;
+		}
+		memcpy( pszLogical, pszLine, (size_t) cch + 1 );
+		cchLogical = (size_t) cch;
+		fPending = 1;
+	}
+
+	free( pszLine );
+	free( pszLogical );
+	return cRecords;
+}
+
+// One CSV record, its fields '\0' terminated one after the other.
+typedef struct _CSV_RECORD
+{
+	char*    psz;
+	size_t   cch, cb;
+	size_t*  rgibFields;
+	uint32_t cFields, cMaxFields;
+} CSV_RECORD;
+
+static int CsvAppend( CSV_RECORD* pRecord, char c )
+{
+	char* pszNew = NULL;
+
+	if ( pRecord->cch + 1 >= pRecord->cb )
+	{
+		pszNew = (char*) realloc( pRecord->psz, ( 0 == pRecord->cb ) ? 256 : pRecord->cb * 2 );
+		if ( NULL == pszNew ) return 0;
+		pRecord->psz = pszNew;
+		pRecord->cb = ( 0 == pRecord->cb ) ? 256 : pRecord->cb * 2;
+	}
+	pRecord->psz[pRecord->cch++] = c;
+	return 1;
+}
+
+static int CsvEndField( CSV_RECORD* pRecord, size_t ibField )
+{
+	size_t* rgNew = NULL;
+
+	if ( pRecord->cFields == pRecord->cMaxFields )
+	{
+		rgNew = (size_t*) realloc( pRecord->rgibFields, ( pRecord->cMaxFields + 16 ) * sizeof(size_t) );
+		if ( NULL == rgNew ) return 0;
+		pRecord->rgibFields = rgNew;
+		pRecord->cMaxFields += 16;
+	}
+	pRecord->rgibFields[pRecord->cFields++] = ibField;
+	return CsvAppend( pRecord, '\0' );
+}
+
+// A data record of a csvde export: DN starts the account, multiple values are separated by ';'.
+static void CsvDispatch( const CSV_RECORD* pHeader, CSV_RECORD* pRecord, int iDN, const SPN_SOURCE* pSource )
+{
+	const char* pszName = NULL;
+	char* pszValue = NULL;
+	char* pszNext = NULL;
+	uint32_t i;
+
+	pSource->pfnAccount( pSource->pvContext, &pRecord->psz[pRecord->rgibFields[iDN]] );
+	for ( i=0; i<pRecord->cFields && i<pHeader->cFields; i++ )
+	{
+		pszName  = &pHeader->psz[pHeader->rgibFields[i]];
+		pszValue = &pRecord->psz[pRecord->rgibFields[i]];
+		if ( (int) i == iDN || '\0' == pszValue[0] ) continue;
+
+		if ( EqualNoCase( pszName, "dNSHostName" ) )
+		{
+			pSource->pfnHost( pSource->pvContext, pszValue );
+		}
+		else if ( EqualNoCase( pszName, "servicePrincipalName" ) )
+		{
+			for ( ; NULL != pszValue; pszValue = pszNext )
+			{
+				pszNext = strchr( pszValue, ';' );
+				if ( NULL != pszNext ) *pszNext++ = '\0';
+				if ( '\0' != pszValue[0] ) pSource->pfnSpn( pSource->pvContext, pszValue );
+			}
+		}
+		else if ( NULL != pSource->pfnAttribute )
+		{
+			pSource->pfnAttribute( pSource->pvContext, pszName, pszValue );
+		}
+	}
+}
+
+// Streams a csvde export into pSource, the first line names the columns and one of them must be
+// DN.  Quoted fields may hold commas, doubled quotes and line breaks.  Returns the number of
+// records, -1 if memory ran out or there is no DN column.
+long SpnReadCsv( FILE* pFile, const SPN_SOURCE* pSource )
+{
+	CSV_RECORD Header, Record, Swap;
+	size_t ibField = 0;
+	long cRecords = 0;
+	int c, cNext, fQuoted = 0, fHeader = 1, fFailed = 0, iDN = -1;
+	uint32_t i;
+
+	memset( &Header, 0, sizeof(Header) );
+	memset( &Record, 0, sizeof(Record) );
+
+	do
+	{
+		c = getc( pFile );
+		if ( fQuoted )
+		{
+			if ( EOF == c ) fQuoted = 0;
+			else if ( '"' != c ) fFailed = !CsvAppend( &Record, (char) c );
+			else if ( '"' == ( cNext = getc( pFile ) ) ) fFailed = !CsvAppend( &Record, '"' );
+			else
+			{
+				fQuoted = 0;
+				if ( EOF != cNext ) ungetc( cNext, pFile );
+			}
+			if ( EOF != c ) continue;
+		}
+
+		if ( '"' == c ) fQuoted = 1;
+		else if ( ',' == c )
+		{
+			fFailed = !CsvEndField( &Record, ibField );
+			ibField = Record.cch;
+		}
+		else if ( '\n' == c || EOF == c )
+		{
+			if ( Record.cch > 0 || Record.cFields > 0 )
+			{
+				fFailed = !CsvEndField( &Record, ibField );
+				if ( !fFailed && fHeader )
+				{
+					for ( i=0; i<Record.cFields; i++ )
+					{
+						if ( EqualNoCase( &Record.psz[Record.rgibFields[i]], "DN" ) ) iDN = (int) i;
+					}
+					Swap = Header;
+					Header = Record;
+					Record = Swap;
+					fHeader = 0;
+				}
+				else if ( !fFailed && iDN >= 0 && (uint32_t) iDN < Record.cFields )
+				{
+					CsvDispatch( &Header, &Record, iDN, pSource );
+					cRecords++;
+				}
+			}
+			Record.cch = 0;
+			Record.cFields = 0;
+			ibField = 0;
+		}
+		else if ( '\r' != c ) fFailed = !CsvAppend( &Record, (char) c );
+	}
+	while ( EOF != c && !fFailed && ( fHeader || iDN >= 0 ) );
+
+	free( Header.psz );
+	free( Header.rgibFields );
+	free( Record.psz );
+	free( Record.rgibFields );
+	return ( fFailed || iDN < 0 ) ? -1 : cRecords;
+}
+
+#ifdef SPNAUDIT_STANDALONE
+
+#include <time.h>
+
+static const char g_szCheckLdif[] =
+	"# Export of servicePrincipalName from the global catalog\r\n"
+	"version: 1\r\n"
+	"\r\n"
+	"dn: CN=SQL01,OU=Servers,DC=contoso,DC=com\r\n"
+	"dNSHostName: sql01.contoso.com\r\n"
+	"servicePrincipalName: MSSQLSvc/sql01.contoso.com:1433\r\n"
+	"servicePrincipalName: MSSQLSvc/SQL01:1433\r\n"
+	"servicePrincipalName: HOST/sql01\r\n"
+	"\r\n"
+	"dn: CN=svc-sql,OU=Service Accounts,DC=contoso,DC=com\r\n"
+	"servicePrincipalName;range=0-*: MSSQLSvc/sql01.contoso.com:1433\r\n"
+	"servicePrincipalName: MSSQLSvc/sqlalias.contoso.com:1433\r\n"
+	"\r\n"
+	"dn: CN=WEB01,OU=Servers with a long name that ldifde folds,DC=cont\n"
+	" oso,DC=com\n"
+	"servicePrincipalName:: SFRUUC93ZWIwMS5jb250b3NvLmNvbQ==\n"
+	"servicePrincipalName: MSSQLSvc/web01.contoso.com:INST1\n"
+	"dNSHostName: web01.contoso.com.\n"
+	"\n"
+	"dn: CN=SQL02,OU=Servers,DC=contoso,DC=com\n"
+	"dNSHostName: sql02.contoso.com\n"
+	"servicePrincipalName: mssqlsvc/SQL01.CONTOSO.COM:1433\n"
+	"servicePrincipalName: MSSQLSvc/sql02.contoso.com:1433\n";
+
+static const char g_szCheckCsv[] =
+	"DN,objectClass,sAMAccountName,dNSHostName,servicePrincipalName\r\n"
+	"\"CN=SQL01,OU=Servers,DC=contoso,DC=com\",computer,SQL01$,sql01.contoso.com,MSSQLSvc/sql01.contoso.com:1433;MSSQLSvc/SQL01:1433\r\n"
+	"\r\n"
+	"\"CN=svc \"\"sql\"\",DC=contoso,DC=com\",user,svc-sql,,\"MSSQLSvc/sql01.contoso.com:1433;MSSQLSvc/alias.contoso.com:1433\"";
+
+// csvde exports end in .csv, anything else is read as LDIF.
+static int IsCsvFile( const char* pszFile )
+{
+	size_t cch = strlen( pszFile );
+	return ( cch > 4 && EqualNoCase( &pszFile[cch-4], ".csv" ) );
+}
+
+static void PrintLine( void* pvContext, const char* pszLine )
+{
+	FILE* pFile = (FILE*) pvContext;
+	fprintf( pFile, "%s\n", pszLine );
+}
+
+static void NullLine( void* /*pvContext*/, const char* /*pszLine*/ )
+{
+}
+
+// n computer accounts with the SPNs Windows registers for them and one MSSQLSvc SPN each, every
+// 1000th SPN also registered on a service account.
+static void AddSynthetic( SPN_AUDIT* pAudit, uint32_t cAccounts )
+{
+	char sz[256];
+	uint32_t i;
+
+	for ( i=0; i<cAccounts; i++ )
+	{
+		snprintf( sz, sizeof(sz), "CN=HOST%07u,OU=Servers,DC=contoso,DC=com", i );
+		SpnAuditAddAccount( pAudit, sz );
+		snprintf( sz, sizeof(sz), "host%07u.contoso.com", i );
+		SpnAuditAddHost( pAudit, sz );
+		snprintf( sz, sizeof(sz), "HOST/host%07u.contoso.com", i );
+		SpnAuditAddSpn( pAudit, sz );
+		snprintf( sz, sizeof(sz), "HOST/HOST%07u", i );
+		SpnAuditAddSpn( pAudit, sz );
+		snprintf( sz, sizeof(sz), "RestrictedKrbHost/host%07u.contoso.com", i );
+		SpnAuditAddSpn( pAudit, sz );
+		snprintf( sz, sizeof(sz), "MSSQLSvc/host%07u.contoso.com:1433", i );
+		SpnAuditAddSpn( pAudit, sz );
+	}
+	SpnAuditAddAccount( pAudit, "CN=svc-sql,OU=Service Accounts,DC=contoso,DC=com" );
+	for ( i=0; i<cAccounts; i+=1000 )
+	{
+		snprintf( sz, sizeof(sz), "MSSQLSvc/host%07u.contoso.com:1433", i );
+		SpnAuditAddSpn( pAudit, sz );
+	}
+}
+
+static int RunChecks()
+{
+	SPN_AUDIT Audit;
+	SPN_SOURCE Source;
+	FILE* pFile = NULL;
+	char szHost[64];
+	long cRecords;
+	int cFailed = 0, cChecks = 0;
+
+	// LDIF with CRLF and LF lines, a folded dn, a base64 value, a range option and a trailing dot.
+	pFile = tmpfile();
+	if ( NULL == pFile )
+	{
+		printf( "FAIL tmpfile\n" );
+		return 1;
+	}
+	fputs( g_szCheckLdif, pFile );
+	rewind( pFile );
+
+	SpnAuditInit( &Audit, 64 * 1048576 );
+	SpnAuditSource( &Audit, &Source );
+	cRecords = SpnReadLdif( pFile, &Source );
+	fclose( pFile );
+
+	cChecks++;
+	if ( 4 != cRecords || 4 != Audit.cAccounts || 9 != Audit.cSpns || 7 != Audit.cUnique )
+	{
+		printf( "FAIL ldif: %ld records, %u accounts, %llu SPNs, %u distinct\n", cRecords, Audit.cAccounts, (unsigned long long) Audit.cSpns, Audit.cUnique );
+		cFailed++;
+	}
+	cChecks++;
+	if ( 0 != strcmp( Audit.rgpszAccounts[2], "CN=WEB01,OU=Servers with a long name that ldifde folds,DC=contoso,DC=com" ) )
+	{
+		printf( "FAIL folded dn: %s\n", Audit.rgpszAccounts[2] );
+		cFailed++;
+	}
+	cChecks++;
+	if ( 1 != Audit.cDups || 3 != Audit.rgDups[0].cOwners || 0 != strcmp( Audit.rgDups[0].pszSpn, "MSSQLSvc/sql01.contoso.com:1433" ) )
+	{
+		printf( "FAIL duplicates: %u, first on %u accounts\n", Audit.cDups, ( Audit.cDups > 0 ) ? Audit.rgDups[0].cOwners : 0 );
+		cFailed++;
+	}
+	cChecks++;
+	if ( 5 != Audit.cSqlSpns || 1 != SpnAuditUnmatchedCount( &Audit ) )
+	{
+		printf( "FAIL MSSQLSvc hosts: %u SPNs, %u unmatched\n", Audit.cSqlSpns, SpnAuditUnmatchedCount( &Audit ) );
+		SpnAuditReport( &Audit, 10, PrintLine, NULL, stdout );
+		cFailed++;
+	}
+	SpnAuditFree( &Audit );
+
+	// csvde: quoted DNs with commas and doubled quotes, ';' between values, an empty column.
+	cChecks++;
+	pFile = tmpfile();
+	if ( NULL != pFile )
+	{
+		fputs( g_szCheckCsv, pFile );
+		rewind( pFile );
+		SpnAuditInit( &Audit, 64 * 1048576 );
+		SpnAuditSource( &Audit, &Source );
+		cRecords = SpnReadCsv( pFile, &Source );
+		fclose( pFile );
+		if ( 2 != cRecords || 4 != Audit.cSpns || 1 != Audit.cDups || 1 != SpnAuditUnmatchedCount( &Audit ) ||
+			 0 != strcmp( Audit.rgpszAccounts[1], "CN=svc \"sql\",DC=contoso,DC=com" ) )
+		{
+			printf( "FAIL csv: %ld records, %llu SPNs, %u duplicates, %u unmatched\n", cRecords, (unsigned long long) Audit.cSpns,
+					Audit.cDups, SpnAuditUnmatchedCount( &Audit ) );
+			cFailed++;
+		}
+		SpnAuditFree( &Audit );
+	}
+	else
+	{
+		printf( "FAIL tmpfile\n" );
+		cFailed++;
+	}
+
+	// Growth past the first table without false duplicates.
+	cChecks++;
+	SpnAuditInit( &Audit, 256 * 1048576 );
+	AddSynthetic( &Audit, 100000 );
+	if ( 400000 != Audit.cUnique || 100 != Audit.cDups || 0 != Audit.cDropped || 0 != SpnAuditUnmatchedCount( &Audit ) )
+	{
+		printf( "FAIL growth: %u distinct, %u duplicates, %llu dropped, %u unmatched\n", Audit.cUnique, Audit.cDups,
+				(unsigned long long) Audit.cDropped, SpnAuditUnmatchedCount( &Audit ) );
+		cFailed++;
+	}
+	SpnAuditFree( &Audit );
+
+	// The memory limit holds, the rest is counted, and the report still works.
+	cChecks++;
+	SpnAuditInit( &Audit, 4 * 1048576 );
+	AddSynthetic( &Audit, 300000 );
+	SpnAuditReport( &Audit, 5, NullLine, NULL, NULL );
+	if ( Audit.cbUsed > Audit.cbLimit || !Audit.fFull || 0 == Audit.cDropped || 1200000 + 300 != Audit.cSpns )
+	{
+		printf( "FAIL limit: %zu of %zu bytes, %llu dropped of %llu\n", Audit.cbUsed, Audit.cbLimit,
+				(unsigned long long) Audit.cDropped, (unsigned long long) Audit.cSpns );
+		cFailed++;
+	}
+	SpnAuditFree( &Audit );
+
+	cChecks++;
+	if ( !SpnSqlHost( "mssqlsvc/sql01.contoso.com.:1433", szHost, sizeof(szHost) ) || 0 != strcmp( szHost, "sql01.contoso.com" ) ||
+		 !SpnSqlHost( "MSSQLSvc/SQL01", szHost, sizeof(szHost) ) || 0 != strcmp( szHost, "SQL01" ) ||
+		 SpnSqlHost( "HTTP/sql01", szHost, sizeof(szHost) ) || SpnSqlHost( "MSSQLSvc/", szHost, sizeof(szHost) ) )
+	{
+		printf( "FAIL SpnSqlHost\n" );
+		cFailed++;
+	}
+
+	printf( "%d checks, %d failed\n", cChecks, cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static void Usage()
+{
+	fprintf( stderr, "Usage: spnaudit [-m MB] [-n lines] file.ldf|file.csv|-\n" );
+	fprintf( stderr, "       spnaudit -bench accounts [-m MB]\n" );
+	fprintf( stderr, "       spnaudit -check\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+	SPN_AUDIT Audit;
+	SPN_SOURCE Source;
+	FILE* pFile = NULL;
+	const char* pszFile = NULL;
+	size_t cMB = SPN_AUDIT_DEFAULT_MB;
+	uint32_t cLines = 200, cBench = 0;
+	clock_t tStart;
+	long cRecords;
+	int iArg;
+
+	if ( argc < 2 )
+	{
+		Usage();
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+
+	for ( iArg=1; iArg<argc; iArg++ )
+	{
+		if ( 0 == strcmp( argv[iArg], "-m" ) && iArg + 1 < argc ) cMB = (size_t) atol( argv[++iArg] );
+		else if ( 0 == strcmp( argv[iArg], "-n" ) && iArg + 1 < argc ) cLines = (uint32_t) atol( argv[++iArg] );
+		else if ( 0 == strcmp( argv[iArg], "-bench" ) && iArg + 1 < argc ) cBench = (uint32_t) atol( argv[++iArg] );
+		else pszFile = argv[iArg];
+	}
+	if ( NULL == pszFile && 0 == cBench )
+	{
+		Usage();
+		return 2;
+	}
+
+	if ( !SpnAuditInit( &Audit, cMB * 1048576 ) )
+	{
+		fprintf( stderr, "A %u MB limit is too small for the index\n", (unsigned) cMB );
+		return 1;
+	}
+
+	tStart = clock();
+	if ( cBench > 0 )
+	{
+		AddSynthetic( &Audit, cBench );
+	}
+	else
+	{
+		pFile = ( 0 == strcmp( pszFile, "-" ) ) ? stdin : fopen( pszFile, "rb" );
+		if ( NULL == pFile )
+		{
+			fprintf( stderr, "Cannot open %s\n", pszFile );
+			SpnAuditFree( &Audit );
+			return 1;
+		}
+		SpnAuditSource( &Audit, &Source );
+		cRecords = ( IsCsvFile( pszFile ) ) ? SpnReadCsv( pFile, &Source ) : SpnReadLdif( pFile, &Source );
+		if ( stdin != pFile ) fclose( pFile );
+		if ( cRecords < 0 ) fprintf( stderr, "Cannot read %s: out of memory, or a CSV file without a DN column\n", pszFile );
+	}
+
+	SpnAuditReport( &Audit, cLines, PrintLine, NULL, stdout );
+	printf( "%.3f s, %.0f ns per SPN\n", (double) ( clock() - tStart ) / CLOCKS_PER_SEC,
+			( Audit.cSpns > 0 ) ? 1e9 * ( clock() - tStart ) / CLOCKS_PER_SEC / Audit.cSpns : 0.0 );
+	SpnAuditFree( &Audit );
+	return 0;
+}
+
+#endif
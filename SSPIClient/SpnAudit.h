@@ -0,0 +1,106 @@
+#pragma once
+
+// Forest-wide SPN audit: every servicePrincipalName value is streamed through an index that keeps
+// 16 bytes per SPN (its 64-bit hash and the account it is on), so only duplicates and MSSQLSvc SPNs
+// keep their text.  Strings live in an arena and the whole index stays under a memory limit, past
+// it SPNs are counted but not indexed.  The values come from a paged global catalog search in
+// SSPIClient (DirectorySession.cpp) or from an LDIF or csvde export (SpnReadLdif, SpnReadCsv).
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPN_AUDIT_DEFAULT_MB	256
+#define SPN_AUDIT_BLOCK_SIZE	( 1024 * 1024 )
+#define SPN_AUDIT_MIN_SLOTS		( 1 << 16 )
+#define SPN_AUDIT_NONE			0xffffffff
+
+// Where the values of one account come from, SpnReadLdif and SpnReadCsv call these for each record.
+typedef struct _SPN_SOURCE
+{
+	void* pvContext;
+	void (*pfnAccount)( void* pvContext, const char* pszDN );			// Starts an account
+	void (*pfnHost)( void* pvContext, const char* pszDnsHostName );		// dNSHostName of that account
+	void (*pfnSpn)( void* pvContext, const char* pszSpn );				// One servicePrincipalName value
+	void (*pfnAttribute)( void* pvContext, const char* pszName, const char* pszValue );	// Any other value, may be NULL
+} SPN_SOURCE;
+
+typedef struct _SPN_AUDIT_ARENA_BLOCK
+{
+	struct _SPN_AUDIT_ARENA_BLOCK* pNext;
+	size_t cbUsed;
+	size_t cbSize;
+	char   rgb[1];
+} SPN_AUDIT_ARENA_BLOCK;
+
+typedef struct _SPN_AUDIT_SLOT
+{
+	uint64_t ui64Hash;					// FNV-1a of the lower case SPN, 0 for an empty slot
+	uint32_t iAccount;
+	uint32_t iDup;						// 1 + index in rgDups, 0 if the SPN is on one account
+} SPN_AUDIT_SLOT;
+
+typedef struct _SPN_AUDIT_DUP
+{
+	const char* pszSpn;
+	uint32_t    cOwners;
+	uint32_t    iFirstOwner;			// Index in rgOwners
+	uint32_t    iLastOwner;
+} SPN_AUDIT_DUP;
+
+typedef struct _SPN_AUDIT_OWNER
+{
+	uint32_t iAccount;
+	uint32_t iNext;						// SPN_AUDIT_NONE at the end
+} SPN_AUDIT_OWNER;
+
+typedef struct _SPN_AUDIT_SQL_SPN
+{
+	const char* pszSpn;
+	uint32_t    iAccount;
+} SPN_AUDIT_SQL_SPN;
+
+typedef struct _SPN_AUDIT
+{
+	size_t cbLimit;
+	size_t cbUsed;						// Arena blocks and tables
+	int    fFull;						// The limit was reached, later SPNs were only counted
+	SPN_AUDIT_ARENA_BLOCK* pArena;
+
+	SPN_AUDIT_SLOT* rgSlots;			// Open addressing, a power of two
+	uint32_t cSlots;
+	uint32_t cUnique;
+
+	uint64_t* rgHosts;					// Hashes of dNSHostName values and of their first label
+	uint32_t  cHostSlots;
+	uint32_t  cHosts;
+
+	const char** rgpszAccounts;			// DN of each account, in the arena
+	uint32_t cAccounts, cMaxAccounts;
+	SPN_AUDIT_DUP* rgDups;
+	uint32_t cDups, cMaxDups;
+	SPN_AUDIT_OWNER* rgOwners;
+	uint32_t cOwners, cMaxOwners;
+	SPN_AUDIT_SQL_SPN* rgSqlSpns;
+	uint32_t cSqlSpns, cMaxSqlSpns;
+
+	uint32_t iCurrentAccount;			// Account the next SPNs belong to
+	uint64_t cSpns;						// Values seen, including the ones not indexed
+	uint64_t cDropped;					// Values not indexed because of the memory limit
+} SPN_AUDIT;
+
+typedef void (*SPN_AUDIT_PRINT)( void* pvContext, const char* pszLine );
+typedef int  (*SPN_AUDIT_RESOLVE)( void* pvContext, const char* pszHost );	// 1 resolves, 0 does not, -1 unknown
+
+int  SpnAuditInit( SPN_AUDIT* pAudit, size_t cbLimit );
+void SpnAuditFree( SPN_AUDIT* pAudit );
+void SpnAuditAddAccount( SPN_AUDIT* pAudit, const char* pszDN );
+void SpnAuditAddHost( SPN_AUDIT* pAudit, const char* pszDnsHostName );
+void SpnAuditAddSpn( SPN_AUDIT* pAudit, const char* pszSpn );
+void SpnAuditSource( SPN_AUDIT* pAudit, SPN_SOURCE* pSource );
+uint32_t SpnAuditUnmatchedCount( const SPN_AUDIT* pAudit );
+void SpnAuditReport( const SPN_AUDIT* pAudit, uint32_t cMaxLines, SPN_AUDIT_PRINT pfnPrint, SPN_AUDIT_RESOLVE pfnResolve, void* pvContext );
+long SpnReadLdif( FILE* pFile, const SPN_SOURCE* pSource );
+long SpnReadCsv( FILE* pFile, const SPN_SOURCE* pSource );
+int  SpnSqlHost( const char* pszSpn, char* pszHost, size_t cchHost );
+uint64_t SpnHashNoCase( const char* psz, size_t cch );
@@ -0,0 +1,443 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// SpnCandidates.cpp: builds the SPNs a SQL Server target could be registered under, for the
+// concurrent Kerberos verification in SSPIClientDlg.cpp.
+//
+// Built without the precompiled header.  With SPNCANDIDATES_STANDALONE defined it also builds a
+// tool that prints the candidates for a server and checks the generation rules, e.g.
+//   g++ -O2 -DSPNCANDIDATES_STANDALONE SpnCandidates.cpp -o spncand
+//   ./spncand -p 1433 -a sqlalias.contoso.com sqlalias node1.contoso.com
+//   ./spncand -check
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SpnCandidates.h"
+
+static int ToLower( int c )
+{
+	return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+static int EqualNoCase( const char* psz1, const char* psz2 )
+{
+	while ( '\0' != *psz1 && ToLower( (unsigned char) *psz1 ) == ToLower( (unsigned char) *psz2 ) )
+	{
+		psz1++;
+		psz2++;
+	}
+	return ( '\0' == *psz1 && '\0' == *psz2 );
+}
+
+static void CopySpan( char* pszDest, size_t cchDest, const char* pszStart, const char* pszEnd )
+{
+	size_t cch = (size_t) ( pszEnd - pszStart );
+
+	if ( 0 == cchDest ) return;
+	if ( cch >= cchDest ) cch = cchDest - 1;
+	memcpy( pszDest, pszStart, cch );
+	pszDest[cch] = '\0';
+}
+
+// tcp:, np:, lpc:, admin: and via: are protocol prefixes, anything else before a colon is not.
+static int IsProtocolPrefix( const char* pszStart, const char* pszColon )
+{
+	static const char* rgpszProtocols[] = { "tcp", "np", "lpc", "admin", "via" };
+	char szPrefix[8];
+	size_t i;
+
+	if ( (size_t) ( pszColon - pszStart ) >= sizeof(szPrefix) ) return 0;
+	CopySpan( szPrefix, sizeof(szPrefix), pszStart, pszColon );
+	for ( i=0; i<sizeof(rgpszProtocols)/sizeof(rgpszProtocols[0]); i++ )
+	{
+		if ( EqualNoCase( szPrefix, rgpszProtocols[i] ) ) return 1;
+	}
+	return 0;
+}
+
+static int IsIPv4Literal( const char* pszHost )
+{
+	int cDots = 0;
+
+	if ( '\0' == *pszHost ) return 0;
+	for ( ; '\0' != *pszHost; pszHost++ )
+	{
+		if ( '.' == *pszHost ) cDots++;
+		else if ( *pszHost < '0' || *pszHost > '9' ) return 0;
+	}
+	return ( 3 == cDots );
+}
+
+// Names the client maps to this machine, the driver never puts them in an SPN.
+static int IsLocalAlias( const char* pszHost )
+{
+	return ( EqualNoCase( pszHost, "." ) || EqualNoCase( pszHost, "(local)" ) || EqualNoCase( pszHost, "localhost" ) );
+}
+
+// Splits a server name the way the drivers read it: "tcp:host\INST,1433", "host,1433",
+// "np:\\host\pipe\sql\query".  Returns 0 if no host name is left.
+int SpnParseServer( const char* pszServer, char* pszHost, size_t cchHost, char* pszInstance, size_t cchInstance, uint32_t* pdwPort )
+{
+	const char* p = pszServer;
+	const char* pszColon = NULL;
+	const char* pszComma = NULL;
+	const char* pszEnd = NULL;
+	const char* pszSlash = NULL;
+	unsigned long ulPort;
+
+	*pdwPort = 0;
+	if ( cchHost > 0 ) pszHost[0] = '\0';
+	if ( cchInstance > 0 ) pszInstance[0] = '\0';
+	if ( NULL == p ) return 0;
+
+	pszColon = strchr( p, ':' );
+	if ( NULL != pszColon && IsProtocolPrefix( p, pszColon ) ) p = pszColon + 1;
+
+	// A pipe path names the host, the rest of it is not an instance.
+	if ( '\\' == p[0] && '\\' == p[1] )
+	{
+		p += 2;
+		pszEnd = strchr( p, '\\' );
+		CopySpan( pszHost, cchHost, p, ( NULL != pszEnd ) ? pszEnd : p + strlen( p ) );
+		return ( '\0' != pszHost[0] );
+	}
+
+	pszComma = strchr( p, ',' );
+	if ( NULL != pszComma )
+	{
+		ulPort = strtoul( pszComma + 1, NULL, 10 );
+		if ( ulPort > 0 && ulPort <= 65535 ) *pdwPort = (uint32_t) ulPort;
+		pszEnd = pszComma;
+	}
+	else
+	{
+		pszEnd = p + strlen( p );
+	}
+
+	for ( pszSlash = p; pszSlash < pszEnd && '\\' != *pszSlash; pszSlash++ );
+	if ( pszSlash < pszEnd ) CopySpan( pszInstance, cchInstance, pszSlash + 1, pszEnd );
+	CopySpan( pszHost, cchHost, p, pszSlash );
+	return ( '\0' != pszHost[0] );
+}
+
+// Port of "service/host:port", 0 if the SPN has no numeric port.
+uint32_t SpnParsePort( const char* pszSpn )
+{
+	const char* pszSlash;
+	const char* pszColon;
+	const char* p;
+	unsigned long ulPort;
+
+	if ( NULL == pszSpn ) return 0;
+	pszSlash = strchr( pszSpn, '/' );
+	if ( NULL == pszSlash ) return 0;
+	pszColon = strrchr( pszSlash, ':' );
+	if ( NULL == pszColon || '\0' == pszColon[1] ) return 0;
+
+	for ( p = pszColon + 1; '\0' != *p; p++ )
+	{
+		if ( *p < '0' || *p > '9' ) return 0;
+	}
+	ulPort = strtoul( pszColon + 1, NULL, 10 );
+	return ( ulPort > 0 && ulPort <= 65535 ) ? (uint32_t) ulPort : 0;
+}
+
+static void AddCandidate( SPN_CANDIDATE* rgCandidates, uint32_t* pcCandidates, uint32_t cMaxCandidates, const char* pszSpn, int iHost, int iSuffix )
+{
+	uint32_t i;
+
+	if ( *pcCandidates >= cMaxCandidates ) return;
+	if ( strlen( pszSpn ) >= SPN_MAX_LENGTH ) return;
+	for ( i=0; i<*pcCandidates; i++ )
+	{
+		if ( EqualNoCase( rgCandidates[i].szSpn, pszSpn ) ) return;
+	}
+
+	strcpy( rgCandidates[*pcCandidates].szSpn, pszSpn );
+	rgCandidates[*pcCandidates].iHost   = iHost;
+	rgCandidates[*pcCandidates].iSuffix = iSuffix;
+	(*pcCandidates)++;
+}
+
+typedef struct _SPN_HOST
+{
+	char szName[SPN_MAX_LENGTH];
+	int  iHost;
+} SPN_HOST;
+
+static void AddHost( SPN_HOST* rgHosts, uint32_t* pcHosts, uint32_t cMaxHosts, const char* pszName, int iHost )
+{
+	uint32_t i;
+
+	if ( NULL == pszName || '\0' == pszName[0] || IsLocalAlias( pszName ) ) return;
+	if ( *pcHosts >= cMaxHosts || strlen( pszName ) >= SPN_MAX_LENGTH ) return;
+	for ( i=0; i<*pcHosts; i++ )
+	{
+		if ( EqualNoCase( rgHosts[i].szName, pszName ) ) return;
+	}
+	strcpy( rgHosts[*pcHosts].szName, pszName );
+	rgHosts[*pcHosts].iHost = iHost;
+	(*pcHosts)++;
+}
+
+static void AddShortHost( SPN_HOST* rgHosts, uint32_t* pcHosts, uint32_t cMaxHosts, const char* pszName )
+{
+	char szShort[SPN_MAX_LENGTH];
+	const char* pszDot;
+
+	if ( NULL == pszName || IsIPv4Literal( pszName ) ) return;
+	pszDot = strchr( pszName, '.' );
+	if ( NULL == pszDot || pszDot == pszName ) return;
+	CopySpan( szShort, sizeof(szShort), pszName, pszDot );
+	AddHost( rgHosts, pcHosts, cMaxHosts, szShort, SPN_HOST_SHORT );
+}
+
+// The captured SPN first, then for each host name (canonical, as typed, aliases, short names)
+// the port, instance and bare forms.  Without a port the one in the captured SPN is used, and
+// without either a default instance is assumed to listen on 1433.
+uint32_t SpnBuildCandidates( const SPN_TARGET* pTarget, SPN_CANDIDATE* rgCandidates, uint32_t cMaxCandidates )
+{
+	SPN_HOST rgHosts[2 * ( 2 + SPN_MAX_ALIASES )];
+	const uint32_t cMaxHosts = (uint32_t) ( sizeof(rgHosts) / sizeof(rgHosts[0]) );
+	const char* pszService = ( NULL != pTarget->pszService ) ? pTarget->pszService : "MSSQLSvc";
+	const char* pszInstance = ( NULL != pTarget->pszInstance && '\0' != pTarget->pszInstance[0] ) ? pTarget->pszInstance : NULL;
+	char szSpn[SPN_MAX_LENGTH];
+	uint32_t cCandidates = 0, cHosts = 0, cLongHosts, dwPort, i;
+	int cch;
+
+	if ( NULL != pTarget->pszCaptured && '\0' != pTarget->pszCaptured[0] )
+	{
+		AddCandidate( rgCandidates, &cCandidates, cMaxCandidates, pTarget->pszCaptured, SPN_HOST_CAPTURED, SPN_SUFFIX_AS_CAPTURED );
+	}
+
+	dwPort = pTarget->dwPort;
+	if ( 0 == dwPort ) dwPort = SpnParsePort( pTarget->pszCaptured );
+	if ( 0 == dwPort && NULL == pszInstance ) dwPort = 1433;
+
+	AddHost( rgHosts, &cHosts, cMaxHosts, pTarget->pszFqdn, SPN_HOST_FQDN );
+	AddHost( rgHosts, &cHosts, cMaxHosts, pTarget->pszInput, SPN_HOST_INPUT );
+	for ( i=0; i<pTarget->cAliases && i<SPN_MAX_ALIASES; i++ )
+	{
+		AddHost( rgHosts, &cHosts, cMaxHosts, pTarget->rgpszAliases[i], SPN_HOST_ALIAS );
+	}
+	cLongHosts = cHosts;
+	for ( i=0; i<cLongHosts; i++ )
+	{
+		AddShortHost( rgHosts, &cHosts, cMaxHosts, rgHosts[i].szName );
+	}
+
+	// A candidate longer than SPN_MAX_LENGTH cannot be an SPN, it is skipped rather than truncated.
+	for ( i=0; i<cHosts; i++ )
+	{
+		if ( 0 != dwPort )
+		{
+			cch = snprintf( szSpn, sizeof(szSpn), "%s/%s:%u", pszService, rgHosts[i].szName, dwPort );
+			if ( cch > 0 && cch < (int) sizeof(szSpn) ) AddCandidate( rgCandidates, &cCandidates, cMaxCandidates, szSpn, rgHosts[i].iHost, SPN_SUFFIX_PORT );
+		}
+		if ( NULL != pszInstance )
+		{
+			cch = snprintf( szSpn, sizeof(szSpn), "%s/%s:%s", pszService, rgHosts[i].szName, pszInstance );
+			if ( cch > 0 && cch < (int) sizeof(szSpn) ) AddCandidate( rgCandidates, &cCandidates, cMaxCandidates, szSpn, rgHosts[i].iHost, SPN_SUFFIX_INSTANCE );
+		}
+		cch = snprintf( szSpn, sizeof(szSpn), "%s/%s", pszService, rgHosts[i].szName );
+		if ( cch > 0 && cch < (int) sizeof(szSpn) ) AddCandidate( rgCandidates, &cCandidates, cMaxCandidates, szSpn, rgHosts[i].iHost, SPN_SUFFIX_NONE );
+	}
+	return cCandidates;
+}
+
+const char* SpnHostName( int iHost )
+{
+	switch ( iHost )
+	{
+		case SPN_HOST_CAPTURED:	return "driver";
+		case SPN_HOST_FQDN:		return "FQDN";
+		case SPN_HOST_INPUT:	return "as typed";
+		case SPN_HOST_ALIAS:	return "alias";
+		case SPN_HOST_SHORT:	return "short name";
+	}
+	return "unknown";
+}
+
+const char* SpnSuffixName( int iSuffix )
+{
+	switch ( iSuffix )
+	{
+		case SPN_SUFFIX_PORT:		return "port";
+		case SPN_SUFFIX_INSTANCE:	return "instance";
+		case SPN_SUFFIX_NONE:		return "no port";
+		case SPN_SUFFIX_AS_CAPTURED:	return "as sent";
+	}
+	return "unknown";
+}
+
+#ifdef SPNCANDIDATES_STANDALONE
+
+typedef struct _PARSE_CASE
+{
+	const char* pszServer;
+	const char* pszHost;
+	const char* pszInstance;
+	uint32_t    dwPort;
+} PARSE_CASE;
+
+static const PARSE_CASE g_rgParseCases[] =
+{
+	{ "sqlprod01",							"sqlprod01",	"",		0 },
+	{ "tcp:sqlprod01\\INST1,1500",			"sqlprod01",	"INST1",	1500 },
+	{ "sqlprod01.contoso.com,1433",			"sqlprod01.contoso.com", "",	1433 },
+	{ "np:\\\\sqlprod01\\pipe\\sql\\query",	"sqlprod01",	"",		0 },
+	{ "10.1.2.3,99999",						"10.1.2.3",		"",		0 },
+	{ "lpc:(local)\\SQLEXPRESS",			"(local)",		"SQLEXPRESS",	0 },
+};
+
+static int CheckCandidates( const char* pszName, const SPN_TARGET* pTarget, const char** rgpszExpected, uint32_t cExpected )
+{
+	SPN_CANDIDATE rgCandidates[SPN_MAX_CANDIDATES];
+	uint32_t cCandidates, i;
+
+	cCandidates = SpnBuildCandidates( pTarget, rgCandidates, SPN_MAX_CANDIDATES );
+	if ( cCandidates != cExpected )
+	{
+		printf( "FAIL %s: %u candidates, expected %u\n", pszName, cCandidates, cExpected );
+		for ( i=0; i<cCandidates; i++ ) printf( "  %s\n", rgCandidates[i].szSpn );
+		return 1;
+	}
+	for ( i=0; i<cExpected; i++ )
+	{
+		if ( NULL != rgpszExpected[i] && 0 != strcmp( rgCandidates[i].szSpn, rgpszExpected[i] ) )
+		{
+			printf( "FAIL %s: candidate %u is %s, expected %s\n", pszName, i, rgCandidates[i].szSpn, rgpszExpected[i] );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int RunChecks()
+{
+	static const char* rgpszDefault[] = { "MSSQLSvc/sqlprod01.contoso.com:1433", "MSSQLSvc/sqlprod01.contoso.com",
+										  "MSSQLSvc/SQLPROD01:1433", "MSSQLSvc/SQLPROD01" };
+	static const char* rgpszCluster[] = { "MSSQLSvc/node1.contoso.com:50123", "MSSQLSvc/node1.contoso.com:INST1", "MSSQLSvc/node1.contoso.com",
+										  "MSSQLSvc/sqlalias.contoso.com:50123", NULL, NULL, NULL, NULL, NULL, NULL, NULL, "MSSQLSvc/sqlalias" };
+	static const char* rgpszIP[] = { "MSSQLSvc/10.1.2.3:1433", "MSSQLSvc/10.1.2.3" };
+	SPN_TARGET Target;
+	SPN_CANDIDATE rgSmall[3];
+	char szHost[64], szInstance[64];
+	uint32_t dwPort;
+	int i, cFailed = 0, cChecks = 0;
+	const int cParseCases = (int) ( sizeof(g_rgParseCases) / sizeof(g_rgParseCases[0]) );
+
+	for ( i=0; i<cParseCases; i++, cChecks++ )
+	{
+		const PARSE_CASE* pCase = &g_rgParseCases[i];
+		SpnParseServer( pCase->pszServer, szHost, sizeof(szHost), szInstance, sizeof(szInstance), &dwPort );
+		if ( 0 != strcmp( szHost, pCase->pszHost ) || 0 != strcmp( szInstance, pCase->pszInstance ) || dwPort != pCase->dwPort )
+		{
+			printf( "FAIL parse %s: [%s] [%s] %u\n", pCase->pszServer, szHost, szInstance, dwPort );
+			cFailed++;
+		}
+	}
+
+	// Default instance typed as a short name, which also stands for the FQDN's first label.
+	memset( &Target, 0, sizeof(Target) );
+	Target.pszInput = "SQLPROD01";
+	Target.pszFqdn  = "sqlprod01.contoso.com";
+	cFailed += CheckCandidates( "default instance", &Target, rgpszDefault, 4 );
+	cChecks++;
+
+	// Named instance behind a CNAME on a dynamic port, which only the captured SPN knows.
+	memset( &Target, 0, sizeof(Target) );
+	Target.pszInput    = "sqlalias.contoso.com";
+	Target.pszFqdn     = "node1.contoso.com";
+	Target.rgpszAliases[0] = "sqlalias.contoso.com";
+	Target.cAliases    = 1;
+	Target.pszInstance = "INST1";
+	Target.pszCaptured = "MSSQLSvc/node1.contoso.com:50123";
+	cFailed += CheckCandidates( "named instance alias", &Target, rgpszCluster, 12 );
+	cChecks++;
+
+	// An IP address has no short name, and (local) is never a host.
+	memset( &Target, 0, sizeof(Target) );
+	Target.pszInput = "(local)";
+	Target.pszFqdn  = "10.1.2.3";
+	cFailed += CheckCandidates( "IP address", &Target, rgpszIP, 2 );
+	cChecks++;
+
+	// Capacity is respected.
+	memset( &Target, 0, sizeof(Target) );
+	Target.pszInput = "sqlprod01";
+	Target.pszFqdn  = "sqlprod01.contoso.com";
+	Target.pszInstance = "INST1";
+	if ( 3 != SpnBuildCandidates( &Target, rgSmall, 3 ) || 50 != SpnParsePort( "MSSQLSvc/h:50" ) || 0 != SpnParsePort( "MSSQLSvc/h:INST" ) )
+	{
+		printf( "FAIL capacity or port parsing\n" );
+		cFailed++;
+	}
+	cChecks++;
+
+	printf( "%d checks, %d failed\n", cChecks, cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static void Usage()
+{
+	fprintf( stderr, "Usage: spncand [-p port] [-i instance] [-a alias]... [-c captured SPN] server [fqdn]\n" );
+	fprintf( stderr, "       spncand -check\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+	static SPN_CANDIDATE rgCandidates[SPN_MAX_CANDIDATES];
+	SPN_TARGET Target;
+	char szHost[SPN_MAX_LENGTH], szInstance[SPN_MAX_LENGTH];
+	uint32_t dwPort, cCandidates, i;
+	int iArg;
+
+	if ( argc < 2 )
+	{
+		Usage();
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+
+	memset( &Target, 0, sizeof(Target) );
+	for ( iArg=1; iArg<argc; iArg++ )
+	{
+		if ( 0 == strcmp( argv[iArg], "-p" ) && iArg + 1 < argc ) Target.dwPort = (uint32_t) atol( argv[++iArg] );
+		else if ( 0 == strcmp( argv[iArg], "-i" ) && iArg + 1 < argc ) Target.pszInstance = argv[++iArg];
+		else if ( 0 == strcmp( argv[iArg], "-c" ) && iArg + 1 < argc ) Target.pszCaptured = argv[++iArg];
+		else if ( 0 == strcmp( argv[iArg], "-a" ) && iArg + 1 < argc )
+		{
+			if ( Target.cAliases < SPN_MAX_ALIASES ) Target.rgpszAliases[Target.cAliases++] = argv[iArg+1];
+			iArg++;
+		}
+		else if ( NULL == Target.pszInput ) Target.pszInput = argv[iArg];
+		else Target.pszFqdn = argv[iArg];
+	}
+	if ( NULL == Target.pszInput )
+	{
+		Usage();
+		return 2;
+	}
+
+	// The server may be given the way it is typed in the dialog.
+	if ( SpnParseServer( Target.pszInput, szHost, sizeof(szHost), szInstance, sizeof(szInstance), &dwPort ) )
+	{
+		Target.pszInput = szHost;
+		if ( 0 == Target.dwPort ) Target.dwPort = dwPort;
+		if ( NULL == Target.pszInstance && '\0' != szInstance[0] ) Target.pszInstance = szInstance;
+	}
+
+	cCandidates = SpnBuildCandidates( &Target, rgCandidates, SPN_MAX_CANDIDATES );
+	for ( i=0; i<cCandidates; i++ )
+	{
+		printf( "%-60s %-10s %s\n", rgCandidates[i].szSpn, SpnHostName( rgCandidates[i].iHost ), SpnSuffixName( rgCandidates[i].iSuffix ) );
+	}
+	return 0;
+}
+
+#endif
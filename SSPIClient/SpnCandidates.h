@@ -0,0 +1,51 @@
+#pragma once
+
+// Candidate SPNs for a SQL Server target: every host name the client could have used (as typed,
+// short name, DNS canonical name, CNAME aliases) with the port, the instance name or nothing.
+// The SPN the driver builds depends on the driver, the protocol and whether the name was an
+// alias, so the verifier asks the KDC for all of them and shows which ones are registered.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPN_MAX_CANDIDATES		48
+#define SPN_MAX_LENGTH			300
+#define SPN_MAX_ALIASES			8
+
+// Where the host part of a candidate came from, SPN_CANDIDATE.iHost.
+#define SPN_HOST_CAPTURED		1		// The SPN the driver passed to InitializeSecurityContext
+#define SPN_HOST_FQDN			2		// Canonical name from DNS
+#define SPN_HOST_INPUT			3		// Server name as typed
+#define SPN_HOST_ALIAS			4		// CNAME DNS followed on the way to the canonical name
+#define SPN_HOST_SHORT			5		// First label of a dotted name
+
+// What follows the host, SPN_CANDIDATE.iSuffix.
+#define SPN_SUFFIX_PORT			1		// MSSQLSvc/host:1433, TCP
+#define SPN_SUFFIX_INSTANCE		2		// MSSQLSvc/host:INST, named pipes and shared memory (SQL Server 2008 and later)
+#define SPN_SUFFIX_NONE			3		// MSSQLSvc/host, default instance before SQL Server 2008
+#define SPN_SUFFIX_AS_CAPTURED	4
+
+typedef struct _SPN_TARGET
+{
+	const char* pszService;			// Service class, "MSSQLSvc"
+	const char* pszInput;			// Host as typed, without protocol, instance or port
+	const char* pszFqdn;			// DNS canonical name, NULL if it did not resolve
+	const char* rgpszAliases[SPN_MAX_ALIASES];
+	uint32_t    cAliases;
+	uint32_t    dwPort;				// 0 when unknown, e.g. a named instance on a dynamic port
+	const char* pszInstance;		// NULL or "" for the default instance
+	const char* pszCaptured;		// SPN the driver used, NULL or "" if none was seen
+} SPN_TARGET;
+
+typedef struct _SPN_CANDIDATE
+{
+	char szSpn[SPN_MAX_LENGTH];
+	int  iHost;						// SPN_HOST_*
+	int  iSuffix;					// SPN_SUFFIX_*
+} SPN_CANDIDATE;
+
+int SpnParseServer( const char* pszServer, char* pszHost, size_t cchHost, char* pszInstance, size_t cchInstance, uint32_t* pdwPort );
+uint32_t SpnParsePort( const char* pszSpn );
+uint32_t SpnBuildCandidates( const SPN_TARGET* pTarget, SPN_CANDIDATE* rgCandidates, uint32_t cMaxCandidates );
+const char* SpnHostName( int iHost );
+const char* SpnSuffixName( int iSuffix );
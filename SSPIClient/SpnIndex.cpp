@@ -0,0 +1,745 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// SpnIndex.cpp: builds the offline SPN index from an LDIF or csvde export, and maps and searches
+// it for the SPN checks in DirectorySession.cpp (spnindex=<file>).
+//
+// Built without the precompiled header.  With SPNINDEX_STANDALONE defined it also builds a tool
+// that builds and queries an index, e.g.
+//   g++ -O2 -DSPNINDEX_STANDALONE SpnIndex.cpp SpnAudit.cpp PerfStats.cpp -o spnindex
+//   ./spnindex -build spns.idx spns.ldf
+//   ./spnindex spns.idx MSSQLSvc/sql01.contoso.com:1433
+//   ./spnindex -bench spns.idx 1000000
+//   ./spnindex -check
+//
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "SpnIndex.h"
+#include "SpnAudit.h"
+
+static int ToLower( int c )
+{
+	return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+// The order of the index, so the builder and the lookup must both use it.
+static int CompareNoCase( const char* psz1, const char* psz2 )
+{
+	int c1, c2;
+
+	do
+	{
+		c1 = ToLower( (unsigned char) *psz1++ );
+		c2 = ToLower( (unsigned char) *psz2++ );
+	}
+	while ( c1 == c2 && '\0' != c1 );
+	return c1 - c2;
+}
+
+static int EqualNoCase( const char* psz1, const char* psz2 )
+{
+	return ( 0 == CompareNoCase( psz1, psz2 ) );
+}
+
+typedef struct _SPN_INDEX_BUILDER
+{
+	char*              pszStrings;
+	size_t             cbStrings, cbMaxStrings;
+	SPN_INDEX_SPN*     rgSpns;
+	uint32_t           cSpns, cMaxSpns;
+	SPN_INDEX_ACCOUNT* rgAccounts;
+	uint32_t           cAccounts, cMaxAccounts;
+	int                fFailed;			// Out of memory or past 4 GB
+} SPN_INDEX_BUILDER;
+
+static uint32_t AddString( SPN_INDEX_BUILDER* pBuilder, const char* psz )
+{
+	size_t cb = strlen( psz ) + 1;
+	size_t cbNew;
+	char* pszNew = NULL;
+	uint32_t ib;
+
+	if ( '\0' == psz[0] ) return 0;			// The empty string every index starts with
+	if ( pBuilder->cbStrings + cb > 0xffffffff )
+	{
+		pBuilder->fFailed = 1;
+		return 0;
+	}
+	if ( pBuilder->cbStrings + cb > pBuilder->cbMaxStrings )
+	{
+		cbNew = ( 0 == pBuilder->cbMaxStrings ) ? 65536 : pBuilder->cbMaxStrings * 2;
+		while ( cbNew < pBuilder->cbStrings + cb ) cbNew *= 2;
+		pszNew = (char*) realloc( pBuilder->pszStrings, cbNew );
+		if ( NULL == pszNew )
+		{
+			pBuilder->fFailed = 1;
+			return 0;
+		}
+		pBuilder->pszStrings = pszNew;
+		pBuilder->cbMaxStrings = cbNew;
+	}
+	ib = (uint32_t) pBuilder->cbStrings;
+	memcpy( &pBuilder->pszStrings[ib], psz, cb );
+	pBuilder->cbStrings += cb;
+	return ib;
+}
+
+static int GrowItems( void** ppv, uint32_t* pcMax, size_t cbItem )
+{
+	uint32_t cNew = ( 0 == *pcMax ) ? 1024 : *pcMax * 2;
+	void* pvNew = NULL;
+
+	if ( cNew < *pcMax ) return 0;
+	pvNew = realloc( *ppv, cNew * cbItem );
+	if ( NULL == pvNew ) return 0;
+	*ppv = pvNew;
+	*pcMax = cNew;
+	return 1;
+}
+
+static SPN_INDEX_ACCOUNT* CurrentAccount( SPN_INDEX_BUILDER* pBuilder )
+{
+	return ( 0 == pBuilder->cAccounts || pBuilder->fFailed ) ? NULL : &pBuilder->rgAccounts[pBuilder->cAccounts - 1];
+}
+
+static void BuildAccount( void* pvContext, const char* pszDN )
+{
+	SPN_INDEX_BUILDER* pBuilder = (SPN_INDEX_BUILDER*) pvContext;
+	SPN_INDEX_ACCOUNT* pAccount = NULL;
+
+	if ( pBuilder->fFailed ) return;
+	if ( pBuilder->cAccounts == pBuilder->cMaxAccounts &&
+		 !GrowItems( (void**) &pBuilder->rgAccounts, &pBuilder->cMaxAccounts, sizeof(SPN_INDEX_ACCOUNT) ) )
+	{
+		pBuilder->fFailed = 1;
+		return;
+	}
+	pAccount = &pBuilder->rgAccounts[pBuilder->cAccounts++];
+	memset( pAccount, 0, sizeof(*pAccount) );
+	pAccount->ibDN = AddString( pBuilder, pszDN );
+}
+
+static void BuildHost( void* pvContext, const char* pszDnsHostName )
+{
+	SPN_INDEX_BUILDER* pBuilder = (SPN_INDEX_BUILDER*) pvContext;
+	SPN_INDEX_ACCOUNT* pAccount = CurrentAccount( pBuilder );
+
+	if ( NULL != pAccount ) pAccount->ibDnsHostName = AddString( pBuilder, pszDnsHostName );
+}
+
+static void BuildSpn( void* pvContext, const char* pszSpn )
+{
+	SPN_INDEX_BUILDER* pBuilder = (SPN_INDEX_BUILDER*) pvContext;
+	SPN_INDEX_ACCOUNT* pAccount = CurrentAccount( pBuilder );
+	SPN_INDEX_SPN* pSpn = NULL;
+
+	if ( NULL == pAccount ) return;
+	if ( pBuilder->cSpns == pBuilder->cMaxSpns &&
+		 !GrowItems( (void**) &pBuilder->rgSpns, &pBuilder->cMaxSpns, sizeof(SPN_INDEX_SPN) ) )
+	{
+		pBuilder->fFailed = 1;
+		return;
+	}
+	pSpn = &pBuilder->rgSpns[pBuilder->cSpns++];
+	pSpn->ibSpn = AddString( pBuilder, pszSpn );
+	pSpn->iAccount = pBuilder->cAccounts - 1;
+	pAccount->cSpns++;
+}
+
+static void BuildAttribute( void* pvContext, const char* pszName, const char* pszValue )
+{
+	SPN_INDEX_BUILDER* pBuilder = (SPN_INDEX_BUILDER*) pvContext;
+	SPN_INDEX_ACCOUNT* pAccount = CurrentAccount( pBuilder );
+
+	if ( NULL == pAccount ) return;
+	if ( EqualNoCase( pszName, "sAMAccountName" ) )
+	{
+		pAccount->ibSamAccountName = AddString( pBuilder, pszValue );
+	}
+	else if ( EqualNoCase( pszName, "userAccountControl" ) )
+	{
+		pAccount->dwUserAccountControl = (uint32_t) strtoul( pszValue, NULL, 0 );
+	}
+	else if ( EqualNoCase( pszName, "msDS-SupportedEncryptionTypes" ) )
+	{
+		pAccount->dwEncryptionTypes = (uint32_t) strtoul( pszValue, NULL, 0 );
+		pAccount->dwFlags |= SPN_INDEX_ACCOUNT_ENCTYPES;
+	}
+}
+
+// qsort has no context argument, the builder runs on one thread.
+static const char* g_pszSortStrings = NULL;
+
+static int CompareSpns( const void* pv1, const void* pv2 )
+{
+	const SPN_INDEX_SPN* pSpn1 = (const SPN_INDEX_SPN*) pv1;
+	const SPN_INDEX_SPN* pSpn2 = (const SPN_INDEX_SPN*) pv2;
+	int iCompare = CompareNoCase( &g_pszSortStrings[pSpn1->ibSpn], &g_pszSortStrings[pSpn2->ibSpn] );
+
+	if ( 0 != iCompare ) return iCompare;
+	return ( pSpn1->iAccount < pSpn2->iAccount ) ? -1 : ( pSpn1->iAccount > pSpn2->iAccount );
+}
+
+// Reads the export (.csv for csvde, LDIF otherwise) and writes the index.  Returns 1 on success,
+// otherwise 0 with the reason in pszError.
+int SpnIndexBuild( const char* pszInput, const char* pszOutput, char* pszError, size_t cchError )
+{
+	SPN_INDEX_BUILDER Builder;
+	SPN_INDEX_HEADER Header;
+	SPN_SOURCE Source;
+	FILE* pFile = NULL;
+	size_t cch = strlen( pszInput );
+	uint64_t cbFile;
+	long cRecords;
+	int fRet = 0;
+
+	memset( &Builder, 0, sizeof(Builder) );
+	pszError[0] = '\0';
+	Builder.pszStrings = (char*) malloc( 65536 );
+	if ( NULL == Builder.pszStrings )
+	{
+		snprintf( pszError, cchError, "out of memory" );
+		return 0;
+	}
+	Builder.pszStrings[0] = '\0';
+	Builder.cbStrings = 1;
+	Builder.cbMaxStrings = 65536;
+
+	Source.pvContext    = &Builder;
+	Source.pfnAccount   = BuildAccount;
+	Source.pfnHost      = BuildHost;
+	Source.pfnSpn       = BuildSpn;
+	Source.pfnAttribute = BuildAttribute;
+
+	pFile = fopen( pszInput, "rb" );
+	if ( NULL == pFile )
+	{
+		snprintf( pszError, cchError, "cannot open %s", pszInput );
+		goto SpnIndexBuildExit;
+	}
+	if ( cch > 4 && EqualNoCase( &pszInput[cch-4], ".csv" ) ) cRecords = SpnReadCsv( pFile, &Source );
+	else cRecords = SpnReadLdif( pFile, &Source );
+	fclose( pFile );
+	pFile = NULL;
+
+	if ( cRecords < 0 || Builder.fFailed )
+	{
+		snprintf( pszError, cchError, "cannot read %s: out of memory, over 4 GB of strings, or a CSV file without a DN column", pszInput );
+		goto SpnIndexBuildExit;
+	}
+
+	g_pszSortStrings = Builder.pszStrings;
+	if ( Builder.cSpns > 0 ) qsort( Builder.rgSpns, Builder.cSpns, sizeof(SPN_INDEX_SPN), CompareSpns );
+	g_pszSortStrings = NULL;
+
+	memset( &Header, 0, sizeof(Header) );
+	memcpy( Header.szMagic, SPN_INDEX_MAGIC, sizeof(Header.szMagic) );
+	Header.dwVersion   = SPN_INDEX_VERSION;
+	Header.cSpns       = Builder.cSpns;
+	Header.cAccounts   = Builder.cAccounts;
+	Header.ibSpns      = sizeof(Header);
+	cbFile = (uint64_t) Header.ibSpns + (uint64_t) Builder.cSpns * sizeof(SPN_INDEX_SPN);
+	Header.ibAccounts  = (uint32_t) cbFile;
+	cbFile += (uint64_t) Builder.cAccounts * sizeof(SPN_INDEX_ACCOUNT);
+	Header.ibStrings   = (uint32_t) cbFile;
+	Header.cbStrings   = (uint32_t) Builder.cbStrings;
+	Header.ui64Created = (uint64_t) time( NULL );
+	cbFile += Builder.cbStrings;
+	if ( cbFile > 0xffffffff )
+	{
+		snprintf( pszError, cchError, "the index would be over 4 GB" );
+		goto SpnIndexBuildExit;
+	}
+
+	pFile = fopen( pszOutput, "wb" );
+	if ( NULL == pFile )
+	{
+		snprintf( pszError, cchError, "cannot create %s", pszOutput );
+		goto SpnIndexBuildExit;
+	}
+	if ( 1 != fwrite( &Header, sizeof(Header), 1, pFile ) ||
+		 Builder.cSpns != fwrite( Builder.rgSpns, sizeof(SPN_INDEX_SPN), Builder.cSpns, pFile ) ||
+		 Builder.cAccounts != fwrite( Builder.rgAccounts, sizeof(SPN_INDEX_ACCOUNT), Builder.cAccounts, pFile ) ||
+		 Builder.cbStrings != fwrite( Builder.pszStrings, 1, Builder.cbStrings, pFile ) )
+	{
+		snprintf( pszError, cchError, "cannot write %s", pszOutput );
+		fclose( pFile );
+		remove( pszOutput );
+		goto SpnIndexBuildExit;
+	}
+	if ( 0 != fclose( pFile ) )
+	{
+		snprintf( pszError, cchError, "cannot write %s", pszOutput );
+		remove( pszOutput );
+		goto SpnIndexBuildExit;
+	}
+	snprintf( pszError, cchError, "%u SPNs on %u accounts, %llu bytes", Builder.cSpns, Builder.cAccounts, (unsigned long long) cbFile );
+	fRet = 1;
+
+SpnIndexBuildExit:
+
+	free( Builder.pszStrings );
+	free( Builder.rgSpns );
+	free( Builder.rgAccounts );
+	return fRet;
+}
+
+// The header must describe tables inside the file and strings that end in '\0', after that every
+// offset in the tables is checked when it is used.
+static int ValidateIndex( SPN_INDEX* pIndex )
+{
+	const SPN_INDEX_HEADER* pHeader = (const SPN_INDEX_HEADER*) pIndex->pbFile;
+
+	if ( pIndex->cbFile < sizeof(SPN_INDEX_HEADER) ) return 0;
+	if ( 0 != memcmp( pHeader->szMagic, SPN_INDEX_MAGIC, sizeof(pHeader->szMagic) ) || SPN_INDEX_VERSION != pHeader->dwVersion ) return 0;
+	if ( 0 != pHeader->ibSpns % 4 || 0 != pHeader->ibAccounts % 4 ) return 0;
+	if ( (uint64_t) pHeader->ibSpns + (uint64_t) pHeader->cSpns * sizeof(SPN_INDEX_SPN) > pIndex->cbFile ) return 0;
+	if ( (uint64_t) pHeader->ibAccounts + (uint64_t) pHeader->cAccounts * sizeof(SPN_INDEX_ACCOUNT) > pIndex->cbFile ) return 0;
+	if ( 0 == pHeader->cbStrings || (uint64_t) pHeader->ibStrings + pHeader->cbStrings > pIndex->cbFile ) return 0;
+	if ( '\0' != pIndex->pbFile[pHeader->ibStrings + pHeader->cbStrings - 1] ) return 0;
+
+	pIndex->pHeader    = pHeader;
+	pIndex->rgSpns     = (const SPN_INDEX_SPN*) ( pIndex->pbFile + pHeader->ibSpns );
+	pIndex->rgAccounts = (const SPN_INDEX_ACCOUNT*) ( pIndex->pbFile + pHeader->ibAccounts );
+	pIndex->pszStrings = (const char*) ( pIndex->pbFile + pHeader->ibStrings );
+	return 1;
+}
+
+#ifdef _WIN32
+
+static int MapIndex( SPN_INDEX* pIndex, const char* pszPath )
+{
+	LARGE_INTEGER liSize;
+
+	pIndex->hFile = CreateFileA( pszPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+	if ( INVALID_HANDLE_VALUE == pIndex->hFile )
+	{
+		pIndex->hFile = NULL;
+		return (int) GetLastError();
+	}
+	if ( !GetFileSizeEx( pIndex->hFile, &liSize ) ) return (int) GetLastError();
+	if ( 0 == liSize.QuadPart || liSize.QuadPart > 0xffffffff ) return -1;
+	pIndex->cbFile = (size_t) liSize.QuadPart;
+
+	pIndex->hMapping = CreateFileMappingA( pIndex->hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( NULL == pIndex->hMapping ) return (int) GetLastError();
+	pIndex->pbFile = (const uint8_t*) MapViewOfFile( pIndex->hMapping, FILE_MAP_READ, 0, 0, 0 );
+	if ( NULL == pIndex->pbFile ) return (int) GetLastError();
+	return 0;
+}
+
+static void UnmapIndex( SPN_INDEX* pIndex )
+{
+	if ( NULL != pIndex->pbFile ) UnmapViewOfFile( pIndex->pbFile );
+	if ( NULL != pIndex->hMapping ) CloseHandle( pIndex->hMapping );
+	if ( NULL != pIndex->hFile ) CloseHandle( pIndex->hFile );
+}
+
+#else
+
+static int MapIndex( SPN_INDEX* pIndex, const char* pszPath )
+{
+	struct stat st;
+	void* pv = NULL;
+	int fd;
+
+	fd = open( pszPath, O_RDONLY );
+	if ( fd < 0 ) return errno;
+	if ( 0 != fstat( fd, &st ) )
+	{
+		close( fd );
+		return errno;
+	}
+	if ( 0 == st.st_size || (uint64_t) st.st_size > 0xffffffff )
+	{
+		close( fd );
+		return -1;
+	}
+	pIndex->cbFile = (size_t) st.st_size;
+
+	pv = mmap( NULL, pIndex->cbFile, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( MAP_FAILED == pv ) return errno;
+	pIndex->pbFile = (const uint8_t*) pv;
+	return 0;
+}
+
+static void UnmapIndex( SPN_INDEX* pIndex )
+{
+	if ( NULL != pIndex->pbFile ) munmap( (void*) pIndex->pbFile, pIndex->cbFile );
+}
+
+#endif
+
+// Maps the index read-only.  Returns 0, the system error, or -1 if the file is not an index.
+int SpnIndexOpen( SPN_INDEX* pIndex, const char* pszPath )
+{
+	int rc;
+
+	memset( pIndex, 0, sizeof(*pIndex) );
+	rc = MapIndex( pIndex, pszPath );
+	if ( 0 == rc && !ValidateIndex( pIndex ) ) rc = -1;
+	if ( 0 != rc ) SpnIndexClose( pIndex );
+	return rc;
+}
+
+void SpnIndexClose( SPN_INDEX* pIndex )
+{
+	UnmapIndex( pIndex );
+	memset( pIndex, 0, sizeof(*pIndex) );
+}
+
+static const char* IndexString( const SPN_INDEX* pIndex, uint32_t ib )
+{
+	return ( ib < pIndex->pHeader->cbStrings ) ? &pIndex->pszStrings[ib] : "";
+}
+
+// Accounts the SPN is on, up to cMaxOwners of them in rgOwners.  Returns how many there are.
+uint32_t SpnIndexLookup( const SPN_INDEX* pIndex, const char* pszSpn, SPN_INDEX_OWNER* rgOwners, uint32_t cMaxOwners )
+{
+	const SPN_INDEX_ACCOUNT* pAccount = NULL;
+	SPN_INDEX_OWNER* pOwner = NULL;
+	uint32_t iLow = 0, iHigh, iMid, cOwners = 0;
+
+	if ( NULL == pIndex->pHeader ) return 0;
+	iHigh = pIndex->pHeader->cSpns;
+
+	while ( iLow < iHigh )
+	{
+		iMid = iLow + ( iHigh - iLow ) / 2;
+		if ( CompareNoCase( IndexString( pIndex, pIndex->rgSpns[iMid].ibSpn ), pszSpn ) < 0 ) iLow = iMid + 1;
+		else iHigh = iMid;
+	}
+
+	for ( ; iLow < pIndex->pHeader->cSpns; iLow++ )
+	{
+		if ( !EqualNoCase( IndexString( pIndex, pIndex->rgSpns[iLow].ibSpn ), pszSpn ) ) break;
+		if ( pIndex->rgSpns[iLow].iAccount >= pIndex->pHeader->cAccounts ) continue;
+
+		if ( cOwners < cMaxOwners )
+		{
+			pAccount = &pIndex->rgAccounts[pIndex->rgSpns[iLow].iAccount];
+			pOwner = &rgOwners[cOwners];
+			pOwner->pszDN                = IndexString( pIndex, pAccount->ibDN );
+			pOwner->pszSamAccountName    = IndexString( pIndex, pAccount->ibSamAccountName );
+			pOwner->pszDnsHostName       = IndexString( pIndex, pAccount->ibDnsHostName );
+			pOwner->dwUserAccountControl = pAccount->dwUserAccountControl;
+			pOwner->dwEncryptionTypes    = pAccount->dwEncryptionTypes;
+			pOwner->fEncryptionTypes     = ( 0 != ( pAccount->dwFlags & SPN_INDEX_ACCOUNT_ENCTYPES ) );
+			pOwner->cSpns                = pAccount->cSpns;
+		}
+		cOwners++;
+	}
+	return cOwners;
+}
+
+#ifdef SPNINDEX_STANDALONE
+
+#include "PerfStats.h"
+
+static const char g_szCheckLdif[] =
+	"version: 1\n"
+	"\n"
+	"dn: CN=SQL01,OU=Servers,DC=contoso,DC=com\n"
+	"sAMAccountName: SQL01$\n"
+	"dNSHostName: sql01.contoso.com\n"
+	"userAccountControl: 4096\n"
+	"msDS-SupportedEncryptionTypes: 28\n"
+	"servicePrincipalName: MSSQLSvc/sql01.contoso.com:1433\n"
+	"servicePrincipalName: MSSQLSvc/SQL01:1433\n"
+	"servicePrincipalName: HOST/sql01\n"
+	"\n"
+	"dn: CN=svc-sql,OU=Service Accounts,DC=contoso,DC=com\n"
+	"sAMAccountName: svc-sql\n"
+	"userAccountControl: 66048\n"
+	"servicePrincipalName: MSSQLSvc/sql01.contoso.com:1433\n"
+	"servicePrincipalName: MSSQLSvc/sqlalias.contoso.com:1433\n";
+
+static const char g_szCheckCsv[] =
+	"DN,sAMAccountName,userAccountControl,msDS-SupportedEncryptionTypes,servicePrincipalName\r\n"
+	"\"CN=Web, Front End,OU=Servers,DC=contoso,DC=com\",WEB01$,4096,24,HTTP/web01.contoso.com;HTTP/web01\r\n";
+
+static void TempPath( char* pszPath, size_t cchPath, const char* pszName )
+{
+	const char* pszDir = getenv( "TMPDIR" );
+
+	if ( NULL == pszDir ) pszDir = getenv( "TEMP" );
+	if ( NULL == pszDir ) pszDir = ".";
+	snprintf( pszPath, cchPath, "%s/%s", pszDir, pszName );
+}
+
+static int WriteFile( const char* pszPath, const void* pv, size_t cb )
+{
+	FILE* pFile = fopen( pszPath, "wb" );
+	int fRet;
+
+	if ( NULL == pFile ) return 0;
+	fRet = ( cb == fwrite( pv, 1, cb, pFile ) );
+	return ( 0 == fclose( pFile ) ) && fRet;
+}
+
+static void PrintOwners( const char* pszSpn, const SPN_INDEX_OWNER* rgOwners, uint32_t cOwners, uint32_t cMaxOwners, double dUs )
+{
+	uint32_t i;
+
+	if ( 0 == cOwners )
+	{
+		printf( "SPN %s not found in the index (%.3f us)\n", pszSpn, dUs );
+		return;
+	}
+	printf( "SPN %s found on %u account(s) (%.3f us)%s\n", pszSpn, cOwners, dUs, ( cOwners > 1 ) ? ", DUPLICATE" : "" );
+	for ( i=0; i<cOwners && i<cMaxOwners; i++ )
+	{
+		printf( "  %02u. %29s = %s\n", i + 1, "distinguishedName", rgOwners[i].pszDN );
+		printf( "      %29s = %s\n", "sAMAccountName", rgOwners[i].pszSamAccountName );
+		if ( '\0' != rgOwners[i].pszDnsHostName[0] ) printf( "      %29s = %s\n", "dnsHostName", rgOwners[i].pszDnsHostName );
+		printf( "      %29s = 0x%08x\n", "userAccountControl", rgOwners[i].dwUserAccountControl );
+		if ( rgOwners[i].fEncryptionTypes ) printf( "      %29s = 0x%02x\n", "msDS-SupportedEncryptionTypes", rgOwners[i].dwEncryptionTypes );
+		else printf( "      %29s = not in the export\n", "msDS-SupportedEncryptionTypes" );
+		printf( "      %29s = %u values\n", "servicePrincipalName", rgOwners[i].cSpns );
+	}
+}
+
+static int RunBench( const char* pszIndex, uint32_t cLookups )
+{
+	SPN_INDEX Index;
+	SPN_INDEX_OWNER rgOwners[8];
+	uint64_t ui64Start, ui64Found = 0;
+	uint32_t i, iSpn = 1;
+	double dMs;
+	int rc;
+
+	rc = SpnIndexOpen( &Index, pszIndex );
+	if ( 0 != rc )
+	{
+		fprintf( stderr, "Cannot open %s (%d)\n", pszIndex, rc );
+		return 1;
+	}
+	if ( 0 == Index.pHeader->cSpns )
+	{
+		SpnIndexClose( &Index );
+		return 0;
+	}
+
+	// Every SPN of the index in a scattered order, so the lookups do not share cache lines.
+	ui64Start = PerfCounter();
+	for ( i=0; i<cLookups; i++ )
+	{
+		iSpn = (uint32_t) ( ( iSpn * 2654435761ULL + 1 ) % Index.pHeader->cSpns );
+		ui64Found += SpnIndexLookup( &Index, IndexString( &Index, Index.rgSpns[iSpn].ibSpn ), rgOwners, 8 );
+	}
+	dMs = PerfElapsedMs( ui64Start );
+	printf( "%u lookups in %u SPNs: %.3f ms, %.3f us per lookup, %llu owners\n", cLookups, Index.pHeader->cSpns, dMs,
+			1000.0 * dMs / cLookups, (unsigned long long) ui64Found );
+	SpnIndexClose( &Index );
+	return 0;
+}
+
+static int RunChecks()
+{
+	SPN_INDEX Index;
+	SPN_INDEX_OWNER rgOwners[4];
+	char szLdif[512], szCsv[512], szIndex[512], szMessage[256];
+	uint8_t* pbCopy = NULL;
+	uint32_t cOwners, i;
+	int cFailed = 0, cChecks = 0, n;
+	FILE* pFile = NULL;
+
+	TempPath( szLdif, sizeof(szLdif), "spnindex-check.ldf" );
+	TempPath( szCsv, sizeof(szCsv), "spnindex-check.csv" );
+	TempPath( szIndex, sizeof(szIndex), "spnindex-check.idx" );
+
+	// LDIF: a duplicate found in any case, with the account attributes the export carried.
+	cChecks++;
+	if ( !WriteFile( szLdif, g_szCheckLdif, strlen( g_szCheckLdif ) ) || !SpnIndexBuild( szLdif, szIndex, szMessage, sizeof(szMessage) ) ||
+		 0 != SpnIndexOpen( &Index, szIndex ) )
+	{
+		printf( "FAIL build from LDIF: %s\n", szMessage );
+		return 1;
+	}
+	cOwners = SpnIndexLookup( &Index, "mssqlsvc/SQL01.CONTOSO.COM:1433", rgOwners, 4 );
+	if ( 2 != cOwners || 0 != strcmp( rgOwners[0].pszSamAccountName, "SQL01$" ) || 0x1c != rgOwners[0].dwEncryptionTypes ||
+		 !rgOwners[0].fEncryptionTypes || 3 != rgOwners[0].cSpns || 0 != strcmp( rgOwners[0].pszDnsHostName, "sql01.contoso.com" ) ||
+		 0x10200 != rgOwners[1].dwUserAccountControl || rgOwners[1].fEncryptionTypes || 0 != strcmp( rgOwners[1].pszDnsHostName, "" ) )
+	{
+		printf( "FAIL LDIF duplicate: %u owners\n", cOwners );
+		cFailed++;
+	}
+	cChecks++;
+	if ( 1 != SpnIndexLookup( &Index, "HOST/sql01", rgOwners, 4 ) || 1 != SpnIndexLookup( &Index, "MSSQLSvc/sqlalias.contoso.com:1433", rgOwners, 1 ) ||
+		 0 != SpnIndexLookup( &Index, "MSSQLSvc/sql01.contoso.com", rgOwners, 4 ) || 0 != SpnIndexLookup( &Index, "", rgOwners, 4 ) ||
+		 0 != SpnIndexLookup( &Index, "zzz", rgOwners, 4 ) || 2 != SpnIndexLookup( &Index, "MSSQLSvc/sql01.contoso.com:1433", rgOwners, 0 ) )
+	{
+		printf( "FAIL LDIF lookups\n" );
+		cFailed++;
+	}
+
+	// Damaged copies of the index are refused, not read past their end.
+	cChecks++;
+	pbCopy = (uint8_t*) malloc( Index.cbFile );
+	if ( NULL != pbCopy )
+	{
+		const size_t cbCopy = Index.cbFile;
+		const uint32_t ibStrings = Index.pHeader->ibStrings;
+		int cAccepted = 0;
+
+		memcpy( pbCopy, Index.pbFile, cbCopy );
+		SpnIndexClose( &Index );
+
+		if ( WriteFile( szIndex, pbCopy, sizeof(SPN_INDEX_HEADER) - 1 ) && 0 == SpnIndexOpen( &Index, szIndex ) ) cAccepted++;
+		( (SPN_INDEX_HEADER*) pbCopy )->cSpns = 0x10000000;
+		if ( WriteFile( szIndex, pbCopy, cbCopy ) && 0 == SpnIndexOpen( &Index, szIndex ) ) cAccepted++;
+		( (SPN_INDEX_HEADER*) pbCopy )->cSpns = 5;
+		pbCopy[cbCopy - 1] = 'x';
+		if ( WriteFile( szIndex, pbCopy, cbCopy ) && 0 == SpnIndexOpen( &Index, szIndex ) ) cAccepted++;
+		pbCopy[cbCopy - 1] = '\0';
+		( (SPN_INDEX_HEADER*) pbCopy )->ibStrings = ibStrings + 1;
+		if ( WriteFile( szIndex, pbCopy, cbCopy ) && 0 == SpnIndexOpen( &Index, szIndex ) ) cAccepted++;
+
+		// Offsets inside the tables are checked on use: an SPN pointing past the strings reads as "".
+		( (SPN_INDEX_HEADER*) pbCopy )->ibStrings = ibStrings;
+		( (SPN_INDEX_SPN*) ( pbCopy + sizeof(SPN_INDEX_HEADER) ) )->ibSpn = 0x7fffffff;
+		( (SPN_INDEX_SPN*) ( pbCopy + sizeof(SPN_INDEX_HEADER) ) )->iAccount = 0x7fffffff;
+		if ( !WriteFile( szIndex, pbCopy, cbCopy ) || 0 != SpnIndexOpen( &Index, szIndex ) ) cAccepted += 10;
+		else
+		{
+			SpnIndexLookup( &Index, "HOST/sql01", rgOwners, 4 );
+			SpnIndexClose( &Index );
+		}
+		free( pbCopy );
+		if ( 0 != cAccepted )
+		{
+			printf( "FAIL damaged index: %d\n", cAccepted );
+			cFailed++;
+		}
+	}
+
+	// csvde with a comma in the DN.
+	cChecks++;
+	if ( !WriteFile( szCsv, g_szCheckCsv, strlen( g_szCheckCsv ) ) || !SpnIndexBuild( szCsv, szIndex, szMessage, sizeof(szMessage) ) ||
+		 0 != SpnIndexOpen( &Index, szIndex ) )
+	{
+		printf( "FAIL build from CSV: %s\n", szMessage );
+		cFailed++;
+	}
+	else
+	{
+		if ( 1 != SpnIndexLookup( &Index, "http/WEB01", rgOwners, 4 ) || 0 != strcmp( rgOwners[0].pszDN, "CN=Web, Front End,OU=Servers,DC=contoso,DC=com" ) ||
+			 0x18 != rgOwners[0].dwEncryptionTypes || 2 != rgOwners[0].cSpns )
+		{
+			printf( "FAIL CSV lookup\n" );
+			cFailed++;
+		}
+		SpnIndexClose( &Index );
+	}
+
+	// 100000 accounts: every SPN is found on its own account, the sort and the search agree.
+	cChecks++;
+	pFile = fopen( szLdif, "wb" );
+	if ( NULL != pFile )
+	{
+		for ( i=0; i<100000; i++ )
+		{
+			fprintf( pFile, "dn: CN=HOST%06u,DC=contoso,DC=com\nsAMAccountName: HOST%06u$\nservicePrincipalName: HOST/host%06u.contoso.com\n"
+					 "servicePrincipalName: MSSQLSvc/Host%06u.contoso.com:1433\n\n", i, i, i, i );
+		}
+		fclose( pFile );
+	}
+	if ( NULL == pFile || !SpnIndexBuild( szLdif, szIndex, szMessage, sizeof(szMessage) ) || 0 != SpnIndexOpen( &Index, szIndex ) )
+	{
+		printf( "FAIL build 100000 accounts: %s\n", szMessage );
+		cFailed++;
+	}
+	else
+	{
+		for ( i=0; i<100000; i+=7 )
+		{
+			n = snprintf( szMessage, sizeof(szMessage), "mssqlsvc/HOST%06u.contoso.com:1433", i );
+			if ( n < 0 || 1 != SpnIndexLookup( &Index, szMessage, rgOwners, 4 ) || (uint32_t) atoi( &rgOwners[0].pszSamAccountName[4] ) != i ) break;
+		}
+		if ( i < 100000 || 200000 != Index.pHeader->cSpns )
+		{
+			printf( "FAIL 100000 accounts: lookup %u\n", i );
+			cFailed++;
+		}
+		SpnIndexClose( &Index );
+	}
+
+	remove( szLdif );
+	remove( szCsv );
+	remove( szIndex );
+
+	printf( "%d checks, %d failed\n", cChecks, cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static void Usage()
+{
+	fprintf( stderr, "Usage: spnindex -build index.idx export.ldf|export.csv\n" );
+	fprintf( stderr, "       spnindex index.idx spn...\n" );
+	fprintf( stderr, "       spnindex -bench index.idx [lookups]\n" );
+	fprintf( stderr, "       spnindex -check\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+	SPN_INDEX Index;
+	SPN_INDEX_OWNER rgOwners[8];
+	char szMessage[512];
+	uint64_t ui64Start;
+	uint32_t cOwners;
+	double dUs;
+	int iArg, rc;
+
+	if ( argc < 2 )
+	{
+		Usage();
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+	if ( 0 == strcmp( argv[1], "-bench" ) && argc >= 3 ) return RunBench( argv[2], ( argc > 3 ) ? (uint32_t) atol( argv[3] ) : 1000000 );
+	if ( 0 == strcmp( argv[1], "-build" ) && 4 == argc )
+	{
+		ui64Start = PerfCounter();
+		rc = SpnIndexBuild( argv[3], argv[2], szMessage, sizeof(szMessage) );
+		printf( "%s%s, %.3f s\n", ( rc ) ? "" : "Failed: ", szMessage, PerfElapsedMs( ui64Start ) / 1000 );
+		return ( rc ) ? 0 : 1;
+	}
+	if ( argc < 3 || '-' == argv[1][0] )
+	{
+		Usage();
+		return 2;
+	}
+
+	rc = SpnIndexOpen( &Index, argv[1] );
+	if ( 0 != rc )
+	{
+		fprintf( stderr, "Cannot open %s (%d%s)\n", argv[1], rc, ( -1 == rc ) ? ", not an SPN index" : "" );
+		return 1;
+	}
+	for ( iArg=2; iArg<argc; iArg++ )
+	{
+		ui64Start = PerfCounter();
+		cOwners = SpnIndexLookup( &Index, argv[iArg], rgOwners, 8 );
+		dUs = 1000.0 * PerfElapsedMs( ui64Start );
+		PrintOwners( argv[iArg], rgOwners, cOwners, 8, dUs );
+	}
+	SpnIndexClose( &Index );
+	return 0;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+// Offline SPN index: an LDIF or csvde export of the accounts with SPNs turned into one file that
+// is mapped read-only and searched in place, for machines that cannot query Active Directory.
+// The file holds the SPNs sorted without case, each with the account it is on, the accounts
+// (DN, sAMAccountName, dNSHostName, userAccountControl, msDS-SupportedEncryptionTypes) and the
+// strings they point to.  A lookup is a binary search, the SPNs on several accounts are adjacent.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPN_INDEX_MAGIC			"SPNIDX1"
+#define SPN_INDEX_VERSION		1
+
+#define SPN_INDEX_ACCOUNT_ENCTYPES	0x00000001		// msDS-SupportedEncryptionTypes was in the export
+
+// All offsets are from the start of the file, all integers little endian.
+typedef struct _SPN_INDEX_HEADER
+{
+	char     szMagic[8];
+	uint32_t dwVersion;
+	uint32_t cSpns;
+	uint32_t cAccounts;
+	uint32_t ibSpns;					// SPN_INDEX_SPN[cSpns], sorted
+	uint32_t ibAccounts;				// SPN_INDEX_ACCOUNT[cAccounts]
+	uint32_t ibStrings;					// '\0' terminated strings, the first one empty
+	uint32_t cbStrings;
+	uint32_t dwReserved;
+	uint64_t ui64Created;				// Seconds since 1970 when the index was built
+} SPN_INDEX_HEADER;
+
+typedef struct _SPN_INDEX_SPN
+{
+	uint32_t ibSpn;						// Offset in the strings
+	uint32_t iAccount;
+} SPN_INDEX_SPN;
+
+typedef struct _SPN_INDEX_ACCOUNT
+{
+	uint32_t ibDN;
+	uint32_t ibSamAccountName;
+	uint32_t ibDnsHostName;
+	uint32_t dwUserAccountControl;
+	uint32_t dwEncryptionTypes;
+	uint32_t dwFlags;					// SPN_INDEX_ACCOUNT_*
+	uint32_t cSpns;						// servicePrincipalName values on the account
+} SPN_INDEX_ACCOUNT;
+
+// An open index, the pointers are into the mapping.
+typedef struct _SPN_INDEX
+{
+	const uint8_t*           pbFile;
+	size_t                   cbFile;
+	const SPN_INDEX_HEADER*  pHeader;
+	const SPN_INDEX_SPN*     rgSpns;
+	const SPN_INDEX_ACCOUNT* rgAccounts;
+	const char*              pszStrings;
+	void*                    hFile;		// Windows only
+	void*                    hMapping;
+} SPN_INDEX;
+
+typedef struct _SPN_INDEX_OWNER
+{
+	const char* pszDN;
+	const char* pszSamAccountName;
+	const char* pszDnsHostName;
+	uint32_t    dwUserAccountControl;
+	uint32_t    dwEncryptionTypes;
+	int         fEncryptionTypes;
+	uint32_t    cSpns;
+} SPN_INDEX_OWNER;
+
+int  SpnIndexBuild( const char* pszInput, const char* pszOutput, char* pszError, size_t cchError );
+int  SpnIndexOpen( SPN_INDEX* pIndex, const char* pszPath );
+void SpnIndexClose( SPN_INDEX* pIndex );
+uint32_t SpnIndexLookup( const SPN_INDEX* pIndex, const char* pszSpn, SPN_INDEX_OWNER* rgOwners, uint32_t cMaxOwners );
@@ -58,7 +58,7 @@ struct SSPIClient_Status
 	BOOL fExecuteSearch;
 	BOOL fSPNFoundInAD;
 	BOOL fDuplicateSPNFound;
-	BOOL fUsedKerberos;
+	BOOL fUsedKerberos;					// A Kerberos token left InitializeSecurityContext, or the context completed with Kerberos
 	char g_szSavedFQDN[1024];
 	char g_szSavedSQLServer[1024];
 	char g_szSavedSQLServerHost[1024];
@@ -72,6 +72,10 @@ struct SSPIClient_Status
 	BOOL fodbc13Available;
 	BOOL fodbc17Available;
 	BOOL fodbc18Available;
+	char szNegotiatedPackage[64];		// Package of the last completed non-Schannel client context
+	char g_szSavedDC[256];				// DsGetDcName DomainControllerName, DcSiteName and ClientSiteName
+	char g_szSavedDcSite[256];
+	char g_szSavedClientSite[256];
 };
 
 extern SSPIClient_Status g_STATUS;
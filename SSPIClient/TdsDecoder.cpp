@@ -0,0 +1,1155 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// TdsDecoder.cpp: streaming TDS message decoder and message timeline.
+//
+// Built without the precompiled header.  With TDSDECODER_STANDALONE defined it also builds a
+// command line tool that decodes TDSCAP capture files and benchmarks the decoder, e.g.
+//   g++ -O2 -DTDSDECODER_STANDALONE TdsDecoder.cpp PerfStats.cpp -o tdsdecode
+//   ./tdsdecode capture.tdscap
+//   ./tdsdecode -bench 1024
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TdsDecoder.h"
+
+#define TDS_STATE_HEADER		0
+#define TDS_STATE_PACKET		1
+#define TDS_STATE_TLS			2
+#define TDS_STATE_LOST			3
+
+#define TDS_TOK_TYPE			0
+#define TDS_TOK_LENGTH			1
+#define TDS_TOK_BODY			2
+#define TDS_TOK_FEATID			3
+#define TDS_TOK_FEATLEN			4
+#define TDS_TOK_FEATDATA		5
+#define TDS_TOK_STOP			6
+
+// How the length of a token is encoded.
+#define TDS_TOKLEN_NONE			0	// Needs column metadata to find its end, walking stops
+#define TDS_TOKLEN_FIXED		1
+#define TDS_TOKLEN_USHORT		2
+#define TDS_TOKLEN_DWORD		3
+#define TDS_TOKLEN_FEATEXT		4	// FEATUREEXTACK, a list of features ending with 0xFF
+
+#define TLS_MAX_RECORD			( 16384 + 2048 )
+
+#define TDS_MIN(a,b)			( ( (a) < (b) ) ? (a) : (b) )
+
+static uint16_t ReadBE16( const uint8_t* pb ) { return (uint16_t) ( ( pb[0] << 8 ) | pb[1] ); }
+static uint16_t ReadLE16( const uint8_t* pb ) { return (uint16_t) ( pb[0] | ( pb[1] << 8 ) ); }
+static uint32_t ReadLE32( const uint8_t* pb ) { return (uint32_t) pb[0] | ( (uint32_t) pb[1] << 8 ) | ( (uint32_t) pb[2] << 16 ) | ( (uint32_t) pb[3] << 24 ); }
+static uint32_t ReadBE32( const uint8_t* pb ) { return ( (uint32_t) pb[0] << 24 ) | ( (uint32_t) pb[1] << 16 ) | ( (uint32_t) pb[2] << 8 ) | (uint32_t) pb[3]; }
+
+const char* TdsPacketTypeName( uint8_t bType )
+{
+	switch ( bType )
+	{
+		case TDS_SQLBATCH:			return "SQLBatch";
+		case TDS_PRE70LOGIN:		return "PreTDS7Login";
+		case TDS_RPC:				return "RPC";
+		case TDS_TABULARRESULT:		return "TabularResult";
+		case TDS_ATTENTION:			return "Attention";
+		case TDS_BULKLOAD:			return "BulkLoad";
+		case TDS_FEDAUTHTOKEN:		return "FedAuthToken";
+		case TDS_TRANSACTION:		return "TransactionManager";
+		case TDS_LOGIN7:			return "LOGIN7";
+		case TDS_SSPI:				return "SSPI";
+		case TDS_PRELOGIN:			return "PRELOGIN";
+	}
+	return "Unknown";
+}
+
+const char* TdsTokenName( uint8_t bToken )
+{
+	switch ( bToken )
+	{
+		case TDS_TOKEN_COLMETADATA:		return "COLMETADATA";
+		case TDS_TOKEN_ORDER:			return "ORDER";
+		case TDS_TOKEN_ERROR:			return "ERROR";
+		case TDS_TOKEN_INFO:			return "INFO";
+		case TDS_TOKEN_RETURNVALUE:		return "RETURNVALUE";
+		case TDS_TOKEN_LOGINACK:		return "LOGINACK";
+		case TDS_TOKEN_FEATUREEXTACK:	return "FEATUREEXTACK";
+		case TDS_TOKEN_ROW:				return "ROW";
+		case TDS_TOKEN_NBCROW:			return "NBCROW";
+		case TDS_TOKEN_ENVCHANGE:		return "ENVCHANGE";
+		case TDS_TOKEN_SESSIONSTATE:	return "SESSIONSTATE";
+		case TDS_TOKEN_SSPI:			return "SSPI";
+		case TDS_TOKEN_FEDAUTHINFO:		return "FEDAUTHINFO";
+		case TDS_TOKEN_DONE:			return "DONE";
+		case TDS_TOKEN_DONEPROC:		return "DONEPROC";
+		case TDS_TOKEN_DONEINPROC:		return "DONEINPROC";
+		case TDS_TOKEN_RETURNSTATUS:	return "RETURNSTATUS";
+		case 0xA4:						return "TABNAME";
+		case 0xA5:						return "COLINFO";
+		case 0x88:						return "ALTMETADATA";
+		case 0xD3:						return "ALTROW";
+	}
+	return "Unknown";
+}
+
+const char* TlsContentTypeName( uint8_t bType )
+{
+	switch ( bType )
+	{
+		case 0x14:	return "TLS ChangeCipherSpec";
+		case 0x15:	return "TLS Alert";
+		case 0x16:	return "TLS Handshake";
+		case 0x17:	return "TLS ApplicationData";
+	}
+	return "TLS Unknown";
+}
+
+const char* TlsHandshakeTypeName( uint8_t bType )
+{
+	switch ( bType )
+	{
+		case 1:		return "ClientHello";
+		case 2:		return "ServerHello";
+		case 4:		return "NewSessionTicket";
+		case 11:	return "Certificate";
+		case 12:	return "ServerKeyExchange";
+		case 13:	return "CertificateRequest";
+		case 14:	return "ServerHelloDone";
+		case 15:	return "CertificateVerify";
+		case 16:	return "ClientKeyExchange";
+	}
+	// Anything else is most likely an encrypted Finished message.
+	return "encrypted";
+}
+
+static int IsTlsContentType( uint8_t b )
+{
+	return ( b >= 0x14 && b <= 0x17 );
+}
+
+static int IsTdsPacketType( uint8_t b )
+{
+	return ( 0 != strcmp( TdsPacketTypeName( b ), "Unknown" ) );
+}
+
+static int TdsTokenLayout( uint8_t bToken, uint32_t cbDoneToken, uint32_t* pcbFixed )
+{
+	*pcbFixed = 0;
+	switch ( bToken )
+	{
+		case TDS_TOKEN_DONE:
+		case TDS_TOKEN_DONEPROC:
+		case TDS_TOKEN_DONEINPROC:
+			*pcbFixed = cbDoneToken;
+			return TDS_TOKLEN_FIXED;
+
+		case TDS_TOKEN_RETURNSTATUS:
+			*pcbFixed = 4;
+			return TDS_TOKLEN_FIXED;
+
+		case TDS_TOKEN_ERROR:
+		case TDS_TOKEN_INFO:
+		case TDS_TOKEN_LOGINACK:
+		case TDS_TOKEN_ENVCHANGE:
+		case TDS_TOKEN_SSPI:
+		case TDS_TOKEN_ORDER:
+		case 0xA4:
+		case 0xA5:
+			return TDS_TOKLEN_USHORT;
+
+		case TDS_TOKEN_SESSIONSTATE:
+		case TDS_TOKEN_FEDAUTHINFO:
+			return TDS_TOKLEN_DWORD;
+
+		case TDS_TOKEN_FEATUREEXTACK:
+			return TDS_TOKLEN_FEATEXT;
+	}
+	return TDS_TOKLEN_NONE;
+}
+
+// Copies up to cchMax UCS-2 characters as printable ASCII.
+static void CopyUcs2( char* pszOut, size_t cchOut, const uint8_t* pb, size_t cbAvail, size_t cchMax )
+{
+	size_t i, cch = TDS_MIN( cbAvail / 2, cchMax );
+	uint16_t wc;
+
+	if ( 0 == cchOut ) return;
+	if ( cch > cchOut - 1 ) cch = cchOut - 1;
+	for ( i=0; i<cch; i++ )
+	{
+		wc = ReadLE16( pb + i*2 );
+		if ( '\r' == wc || '\n' == wc || '\t' == wc ) wc = ' ';
+		pszOut[i] = ( wc >= 0x20 && wc < 0x7F ) ? (char) wc : '.';
+	}
+	pszOut[cch] = '\0';
+}
+
+static void Emit( TDS_DECODER* pDecoder, TDS_EVENT* pEvent )
+{
+	if ( NULL != pDecoder->pfnEvent ) pDecoder->pfnEvent( pEvent, pDecoder->pvContext );
+}
+
+static void InitEvent( TDS_EVENT* pEvent, int iEvent, int iDirection, uint8_t bType, const char* pszName )
+{
+	memset( pEvent, 0, sizeof(TDS_EVENT) );
+	pEvent->iEvent     = iEvent;
+	pEvent->iDirection = iDirection;
+	pEvent->bType      = bType;
+	pEvent->pszName    = pszName;
+}
+
+static void EndMessage( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, int fIncomplete );
+
+static void LostSync( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, const char* pszReason )
+{
+	TDS_EVENT ev;
+
+	// Whatever was reassembled so far is still worth reporting.
+	if ( s->fInMessage ) EndMessage( pDecoder, s, iDirection, !s->fTlsFlight );
+
+	InitEvent( &ev, TDS_EVENT_ERROR, iDirection, s->rgbHeader[0], "Decode error" );
+	ev.ui64Offset  = s->ui64Offset - s->cbHeader;
+	ev.ui64StartUs = s->ui64LastUs;
+	ev.ui64EndUs   = s->ui64LastUs;
+	snprintf( ev.szDetail, sizeof(ev.szDetail),
+			  "%s, header %02x %02x %02x %02x %02x, rest of this direction is not decoded",
+			  pszReason, s->rgbHeader[0], s->rgbHeader[1], s->rgbHeader[2], s->rgbHeader[3], s->rgbHeader[4] );
+	pDecoder->cErrors++;
+	s->iState = TDS_STATE_LOST;
+	Emit( pDecoder, &ev );
+}
+
+//
+// Message descriptions, built from the first TDS_PEEK_SIZE bytes of the message.
+//
+
+static const char* PreloginEncryptionName( uint8_t b )
+{
+	switch ( b )
+	{
+		case 0:	return "OFF";
+		case 1:	return "ON";
+		case 2:	return "NOT_SUP";
+		case 3:	return "REQ";
+	}
+	return "other";
+}
+
+static void DescribePrelogin( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	const uint8_t* pb = s->rgbPeek;
+	uint32_t cb = s->cbPeek, i, cchUsed = 0;
+	uint16_t wOffset, wLength;
+	int cch;
+
+	// The TLS handshake runs inside PRELOGIN packets when encryption is negotiated in TDS 7.x.
+	if ( cb >= 2 && IsTlsContentType( pb[0] ) && 0x03 == pb[1] )
+	{
+		pEvent->pszName = "PRELOGIN (TLS)";
+		if ( 0x16 == pb[0] && cb >= 6 )
+		{
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "%s %s", TlsContentTypeName( pb[0] ), TlsHandshakeTypeName( pb[5] ) );
+		}
+		else
+		{
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "%s", TlsContentTypeName( pb[0] ) );
+		}
+		return;
+	}
+
+	// Option list: token, offset and length, terminated by 0xFF.
+	for ( i=0; i+5 <= cb && 0xFF != pb[i]; i+=5 )
+	{
+		wOffset = ReadBE16( pb + i + 1 );
+		wLength = ReadBE16( pb + i + 3 );
+		cch = 0;
+		if ( 0x00 == pb[i] && wLength >= 6 && (uint32_t) wOffset + 6 <= cb )
+		{
+			cch = snprintf( pEvent->szDetail + cchUsed, sizeof(pEvent->szDetail) - cchUsed, "%sVersion=%u.%u.%u",
+							( cchUsed ) ? " " : "", pb[wOffset], pb[wOffset+1], ReadBE16( pb + wOffset + 2 ) );
+		}
+		else if ( 0x01 == pb[i] && wLength >= 1 && (uint32_t) wOffset + 1 <= cb )
+		{
+			cch = snprintf( pEvent->szDetail + cchUsed, sizeof(pEvent->szDetail) - cchUsed, "%sEncryption=%s(%u)",
+							( cchUsed ) ? " " : "", PreloginEncryptionName( pb[wOffset] ), pb[wOffset] );
+		}
+		else if ( 0x04 == pb[i] && wLength >= 1 && (uint32_t) wOffset + 1 <= cb )
+		{
+			cch = snprintf( pEvent->szDetail + cchUsed, sizeof(pEvent->szDetail) - cchUsed, "%sMARS=%u",
+							( cchUsed ) ? " " : "", pb[wOffset] );
+		}
+		else if ( 0x06 == pb[i] && wLength >= 1 && (uint32_t) wOffset + 1 <= cb )
+		{
+			cch = snprintf( pEvent->szDetail + cchUsed, sizeof(pEvent->szDetail) - cchUsed, "%sFedAuthRequired=%u",
+							( cchUsed ) ? " " : "", pb[wOffset] );
+		}
+		if ( cch < 0 || (size_t) cch >= sizeof(pEvent->szDetail) - cchUsed ) break;
+		cchUsed += cch;
+	}
+}
+
+static void DescribeLogin7( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	const uint8_t* pb = s->rgbPeek;
+
+	// Length(4) TDSVersion(4) PacketSize(4) ClientProgVer(4) ClientPID(4) ConnectionID(4) OptionFlags1(1) OptionFlags2(1)
+	if ( s->cbPeek < 26 ) return;
+	snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "TDSVersion=0x%08x PacketSize=%u IntegratedSecurity=%s",
+			  ReadLE32( pb + 4 ), ReadLE32( pb + 8 ), ( pb[25] & 0x80 ) ? "Yes" : "No" );
+}
+
+static void DescribeSspi( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	const uint8_t* pb = s->rgbPeek;
+
+	if ( s->cbPeek >= 12 && 0 == memcmp( pb, "NTLMSSP", 8 ) )
+	{
+		snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "NTLMSSP message type %u", ReadLE32( pb + 8 ) );
+	}
+	else if ( s->cbPeek >= 1 && 0x60 == pb[0] )
+	{
+		snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "GSS-API initial token (SPNEGO/Kerberos)" );
+	}
+	else if ( s->cbPeek >= 1 && 0xA1 == pb[0] )
+	{
+		snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "SPNEGO negTokenResp" );
+	}
+}
+
+// Skips ALL_HEADERS (TDS 7.2 and later) and returns the offset of the data that follows.
+static uint32_t SkipAllHeaders( const TDS_STREAM* s )
+{
+	uint32_t cbHeaders;
+
+	if ( s->cbPeek < 4 ) return 0;
+	cbHeaders = ReadLE32( s->rgbPeek );
+	// Before TDS 7.2 there are no headers and the batch text starts right away.
+	if ( cbHeaders < 4 || cbHeaders > 1024 ) return 0;
+	return cbHeaders;
+}
+
+static void DescribeSqlBatch( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	char szText[64];
+	uint32_t iText = SkipAllHeaders( s );
+
+	if ( iText >= s->cbPeek ) return;
+	CopyUcs2( szText, sizeof(szText), s->rgbPeek + iText, s->cbPeek - iText, 48 );
+	snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Text=\"%s%s\"", szText, ( s->cbMessage - iText > 96 ) ? "..." : "" );
+}
+
+static void DescribeRpc( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	char szName[64];
+	uint32_t i = SkipAllHeaders( s );
+	uint16_t cchName;
+
+	if ( i + 2 > s->cbPeek ) return;
+	cchName = ReadLE16( s->rgbPeek + i );
+	if ( 0xFFFF == cchName )
+	{
+		if ( i + 4 > s->cbPeek ) return;
+		snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "ProcID=%u", ReadLE16( s->rgbPeek + i + 2 ) );
+		return;
+	}
+	CopyUcs2( szName, sizeof(szName), s->rgbPeek + i + 2, s->cbPeek - i - 2, cchName );
+	snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Proc=%s", szName );
+}
+
+static void DescribeMessage( const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	if ( s->fTlsFlight )
+	{
+		pEvent->pszName = TlsContentTypeName( s->bType );
+		if ( 0x16 == s->bType && s->cbPeek >= 1 )
+		{
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "first %s", TlsHandshakeTypeName( s->rgbPeek[0] ) );
+		}
+		return;
+	}
+
+	pEvent->pszName = TdsPacketTypeName( s->bType );
+	switch ( s->bType )
+	{
+		case TDS_PRELOGIN:		DescribePrelogin( s, pEvent ); break;
+		case TDS_LOGIN7:		DescribeLogin7( s, pEvent ); break;
+		case TDS_SSPI:			DescribeSspi( s, pEvent ); break;
+		case TDS_SQLBATCH:		DescribeSqlBatch( s, pEvent ); break;
+		case TDS_RPC:			DescribeRpc( s, pEvent ); break;
+		case TDS_TABULARRESULT:
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "%u tokens%s", s->cTokens,
+					  ( TDS_TOK_STOP == s->iTokState ) ? ", column and row data not decoded" : "" );
+			break;
+	}
+}
+
+//
+// Token walker.
+//
+
+static void DescribeToken( TDS_DECODER* pDecoder, const TDS_STREAM* s, TDS_EVENT* pEvent )
+{
+	const uint8_t* pb = s->rgbTok;
+	uint32_t cb = s->cbTok, dwVersion;
+	uint16_t wStatus;
+	char szText[128];
+
+	switch ( s->bToken )
+	{
+		case TDS_TOKEN_ERROR:
+		case TDS_TOKEN_INFO:
+			// Number(4) State(1) Class(1) MsgText(US_VARCHAR)
+			if ( cb < 8 ) break;
+			CopyUcs2( szText, sizeof(szText), pb + 8, cb - 8, ReadLE16( pb + 6 ) );
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Number=%u State=%u Class=%u Msg=\"%.100s\"",
+					  ReadLE32( pb ), pb[4], pb[5], szText );
+			break;
+
+		case TDS_TOKEN_LOGINACK:
+			// Interface(1) TDSVersion(4) ProgName(B_VARCHAR) ProgVersion(4)
+			if ( cb < 6 ) break;
+			dwVersion = ReadBE32( pb + 1 );
+			CopyUcs2( szText, sizeof(szText), pb + 6, cb - 6, pb[5] );
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "TDSVersion=0x%08x Prog=\"%s\"", dwVersion, szText );
+			if ( 6 + (uint32_t) pb[5] * 2 + 4 <= cb )
+			{
+				pb += 6 + pb[5] * 2;
+				snprintf( pEvent->szDetail + strlen( pEvent->szDetail ), sizeof(pEvent->szDetail) - strlen( pEvent->szDetail ),
+						  " Version=%u.%u.%u", pb[0], pb[1], ReadBE16( pb + 2 ) );
+			}
+			// DONE tokens have a 4 byte row count before TDS 7.2.
+			pDecoder->cbDoneToken = ( dwVersion >= 0x72090002 ) ? 12 : 8;
+			break;
+
+		case TDS_TOKEN_ENVCHANGE:
+			// Type(1) then for most types NewValue(B_VARCHAR) OldValue(B_VARCHAR)
+			if ( cb < 1 ) break;
+			if ( cb >= 2 && ( pb[0] <= 6 || 13 == pb[0] || 19 == pb[0] ) )
+			{
+				CopyUcs2( szText, sizeof(szText), pb + 2, cb - 2, pb[1] );
+				snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Type=%u New=\"%s\"", pb[0], szText );
+			}
+			else
+			{
+				snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Type=%u", pb[0] );
+			}
+			break;
+
+		case TDS_TOKEN_DONE:
+		case TDS_TOKEN_DONEPROC:
+		case TDS_TOKEN_DONEINPROC:
+			// Status(2) CurCmd(2) DoneRowCount(4 or 8)
+			if ( cb < 8 ) break;
+			wStatus = ReadLE16( pb );
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Status=0x%04x%s%s%s%s CurCmd=%u Rows=%u",
+					  wStatus,
+					  ( wStatus & 0x0001 ) ? " MORE" : "",
+					  ( wStatus & 0x0002 ) ? " ERROR" : "",
+					  ( wStatus & 0x0020 ) ? " ATTN" : "",
+					  ( wStatus & 0x0100 ) ? " SRVERROR" : "",
+					  ReadLE16( pb + 2 ),
+					  ReadLE32( pb + 4 ) );
+			break;
+
+		case TDS_TOKEN_RETURNSTATUS:
+			if ( cb < 4 ) break;
+			snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Value=%d", (int32_t) ReadLE32( pb ) );
+			break;
+
+		case TDS_TOKEN_FEATUREEXTACK:
+			// rgbTok holds the feature ids that were acknowledged.
+			{
+				uint32_t i, cchUsed;
+				cchUsed = snprintf( pEvent->szDetail, sizeof(pEvent->szDetail), "Features=" );
+				for ( i=0; i<cb && cchUsed + 6 < sizeof(pEvent->szDetail); i++ )
+				{
+					cchUsed += snprintf( pEvent->szDetail + cchUsed, sizeof(pEvent->szDetail) - cchUsed, "%s0x%02x", ( i ) ? "," : "", pb[i] );
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void EmitToken( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, uint64_t cbToken )
+{
+	TDS_EVENT ev;
+
+	s->cTokens++;
+	pDecoder->cTokens++;
+	if ( NULL == pDecoder->pfnEvent ) return;
+
+	InitEvent( &ev, TDS_EVENT_TOKEN, iDirection, s->bToken, TdsTokenName( s->bToken ) );
+	ev.cbMessage   = cbToken;
+	ev.ui64StartUs = s->ui64LastUs;
+	ev.ui64EndUs   = s->ui64LastUs;
+	DescribeToken( pDecoder, s, &ev );
+	Emit( pDecoder, &ev );
+}
+
+static void StopTokens( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection )
+{
+	TDS_EVENT ev;
+
+	s->iTokState = TDS_TOK_STOP;
+	if ( NULL == pDecoder->pfnEvent ) return;
+
+	InitEvent( &ev, TDS_EVENT_TOKEN, iDirection, s->bToken, TdsTokenName( s->bToken ) );
+	ev.ui64StartUs = s->ui64LastUs;
+	ev.ui64EndUs   = s->ui64LastUs;
+	snprintf( ev.szDetail, sizeof(ev.szDetail), "rest of the response is not decoded" );
+	Emit( pDecoder, &ev );
+}
+
+static void WalkTokens( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, const uint8_t* pb, size_t cb )
+{
+	uint32_t cbFixed, n;
+	uint64_t cbSkip;
+
+	while ( cb > 0 )
+	{
+		switch ( s->iTokState )
+		{
+			case TDS_TOK_TYPE:
+				s->bToken   = *pb++;
+				cb--;
+				s->cbTok    = 0;
+				s->cbTokLen = 0;
+				switch ( TdsTokenLayout( s->bToken, pDecoder->cbDoneToken, &cbFixed ) )
+				{
+					case TDS_TOKLEN_FIXED:
+						s->cbTokRemaining = cbFixed;
+						s->iTokState      = TDS_TOK_BODY;
+						break;
+					case TDS_TOKLEN_USHORT:
+						s->cbTokLenNeeded = 2;
+						s->iTokState      = TDS_TOK_LENGTH;
+						break;
+					case TDS_TOKLEN_DWORD:
+						s->cbTokLenNeeded = 4;
+						s->iTokState      = TDS_TOK_LENGTH;
+						break;
+					case TDS_TOKLEN_FEATEXT:
+						s->iTokState      = TDS_TOK_FEATID;
+						break;
+					default:
+						StopTokens( pDecoder, s, iDirection );
+						return;
+				}
+				break;
+
+			case TDS_TOK_LENGTH:
+			case TDS_TOK_FEATLEN:
+				n = (uint32_t) TDS_MIN( cb, (size_t) ( s->cbTokLenNeeded - s->cbTokLen ) );
+				memcpy( s->rgbTokLen + s->cbTokLen, pb, n );
+				s->cbTokLen += n;
+				pb += n;
+				cb -= n;
+				if ( s->cbTokLen < s->cbTokLenNeeded ) break;
+				s->cbTokRemaining = ( 2 == s->cbTokLenNeeded ) ? ReadLE16( s->rgbTokLen ) : ReadLE32( s->rgbTokLen );
+				s->cbTokLen       = 0;
+				s->iTokState      = ( TDS_TOK_LENGTH == s->iTokState ) ? TDS_TOK_BODY : TDS_TOK_FEATDATA;
+				break;
+
+			case TDS_TOK_BODY:
+				cbSkip = TDS_MIN( (uint64_t) cb, s->cbTokRemaining );
+				if ( s->cbTok < TDS_TOKEN_PEEK_SIZE )
+				{
+					n = (uint32_t) TDS_MIN( cbSkip, (uint64_t) ( TDS_TOKEN_PEEK_SIZE - s->cbTok ) );
+					memcpy( s->rgbTok + s->cbTok, pb, n );
+					s->cbTok += n;
+				}
+				s->cbTokRemaining -= cbSkip;
+				pb += cbSkip;
+				cb -= (size_t) cbSkip;
+				break;
+
+			case TDS_TOK_FEATID:
+				if ( 0xFF == *pb )
+				{
+					pb++;
+					cb--;
+					EmitToken( pDecoder, s, iDirection, 0 );
+					s->iTokState = TDS_TOK_TYPE;
+					break;
+				}
+				if ( s->cbTok < TDS_TOKEN_PEEK_SIZE ) s->rgbTok[s->cbTok++] = *pb;
+				pb++;
+				cb--;
+				s->cbTokLenNeeded = 4;
+				s->iTokState      = TDS_TOK_FEATLEN;
+				break;
+
+			case TDS_TOK_FEATDATA:
+				cbSkip = TDS_MIN( (uint64_t) cb, s->cbTokRemaining );
+				s->cbTokRemaining -= cbSkip;
+				pb += cbSkip;
+				cb -= (size_t) cbSkip;
+				if ( 0 == s->cbTokRemaining ) s->iTokState = TDS_TOK_FEATID;
+				break;
+
+			default:
+				return;
+		}
+
+		// Zero length bodies complete without consuming anything.
+		if ( TDS_TOK_BODY == s->iTokState && 0 == s->cbTokRemaining )
+		{
+			EmitToken( pDecoder, s, iDirection, s->cbTok );
+			s->iTokState = TDS_TOK_TYPE;
+		}
+	}
+}
+
+//
+// Message reassembly.
+//
+
+static void StartMessage( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, uint8_t bType, int fTlsFlight, uint64_t ui64TimeUs )
+{
+	s->fInMessage        = 1;
+	s->fTlsFlight        = fTlsFlight;
+	s->bType             = bType;
+	s->cPackets          = 0;
+	s->cbMessage         = 0;
+	s->cbPeek            = 0;
+	s->ui64MessageOffset = s->ui64Offset - s->cbHeader;
+	s->ui64StartUs       = ui64TimeUs;
+	s->fWait             = 0;
+	s->cTokens           = 0;
+	s->iTokState         = ( !fTlsFlight && TDS_TABULARRESULT == bType ) ? TDS_TOK_TYPE : TDS_TOK_STOP;
+
+	// Time the server took to start answering, as seen by the client.
+	if ( TDS_DIR_SERVER == iDirection && pDecoder->fAwaitingResponse )
+	{
+		s->fWait      = 1;
+		s->ui64WaitUs = ( ui64TimeUs > pDecoder->ui64LastClientEndUs ) ? ui64TimeUs - pDecoder->ui64LastClientEndUs : 0;
+		pDecoder->fAwaitingResponse = 0;
+	}
+}
+
+static void EndMessage( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, int fIncomplete )
+{
+	TDS_EVENT ev;
+	size_t cch;
+
+	if ( !s->fInMessage ) return;
+	s->fInMessage = 0;
+	pDecoder->cMessages++;
+
+	if ( TDS_DIR_CLIENT == iDirection )
+	{
+		pDecoder->fAwaitingResponse   = 1;
+		pDecoder->ui64LastClientEndUs = s->ui64LastUs;
+	}
+
+	if ( NULL == pDecoder->pfnEvent ) return;
+
+	InitEvent( &ev, ( s->fTlsFlight ) ? TDS_EVENT_TLS : TDS_EVENT_MESSAGE, iDirection, s->bType, NULL );
+	ev.cPackets    = s->cPackets;
+	ev.cbMessage   = s->cbMessage;
+	ev.ui64Offset  = s->ui64MessageOffset;
+	ev.ui64StartUs = s->ui64StartUs;
+	ev.ui64EndUs   = s->ui64LastUs;
+	ev.ui64WaitUs  = s->ui64WaitUs;
+	ev.fWait       = s->fWait;
+	DescribeMessage( s, &ev );
+	if ( fIncomplete )
+	{
+		cch = strlen( ev.szDetail );
+		snprintf( ev.szDetail + cch, sizeof(ev.szDetail) - cch, "%s(incomplete)", ( cch ) ? " " : "" );
+	}
+	Emit( pDecoder, &ev );
+}
+
+static void AddPayload( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection, const uint8_t* pb, size_t cb )
+{
+	size_t n;
+
+	if ( s->cbPeek < TDS_PEEK_SIZE )
+	{
+		n = TDS_MIN( cb, (size_t) ( TDS_PEEK_SIZE - s->cbPeek ) );
+		memcpy( s->rgbPeek + s->cbPeek, pb, n );
+		s->cbPeek += (uint32_t) n;
+	}
+	s->cbMessage += cb;
+
+	if ( TDS_TOK_STOP != s->iTokState ) WalkTokens( pDecoder, s, iDirection, pb, cb );
+}
+
+static void HeaderComplete( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection )
+{
+	const uint8_t* h = s->rgbHeader;
+	uint32_t cbLength;
+
+	if ( TLS_HEADER_SIZE == s->cbHeaderNeeded )
+	{
+		// Type(1) Version(2) Length(2)
+		cbLength = ReadBE16( h + 3 );
+		if ( 0x03 != h[1] || 0 == cbLength || cbLength > TLS_MAX_RECORD )
+		{
+			LostSync( pDecoder, s, iDirection, "Bad TLS record header" );
+			return;
+		}
+		if ( s->fInMessage && ( !s->fTlsFlight || s->bType != h[0] ) ) EndMessage( pDecoder, s, iDirection, !s->fTlsFlight );
+		if ( !s->fInMessage ) StartMessage( pDecoder, s, iDirection, h[0], 1, s->ui64HeaderUs );
+		s->cPackets++;
+		s->cbBody  = cbLength;
+		s->cbHeader = 0;
+		s->iState  = TDS_STATE_TLS;
+		return;
+	}
+
+	// Type(1) Status(1) Length(2) SPID(2) PacketID(1) Window(1)
+	cbLength = ReadBE16( h + 2 );
+	if ( !IsTdsPacketType( h[0] ) || cbLength < TDS_HEADER_SIZE )
+	{
+		LostSync( pDecoder, s, iDirection, "Bad TDS packet header" );
+		return;
+	}
+	if ( s->fInMessage && ( s->fTlsFlight || s->bType != h[0] ) ) EndMessage( pDecoder, s, iDirection, !s->fTlsFlight );
+	if ( !s->fInMessage ) StartMessage( pDecoder, s, iDirection, h[0], 0, s->ui64HeaderUs );
+	s->cPackets++;
+	s->bStatus  = h[1];
+	s->cbBody   = cbLength - TDS_HEADER_SIZE;
+	s->cbHeader = 0;
+	s->iState   = TDS_STATE_PACKET;
+	pDecoder->cPackets++;
+}
+
+static void PacketComplete( TDS_DECODER* pDecoder, TDS_STREAM* s, int iDirection )
+{
+	s->iState = TDS_STATE_HEADER;
+	if ( s->bStatus & TDS_STATUS_EOM ) EndMessage( pDecoder, s, iDirection, 0 );
+}
+
+// A run of TLS records ends when the other side starts sending.
+static void EndTlsFlight( TDS_DECODER* pDecoder, int iDirection )
+{
+	TDS_STREAM* s = &pDecoder->rgStreams[iDirection];
+
+	if ( s->fInMessage && s->fTlsFlight && TDS_STATE_HEADER == s->iState && 0 == s->cbHeader )
+	{
+		EndMessage( pDecoder, s, iDirection, 0 );
+	}
+}
+
+void TdsDecoderInit( TDS_DECODER* pDecoder, PFN_TDS_EVENT pfnEvent, void* pvContext )
+{
+	if ( NULL == pDecoder ) return;
+	memset( pDecoder, 0, sizeof(TDS_DECODER) );
+	pDecoder->cbDoneToken = 12;
+	pDecoder->pfnEvent    = pfnEvent;
+	pDecoder->pvContext   = pvContext;
+}
+
+// pbData is only read during the call, the decoder never keeps a pointer to it.
+void TdsDecoderFeed( TDS_DECODER* pDecoder, int iDirection, const uint8_t* pbData, size_t cbData, uint64_t ui64TimeUs )
+{
+	TDS_STREAM* s;
+	size_t n;
+
+	if ( NULL == pDecoder || NULL == pbData || 0 == cbData ) return;
+	if ( TDS_DIR_CLIENT != iDirection && TDS_DIR_SERVER != iDirection ) return;
+
+	EndTlsFlight( pDecoder, iDirection ^ 1 );
+
+	s = &pDecoder->rgStreams[iDirection];
+	s->ui64LastUs = ui64TimeUs;
+	pDecoder->cbTotal += cbData;
+
+	while ( cbData > 0 )
+	{
+		switch ( s->iState )
+		{
+			case TDS_STATE_HEADER:
+				// The first byte tells a TDS packet from a TLS record sent without TDS framing
+				// (TDS 8.0, or the LOGIN7 of a login-only encrypted connection).
+				if ( 0 == s->cbHeader )
+				{
+					s->cbHeaderNeeded = ( ( !s->fInMessage || s->fTlsFlight ) && IsTlsContentType( pbData[0] ) ) ? TLS_HEADER_SIZE : TDS_HEADER_SIZE;
+					s->ui64HeaderUs   = ui64TimeUs;
+				}
+				n = TDS_MIN( cbData, (size_t) ( s->cbHeaderNeeded - s->cbHeader ) );
+				memcpy( s->rgbHeader + s->cbHeader, pbData, n );
+				s->cbHeader   += (uint32_t) n;
+				s->ui64Offset += n;
+				pbData += n;
+				cbData -= n;
+				if ( s->cbHeader < s->cbHeaderNeeded ) break;
+				HeaderComplete( pDecoder, s, iDirection );
+				if ( TDS_STATE_PACKET == s->iState && 0 == s->cbBody ) PacketComplete( pDecoder, s, iDirection );
+				break;
+
+			case TDS_STATE_PACKET:
+				n = TDS_MIN( cbData, (size_t) s->cbBody );
+				AddPayload( pDecoder, s, iDirection, pbData, n );
+				s->cbBody     -= (uint32_t) n;
+				s->ui64Offset += n;
+				pbData += n;
+				cbData -= n;
+				if ( 0 == s->cbBody ) PacketComplete( pDecoder, s, iDirection );
+				break;
+
+			case TDS_STATE_TLS:
+				// Keep the start of the first record, it has the handshake message type.
+				n = TDS_MIN( cbData, (size_t) s->cbBody );
+				if ( 1 == s->cPackets ) AddPayload( pDecoder, s, iDirection, pbData, n );
+				else                    s->cbMessage += n;
+				s->cbBody     -= (uint32_t) n;
+				s->ui64Offset += n;
+				pbData += n;
+				cbData -= n;
+				if ( 0 == s->cbBody ) s->iState = TDS_STATE_HEADER;
+				break;
+
+			default:
+				s->ui64Offset += cbData;
+				return;
+		}
+	}
+}
+
+// Reports any message still being reassembled, e.g. when the connection closes.
+void TdsDecoderFinish( TDS_DECODER* pDecoder )
+{
+	int i;
+	TDS_STREAM* s;
+
+	if ( NULL == pDecoder ) return;
+	for ( i=0; i<2; i++ )
+	{
+		s = &pDecoder->rgStreams[i];
+		if ( s->fInMessage )
+		{
+			EndMessage( pDecoder, s, i, !( s->fTlsFlight && TDS_STATE_HEADER == s->iState && 0 == s->cbHeader ) );
+		}
+	}
+}
+
+// One timeline line, times are relative to ui64BaseUs.
+char* TdsEventFormat( const TDS_EVENT* pEvent, uint64_t ui64BaseUs, char* pszBuffer, size_t cchBuffer )
+{
+	char szWait[32] = "";
+	const char* pszDir;
+
+	if ( NULL == pszBuffer || 0 == cchBuffer ) return (char*) "";
+	pszBuffer[0] = '\0';
+	if ( NULL == pEvent ) return pszBuffer;
+
+	pszDir = ( TDS_DIR_CLIENT == pEvent->iDirection ) ? "C->S" : "S->C";
+
+	if ( TDS_EVENT_TOKEN == pEvent->iEvent )
+	{
+		snprintf( pszBuffer, cchBuffer, "%*s%s   token %-14s %s", 14, "", pszDir, pEvent->pszName, pEvent->szDetail );
+		return pszBuffer;
+	}
+
+	if ( pEvent->fWait ) snprintf( szWait, sizeof(szWait), "wait %.3f ms", pEvent->ui64WaitUs / 1000.0 );
+	snprintf( pszBuffer, cchBuffer, "%+12.3f ms %s %-20s %8llu bytes %4u %s %-18s %s",
+			  ( (double) pEvent->ui64StartUs - (double) ui64BaseUs ) / 1000.0,
+			  pszDir,
+			  ( NULL == pEvent->pszName ) ? "" : pEvent->pszName,
+			  (unsigned long long) pEvent->cbMessage,
+			  pEvent->cPackets,
+			  ( TDS_EVENT_TLS == pEvent->iEvent ) ? "rec" : "pkt",
+			  szWait,
+			  pEvent->szDetail );
+	return pszBuffer;
+}
+
+#ifdef TDSDECODER_STANDALONE
+
+#include "PerfStats.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define TDSCAP_MAX_STREAMS	64
+
+static TDS_DECODER g_rgDecoders[TDSCAP_MAX_STREAMS];
+static int g_rgfStarted[TDSCAP_MAX_STREAMS];
+static int g_fQuiet = 0;
+
+static void PrintEvent( const TDS_EVENT* pEvent, void* pvContext )
+{
+	char szLine[512];
+	printf( "#%-3d %s\n", (int) (size_t) pvContext, TdsEventFormat( pEvent, 0, szLine, sizeof(szLine) ) );
+}
+
+static void PrintTotals( const char* pszWhat, uint64_t cbTotal, double dMs )
+{
+	uint64_t cPackets = 0, cMessages = 0, cTokens = 0, cErrors = 0;
+	int i;
+
+	for ( i=0; i<TDSCAP_MAX_STREAMS; i++ )
+	{
+		cPackets  += g_rgDecoders[i].cPackets;
+		cMessages += g_rgDecoders[i].cMessages;
+		cTokens   += g_rgDecoders[i].cTokens;
+		cErrors   += g_rgDecoders[i].cErrors;
+	}
+	printf( "%s: %llu bytes, %llu packets, %llu messages, %llu tokens, %llu errors in %.1f ms",
+			pszWhat, (unsigned long long) cbTotal, (unsigned long long) cPackets, (unsigned long long) cMessages,
+			(unsigned long long) cTokens, (unsigned long long) cErrors, dMs );
+	if ( dMs > 0.0 ) printf( " (%.1f MB/s)", ( cbTotal / ( 1024.0 * 1024.0 ) ) / ( dMs / 1000.0 ) );
+	printf( "\n" );
+}
+
+static void DecodeRecord( const TDSCAP_RECORD* pRecord, const uint8_t* pbData )
+{
+	TDS_DECODER* pDecoder;
+
+	if ( pRecord->wStream >= TDSCAP_MAX_STREAMS ) return;
+	pDecoder = &g_rgDecoders[pRecord->wStream];
+	if ( !g_rgfStarted[pRecord->wStream] )
+	{
+		TdsDecoderInit( pDecoder, ( g_fQuiet ) ? NULL : PrintEvent, (void*) (size_t) pRecord->wStream );
+		g_rgfStarted[pRecord->wStream] = 1;
+	}
+	TdsDecoderFeed( pDecoder, pRecord->bDirection, pbData, pRecord->cbData, pRecord->ui64TimeUs );
+}
+
+#ifndef _WIN32
+
+// Maps the whole capture and decodes straight out of the mapping, captures larger than memory are fine.
+static int DecodeCaptureFile( const char* pszFile, uint64_t* pcbTotal )
+{
+	struct stat st;
+	const uint8_t* pbFile;
+	uint64_t i;
+	TDSCAP_RECORD rec;
+	int fd = open( pszFile, O_RDONLY );
+
+	if ( fd < 0 || 0 != fstat( fd, &st ) )
+	{
+		fprintf( stderr, "Cannot open %s\n", pszFile );
+		if ( fd >= 0 ) close( fd );
+		return 1;
+	}
+	if ( (uint64_t) st.st_size < TDSCAP_MAGIC_SIZE )
+	{
+		fprintf( stderr, "%s is not a TDSCAP file\n", pszFile );
+		close( fd );
+		return 1;
+	}
+	pbFile = (const uint8_t*) mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( MAP_FAILED == (void*) pbFile )
+	{
+		fprintf( stderr, "Cannot map %s\n", pszFile );
+		return 1;
+	}
+	madvise( (void*) pbFile, (size_t) st.st_size, MADV_SEQUENTIAL );
+
+	if ( 0 != memcmp( pbFile, TDSCAP_MAGIC, TDSCAP_MAGIC_SIZE ) )
+	{
+		fprintf( stderr, "%s is not a TDSCAP file\n", pszFile );
+		munmap( (void*) pbFile, (size_t) st.st_size );
+		return 1;
+	}
+
+	for ( i=TDSCAP_MAGIC_SIZE; i + sizeof(rec) <= (uint64_t) st.st_size; )
+	{
+		memcpy( &rec, pbFile + i, sizeof(rec) );
+		i += sizeof(rec);
+		if ( rec.cbData > (uint64_t) st.st_size - i )
+		{
+			fprintf( stderr, "Truncated record at offset %llu\n", (unsigned long long) ( i - sizeof(rec) ) );
+			break;
+		}
+		DecodeRecord( &rec, pbFile + i );
+		*pcbTotal += rec.cbData;
+		i += rec.cbData;
+	}
+
+	munmap( (void*) pbFile, (size_t) st.st_size );
+	return 0;
+}
+
+#else
+
+static int DecodeCaptureFile( const char* pszFile, uint64_t* pcbTotal )
+{
+	static uint8_t rgbBuffer[65536];
+	char szMagic[TDSCAP_MAGIC_SIZE];
+	TDSCAP_RECORD rec;
+	uint32_t cbLeft;
+	size_t n;
+	FILE* f = fopen( pszFile, "rb" );
+
+	if ( NULL == f )
+	{
+		fprintf( stderr, "Cannot open %s\n", pszFile );
+		return 1;
+	}
+	if ( 1 != fread( szMagic, sizeof(szMagic), 1, f ) || 0 != memcmp( szMagic, TDSCAP_MAGIC, TDSCAP_MAGIC_SIZE ) )
+	{
+		fprintf( stderr, "%s is not a TDSCAP file\n", pszFile );
+		fclose( f );
+		return 1;
+	}
+
+	// Large records are fed in pieces, the decoder does not care where the buffers split.
+	while ( 1 == fread( &rec, sizeof(rec), 1, f ) )
+	{
+		for ( cbLeft = rec.cbData; cbLeft > 0; cbLeft -= (uint32_t) n )
+		{
+			n = fread( rgbBuffer, 1, TDS_MIN( (size_t) cbLeft, sizeof(rgbBuffer) ), f );
+			if ( 0 == n ) break;
+			rec.cbData = (uint32_t) n;
+			DecodeRecord( &rec, rgbBuffer );
+			*pcbTotal += n;
+		}
+	}
+
+	fclose( f );
+	return 0;
+}
+
+#endif
+
+//
+// Benchmark: a synthetic session repeated until the requested size is reached.
+//
+
+static size_t PutPacket( uint8_t* pb, uint8_t bType, uint8_t bStatus, const uint8_t* pbPayload, size_t cbPayload )
+{
+	size_t cb = cbPayload + TDS_HEADER_SIZE;
+	pb[0] = bType;
+	pb[1] = bStatus;
+	pb[2] = (uint8_t) ( cb >> 8 );
+	pb[3] = (uint8_t) cb;
+	pb[4] = 0;
+	pb[5] = 0x33;
+	pb[6] = 1;
+	pb[7] = 0;
+	memcpy( pb + TDS_HEADER_SIZE, pbPayload, cbPayload );
+	return cb;
+}
+
+// Splits a message into packets of cbPacket bytes.
+static size_t PutMessage( uint8_t* pb, uint8_t bType, const uint8_t* pbPayload, size_t cbPayload, size_t cbPacket )
+{
+	size_t cbUsed = 0, n;
+	do
+	{
+		n = TDS_MIN( cbPayload, cbPacket - TDS_HEADER_SIZE );
+		cbUsed += PutPacket( pb + cbUsed, bType, ( n == cbPayload ) ? TDS_STATUS_EOM : 0, pbPayload, n );
+		pbPayload += n;
+		cbPayload -= n;
+	} while ( cbPayload > 0 );
+	return cbUsed;
+}
+
+static size_t PutDone( uint8_t* pb, uint8_t bToken, uint16_t wStatus, uint32_t dwRows )
+{
+	memset( pb, 0, 13 );
+	pb[0] = bToken;
+	pb[1] = (uint8_t) wStatus;
+	pb[2] = (uint8_t) ( wStatus >> 8 );
+	pb[5] = (uint8_t) dwRows;
+	pb[6] = (uint8_t) ( dwRows >> 8 );
+	return 13;
+}
+
+static size_t PutInfo( uint8_t* pb, const char* pszText )
+{
+	size_t i, cch = strlen( pszText ), cb = 14 + cch * 2;
+	pb[0] = TDS_TOKEN_INFO;
+	pb[1] = (uint8_t) cb;
+	pb[2] = (uint8_t) ( cb >> 8 );
+	memset( pb + 3, 0, cb );
+	pb[3] = 0x45; pb[4] = 0x16;		// 5701
+	pb[7] = 1;
+	pb[8] = 10;
+	pb[9] = (uint8_t) cch;
+	for ( i=0; i<cch; i++ ) pb[11 + i*2] = (uint8_t) pszText[i];
+	return 3 + cb;
+}
+
+static int RunBenchmark( uint64_t cbWanted )
+{
+	static uint8_t rgbClient[1 << 16], rgbServer[1 << 20], rgbPayload[1 << 20];
+	size_t cbClient, cbServer, cbPayload = 0, i, n, iChunk;
+	static const size_t rgcbChunks[] = { 4096, 1460, 8000, 333, 65536 };
+	const char* pszBatch = "select * from sys.objects";
+	uint64_t ui64Start, cbTotal = 0, t = 0;
+	TDS_DECODER* pDecoder = &g_rgDecoders[0];
+
+	// Client: a SQLBatch with ALL_HEADERS.
+	memset( rgbPayload, 0, 22 );
+	rgbPayload[0] = 22; rgbPayload[4] = 18; rgbPayload[8] = 2;
+	for ( i=0; pszBatch[i]; i++ ) rgbPayload[22 + i*2] = (uint8_t) pszBatch[i], rgbPayload[23 + i*2] = 0;
+	cbClient = PutMessage( rgbClient, TDS_SQLBATCH, rgbPayload, 22 + i*2, 4096 );
+
+	// Server: a token stream the walker decodes end to end (INFO/DONEINPROC pairs), followed by a
+	// result set the walker has to skip over in bulk.
+	for ( i=0; i<400; i++ )
+	{
+		cbPayload += PutInfo( rgbPayload + cbPayload, "Changed database context to 'master'." );
+		cbPayload += PutDone( rgbPayload + cbPayload, TDS_TOKEN_DONEINPROC, 0x0011, (uint32_t) i );
+	}
+	cbPayload += PutDone( rgbPayload + cbPayload, TDS_TOKEN_DONE, 0, 0 );
+	cbServer = PutMessage( rgbServer, TDS_TABULARRESULT, rgbPayload, cbPayload, 4096 );
+	rgbPayload[0] = TDS_TOKEN_COLMETADATA;
+	for ( i=1; i<sizeof(rgbServer) / 2; i++ ) rgbPayload[i] = (uint8_t) i;
+	cbServer += PutMessage( rgbServer + cbServer, TDS_TABULARRESULT, rgbPayload, sizeof(rgbServer) / 2, 32768 );
+
+	printf( "Session: %u byte request, %u byte response (%u tokens then a %u byte result set)\n",
+			(unsigned) cbClient, (unsigned) cbServer, 801, (unsigned) ( sizeof(rgbServer) / 2 ) );
+
+	TdsDecoderInit( pDecoder, NULL, NULL );
+	ui64Start = PerfCounter();
+	for ( iChunk = 0; cbTotal < cbWanted; iChunk++ )
+	{
+		TdsDecoderFeed( pDecoder, TDS_DIR_CLIENT, rgbClient, cbClient, t++ );
+		// Feed the response in uneven pieces, as reads return it.
+		for ( i=0; i<cbServer; i+=n )
+		{
+			n = TDS_MIN( rgcbChunks[( iChunk + i ) % 5], cbServer - i );
+			TdsDecoderFeed( pDecoder, TDS_DIR_SERVER, rgbServer + i, n, t++ );
+		}
+		cbTotal += cbClient + cbServer;
+	}
+	TdsDecoderFinish( pDecoder );
+	PrintTotals( "Benchmark", cbTotal, PerfElapsedMs( ui64Start ) );
+	return ( 0 == pDecoder->cErrors ) ? 0 : 1;
+}
+
+int main( int argc, char* argv[] )
+{
+	uint64_t cbTotal = 0, ui64Start;
+	int i, rc = 0;
+
+	if ( argc >= 2 && 0 == strcmp( argv[1], "-bench" ) )
+	{
+		return RunBenchmark( ( ( argc >= 3 ) ? strtoull( argv[2], NULL, 10 ) : 1024 ) * 1024 * 1024 );
+	}
+
+	for ( i=1; i<argc && '-' == argv[i][0]; i++ )
+	{
+		if ( 0 == strcmp( argv[i], "-q" ) ) g_fQuiet = 1;
+	}
+	if ( i >= argc )
+	{
+		fprintf( stderr, "Usage: tdsdecode [-q] <capture.tdscap>\n"
+						 "       tdsdecode -bench [MB]\n" );
+		return 2;
+	}
+
+	ui64Start = PerfCounter();
+	rc = DecodeCaptureFile( argv[i], &cbTotal );
+	for ( i=0; i<TDSCAP_MAX_STREAMS; i++ ) TdsDecoderFinish( &g_rgDecoders[i] );
+	PrintTotals( "Decoded", cbTotal, PerfElapsedMs( ui64Start ) );
+	return rc;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+
+// Streaming TDS decoder.  Bytes are fed in whatever pieces the transport returned them in,
+// packets are reassembled into messages on the EOM status bit and the caller gets one event
+// per message, per login-time token and per TLS flight.  Nothing is allocated: the decoder
+// only keeps the packet header, the first bytes of each message and of each token.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TDS_DIR_CLIENT			0	// Client to server
+#define TDS_DIR_SERVER			1	// Server to client
+
+// Packet types, MS-TDS 2.2.3.1.1
+#define TDS_SQLBATCH			0x01
+#define TDS_PRE70LOGIN			0x02
+#define TDS_RPC					0x03
+#define TDS_TABULARRESULT		0x04
+#define TDS_ATTENTION			0x06
+#define TDS_BULKLOAD			0x07
+#define TDS_FEDAUTHTOKEN		0x08
+#define TDS_TRANSACTION			0x0E
+#define TDS_LOGIN7				0x10
+#define TDS_SSPI				0x11
+#define TDS_PRELOGIN			0x12
+
+#define TDS_STATUS_EOM			0x01
+#define TDS_HEADER_SIZE			8
+#define TLS_HEADER_SIZE			5
+
+// Token types, MS-TDS 2.2.7
+#define TDS_TOKEN_COLMETADATA	0x81
+#define TDS_TOKEN_ORDER			0xA9
+#define TDS_TOKEN_ERROR			0xAA
+#define TDS_TOKEN_INFO			0xAB
+#define TDS_TOKEN_RETURNVALUE	0xAC
+#define TDS_TOKEN_LOGINACK		0xAD
+#define TDS_TOKEN_FEATUREEXTACK	0xAE
+#define TDS_TOKEN_ROW			0xD1
+#define TDS_TOKEN_NBCROW		0xD2
+#define TDS_TOKEN_ENVCHANGE		0xE3
+#define TDS_TOKEN_SESSIONSTATE	0xE4
+#define TDS_TOKEN_SSPI			0xED
+#define TDS_TOKEN_FEDAUTHINFO	0xEE
+#define TDS_TOKEN_DONE			0xFD
+#define TDS_TOKEN_DONEPROC		0xFE
+#define TDS_TOKEN_DONEINPROC	0xFF
+#define TDS_TOKEN_RETURNSTATUS	0x79
+
+// Event kinds
+#define TDS_EVENT_MESSAGE		1	// A complete TDS message
+#define TDS_EVENT_TOKEN			2	// A token inside a server response, reported before its message
+#define TDS_EVENT_TLS			3	// Consecutive TLS records sent outside of TDS framing
+#define TDS_EVENT_ERROR			4	// Framing error, the direction is no longer decoded
+
+#define TDS_PEEK_SIZE			128
+#define TDS_TOKEN_PEEK_SIZE		256
+
+typedef struct _TDS_EVENT
+{
+	int         iEvent;			// TDS_EVENT_*
+	int         iDirection;		// TDS_DIR_*
+	uint8_t     bType;			// Packet type, token type or TLS content type
+	uint32_t    cPackets;		// TDS packets or TLS records in the message
+	uint64_t    cbMessage;		// Payload bytes, packet headers excluded
+	uint64_t    ui64Offset;		// Offset of the first byte in this direction
+	uint64_t    ui64StartUs;	// Time the first byte was fed
+	uint64_t    ui64EndUs;		// Time the last byte was fed
+	uint64_t    ui64WaitUs;		// Server messages: time since the end of the last client message
+	int         fWait;			// TRUE if ui64WaitUs is set
+	const char* pszName;
+	char        szDetail[160];
+} TDS_EVENT;
+
+typedef void (*PFN_TDS_EVENT)( const TDS_EVENT* pEvent, void* pvContext );
+
+typedef struct _TDS_STREAM
+{
+	int      iState;
+	uint8_t  rgbHeader[TDS_HEADER_SIZE];
+	uint32_t cbHeader;
+	uint32_t cbHeaderNeeded;
+	uint64_t ui64HeaderUs;			// Time the first byte of the header was fed
+	uint32_t cbBody;				// Bytes left in the current packet or TLS record
+	uint64_t ui64Offset;			// Bytes seen so far in this direction
+	uint64_t ui64LastUs;
+
+	// Message being reassembled
+	int      fInMessage;
+	int      fTlsFlight;			// Message is a run of TLS records rather than TDS packets
+	uint8_t  bType;
+	uint8_t  bStatus;
+	uint32_t cPackets;
+	uint64_t cbMessage;
+	uint64_t ui64MessageOffset;
+	uint64_t ui64StartUs;
+	uint64_t ui64WaitUs;
+	int      fWait;
+	uint8_t  rgbPeek[TDS_PEEK_SIZE];
+	uint32_t cbPeek;
+
+	// Token walker for server responses
+	int      iTokState;
+	uint8_t  bToken;
+	uint8_t  rgbTokLen[4];
+	uint32_t cbTokLen;
+	uint32_t cbTokLenNeeded;
+	uint64_t cbTokRemaining;
+	uint32_t cTokens;
+	uint8_t  rgbTok[TDS_TOKEN_PEEK_SIZE];
+	uint32_t cbTok;
+} TDS_STREAM;
+
+typedef struct _TDS_DECODER
+{
+	TDS_STREAM    rgStreams[2];
+	uint32_t      cbDoneToken;			// 12 for TDS 7.2 and later, 8 before
+	int           fAwaitingResponse;	// A client message ended and the server has not answered yet
+	uint64_t      ui64LastClientEndUs;
+	PFN_TDS_EVENT pfnEvent;
+	void*         pvContext;
+
+	// Totals
+	uint64_t      cbTotal;
+	uint64_t      cPackets;
+	uint64_t      cMessages;
+	uint64_t      cTokens;
+	uint64_t      cErrors;
+} TDS_DECODER;
+
+void TdsDecoderInit( TDS_DECODER* pDecoder, PFN_TDS_EVENT pfnEvent, void* pvContext );
+void TdsDecoderFeed( TDS_DECODER* pDecoder, int iDirection, const uint8_t* pbData, size_t cbData, uint64_t ui64TimeUs );
+void TdsDecoderFinish( TDS_DECODER* pDecoder );
+
+const char* TdsPacketTypeName( uint8_t bType );
+const char* TdsTokenName( uint8_t bToken );
+const char* TlsContentTypeName( uint8_t bType );
+const char* TlsHandshakeTypeName( uint8_t bType );
+char* TdsEventFormat( const TDS_EVENT* pEvent, uint64_t ui64BaseUs, char* pszBuffer, size_t cchBuffer );
+
+// Capture file written by the dbnetlib detours (tdscapture=<file> option) and read by the
+// standalone decoder.  The file starts with TDSCAP_MAGIC, then each ConnectionRead/ConnectionWrite
+// is a TDSCAP_RECORD followed by cbData bytes.  All fields are little endian.
+#define TDSCAP_MAGIC		"TDSCAP01"
+#define TDSCAP_MAGIC_SIZE	8
+
+#pragma pack(push, 1)
+typedef struct _TDSCAP_RECORD
+{
+	uint64_t ui64TimeUs;		// Microseconds since the capture started
+	uint32_t cbData;
+	uint16_t wStream;			// Connection number, each one is decoded separately
+	uint8_t  bDirection;		// TDS_DIR_*
+	uint8_t  bReserved;
+} TDSCAP_RECORD;
+#pragma pack(pop)
@@ -0,0 +1,130 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// TestOptions.cpp: parser for the name=value;name=value options string.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "TestOptions.h"
+
+static char g_szTestOptions[2048] = "";
+
+void SetTestOptions( const char* pszOptions )
+{
+	if ( NULL == pszOptions ) pszOptions = "";
+	snprintf( g_szTestOptions, sizeof(g_szTestOptions), "%s", pszOptions );
+}
+
+const char* GetTestOptions( void )
+{
+	return g_szTestOptions;
+}
+
+// Finds pszName in the options string.  On success returns TRUE and points
+// *ppszValue/*pcchValue at the (unterminated) value, which is empty for a bare flag.
+static int FindTestOption( const char* pszName, const char** ppszValue, size_t* pcchValue )
+{
+	const char* s = g_szTestOptions;
+	const char* pszKey;
+	const char* pszEnd;
+	size_t cchName, cchKey, i;
+
+	if ( NULL == pszName ) return 0;
+	cchName = strlen( pszName );
+
+	while ( *s )
+	{
+		// Skip separators and leading blanks.
+		while ( ';' == *s || ' ' == *s || '\t' == *s ) s++;
+		if ( '\0' == *s ) break;
+
+		pszKey = s;
+		while ( *s && '=' != *s && ';' != *s ) s++;
+		pszEnd = s;
+		while ( pszEnd > pszKey && ' ' == pszEnd[-1] ) pszEnd--;
+		cchKey = pszEnd - pszKey;
+
+		if ( cchKey == cchName )
+		{
+			for ( i=0; i<cchKey; i++ )
+			{
+				if ( tolower( (unsigned char) pszKey[i] ) != tolower( (unsigned char) pszName[i] ) ) break;
+			}
+			if ( i == cchKey )
+			{
+				if ( '=' == *s ) s++;
+				while ( ' ' == *s ) s++;
+				*ppszValue = s;
+				while ( *s && ';' != *s ) s++;
+				pszEnd = s;
+				while ( pszEnd > *ppszValue && ' ' == pszEnd[-1] ) pszEnd--;
+				*pcchValue = pszEnd - *ppszValue;
+				return 1;
+			}
+		}
+
+		// Skip the value.
+		while ( *s && ';' != *s ) s++;
+	}
+	return 0;
+}
+
+int HasTestOption( const char* pszName )
+{
+	const char* pszValue;
+	size_t cchValue;
+	return FindTestOption( pszName, &pszValue, &cchValue );
+}
+
+char* GetTestOptionString( const char* pszName, const char* pszDefault, char* pszBuffer, size_t cchBuffer )
+{
+	const char* pszValue;
+	size_t cchValue;
+
+	if ( NULL == pszBuffer || 0 == cchBuffer ) return (char*) "";
+
+	if ( !FindTestOption( pszName, &pszValue, &cchValue ) || 0 == cchValue )
+	{
+		snprintf( pszBuffer, cchBuffer, "%s", ( NULL == pszDefault ) ? "" : pszDefault );
+		return pszBuffer;
+	}
+
+	if ( cchValue >= cchBuffer ) cchValue = cchBuffer - 1;
+	memcpy( pszBuffer, pszValue, cchValue );
+	pszBuffer[cchValue] = '\0';
+	return pszBuffer;
+}
+
+long GetTestOptionLong( const char* pszName, long lDefault )
+{
+	char szValue[64];
+	char* pszEnd = NULL;
+	long lValue;
+
+	if ( !HasTestOption( pszName ) ) return lDefault;
+	GetTestOptionString( pszName, "1", szValue, sizeof(szValue) );
+	lValue = strtol( szValue, &pszEnd, 0 );
+	if ( pszEnd == szValue ) return lDefault;
+	return lValue;
+}
+
+int GetTestOptionBool( const char* pszName, int fDefault )
+{
+	char szValue[16];
+
+	if ( !HasTestOption( pszName ) ) return fDefault;
+	GetTestOptionString( pszName, "1", szValue, sizeof(szValue) );
+	switch ( tolower( (unsigned char) szValue[0] ) )
+	{
+		case '0':
+		case 'n':
+		case 'f':
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Free-form test options typed into the "Options" box of the dialog, in the form
+//   name=value;name=value;flag
+// Names are case insensitive.  A name without a value is treated as 1.
+
+#include <stddef.h>
+
+void  SetTestOptions( const char* pszOptions );
+const char* GetTestOptions( void );
+int   HasTestOption( const char* pszName );
+long  GetTestOptionLong( const char* pszName, long lDefault );
+int   GetTestOptionBool( const char* pszName, int fDefault );
+char* GetTestOptionString( const char* pszName, const char* pszDefault, char* pszBuffer, size_t cchBuffer );
@@ -0,0 +1,474 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// TicketCache.cpp: snapshots of the Kerberos ticket cache, the difference between two of them,
+// a thread that logs tickets as they are acquired while a problem is reproduced, and purging the
+// tickets that match a filter.
+//
+
+#include "stdafx.h"
+#include "TicketCache.h"
+#include "KerbTickets.h"
+#include "KerbDecoder.h"
+#include "DynamicLSA.h"
+#include "DetourFunctions.h"
+#include "TestOptions.h"
+
+static TICKET_CACHE_SNAPSHOT g_TicketsBefore;		// Taken before the login
+static TICKET_CACHE_SNAPSHOT g_TicketsAfter;
+static TICKET_CACHE_SNAPSHOT g_rgWatchSnapshots[2];	// The watch thread alternates between them
+static BOOL   g_fTicketsBefore = FALSE;
+static HANDLE g_hWatchThread = NULL;
+static HANDLE g_hWatchStop = NULL;
+static DWORD  g_dwWatchIntervalMs = 0;
+
+static void US2Buffer( const UNICODE_STRING* pus, char* pszBuffer, int cchBuffer )
+{
+	int cch = 0;
+
+	if ( NULL != pus->Buffer && pus->Length > 0 )
+	{
+		cch = WideCharToMultiByte( CP_ACP, 0, pus->Buffer, pus->Length / sizeof(WCHAR), pszBuffer, cchBuffer - 1, NULL, NULL );
+	}
+	pszBuffer[cch] = '\0';
+}
+
+static int CompareTicketKeys( const TICKET_CACHE_ENTRY* pEntry1, const TICKET_CACHE_ENTRY* pEntry2 )
+{
+	int iCompare = lstrcmpi( pEntry1->szServer, pEntry2->szServer );
+
+	if ( 0 != iCompare ) return iCompare;
+	return lstrcmpi( pEntry1->szRealm, pEntry2->szRealm );
+}
+
+static int __cdecl CompareTicketEntries( const void* pv1, const void* pv2 )
+{
+	return CompareTicketKeys( (const TICKET_CACHE_ENTRY*) pv1, (const TICKET_CACHE_ENTRY*) pv2 );
+}
+
+static uint64_t HashBytes( uint64_t ui64Hash, const void* pv, size_t cb )
+{
+	const BYTE* pb = (const BYTE*) pv;
+
+	while ( cb-- > 0 )
+	{
+		ui64Hash ^= *pb++;
+		ui64Hash *= 0x100000001b3ULL;
+	}
+	return ui64Hash;
+}
+
+// Reads the ticket cache of this logon session.  The entries are sorted by server and realm.
+BOOL TicketCacheSnapshot( TICKET_CACHE_SNAPSHOT* pSnapshot )
+{
+	KERB_QUERY_TKT_CACHE_REQUEST CacheRequest;
+	PKERB_QUERY_TKT_CACHE_EX_RESPONSE pTickets = NULL;
+	PKERB_TICKET_CACHE_INFO_EX pInfo = NULL;
+	TICKET_CACHE_ENTRY* pEntry = NULL;
+	NTSTATUS Status, SubStatus;
+	HANDLE hLogonHandle = NULL;
+	ULONG ulPackageId = 0, ulResponseSize = 0, i;
+	uint64_t ui64Hash = 0xcbf29ce484222325ULL;
+
+	pSnapshot->cEntries = 0;
+	pSnapshot->cDropped = 0;
+	pSnapshot->ui64Hash = 0;
+	pSnapshot->ui64Taken = PerfCounter();
+	if ( !KerbSessionOpen( &hLogonHandle, &ulPackageId ) ) return FALSE;
+
+	ZeroMemory( &CacheRequest, sizeof(CacheRequest) );
+	CacheRequest.MessageType = KerbQueryTicketCacheExMessage;
+
+	__try
+	{
+		Status = pfnLsaCallAuthenticationPackage( hLogonHandle,
+												  ulPackageId,
+												  &CacheRequest,
+												  sizeof(CacheRequest),
+												  (PVOID*) &pTickets,
+												  &ulResponseSize,
+												  &SubStatus );
+		if ( !SEC_SUCCESS( Status ) || !SEC_SUCCESS( SubStatus ) || NULL == pTickets )
+		{
+			if ( NULL != pTickets ) pfnLsaFreeReturnBuffer( pTickets );
+			return FALSE;
+		}
+
+		for ( i=0; i<pTickets->CountOfTickets; i++ )
+		{
+			if ( pSnapshot->cEntries >= TICKET_CACHE_MAX_TICKETS )
+			{
+				pSnapshot->cDropped++;
+				continue;
+			}
+			pInfo  = &pTickets->Tickets[i];
+			pEntry = &pSnapshot->rgEntries[pSnapshot->cEntries++];
+			US2Buffer( &pInfo->ServerName, pEntry->szServer, sizeof(pEntry->szServer) );
+			US2Buffer( &pInfo->ServerRealm, pEntry->szRealm, sizeof(pEntry->szRealm) );
+			pEntry->StartTime       = pInfo->StartTime;
+			pEntry->EndTime         = pInfo->EndTime;
+			pEntry->RenewTime       = pInfo->RenewTime;
+			pEntry->lEncryptionType = pInfo->EncryptionType;
+			pEntry->ulTicketFlags   = pInfo->TicketFlags;
+		}
+		pfnLsaFreeReturnBuffer( pTickets );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		o_printf( "[TicketCacheSnapshot] Unexpected error reading the ticket cache" );
+		return FALSE;
+	}
+
+	qsort( pSnapshot->rgEntries, pSnapshot->cEntries, sizeof(TICKET_CACHE_ENTRY), CompareTicketEntries );
+
+	// The names are hashed up to their terminator so unused buffer space does not matter.
+	for ( i=0; i<pSnapshot->cEntries; i++ )
+	{
+		pEntry = &pSnapshot->rgEntries[i];
+		ui64Hash = HashBytes( ui64Hash, pEntry->szServer, strlen( pEntry->szServer ) + 1 );
+		ui64Hash = HashBytes( ui64Hash, pEntry->szRealm, strlen( pEntry->szRealm ) + 1 );
+		ui64Hash = HashBytes( ui64Hash, &pEntry->StartTime, sizeof(pEntry->StartTime) );
+		ui64Hash = HashBytes( ui64Hash, &pEntry->EndTime, sizeof(pEntry->EndTime) );
+		ui64Hash = HashBytes( ui64Hash, &pEntry->lEncryptionType, sizeof(pEntry->lEncryptionType) );
+		ui64Hash = HashBytes( ui64Hash, &pEntry->ulTicketFlags, sizeof(pEntry->ulTicketFlags) );
+	}
+	pSnapshot->ui64Hash = ui64Hash;
+	return TRUE;
+}
+
+// "10:00:00 lifetime, 09:59:58 left" or "expired 00:05:00 ago", times from the ticket are UTC.
+static char* FormatLifetime( const TICKET_CACHE_ENTRY* pEntry, char* pszBuffer, size_t cchBuffer )
+{
+	FILETIME ftNow;
+	__int64 i64Now, i64Lifetime, i64Left;
+
+	GetSystemTimeAsFileTime( &ftNow );
+	i64Now      = ( (__int64) ftNow.dwHighDateTime << 32 ) | ftNow.dwLowDateTime;
+	i64Lifetime = ( pEntry->EndTime.QuadPart - pEntry->StartTime.QuadPart ) / 10000000;
+	i64Left     = ( pEntry->EndTime.QuadPart - i64Now ) / 10000000;
+
+	if ( i64Left >= 0 )
+	{
+		sprintf_s( pszBuffer, cchBuffer, "%02I64d:%02I64d:%02I64d lifetime, %02I64d:%02I64d:%02I64d left",
+				   i64Lifetime / 3600, ( i64Lifetime / 60 ) % 60, i64Lifetime % 60, i64Left / 3600, ( i64Left / 60 ) % 60, i64Left % 60 );
+	}
+	else
+	{
+		i64Left = -i64Left;
+		sprintf_s( pszBuffer, cchBuffer, "%02I64d:%02I64d:%02I64d lifetime, expired %02I64d:%02I64d:%02I64d ago",
+				   i64Lifetime / 3600, ( i64Lifetime / 60 ) % 60, i64Lifetime % 60, i64Left / 3600, ( i64Left / 60 ) % 60, i64Left % 60 );
+	}
+	return pszBuffer;
+}
+
+static void LogTicketEntry( const char* pszPrefix, const char* pszChange, const TICKET_CACHE_ENTRY* pEntry )
+{
+	char szLifetime[96];
+
+	o_printf( "%s%-8s %s@%s, %s, etype %ld (%s), flags 0x%08x", pszPrefix, pszChange, pEntry->szServer, pEntry->szRealm,
+			  FormatLifetime( pEntry, szLifetime, sizeof(szLifetime) ), pEntry->lEncryptionType,
+			  KerbEtypeName( pEntry->lEncryptionType ), pEntry->ulTicketFlags );
+}
+
+// Walks both sorted snapshots together and logs the tickets that are new, gone, or have a new
+// start or end time (renewed or requested again).  Returns the number of changes.
+DWORD LogTicketCacheDiff( const TICKET_CACHE_SNAPSHOT* pBefore, const TICKET_CACHE_SNAPSHOT* pAfter, const char* pszPrefix )
+{
+	const TICKET_CACHE_ENTRY* pOld = NULL;
+	const TICKET_CACHE_ENTRY* pNew = NULL;
+	DWORD iBefore = 0, iAfter = 0, cChanges = 0;
+	int iCompare;
+
+	if ( pBefore->ui64Hash == pAfter->ui64Hash && pBefore->cEntries == pAfter->cEntries ) return 0;
+
+	while ( iBefore < pBefore->cEntries || iAfter < pAfter->cEntries )
+	{
+		pOld = ( iBefore < pBefore->cEntries ) ? &pBefore->rgEntries[iBefore] : NULL;
+		pNew = ( iAfter < pAfter->cEntries ) ? &pAfter->rgEntries[iAfter] : NULL;
+
+		if ( NULL == pOld ) iCompare = 1;
+		else if ( NULL == pNew ) iCompare = -1;
+		else iCompare = CompareTicketKeys( pOld, pNew );
+
+		if ( iCompare < 0 )
+		{
+			LogTicketEntry( pszPrefix, "removed", pOld );
+			cChanges++;
+			iBefore++;
+		}
+		else if ( iCompare > 0 )
+		{
+			LogTicketEntry( pszPrefix, "added", pNew );
+			cChanges++;
+			iAfter++;
+		}
+		else
+		{
+			if ( pOld->StartTime.QuadPart != pNew->StartTime.QuadPart || pOld->EndTime.QuadPart != pNew->EndTime.QuadPart )
+			{
+				LogTicketEntry( pszPrefix, "renewed", pNew );
+				cChanges++;
+			}
+			else if ( pOld->lEncryptionType != pNew->lEncryptionType || pOld->ulTicketFlags != pNew->ulTicketFlags )
+			{
+				LogTicketEntry( pszPrefix, "changed", pNew );
+				cChanges++;
+			}
+			iBefore++;
+			iAfter++;
+		}
+	}
+	return cChanges;
+}
+
+void TicketCacheBaseline()
+{
+	g_fTicketsBefore = TicketCacheSnapshot( &g_TicketsBefore );
+	if ( g_fTicketsBefore )
+	{
+		o_printf( "Kerberos ticket cache before the connection attempt: %lu tickets (ticketdump=1 lists them)", g_TicketsBefore.cEntries );
+	}
+	else
+	{
+		o_printf( "Could not read the Kerberos ticket cache before the connection attempt." );
+	}
+}
+
+// Called after the login instead of dumping the whole cache a second time.
+void DumpTicketCacheChanges()
+{
+	DWORD cChanges;
+
+	if ( !g_fTicketsBefore ) return;
+	g_fTicketsBefore = FALSE;
+	if ( !TicketCacheSnapshot( &g_TicketsAfter ) )
+	{
+		o_printf( "Could not read the Kerberos ticket cache after the connection attempt." );
+		return;
+	}
+
+	o_printf( "Kerberos ticket cache changes during the connection attempt (%lu tickets before, %lu after):", g_TicketsBefore.cEntries, g_TicketsAfter.cEntries );
+	cChanges = LogTicketCacheDiff( &g_TicketsBefore, &g_TicketsAfter, "  " );
+	if ( 0 == cChanges )
+	{
+		o_printf( "  No change, the login used tickets that were already cached or did not use Kerberos." );
+	}
+	if ( g_TicketsAfter.cDropped > 0 )
+	{
+		o_printf( "  %lu tickets past the first %d were not compared.", g_TicketsAfter.cDropped, TICKET_CACHE_MAX_TICKETS );
+	}
+	o_printf( "" );
+}
+
+// Reads the cache every interval and logs what changed since the last read.  Reading the cache
+// is one LSA call, the snapshots are only walked when their hashes differ.
+static DWORD WINAPI TicketWatchThread( LPVOID pvUnused )
+{
+	TICKET_CACHE_SNAPSHOT* pPrevious = &g_rgWatchSnapshots[0];
+	TICKET_CACHE_SNAPSHOT* pCurrent = &g_rgWatchSnapshots[1];
+	TICKET_CACHE_SNAPSHOT* pSwap = NULL;
+	BOOL fPrevious;
+
+	fPrevious = TicketCacheSnapshot( pPrevious );
+	while ( WAIT_TIMEOUT == WaitForSingleObject( g_hWatchStop, g_dwWatchIntervalMs ) )
+	{
+		if ( !TicketCacheSnapshot( pCurrent ) ) continue;
+		if ( fPrevious && pCurrent->ui64Hash != pPrevious->ui64Hash )
+		{
+			LogTicketCacheDiff( pPrevious, pCurrent, "[ticket watch] " );
+		}
+		pSwap = pPrevious;
+		pPrevious = pCurrent;
+		pCurrent = pSwap;
+		fPrevious = TRUE;
+	}
+	return 0;
+}
+
+void TicketWatchStart( DWORD dwIntervalMs )
+{
+	if ( NULL != g_hWatchThread || 0 == dwIntervalMs ) return;
+	if ( !KerbSessionOpen( NULL, NULL ) ) return;
+
+	g_dwWatchIntervalMs = max( dwIntervalMs, TICKET_WATCH_MIN_MS );
+	g_hWatchStop = CreateEvent( NULL, TRUE, FALSE, NULL );
+	if ( NULL == g_hWatchStop ) return;
+
+	g_hWatchThread = CreateThread( NULL, 0, TicketWatchThread, NULL, 0, NULL );
+	if ( NULL == g_hWatchThread )
+	{
+		CloseHandle( g_hWatchStop );
+		g_hWatchStop = NULL;
+		return;
+	}
+	o_printf( "Watching the Kerberos ticket cache every %lu ms, changes are logged with [ticket watch].", g_dwWatchIntervalMs );
+}
+
+void TicketWatchStop()
+{
+	if ( NULL == g_hWatchThread ) return;
+
+	SetEvent( g_hWatchStop );
+	WaitForSingleObject( g_hWatchThread, INFINITE );
+	CloseHandle( g_hWatchThread );
+	CloseHandle( g_hWatchStop );
+	g_hWatchThread = NULL;
+	g_hWatchStop = NULL;
+}
+
+// purgeservice, purgerealm and purgeexpired from the test options.
+void GetTicketPurgeFilter( TICKET_PURGE_FILTER* pFilter )
+{
+	ZeroMemory( pFilter, sizeof(*pFilter) );
+	GetTestOptionString( "purgeservice", "", pFilter->szServiceClass, sizeof(pFilter->szServiceClass) );
+	GetTestOptionString( "purgerealm", "", pFilter->szRealm, sizeof(pFilter->szRealm) );
+	pFilter->fExpiredOnly = GetTestOptionBool( "purgeexpired", FALSE );
+}
+
+char* FormatTicketPurgeFilter( const TICKET_PURGE_FILTER* pFilter, char* pszBuffer, size_t cchBuffer )
+{
+	sprintf_s( pszBuffer, cchBuffer, "%s%s tickets%s%s",
+			   ( pFilter->fExpiredOnly ) ? "expired " : "all ",
+			   ( '\0' != pFilter->szServiceClass[0] ) ? pFilter->szServiceClass : "",
+			   ( '\0' != pFilter->szRealm[0] ) ? " in realm " : "",
+			   pFilter->szRealm );
+	return pszBuffer;
+}
+
+static BOOL TicketMatchesFilter( const TICKET_PURGE_FILTER* pFilter, const char* pszServer, const char* pszRealm, const LARGE_INTEGER* pEndTime, __int64 i64Now )
+{
+	size_t cchClass = strlen( pFilter->szServiceClass );
+
+	if ( cchClass > 0 )
+	{
+		if ( 0 != _strnicmp( pszServer, pFilter->szServiceClass, cchClass ) || '/' != pszServer[cchClass] ) return FALSE;
+	}
+	if ( '\0' != pFilter->szRealm[0] && 0 != lstrcmpi( pszRealm, pFilter->szRealm ) ) return FALSE;
+	if ( pFilter->fExpiredOnly && pEndTime->QuadPart > i64Now ) return FALSE;
+	return TRUE;
+}
+
+// A purge request with room for the names after it, built again for each ticket in the same memory.
+typedef struct _TICKET_PURGE_BUFFER
+{
+	KERB_PURGE_TKT_CACHE_REQUEST Request;
+	WCHAR wszNames[2 * KERB_MAX_SPN_LENGTH];
+} TICKET_PURGE_BUFFER;
+
+static NTSTATUS PurgeTicket( HANDLE hLogonHandle, ULONG ulPackageId, TICKET_PURGE_BUFFER* pBuffer, const UNICODE_STRING* pusServer, const UNICODE_STRING* pusRealm )
+{
+	PVOID pvResponse = NULL;
+	ULONG ulResponseSize = 0;
+	NTSTATUS Status, SubStatus = 0;
+
+	if ( (size_t) pusServer->Length + pusRealm->Length > sizeof(pBuffer->wszNames) ) return (NTSTATUS) 0xc0000023;		// STATUS_BUFFER_TOO_SMALL
+
+	ZeroMemory( &pBuffer->Request, sizeof(pBuffer->Request) );
+	pBuffer->Request.MessageType = KerbPurgeTicketCacheMessage;
+
+	CopyMemory( pBuffer->wszNames, pusServer->Buffer, pusServer->Length );
+	pBuffer->Request.ServerName.Buffer        = pBuffer->wszNames;
+	pBuffer->Request.ServerName.Length        = pusServer->Length;
+	pBuffer->Request.ServerName.MaximumLength = pusServer->Length;
+
+	CopyMemory( (LPBYTE) pBuffer->wszNames + pusServer->Length, pusRealm->Buffer, pusRealm->Length );
+	pBuffer->Request.RealmName.Buffer        = (LPWSTR) ( (LPBYTE) pBuffer->wszNames + pusServer->Length );
+	pBuffer->Request.RealmName.Length        = pusRealm->Length;
+	pBuffer->Request.RealmName.MaximumLength = pusRealm->Length;
+
+	Status = pfnLsaCallAuthenticationPackage( hLogonHandle,
+											  ulPackageId,
+											  pBuffer,
+											  sizeof(pBuffer->Request) + pusServer->Length + pusRealm->Length,
+											  &pvResponse,
+											  &ulResponseSize,
+											  &SubStatus );
+	if ( NULL != pvResponse ) pfnLsaFreeReturnBuffer( pvResponse );
+
+	if ( !SEC_SUCCESS( Status ) ) return Status;
+	return SubStatus;
+}
+
+// Removes the tickets pFilter matches from this logon session's cache over the shared session,
+// logging each one.  The purge requests are built in one buffer on the stack.
+BOOL PurgeTickets( const TICKET_PURGE_FILTER* pFilter, TICKET_PURGE_RESULT* pResult )
+{
+	TICKET_PURGE_BUFFER Buffer;
+	KERB_QUERY_TKT_CACHE_REQUEST CacheRequest;
+	PKERB_QUERY_TKT_CACHE_RESPONSE pTickets = NULL;
+	PKERB_TICKET_CACHE_INFO pInfo = NULL;
+	NTSTATUS Status, SubStatus;
+	HANDLE hLogonHandle = NULL;
+	ULONG ulPackageId = 0, ulResponseSize = 0, i;
+	FILETIME ftNow;
+	__int64 i64Now;
+	char szServer[256], szRealm[128];
+	size_t cchList = 0;
+	uint64_t ui64Start;
+
+	ZeroMemory( pResult, sizeof(*pResult) );
+	if ( !KerbSessionOpen( &hLogonHandle, &ulPackageId ) ) return FALSE;
+
+	GetSystemTimeAsFileTime( &ftNow );
+	i64Now = ( (__int64) ftNow.dwHighDateTime << 32 ) | ftNow.dwLowDateTime;
+
+	ZeroMemory( &CacheRequest, sizeof(CacheRequest) );
+	CacheRequest.MessageType = KerbQueryTicketCacheMessage;
+
+	__try
+	{
+		ui64Start = PerfCounter();
+		Status = pfnLsaCallAuthenticationPackage( hLogonHandle,
+												  ulPackageId,
+												  &CacheRequest,
+												  sizeof(CacheRequest),
+												  (PVOID*) &pTickets,
+												  &ulResponseSize,
+												  &SubStatus );
+		if ( !SEC_SUCCESS( Status ) || !SEC_SUCCESS( SubStatus ) || NULL == pTickets )
+		{
+			pResult->LastError = SEC_SUCCESS( Status ) ? SubStatus : Status;
+			if ( NULL != pTickets ) pfnLsaFreeReturnBuffer( pTickets );
+			return FALSE;
+		}
+
+		pResult->cTickets = pTickets->CountOfTickets;
+		for ( i=0; i<pTickets->CountOfTickets; i++ )
+		{
+			pInfo = &pTickets->Tickets[i];
+			US2Buffer( &pInfo->ServerName, szServer, sizeof(szServer) );
+			US2Buffer( &pInfo->RealmName, szRealm, sizeof(szRealm) );
+			if ( !TicketMatchesFilter( pFilter, szServer, szRealm, &pInfo->EndTime, i64Now ) ) continue;
+
+			pResult->cMatched++;
+			Status = PurgeTicket( hLogonHandle, ulPackageId, &Buffer, &pInfo->ServerName, &pInfo->RealmName );
+			if ( SEC_SUCCESS( Status ) )
+			{
+				pResult->cPurged++;
+				o_printf( "  purged   %s@%s, etype %ld (%s)%s", szServer, szRealm, pInfo->EncryptionType, KerbEtypeName( pInfo->EncryptionType ),
+						  ( pInfo->EndTime.QuadPart <= i64Now ) ? ", expired" : "" );
+				if ( cchList + strlen( szServer ) + strlen( szRealm ) + 4 < sizeof(pResult->szPurged) )
+				{
+					cchList += sprintf_s( pResult->szPurged + cchList, sizeof(pResult->szPurged) - cchList, "%s@%s\r\n", szServer, szRealm );
+				}
+			}
+			else
+			{
+				pResult->cFailed++;
+				pResult->LastError = Status;
+				o_printf( "  failed   %s@%s, 0x%08x %s", szServer, szRealm, Status, KerbStatusName( Status ) );
+			}
+		}
+		pfnLsaFreeReturnBuffer( pTickets );
+		pResult->dMs = PerfElapsedMs( ui64Start );
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		o_printf( "[PurgeTickets] Unexpected error purging tickets" );
+		return FALSE;
+	}
+
+	return TRUE;
+}
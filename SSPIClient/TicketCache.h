@@ -0,0 +1,63 @@
+#pragma once
+
+#include "PerfStats.h"
+
+// Copies of the Kerberos ticket cache (KerbQueryTicketCacheExMessage) sorted by server and realm,
+// so two of them can be compared in one pass and only the tickets that were added, removed or
+// renewed are logged.  Each copy carries a hash of the tickets, the watch thread polls the cache
+// and only compares when the hash moved.
+
+#define TICKET_CACHE_MAX_TICKETS	256
+#define TICKET_WATCH_MIN_MS			100
+#define TICKET_PURGE_LIST_SIZE		2048	// Characters of purged ticket names kept for the caller
+
+typedef struct _TICKET_CACHE_ENTRY
+{
+	char  szServer[256];
+	char  szRealm[128];
+	LARGE_INTEGER StartTime;
+	LARGE_INTEGER EndTime;
+	LARGE_INTEGER RenewTime;
+	LONG  lEncryptionType;
+	ULONG ulTicketFlags;
+} TICKET_CACHE_ENTRY;
+
+typedef struct _TICKET_CACHE_SNAPSHOT
+{
+	DWORD    cEntries;
+	DWORD    cDropped;				// Tickets past TICKET_CACHE_MAX_TICKETS
+	uint64_t ui64Hash;				// FNV-1a over the sorted entries
+	uint64_t ui64Taken;				// PerfCounter when the cache was read
+	TICKET_CACHE_ENTRY rgEntries[TICKET_CACHE_MAX_TICKETS];
+} TICKET_CACHE_SNAPSHOT;
+
+// Which tickets a purge removes, empty fields match everything.
+typedef struct _TICKET_PURGE_FILTER
+{
+	char szServiceClass[64];		// Part of the server name before the '/', e.g. MSSQLSvc or krbtgt
+	char szRealm[128];
+	BOOL fExpiredOnly;
+} TICKET_PURGE_FILTER;
+
+typedef struct _TICKET_PURGE_RESULT
+{
+	DWORD    cTickets;				// In the cache before the purge
+	DWORD    cMatched;
+	DWORD    cPurged;
+	DWORD    cFailed;
+	NTSTATUS LastError;
+	double   dMs;					// Cache query plus all purge calls
+	char     szPurged[TICKET_PURGE_LIST_SIZE];	// server@realm of the purged tickets, one per line
+} TICKET_PURGE_RESULT;
+
+BOOL  TicketCacheSnapshot( TICKET_CACHE_SNAPSHOT* pSnapshot );
+DWORD LogTicketCacheDiff( const TICKET_CACHE_SNAPSHOT* pBefore, const TICKET_CACHE_SNAPSHOT* pAfter, const char* pszPrefix );
+
+void  TicketCacheBaseline();
+void  DumpTicketCacheChanges();
+void  TicketWatchStart( DWORD dwIntervalMs );
+void  TicketWatchStop();
+
+void  GetTicketPurgeFilter( TICKET_PURGE_FILTER* pFilter );
+char* FormatTicketPurgeFilter( const TICKET_PURGE_FILTER* pFilter, char* pszBuffer, size_t cchBuffer );
+BOOL  PurgeTickets( const TICKET_PURGE_FILTER* pFilter, TICKET_PURGE_RESULT* pResult );
@@ -0,0 +1,514 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// TlsStats.cpp: record counts, sizes and cost of Schannel EncryptMessage/DecryptMessage,
+// and the legs, certificate validation and outcome of each Schannel handshake.
+//
+
+#include "stdafx.h"
+#include "TlsStats.h"
+#include "DetourFunctions.h"
+#include "TdsDecoder.h"
+
+static TLS_TOTALS g_TlsTotals;
+
+static TLS_HANDSHAKE g_TlsHandshake;
+static DWORD g_dwTlsHandshakes = 0;
+
+void TlsStatsReset()
+{
+	ZeroMemory( &g_TlsTotals, sizeof(g_TlsTotals) );
+	ZeroMemory( &g_TlsHandshake, sizeof(g_TlsHandshake) );
+	g_dwTlsHandshakes = 0;
+}
+
+// Sums the sizes of the header, data and trailer buffers of a stream message.  Returns FALSE
+// if the message has no stream header, i.e. it is not a TLS record.
+static BOOL GetStreamSizes( PSecBufferDesc pMessage, DWORD* pcbData, DWORD* pcbOverhead )
+{
+	unsigned long i;
+	BOOL fStream = FALSE;
+
+	*pcbData = 0;
+	*pcbOverhead = 0;
+
+	if ( NULL == pMessage || NULL == pMessage->pBuffers ) return FALSE;
+
+	for ( i=0; i<pMessage->cBuffers; i++ )
+	{
+		switch( pMessage->pBuffers[i].BufferType & ~SECBUFFER_ATTRMASK )
+		{
+			case SECBUFFER_STREAM_HEADER:
+				fStream = TRUE;
+				*pcbOverhead += pMessage->pBuffers[i].cbBuffer;
+				break;
+
+			case SECBUFFER_STREAM_TRAILER:
+				*pcbOverhead += pMessage->pBuffers[i].cbBuffer;
+				break;
+
+			case SECBUFFER_DATA:
+				*pcbData += pMessage->pBuffers[i].cbBuffer;
+				break;
+		}
+	}
+
+	return fStream;
+}
+
+void TlsStatsEncrypt( PSecBufferDesc pMessage, SECURITY_STATUS rv, uint64_t ui64Start, uint64_t ui64End )
+{
+	DWORD cbData, cbOverhead;
+
+	if ( !GetStreamSizes( pMessage, &cbData, &cbOverhead ) ) return;
+
+	if ( SEC_E_OK != rv )
+	{
+		g_TlsTotals.dwFailures++;
+		return;
+	}
+
+	g_TlsTotals.dwEncryptRecords++;
+	g_TlsTotals.ui64EncryptDataBytes     += cbData;
+	g_TlsTotals.ui64EncryptOverheadBytes += cbOverhead;
+	g_TlsTotals.ui64EncryptUs            += PerfCounterToUs( ui64End - ui64Start );
+}
+
+// DecryptMessage is called with one SECBUFFER_DATA holding the ciphertext and splits it into
+// header, data and trailer in place, so the sizes are only known after the call.
+// SEC_E_INCOMPLETE_MESSAGE just means the caller has to read more, it is not counted.
+void TlsStatsDecrypt( PSecBufferDesc pMessage, SECURITY_STATUS rv, uint64_t ui64Start, uint64_t ui64End )
+{
+	DWORD cbData, cbOverhead;
+
+	if ( SEC_E_INCOMPLETE_MESSAGE == rv ) return;
+
+	if ( SEC_E_OK != rv )
+	{
+		if ( GetStreamSizes( pMessage, &cbData, &cbOverhead ) ) g_TlsTotals.dwFailures++;
+		return;
+	}
+
+	if ( !GetStreamSizes( pMessage, &cbData, &cbOverhead ) ) return;
+
+	g_TlsTotals.dwDecryptRecords++;
+	g_TlsTotals.ui64DecryptDataBytes     += cbData;
+	g_TlsTotals.ui64DecryptOverheadBytes += cbOverhead;
+	g_TlsTotals.ui64DecryptUs            += PerfCounterToUs( ui64End - ui64Start );
+}
+
+void TlsStatsGetTotals( TLS_TOTALS* pTotals )
+{
+	*pTotals = g_TlsTotals;
+}
+
+void TlsTotalsDelta( const TLS_TOTALS* pBefore, const TLS_TOTALS* pAfter, TLS_TOTALS* pDelta )
+{
+	pDelta->dwEncryptRecords         = pAfter->dwEncryptRecords         - pBefore->dwEncryptRecords;
+	pDelta->dwDecryptRecords         = pAfter->dwDecryptRecords         - pBefore->dwDecryptRecords;
+	pDelta->dwFailures               = pAfter->dwFailures               - pBefore->dwFailures;
+	pDelta->ui64EncryptDataBytes     = pAfter->ui64EncryptDataBytes     - pBefore->ui64EncryptDataBytes;
+	pDelta->ui64EncryptOverheadBytes = pAfter->ui64EncryptOverheadBytes - pBefore->ui64EncryptOverheadBytes;
+	pDelta->ui64DecryptDataBytes     = pAfter->ui64DecryptDataBytes     - pBefore->ui64DecryptDataBytes;
+	pDelta->ui64DecryptOverheadBytes = pAfter->ui64DecryptOverheadBytes - pBefore->ui64DecryptOverheadBytes;
+	pDelta->ui64EncryptUs            = pAfter->ui64EncryptUs            - pBefore->ui64EncryptUs;
+	pDelta->ui64DecryptUs            = pAfter->ui64DecryptUs            - pBefore->ui64DecryptUs;
+}
+
+static void AppendFlightName( char* pszDesc, size_t cchDesc, const char* pszName )
+{
+	if ( '\0' != pszDesc[0] ) strcat_s( pszDesc, cchDesc, ", " );
+	strcat_s( pszDesc, cchDesc, pszName );
+}
+
+// Names the TLS messages in a handshake token, e.g. "ServerHello, Certificate, ServerHelloDone".
+// Handshake messages that span records are followed through the length in their header.
+// Anything after ChangeCipherSpec is encrypted, so only the record type is known.
+static void DescribeTlsFlight( const BYTE* pb, DWORD cb, char* pszDesc, size_t cchDesc )
+{
+	DWORD ib = 0;
+	DWORD cbSkip = 0;
+	BOOL fEncrypted = FALSE;
+
+	pszDesc[0] = '\0';
+
+	while ( ib + TLS_HEADER_SIZE <= cb )
+	{
+		BYTE  bType    = pb[ib];
+		DWORD cbRecord = ( pb[ib+3] << 8 ) | pb[ib+4];
+		DWORD cbBody   = min( cbRecord, cb - ib - TLS_HEADER_SIZE );
+		const BYTE* pbBody = pb + ib + TLS_HEADER_SIZE;
+		DWORD ih;
+
+		if ( bType < 0x14 || bType > 0x17 ) break;
+
+		if ( 0x16 == bType && !fEncrypted )
+		{
+			ih = min( cbSkip, cbBody );
+			cbSkip -= ih;
+			while ( ih + 4 <= cbBody )
+			{
+				DWORD cbMessage = ( pbBody[ih+1] << 16 ) | ( pbBody[ih+2] << 8 ) | pbBody[ih+3];
+				AppendFlightName( pszDesc, cchDesc, TlsHandshakeTypeName( pbBody[ih] ) );
+				if ( ih + 4 + cbMessage > cbBody )
+				{
+					cbSkip = ih + 4 + cbMessage - cbBody;
+					break;
+				}
+				ih += 4 + cbMessage;
+			}
+		}
+		else if ( 0x16 == bType )
+		{
+			AppendFlightName( pszDesc, cchDesc, "Finished" );
+		}
+		else if ( 0x14 == bType )
+		{
+			AppendFlightName( pszDesc, cchDesc, "ChangeCipherSpec" );
+			fEncrypted = TRUE;
+		}
+		else if ( 0x15 == bType )
+		{
+			AppendFlightName( pszDesc, cchDesc, "Alert" );
+		}
+		else
+		{
+			// TLS 1.3 sends everything after ServerHello as application data records.
+			AppendFlightName( pszDesc, cchDesc, "encrypted" );
+		}
+
+		ib += TLS_HEADER_SIZE + cbRecord;
+	}
+}
+
+// Size and description of the SECBUFFER_TOKEN buffers of a handshake call.
+static DWORD GetTokenFlight( PSecBufferDesc pDesc, char* pszDesc, size_t cchDesc )
+{
+	unsigned long i;
+	DWORD cbToken = 0;
+
+	pszDesc[0] = '\0';
+	if ( NULL == pDesc || NULL == pDesc->pBuffers ) return 0;
+
+	for ( i=0; i<pDesc->cBuffers; i++ )
+	{
+		if ( SECBUFFER_TOKEN != ( pDesc->pBuffers[i].BufferType & ~SECBUFFER_ATTRMASK ) ) continue;
+		if ( NULL == pDesc->pBuffers[i].pvBuffer || 0 == pDesc->pBuffers[i].cbBuffer ) continue;
+
+		if ( 0 == cbToken )
+		{
+			DescribeTlsFlight( (const BYTE*) pDesc->pBuffers[i].pvBuffer, pDesc->pBuffers[i].cbBuffer, pszDesc, cchDesc );
+		}
+		cbToken += pDesc->pBuffers[i].cbBuffer;
+	}
+	return cbToken;
+}
+
+static BOOL IsCurrentHandshake( PCtxtHandle phContext )
+{
+	if ( 0 == g_TlsHandshake.dwNumber || NULL == phContext ) return FALSE;
+	return ( phContext->dwLower == g_TlsHandshake.hContext.dwLower &&
+			 phContext->dwUpper == g_TlsHandshake.hContext.dwUpper );
+}
+
+// Called before each InitializeSecurityContext call on a stream context.  A call without an
+// existing context, or with one we have not seen, starts a new handshake and reports the last.
+void TlsHandshakeLegStart( PCtxtHandle phContext, const char* pszTarget, PSecBufferDesc pInput, uint64_t ui64Start )
+{
+	TLS_LEG* pLeg = NULL;
+
+	if ( !IsCurrentHandshake( phContext ) )
+	{
+		DumpTlsHandshake();
+		ZeroMemory( &g_TlsHandshake, sizeof(g_TlsHandshake) );
+		g_TlsHandshake.dwNumber = ++g_dwTlsHandshakes;
+		g_TlsHandshake.rvFinal  = SEC_I_CONTINUE_NEEDED;
+		if ( NULL != phContext ) g_TlsHandshake.hContext = *phContext;
+		lstrcpyn( g_TlsHandshake.szTarget, ( NULL == pszTarget ) ? "<NULL>" : pszTarget, sizeof(g_TlsHandshake.szTarget) );
+	}
+
+	g_TlsHandshake.fInLeg = TRUE;
+	if ( g_TlsHandshake.cLegs < TLS_MAX_LEGS )
+	{
+		pLeg = &g_TlsHandshake.rgLegs[g_TlsHandshake.cLegs];
+		pLeg->ui64Start = ui64Start;
+		pLeg->cbIn = GetTokenFlight( pInput, pLeg->szIn, sizeof(pLeg->szIn) );
+	}
+}
+
+void TlsHandshakeLegEnd( PCtxtHandle phNewContext, PSecBufferDesc pOutput, SECURITY_STATUS rv, uint64_t ui64End )
+{
+	TLS_LEG* pLeg = NULL;
+
+	if ( 0 == g_TlsHandshake.dwNumber || !g_TlsHandshake.fInLeg ) return;
+
+	if ( g_TlsHandshake.cLegs < TLS_MAX_LEGS )
+	{
+		pLeg = &g_TlsHandshake.rgLegs[g_TlsHandshake.cLegs];
+		pLeg->ui64End = ui64End;
+		pLeg->rv      = rv;
+		pLeg->cbOut   = GetTokenFlight( pOutput, pLeg->szOut, sizeof(pLeg->szOut) );
+	}
+	g_TlsHandshake.cLegs++;
+	g_TlsHandshake.fInLeg = FALSE;
+	g_TlsHandshake.ui64LastEnd = ui64End;
+
+	// The first call returns the context handle, later calls pass it back in.
+	if ( NULL != phNewContext && ( SEC_E_OK == rv || SEC_I_CONTINUE_NEEDED == rv ) )
+	{
+		g_TlsHandshake.hContext = *phNewContext;
+	}
+
+	if ( SEC_E_OK == rv )
+	{
+		g_TlsHandshake.fComplete = TRUE;
+		g_TlsHandshake.rvFinal   = rv;
+	}
+	else if ( FAILED(rv) && SEC_E_INCOMPLETE_MESSAGE != rv )
+	{
+		g_TlsHandshake.rvFinal = rv;
+	}
+}
+
+void TlsHandshakeConnectionInfo( const SecPkgContext_ConnectionInfo* pInfo )
+{
+	if ( 0 == g_TlsHandshake.dwNumber ) return;
+	g_TlsHandshake.ConnectionInfo  = *pInfo;
+	g_TlsHandshake.fConnectionInfo = TRUE;
+}
+
+void TlsHandshakeSessionInfo( const SecPkgContext_SessionInfo* pInfo )
+{
+	if ( 0 == g_TlsHandshake.dwNumber ) return;
+	g_TlsHandshake.dwSessionFlags = pInfo->dwFlags;
+	g_TlsHandshake.cbSessionId    = pInfo->cbSessionId;
+	g_TlsHandshake.fSessionInfo   = TRUE;
+}
+
+// Charges certificate validation time to the current handshake.  Time spent inside a leg is
+// also subtracted from that leg, so it is not counted twice as client time.
+static void AddCertTime( uint64_t ui64Start, uint64_t ui64End )
+{
+	if ( g_TlsHandshake.fInLeg && g_TlsHandshake.cLegs < TLS_MAX_LEGS )
+	{
+		g_TlsHandshake.rgLegs[g_TlsHandshake.cLegs].ui64CertUs += PerfCounterToUs( ui64End - ui64Start );
+	}
+	if ( ui64End > g_TlsHandshake.ui64LastEnd ) g_TlsHandshake.ui64LastEnd = ui64End;
+}
+
+void TlsHandshakeChainBuild( DWORD dwFlags, BOOL fResult, uint64_t ui64Start, uint64_t ui64End )
+{
+	if ( 0 == g_TlsHandshake.dwNumber ) return;
+
+	g_TlsHandshake.cChainBuilds++;
+	if ( !fResult ) g_TlsHandshake.cChainFailures++;
+	g_TlsHandshake.dwChainFlags = dwFlags;
+	g_TlsHandshake.ui64ChainUs += PerfCounterToUs( ui64End - ui64Start );
+	AddCertTime( ui64Start, ui64End );
+}
+
+void TlsHandshakePolicyCheck( DWORD dwError, uint64_t ui64Start, uint64_t ui64End )
+{
+	if ( 0 == g_TlsHandshake.dwNumber ) return;
+
+	g_TlsHandshake.cPolicyChecks++;
+	if ( 0 == g_TlsHandshake.dwPolicyError ) g_TlsHandshake.dwPolicyError = dwError;
+	g_TlsHandshake.ui64PolicyUs += PerfCounterToUs( ui64End - ui64Start );
+	AddCertTime( ui64Start, ui64End );
+}
+
+BOOL TlsGetLastHandshake( TLS_HANDSHAKE* pHandshake )
+{
+	if ( 0 == g_TlsHandshake.dwNumber ) return FALSE;
+	*pHandshake = g_TlsHandshake;
+	return TRUE;
+}
+
+// Full or resumed, from SECPKG_ATTR_SESSION_INFO when Schannel supports it.  Otherwise from the
+// server flights: a full handshake sends its Certificate, a resumed TLS 1.2 one goes straight
+// from ServerHello to ChangeCipherSpec and Finished.  TLS 1.3 flights are encrypted, so unknown.
+int GetTlsHandshakeKind( const TLS_HANDSHAKE* pHandshake )
+{
+	DWORD i;
+	BOOL fServerHello = FALSE;
+	BOOL fFinished = FALSE;
+
+	if ( !pHandshake->fComplete ) return TLS_HANDSHAKE_UNKNOWN;
+	if ( pHandshake->fSessionInfo )
+	{
+		return ( pHandshake->dwSessionFlags & SSL_SESSION_RECONNECT ) ? TLS_HANDSHAKE_RESUMED : TLS_HANDSHAKE_FULL;
+	}
+
+	for ( i=0; i<min( pHandshake->cLegs, TLS_MAX_LEGS ); i++ )
+	{
+		const char* pszIn = pHandshake->rgLegs[i].szIn;
+		if ( NULL != strstr( pszIn, "Certificate" ) ) return TLS_HANDSHAKE_FULL;
+		if ( NULL != strstr( pszIn, "ServerHello" ) ) fServerHello = TRUE;
+		if ( NULL != strstr( pszIn, "Finished" ) ) fFinished = TRUE;
+	}
+	return ( fServerHello && fFinished ) ? TLS_HANDSHAKE_RESUMED : TLS_HANDSHAKE_UNKNOWN;
+}
+
+const char* GetTlsHandshakeKindName( int iKind )
+{
+	switch ( iKind )
+	{
+		case TLS_HANDSHAKE_FULL:	return "full";
+		case TLS_HANDSHAKE_RESUMED:	return "resumed";
+	}
+	return "unknown";
+}
+
+// First leg start to last leg end, certificate validation after the handshake is not included.
+double TlsHandshakeMs( const TLS_HANDSHAKE* pHandshake )
+{
+	DWORD cLegs = min( pHandshake->cLegs, TLS_MAX_LEGS );
+
+	if ( 0 == cLegs ) return 0;
+	return PerfCounterToMs( pHandshake->rgLegs[cLegs-1].ui64End - pHandshake->rgLegs[0].ui64Start );
+}
+
+const char* GetTlsProtocolName( DWORD dwProtocol )
+{
+	// Client and server bits of the SP_PROT_* values, spelled out because older SDKs lack TLS 1.3.
+	if ( dwProtocol & 0x00003000 ) return "TLS 1.3";
+	if ( dwProtocol & 0x00000C00 ) return "TLS 1.2";
+	if ( dwProtocol & 0x00000300 ) return "TLS 1.1";
+	if ( dwProtocol & 0x000000C0 ) return "TLS 1.0";
+	if ( dwProtocol & 0x00000030 ) return "SSL 3.0";
+	if ( dwProtocol & 0x0000000C ) return "SSL 2.0";
+	return "Unknown";
+}
+
+// CALG_* values, numeric because the SHA-2 and ECC ones depend on the NTDDI version.
+const char* GetTlsAlgName( ALG_ID aiAlg, char* pszBuffer, size_t cchBuffer )
+{
+	switch ( aiAlg )
+	{
+		case 0:			return "none";
+		case 0x6801:	return "RC4";
+		case 0x6601:	return "DES";
+		case 0x6603:	return "3DES";
+		case 0x660e:	return "AES-128";
+		case 0x660f:	return "AES-192";
+		case 0x6610:	return "AES-256";
+		case 0x6611:	return "AES";
+		case 0x8003:	return "MD5";
+		case 0x8004:	return "SHA1";
+		case 0x800c:	return "SHA-256";
+		case 0x800d:	return "SHA-384";
+		case 0x800e:	return "SHA-512";
+		case 0xa400:	return "RSA";
+		case 0xaa02:	return "DH ephemeral";
+		case 0xaa05:	return "ECDH";
+		case 0xae06:	return "ECDH ephemeral";
+		case 0x2203:	return "ECDSA";
+	}
+	sprintf_s( pszBuffer, cchBuffer, "0x%04x", aiAlg );
+	return pszBuffer;
+}
+
+// Reports the handshake in progress or last completed, once.  Called when the next handshake
+// starts and at the end of the test, so validation done after the handshake is included.
+void DumpTlsHandshake()
+{
+	TLS_HANDSHAKE* p = &g_TlsHandshake;
+	DWORD i;
+	DWORD cLegs;
+	uint64_t ui64WaitUs = 0;
+	uint64_t ui64ClientUs = 0;
+	uint64_t ui64CertUs, ui64TotalUs, ui64OtherUs;
+	char szAlg1[16], szAlg2[16], szAlg3[16];
+	const char* pszMost;
+
+	if ( 0 == p->dwNumber || p->fReported || 0 == p->cLegs ) return;
+	p->fReported = TRUE;
+
+	cLegs = min( p->cLegs, TLS_MAX_LEGS );
+
+	o_printf( "" );
+	if ( p->fComplete )
+	{
+		o_printf( "TLS handshake %lu to [%s] completed in %lu legs.", p->dwNumber, p->szTarget, p->cLegs );
+	}
+	else if ( SEC_I_CONTINUE_NEEDED == p->rvFinal )
+	{
+		o_printf( "TLS handshake %lu to [%s] did not complete after %lu legs.", p->dwNumber, p->szTarget, p->cLegs );
+	}
+	else
+	{
+		o_printf( "TLS handshake %lu to [%s] failed after %lu legs with 0x%08x %s", p->dwNumber, p->szTarget, p->cLegs, p->rvFinal, GetSecurityErrorString( p->rvFinal ) );
+	}
+
+	for ( i=0; i<cLegs; i++ )
+	{
+		const TLS_LEG* pLeg = &p->rgLegs[i];
+		uint64_t ui64LegUs = PerfCounterToUs( pLeg->ui64End - pLeg->ui64Start );
+
+		if ( i > 0 )
+		{
+			uint64_t ui64GapUs = PerfCounterToUs( pLeg->ui64Start - p->rgLegs[i-1].ui64End );
+			ui64WaitUs += ui64GapUs;
+			o_printf( "  wait  %10.3f ms  network and server", ui64GapUs / 1000.0 );
+		}
+		ui64ClientUs += ( ui64LegUs > pLeg->ui64CertUs ) ? ui64LegUs - pLeg->ui64CertUs : 0;
+
+		o_printf( "  leg %lu %10.3f ms  received %5lu bytes [%s], sent %5lu bytes [%s], returned 0x%08x",
+				  i+1, ui64LegUs / 1000.0, pLeg->cbIn, pLeg->szIn, pLeg->cbOut, pLeg->szOut, pLeg->rv );
+	}
+
+	if ( p->cChainBuilds > 0 )
+	{
+		o_printf( "  CertGetCertificateChain      %lu calls, %10.3f ms, %lu failed, dwFlags 0x%08x (%s)",
+				  p->cChainBuilds, p->ui64ChainUs / 1000.0, p->cChainFailures, p->dwChainFlags,
+				  ( p->dwChainFlags & ( CERT_CHAIN_REVOCATION_CHECK_END_CERT | CERT_CHAIN_REVOCATION_CHECK_CHAIN | CERT_CHAIN_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT ) ) ?
+				  ( ( p->dwChainFlags & CERT_CHAIN_REVOCATION_CHECK_CACHE_ONLY ) ? "revocation from cache only" : "revocation checked" ) : "no revocation check" );
+	}
+	if ( p->cPolicyChecks > 0 )
+	{
+		o_printf( "  CertVerifyCertificateChainPolicy %lu calls, %10.3f ms, dwError 0x%08x",
+				  p->cPolicyChecks, p->ui64PolicyUs / 1000.0, p->dwPolicyError );
+	}
+
+	if ( p->fConnectionInfo )
+	{
+		o_printf( "  Negotiated %s, cipher %s %lu bits, hash %s %lu bits, key exchange %s %lu bits",
+				  GetTlsProtocolName( p->ConnectionInfo.dwProtocol ),
+				  GetTlsAlgName( p->ConnectionInfo.aiCipher, szAlg1, sizeof(szAlg1) ), p->ConnectionInfo.dwCipherStrength,
+				  GetTlsAlgName( p->ConnectionInfo.aiHash, szAlg2, sizeof(szAlg2) ), p->ConnectionInfo.dwHashStrength,
+				  GetTlsAlgName( p->ConnectionInfo.aiExch, szAlg3, sizeof(szAlg3) ), p->ConnectionInfo.dwExchStrength );
+	}
+
+	if ( p->fComplete )
+	{
+		o_printf( "  Handshake was %s%s, session id %lu bytes",
+				  GetTlsHandshakeKindName( GetTlsHandshakeKind( p ) ),
+				  ( p->fSessionInfo ) ? "" : " (from the server flights, SECPKG_ATTR_SESSION_INFO not supported)",
+				  p->cbSessionId );
+	}
+
+	// Whatever is not a leg, a wait or certificate validation is the driver between calls.
+	ui64CertUs  = p->ui64ChainUs + p->ui64PolicyUs;
+	ui64TotalUs = PerfCounterToUs( p->ui64LastEnd - p->rgLegs[0].ui64Start );
+	ui64OtherUs = ui64TotalUs - min( ui64TotalUs, ui64WaitUs + ui64ClientUs + ui64CertUs );
+
+	if ( ui64WaitUs >= ui64ClientUs && ui64WaitUs >= ui64CertUs )
+	{
+		pszMost = "network and server";
+	}
+	else if ( ui64CertUs >= ui64ClientUs )
+	{
+		pszMost = ( p->dwChainFlags & ( CERT_CHAIN_REVOCATION_CHECK_END_CERT | CERT_CHAIN_REVOCATION_CHECK_CHAIN | CERT_CHAIN_REVOCATION_CHECK_CHAIN_EXCLUDE_ROOT ) ) ?
+				  "certificate validation, including CRL/OCSP retrieval" : "certificate validation";
+	}
+	else
+	{
+		pszMost = "client side Schannel processing";
+	}
+
+	o_printf( "  Total %.3f ms: network and server %.3f ms, client %.3f ms, certificate validation %.3f ms, other %.3f ms.",
+			  ui64TotalUs / 1000.0, ui64WaitUs / 1000.0, ui64ClientUs / 1000.0, ui64CertUs / 1000.0, ui64OtherUs / 1000.0 );
+	o_printf( "  Most of the handshake was spent in %s.", pszMost );
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <schannel.h>
+#include "PerfStats.h"
+
+// Schannel record statistics collected by the EncryptMessage/DecryptMessage detours.  Only
+// stream contexts (TLS) are counted, recognised by their SECBUFFER_STREAM_HEADER buffer.
+// Tests take a snapshot before and after a workload and report the difference.
+
+typedef struct _TLS_TOTALS
+{
+	DWORD    dwEncryptRecords;
+	DWORD    dwDecryptRecords;
+	DWORD    dwFailures;				// Calls that returned anything but SEC_E_OK
+	uint64_t ui64EncryptDataBytes;		// Plaintext handed to EncryptMessage
+	uint64_t ui64EncryptOverheadBytes;	// Record header plus trailer (MAC, padding) added to it
+	uint64_t ui64DecryptDataBytes;		// Plaintext returned by DecryptMessage
+	uint64_t ui64DecryptOverheadBytes;
+	uint64_t ui64EncryptUs;				// Time spent inside EncryptMessage
+	uint64_t ui64DecryptUs;
+} TLS_TOTALS;
+
+void TlsStatsReset();
+void TlsStatsEncrypt( PSecBufferDesc pMessage, SECURITY_STATUS rv, uint64_t ui64Start, uint64_t ui64End );
+void TlsStatsDecrypt( PSecBufferDesc pMessage, SECURITY_STATUS rv, uint64_t ui64Start, uint64_t ui64End );
+void TlsStatsGetTotals( TLS_TOTALS* pTotals );
+void TlsTotalsDelta( const TLS_TOTALS* pBefore, const TLS_TOTALS* pAfter, TLS_TOTALS* pDelta );
+
+// Schannel handshakes, reconstructed from the InitializeSecurityContext detour.  Each call is a
+// leg: the client works inside the call, then sends the output token and waits for the server's
+// next flight.  Chain building and policy checks done by the driver are charged to the handshake
+// in progress, or to the last one if the driver validates the certificate after the handshake.
+
+#define TLS_MAX_LEGS			8
+#define TLS_FLIGHT_DESC_SIZE	96
+
+typedef struct _TLS_LEG
+{
+	uint64_t ui64Start;			// PerfCounter at the start of the InitializeSecurityContext call
+	uint64_t ui64End;
+	uint64_t ui64CertUs;		// Chain building and policy checks done inside the call
+	DWORD    cbIn;				// Server flight handed to this call
+	DWORD    cbOut;				// Client flight returned by it
+	SECURITY_STATUS rv;
+	char     szIn[TLS_FLIGHT_DESC_SIZE];
+	char     szOut[TLS_FLIGHT_DESC_SIZE];
+} TLS_LEG;
+
+typedef struct _TLS_HANDSHAKE
+{
+	DWORD    dwNumber;			// 1 for the first handshake since TlsStatsReset
+	CtxtHandle hContext;
+	char     szTarget[256];
+	BOOL     fComplete;
+	BOOL     fReported;
+	BOOL     fInLeg;
+	SECURITY_STATUS rvFinal;	// SEC_I_CONTINUE_NEEDED until the handshake completes or fails
+	uint64_t ui64LastEnd;		// End of the last leg, chain build or policy check
+	DWORD    cLegs;				// May exceed TLS_MAX_LEGS, only the first legs are kept
+	TLS_LEG  rgLegs[TLS_MAX_LEGS];
+	DWORD    cChainBuilds;
+	DWORD    cChainFailures;
+	DWORD    dwChainFlags;		// dwFlags of the last CertGetCertificateChain call
+	uint64_t ui64ChainUs;
+	DWORD    cPolicyChecks;
+	DWORD    dwPolicyError;		// First non zero CERT_CHAIN_POLICY_STATUS.dwError
+	uint64_t ui64PolicyUs;
+	BOOL     fConnectionInfo;
+	SecPkgContext_ConnectionInfo ConnectionInfo;
+	BOOL     fSessionInfo;
+	DWORD    dwSessionFlags;	// SSL_SESSION_RECONNECT when Schannel resumed a cached session
+	DWORD    cbSessionId;
+} TLS_HANDSHAKE;
+
+#define TLS_HANDSHAKE_UNKNOWN	0
+#define TLS_HANDSHAKE_FULL		1
+#define TLS_HANDSHAKE_RESUMED	2
+
+void TlsHandshakeLegStart( PCtxtHandle phContext, const char* pszTarget, PSecBufferDesc pInput, uint64_t ui64Start );
+void TlsHandshakeLegEnd( PCtxtHandle phNewContext, PSecBufferDesc pOutput, SECURITY_STATUS rv, uint64_t ui64End );
+void TlsHandshakeConnectionInfo( const SecPkgContext_ConnectionInfo* pInfo );
+void TlsHandshakeSessionInfo( const SecPkgContext_SessionInfo* pInfo );
+void TlsHandshakeChainBuild( DWORD dwFlags, BOOL fResult, uint64_t ui64Start, uint64_t ui64End );
+void TlsHandshakePolicyCheck( DWORD dwError, uint64_t ui64Start, uint64_t ui64End );
+BOOL TlsGetLastHandshake( TLS_HANDSHAKE* pHandshake );
+int  GetTlsHandshakeKind( const TLS_HANDSHAKE* pHandshake );
+const char* GetTlsHandshakeKindName( int iKind );
+double TlsHandshakeMs( const TLS_HANDSHAKE* pHandshake );
+void DumpTlsHandshake();
+
+const char* GetTlsProtocolName( DWORD dwProtocol );
+const char* GetTlsAlgName( ALG_ID aiAlg, char* pszBuffer, size_t cchBuffer );
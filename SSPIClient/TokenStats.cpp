@@ -0,0 +1,261 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// TokenStats.cpp: size distribution of the authentication tokens per user, SPN and mechanism,
+// and the TDS packets and TCP round trips they add to a login.
+//
+
+#include "stdafx.h"
+#include "TokenStats.h"
+#include "NegoStats.h"
+#include "NegoDecoder.h"
+#include "TlsStats.h"
+#include "TdsDecoder.h"
+#include "TestOptions.h"
+#include "DetourFunctions.h"
+
+static TOKEN_SIZE_STATS g_rgTokenStats[TOKEN_MAX_KEYS];
+static DWORD g_cTokenStats = 0;
+static DWORD g_cTokenStatsDropped = 0;
+static char  g_szTokenUser[128];			// Identity the next tokens are sent for
+static char  g_szTokenCredPackage[32];
+static DWORD g_dwTokenPacketSize = 0;		// Last packet size dbnetlib was told to use
+
+void TokenStatsReset()
+{
+	char szDomain[64] = "";
+	char szUser[64] = "";
+	DWORD cchUser = sizeof(szUser);
+
+	ZeroMemory( g_rgTokenStats, sizeof(g_rgTokenStats) );
+	g_cTokenStats = 0;
+	g_cTokenStatsDropped = 0;
+	g_dwTokenPacketSize = 0;
+	lstrcpyn( g_szTokenCredPackage, "Negotiate", sizeof(g_szTokenCredPackage) );
+
+	// Integrated logins use the process identity unless the credentials name a principal.
+	GetEnvironmentVariableA( "USERDOMAIN", szDomain, sizeof(szDomain) );
+	if ( !GetUserNameA( szUser, &cchUser ) ) lstrcpyn( szUser, "<unknown>", sizeof(szUser) );
+	sprintf_s( g_szTokenUser, sizeof(g_szTokenUser), "%s%s%s", szDomain, ( '\0' != szDomain[0] ) ? "\\" : "", szUser );
+}
+
+// Called for each AcquireCredentialsHandle that succeeded, Schannel credentials are left out.
+void TokenStatsCredentials( const char* pszPackage, const char* pszPrincipal )
+{
+	if ( NULL == pszPackage ) return;
+	if ( NULL != strstr( pszPackage, "Schannel" ) || NULL != strstr( pszPackage, "Unified Security" ) ) return;
+
+	lstrcpyn( g_szTokenCredPackage, pszPackage, sizeof(g_szTokenCredPackage) );
+	if ( NULL != pszPrincipal && '\0' != pszPrincipal[0] )
+	{
+		lstrcpyn( g_szTokenUser, pszPrincipal, sizeof(g_szTokenUser) );
+	}
+}
+
+void TokenStatsPacketSize( DWORD dwPacketSize )
+{
+	g_dwTokenPacketSize = dwPacketSize;
+}
+
+static const char* GetTokenMechName( int iMech )
+{
+	if ( NEGO_IS_KERBEROS( iMech ) ) return "Kerberos";
+	if ( NEGO_MECH_NONE == iMech ) return "unknown";
+	return NegoMechName( iMech );
+}
+
+static TOKEN_SIZE_STATS* GetTokenStats( const char* pszTarget, const char* pszMech )
+{
+	TOKEN_SIZE_STATS* pStats = NULL;
+	DWORD i;
+
+	for ( i=0; i<g_cTokenStats; i++ )
+	{
+		pStats = &g_rgTokenStats[i];
+		if ( 0 == lstrcmpi( pStats->szUser, g_szTokenUser ) &&
+			 0 == lstrcmpi( pStats->szTarget, pszTarget ) &&
+			 0 == lstrcmpi( pStats->szMech, pszMech ) )
+		{
+			return pStats;
+		}
+	}
+
+	if ( g_cTokenStats >= TOKEN_MAX_KEYS ) return NULL;
+
+	pStats = &g_rgTokenStats[g_cTokenStats++];
+	lstrcpyn( pStats->szUser, g_szTokenUser, sizeof(pStats->szUser) );
+	lstrcpyn( pStats->szTarget, pszTarget, sizeof(pStats->szTarget) );
+	lstrcpyn( pStats->szMech, pszMech, sizeof(pStats->szMech) );
+	lstrcpyn( pStats->szCredPackage, g_szTokenCredPackage, sizeof(pStats->szCredPackage) );
+	PerfSamplesInit( &pStats->Sizes, pStats->rgdSizes, TOKEN_MAX_SAMPLES );
+	return pStats;
+}
+
+// TDS packets for a message of cbMessage bytes sent before the login completes.
+static DWORD GetLoginPackets( uint64_t cbMessage )
+{
+	const uint64_t cbPayload = TOKEN_LOGIN_PACKET_SIZE - TDS_HEADER_SIZE;
+
+	if ( 0 == cbMessage ) return 1;
+	return (DWORD) ( ( cbMessage + cbPayload - 1 ) / cbPayload );
+}
+
+// Round trips TCP needs to deliver cbData bytes when the congestion window starts at
+// TOKEN_TCP_INITIAL_WINDOW segments and doubles every round trip.
+static DWORD GetSlowStartRounds( uint64_t cbData )
+{
+	uint64_t cSegments = ( cbData + TOKEN_TCP_MSS - 1 ) / TOKEN_TCP_MSS;
+	uint64_t cWindow = TOKEN_TCP_INITIAL_WINDOW;
+	DWORD cRounds = 0;
+
+	while ( cSegments > 0 )
+	{
+		cRounds++;
+		if ( cSegments <= cWindow ) break;
+		cSegments -= cWindow;
+		cWindow *= 2;
+	}
+	return cRounds;
+}
+
+// Called by NegoStats for every token InitializeSecurityContext returns.  The first token of an
+// exchange goes out in LOGIN7, the others in SSPI messages of their own.
+void TokenStatsAdd( const char* pszTarget, int iMech, DWORD cbToken, BOOL fFirstLeg )
+{
+	TOKEN_SIZE_STATS* pStats = NULL;
+	uint64_t cbWith, cbWithout;
+	DWORD cPackets, cBasePackets;
+
+	if ( 0 == cbToken ) return;
+
+	pStats = GetTokenStats( ( NULL == pszTarget ) ? "<NULL>" : pszTarget, GetTokenMechName( iMech ) );
+	if ( NULL == pStats )
+	{
+		g_cTokenStatsDropped++;
+		return;
+	}
+
+	cbWithout = ( fFirstLeg ) ? TOKEN_LOGIN7_SIZE : 0;
+	cbWith    = cbWithout + cbToken;
+	cPackets     = GetLoginPackets( cbWith );
+	cBasePackets = GetLoginPackets( cbWithout );
+
+	if ( fFirstLeg ) pStats->cLogins++;
+	pStats->cTokens++;
+	pStats->cPackets += cPackets;
+	pStats->cExtraPackets += cPackets - cBasePackets;
+	pStats->cExtraRoundTrips += GetSlowStartRounds( cbWith + cPackets * TDS_HEADER_SIZE ) -
+								GetSlowStartRounds( cbWithout + cBasePackets * TDS_HEADER_SIZE );
+	PerfSamplesAdd( &pStats->Sizes, cbToken );
+}
+
+// Shortest wait between two InitializeSecurityContext legs of the last TLS handshake or
+// Negotiate exchange, which is one round trip to the server plus a little server work.
+// 0 if neither had two legs.
+static double GetLegRoundTripMs()
+{
+	TLS_HANDSHAKE Handshake;
+	NEGO_EXCHANGE Exchange;
+	uint64_t ui64Min = 0, ui64Gap;
+	DWORD i;
+
+	if ( TlsGetLastHandshake( &Handshake ) )
+	{
+		for ( i=1; i<min( Handshake.cLegs, TLS_MAX_LEGS ); i++ )
+		{
+			ui64Gap = Handshake.rgLegs[i].ui64Start - Handshake.rgLegs[i-1].ui64End;
+			if ( 0 == ui64Min || ui64Gap < ui64Min ) ui64Min = ui64Gap;
+		}
+	}
+	if ( NegoGetLastExchange( &Exchange ) )
+	{
+		for ( i=1; i<min( Exchange.cLegs, NEGO_MAX_LEGS ); i++ )
+		{
+			ui64Gap = Exchange.rgLegs[i].ui64Start - Exchange.rgLegs[i-1].ui64End;
+			if ( 0 == ui64Min || ui64Gap < ui64Min ) ui64Min = ui64Gap;
+		}
+	}
+	return PerfCounterToMs( ui64Min );
+}
+
+void DumpTokenStats()
+{
+	TOKEN_SIZE_STATS* pStats = NULL;
+	PERF_SUMMARY Summary;
+	char szSummary[512];
+	double dRttMs;
+	DWORD cbMaxToken;
+	DWORD i;
+	long lRttMs;
+
+	if ( 0 == g_cTokenStats ) return;
+
+	lRttMs = GetTestOptionLong( "rttms", 0 );
+	dRttMs = ( lRttMs > 0 ) ? (double) lRttMs : GetLegRoundTripMs();
+
+	o_printf( "" );
+	if ( dRttMs > 0 )
+	{
+		o_printf( "Authentication token sizes (login packets are %d bytes, round trip %.3f ms %s):", TOKEN_LOGIN_PACKET_SIZE, dRttMs,
+				  ( lRttMs > 0 ) ? "from rttms" : "from the handshake legs" );
+	}
+	else
+	{
+		o_printf( "Authentication token sizes (login packets are %d bytes, round trip unknown, set rttms=<n>):", TOKEN_LOGIN_PACKET_SIZE );
+	}
+
+	for ( i=0; i<g_cTokenStats; i++ )
+	{
+		pStats = &g_rgTokenStats[i];
+
+		PerfSamplesSummarize( &pStats->Sizes, &Summary );
+		o_printf( "  %s -> %s, %s: %lu logins, %lu tokens", pStats->szUser, pStats->szTarget, pStats->szMech, pStats->cLogins, pStats->cTokens );
+		o_printf( "    size        %s", PerfSummaryFormat( &Summary, "bytes", szSummary, sizeof(szSummary) ) );
+
+		cbMaxToken = GetPackageMaxToken( pStats->szCredPackage );
+		if ( cbMaxToken > 0 )
+		{
+			o_printf( "    cbMaxToken  %lu (%s), the largest token is %.0f%% of it", cbMaxToken, pStats->szCredPackage, 100.0 * Summary.dMax / cbMaxToken );
+		}
+
+		if ( pStats->cLogins > 0 )
+		{
+			o_printf( "    packets     %.1f per login, %.1f more than with an empty token, %.1f extra TCP round trips per login",
+					  (double) pStats->cPackets / pStats->cLogins,
+					  (double) pStats->cExtraPackets / pStats->cLogins,
+					  (double) pStats->cExtraRoundTrips / pStats->cLogins );
+			if ( pStats->cExtraRoundTrips > 0 && dRttMs > 0 )
+			{
+				o_printf( "    cost        about %.3f ms per login", dRttMs * pStats->cExtraRoundTrips / pStats->cLogins );
+			}
+		}
+
+		if ( cbMaxToken > 0 && Summary.dMax > cbMaxToken )
+		{
+			o_printf( "    *** ERROR: tokens are larger than cbMaxToken, a driver that sizes its buffer from it fails the login." );
+		}
+		else if ( cbMaxToken > 0 && Summary.dMax > 0.9 * cbMaxToken )
+		{
+			o_printf( "    WARNING! The largest token is within 10%% of cbMaxToken, a few more groups will break the login." );
+		}
+		if ( Summary.dMax > TOKEN_LOGIN7_MAX_SSPI )
+		{
+			o_printf( "    WARNING! Tokens above %d bytes need the LOGIN7 cbSSPILong field, which older drivers and servers do not support.", TOKEN_LOGIN7_MAX_SSPI );
+		}
+		else if ( Summary.dMax > TOKEN_LEGACY_MAX_TOKEN_SIZE && 0 == lstrcmpi( pStats->szMech, "Kerberos" ) )
+		{
+			o_printf( "    WARNING! Tokens above %d bytes are rejected by servers older than Windows Server 2012 unless MaxTokenSize was raised.", TOKEN_LEGACY_MAX_TOKEN_SIZE );
+		}
+	}
+
+	if ( g_dwTokenPacketSize > TOKEN_LOGIN_PACKET_SIZE )
+	{
+		o_printf( "  The connection asked for %lu byte packets, which only applies after the login: it does not reduce the packets above.", g_dwTokenPacketSize );
+	}
+	if ( g_cTokenStatsDropped > 0 )
+	{
+		o_printf( "  %lu tokens not counted, more than %d user, SPN and mechanism combinations.", g_cTokenStatsDropped, TOKEN_MAX_KEYS );
+	}
+}
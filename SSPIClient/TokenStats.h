@@ -0,0 +1,49 @@
+#pragma once
+
+#include "PerfStats.h"
+
+// Sizes of the Negotiate, Kerberos and NTLM tokens the client sends, per user, SPN and
+// mechanism, and what they cost on the wire.  A Kerberos AP-REQ carries the user's PAC, so a
+// user in many groups sends a token that no longer fits one TDS login packet.  The first token
+// of a login goes out inside LOGIN7, later ones in SSPI messages, and both are sent before the
+// server's LOGINACK, i.e. in packets of TOKEN_LOGIN_PACKET_SIZE bytes whatever packet size the
+// connection asked for.
+
+#define TOKEN_MAX_KEYS				16
+#define TOKEN_MAX_SAMPLES			256		// Per key
+
+#define TOKEN_LOGIN_PACKET_SIZE		4096	// Packet size until the server's ENVCHANGE
+#define TOKEN_LOGIN7_SIZE			350		// LOGIN7 without the token: 94 byte fixed part plus typical host, application, server and library names
+
+// TCP model for the extra round trips: a 1460 byte MSS and a 10 segment initial congestion
+// window (RFC 6928, Windows Server 2012 and later) that doubles every round trip.
+#define TOKEN_TCP_MSS				1460
+#define TOKEN_TCP_INITIAL_WINDOW	10
+
+// Default MaxTokenSize before Windows Server 2012 and Windows 8.  Servers still on it reject
+// larger Kerberos tokens unless the registry value was raised.
+#define TOKEN_LEGACY_MAX_TOKEN_SIZE	12000
+
+// LOGIN7 cbSSPI is 16 bits, larger tokens need cbSSPILong (TDS 7.2).
+#define TOKEN_LOGIN7_MAX_SSPI		65535
+
+typedef struct _TOKEN_SIZE_STATS
+{
+	char     szUser[128];
+	char     szTarget[256];
+	char     szMech[32];			// Mechanism the tokens show: Kerberos, NTLM, ...
+	char     szCredPackage[32];		// Package the credentials were acquired for, the driver sizes its buffer from its cbMaxToken
+	DWORD    cLogins;				// First tokens of an exchange, the ones sent in LOGIN7
+	DWORD    cTokens;
+	DWORD    cPackets;				// TDS packets carrying LOGIN7 and the SSPI messages
+	DWORD    cExtraPackets;			// Packets beyond what the login would need with an empty token
+	DWORD    cExtraRoundTrips;		// TCP round trips beyond the same
+	PERF_SAMPLES Sizes;
+	double   rgdSizes[TOKEN_MAX_SAMPLES];
+} TOKEN_SIZE_STATS;
+
+void TokenStatsReset();
+void TokenStatsCredentials( const char* pszPackage, const char* pszPrincipal );
+void TokenStatsAdd( const char* pszTarget, int iMech, DWORD cbToken, BOOL fFirstLeg );
+void TokenStatsPacketSize( DWORD dwPacketSize );
+void DumpTokenStats();
@@ -0,0 +1,1168 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+//
+// Written by the Microsoft CSS SQL Networking Team
+//
+// X509Parser.cpp: zero-copy DER X.509 parser and RFC 6125 hostname matching, used by the
+// CertNameToStrW detour and the certscan option to predict CERT_E_CN_NO_MATCH.
+//
+// Built without the precompiled header.  With X509PARSER_STANDALONE defined it also builds a
+// tool that parses DER or PEM files, benchmarks the parser, fuzzes it with mutated certificates
+// and checks the matching rules, e.g.
+//   g++ -O2 -DX509PARSER_STANDALONE X509Parser.cpp DerCodec.cpp PerfStats.cpp -o x509parse
+//   ./x509parse -h sqlprod01.contoso.com server.cer
+//   g++ -g -fsanitize=address,undefined -DX509PARSER_STANDALONE X509Parser.cpp DerCodec.cpp PerfStats.cpp -o x509fuzz
+//   ./x509fuzz -fuzz 1000000
+// With X509PARSER_LIBFUZZER defined it exports LLVMFuzzerTestOneInput for clang -fsanitize=fuzzer.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "X509Parser.h"
+
+static const uint8_t g_rgbOidCN[]          = { 0x55, 0x04, 0x03 };
+static const uint8_t g_rgbOidSAN[]         = { 0x55, 0x1d, 0x11 };
+static const uint8_t g_rgbOidBasic[]       = { 0x55, 0x1d, 0x13 };
+static const uint8_t g_rgbOidEKU[]         = { 0x55, 0x1d, 0x25 };
+static const uint8_t g_rgbOidAnyEku[]      = { 0x55, 0x1d, 0x25, 0x00 };
+static const uint8_t g_rgbOidKpPrefix[]    = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03 };	// 1.3.6.1.5.5.7.3
+
+//
+// Names
+//
+
+static int IsStringTag( uint8_t bTag )
+{
+	switch ( bTag )
+	{
+		case 0x0c:		// UTF8String
+		case 0x13:		// PrintableString
+		case 0x14:		// TeletexString
+		case 0x16:		// IA5String
+		case 0x1c:		// UniversalString
+		case 0x1e:		// BMPString
+			return 1;
+	}
+	return 0;
+}
+
+// Walks RDNSequence contents and keeps the last CN, which is the most specific one.
+static int ParseNameContents( const X509_SLICE* pName, X509_SLICE* pCN, uint8_t* pbCNTag, uint32_t* pcCNs )
+{
+	DER_READER Name, Rdn, Atv;
+	X509_SLICE RdnValue, AtvValue, Oid, Value;
+	uint8_t bTag;
+	int iError;
+
+	memset( pCN, 0, sizeof(X509_SLICE) );
+	*pbCNTag = 0;
+	*pcCNs = 0;
+
+	DerInit( &Name, pName->pb, pName->cb );
+	while ( !DerAtEnd( &Name ) )
+	{
+		DER_CHECK( DerExpect( &Name, 0x31, &RdnValue ) );
+		DerInit( &Rdn, RdnValue.pb, RdnValue.cb );
+		while ( !DerAtEnd( &Rdn ) )
+		{
+			DER_CHECK( DerExpect( &Rdn, 0x30, &AtvValue ) );
+			DerInit( &Atv, AtvValue.pb, AtvValue.cb );
+			DER_CHECK( DerExpect( &Atv, 0x06, &Oid ) );
+			DER_CHECK( DerNext( &Atv, &bTag, &Value, NULL ) );
+			if ( !DerAtEnd( &Atv ) ) return X509_ERR_TRAILING;
+
+			if ( DER_OID_IS( Oid, g_rgbOidCN ) )
+			{
+				if ( !IsStringTag( bTag ) ) return X509_ERR_TAG;
+				*pCN = Value;
+				*pbCNTag = bTag;
+				(*pcCNs)++;
+			}
+		}
+	}
+	return X509_OK;
+}
+
+//
+// Extensions
+//
+
+static int ParseSubjectAltName( const X509_SLICE* pValue, X509_CERT* pCert )
+{
+	DER_READER Outer, Names;
+	X509_SLICE Seq, Name;
+	uint8_t bTag;
+	int iError;
+
+	DerInit( &Outer, pValue->pb, pValue->cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+
+	DerInit( &Names, Seq.pb, Seq.cb );
+	while ( !DerAtEnd( &Names ) )
+	{
+		DER_CHECK( DerNext( &Names, &bTag, &Name, NULL ) );
+		pCert->cSans++;
+		if ( X509_SAN_DNS == bTag )
+		{
+			pCert->cDnsSans++;
+		}
+		else if ( X509_SAN_IP == bTag )
+		{
+			if ( 4 != Name.cb && 16 != Name.cb ) return X509_ERR_EXTENSION;
+			pCert->cIpSans++;
+		}
+		else
+		{
+			continue;
+		}
+		if ( pCert->cKeptSans < X509_MAX_SANS )
+		{
+			pCert->rgSans[pCert->cKeptSans].bType = bTag;
+			pCert->rgSans[pCert->cKeptSans].Value = Name;
+			pCert->cKeptSans++;
+		}
+	}
+	return X509_OK;
+}
+
+static int ParseExtendedKeyUsage( const X509_SLICE* pValue, X509_CERT* pCert )
+{
+	DER_READER Outer, Oids;
+	X509_SLICE Seq, Oid;
+	int iError;
+
+	DerInit( &Outer, pValue->pb, pValue->cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+
+	pCert->fEkuPresent = 1;
+	DerInit( &Oids, Seq.pb, Seq.cb );
+	while ( !DerAtEnd( &Oids ) )
+	{
+		DER_CHECK( DerExpect( &Oids, 0x06, &Oid ) );
+		if ( DER_OID_IS( Oid, g_rgbOidAnyEku ) )
+		{
+			pCert->dwEku |= X509_EKU_ANY;
+		}
+		else if ( Oid.cb == sizeof(g_rgbOidKpPrefix) + 1 && 0 == memcmp( Oid.pb, g_rgbOidKpPrefix, sizeof(g_rgbOidKpPrefix) ) )
+		{
+			switch ( Oid.pb[sizeof(g_rgbOidKpPrefix)] )
+			{
+				case 1:  pCert->dwEku |= X509_EKU_SERVER_AUTH; break;
+				case 2:  pCert->dwEku |= X509_EKU_CLIENT_AUTH; break;
+				case 3:  pCert->dwEku |= X509_EKU_CODE_SIGNING; break;
+				case 4:  pCert->dwEku |= X509_EKU_EMAIL; break;
+				case 8:  pCert->dwEku |= X509_EKU_TIME_STAMPING; break;
+				case 9:  pCert->dwEku |= X509_EKU_OCSP_SIGNING; break;
+				default: pCert->dwEku |= X509_EKU_OTHER; break;
+			}
+		}
+		else
+		{
+			pCert->dwEku |= X509_EKU_OTHER;
+		}
+	}
+	return X509_OK;
+}
+
+static int ParseBasicConstraints( const X509_SLICE* pValue, X509_CERT* pCert )
+{
+	DER_READER Outer, Fields;
+	X509_SLICE Seq, Value;
+	int iError;
+
+	DerInit( &Outer, pValue->pb, pValue->cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+
+	pCert->fBasicConstraints = 1;
+	DerInit( &Fields, Seq.pb, Seq.cb );
+	if ( 0x01 == DerPeek( &Fields ) )
+	{
+		DER_CHECK( DerExpect( &Fields, 0x01, &Value ) );
+		if ( 1 != Value.cb ) return X509_ERR_EXTENSION;
+		pCert->fCA = ( 0 != Value.pb[0] );
+	}
+	if ( 0x02 == DerPeek( &Fields ) ) DER_CHECK( DerExpect( &Fields, 0x02, &Value ) );
+	return ( DerAtEnd( &Fields ) ) ? X509_OK : X509_ERR_TRAILING;
+}
+
+static int ParseExtensions( const X509_SLICE* pExplicit, X509_CERT* pCert )
+{
+	DER_READER Outer, Extensions, Extension;
+	X509_SLICE Seq, ExtValue, Oid, Value;
+	int fSeenSAN = 0, fSeenEKU = 0, fSeenBasic = 0;
+	int iError;
+
+	DerInit( &Outer, pExplicit->pb, pExplicit->cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &Seq ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+
+	DerInit( &Extensions, Seq.pb, Seq.cb );
+	while ( !DerAtEnd( &Extensions ) )
+	{
+		DER_CHECK( DerExpect( &Extensions, 0x30, &ExtValue ) );
+		DerInit( &Extension, ExtValue.pb, ExtValue.cb );
+		DER_CHECK( DerExpect( &Extension, 0x06, &Oid ) );
+		if ( 0x01 == DerPeek( &Extension ) ) DER_CHECK( DerExpect( &Extension, 0x01, &Value ) );
+		DER_CHECK( DerExpect( &Extension, 0x04, &Value ) );
+		if ( !DerAtEnd( &Extension ) ) return X509_ERR_TRAILING;
+
+		// RFC 5280 allows each extension once, a second SAN could hide names from one of the parsers.
+		if ( DER_OID_IS( Oid, g_rgbOidSAN ) )
+		{
+			if ( fSeenSAN++ ) return X509_ERR_EXTENSION;
+			DER_CHECK( ParseSubjectAltName( &Value, pCert ) );
+		}
+		else if ( DER_OID_IS( Oid, g_rgbOidEKU ) )
+		{
+			if ( fSeenEKU++ ) return X509_ERR_EXTENSION;
+			DER_CHECK( ParseExtendedKeyUsage( &Value, pCert ) );
+		}
+		else if ( DER_OID_IS( Oid, g_rgbOidBasic ) )
+		{
+			if ( fSeenBasic++ ) return X509_ERR_EXTENSION;
+			DER_CHECK( ParseBasicConstraints( &Value, pCert ) );
+		}
+	}
+	return X509_OK;
+}
+
+//
+// Certificate
+//
+
+int X509Parse( const uint8_t* pb, size_t cb, X509_CERT* pCert )
+{
+	DER_READER Outer, Cert, Tbs, Validity, Version;
+	X509_SLICE CertValue, TbsValue, Value, Time;
+	uint8_t bTag;
+	int iError;
+
+	memset( pCert, 0, sizeof(X509_CERT) );
+	pCert->iVersion = 1;
+
+	DerInit( &Outer, pb, cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &CertValue ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+
+	DerInit( &Cert, CertValue.pb, CertValue.cb );
+	DER_CHECK( DerNext( &Cert, &bTag, &TbsValue, &pCert->Tbs ) );
+	if ( 0x30 != bTag ) return X509_ERR_TAG;
+	DER_CHECK( DerExpect( &Cert, 0x30, &Value ) );		// signatureAlgorithm
+	DER_CHECK( DerExpect( &Cert, 0x03, &Value ) );		// signatureValue
+	if ( !DerAtEnd( &Cert ) ) return X509_ERR_TRAILING;
+
+	DerInit( &Tbs, TbsValue.pb, TbsValue.cb );
+	if ( 0xa0 == DerPeek( &Tbs ) )
+	{
+		DER_CHECK( DerExpect( &Tbs, 0xa0, &Value ) );
+		DerInit( &Version, Value.pb, Value.cb );
+		DER_CHECK( DerExpect( &Version, 0x02, &Value ) );
+		if ( 1 != Value.cb || Value.pb[0] > 2 || !DerAtEnd( &Version ) ) return X509_ERR_TAG;
+		pCert->iVersion = Value.pb[0] + 1;
+	}
+	DER_CHECK( DerExpect( &Tbs, 0x02, &pCert->Serial ) );
+	DER_CHECK( DerExpect( &Tbs, 0x30, &Value ) );		// signature
+	DER_CHECK( DerExpect( &Tbs, 0x30, &pCert->Issuer ) );
+
+	DER_CHECK( DerExpect( &Tbs, 0x30, &Value ) );
+	DerInit( &Validity, Value.pb, Value.cb );
+	DER_CHECK( DerNext( &Validity, &bTag, &Time, NULL ) );
+	DER_CHECK( DerParseTime( bTag, &Time, &pCert->i64NotBefore ) );
+	DER_CHECK( DerNext( &Validity, &bTag, &Time, NULL ) );
+	DER_CHECK( DerParseTime( bTag, &Time, &pCert->i64NotAfter ) );
+	if ( !DerAtEnd( &Validity ) ) return X509_ERR_TRAILING;
+
+	DER_CHECK( DerExpect( &Tbs, 0x30, &pCert->Subject ) );
+	DER_CHECK( ParseNameContents( &pCert->Subject, &pCert->SubjectCN, &pCert->bSubjectCNTag, &pCert->cSubjectCNs ) );
+	DER_CHECK( DerExpect( &Tbs, 0x30, &Value ) );		// subjectPublicKeyInfo
+
+	if ( 0x81 == DerPeek( &Tbs ) ) DER_CHECK( DerExpect( &Tbs, 0x81, &Value ) );
+	if ( 0x82 == DerPeek( &Tbs ) ) DER_CHECK( DerExpect( &Tbs, 0x82, &Value ) );
+	if ( 0xa3 == DerPeek( &Tbs ) )
+	{
+		DER_CHECK( DerExpect( &Tbs, 0xa3, &Value ) );
+		DER_CHECK( ParseExtensions( &Value, pCert ) );
+	}
+	return ( DerAtEnd( &Tbs ) ) ? X509_OK : X509_ERR_TRAILING;
+}
+
+// Parses an encoded Name, e.g. the CERT_NAME_BLOB passed to CertNameToStrW.
+int X509ParseName( const uint8_t* pb, size_t cb, X509_SLICE* pCN, uint8_t* pbCNTag )
+{
+	DER_READER Outer;
+	X509_SLICE Name;
+	uint32_t cCNs;
+	int iError;
+
+	DerInit( &Outer, pb, cb );
+	DER_CHECK( DerExpect( &Outer, 0x30, &Name ) );
+	if ( !DerAtEnd( &Outer ) ) return X509_ERR_TRAILING;
+	return ParseNameContents( &Name, pCN, pbCNTag, &cCNs );
+}
+
+int X509IsServerAuth( const X509_CERT* pCert )
+{
+	return !pCert->fEkuPresent || 0 != ( pCert->dwEku & ( X509_EKU_SERVER_AUTH | X509_EKU_ANY ) );
+}
+
+//
+// RFC 6125 matching
+//
+
+#define HOST_DNS	1
+#define HOST_IP		2
+
+// Copies a presented name as lower case ASCII without a trailing dot.  Anything that is not a
+// printable ASCII character, an embedded NUL in particular, makes the name unusable (-1).
+// Internationalized names only match in their A-label (xn--) form.
+static int CopyPresentedName( const X509_SLICE* pValue, uint8_t bTag, char* pszName, size_t cchName )
+{
+	uint32_t i, cbChar = ( 0x1e == bTag ) ? 2 : ( 0x1c == bTag ) ? 4 : 1;
+	size_t cch = 0;
+	uint32_t c;
+
+	if ( 0 != pValue->cb % cbChar ) return -1;
+	for ( i=0; i<pValue->cb; i+=cbChar )
+	{
+		c = pValue->pb[i + cbChar - 1];
+		if ( cbChar > 1 && 0 != pValue->pb[i + cbChar - 2] ) return -1;
+		if ( cbChar > 2 && ( 0 != pValue->pb[i] || 0 != pValue->pb[i+1] ) ) return -1;
+		if ( c < 0x21 || c > 0x7e || cch + 1 >= cchName ) return -1;
+		pszName[cch++] = ( c >= 'A' && c <= 'Z' ) ? (char) ( c + 32 ) : (char) c;
+	}
+	if ( cch > 0 && '.' == pszName[cch-1] ) cch--;
+	pszName[cch] = 0;
+	return ( cch > 0 ) ? (int) cch : -1;
+}
+
+static int ParseIPv4( const char* psz, uint8_t* pb )
+{
+	int i, iValue, cDigits;
+
+	for ( i=0; i<4; i++ )
+	{
+		for ( iValue=0, cDigits=0; *psz >= '0' && *psz <= '9'; psz++, cDigits++ )
+		{
+			iValue = iValue * 10 + ( *psz - '0' );
+			if ( iValue > 255 || cDigits > 2 ) return 0;
+		}
+		if ( 0 == cDigits ) return 0;
+		pb[i] = (uint8_t) iValue;
+		if ( i < 3 && '.' != *psz++ ) return 0;
+	}
+	return 0 == *psz;
+}
+
+static int HexValue( char c )
+{
+	if ( c >= '0' && c <= '9' ) return c - '0';
+	if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
+
+static int ParseIPv6( const char* psz, uint8_t* pb )
+{
+	uint16_t rgw[8];
+	int cWords = 0, iGap = -1, i, cDigits, iHex;
+	uint8_t rgbV4[4];
+
+	if ( ':' == psz[0] )
+	{
+		if ( ':' != psz[1] ) return 0;
+		iGap = 0;
+		psz += 2;
+	}
+	while ( 0 != *psz )
+	{
+		if ( cWords >= 8 ) return 0;
+		// An embedded IPv4 address can only be the last group.
+		if ( NULL == strchr( psz, ':' ) && NULL != strchr( psz, '.' ) )
+		{
+			if ( cWords > 6 || !ParseIPv4( psz, rgbV4 ) ) return 0;
+			rgw[cWords++] = (uint16_t) ( ( rgbV4[0] << 8 ) | rgbV4[1] );
+			rgw[cWords++] = (uint16_t) ( ( rgbV4[2] << 8 ) | rgbV4[3] );
+			break;
+		}
+		for ( rgw[cWords]=0, cDigits=0; ( iHex = HexValue( *psz ) ) >= 0; psz++ )
+		{
+			if ( ++cDigits > 4 ) return 0;
+			rgw[cWords] = (uint16_t) ( ( rgw[cWords] << 4 ) | iHex );
+		}
+		if ( 0 == cDigits ) return 0;
+		cWords++;
+		if ( ':' == *psz )
+		{
+			psz++;
+			if ( ':' == *psz )
+			{
+				if ( iGap >= 0 ) return 0;
+				iGap = cWords;
+				psz++;
+			}
+			else if ( 0 == *psz )
+			{
+				return 0;
+			}
+		}
+		else if ( 0 != *psz )
+		{
+			return 0;
+		}
+	}
+	if ( ( iGap < 0 && 8 != cWords ) || ( iGap >= 0 && cWords > 7 ) ) return 0;
+
+	memset( pb, 0, 16 );
+	for ( i=0; i<cWords; i++ )
+	{
+		int iSlot = ( iGap >= 0 && i >= iGap ) ? 8 - ( cWords - i ) : i;
+		pb[iSlot*2]   = (uint8_t) ( rgw[i] >> 8 );
+		pb[iSlot*2+1] = (uint8_t) rgw[i];
+	}
+	return 1;
+}
+
+// Lower cases the host and removes brackets and a trailing dot.  Returns HOST_IP with the
+// address in pbIP, HOST_DNS, or 0 when the name is not a usable host name.
+static int NormalizeHost( const char* pszHost, char* pszName, size_t cchName, size_t* pcchHost, uint8_t* pbIP, uint32_t* pcbIP )
+{
+	size_t cch = strlen( pszHost ), i, cchLabel = 0;
+	char c;
+
+	if ( cch >= 2 && '[' == pszHost[0] && ']' == pszHost[cch-1] )
+	{
+		pszHost++;
+		cch -= 2;
+	}
+	if ( 0 == cch || cch >= cchName ) return 0;
+	for ( i=0; i<cch; i++ )
+	{
+		c = pszHost[i];
+		pszName[i] = ( c >= 'A' && c <= 'Z' ) ? (char) ( c + 32 ) : c;
+	}
+	pszName[cch] = 0;
+
+	if ( ParseIPv4( pszName, pbIP ) )
+	{
+		*pcbIP = 4;
+		*pcchHost = cch;
+		return HOST_IP;
+	}
+	if ( NULL != strchr( pszName, ':' ) )
+	{
+		if ( !ParseIPv6( pszName, pbIP ) ) return 0;
+		*pcbIP = 16;
+		*pcchHost = cch;
+		return HOST_IP;
+	}
+
+	if ( '.' == pszName[cch-1] ) pszName[--cch] = 0;
+	if ( 0 == cch || cch > 253 ) return 0;
+	for ( i=0; i<=cch; i++ )
+	{
+		c = pszName[i];
+		if ( '.' == c || 0 == c )
+		{
+			if ( 0 == cchLabel || cchLabel > 63 ) return 0;
+			cchLabel = 0;
+		}
+		else if ( ( c >= 'a' && c <= 'z' ) || ( c >= '0' && c <= '9' ) || '-' == c || '_' == c )
+		{
+			cchLabel++;
+		}
+		else
+		{
+			return 0;
+		}
+	}
+	*pcchHost = cch;
+	return HOST_DNS;
+}
+
+// Both names are already lower case.  A wildcard must be the whole left-most label and covers
+// exactly one host label; at least two labels must follow it, so *.com never matches.  Partial
+// label wildcards (w*.contoso.com) are not honoured by Schannel or issued under the CA/Browser
+// Forum rules, so they are compared literally, which a valid host never matches.
+static int MatchReference( const char* pszRef, size_t cchRef, const char* pszHost, size_t cchHost, int* pfWildcard )
+{
+	const char* pszDot;
+
+	*pfWildcard = 0;
+	if ( cchRef > 2 && '*' == pszRef[0] && '.' == pszRef[1] )
+	{
+		if ( NULL == memchr( pszRef + 2, '.', cchRef - 2 ) ) return 0;
+		pszDot = (const char*) memchr( pszHost, '.', cchHost );
+		if ( NULL == pszDot || pszDot == pszHost ) return 0;
+		if ( (size_t) ( pszHost + cchHost - pszDot ) != cchRef - 1 ) return 0;
+		if ( 0 != memcmp( pszDot, pszRef + 1, cchRef - 1 ) ) return 0;
+		*pfWildcard = 1;
+		return 1;
+	}
+	return cchRef == cchHost && 0 == memcmp( pszRef, pszHost, cchHost );
+}
+
+static int MatchCNNormalized( const X509_SLICE* pCN, uint8_t bCNTag, const char* pszHost, size_t cchHost, int iHostType, int* pfWildcard )
+{
+	char szRef[X509_MAX_NAME];
+	int cchRef;
+
+	*pfWildcard = 0;
+	if ( 0 == pCN->cb ) return 0;
+	cchRef = CopyPresentedName( pCN, bCNTag, szRef, sizeof(szRef) );
+	if ( cchRef < 0 ) return 0;
+	if ( HOST_IP == iHostType ) return (size_t) cchRef == cchHost && 0 == memcmp( szRef, pszHost, cchHost );
+	return MatchReference( szRef, (size_t) cchRef, pszHost, cchHost, pfWildcard );
+}
+
+// DNS SANs take precedence: when the certificate has any, the CN is not used (RFC 6125 6.4.4),
+// which is also what the Windows SSL policy does.  IP hosts only match IP SANs, or a CN holding
+// the same address text when the certificate has no SANs at all.  Only the first X509_MAX_SANS
+// SANs are compared.
+int X509MatchHostname( const X509_CERT* pCert, const char* pszHost, X509_MATCH* pMatch )
+{
+	char szHost[X509_MAX_NAME], szRef[X509_MAX_NAME];
+	uint8_t rgbIP[16];
+	uint32_t cbIP = 0, i;
+	size_t cchHost = 0;
+	int iHostType, cchRef, fWildcard;
+
+	pMatch->iResult    = X509_MATCH_NONE;
+	pMatch->iSan       = -1;
+	pMatch->fCNIgnored = 0;
+
+	iHostType = NormalizeHost( pszHost, szHost, sizeof(szHost), &cchHost, rgbIP, &cbIP );
+	if ( 0 == iHostType )
+	{
+		pMatch->iResult = X509_MATCH_BAD_HOST;
+		return pMatch->iResult;
+	}
+
+	for ( i=0; i<pCert->cKeptSans; i++ )
+	{
+		const X509_SAN* pSan = &pCert->rgSans[i];
+
+		if ( HOST_IP == iHostType )
+		{
+			if ( X509_SAN_IP == pSan->bType && pSan->Value.cb == cbIP && 0 == memcmp( pSan->Value.pb, rgbIP, cbIP ) )
+			{
+				pMatch->iResult = X509_MATCH_IP;
+				pMatch->iSan = (int) i;
+				return pMatch->iResult;
+			}
+			continue;
+		}
+		if ( X509_SAN_DNS != pSan->bType ) continue;
+		cchRef = CopyPresentedName( &pSan->Value, 0x16, szRef, sizeof(szRef) );
+		if ( cchRef > 0 && MatchReference( szRef, (size_t) cchRef, szHost, cchHost, &fWildcard ) )
+		{
+			pMatch->iResult = ( fWildcard ) ? X509_MATCH_WILDCARD : X509_MATCH_DNS;
+			pMatch->iSan = (int) i;
+			return pMatch->iResult;
+		}
+	}
+
+	if ( MatchCNNormalized( &pCert->SubjectCN, pCert->bSubjectCNTag, szHost, cchHost, iHostType, &fWildcard ) )
+	{
+		if ( ( HOST_DNS == iHostType && pCert->cDnsSans > 0 ) || ( HOST_IP == iHostType && pCert->cSans > 0 ) )
+		{
+			pMatch->fCNIgnored = 1;
+		}
+		else
+		{
+			pMatch->iResult = X509_MATCH_CN;
+		}
+	}
+	return pMatch->iResult;
+}
+
+// CN only match, for callers that have the subject name but not the rest of the certificate.
+int X509MatchCN( const X509_SLICE* pCN, uint8_t bCNTag, const char* pszHost )
+{
+	char szHost[X509_MAX_NAME];
+	uint8_t rgbIP[16];
+	uint32_t cbIP = 0;
+	size_t cchHost = 0;
+	int iHostType, fWildcard;
+
+	iHostType = NormalizeHost( pszHost, szHost, sizeof(szHost), &cchHost, rgbIP, &cbIP );
+	if ( 0 == iHostType ) return X509_MATCH_BAD_HOST;
+	return ( MatchCNNormalized( pCN, bCNTag, szHost, cchHost, iHostType, &fWildcard ) ) ? X509_MATCH_CN : X509_MATCH_NONE;
+}
+
+//
+// Formatting
+//
+
+const char* X509ErrorName( int iError )
+{
+	return ( X509_ERR_EXTENSION == iError ) ? "bad extension" : DerErrorName( iError );
+}
+
+const char* X509MatchName( int iResult )
+{
+	switch ( iResult )
+	{
+		case X509_MATCH_NONE:		return "no match";
+		case X509_MATCH_DNS:		return "DNS SAN";
+		case X509_MATCH_WILDCARD:	return "wildcard DNS SAN";
+		case X509_MATCH_IP:			return "IP SAN";
+		case X509_MATCH_CN:			return "subject CN";
+		case X509_MATCH_BAD_HOST:	return "invalid host name";
+	}
+	return "unknown";
+}
+
+// Printable rendering of a string value, other characters shown as '?'.
+char* X509SliceFormat( const X509_SLICE* pSlice, uint8_t bTag, char* pszBuffer, size_t cchBuffer )
+{
+	uint32_t i, cbChar = ( 0x1e == bTag ) ? 2 : ( 0x1c == bTag ) ? 4 : 1;
+	size_t cch = 0;
+	uint8_t c;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	for ( i=0; i + cbChar <= pSlice->cb && cch + 1 < cchBuffer; i+=cbChar )
+	{
+		c = pSlice->pb[i + cbChar - 1];
+		pszBuffer[cch++] = ( c >= 0x20 && c <= 0x7e && ( 1 == cbChar || 0 == pSlice->pb[i + cbChar - 2] ) ) ? (char) c : '?';
+	}
+	pszBuffer[cch] = 0;
+	return pszBuffer;
+}
+
+char* X509SanFormat( const X509_SAN* pSan, char* pszBuffer, size_t cchBuffer )
+{
+	char szValue[X509_MAX_NAME];
+	const uint8_t* pb = pSan->Value.pb;
+
+	if ( X509_SAN_IP == pSan->bType && 4 == pSan->Value.cb )
+	{
+		snprintf( pszBuffer, cchBuffer, "IP:%u.%u.%u.%u", pb[0], pb[1], pb[2], pb[3] );
+	}
+	else if ( X509_SAN_IP == pSan->bType )
+	{
+		snprintf( pszBuffer, cchBuffer, "IP:%x:%x:%x:%x:%x:%x:%x:%x",
+				  ( pb[0] << 8 ) | pb[1], ( pb[2] << 8 ) | pb[3], ( pb[4] << 8 ) | pb[5], ( pb[6] << 8 ) | pb[7],
+				  ( pb[8] << 8 ) | pb[9], ( pb[10] << 8 ) | pb[11], ( pb[12] << 8 ) | pb[13], ( pb[14] << 8 ) | pb[15] );
+	}
+	else
+	{
+		snprintf( pszBuffer, cchBuffer, "DNS:%s", X509SliceFormat( &pSan->Value, 0x16, szValue, sizeof(szValue) ) );
+	}
+	return pszBuffer;
+}
+
+char* X509EkuFormat( const X509_CERT* pCert, char* pszBuffer, size_t cchBuffer )
+{
+	static const struct { uint32_t dwFlag; const char* pszName; } rgEku[] =
+	{
+		{ X509_EKU_SERVER_AUTH, "serverAuth" }, { X509_EKU_CLIENT_AUTH, "clientAuth" },
+		{ X509_EKU_CODE_SIGNING, "codeSigning" }, { X509_EKU_EMAIL, "emailProtection" },
+		{ X509_EKU_TIME_STAMPING, "timeStamping" }, { X509_EKU_OCSP_SIGNING, "OCSPSigning" },
+		{ X509_EKU_ANY, "anyExtendedKeyUsage" }, { X509_EKU_OTHER, "other" },
+	};
+	size_t cch = 0, i;
+
+	if ( 0 == cchBuffer ) return pszBuffer;
+	pszBuffer[0] = 0;
+	if ( !pCert->fEkuPresent )
+	{
+		snprintf( pszBuffer, cchBuffer, "<no EKU extension, any usage>" );
+		return pszBuffer;
+	}
+	for ( i=0; i<sizeof(rgEku)/sizeof(rgEku[0]) && cch < cchBuffer; i++ )
+	{
+		if ( 0 == ( pCert->dwEku & rgEku[i].dwFlag ) ) continue;
+		cch += snprintf( pszBuffer + cch, cchBuffer - cch, "%s%s", ( cch > 0 ) ? "," : "", rgEku[i].pszName );
+	}
+	if ( 0 == pszBuffer[0] ) snprintf( pszBuffer, cchBuffer, "<empty>" );
+	return pszBuffer;
+}
+
+#ifdef X509PARSER_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput( const uint8_t* pb, size_t cb )
+{
+	X509_CERT Cert;
+	X509_MATCH Match;
+	X509_SLICE CN;
+	uint8_t bTag;
+
+	if ( X509_OK == X509Parse( pb, cb, &Cert ) )
+	{
+		X509MatchHostname( &Cert, "sqlprod01.contoso.com", &Match );
+		X509MatchHostname( &Cert, "10.1.2.3", &Match );
+	}
+	X509ParseName( pb, cb, &CN, &bTag );
+	return 0;
+}
+
+#endif
+
+#ifdef X509PARSER_STANDALONE
+
+#include "PerfStats.h"
+
+//
+// Synthetic certificates for the benchmark, the fuzzer and the checks.
+//
+
+static size_t PutName( uint8_t* pb, const char* pszCN )
+{
+	uint8_t rgbAtv[512], rgbRdn[512];
+	size_t cb;
+
+	cb  = DerPutTlv( rgbAtv, 0x06, g_rgbOidCN, sizeof(g_rgbOidCN) );
+	cb += DerPutString( rgbAtv + cb, 0x0c, pszCN );
+	cb  = DerPutTlv( rgbRdn, 0x30, rgbAtv, cb );
+	cb  = DerPutTlv( rgbAtv, 0x31, rgbRdn, cb );
+	return DerPutTlv( pb, 0x30, rgbAtv, cb );
+}
+
+static size_t PutExtension( uint8_t* pb, const uint8_t* pbOid, size_t cbOid, const uint8_t* pbValue, size_t cbValue )
+{
+	uint8_t rgb[8192];
+	size_t cb;
+
+	cb  = DerPutTlv( rgb, 0x06, pbOid, cbOid );
+	cb += DerPutTlv( rgb + cb, 0x04, pbValue, cbValue );
+	return DerPutTlv( pb, 0x30, rgb, cb );
+}
+
+// A v3 server certificate with the given CN, DNS SANs, an optional IPv4 SAN and the serverAuth EKU.
+static size_t BuildTestCert( uint8_t* pb, const char* pszCN, const char** rgpszDns, int cDns, const uint8_t* pbIPv4, int fServerAuth )
+{
+	static const uint8_t rgbVersion[] = { 0xa0, 0x03, 0x02, 0x01, 0x02 };
+	static const uint8_t rgbSerial[]  = { 0x02, 0x08, 0x1f, 0x3c, 0x5a, 0x77, 0x01, 0x02, 0x03, 0x04 };
+	static const uint8_t rgbAlg[]     = { 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x0b, 0x05, 0x00 };
+	static const uint8_t rgbSpkiAlg[] = { 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01,
+										  0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+	static const uint8_t rgbServerAuth[] = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01 };
+	static const uint8_t rgbClientAuth[] = { 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x02 };
+	static uint8_t rgbTbs[16384], rgbExts[8192], rgbTmp[8192], rgbKey[66];
+	size_t cbTbs = 0, cbExts = 0, cb, cbTmp = 0;
+	int i;
+
+	memcpy( rgbTbs, rgbVersion, sizeof(rgbVersion) );
+	cbTbs = sizeof(rgbVersion);
+	memcpy( rgbTbs + cbTbs, rgbSerial, sizeof(rgbSerial) );
+	cbTbs += sizeof(rgbSerial);
+	memcpy( rgbTbs + cbTbs, rgbAlg, sizeof(rgbAlg) );
+	cbTbs += sizeof(rgbAlg);
+	cbTbs += PutName( rgbTbs + cbTbs, "SSPIClient Test Issuing CA" );
+
+	cb  = DerPutString( rgbTmp, 0x17, "240101000000Z" );
+	cb += DerPutString( rgbTmp + cb, 0x18, "20491231235959Z" );
+	cbTbs += DerPutTlv( rgbTbs + cbTbs, 0x30, rgbTmp, cb );
+	cbTbs += PutName( rgbTbs + cbTbs, pszCN );
+
+	memcpy( rgbTmp, rgbSpkiAlg, sizeof(rgbSpkiAlg) );
+	rgbKey[0] = 0;
+	rgbKey[1] = 4;
+	for ( i=2; i<(int)sizeof(rgbKey); i++ ) rgbKey[i] = (uint8_t) ( i * 37 );
+	cb = sizeof(rgbSpkiAlg) + DerPutTlv( rgbTmp + sizeof(rgbSpkiAlg), 0x03, rgbKey, sizeof(rgbKey) );
+	cbTbs += DerPutTlv( rgbTbs + cbTbs, 0x30, rgbTmp, cb );
+
+	for ( i=0; i<cDns; i++ ) cbTmp += DerPutString( rgbTmp + cbTmp, X509_SAN_DNS, rgpszDns[i] );
+	if ( NULL != pbIPv4 ) cbTmp += DerPutTlv( rgbTmp + cbTmp, X509_SAN_IP, pbIPv4, 4 );
+	if ( cbTmp > 0 )
+	{
+		cbTmp = DerPutTlv( rgbTmp, 0x30, rgbTmp, cbTmp );
+		cbExts += PutExtension( rgbExts + cbExts, g_rgbOidSAN, sizeof(g_rgbOidSAN), rgbTmp, cbTmp );
+	}
+	cbTmp  = DerPutTlv( rgbTmp, 0x06, ( fServerAuth ) ? rgbServerAuth : rgbClientAuth, sizeof(rgbServerAuth) );
+	cbTmp  = DerPutTlv( rgbTmp, 0x30, rgbTmp, cbTmp );
+	cbExts += PutExtension( rgbExts + cbExts, g_rgbOidEKU, sizeof(g_rgbOidEKU), rgbTmp, cbTmp );
+	cbExts += PutExtension( rgbExts + cbExts, g_rgbOidBasic, sizeof(g_rgbOidBasic), (const uint8_t*) "\x30\x00", 2 );
+	cbExts = DerPutTlv( rgbExts, 0x30, rgbExts, cbExts );
+	cbTbs += DerPutTlv( rgbTbs + cbTbs, 0xa3, rgbExts, cbExts );
+
+	cb = DerPutTlv( pb, 0x30, rgbTbs, cbTbs );
+	memcpy( pb + cb, rgbAlg, sizeof(rgbAlg) );
+	cb += sizeof(rgbAlg);
+	memset( rgbTmp, 0x5a, 257 );
+	rgbTmp[0] = 0;
+	cb += DerPutTlv( pb + cb, 0x03, rgbTmp, 257 );
+	return DerPutTlv( pb, 0x30, pb, cb );
+}
+
+//
+// Files
+//
+
+static void PrintCert( const X509_CERT* pCert, const char* pszHost )
+{
+	char szBuffer[512], szTime[32], szTime2[32];
+	X509_MATCH Match;
+	uint32_t i;
+
+	printf( "  Version %d, subject CN [%s]%s\n", pCert->iVersion,
+			X509SliceFormat( &pCert->SubjectCN, pCert->bSubjectCNTag, szBuffer, sizeof(szBuffer) ),
+			( pCert->cSubjectCNs > 1 ) ? " (last of several CNs)" : "" );
+	printf( "  Valid %s to %s UTC\n", DerTimeFormat( pCert->i64NotBefore, szTime, sizeof(szTime) ), DerTimeFormat( pCert->i64NotAfter, szTime2, sizeof(szTime2) ) );
+	printf( "  EKU %s%s\n", X509EkuFormat( pCert, szBuffer, sizeof(szBuffer) ), ( pCert->fCA ) ? ", CA" : "" );
+	printf( "  %u SANs (%u DNS, %u IP)\n", pCert->cSans, pCert->cDnsSans, pCert->cIpSans );
+	for ( i=0; i<pCert->cKeptSans; i++ ) printf( "    %s\n", X509SanFormat( &pCert->rgSans[i], szBuffer, sizeof(szBuffer) ) );
+	if ( NULL != pszHost )
+	{
+		X509MatchHostname( pCert, pszHost, &Match );
+		printf( "  %s: %s%s%s\n", pszHost, X509MatchName( Match.iResult ),
+				( Match.fCNIgnored ) ? " (the CN matches but is ignored because the certificate has SANs)" : "",
+				( Match.iResult != X509_MATCH_NONE && !X509IsServerAuth( pCert ) ) ? ", but the certificate is not valid for server authentication" : "" );
+	}
+}
+
+static size_t Base64Decode( const char* psz, const char* pszEnd, uint8_t* pb )
+{
+	uint32_t dwBits = 0;
+	int cBits = 0, iValue;
+	size_t cb = 0;
+
+	for ( ; psz < pszEnd; psz++ )
+	{
+		char c = *psz;
+		if ( c >= 'A' && c <= 'Z' ) iValue = c - 'A';
+		else if ( c >= 'a' && c <= 'z' ) iValue = c - 'a' + 26;
+		else if ( c >= '0' && c <= '9' ) iValue = c - '0' + 52;
+		else if ( '+' == c ) iValue = 62;
+		else if ( '/' == c ) iValue = 63;
+		else continue;
+		dwBits = ( dwBits << 6 ) | (uint32_t) iValue;
+		cBits += 6;
+		if ( cBits >= 8 )
+		{
+			cBits -= 8;
+			pb[cb++] = (uint8_t) ( dwBits >> cBits );
+		}
+	}
+	return cb;
+}
+
+static int ParseCertFile( const char* pszFile, const char* pszHost )
+{
+	static const char szBegin[] = "-----BEGIN CERTIFICATE-----";
+	static const char szEnd[]   = "-----END CERTIFICATE-----";
+	X509_CERT Cert;
+	uint8_t* pbFile;
+	uint8_t* pbDer;
+	long cbFile;
+	size_t cbDer;
+	const char* pszBegin;
+	const char* pszEnd;
+	int iError, cCerts = 0, fFailed = 0;
+	FILE* f = fopen( pszFile, "rb" );
+
+	if ( NULL == f )
+	{
+		fprintf( stderr, "Cannot open %s\n", pszFile );
+		return 1;
+	}
+	fseek( f, 0, SEEK_END );
+	cbFile = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	pbFile = (uint8_t*) malloc( (size_t) cbFile + 1 );
+	pbDer = (uint8_t*) malloc( (size_t) cbFile + 1 );
+	if ( NULL == pbFile || NULL == pbDer || 1 != fread( pbFile, (size_t) cbFile, 1, f ) )
+	{
+		fprintf( stderr, "Cannot read %s\n", pszFile );
+		fclose( f );
+		free( pbFile );
+		free( pbDer );
+		return 1;
+	}
+	fclose( f );
+	pbFile[cbFile] = 0;
+
+	printf( "%s\n", pszFile );
+	pszBegin = strstr( (const char*) pbFile, szBegin );
+	if ( NULL == pszBegin )
+	{
+		iError = X509Parse( pbFile, (size_t) cbFile, &Cert );
+		if ( X509_OK == iError ) PrintCert( &Cert, pszHost );
+		else printf( "  Not a certificate: %s\n", X509ErrorName( iError ) );
+		fFailed = ( X509_OK != iError );
+	}
+	for ( ; NULL != pszBegin; pszBegin = strstr( pszEnd, szBegin ) )
+	{
+		pszBegin += sizeof(szBegin) - 1;
+		pszEnd = strstr( pszBegin, szEnd );
+		if ( NULL == pszEnd ) break;
+		cbDer = Base64Decode( pszBegin, pszEnd, pbDer );
+		iError = X509Parse( pbDer, cbDer, &Cert );
+		printf( " Certificate %d\n", ++cCerts );
+		if ( X509_OK == iError ) PrintCert( &Cert, pszHost );
+		else printf( "  Not a certificate: %s\n", X509ErrorName( iError ) );
+		fFailed |= ( X509_OK != iError );
+	}
+
+	free( pbFile );
+	free( pbDer );
+	return fFailed;
+}
+
+//
+// Benchmark and fuzzer
+//
+
+static const char* g_rgpszBenchSans[] =
+{
+	"sqlprod01.contoso.com", "sqlprod01", "sqllistener.contoso.com", "*.sql.contoso.com",
+	"sqlprod02.contoso.com", "sqlprod03.contoso.com", "sqlprod04.contoso.com", "sqlprod05.contoso.com",
+};
+
+static int RunBenchmark( long cIterations )
+{
+	static uint8_t rgbCert[32768];
+	static const uint8_t rgbIP[4] = { 10, 1, 2, 3 };
+	X509_CERT Cert;
+	X509_MATCH Match;
+	uint64_t ui64Start;
+	double dParseMs, dMatchMs;
+	size_t cbCert;
+	long i, cMatches = 0;
+
+	cbCert = BuildTestCert( rgbCert, "sqlprod01.contoso.com", g_rgpszBenchSans, 8, rgbIP, 1 );
+
+	ui64Start = PerfCounter();
+	for ( i=0; i<cIterations; i++ )
+	{
+		if ( X509_OK != X509Parse( rgbCert, cbCert, &Cert ) ) return 1;
+	}
+	dParseMs = PerfElapsedMs( ui64Start );
+
+	// The last SAN and a miss are the worst cases, every SAN is compared.
+	ui64Start = PerfCounter();
+	for ( i=0; i<cIterations; i++ )
+	{
+		cMatches += ( X509_MATCH_NONE != X509MatchHostname( &Cert, ( i & 1 ) ? "sqlprod05.contoso.com" : "othersql.fabrikam.com", &Match ) );
+	}
+	dMatchMs = PerfElapsedMs( ui64Start );
+
+	printf( "Certificate of %u bytes with %u SANs, %ld iterations\n", (unsigned) cbCert, Cert.cSans, cIterations );
+	printf( "Parse: %.1f ns each, %.0f certificates/s\n", dParseMs * 1e6 / cIterations, cIterations / ( dParseMs / 1000.0 ) );
+	printf( "Match: %.1f ns each, %ld matched\n", dMatchMs * 1e6 / cIterations, cMatches );
+	return 0;
+}
+
+static uint32_t g_dwFuzzState = 0x2545f491;
+
+static uint32_t FuzzRandom()
+{
+	g_dwFuzzState ^= g_dwFuzzState << 13;
+	g_dwFuzzState ^= g_dwFuzzState >> 17;
+	g_dwFuzzState ^= g_dwFuzzState << 5;
+	return g_dwFuzzState;
+}
+
+static int SliceInside( const X509_SLICE* pSlice, const uint8_t* pb, size_t cb )
+{
+	return 0 == pSlice->cb || ( pSlice->pb >= pb && pSlice->pb + pSlice->cb <= pb + cb );
+}
+
+// Mutates a valid certificate and checks that the parser neither crashes nor returns slices
+// outside the input.  Build with -fsanitize=address,undefined to catch out of bounds reads.
+static int RunFuzzer( long cIterations, uint32_t dwSeed )
+{
+	static uint8_t rgbSeed[32768];
+	static const uint8_t rgbIP[4] = { 10, 1, 2, 3 };
+	long rgcResults[X509_ERR_LAST + 2] = { 0 };
+	X509_CERT Cert;
+	X509_MATCH Match;
+	X509_SLICE CN;
+	uint8_t bTag;
+	uint8_t* pb;
+	size_t cbSeed, cb;
+	uint32_t i, cMutations;
+	long n;
+	int iError;
+
+	if ( 0 != dwSeed ) g_dwFuzzState = dwSeed;
+	cbSeed = BuildTestCert( rgbSeed, "sqlprod01.contoso.com", g_rgpszBenchSans, 8, rgbIP, 1 );
+
+	for ( n=0; n<cIterations; n++ )
+	{
+		// A fresh heap block of the exact size, so ASan sees any read past the end.
+		cb = cbSeed;
+		if ( 0 == FuzzRandom() % 4 ) cb = FuzzRandom() % cbSeed;
+		pb = (uint8_t*) malloc( cb + 1 );
+		memcpy( pb, rgbSeed, cb );
+
+		cMutations = 1 + FuzzRandom() % 8;
+		for ( i=0; i<cMutations && cb > 0; i++ )
+		{
+			uint32_t iAt = FuzzRandom() % (uint32_t) cb;
+			switch ( FuzzRandom() % 4 )
+			{
+				case 0:  pb[iAt] ^= (uint8_t) ( 1 << ( FuzzRandom() % 8 ) ); break;
+				case 1:  pb[iAt] = (uint8_t) FuzzRandom(); break;
+				case 2:  pb[iAt] = ( FuzzRandom() & 1 ) ? 0x80 : 0xff; break;		// Length bytes
+				default: pb[iAt] = (uint8_t) ( pb[iAt] + 1 ); break;
+			}
+		}
+
+		iError = X509Parse( pb, cb, &Cert );
+		rgcResults[( iError >= 0 && iError <= X509_ERR_LAST ) ? iError : X509_ERR_LAST + 1]++;
+		if ( X509_OK == iError )
+		{
+			int fInside = SliceInside( &Cert.Tbs, pb, cb ) && SliceInside( &Cert.Subject, pb, cb ) && SliceInside( &Cert.SubjectCN, pb, cb );
+			for ( i=0; i<Cert.cKeptSans; i++ ) fInside &= SliceInside( &Cert.rgSans[i].Value, pb, cb );
+			if ( !fInside )
+			{
+				fprintf( stderr, "Iteration %ld: slice outside the input\n", n );
+				free( pb );
+				return 1;
+			}
+			X509MatchHostname( &Cert, "sqlprod01.contoso.com", &Match );
+			X509MatchHostname( &Cert, "x.sql.contoso.com", &Match );
+			X509MatchHostname( &Cert, "10.1.2.3", &Match );
+		}
+		X509ParseName( pb, cb, &CN, &bTag );
+		free( pb );
+	}
+
+	printf( "%ld mutated certificates:", cIterations );
+	for ( i=0; i<=X509_ERR_LAST; i++ ) printf( " %s %ld%s", X509ErrorName( (int) i ), rgcResults[i], ( i < X509_ERR_LAST ) ? "," : "\n" );
+	return 0;
+}
+
+//
+// Matching rules
+//
+
+typedef struct _MATCH_CASE
+{
+	const char* pszCN;
+	const char* rgpszDns[3];
+	int         fIP;				// Adds IP SAN 10.1.2.3
+	const char* pszHost;
+	int         iExpected;
+} MATCH_CASE;
+
+static const MATCH_CASE g_rgMatchCases[] =
+{
+	{ "sqlprod01.contoso.com", { "sqlprod01.contoso.com" },        0, "sqlprod01.contoso.com",   X509_MATCH_DNS },
+	{ "sqlprod01.contoso.com", { "sqlprod01.contoso.com" },        0, "SQLPROD01.Contoso.COM.",  X509_MATCH_DNS },
+	{ "sqlprod01.contoso.com", { "sqlprod01.contoso.com" },        0, "prod01.contoso.com",      X509_MATCH_NONE },	// Substring
+	{ "sqlprod01.contoso.com", { "sqlprod01.contoso.com" },        0, "sqlprod01.contoso.co",    X509_MATCH_NONE },
+	{ "sqlprod01.contoso.com", { "other.contoso.com" },            0, "sqlprod01.contoso.com",   X509_MATCH_NONE },	// CN ignored
+	{ "sqlprod01.contoso.com", { NULL },                           0, "sqlprod01.contoso.com",   X509_MATCH_CN },
+	{ "sqlprod01.contoso.com", { NULL },                           0, "sqlprod01",               X509_MATCH_NONE },
+	{ "x",                     { "*.sql.contoso.com" },            0, "a.sql.contoso.com",       X509_MATCH_WILDCARD },
+	{ "x",                     { "*.sql.contoso.com" },            0, "sql.contoso.com",         X509_MATCH_NONE },
+	{ "x",                     { "*.sql.contoso.com" },            0, "a.b.sql.contoso.com",     X509_MATCH_NONE },
+	{ "x",                     { "*.com" },                        0, "contoso.com",             X509_MATCH_NONE },
+	{ "x",                     { "s*.contoso.com" },               0, "sqlprod01.contoso.com",   X509_MATCH_NONE },
+	{ "x",                     { "*" },                            0, "sqlprod01",               X509_MATCH_NONE },
+	{ "*.contoso.com",         { NULL },                           0, "sqlprod01.contoso.com",   X509_MATCH_CN },
+	{ "x",                     { "sqlprod01", "sqlprod01.contoso.com" }, 0, "sqlprod01",         X509_MATCH_DNS },
+	{ "x",                     { "sqlprod01.contoso.com" },        1, "10.1.2.3",                X509_MATCH_IP },
+	{ "x",                     { "sqlprod01.contoso.com" },        1, "10.1.2.4",                X509_MATCH_NONE },
+	{ "10.1.2.3",              { "sqlprod01.contoso.com" },        0, "10.1.2.3",                X509_MATCH_NONE },
+	{ "10.1.2.3",              { NULL },                           0, "10.1.2.3",                X509_MATCH_CN },
+	{ "x",                     { "*.contoso.com" },                1, "10.1.2.3",                X509_MATCH_IP },
+	{ "x",                     { "sqlprod01.contoso.com" },        0, "sql prod.contoso.com",    X509_MATCH_BAD_HOST },
+	{ "x",                     { "sqlprod01.contoso.com" },        0, "sqlprod01..contoso.com",  X509_MATCH_BAD_HOST },
+};
+
+static int RunChecks()
+{
+	static uint8_t rgbCert[32768];
+	static const uint8_t rgbIP[4] = { 10, 1, 2, 3 };
+	static const uint8_t rgbV6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+	static const char szCNWithNul[] = "sqlprod01.contoso.com\0.evil.com";
+	X509_CERT Cert;
+	X509_MATCH Match;
+	X509_SAN San;
+	uint8_t rgbParsed[16];
+	size_t cbCert;
+	int i, cDns, cFailed = 0, iError;
+	const int cCases = (int) ( sizeof(g_rgMatchCases) / sizeof(g_rgMatchCases[0]) );
+
+	for ( i=0; i<cCases; i++ )
+	{
+		const MATCH_CASE* pCase = &g_rgMatchCases[i];
+		for ( cDns=0; cDns<3 && NULL != pCase->rgpszDns[cDns]; cDns++ );
+		cbCert = BuildTestCert( rgbCert, pCase->pszCN, (const char**) pCase->rgpszDns, cDns, ( pCase->fIP ) ? rgbIP : NULL, 1 );
+		iError = X509Parse( rgbCert, cbCert, &Cert );
+		if ( X509_OK != iError )
+		{
+			printf( "FAIL case %d: parse error %s\n", i, X509ErrorName( iError ) );
+			cFailed++;
+			continue;
+		}
+		X509MatchHostname( &Cert, pCase->pszHost, &Match );
+		if ( Match.iResult != pCase->iExpected )
+		{
+			printf( "FAIL case %d: %s against CN %s: %s, expected %s\n", i, pCase->pszHost, pCase->pszCN,
+					X509MatchName( Match.iResult ), X509MatchName( pCase->iExpected ) );
+			cFailed++;
+		}
+	}
+
+	// IPv6 host forms, and a CN with an embedded NUL that a C string compare would accept.
+	San.bType = X509_SAN_IP;
+	San.Value.pb = rgbV6;
+	San.Value.cb = 16;
+	memset( &Cert, 0, sizeof(Cert) );
+	Cert.rgSans[0] = San;
+	Cert.cKeptSans = Cert.cSans = Cert.cIpSans = 1;
+	if ( X509_MATCH_IP != X509MatchHostname( &Cert, "[2001:DB8::1]", &Match ) ||
+		 X509_MATCH_IP != X509MatchHostname( &Cert, "2001:db8:0:0:0:0:0.0.0.1", &Match ) ||
+		 X509_MATCH_BAD_HOST != X509MatchHostname( &Cert, "2001:db8:::1", &Match ) ||
+		 !ParseIPv6( "::", rgbParsed ) || ParseIPv6( "1:2:3:4:5:6:7:8:9", rgbParsed ) )
+	{
+		printf( "FAIL IPv6 host parsing\n" );
+		cFailed++;
+	}
+	memset( &Cert, 0, sizeof(Cert) );
+	Cert.SubjectCN.pb = (const uint8_t*) szCNWithNul;
+	Cert.SubjectCN.cb = sizeof(szCNWithNul) - 1;
+	Cert.bSubjectCNTag = 0x0c;
+	if ( X509_MATCH_NONE != X509MatchHostname( &Cert, "sqlprod01.contoso.com", &Match ) )
+	{
+		printf( "FAIL CN with embedded NUL matched\n" );
+		cFailed++;
+	}
+
+	printf( "%d matching checks, %d failed\n", cCases + 2, cFailed );
+	return ( cFailed > 0 ) ? 1 : 0;
+}
+
+static void Usage()
+{
+	fprintf( stderr, "Usage: x509parse [-h host] file...  parse DER or PEM certificates\n" );
+	fprintf( stderr, "       x509parse -bench [iterations]\n" );
+	fprintf( stderr, "       x509parse -fuzz [iterations] [seed]\n" );
+	fprintf( stderr, "       x509parse -check\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+	const char* pszHost = NULL;
+	int i, iResult = 0;
+
+	if ( argc < 2 )
+	{
+		Usage();
+		return 2;
+	}
+	if ( 0 == strcmp( argv[1], "-bench" ) ) return RunBenchmark( ( argc > 2 ) ? atol( argv[2] ) : 1000000 );
+	if ( 0 == strcmp( argv[1], "-fuzz" ) ) return RunFuzzer( ( argc > 2 ) ? atol( argv[2] ) : 100000, ( argc > 3 ) ? (uint32_t) strtoul( argv[3], NULL, 0 ) : 0 );
+	if ( 0 == strcmp( argv[1], "-check" ) ) return RunChecks();
+
+	for ( i=1; i<argc; i++ )
+	{
+		if ( 0 == strcmp( argv[i], "-h" ) && i + 1 < argc )
+		{
+			pszHost = argv[++i];
+			continue;
+		}
+		iResult |= ParseCertFile( argv[i], pszHost );
+	}
+	return iResult;
+}
+
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+
+// DER X.509 certificate parser and RFC 6125 server name matching.  The parser does not copy or
+// allocate: every field is a slice into the caller's buffer, which must outlive the X509_CERT.
+// It reads only what the name check needs (subject CN, SANs, EKUs, basic constraints and
+// validity), see DerCodec.h for how strict it is about the encoding.
+
+#include "DerCodec.h"
+
+#define X509_MAX_SANS			64		// DNS and IP SANs kept, more are only counted
+#define X509_MAX_NAME			256		// Longest DNS name or CN that can match
+
+// Parse results, the DER reader's plus X509_ERR_EXTENSION.
+#define X509_OK					DER_OK
+#define X509_ERR_TRUNCATED		DER_ERR_TRUNCATED
+#define X509_ERR_LENGTH			DER_ERR_LENGTH
+#define X509_ERR_TAG			DER_ERR_TAG
+#define X509_ERR_TIME			DER_ERR_TIME
+#define X509_ERR_TRAILING		DER_ERR_TRAILING
+#define X509_ERR_EXTENSION		( DER_ERR_LAST + 1 )	// Malformed or duplicate extension
+#define X509_ERR_LAST			X509_ERR_EXTENSION
+
+// GeneralName tags of the SANs that are kept.
+#define X509_SAN_DNS			0x82
+#define X509_SAN_IP				0x87
+
+// Extended key usages, X509_CERT.dwEku.
+#define X509_EKU_SERVER_AUTH	0x0001
+#define X509_EKU_CLIENT_AUTH	0x0002
+#define X509_EKU_CODE_SIGNING	0x0004
+#define X509_EKU_EMAIL			0x0008
+#define X509_EKU_TIME_STAMPING	0x0010
+#define X509_EKU_OCSP_SIGNING	0x0020
+#define X509_EKU_ANY			0x0040
+#define X509_EKU_OTHER			0x8000
+
+// Hostname match results.
+#define X509_MATCH_NONE			0
+#define X509_MATCH_DNS			1		// DNS SAN, exact
+#define X509_MATCH_WILDCARD		2		// DNS SAN, *.domain
+#define X509_MATCH_IP			3		// IP address SAN
+#define X509_MATCH_CN			4		// Subject CN, only used when the certificate has no DNS SAN
+#define X509_MATCH_BAD_HOST		5		// The host name itself is not valid
+
+typedef DER_SLICE X509_SLICE;
+
+typedef struct _X509_SAN
+{
+	uint8_t    bType;				// X509_SAN_DNS or X509_SAN_IP
+	X509_SLICE Value;
+} X509_SAN;
+
+typedef struct _X509_CERT
+{
+	X509_SLICE Tbs;					// Whole TBSCertificate, tag and length included
+	X509_SLICE Serial;
+	X509_SLICE Issuer;				// Name contents
+	X509_SLICE Subject;
+	X509_SLICE SubjectCN;			// Last CN of the subject, empty if none
+	uint8_t    bSubjectCNTag;		// String type of SubjectCN (UTF8String, BMPString, ...)
+	uint32_t   cSubjectCNs;
+	int        iVersion;			// 1, 2 or 3
+	int64_t    i64NotBefore;		// Seconds since 1970-01-01 UTC
+	int64_t    i64NotAfter;
+	uint32_t   cSans;				// All SANs, may exceed X509_MAX_SANS
+	uint32_t   cDnsSans;
+	uint32_t   cIpSans;
+	uint32_t   cKeptSans;
+	X509_SAN   rgSans[X509_MAX_SANS];
+	int        fEkuPresent;			// No EKU extension means any usage
+	uint32_t   dwEku;
+	int        fBasicConstraints;
+	int        fCA;
+} X509_CERT;
+
+typedef struct _X509_MATCH
+{
+	int iResult;					// X509_MATCH_*
+	int iSan;						// Index in rgSans of the matching SAN, -1 if none
+	int fCNIgnored;					// The CN matches but DNS SANs are present, so it does not count
+} X509_MATCH;
+
+int X509Parse( const uint8_t* pb, size_t cb, X509_CERT* pCert );
+int X509ParseName( const uint8_t* pb, size_t cb, X509_SLICE* pCN, uint8_t* pbCNTag );
+int X509MatchHostname( const X509_CERT* pCert, const char* pszHost, X509_MATCH* pMatch );
+int X509MatchCN( const X509_SLICE* pCN, uint8_t bCNTag, const char* pszHost );
+int X509IsServerAuth( const X509_CERT* pCert );
+
+const char* X509ErrorName( int iError );
+const char* X509MatchName( int iResult );
+char* X509SliceFormat( const X509_SLICE* pSlice, uint8_t bTag, char* pszBuffer, size_t cchBuffer );
+char* X509SanFormat( const X509_SAN* pSan, char* pszBuffer, size_t cchBuffer );
+char* X509EkuFormat( const X509_CERT* pCert, char* pszBuffer, size_t cchBuffer );
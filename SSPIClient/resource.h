@@ -13,6 +13,9 @@
 #define IDC_EDT_USERID                  1007
 #define IDC_EDT_PASSWORD                1008
 #define IDC_CHECK2                      1009
+#define IDC_EDT_OPTIONS                 1010
+#define IDC_CMB_TEST                    1011
+#define IDC_BTN_RUNTEST                 1012
 
 // Next default values for new objects
 // 
@@ -20,7 +23,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        129
 #define _APS_NEXT_COMMAND_VALUE         32771
-#define _APS_NEXT_CONTROL_VALUE         1008
+#define _APS_NEXT_CONTROL_VALUE         1013
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif